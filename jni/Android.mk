@@ -6,26 +6,41 @@ LOCAL_CFLAGS := -Wall -Werror
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../src
 LOCAL_SRC_FILES :=		\
 	../src/base64.c		\
+	../src/bpf.c		\
 	../src/conf.c		\
 	../src/conf_argv.c	\
 	../src/conf_file.c	\
 	../src/event.c		\
+	../src/filter.c		\
+	../src/flow.c		\
+	../src/gf256.c		\
+	../src/hdlc.c		\
+	../src/http.c		\
 	../src/io.c		\
 	../src/list.c		\
 	../src/log.c		\
+	../src/lpm.c		\
 	../src/memory.c		\
 	../src/misc.c		\
 	../src/module.c		\
 	../src/mutex.c		\
 	../src/packet.c		\
+	../src/peers.c		\
 	../src/queue.c		\
 	../src/pipeline.c	\
+	../src/ppp.c		\
+	../src/rtt.c		\
 	../src/sem.c		\
+	../src/siphash.c	\
+	../src/splice.c		\
 	../src/thread.c		\
 	../src/pppoat.c		\
 	../src/modules/if_fd.c	\
 	../src/modules/if_pppd.c\
 	../src/modules/if_tun.c	\
+	../src/modules/pl_arq.c	\
+	../src/modules/pl_fec.c	\
+	../src/modules/pl_frag.c\
 	../src/modules/tp_udp.c
 
 include $(BUILD_EXECUTABLE)
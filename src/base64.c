@@ -147,6 +147,73 @@ bool pppoat_base64_is_valid(const char *base64, size_t len)
 	return valid;
 }
 
+/** Returns value of the base64 character or -1. */
+static int base64_value(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+void pppoat_base64_decoder_init(struct pppoat_base64_decoder *dec)
+{
+	dec->bd_acc = 0;
+	dec->bd_nr  = 0;
+	dec->bd_pad = 0;
+}
+
+int pppoat_base64_decoder_update(struct pppoat_base64_decoder *dec,
+				 const char                   *base64,
+				 size_t                        len,
+				 void                         *result,
+				 size_t                       *result_len)
+{
+	unsigned char *p = result;
+	size_t         i;
+	int            t;
+
+	for (i = 0; i < len; ++i) {
+		if (base64[i] == '=') {
+			/* At most two padding characters end a quantum. */
+			if (dec->bd_nr < 2 || ++dec->bd_pad > 2)
+				return P_ERR(-EINVAL);
+			t = 0;
+		} else {
+			t = base64_value(base64[i]);
+			if (t < 0 || dec->bd_pad > 0)
+				return P_ERR(-EINVAL);
+		}
+		dec->bd_acc = dec->bd_acc << 6 | (uint32_t)t;
+		if (++dec->bd_nr < 4)
+			continue;
+
+		*p++ = (unsigned char)(dec->bd_acc >> 16);
+		if (dec->bd_pad < 2)
+			*p++ = (unsigned char)(dec->bd_acc >> 8);
+		if (dec->bd_pad < 1)
+			*p++ = (unsigned char)dec->bd_acc;
+		dec->bd_acc = 0;
+		dec->bd_nr  = 0;
+		/* Keep bd_pad, so nothing is accepted after padding. */
+	}
+	*result_len = (size_t)(p - (unsigned char *)result);
+
+	return 0;
+}
+
+int pppoat_base64_decoder_final(struct pppoat_base64_decoder *dec)
+{
+	return dec->bd_nr == 0 ? 0 : -EINVAL;
+}
+
 int pppoat_base64_enc_new(const void *buf,
 			  size_t      len,
 			  char      **result)
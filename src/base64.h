@@ -22,6 +22,7 @@
 
 #include <stdbool.h>	/* bool */
 #include <stddef.h>	/* size_t */
+#include <stdint.h>
 
 size_t pppoat_base64_enc_len(const void *buf, size_t len);
 size_t pppoat_base64_dec_len(const char *base64, size_t len);
@@ -42,4 +43,27 @@ int pppoat_base64_dec_new(const char     *base64,
 			  size_t         *result_len);
 bool pppoat_base64_is_valid(const char *base64, size_t len);
 
+/** Decoder for input which is split at arbitrary positions. */
+struct pppoat_base64_decoder {
+	uint32_t bd_acc;
+	unsigned bd_nr;
+	/** Padding characters seen, only padding may follow. */
+	unsigned bd_pad;
+};
+
+void pppoat_base64_decoder_init(struct pppoat_base64_decoder *dec);
+/**
+ * Decodes the next part of input. `result' must fit (len + 3) / 4 * 3
+ * bytes, `result_len' is set to the number of decoded bytes.
+ *
+ * @return 0 or -EINVAL if the input is not base64.
+ */
+int pppoat_base64_decoder_update(struct pppoat_base64_decoder *dec,
+				 const char                   *base64,
+				 size_t                        len,
+				 void                         *result,
+				 size_t                       *result_len);
+/** @return 0 if the input ends on a quantum boundary, -EINVAL otherwise. */
+int pppoat_base64_decoder_final(struct pppoat_base64_decoder *dec);
+
 #endif /* __PPPOAT_BASE64_H__ */
@@ -0,0 +1,332 @@
+/* bpf.c
+ * PPP over Any Transport -- eBPF helpers
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "trace.h"
+
+#include "bpf.h"
+#include "filter.h"
+#include "memory.h"
+
+#include <errno.h>
+#include <string.h>	/* memset */
+#include <unistd.h>	/* syscall */
+
+#ifdef __linux__
+#include <sys/syscall.h>	/* __NR_bpf */
+#endif
+
+#if defined(__linux__) && defined(__NR_bpf)
+
+enum {
+	BPF_LOG_SIZE = 64 * 1024,
+};
+
+static int bpf_sys(int cmd, union bpf_attr *attr)
+{
+	long rc;
+
+	rc = syscall(__NR_bpf, cmd, attr, sizeof *attr);
+	return rc < 0 ? -errno : (int)rc;
+}
+
+static uint64_t bpf_ptr(const void *ptr)
+{
+	return (uint64_t)(uintptr_t)ptr;
+}
+
+int pppoat_bpf_map_create(unsigned  type,
+			  size_t    key_size,
+			  size_t    value_size,
+			  size_t    max_entries,
+			  int      *fd)
+{
+	union bpf_attr attr;
+	int            rc;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_type    = type;
+	attr.key_size    = key_size;
+	attr.value_size  = value_size;
+	attr.max_entries = max_entries;
+
+	rc = bpf_sys(BPF_MAP_CREATE, &attr);
+	if (rc >= 0)
+		*fd = rc;
+
+	return rc < 0 ? P_ERR(rc) : 0;
+}
+
+int pppoat_bpf_map_update(int fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+	int            rc;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = fd;
+	attr.key    = bpf_ptr(key);
+	attr.value  = bpf_ptr(value);
+	attr.flags  = BPF_ANY;
+
+	rc = bpf_sys(BPF_MAP_UPDATE_ELEM, &attr);
+	return rc < 0 ? P_ERR(rc) : 0;
+}
+
+int pppoat_bpf_map_delete(int fd, const void *key)
+{
+	union bpf_attr attr;
+	int            rc;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = fd;
+	attr.key    = bpf_ptr(key);
+
+	rc = bpf_sys(BPF_MAP_DELETE_ELEM, &attr);
+	return rc < 0 && rc != -ENOENT ? P_ERR(rc) : 0;
+}
+
+int pppoat_bpf_prog_load(unsigned               type,
+			 const struct bpf_insn *insns,
+			 size_t                 nr,
+			 int                   *fd)
+{
+	union bpf_attr  attr;
+	char           *log;
+	int             rc;
+
+	memset(&attr, 0, sizeof attr);
+	attr.prog_type = type;
+	attr.insns     = bpf_ptr(insns);
+	attr.insn_cnt  = nr;
+	attr.license   = bpf_ptr("GPL");
+
+	rc = bpf_sys(BPF_PROG_LOAD, &attr);
+	if (rc == -EACCES || rc == -EINVAL) {
+		/* Load again with the verifier log for diagnostics. */
+		log = pppoat_alloc(BPF_LOG_SIZE);
+		if (log != NULL) {
+			log[0] = '\0';
+			attr.log_buf   = bpf_ptr(log);
+			attr.log_size  = BPF_LOG_SIZE;
+			attr.log_level = 1;
+			rc = bpf_sys(BPF_PROG_LOAD, &attr);
+			if (rc < 0)
+				pppoat_debug("bpf", "Verifier log:\n%s", log);
+			pppoat_free(log);
+		}
+	}
+	if (rc >= 0)
+		*fd = rc;
+
+	return rc < 0 ? P_ERR(rc) : 0;
+}
+
+enum {
+	/** The most instructions which one classic instruction takes. */
+	BPF_FILTER_EXPAND = 6,
+};
+
+/**
+ * Translates the classic instructions which the filter compiler emits.
+ * Like the kernel does internally: r0 is A, r7 is X, r6 keeps the context
+ * for the legacy packet loads. Jumps are fixed up after all instructions
+ * are in place, `targets' keeps the classic target of every jump.
+ */
+static int bpf_filter_translate(const struct pppoat_filter *filter,
+				struct bpf_insn            *out,
+				size_t                     *map,
+				size_t                     *targets,
+				size_t                     *nr)
+{
+	const struct pppoat_filter_insn *fi;
+	struct bpf_insn                 *insn;
+	size_t                           n = 0;
+	size_t                           i;
+	uint32_t                         k;
+	int                              op;
+
+	out[n++] = PPPOAT_BPF_MOV64_REG(BPF_REG_6, BPF_REG_1);
+	out[n++] = PPPOAT_BPF_MOV32_IMM(BPF_REG_0, 0);
+	out[n++] = PPPOAT_BPF_MOV32_IMM(BPF_REG_7, 0);
+	for (i = 0; i < filter->f_nr; ++i) {
+		fi = &filter->f_insns[i];
+		k  = fi->fi_k;
+		map[i] = n;
+		switch (BPF_CLASS(fi->fi_code)) {
+		case BPF_LD:
+			if (BPF_MODE(fi->fi_code) == BPF_ABS)
+				out[n++] = PPPOAT_BPF_LD_ABS(
+						BPF_SIZE(fi->fi_code), k);
+			else if (BPF_MODE(fi->fi_code) == BPF_IND)
+				out[n++] = PPPOAT_BPF_LD_IND(
+						BPF_SIZE(fi->fi_code),
+						BPF_REG_7, k);
+			else
+				return P_ERR(-EINVAL);
+			break;
+		case BPF_LDX:
+			if (fi->fi_code != (BPF_LDX | BPF_B | BPF_MSH))
+				return P_ERR(-EINVAL);
+			out[n++] = PPPOAT_BPF_MOV64_REG(BPF_REG_8, BPF_REG_0);
+			out[n++] = PPPOAT_BPF_LD_ABS(BPF_B, k);
+			out[n++] = PPPOAT_BPF_ALU32_IMM(BPF_AND, BPF_REG_0,
+							0xf);
+			out[n++] = PPPOAT_BPF_ALU32_IMM(BPF_LSH, BPF_REG_0, 2);
+			out[n++] = PPPOAT_BPF_MOV64_REG(BPF_REG_7, BPF_REG_0);
+			out[n++] = PPPOAT_BPF_MOV64_REG(BPF_REG_0, BPF_REG_8);
+			break;
+		case BPF_ALU:
+			if (BPF_SRC(fi->fi_code) != BPF_K)
+				return P_ERR(-EINVAL);
+			out[n++] = PPPOAT_BPF_ALU32_IMM(BPF_OP(fi->fi_code),
+							BPF_REG_0, k);
+			break;
+		case BPF_JMP:
+			op = BPF_OP(fi->fi_code);
+			if (op == BPF_JA) {
+				targets[n] = i + 1 + k;
+				out[n++] = PPPOAT_BPF_JA(0);
+				break;
+			}
+			if (BPF_SRC(fi->fi_code) != BPF_K)
+				return P_ERR(-EINVAL);
+			/* Immediates are sign extended, compare with r9. */
+			out[n++] = PPPOAT_BPF_MOV32_IMM(BPF_REG_9, k);
+			targets[n] = i + 1 + fi->fi_jt;
+			out[n++] = PPPOAT_BPF_JMP_REG(op, BPF_REG_0,
+						      BPF_REG_9, 0);
+			if (fi->fi_jf != 0) {
+				targets[n] = i + 1 + fi->fi_jf;
+				out[n++] = PPPOAT_BPF_JA(0);
+			}
+			break;
+		case BPF_RET:
+			if (fi->fi_code != (BPF_RET | BPF_K))
+				return P_ERR(-EINVAL);
+			out[n++] = PPPOAT_BPF_MOV32_IMM(BPF_REG_0, k);
+			out[n++] = PPPOAT_BPF_EXIT();
+			break;
+		default:
+			return P_ERR(-EINVAL);
+		}
+	}
+	map[filter->f_nr] = n;
+
+	for (i = 0; i < n; ++i) {
+		insn = &out[i];
+		if (BPF_CLASS(insn->code) != BPF_JMP ||
+		    BPF_OP(insn->code) == BPF_EXIT)
+			continue;
+		if (targets[i] > filter->f_nr)
+			return P_ERR(-EINVAL);
+		insn->off = (int16_t)(map[targets[i]] - i - 1);
+	}
+	*nr = n;
+
+	return 0;
+}
+
+int pppoat_bpf_prog_load_filter(const struct pppoat_filter *filter, int *fd)
+{
+	struct bpf_insn *insns;
+	size_t          *map;
+	size_t          *targets;
+	size_t           max = filter->f_nr * BPF_FILTER_EXPAND + 3;
+	size_t           nr;
+	int              rc;
+
+	insns   = pppoat_alloc(max * sizeof *insns);
+	map     = pppoat_alloc((filter->f_nr + 1) * sizeof *map);
+	targets = pppoat_alloc(max * sizeof *targets);
+	rc = insns == NULL || map == NULL || targets == NULL ?
+	     P_ERR(-ENOMEM) : 0;
+	rc = rc ?: bpf_filter_translate(filter, insns, map, targets, &nr);
+	rc = rc ?: pppoat_bpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER, insns,
+					nr, fd);
+	pppoat_free(targets);
+	pppoat_free(map);
+	pppoat_free(insns);
+
+	return rc;
+}
+
+int pppoat_bpf_xdp_attach(int prog_fd, int ifindex, uint32_t flags,
+			  int *link_fd)
+{
+#if HAVE_DECL_BPF_LINK_CREATE
+	union bpf_attr attr;
+	int            rc;
+
+	memset(&attr, 0, sizeof attr);
+	attr.link_create.prog_fd        = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type    = BPF_XDP;
+	attr.link_create.flags          = flags;
+
+	rc = bpf_sys(BPF_LINK_CREATE, &attr);
+	if (rc >= 0)
+		*link_fd = rc;
+
+	return rc < 0 ? P_ERR(rc) : 0;
+#else /* HAVE_DECL_BPF_LINK_CREATE */
+	return P_ERR(-ENOSYS);
+#endif /* HAVE_DECL_BPF_LINK_CREATE */
+}
+
+#else /* __linux__ && __NR_bpf */
+
+int pppoat_bpf_map_create(unsigned  type,
+			  size_t    key_size,
+			  size_t    value_size,
+			  size_t    max_entries,
+			  int      *fd)
+{
+	return P_ERR(-ENOSYS);
+}
+
+int pppoat_bpf_map_update(int fd, const void *key, const void *value)
+{
+	return P_ERR(-ENOSYS);
+}
+
+int pppoat_bpf_map_delete(int fd, const void *key)
+{
+	return P_ERR(-ENOSYS);
+}
+
+int pppoat_bpf_prog_load(unsigned               type,
+			 const struct bpf_insn *insns,
+			 size_t                 nr,
+			 int                   *fd)
+{
+	return P_ERR(-ENOSYS);
+}
+
+int pppoat_bpf_prog_load_filter(const struct pppoat_filter *filter, int *fd)
+{
+	return P_ERR(-ENOSYS);
+}
+
+int pppoat_bpf_xdp_attach(int prog_fd, int ifindex, uint32_t flags,
+			  int *link_fd)
+{
+	return P_ERR(-ENOSYS);
+}
+
+#endif /* __linux__ && __NR_bpf */
@@ -0,0 +1,115 @@
+/* bpf.h
+ * PPP over Any Transport -- eBPF helpers
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_BPF_H__
+#define __PPPOAT_BPF_H__
+
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/bpf.h>
+#endif
+
+/**
+ * Thin wrappers around the bpf(2) syscall. Modules assemble their small
+ * programs with the instruction macros below, so pppoat doesn't depend on
+ * libbpf or a BPF compiler. All functions return -ENOSYS on systems
+ * without eBPF.
+ */
+
+struct bpf_insn;
+struct pppoat_filter;
+
+int pppoat_bpf_map_create(unsigned  type,
+			  size_t    key_size,
+			  size_t    value_size,
+			  size_t    max_entries,
+			  int      *fd);
+int pppoat_bpf_map_update(int fd, const void *key, const void *value);
+int pppoat_bpf_map_delete(int fd, const void *key);
+
+/**
+ * Loads a program of the given type. The verifier log is printed with
+ * debug level when the kernel rejects the program.
+ */
+int pppoat_bpf_prog_load(unsigned               type,
+			 const struct bpf_insn *insns,
+			 size_t                 nr,
+			 int                   *fd);
+
+/**
+ * Translates a classic BPF filter, see filter.h, to eBPF and loads it as a
+ * socket filter. Some interfaces accept only eBPF programs.
+ */
+int pppoat_bpf_prog_load_filter(const struct pppoat_filter *filter, int *fd);
+
+/**
+ * Attaches an XDP program to the interface with a BPF link. The program
+ * is detached when the link is closed, including when the process dies.
+ * `flags' are XDP_FLAGS_* from <linux/if_link.h>.
+ */
+int pppoat_bpf_xdp_attach(int prog_fd, int ifindex, uint32_t flags,
+			  int *link_fd);
+
+#ifdef __linux__
+
+#define PPPOAT_BPF_INSN(c, d, s, o, i)				\
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s),\
+			    .off = (o), .imm = (i) })
+
+#define PPPOAT_BPF_LD_ABS(size, imm)					\
+	PPPOAT_BPF_INSN(BPF_LD | BPF_ABS | (size), 0, 0, 0, imm)
+#define PPPOAT_BPF_LD_IND(size, src, imm)				\
+	PPPOAT_BPF_INSN(BPF_LD | BPF_IND | (size), 0, src, 0, imm)
+#define PPPOAT_BPF_LDX_MEM(size, dst, src, off)			\
+	PPPOAT_BPF_INSN(BPF_LDX | BPF_MEM | (size), dst, src, off, 0)
+#define PPPOAT_BPF_ALU32_IMM(op, dst, imm)				\
+	PPPOAT_BPF_INSN(BPF_ALU | BPF_K | (op), dst, 0, 0, imm)
+#define PPPOAT_BPF_ALU64_IMM(op, dst, imm)				\
+	PPPOAT_BPF_INSN(BPF_ALU64 | BPF_K | (op), dst, 0, 0, imm)
+#define PPPOAT_BPF_ALU64_REG(op, dst, src)				\
+	PPPOAT_BPF_INSN(BPF_ALU64 | BPF_X | (op), dst, src, 0, 0)
+#define PPPOAT_BPF_MOV64_IMM(dst, imm)					\
+	PPPOAT_BPF_ALU64_IMM(BPF_MOV, dst, imm)
+#define PPPOAT_BPF_MOV32_IMM(dst, imm)					\
+	PPPOAT_BPF_ALU32_IMM(BPF_MOV, dst, imm)
+#define PPPOAT_BPF_MOV64_REG(dst, src)					\
+	PPPOAT_BPF_ALU64_REG(BPF_MOV, dst, src)
+#define PPPOAT_BPF_JA(off)						\
+	PPPOAT_BPF_INSN(BPF_JMP | BPF_JA, 0, 0, off, 0)
+#define PPPOAT_BPF_JMP_IMM(op, dst, imm, off)				\
+	PPPOAT_BPF_INSN(BPF_JMP | BPF_K | (op), dst, 0, off, imm)
+#define PPPOAT_BPF_JMP_REG(op, dst, src, off)				\
+	PPPOAT_BPF_INSN(BPF_JMP | BPF_X | (op), dst, src, off, 0)
+#define PPPOAT_BPF_JMP32_IMM(op, dst, imm, off)			\
+	PPPOAT_BPF_INSN(BPF_JMP32 | BPF_K | (op), dst, 0, off, imm)
+#define PPPOAT_BPF_CALL(func)						\
+	PPPOAT_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, func)
+#define PPPOAT_BPF_EXIT()						\
+	PPPOAT_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+/** Takes two instructions. */
+#define PPPOAT_BPF_LD_MAP_FD(dst, fd)					\
+	PPPOAT_BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, dst,		\
+			BPF_PSEUDO_MAP_FD, 0, fd),			\
+	PPPOAT_BPF_INSN(0, 0, 0, 0, 0)
+
+#endif /* __linux__ */
+
+#endif /* __PPPOAT_BPF_H__ */
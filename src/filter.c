@@ -0,0 +1,574 @@
+/* filter.c
+ * PPP over Any Transport -- Packet filters
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "filter.h"
+#include "memory.h"
+#include "misc.h"
+
+#include <ctype.h>	/* isalnum, isdigit, isspace */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>	/* strtoul */
+#include <string.h>	/* memcpy */
+
+/* Classic BPF opcodes, the values are the same on every system. */
+enum {
+	FILTER_LD   = 0x00,
+	FILTER_LDX  = 0x01,
+	FILTER_ALU  = 0x04,
+	FILTER_JMP  = 0x05,
+	FILTER_RET  = 0x06,
+	FILTER_W    = 0x00,
+	FILTER_H    = 0x08,
+	FILTER_B    = 0x10,
+	FILTER_ABS  = 0x20,
+	FILTER_IND  = 0x40,
+	FILTER_MSH  = 0xa0,
+	FILTER_AND  = 0x50,
+	FILTER_JA   = 0x00,
+	FILTER_JEQ  = 0x10,
+	FILTER_JSET = 0x40,
+	FILTER_K    = 0x00,
+};
+
+enum {
+	FILTER_RULES_MAX = 64,
+	/** Jump target of the next instruction, other labels start at 1. */
+	FILTER_NEXT = 0,
+	FILTER_LABEL_UNSET = 0xffff,
+	FILTER_DROP = 0,
+	FILTER_ACCEPT = 0xffffffff,
+	FILTER_ETHER_HLEN = 14,
+};
+
+enum filter_rule_type {
+	FILTER_RULE_MULTICAST,
+	FILTER_RULE_BROADCAST,
+	FILTER_RULE_RA,
+	FILTER_RULE_IPV4,
+	FILTER_RULE_IPV6,
+	FILTER_RULE_PROTO,
+	FILTER_RULE_PORT,
+};
+
+struct filter_rule {
+	enum filter_rule_type fr_type;
+	uint32_t              fr_arg;
+};
+
+static const struct {
+	const char            *frn_name;
+	enum filter_rule_type  frn_type;
+	/** Maximum value of the argument, 0 if the rule takes none. */
+	unsigned long          frn_arg_max;
+} filter_rule_names[] = {
+	{ "multicast", FILTER_RULE_MULTICAST, 0 },
+	{ "broadcast", FILTER_RULE_BROADCAST, 0 },
+	{ "ra",        FILTER_RULE_RA,        0 },
+	{ "ipv4",      FILTER_RULE_IPV4,      0 },
+	{ "ipv6",      FILTER_RULE_IPV6,      0 },
+	{ "proto",     FILTER_RULE_PROTO,     255 },
+	{ "port",      FILTER_RULE_PORT,      65535 },
+};
+
+/**
+ * Program under construction. Jumps refer to labels until the program is
+ * complete, fb_jt and fb_jf keep the labels of the instructions.
+ */
+struct filter_builder {
+	struct pppoat_filter_insn *fb_insns;
+	size_t                     fb_nr;
+	uint16_t                   fb_jt[PPPOAT_FILTER_INSNS_MAX];
+	uint16_t                   fb_jf[PPPOAT_FILTER_INSNS_MAX];
+	uint16_t                   fb_labels[PPPOAT_FILTER_INSNS_MAX];
+	uint16_t                   fb_labels_nr;
+	int                        fb_rc;
+};
+
+static int filter_parse(const char         *rules,
+			struct filter_rule *out,
+			size_t             *nr)
+{
+	const char    *p = rules;
+	const char    *rule;
+	char          *end;
+	char           word[16];
+	size_t         wlen;
+	size_t         i;
+	unsigned long  arg;
+
+	*nr = 0;
+	while (true) {
+		while (isspace((unsigned char)*p))
+			++p;
+		if (*p == '\0')
+			break;
+		rule = p;
+		for (wlen = 0; isalnum((unsigned char)*p); ++wlen, ++p) {
+			if (wlen == sizeof(word) - 1)
+				goto err;
+			word[wlen] = *p;
+		}
+		word[wlen] = '\0';
+		for (i = 0; i < ARRAY_SIZE(filter_rule_names); ++i) {
+			if (pppoat_streq(word, filter_rule_names[i].frn_name))
+				break;
+		}
+		if (i == ARRAY_SIZE(filter_rule_names))
+			goto err;
+
+		while (isspace((unsigned char)*p))
+			++p;
+		arg = 0;
+		if (filter_rule_names[i].frn_arg_max != 0) {
+			if (!isdigit((unsigned char)*p))
+				goto err;
+			arg = strtoul(p, &end, 10);
+			if (arg > filter_rule_names[i].frn_arg_max)
+				goto err;
+			p = end;
+			while (isspace((unsigned char)*p))
+				++p;
+		}
+		if (*p != ',' && *p != '\0')
+			goto err;
+		if (*p == ',')
+			++p;
+
+		if (*nr == FILTER_RULES_MAX)
+			return P_ERR(-E2BIG);
+		out[*nr].fr_type = filter_rule_names[i].frn_type;
+		out[*nr].fr_arg  = (uint32_t)arg;
+		++*nr;
+	}
+	return 0;
+
+err:
+	pppoat_debug("filter", "Malformed rule '%s'", rule);
+	return P_ERR(-EINVAL);
+}
+
+static uint16_t filter_label_new(struct filter_builder *fb)
+{
+	if (fb->fb_labels_nr == PPPOAT_FILTER_INSNS_MAX - 1) {
+		fb->fb_rc = -E2BIG;
+		return FILTER_NEXT;
+	}
+	fb->fb_labels[++fb->fb_labels_nr] = FILTER_LABEL_UNSET;
+	return fb->fb_labels_nr;
+}
+
+static void filter_label_set(struct filter_builder *fb, uint16_t label)
+{
+	if (label != FILTER_NEXT)
+		fb->fb_labels[label] = (uint16_t)fb->fb_nr;
+}
+
+static void filter_emit(struct filter_builder *fb,
+			uint16_t               code,
+			uint32_t               k,
+			uint16_t               jt,
+			uint16_t               jf)
+{
+	if (fb->fb_nr == PPPOAT_FILTER_INSNS_MAX) {
+		fb->fb_rc = -E2BIG;
+		return;
+	}
+	fb->fb_insns[fb->fb_nr] = (struct pppoat_filter_insn){
+		.fi_code = code,
+		.fi_k    = k,
+	};
+	fb->fb_jt[fb->fb_nr] = jt;
+	fb->fb_jf[fb->fb_nr] = jf;
+	++fb->fb_nr;
+}
+
+static void filter_ld(struct filter_builder *fb, uint16_t size, uint32_t off)
+{
+	filter_emit(fb, FILTER_LD | FILTER_ABS | size, off, 0, 0);
+}
+
+static void filter_jeq(struct filter_builder *fb,
+		       uint32_t               k,
+		       uint16_t               jt,
+		       uint16_t               jf)
+{
+	filter_emit(fb, FILTER_JMP | FILTER_JEQ | FILTER_K, k, jt, jf);
+}
+
+static void filter_ret(struct filter_builder *fb, uint32_t k)
+{
+	filter_emit(fb, FILTER_RET | FILTER_K, k, 0, 0);
+}
+
+/** Replaces labels with offsets, classic BPF jumps only go forward. */
+static int filter_resolve(struct filter_builder *fb)
+{
+	struct pppoat_filter_insn *insn;
+	uint16_t                   label;
+	size_t                     off;
+	size_t                     i;
+	size_t                     j;
+
+	for (i = 0; i < fb->fb_nr; ++i) {
+		insn = &fb->fb_insns[i];
+		for (j = 0; j < 2; ++j) {
+			label = j == 0 ? fb->fb_jt[i] : fb->fb_jf[i];
+			if (label == FILTER_NEXT)
+				continue;
+			/* The label must be set after the jump. */
+			PPPOAT_ASSERT(fb->fb_labels[label] > i &&
+				      fb->fb_labels[label] <= fb->fb_nr);
+			off = fb->fb_labels[label] - i - 1;
+			if (insn->fi_code == (FILTER_JMP | FILTER_JA))
+				insn->fi_k = (uint32_t)off;
+			else if (off > 255)
+				return P_ERR(-E2BIG);
+			else if (j == 0)
+				insn->fi_jt = (uint8_t)off;
+			else
+				insn->fi_jf = (uint8_t)off;
+		}
+	}
+	return 0;
+}
+
+/** Ethernet broadcast except ARP, which can't work without it. */
+static void filter_gen_ether_bcast(struct filter_builder *fb)
+{
+	uint16_t next = filter_label_new(fb);
+
+	filter_ld(fb, FILTER_H, 12);
+	filter_jeq(fb, 0x0806, next, FILTER_NEXT);
+	filter_ld(fb, FILTER_W, 0);
+	filter_jeq(fb, 0xffffffff, FILTER_NEXT, next);
+	filter_ld(fb, FILTER_H, 4);
+	filter_jeq(fb, 0xffff, FILTER_NEXT, next);
+	filter_ret(fb, FILTER_DROP);
+	filter_label_set(fb, next);
+}
+
+/** Rules for frames which are neither IPv4 nor IPv6. */
+static void filter_gen_other(struct filter_builder    *fb,
+			     const struct filter_rule *rule,
+			     bool                      ether)
+{
+	uint16_t next;
+	uint16_t drop;
+
+	if (!ether)
+		return;
+
+	switch (rule->fr_type) {
+	case FILTER_RULE_MULTICAST:
+		next = filter_label_new(fb);
+		drop = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, 0);
+		filter_emit(fb, FILTER_JMP | FILTER_JSET | FILTER_K, 0x01,
+			    FILTER_NEXT, next);
+		filter_ld(fb, FILTER_W, 0);
+		filter_jeq(fb, 0xffffffff, FILTER_NEXT, drop);
+		filter_ld(fb, FILTER_H, 4);
+		filter_jeq(fb, 0xffff, next, FILTER_NEXT);
+		filter_label_set(fb, drop);
+		filter_ret(fb, FILTER_DROP);
+		filter_label_set(fb, next);
+		break;
+	case FILTER_RULE_BROADCAST:
+		filter_gen_ether_bcast(fb);
+		break;
+	default:
+		break;
+	}
+}
+
+/** Returns true if the rule drops every packet of the section. */
+static bool filter_gen_ip4(struct filter_builder    *fb,
+			   const struct filter_rule *rule,
+			   bool                      ether)
+{
+	uint32_t b = ether ? FILTER_ETHER_HLEN : 0;
+	uint16_t next;
+	uint16_t port;
+
+	switch (rule->fr_type) {
+	case FILTER_RULE_IPV4:
+		filter_ret(fb, FILTER_DROP);
+		return true;
+	case FILTER_RULE_MULTICAST:
+		next = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, b + 16);
+		filter_emit(fb, FILTER_ALU | FILTER_AND | FILTER_K, 0xf0, 0, 0);
+		filter_jeq(fb, 0xe0, FILTER_NEXT, next);
+		break;
+	case FILTER_RULE_BROADCAST:
+		if (ether)
+			filter_gen_ether_bcast(fb);
+		next = filter_label_new(fb);
+		filter_ld(fb, FILTER_W, b + 16);
+		filter_jeq(fb, 0xffffffff, FILTER_NEXT, next);
+		break;
+	case FILTER_RULE_PROTO:
+		next = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, b + 9);
+		filter_jeq(fb, rule->fr_arg, FILTER_NEXT, next);
+		break;
+	case FILTER_RULE_PORT:
+		next = filter_label_new(fb);
+		port = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, b + 9);
+		filter_jeq(fb, 6, port, FILTER_NEXT);
+		filter_jeq(fb, 17, FILTER_NEXT, next);
+		filter_label_set(fb, port);
+		/* Only the first fragment carries ports. */
+		filter_ld(fb, FILTER_H, b + 6);
+		filter_emit(fb, FILTER_JMP | FILTER_JSET | FILTER_K, 0x1fff,
+			    next, FILTER_NEXT);
+		filter_emit(fb, FILTER_LDX | FILTER_B | FILTER_MSH, b, 0, 0);
+		filter_emit(fb, FILTER_LD | FILTER_IND | FILTER_H, b + 2, 0, 0);
+		filter_jeq(fb, rule->fr_arg, FILTER_NEXT, next);
+		break;
+	default:
+		return false;
+	}
+	filter_ret(fb, FILTER_DROP);
+	filter_label_set(fb, next);
+	return false;
+}
+
+static bool filter_gen_ip6(struct filter_builder    *fb,
+			   const struct filter_rule *rule,
+			   bool                      ether)
+{
+	uint32_t b = ether ? FILTER_ETHER_HLEN : 0;
+	uint16_t next;
+	uint16_t label;
+
+	switch (rule->fr_type) {
+	case FILTER_RULE_IPV6:
+		filter_ret(fb, FILTER_DROP);
+		return true;
+	case FILTER_RULE_MULTICAST:
+		/* Neighbour discovery relies on ICMPv6 multicast. */
+		next = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, b + 24);
+		filter_jeq(fb, 0xff, FILTER_NEXT, next);
+		filter_ld(fb, FILTER_B, b + 6);
+		filter_jeq(fb, 58, next, FILTER_NEXT);
+		break;
+	case FILTER_RULE_BROADCAST:
+		if (ether)
+			filter_gen_ether_bcast(fb);
+		return false;
+	case FILTER_RULE_RA:
+		next  = filter_label_new(fb);
+		label = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, b + 6);
+		filter_jeq(fb, 58, FILTER_NEXT, next);
+		filter_ld(fb, FILTER_B, b + 40);
+		filter_jeq(fb, 133, label, FILTER_NEXT);
+		filter_jeq(fb, 134, FILTER_NEXT, next);
+		filter_label_set(fb, label);
+		break;
+	case FILTER_RULE_PROTO:
+		next = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, b + 6);
+		filter_jeq(fb, rule->fr_arg, FILTER_NEXT, next);
+		break;
+	case FILTER_RULE_PORT:
+		next  = filter_label_new(fb);
+		label = filter_label_new(fb);
+		filter_ld(fb, FILTER_B, b + 6);
+		filter_jeq(fb, 6, label, FILTER_NEXT);
+		filter_jeq(fb, 17, FILTER_NEXT, next);
+		filter_label_set(fb, label);
+		filter_ld(fb, FILTER_H, b + 42);
+		filter_jeq(fb, rule->fr_arg, FILTER_NEXT, next);
+		break;
+	default:
+		return false;
+	}
+	filter_ret(fb, FILTER_DROP);
+	filter_label_set(fb, next);
+	return false;
+}
+
+/**
+ * The program classifies the packet and jumps to the section of its
+ * family. Each rule either drops the packet or falls through to the next
+ * one, the end of a section accepts the packet. There is no unreachable
+ * code, the eBPF verifier rejects it.
+ */
+static void filter_gen(struct filter_builder    *fb,
+		       const struct filter_rule *rules,
+		       size_t                    nr,
+		       bool                      ether)
+{
+	uint16_t ip4  = filter_label_new(fb);
+	uint16_t ip6  = filter_label_new(fb);
+	uint16_t not4 = filter_label_new(fb);
+	uint16_t not6 = filter_label_new(fb);
+	size_t   i;
+
+	if (ether) {
+		filter_ld(fb, FILTER_H, 12);
+		filter_jeq(fb, 0x0800, FILTER_NEXT, not4);
+	} else {
+		filter_ld(fb, FILTER_B, 0);
+		filter_emit(fb, FILTER_ALU | FILTER_AND | FILTER_K, 0xf0, 0, 0);
+		filter_jeq(fb, 0x40, FILTER_NEXT, not4);
+	}
+	/* Sections may be too long for conditional jumps. */
+	filter_emit(fb, FILTER_JMP | FILTER_JA, 0, ip4, FILTER_NEXT);
+	filter_label_set(fb, not4);
+	filter_jeq(fb, ether ? 0x86dd : 0x60, FILTER_NEXT, not6);
+	filter_emit(fb, FILTER_JMP | FILTER_JA, 0, ip6, FILTER_NEXT);
+	filter_label_set(fb, not6);
+
+	for (i = 0; i < nr; ++i)
+		filter_gen_other(fb, &rules[i], ether);
+	filter_ret(fb, FILTER_ACCEPT);
+	filter_label_set(fb, ip4);
+	for (i = 0; i < nr && !filter_gen_ip4(fb, &rules[i], ether); ++i)
+		;
+	if (i == nr)
+		filter_ret(fb, FILTER_ACCEPT);
+	filter_label_set(fb, ip6);
+	for (i = 0; i < nr && !filter_gen_ip6(fb, &rules[i], ether); ++i)
+		;
+	if (i == nr)
+		filter_ret(fb, FILTER_ACCEPT);
+}
+
+int pppoat_filter_compile(struct pppoat_filter    *filter,
+			  const char              *rules,
+			  enum pppoat_filter_link  link)
+{
+	struct filter_builder *fb;
+	struct filter_rule     parsed[FILTER_RULES_MAX];
+	size_t                 nr;
+	int                    rc;
+
+	rc = filter_parse(rules, parsed, &nr);
+	if (rc != 0)
+		return rc;
+
+	fb = pppoat_alloc(sizeof *fb);
+	rc = fb == NULL ? P_ERR(-ENOMEM) : 0;
+	if (rc == 0) {
+		memset(fb, 0, sizeof *fb);
+		fb->fb_insns = pppoat_alloc(PPPOAT_FILTER_INSNS_MAX *
+					    sizeof *fb->fb_insns);
+		rc = fb->fb_insns == NULL ? P_ERR(-ENOMEM) : 0;
+	}
+	if (rc == 0) {
+		filter_gen(fb, parsed, nr, link == PPPOAT_FILTER_LINK_ETHER);
+		rc = fb->fb_rc != 0 ? P_ERR(fb->fb_rc) : filter_resolve(fb);
+	}
+	if (rc == 0) {
+		filter->f_insns = fb->fb_insns;
+		filter->f_nr    = fb->fb_nr;
+	} else if (fb != NULL)
+		pppoat_free(fb->fb_insns);
+	pppoat_free(fb);
+
+	return rc;
+}
+
+void pppoat_filter_fini(struct pppoat_filter *filter)
+{
+	pppoat_free(filter->f_insns);
+}
+
+static bool filter_load(const unsigned char *p,
+			size_t               len,
+			uint32_t             off,
+			uint16_t             size,
+			uint32_t            *a)
+{
+	size_t n = size == FILTER_W ? 4 : size == FILTER_H ? 2 : 1;
+	size_t i;
+
+	if (off > len || len - off < n)
+		return false;
+	for (*a = 0, i = 0; i < n; ++i)
+		*a = *a << 8 | p[off + i];
+	return true;
+}
+
+/**
+ * Supports the instructions which the compiler emits. A load beyond the
+ * packet drops it, like in the kernel.
+ */
+uint32_t pppoat_filter_run(const struct pppoat_filter *filter,
+			   const void                 *pkt,
+			   size_t                      len)
+{
+	const struct pppoat_filter_insn *insn;
+	const unsigned char             *p = pkt;
+	uint32_t                         a = 0;
+	uint32_t                         x = 0;
+	size_t                           pc;
+	bool                             cond;
+
+	for (pc = 0; pc < filter->f_nr; ++pc) {
+		insn = &filter->f_insns[pc];
+		switch (insn->fi_code) {
+		case FILTER_LD | FILTER_ABS | FILTER_W:
+		case FILTER_LD | FILTER_ABS | FILTER_H:
+		case FILTER_LD | FILTER_ABS | FILTER_B:
+			if (!filter_load(p, len, insn->fi_k,
+					 insn->fi_code & 0x18, &a))
+				return 0;
+			break;
+		case FILTER_LD | FILTER_IND | FILTER_W:
+		case FILTER_LD | FILTER_IND | FILTER_H:
+		case FILTER_LD | FILTER_IND | FILTER_B:
+			if (!filter_load(p, len, x + insn->fi_k,
+					 insn->fi_code & 0x18, &a))
+				return 0;
+			break;
+		case FILTER_LDX | FILTER_B | FILTER_MSH:
+			if (insn->fi_k >= len)
+				return 0;
+			x = (p[insn->fi_k] & 0x0f) << 2;
+			break;
+		case FILTER_ALU | FILTER_AND | FILTER_K:
+			a &= insn->fi_k;
+			break;
+		case FILTER_JMP | FILTER_JA:
+			pc += insn->fi_k;
+			break;
+		case FILTER_JMP | FILTER_JEQ | FILTER_K:
+		case FILTER_JMP | FILTER_JSET | FILTER_K:
+			cond = (insn->fi_code & 0xf0) == FILTER_JEQ ?
+			       a == insn->fi_k : (a & insn->fi_k) != 0;
+			pc += cond ? insn->fi_jt : insn->fi_jf;
+			break;
+		case FILTER_RET | FILTER_K:
+			return insn->fi_k;
+		default:
+			PPPOAT_ASSERT_INFO(false, "code=%#x", insn->fi_code);
+			return 0;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+/* filter.h
+ * PPP over Any Transport -- Packet filters
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_FILTER_H__
+#define __PPPOAT_FILTER_H__
+
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/**
+ * High level design.
+ *
+ * A filter is a list of rules which drop packets, separated by commas.
+ * A packet which matches any rule is dropped:
+ *
+ *   multicast  - IPv4 and IPv6 multicast, except ICMPv6 which carries
+ *                neighbour discovery, and Ethernet multicast of non-IP
+ *                frames
+ *   broadcast  - IPv4 limited broadcast and, for Ethernet, frames to
+ *                ff:ff:ff:ff:ff:ff except ARP
+ *   ra         - ICMPv6 router solicitations and advertisements
+ *   ipv4, ipv6 - whole address family
+ *   proto N    - IPv4 protocol or IPv6 next header N
+ *   port N     - TCP or UDP destination port N
+ *
+ * For example "multicast, ra, port 137, port 138".
+ *
+ * Rules are compiled to a classic BPF program, so the kernel can run it on
+ * the socket of an interface. The instructions have the layout of
+ * struct sock_filter. pppoat_filter_run() interprets the program for
+ * systems where the kernel can't do that. IPv6 extension headers hide the
+ * protocol and ports of the packet from the rules.
+ */
+
+enum pppoat_filter_link {
+	/** Packets start with IPv4 or IPv6 header. */
+	PPPOAT_FILTER_LINK_IP,
+	/** Packets start with Ethernet header. */
+	PPPOAT_FILTER_LINK_ETHER,
+};
+
+enum {
+	PPPOAT_FILTER_INSNS_MAX = 1024,
+};
+
+struct pppoat_filter_insn {
+	uint16_t fi_code;
+	uint8_t  fi_jt;
+	uint8_t  fi_jf;
+	uint32_t fi_k;
+};
+
+struct pppoat_filter {
+	struct pppoat_filter_insn *f_insns;
+	size_t                     f_nr;
+};
+
+/**
+ * Compiles the rules. Returns -EINVAL for a malformed rule and -E2BIG if
+ * the program doesn't fit PPPOAT_FILTER_INSNS_MAX instructions.
+ */
+int pppoat_filter_compile(struct pppoat_filter    *filter,
+			  const char              *rules,
+			  enum pppoat_filter_link  link);
+void pppoat_filter_fini(struct pppoat_filter *filter);
+
+/**
+ * Runs the program against the packet like the kernel does.
+ *
+ * @return Number of bytes to keep, 0 means the packet is dropped.
+ */
+uint32_t pppoat_filter_run(const struct pppoat_filter *filter,
+			   const void                 *pkt,
+			   size_t                      len);
+
+#endif /* __PPPOAT_FILTER_H__ */
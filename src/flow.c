@@ -0,0 +1,67 @@
+/* flow.c
+ * PPP over Any Transport -- Inner flow hashing
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "flow.h"
+
+#include <stdbool.h>
+#include <netinet/in.h>	/* IPPROTO_TCP, IPPROTO_UDP */
+
+static uint32_t flow_hash_mix(uint32_t h, const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	/* FNV-1a. */
+	for (i = 0; i < len; ++i)
+		h = (h ^ buf[i]) * 16777619U;
+	return h;
+}
+
+uint32_t pppoat_flow_hash(const void *ip, size_t len)
+{
+	const unsigned char *p = ip;
+	size_t               hlen;
+	unsigned char        proto;
+	bool                 frag;
+	uint32_t             h = 2166136261U;
+
+	if (len < 20)
+		return 0;
+
+	if (p[0] >> 4 == 4) {
+		hlen  = (p[0] & 0x0f) * 4;
+		proto = p[9];
+		/* More fragments bit or non-zero offset. */
+		frag  = (p[6] & 0x3f) != 0 || p[7] != 0;
+		h = flow_hash_mix(h, &p[12], 8);
+	} else if (p[0] >> 4 == 6 && len >= 40) {
+		hlen  = 40;
+		proto = p[6];
+		frag  = false;
+		h = flow_hash_mix(h, &p[8], 32);
+	} else
+		return 0;
+
+	h = flow_hash_mix(h, &proto, 1);
+	if (!frag && len >= hlen + 4 && (proto == IPPROTO_TCP ||
+	    proto == IPPROTO_UDP || proto == 132 /* SCTP */))
+		h = flow_hash_mix(h, &p[hlen], 4);
+	return h;
+}
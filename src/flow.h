@@ -0,0 +1,35 @@
+/* flow.h
+ * PPP over Any Transport -- Inner flow hashing
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_FLOW_H__
+#define __PPPOAT_FLOW_H__
+
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/**
+ * Returns hash of the flow of an IPv4 or IPv6 packet: addresses, protocol
+ * and, unless the packet is a fragment, TCP/UDP/SCTP ports. IPv6 extension
+ * headers hide the ports. Packets of one flow always get the same hash, so
+ * modules use it to spread flows over sockets or queues without
+ * reordering. Non-IP and truncated packets hash to 0.
+ */
+uint32_t pppoat_flow_hash(const void *ip, size_t len);
+
+#endif /* __PPPOAT_FLOW_H__ */
@@ -0,0 +1,210 @@
+/* gf256.c
+ * PPP over Any Transport -- Arithmetic in GF(2^8)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "gf256.h"
+#include "misc.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define GF256_HAVE_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+enum {
+	GF256_POLY = 0x11d,
+};
+
+typedef void (*gf256_muladd_t)(uint8_t *dst, const uint8_t *src, uint8_t c,
+			       size_t len);
+
+static uint8_t gf256_exp[512];
+static uint8_t gf256_log[256];
+static bool    gf256_ready = false;
+static gf256_muladd_t gf256_muladd_impl;
+static const char    *gf256_impl_name;
+
+/** Products of c and all nibbles: lo[i] = c * i, hi[i] = c * (i << 4). */
+static void gf256_nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi)
+{
+	unsigned i;
+
+	for (i = 0; i < 16; ++i) {
+		lo[i] = pppoat_gf256_mul(c, (uint8_t)i);
+		hi[i] = pppoat_gf256_mul(c, (uint8_t)(i << 4));
+	}
+}
+
+static void gf256_muladd_scalar(uint8_t *dst, const uint8_t *src, uint8_t c,
+				size_t len)
+{
+	uint8_t lo[16];
+	uint8_t hi[16];
+	size_t  i;
+
+	gf256_nibble_tables(c, lo, hi);
+	for (i = 0; i < len; ++i)
+		dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+#ifdef GF256_HAVE_SSSE3
+__attribute__((target("ssse3")))
+static void gf256_muladd_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+			       size_t len)
+{
+	uint8_t lo[16];
+	uint8_t hi[16];
+	__m128i tlo;
+	__m128i thi;
+	__m128i mask = _mm_set1_epi8(0x0f);
+	__m128i x;
+	__m128i r;
+	size_t  i;
+
+	gf256_nibble_tables(c, lo, hi);
+	tlo = _mm_loadu_si128((const __m128i *)lo);
+	thi = _mm_loadu_si128((const __m128i *)hi);
+	for (i = 0; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(src + i));
+		r = _mm_xor_si128(
+			_mm_shuffle_epi8(tlo, _mm_and_si128(x, mask)),
+			_mm_shuffle_epi8(thi, _mm_and_si128(
+					_mm_srli_epi64(x, 4), mask)));
+		r = _mm_xor_si128(r, _mm_loadu_si128((__m128i *)(dst + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), r);
+	}
+	for (; i < len; ++i)
+		dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+#endif /* GF256_HAVE_SSSE3 */
+
+void pppoat_gf256_init(void)
+{
+	unsigned x = 1;
+	unsigned i;
+
+	if (gf256_ready)
+		return;
+
+	for (i = 0; i < 255; ++i) {
+		gf256_exp[i] = (uint8_t)x;
+		gf256_log[x] = (uint8_t)i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= GF256_POLY;
+	}
+	/* Doubled table saves a modulo in mul(). */
+	for (i = 255; i < ARRAY_SIZE(gf256_exp); ++i)
+		gf256_exp[i] = gf256_exp[i - 255];
+
+	gf256_muladd_impl = &gf256_muladd_scalar;
+	gf256_impl_name   = "scalar";
+#ifdef GF256_HAVE_SSSE3
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		gf256_muladd_impl = &gf256_muladd_ssse3;
+		gf256_impl_name   = "ssse3";
+	}
+#endif
+	gf256_ready = true;
+}
+
+uint8_t pppoat_gf256_mul(uint8_t a, uint8_t b)
+{
+	if (a == 0 || b == 0)
+		return 0;
+	return gf256_exp[gf256_log[a] + gf256_log[b]];
+}
+
+uint8_t pppoat_gf256_inv(uint8_t a)
+{
+	PPPOAT_ASSERT(a != 0);
+	return gf256_exp[255 - gf256_log[a]];
+}
+
+void pppoat_gf256_muladd(uint8_t *dst, const uint8_t *src, uint8_t c,
+			 size_t len)
+{
+	PPPOAT_ASSERT(gf256_ready);
+
+	if (c != 0)
+		gf256_muladd_impl(dst, src, c, len);
+}
+
+const char *pppoat_gf256_impl(void)
+{
+	return gf256_impl_name;
+}
+
+int pppoat_gf256_matrix_inv(uint8_t *m, unsigned n)
+{
+	uint8_t  inv[PPPOAT_GF256_MATRIX_MAX * PPPOAT_GF256_MATRIX_MAX];
+	uint8_t  tmp[PPPOAT_GF256_MATRIX_MAX];
+	uint8_t *a;
+	uint8_t *b;
+	uint8_t  c;
+	unsigned col;
+	unsigned row;
+	unsigned i;
+
+	PPPOAT_ASSERT(n > 0 && n <= PPPOAT_GF256_MATRIX_MAX);
+
+	/* Gauss-Jordan elimination on [m | I]. */
+	memset(inv, 0, n * n);
+	for (i = 0; i < n; ++i)
+		inv[i * n + i] = 1;
+
+	for (col = 0; col < n; ++col) {
+		for (row = col; row < n && m[row * n + col] == 0; ++row)
+			;
+		if (row == n)
+			return -EINVAL;
+		if (row != col) {
+			memcpy(tmp, &m[row * n], n);
+			memcpy(&m[row * n], &m[col * n], n);
+			memcpy(&m[col * n], tmp, n);
+			memcpy(tmp, &inv[row * n], n);
+			memcpy(&inv[row * n], &inv[col * n], n);
+			memcpy(&inv[col * n], tmp, n);
+		}
+		c = pppoat_gf256_inv(m[col * n + col]);
+		a = &m[col * n];
+		b = &inv[col * n];
+		for (i = 0; i < n; ++i) {
+			a[i] = pppoat_gf256_mul(a[i], c);
+			b[i] = pppoat_gf256_mul(b[i], c);
+		}
+		for (row = 0; row < n; ++row) {
+			c = m[row * n + col];
+			if (row == col || c == 0)
+				continue;
+			for (i = 0; i < n; ++i) {
+				m[row * n + i]   ^= pppoat_gf256_mul(a[i], c);
+				inv[row * n + i] ^= pppoat_gf256_mul(b[i], c);
+			}
+		}
+	}
+	memcpy(m, inv, n * n);
+
+	return 0;
+}
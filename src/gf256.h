@@ -0,0 +1,63 @@
+/* gf256.h
+ * PPP over Any Transport -- Arithmetic in GF(2^8)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_GF256_H__
+#define __PPPOAT_GF256_H__
+
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/**
+ * Arithmetic in GF(2^8) with polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d)
+ * for erasure codes. Addition is XOR.
+ *
+ * Region operations multiply a buffer by a constant. Product of a byte is
+ * XOR of products of its low and high nibbles, so a constant is expanded to
+ * two 16-entry tables. With SSSE3, PSHUFB looks up 16 bytes at once in such
+ * a table. The implementation is selected at runtime by the CPU features,
+ * other CPUs use the same tables byte by byte.
+ */
+
+enum {
+	/** Maximum dimension of an inverted matrix. */
+	PPPOAT_GF256_MATRIX_MAX = 64,
+};
+
+/** Builds tables and selects region implementation. May be called twice. */
+void pppoat_gf256_init(void);
+
+uint8_t pppoat_gf256_mul(uint8_t a, uint8_t b);
+/** Inverse of a non-zero element. */
+uint8_t pppoat_gf256_inv(uint8_t a);
+
+/** dst[i] ^= c * src[i] for i in [0, len). */
+void pppoat_gf256_muladd(uint8_t *dst, const uint8_t *src, uint8_t c,
+			 size_t len);
+
+/**
+ * Inverts n x n matrix in row-major order in place.
+ *
+ * @return 0 or -EINVAL if the matrix is singular.
+ */
+int pppoat_gf256_matrix_inv(uint8_t *m, unsigned n);
+
+/** Name of the region implementation, e.g. for logging. */
+const char *pppoat_gf256_impl(void);
+
+#endif /* __PPPOAT_GF256_H__ */
@@ -0,0 +1,245 @@
+/* hdlc.c
+ * PPP over Any Transport -- HDLC-like framing for PPP
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "hdlc.h"
+#include "memory.h"
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define HDLC_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+enum {
+	/** RFC 1662 discards frames shorter than 4 bytes including FCS. */
+	HDLC_FRAME_MIN = 4,
+};
+
+/** CRC-CCITT in reflected form, polynomial 0x8408. */
+static const uint16_t hdlc_fcs_tbl[256] = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
+};
+
+uint16_t pppoat_hdlc_fcs(uint16_t fcs, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len-- > 0)
+		fcs = (fcs >> 8) ^ hdlc_fcs_tbl[(fcs ^ *p++) & 0xff];
+	return fcs;
+}
+
+size_t pppoat_hdlc_scan(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t         i = 0;
+#ifdef HDLC_HAVE_SSE2
+	const __m128i  flag = _mm_set1_epi8(PPPOAT_HDLC_FLAG);
+	const __m128i  esc  = _mm_set1_epi8(PPPOAT_HDLC_ESCAPE);
+	__m128i        x;
+	int            mask;
+
+	for (; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(p + i));
+		x = _mm_or_si128(_mm_cmpeq_epi8(x, flag),
+				 _mm_cmpeq_epi8(x, esc));
+		mask = _mm_movemask_epi8(x);
+		if (mask != 0)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+#endif /* HDLC_HAVE_SSE2 */
+	for (; i < len; ++i) {
+		if (p[i] == PPPOAT_HDLC_FLAG || p[i] == PPPOAT_HDLC_ESCAPE)
+			break;
+	}
+	return i;
+}
+
+static bool hdlc_needs_escape(uint8_t c, uint32_t accm)
+{
+	return c == PPPOAT_HDLC_FLAG || c == PPPOAT_HDLC_ESCAPE ||
+	       (c < 0x20 && (accm & (1U << c)) != 0);
+}
+
+static uint8_t *hdlc_put(uint8_t *out, uint8_t c, uint32_t accm)
+{
+	if (hdlc_needs_escape(c, accm)) {
+		*out++ = PPPOAT_HDLC_ESCAPE;
+		c ^= PPPOAT_HDLC_TRANS;
+	}
+	*out++ = c;
+	return out;
+}
+
+size_t pppoat_hdlc_encode(void               *out,
+			  const struct iovec *iov,
+			  int                 iovcnt,
+			  uint32_t            accm)
+{
+	const uint8_t *p;
+	uint8_t       *o = out;
+	uint16_t       fcs = PPPOAT_HDLC_FCS_INIT;
+	size_t         i;
+	int            v;
+
+	*o++ = PPPOAT_HDLC_FLAG;
+	for (v = 0; v < iovcnt; ++v) {
+		p = iov[v].iov_base;
+		fcs = pppoat_hdlc_fcs(fcs, p, iov[v].iov_len);
+		for (i = 0; i < iov[v].iov_len; ++i)
+			o = hdlc_put(o, p[i], accm);
+	}
+	fcs ^= 0xffff;
+	o = hdlc_put(o, fcs & 0xff, accm);
+	o = hdlc_put(o, fcs >> 8, accm);
+	*o++ = PPPOAT_HDLC_FLAG;
+
+	return o - (uint8_t *)out;
+}
+
+int pppoat_hdlc_decoder_init(struct pppoat_hdlc_decoder *dec, size_t size)
+{
+	*dec = (struct pppoat_hdlc_decoder){
+		.hd_size = size + PPPOAT_HDLC_FCS_SIZE,
+	};
+	dec->hd_buf = pppoat_alloc(dec->hd_size);
+
+	return dec->hd_buf == NULL ? P_ERR(-ENOMEM) : 0;
+}
+
+void pppoat_hdlc_decoder_fini(struct pppoat_hdlc_decoder *dec)
+{
+	pppoat_free(dec->hd_buf);
+}
+
+/** Handles a flag. Returns true if the buffer holds a good frame. */
+static bool hdlc_frame_end(struct pppoat_hdlc_decoder *dec)
+{
+	bool good = false;
+
+	if (dec->hd_escape) {
+		++dec->hd_aborts;
+	} else if (dec->hd_discard) {
+		++dec->hd_errors;
+	} else if (dec->hd_len >= HDLC_FRAME_MIN) {
+		good = pppoat_hdlc_fcs(PPPOAT_HDLC_FCS_INIT, dec->hd_buf,
+				       dec->hd_len) == PPPOAT_HDLC_FCS_GOOD;
+		dec->hd_errors += good ? 0 : 1;
+		dec->hd_frames += good ? 1 : 0;
+	} else if (dec->hd_len > 0) {
+		/* Back-to-back flags make empty frames which aren't errors. */
+		++dec->hd_errors;
+	}
+	dec->hd_escape  = false;
+	dec->hd_discard = false;
+
+	return good;
+}
+
+size_t pppoat_hdlc_decode(struct pppoat_hdlc_decoder  *dec,
+			  const void                  *buf,
+			  size_t                       len,
+			  const uint8_t              **frame,
+			  size_t                      *frame_len)
+{
+	const uint8_t *p = buf;
+	size_t         i = 0;
+	size_t         n;
+	uint8_t        c;
+
+	*frame = NULL;
+	while (i < len) {
+		/* Copy the run of plain bytes at once. */
+		if (!dec->hd_escape) {
+			n = pppoat_hdlc_scan(p + i, len - i);
+			if (dec->hd_discard) {
+				/* Skip the bytes. */
+			} else if (n > dec->hd_size - dec->hd_len) {
+				dec->hd_discard = true;
+			} else {
+				memcpy(dec->hd_buf + dec->hd_len, p + i, n);
+				dec->hd_len += n;
+			}
+			i += n;
+			if (i == len)
+				break;
+		}
+		c = p[i++];
+		if (c == PPPOAT_HDLC_FLAG) {
+			if (hdlc_frame_end(dec)) {
+				*frame     = dec->hd_buf;
+				*frame_len = dec->hd_len - PPPOAT_HDLC_FCS_SIZE;
+				dec->hd_len = 0;
+				return i;
+			}
+			dec->hd_len = 0;
+			continue;
+		}
+		if (dec->hd_discard)
+			continue;
+		if (c == PPPOAT_HDLC_ESCAPE) {
+			dec->hd_escape = true;
+			continue;
+		}
+		if (dec->hd_escape) {
+			c ^= PPPOAT_HDLC_TRANS;
+			dec->hd_escape = false;
+		}
+		if (dec->hd_len == dec->hd_size)
+			dec->hd_discard = true;
+		else
+			dec->hd_buf[dec->hd_len++] = c;
+	}
+	return len;
+}
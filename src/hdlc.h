@@ -0,0 +1,110 @@
+/* hdlc.h
+ * PPP over Any Transport -- HDLC-like framing for PPP
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_HDLC_H__
+#define __PPPOAT_HDLC_H__
+
+#include <stdbool.h>
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+#include <sys/uio.h>	/* iovec */
+
+/**
+ * High level design.
+ *
+ * Asynchronous HDLC-like framing from RFC 1662, the format which pppd uses
+ * on a tty. A frame is delimited by flag bytes 0x7e and ends with 16-bit
+ * FCS. Flag and escape bytes inside the frame, as well as control
+ * characters from ACCM, are sent as 0x7d followed by the byte XOR 0x20.
+ *
+ * The stream carries no other boundaries, so the decoder keeps state
+ * between calls and accepts frames split or concatenated arbitrarily.
+ */
+
+enum {
+	PPPOAT_HDLC_FLAG     = 0x7e,
+	PPPOAT_HDLC_ESCAPE   = 0x7d,
+	PPPOAT_HDLC_TRANS    = 0x20,
+	PPPOAT_HDLC_FCS_INIT = 0xffff,
+	/** FCS of a frame including its own FCS field. */
+	PPPOAT_HDLC_FCS_GOOD = 0xf0b8,
+	PPPOAT_HDLC_FCS_SIZE = 2,
+};
+
+/** Escapes all control characters, the value before LCP negotiates ACCM. */
+#define PPPOAT_HDLC_ACCM_ALL 0xffffffffU
+
+/** Maximum size of encoded frame with `len' bytes of data. */
+#define PPPOAT_HDLC_ENCODED_MAX(len) (2 * ((len) + PPPOAT_HDLC_FCS_SIZE) + 2)
+
+struct pppoat_hdlc_decoder {
+	uint8_t  *hd_buf;
+	/** Maximum frame size including FCS. */
+	size_t    hd_size;
+	size_t    hd_len;
+	bool      hd_escape;
+	/** The frame is broken, skip bytes until the next flag. */
+	bool      hd_discard;
+	uint64_t  hd_frames;
+	/** Frames with bad FCS, too short or too long. */
+	uint64_t  hd_errors;
+	/** Frames aborted with 0x7d 0x7e. */
+	uint64_t  hd_aborts;
+};
+
+uint16_t pppoat_hdlc_fcs(uint16_t fcs, const void *buf, size_t len);
+
+/**
+ * Finds the first flag or escape byte, 16 bytes per step with SSE2.
+ *
+ * @return Offset of the byte or `len' if there is none.
+ */
+size_t pppoat_hdlc_scan(const void *buf, size_t len);
+
+/**
+ * Encodes a frame from the buffers with opening and closing flags.
+ * `out' must fit PPPOAT_HDLC_ENCODED_MAX() of the total length.
+ *
+ * @return Size of encoded frame.
+ */
+size_t pppoat_hdlc_encode(void               *out,
+			  const struct iovec *iov,
+			  int                 iovcnt,
+			  uint32_t            accm);
+
+/**
+ * Initialises decoder for frames up to `size' bytes without FCS.
+ */
+int pppoat_hdlc_decoder_init(struct pppoat_hdlc_decoder *dec, size_t size);
+void pppoat_hdlc_decoder_fini(struct pppoat_hdlc_decoder *dec);
+
+/**
+ * Consumes the stream until the end of buffer or the end of a good frame.
+ * When a frame is complete, `frame' points to it without FCS and remains
+ * valid until the next call. Otherwise `frame' is set to NULL.
+ *
+ * @return Number of consumed bytes.
+ */
+size_t pppoat_hdlc_decode(struct pppoat_hdlc_decoder  *dec,
+			  const void                  *buf,
+			  size_t                       len,
+			  const uint8_t              **frame,
+			  size_t                      *frame_len);
+
+#endif /* __PPPOAT_HDLC_H__ */
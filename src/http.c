@@ -0,0 +1,347 @@
+/* http.c
+ * PPP over Any Transport -- Incremental HTTP/1.1 message parser
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "http.h"
+#include "io.h"
+#include "memory.h"
+#include "misc.h"
+
+#include <errno.h>
+#include <string.h>	/* memchr, memcpy, strlen */
+#include <strings.h>	/* strncasecmp */
+#include <sys/uio.h>	/* readv */
+
+#define HTTP_CONTENT_LENGTH "Content-Length"
+#define HTTP_TRANSFER_ENCODING "Transfer-Encoding"
+
+static bool http_parser_invariant(const struct pppoat_http_parser *p)
+{
+	return p != NULL && p->hp_ring != NULL &&
+	       (p->hp_size & (p->hp_size - 1)) == 0 &&
+	       p->hp_wr - p->hp_rd <= p->hp_size &&
+	       p->hp_scan - p->hp_rd <= p->hp_wr - p->hp_rd;
+}
+
+static size_t http_ring_off(const struct pppoat_http_parser *p, size_t pos)
+{
+	return pos & (p->hp_size - 1);
+}
+
+/** Contiguous part of buffered data starting from `pos'. */
+static size_t http_ring_contig(const struct pppoat_http_parser *p, size_t pos)
+{
+	return pppoat_min(p->hp_wr - pos, p->hp_size - http_ring_off(p, pos));
+}
+
+int pppoat_http_parser_init(struct pppoat_http_parser *p,
+			    struct pppoat_packets     *pkts,
+			    size_t                     size,
+			    bool                       base64,
+			    pppoat_http_line_cb_t      line_cb,
+			    void                      *arg)
+{
+	PPPOAT_ASSERT((size & (size - 1)) == 0);
+	PPPOAT_ASSERT(size >= 2 * PPPOAT_HTTP_LINE_MAX);
+
+	p->hp_ring = pppoat_alloc(size);
+	if (p->hp_ring == NULL)
+		return P_ERR(-ENOMEM);
+
+	p->hp_size      = size;
+	p->hp_rd        = 0;
+	p->hp_wr        = 0;
+	p->hp_scan      = 0;
+	p->hp_state     = PPPOAT_HTTP_START;
+	p->hp_line_cb   = line_cb;
+	p->hp_arg       = arg;
+	p->hp_pkts      = pkts;
+	p->hp_base64    = base64;
+	p->hp_body_left = 0;
+	p->hp_pkt       = NULL;
+	p->hp_pkt_len   = 0;
+
+	return 0;
+}
+
+void pppoat_http_parser_fini(struct pppoat_http_parser *p)
+{
+	PPPOAT_ASSERT(http_parser_invariant(p));
+
+	if (p->hp_pkt != NULL)
+		pppoat_packet_put(p->hp_pkts, p->hp_pkt);
+	pppoat_free(p->hp_ring);
+}
+
+int pppoat_http_parser_read(struct pppoat_http_parser *p, int fd)
+{
+	struct iovec iov[2];
+	size_t       space;
+	size_t       off;
+	ssize_t      rlen;
+	int          nr;
+
+	PPPOAT_ASSERT(http_parser_invariant(p));
+
+	/* The parser consumes everything but a partial line. */
+	space = p->hp_size - (p->hp_wr - p->hp_rd);
+	if (space == 0)
+		return P_ERR(-ENOBUFS);
+
+	off = http_ring_off(p, p->hp_wr);
+	iov[0].iov_base = p->hp_ring + off;
+	iov[0].iov_len  = pppoat_min(space, p->hp_size - off);
+	iov[1].iov_base = p->hp_ring;
+	iov[1].iov_len  = space - iov[0].iov_len;
+	nr = iov[1].iov_len > 0 ? 2 : 1;
+
+	do {
+		rlen = readv(fd, iov, nr);
+	} while (rlen < 0 && errno == EINTR);
+	if (rlen < 0)
+		return pppoat_io_error_is_recoverable(-errno) ? -errno :
+							       P_ERR(-errno);
+	if (rlen == 0)
+		return -ECONNRESET;
+
+	p->hp_wr += (size_t)rlen;
+
+	return 0;
+}
+
+/**
+ * Takes the next complete line from the ring.
+ *
+ * @return 0, -EAGAIN if the line is incomplete or -EMSGSIZE.
+ */
+static int http_line_get(struct pppoat_http_parser  *p,
+			 const char                **line,
+			 size_t                     *len)
+{
+	const char *nl = NULL;
+	size_t      contig;
+	size_t      off;
+	size_t      eol;
+	size_t      llen;
+
+	while (nl == NULL && p->hp_scan < p->hp_wr) {
+		off    = http_ring_off(p, p->hp_scan);
+		contig = http_ring_contig(p, p->hp_scan);
+		nl = memchr(p->hp_ring + off, '\n', contig);
+		p->hp_scan += nl == NULL ? contig :
+			      (size_t)(nl - (p->hp_ring + off));
+	}
+	if (nl == NULL) {
+		return p->hp_wr - p->hp_rd > PPPOAT_HTTP_LINE_MAX ?
+		       P_ERR(-EMSGSIZE) : -EAGAIN;
+	}
+
+	eol  = p->hp_scan;
+	llen = eol - p->hp_rd;
+	if (llen > PPPOAT_HTTP_LINE_MAX)
+		return P_ERR(-EMSGSIZE);
+
+	off = http_ring_off(p, p->hp_rd);
+	if (off + llen <= p->hp_size) {
+		*line = p->hp_ring + off;
+	} else {
+		contig = p->hp_size - off;
+		memcpy(p->hp_line, p->hp_ring + off, contig);
+		memcpy(p->hp_line + contig, p->hp_ring, llen - contig);
+		*line = p->hp_line;
+	}
+	*len = llen > 0 && (*line)[llen - 1] == '\r' ? llen - 1 : llen;
+
+	p->hp_rd   = eol + 1;
+	p->hp_scan = p->hp_rd;
+
+	return 0;
+}
+
+bool pppoat_http_header_value(const char  *line,
+			      size_t       len,
+			      const char  *name,
+			      const char **value,
+			      size_t      *value_len)
+{
+	size_t nlen = strlen(name);
+
+	if (len <= nlen || line[nlen] != ':' ||
+	    strncasecmp(line, name, nlen) != 0)
+		return false;
+
+	line += nlen + 1;
+	len  -= nlen + 1;
+	while (len > 0 && (*line == ' ' || *line == '\t')) {
+		++line;
+		--len;
+	}
+	while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+		--len;
+	*value     = line;
+	*value_len = len;
+
+	return true;
+}
+
+static int http_number_parse(const char *s, size_t len, uint64_t *val)
+{
+	uint64_t v = 0;
+	size_t   i;
+
+	if (len == 0 || len > 18)
+		return P_ERR(-EPROTO);
+	for (i = 0; i < len; ++i) {
+		if (s[i] < '0' || s[i] > '9')
+			return P_ERR(-EPROTO);
+		v = v * 10 + (uint64_t)(s[i] - '0');
+	}
+	*val = v;
+
+	return 0;
+}
+
+/** Handles a header line, the parser itself needs only the body length. */
+static int http_header(struct pppoat_http_parser *p,
+		       const char                *line,
+		       size_t                     len)
+{
+	const char *value;
+	size_t      vlen;
+	int         rc = 0;
+
+	if (memchr(line, ':', len) == NULL)
+		return P_ERR(-EPROTO);
+
+	if (pppoat_http_header_value(line, len, HTTP_CONTENT_LENGTH, &value,
+				     &vlen))
+		rc = http_number_parse(value, vlen, &p->hp_body_left);
+	if (pppoat_http_header_value(line, len, HTTP_TRANSFER_ENCODING, &value,
+				     &vlen))
+		rc = P_ERR(-EPROTO);
+	if (rc == 0 && p->hp_line_cb != NULL)
+		p->hp_line_cb(p->hp_arg, line, len);
+
+	return rc;
+}
+
+/** Prepares to receive the body after the empty line. */
+static int http_body_start(struct pppoat_http_parser *p)
+{
+	size_t size;
+
+	if (!p->hp_base64 || p->hp_body_left == 0)
+		return 0;
+	if (p->hp_body_left % 4 != 0 ||
+	    p->hp_body_left / 4 * 3 > PPPOAT_HTTP_BODY_MAX)
+		return P_ERR(-EPROTO);
+
+	size = (size_t)(p->hp_body_left / 4 * 3);
+	p->hp_pkt = pppoat_packet_get(p->hp_pkts, size);
+	if (p->hp_pkt == NULL)
+		return P_ERR(-ENOMEM);
+	p->hp_pkt_len = 0;
+	pppoat_base64_decoder_init(&p->hp_dec);
+
+	return 0;
+}
+
+/**
+ * Consumes available part of the body.
+ *
+ * @return 0 when the body is complete, -EAGAIN or -EPROTO.
+ */
+static int http_body(struct pppoat_http_parser *p)
+{
+	size_t len;
+	size_t dlen;
+	int    rc = 0;
+
+	while (rc == 0 && p->hp_body_left > 0 && p->hp_rd < p->hp_wr) {
+		len = http_ring_contig(p, p->hp_rd);
+		len = (size_t)pppoat_min((uint64_t)len, p->hp_body_left);
+		if (p->hp_pkt != NULL) {
+			rc = pppoat_base64_decoder_update(&p->hp_dec,
+				p->hp_ring + http_ring_off(p, p->hp_rd), len,
+				(char *)p->hp_pkt->pkt_data + p->hp_pkt_len,
+				&dlen);
+			rc = rc == 0 ? 0 : P_ERR(-EPROTO);
+			p->hp_pkt_len += rc == 0 ? dlen : 0;
+		}
+		p->hp_rd        += len;
+		p->hp_body_left -= len;
+	}
+	p->hp_scan = p->hp_rd;
+
+	if (rc == 0 && p->hp_body_left > 0)
+		rc = -EAGAIN;
+	if (rc == 0 && p->hp_pkt != NULL &&
+	    pppoat_base64_decoder_final(&p->hp_dec) != 0)
+		rc = P_ERR(-EPROTO);
+	if (rc == 0 && p->hp_pkt != NULL)
+		p->hp_pkt->pkt_size = p->hp_pkt_len;
+
+	return rc;
+}
+
+int pppoat_http_parse(struct pppoat_http_parser  *p,
+		      struct pppoat_packet      **pkt)
+{
+	const char *line;
+	size_t      len;
+	int         rc = 0;
+
+	PPPOAT_ASSERT(http_parser_invariant(p));
+
+	*pkt = NULL;
+	while (rc == 0) {
+		switch (p->hp_state) {
+		case PPPOAT_HTTP_START:
+			rc = http_line_get(p, &line, &len);
+			/* RFC 7230 allows empty lines before a message. */
+			if (rc != 0 || len == 0)
+				break;
+			p->hp_body_left = 0;
+			if (p->hp_line_cb != NULL)
+				p->hp_line_cb(p->hp_arg, line, len);
+			p->hp_state = PPPOAT_HTTP_HEADERS;
+			break;
+		case PPPOAT_HTTP_HEADERS:
+			rc = http_line_get(p, &line, &len);
+			if (rc == 0 && len > 0)
+				rc = http_header(p, line, len);
+			else if (rc == 0) {
+				rc = http_body_start(p);
+				p->hp_state = PPPOAT_HTTP_BODY;
+			}
+			break;
+		case PPPOAT_HTTP_BODY:
+			rc = http_body(p);
+			if (rc == 0) {
+				*pkt = p->hp_pkt;
+				p->hp_pkt = NULL;
+				p->hp_state = PPPOAT_HTTP_START;
+				return 0;
+			}
+			break;
+		}
+	}
+	return rc;
+}
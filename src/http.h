@@ -0,0 +1,128 @@
+/* http.h
+ * PPP over Any Transport -- Incremental HTTP/1.1 message parser
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_HTTP_H__
+#define __PPPOAT_HTTP_H__
+
+#include "base64.h"
+#include "packet.h"
+
+#include <stdbool.h>
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/**
+ * High level design.
+ *
+ * A TCP stream carries HTTP messages without regard to read() boundaries:
+ * a message may be split across reads and a single read may contain
+ * several pipelined messages. The parser keeps bytes of a connection in
+ * a ring buffer which is filled directly by readv() and consumes them as
+ * a state machine, so it never waits for a whole message.
+ *
+ * The start line and header lines are passed to a callback as soon as they
+ * are complete. A line points to the ring unless it wraps around the end,
+ * then it is copied. Messages are delimited by Content-Length, chunked
+ * encoding is not supported. The body is either decoded from base64 to
+ * a pool packet while it arrives or skipped.
+ */
+
+enum {
+	/** Maximum length of the start line or a header line. */
+	PPPOAT_HTTP_LINE_MAX = 4096,
+	/** Maximum size of a decoded body. */
+	PPPOAT_HTTP_BODY_MAX = 65536,
+};
+
+/** Receives a line without CRLF, `line' is valid only during the call. */
+typedef void (*pppoat_http_line_cb_t)(void *arg, const char *line,
+				      size_t len);
+
+enum pppoat_http_state {
+	PPPOAT_HTTP_START,
+	PPPOAT_HTTP_HEADERS,
+	PPPOAT_HTTP_BODY,
+};
+
+struct pppoat_http_parser {
+	char                        *hp_ring;
+	/** Size of the ring, power of 2. */
+	size_t                       hp_size;
+	/** Free-running read and write positions. */
+	size_t                       hp_rd;
+	size_t                       hp_wr;
+	/** Position where search for the end of line continues. */
+	size_t                       hp_scan;
+	enum pppoat_http_state       hp_state;
+	pppoat_http_line_cb_t        hp_line_cb;
+	void                        *hp_arg;
+	struct pppoat_packets       *hp_pkts;
+	/** Body is decoded from base64, otherwise it's skipped. */
+	bool                         hp_base64;
+	uint64_t                     hp_body_left;
+	struct pppoat_packet        *hp_pkt;
+	size_t                       hp_pkt_len;
+	struct pppoat_base64_decoder hp_dec;
+	/** Copy of a line which wraps around the end of the ring. */
+	char                         hp_line[PPPOAT_HTTP_LINE_MAX];
+};
+
+/**
+ * Initialises parser with a ring of `size' bytes, which must be a power
+ * of 2 and at least twice PPPOAT_HTTP_LINE_MAX.
+ */
+int pppoat_http_parser_init(struct pppoat_http_parser *p,
+			    struct pppoat_packets     *pkts,
+			    size_t                     size,
+			    bool                       base64,
+			    pppoat_http_line_cb_t      line_cb,
+			    void                      *arg);
+void pppoat_http_parser_fini(struct pppoat_http_parser *p);
+
+/**
+ * Reads available data from `fd' to the ring.
+ *
+ * @return 0, -ECONNRESET on end of stream or other error. Recoverable
+ *         errors are returned as is. The ring is never full if the caller
+ *         parses all messages after every read.
+ */
+int pppoat_http_parser_read(struct pppoat_http_parser *p, int fd);
+
+/**
+ * Consumes buffered data until the end of a message. `pkt' is set to the
+ * decoded body or NULL if the message has no body or it's skipped.
+ *
+ * @return 0 if a message is complete, -EAGAIN if more data is needed,
+ *         -EPROTO or -EMSGSIZE if the stream is malformed. After an error
+ *         the connection must be closed.
+ */
+int pppoat_http_parse(struct pppoat_http_parser  *p,
+		      struct pppoat_packet      **pkt);
+
+/**
+ * Matches a header line by the case-insensitive name. The value is
+ * returned without surrounding whitespace.
+ */
+bool pppoat_http_header_value(const char  *line,
+			      size_t       len,
+			      const char  *name,
+			      const char **value,
+			      size_t      *value_len);
+
+#endif /* __PPPOAT_HTTP_H__ */
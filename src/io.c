@@ -36,18 +36,30 @@ bool pppoat_io_error_is_recoverable(int error)
 	       error == -EAGAIN;
 }
 
-int pppoat_io_select(int maxfd, fd_set *rfds, fd_set *wfds)
+int pppoat_io_select_timeout(int     maxfd,
+			     fd_set *rfds,
+			     fd_set *wfds,
+			     long    timeout_ms)
 {
-	int rc;
+	struct timeval tv;
+	int            rc;
 
 	do {
-		rc = select(maxfd + 1, rfds, wfds, NULL, NULL);
+		tv.tv_sec  = timeout_ms / 1000;
+		tv.tv_usec = timeout_ms % 1000 * 1000;
+		rc = select(maxfd + 1, rfds, wfds, NULL,
+			    timeout_ms < 0 ? NULL : &tv);
 	} while (rc < 0 && errno == EINTR);
 	rc = rc < 0 ? P_ERR(-errno) : 0;
 
 	return rc;
 }
 
+int pppoat_io_select(int maxfd, fd_set *rfds, fd_set *wfds)
+{
+	return pppoat_io_select_timeout(maxfd, rfds, wfds, -1);
+}
+
 int pppoat_io_select_single_read(int fd)
 {
 	fd_set rfds;
@@ -31,6 +31,14 @@ int pppoat_io_write_sync(int fd, const void *buf, size_t len);
 int pppoat_io_close(int fd);
 
 int pppoat_io_select(int maxfd, fd_set *rfds, fd_set *wfds);
+/**
+ * Waits at most timeout_ms milliseconds, negative timeout means infinity.
+ * On timeout returns 0 and the sets are empty.
+ */
+int pppoat_io_select_timeout(int     maxfd,
+			     fd_set *rfds,
+			     fd_set *wfds,
+			     long    timeout_ms);
 int pppoat_io_select_single_read(int fd);
 int pppoat_io_select_single_write(int fd);
 
@@ -0,0 +1,411 @@
+/* lpm.c
+ * PPP over Any Transport -- IPv4 longest prefix match table
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "lpm.h"
+#include "memory.h"
+
+#include <errno.h>
+
+/*
+ * Entry format: bit 31 marks a first level entry which refers to a second
+ * level group, bits 24-29 keep depth of the prefix and bits 0-23 keep next
+ * hop or group index. Depth 0 means an empty entry.
+ */
+#define LPM_EXT         0x80000000U
+#define LPM_DEPTH_SHIFT 24
+#define LPM_DEPTH_MASK  0x3fU
+#define LPM_VAL_MASK    0x00ffffffU
+
+enum {
+	LPM_TBL24_NR  = 1 << 24,
+	LPM_TBL8_SIZE = 256,
+	/** Initial size of the rules hash table. */
+	LPM_RULES_MIN = 64,
+};
+
+static uint32_t lpm_entry(uint32_t val, uint8_t depth)
+{
+	return (uint32_t)depth << LPM_DEPTH_SHIFT | val;
+}
+
+static uint8_t lpm_entry_depth(uint32_t e)
+{
+	return (e >> LPM_DEPTH_SHIFT) & LPM_DEPTH_MASK;
+}
+
+static uint32_t lpm_entry_val(uint32_t e)
+{
+	return e & LPM_VAL_MASK;
+}
+
+static uint32_t lpm_mask(uint8_t len)
+{
+	return len == 0 ? 0 : ~0U << (32 - len);
+}
+
+int pppoat_lpm_init(struct pppoat_lpm *lpm, uint32_t tbl8_max)
+{
+	PPPOAT_ASSERT(tbl8_max <= LPM_VAL_MASK + 1);
+
+	lpm->lpm_tbl24 = pppoat_calloc(LPM_TBL24_NR, sizeof *lpm->lpm_tbl24);
+	lpm->lpm_tbl8  = pppoat_calloc((size_t)tbl8_max * LPM_TBL8_SIZE,
+				       sizeof *lpm->lpm_tbl8);
+	if (lpm->lpm_tbl24 == NULL || lpm->lpm_tbl8 == NULL) {
+		pppoat_free(lpm->lpm_tbl24);
+		pppoat_free(lpm->lpm_tbl8);
+		return P_ERR(-ENOMEM);
+	}
+	lpm->lpm_tbl8_nr     = 0;
+	lpm->lpm_tbl8_max    = tbl8_max;
+	lpm->lpm_rules       = NULL;
+	lpm->lpm_rules_nr    = 0;
+	lpm->lpm_rules_size  = 0;
+	lpm->lpm_default     = 0;
+	lpm->lpm_has_default = false;
+
+	return 0;
+}
+
+void pppoat_lpm_fini(struct pppoat_lpm *lpm)
+{
+	pppoat_free(lpm->lpm_rules);
+	pppoat_free(lpm->lpm_tbl8);
+	pppoat_free(lpm->lpm_tbl24);
+}
+
+/** Home slot of a rule, finaliser of MurmurHash3 mixes the prefix bits. */
+static size_t lpm_rule_slot(const struct pppoat_lpm *lpm,
+			    uint32_t                 prefix,
+			    uint8_t                  len)
+{
+	uint32_t h = prefix ^ len;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h & (lpm->lpm_rules_size - 1);
+}
+
+static struct pppoat_lpm_rule *lpm_rule_find(const struct pppoat_lpm *lpm,
+					     uint32_t                 prefix,
+					     uint8_t                  len)
+{
+	struct pppoat_lpm_rule *r;
+	size_t                  mask = lpm->lpm_rules_size - 1;
+	size_t                  i;
+
+	if (lpm->lpm_rules_size == 0)
+		return NULL;
+	/* The table is never more than half full. */
+	for (i = lpm_rule_slot(lpm, prefix, len);; i = (i + 1) & mask) {
+		r = &lpm->lpm_rules[i];
+		if (r->lr_len == 0)
+			return NULL;
+		if (r->lr_prefix == prefix && r->lr_len == len)
+			return r;
+	}
+}
+
+static void lpm_rule_insert(struct pppoat_lpm            *lpm,
+			    const struct pppoat_lpm_rule *rule)
+{
+	size_t mask = lpm->lpm_rules_size - 1;
+	size_t i;
+
+	for (i = lpm_rule_slot(lpm, rule->lr_prefix, rule->lr_len);
+	     lpm->lpm_rules[i].lr_len != 0; i = (i + 1) & mask);
+	lpm->lpm_rules[i] = *rule;
+	++lpm->lpm_rules_nr;
+}
+
+static int lpm_rules_grow(struct pppoat_lpm *lpm)
+{
+	struct pppoat_lpm_rule *old = lpm->lpm_rules;
+	size_t                  size = lpm->lpm_rules_size;
+	size_t                  i;
+
+	lpm->lpm_rules = pppoat_calloc(size == 0 ? LPM_RULES_MIN : size * 2,
+				       sizeof *lpm->lpm_rules);
+	if (lpm->lpm_rules == NULL) {
+		lpm->lpm_rules = old;
+		return P_ERR(-ENOMEM);
+	}
+	lpm->lpm_rules_size = size == 0 ? LPM_RULES_MIN : size * 2;
+	lpm->lpm_rules_nr   = 0;
+	for (i = 0; i < size; ++i)
+		if (old[i].lr_len != 0)
+			lpm_rule_insert(lpm, &old[i]);
+	pppoat_free(old);
+
+	return 0;
+}
+
+static int lpm_rule_add(struct pppoat_lpm *lpm,
+			uint32_t           prefix,
+			uint8_t            len,
+			uint32_t           nh)
+{
+	struct pppoat_lpm_rule rule = {
+		.lr_prefix = prefix,
+		.lr_len    = len,
+		.lr_nh     = nh,
+	};
+	int                    rc;
+
+	if (2 * (lpm->lpm_rules_nr + 1) > lpm->lpm_rules_size) {
+		rc = lpm_rules_grow(lpm);
+		if (rc != 0)
+			return rc;
+	}
+	lpm_rule_insert(lpm, &rule);
+
+	return 0;
+}
+
+/**
+ * Removes a rule with backward shift, so lookups don't need tombstones:
+ * every following rule of the cluster moves to the freed slot unless its
+ * home slot lies between the freed slot and the rule.
+ */
+static void lpm_rule_del(struct pppoat_lpm *lpm, struct pppoat_lpm_rule *r)
+{
+	struct pppoat_lpm_rule *rules = lpm->lpm_rules;
+	size_t                  mask = lpm->lpm_rules_size - 1;
+	size_t                  i = (size_t)(r - rules);
+	size_t                  j;
+	size_t                  home;
+
+	for (j = (i + 1) & mask; rules[j].lr_len != 0; j = (j + 1) & mask) {
+		home = lpm_rule_slot(lpm, rules[j].lr_prefix, rules[j].lr_len);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			rules[i] = rules[j];
+			i = j;
+		}
+	}
+	rules[i].lr_len = 0;
+	--lpm->lpm_rules_nr;
+}
+
+/**
+ * Finds the longest rule shorter than `len' which covers the prefix.
+ * Returns empty entry if there is no such rule.
+ */
+static uint32_t lpm_covering_entry(struct pppoat_lpm *lpm,
+				   uint32_t           prefix,
+				   uint8_t            len)
+{
+	struct pppoat_lpm_rule *r;
+	uint8_t                 l;
+
+	for (l = len - 1; l > 0; --l) {
+		r = lpm_rule_find(lpm, prefix & lpm_mask(l), l);
+		if (r != NULL)
+			return lpm_entry(r->lr_nh, r->lr_len);
+	}
+	return 0;
+}
+
+/**
+ * Replaces entries in range [from, from + nr) of a group or the first level
+ * with `e'. Only entries with depth in range [depth_min, depth_max] are
+ * replaced.
+ */
+static void lpm_range_set(uint32_t *tbl,
+			  uint32_t  from,
+			  uint32_t  nr,
+			  uint32_t  e,
+			  uint8_t   depth_min,
+			  uint8_t   depth_max)
+{
+	uint32_t i;
+	uint8_t  depth;
+
+	for (i = from; i < from + nr; ++i) {
+		depth = lpm_entry_depth(tbl[i]);
+		if (depth >= depth_min && depth <= depth_max)
+			tbl[i] = e;
+	}
+}
+
+/**
+ * Sets entries of the prefix to `e'. Entries of longer prefixes are kept.
+ * If `del_len' is not zero, only entries with exactly that depth are
+ * replaced.
+ */
+static void lpm_apply(struct pppoat_lpm *lpm,
+		      uint32_t           prefix,
+		      uint8_t            len,
+		      uint32_t           e,
+		      uint8_t            del_len)
+{
+	uint8_t   dmin = del_len;
+	uint8_t   dmax = del_len == 0 ? len : del_len;
+	uint32_t  i;
+	uint32_t  nr;
+	uint32_t *grp;
+
+	if (len <= 24) {
+		nr = 1U << (24 - len);
+		for (i = prefix >> 8; i < (prefix >> 8) + nr; ++i) {
+			if (lpm->lpm_tbl24[i] & LPM_EXT) {
+				grp = &lpm->lpm_tbl8[lpm_entry_val(
+					lpm->lpm_tbl24[i]) * LPM_TBL8_SIZE];
+				lpm_range_set(grp, 0, LPM_TBL8_SIZE, e,
+					      dmin, dmax);
+			} else
+				lpm_range_set(lpm->lpm_tbl24, i, 1, e,
+					      dmin, dmax);
+		}
+	} else {
+		i = prefix >> 8;
+		PPPOAT_ASSERT(lpm->lpm_tbl24[i] & LPM_EXT);
+		grp = &lpm->lpm_tbl8[lpm_entry_val(lpm->lpm_tbl24[i]) *
+				     LPM_TBL8_SIZE];
+		lpm_range_set(grp, prefix & 0xff, 1U << (32 - len), e,
+			      dmin, dmax);
+	}
+}
+
+/** Makes sure that the first level entry of the address is extended. */
+static int lpm_tbl8_ensure(struct pppoat_lpm *lpm, uint32_t prefix)
+{
+	uint32_t  i = prefix >> 8;
+	uint32_t *grp;
+	uint32_t  g;
+	uint32_t  j;
+
+	if (lpm->lpm_tbl24[i] & LPM_EXT)
+		return 0;
+	if (lpm->lpm_tbl8_nr == lpm->lpm_tbl8_max)
+		return P_ERR(-ENOSPC);
+
+	g   = lpm->lpm_tbl8_nr++;
+	grp = &lpm->lpm_tbl8[g * LPM_TBL8_SIZE];
+	for (j = 0; j < LPM_TBL8_SIZE; ++j)
+		grp[j] = lpm->lpm_tbl24[i];
+	/* Concurrent lookups must see the filled group. */
+	__sync_synchronize();
+	lpm->lpm_tbl24[i] = LPM_EXT | g;
+
+	return 0;
+}
+
+int pppoat_lpm_add(struct pppoat_lpm *lpm,
+		   uint32_t           prefix,
+		   uint8_t            len,
+		   uint32_t           nh)
+{
+	struct pppoat_lpm_rule *r;
+	int                     rc;
+
+	PPPOAT_ASSERT(len <= 32);
+	PPPOAT_ASSERT(nh <= PPPOAT_LPM_NH_MAX);
+
+	prefix &= lpm_mask(len);
+	if (len == 0) {
+		lpm->lpm_default     = nh;
+		lpm->lpm_has_default = true;
+		return 0;
+	}
+	if (len > 24) {
+		rc = lpm_tbl8_ensure(lpm, prefix);
+		if (rc != 0)
+			return rc;
+	}
+	r = lpm_rule_find(lpm, prefix, len);
+	if (r != NULL)
+		r->lr_nh = nh;
+	else {
+		rc = lpm_rule_add(lpm, prefix, len, nh);
+		if (rc != 0)
+			return rc;
+	}
+	lpm_apply(lpm, prefix, len, lpm_entry(nh, len), 0);
+
+	return 0;
+}
+
+int pppoat_lpm_del(struct pppoat_lpm *lpm, uint32_t prefix, uint8_t len)
+{
+	struct pppoat_lpm_rule *r;
+
+	PPPOAT_ASSERT(len <= 32);
+
+	prefix &= lpm_mask(len);
+	if (len == 0) {
+		if (!lpm->lpm_has_default)
+			return -ENOENT;
+		lpm->lpm_has_default = false;
+		return 0;
+	}
+	r = lpm_rule_find(lpm, prefix, len);
+	if (r == NULL)
+		return -ENOENT;
+	lpm_rule_del(lpm, r);
+
+	/* Second level groups are not released. */
+	lpm_apply(lpm, prefix, len, lpm_covering_entry(lpm, prefix, len), len);
+
+	return 0;
+}
+
+int pppoat_lpm_find(const struct pppoat_lpm *lpm,
+		    uint32_t                 prefix,
+		    uint8_t                  len,
+		    uint32_t                *nh)
+{
+	struct pppoat_lpm_rule *r;
+
+	PPPOAT_ASSERT(len <= 32);
+
+	prefix &= lpm_mask(len);
+	if (len == 0) {
+		*nh = lpm->lpm_default;
+		return lpm->lpm_has_default ? 0 : -ENOENT;
+	}
+	r = lpm_rule_find(lpm, prefix, len);
+	if (r != NULL)
+		*nh = r->lr_nh;
+	return r == NULL ? -ENOENT : 0;
+}
+
+int pppoat_lpm_lookup(const struct pppoat_lpm *lpm,
+		      uint32_t                 addr,
+		      uint32_t                *nh)
+{
+	uint32_t e = lpm->lpm_tbl24[addr >> 8];
+
+	if (e & LPM_EXT)
+		e = lpm->lpm_tbl8[lpm_entry_val(e) * LPM_TBL8_SIZE +
+				  (addr & 0xff)];
+	if (lpm_entry_depth(e) != 0) {
+		*nh = lpm_entry_val(e);
+		return 0;
+	}
+	if (lpm->lpm_has_default) {
+		*nh = lpm->lpm_default;
+		return 0;
+	}
+	return -ENOENT;
+}
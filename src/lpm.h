@@ -0,0 +1,123 @@
+/* lpm.h
+ * PPP over Any Transport -- IPv4 longest prefix match table
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_LPM_H__
+#define __PPPOAT_LPM_H__
+
+#include <stdbool.h>
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/**
+ * High level design.
+ *
+ * LPM table maps IPv4 prefixes to next hops. Next hop is an opaque number
+ * chosen by user, e.g. index of a peer. Lookup returns next hop of the
+ * longest prefix which covers the address.
+ *
+ * The table implements DIR-24-8 algorithm. The first level is indexed by
+ * the upper 24 bits of the address. If there are prefixes longer than 24
+ * bits within an entry, the entry refers to a second level group of 256
+ * entries indexed by the lower 8 bits. So a lookup takes one or two memory
+ * accesses regardless of the number of prefixes.
+ *
+ * Every entry keeps depth of the prefix which set it. Adding a prefix
+ * overwrites only entries with smaller or equal depth. Deleting a prefix
+ * replaces its entries with the longest remaining prefix which covers it.
+ *
+ * Prefixes are also kept as rules in a hash table keyed by prefix and
+ * length. So adding or deleting a rule and finding the covering rule take
+ * at most 32 hash lookups regardless of the number of rules, and loading
+ * a large table is linear.
+ *
+ * The first level takes 64MB of virtual memory, but only touched pages are
+ * backed by physical memory. Prefixes shorter than 24 bits touch
+ * 2^(24 - len) entries each.
+ *
+ * Concurrency. Modifications must be serialised by user. Lookups may run
+ * concurrently with a modification and return either old or new next hop.
+ */
+
+enum {
+	/** Maximum next hop value. */
+	PPPOAT_LPM_NH_MAX = (1 << 24) - 1,
+};
+
+/** Rule of the hash table, zero length marks an empty slot. */
+struct pppoat_lpm_rule {
+	uint32_t lr_prefix;
+	uint8_t  lr_len;
+	uint32_t lr_nh;
+};
+
+struct pppoat_lpm {
+	uint32_t               *lpm_tbl24;
+	uint32_t               *lpm_tbl8;
+	uint32_t                lpm_tbl8_nr;
+	uint32_t                lpm_tbl8_max;
+	/** Open addressing hash table of rules, the size is a power of 2. */
+	struct pppoat_lpm_rule *lpm_rules;
+	size_t                  lpm_rules_nr;
+	size_t                  lpm_rules_size;
+	/** Next hop of the default prefix (length 0), if any. */
+	uint32_t                lpm_default;
+	bool                    lpm_has_default;
+};
+
+/**
+ * Initialises empty table.
+ *
+ * @param tbl8_max Maximum number of second level groups, i.e. number of
+ *                 distinct /24 networks which contain prefixes longer
+ *                 than 24 bits.
+ */
+int pppoat_lpm_init(struct pppoat_lpm *lpm, uint32_t tbl8_max);
+void pppoat_lpm_fini(struct pppoat_lpm *lpm);
+
+/**
+ * Adds a prefix or replaces next hop of an existing one. Address is in host
+ * byte order, bits after the prefix length are ignored.
+ */
+int pppoat_lpm_add(struct pppoat_lpm *lpm,
+		   uint32_t           prefix,
+		   uint8_t            len,
+		   uint32_t           nh);
+int pppoat_lpm_del(struct pppoat_lpm *lpm, uint32_t prefix, uint8_t len);
+
+/**
+ * Finds the exact prefix, unlike pppoat_lpm_lookup() covering prefixes
+ * don't match. Must be serialised with modifications.
+ *
+ * @return 0 and next hop in `nh' or -ENOENT.
+ */
+int pppoat_lpm_find(const struct pppoat_lpm *lpm,
+		    uint32_t                 prefix,
+		    uint8_t                  len,
+		    uint32_t                *nh);
+
+/**
+ * Looks up the longest prefix which covers the address.
+ *
+ * @return 0 and next hop in `nh' or -ENOENT.
+ */
+int pppoat_lpm_lookup(const struct pppoat_lpm *lpm,
+		      uint32_t                 addr,
+		      uint32_t                *nh);
+
+#endif /* __PPPOAT_LPM_H__ */
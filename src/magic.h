@@ -40,12 +40,36 @@
 /* pipeline.c::pipeline_descr */
 #define PPPOAT_PIPELINE_MAGIC 0x400DF00D
 
+/* splice.c::splice_pinned_descr */
+#define PPPOAT_SPLICE_PINNED_MAGIC 0x5911CE01
+
 /* thread.c::pppoat_thread->t_magic */
 #define PPPOAT_THREAD_MAGIC 0xABBA4EAD
 
+/* modules/if_fd.c::if_fd_txq_descr */
+#define PPPOAT_MODULE_IF_FD_TXQ_MAGIC 0xFDC0C001
+
 /* modules/if_pppd.c::if_pppd_ctx */
 #define PPPOAT_MODULE_IF_PPPD_MAGIC 0xD00DC001
 
+/* modules/if_ppp.c::if_ppp_pktq_descr */
+#define PPPOAT_MODULE_IF_PPP_PKTQ_MAGIC 0x7E7EC001
+
+/* modules/if_tun.c::if_tuntap_segs_descr */
+#define PPPOAT_MODULE_IF_TUN_SEGS_MAGIC 0x7E550001
+
+/* modules/pl_arq.c::pl_arq_outq_descr */
+#define PPPOAT_MODULE_PL_ARQ_OUTQ_MAGIC 0xA4C00001
+
+/* modules/pl_fec.c::pl_fec_outq_descr */
+#define PPPOAT_MODULE_PL_FEC_OUTQ_MAGIC 0xFECC0001
+
+/* modules/pl_frag.c::pl_frag_txq_descr */
+#define PPPOAT_MODULE_PL_FRAG_TXQ_MAGIC 0xF4A6C001
+
+/* modules/tp_udp.c::tp_udp_txq_descr */
+#define PPPOAT_MODULE_TP_UDP_TXQ_MAGIC 0xBA7C4001
+
 /* modules/tp_xmpp.c::tp_xmpp_ctx */
 #define PPPOAT_MODULE_TP_XMPP_MAGIC 0xCAFEC001
 
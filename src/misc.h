@@ -52,5 +52,6 @@ int pppoat_strtol(char *str, long *out);
 
 /* XXX TODO Replace with a function. */
 #define pppoat_max(a, b) ((a) > (b) ? (a) : (b))
+#define pppoat_min(a, b) ((a) < (b) ? (a) : (b))
 
 #endif /* __PPPOAT_MISC_H__ */
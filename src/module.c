@@ -23,6 +23,8 @@
 #include "packet.h"
 #include "pppoat.h"
 
+#include <errno.h>
+
 /* XXX TODO check if non mandatory interface != NULL */
 
 int pppoat_module_init(struct pppoat_module            *mod,
@@ -31,6 +33,7 @@ int pppoat_module_init(struct pppoat_module            *mod,
 {
 	mod->m_impl = impl;
 	mod->m_pkts = ctx->p_pkts;
+	mod->m_pipeline = NULL;
 	mod->m_invert = false;
 	mod->m_userdata = NULL;
 
@@ -89,6 +92,35 @@ size_t pppoat_module_mtu(struct pppoat_module *mod)
 	return mod->m_impl->mod_ops->mop_mtu(mod);
 }
 
+size_t pppoat_module_mtu_set(struct pppoat_module *mod, size_t mtu)
+{
+	struct pppoat_module_ops *ops = mod->m_impl->mod_ops;
+
+	return ops->mop_mtu_set == NULL ? mtu : ops->mop_mtu_set(mod, mtu);
+}
+
+unsigned pppoat_module_workers(struct pppoat_module *mod)
+{
+	struct pppoat_module_ops *ops = mod->m_impl->mod_ops;
+
+	return ops->mop_workers == NULL ? 1 : ops->mop_workers(mod);
+}
+
+void pppoat_module_stats(struct pppoat_module *mod)
+{
+	struct pppoat_module_ops *ops = mod->m_impl->mod_ops;
+
+	if (ops->mop_stats != NULL)
+		ops->mop_stats(mod);
+}
+
+int pppoat_module_rtt(struct pppoat_module *mod, struct pppoat_rtt_stats *stats)
+{
+	struct pppoat_module_ops *ops = mod->m_impl->mod_ops;
+
+	return ops->mop_rtt == NULL ? -ENOENT : ops->mop_rtt(mod, stats);
+}
+
 enum pppoat_module_type pppoat_module_type(struct pppoat_module *mod)
 {
 	return mod->m_impl->mod_type;
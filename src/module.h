@@ -27,6 +27,7 @@ struct pppoat_conf;
 struct pppoat_packet;
 struct pppoat_packets;
 struct pppoat_pipeline;
+struct pppoat_rtt_stats;
 
 struct pppoat_module;
 
@@ -50,6 +51,24 @@ struct pppoat_module_ops {
 			   struct pppoat_packet  *pkt,
 			   struct pppoat_packet **next);
 	size_t (*mop_mtu)(struct pppoat_module *mod);
+	/**
+	 * Optional. Notifies the module that MTU of the opposite edge
+	 * module has changed at runtime. Returns MTU for the next module or
+	 * 0 if the module hides the change, e.g. a fragmentation plugin.
+	 */
+	size_t (*mop_mtu_set)(struct pppoat_module *mod, size_t mtu);
+	/**
+	 * Optional. Number of threads which poll a blocking module
+	 * concurrently. Default is 1.
+	 */
+	unsigned (*mop_workers)(struct pppoat_module *mod);
+	/** Optional. Logs statistics of the module. */
+	void (*mop_stats)(struct pppoat_module *mod);
+	/**
+	 * Optional. Latency and loss of the path measured by a transport.
+	 * Returns -ENOENT if there is no estimate yet.
+	 */
+	int (*mop_rtt)(struct pppoat_module *mod, struct pppoat_rtt_stats *stats);
 };
 
 struct pppoat_module_impl {
@@ -63,6 +82,7 @@ struct pppoat_module_impl {
 struct pppoat_module {
 	const struct pppoat_module_impl *m_impl;
 	struct pppoat_packets           *m_pkts;
+	struct pppoat_pipeline          *m_pipeline;
 	struct pppoat_list_link          m_link;
 	uint32_t                         m_magic;
 	bool                             m_invert;
@@ -82,6 +102,14 @@ int pppoat_module_process(struct pppoat_module  *mod,
 			  struct pppoat_packet **next);
 
 size_t pppoat_module_mtu(struct pppoat_module *mod);
+/**
+ * @return MTU for the next module, modules without mop_mtu_set() pass the
+ *         MTU unchanged.
+ */
+size_t pppoat_module_mtu_set(struct pppoat_module *mod, size_t mtu);
+unsigned pppoat_module_workers(struct pppoat_module *mod);
+void pppoat_module_stats(struct pppoat_module *mod);
+int pppoat_module_rtt(struct pppoat_module *mod, struct pppoat_rtt_stats *stats);
 
 enum pppoat_module_type pppoat_module_type(struct pppoat_module *mod);
 const char *pppoat_module_name(struct pppoat_module *mod);
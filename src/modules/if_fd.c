@@ -21,15 +21,25 @@
 
 #include "conf.h"
 #include "io.h"
+#include "magic.h"
 #include "memory.h"
 #include "misc.h"
 #include "module.h"
+#include "mutex.h"
 #include "packet.h"
+#include "splice.h"
 
 #include <sys/types.h>
+#include <sys/uio.h>	/* writev */
 #include <signal.h>	/* kill */
+#include <time.h>	/* clock_gettime */
 #include <unistd.h>	/* read */
 
+#define STDIO_CONF_ZEROCOPY "stdio.zerocopy"
+#define STDIO_CONF_STREAM   "stdio.stream"
+#define STDIO_CONF_MSG_SIZE "stdio.msg_size"
+#define STDIO_CONF_FLUSH_MS "stdio.flush_ms"
+
 /*
  * TODO Add "file" bidirectional interface module which can transfer data
  * between file descriptors of two pppoat instances. The file can be
@@ -37,15 +47,61 @@
  * regular file, transfer should be unidirectional.
  */
 
+/*
+ * Stream mode.
+ *
+ * By default every read() becomes a packet and every packet is written with
+ * a separate write(), so the number of messages depends on how the reader
+ * and writer of the pipe are scheduled. With stdio.stream, the input is read
+ * directly into a message of stdio.msg_size bytes. The message is sent when
+ * it is full or when stdio.flush_ms milliseconds have passed since its first
+ * byte. With zero deadline a message carries whatever a single read()
+ * returns, i.e. all the data waiting in the pipe.
+ *
+ * Outbound packets are queued and the module's blocking thread writes the
+ * queue with writev(2). The thread is woken up only when the queue becomes
+ * non-empty, so under load a single syscall writes many packets. When the
+ * queue is full, the caller writes it itself instead of dropping data.
+ * Zero-copy writes bypass the queue.
+ */
+
 struct if_fd_ctx {
-	int ifc_rd;
-	int ifc_wr;
+	int                   ifc_rd;
+	int                   ifc_wr;
+	/** Received packets are vmspliced to ifc_wr. */
+	bool                  ifc_zerocopy;
+	struct pppoat_splice  ifc_splice;
+	bool                  ifc_stream;
+	size_t                ifc_msg_size;
+	uint64_t              ifc_flush_ms;
+	/* Message being read, owned by the blocking thread. */
+	struct pppoat_packet *ifc_cur;
+	size_t                ifc_cur_len;
+	uint64_t              ifc_cur_time;
+	bool                  ifc_eof;
+	/** Outbound queue, protected by ifc_txq_lock. */
+	struct pppoat_list    ifc_txq;
+	unsigned              ifc_txq_nr;
+	struct pppoat_mutex   ifc_txq_lock;
+	/** Serialises writers, so the queue leaves in order. */
+	struct pppoat_mutex   ifc_wr_lock;
+	/** Pipe which wakes up the blocking thread to write ifc_txq. */
+	int                   ifc_wake[2];
 };
 
 enum {
-	IF_FD_MTU = 1500,
+	IF_FD_MTU          = 1500,
+	IF_FD_MSG_SIZE_MIN = 64,
+	IF_FD_MSG_SIZE_MAX = 65535,
+	/** Packets per writev(). */
+	IF_FD_IOV_NR       = 64,
+	IF_FD_TXQ_MAX      = 256,
 };
 
+static struct pppoat_list_descr if_fd_txq_descr =
+	PPPOAT_LIST_DESCR("stdio send queue", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_MODULE_IF_FD_TXQ_MAGIC);
+
 static bool if_fd_ctx_invariant(const struct if_fd_ctx *ctx)
 {
 	return ctx != NULL;
@@ -61,6 +117,19 @@ static int if_fd_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 
 	ctx->ifc_rd = -1;
 	ctx->ifc_wr = -1;
+	ctx->ifc_zerocopy = false;
+	ctx->ifc_stream   = false;
+	ctx->ifc_msg_size = IF_FD_MTU;
+	ctx->ifc_flush_ms = 0;
+	ctx->ifc_cur      = NULL;
+	ctx->ifc_cur_len  = 0;
+	ctx->ifc_eof      = false;
+	ctx->ifc_txq_nr   = 0;
+	ctx->ifc_wake[0]  = -1;
+	ctx->ifc_wake[1]  = -1;
+	pppoat_list_init(&ctx->ifc_txq, &if_fd_txq_descr);
+	pppoat_mutex_init(&ctx->ifc_txq_lock);
+	pppoat_mutex_init(&ctx->ifc_wr_lock);
 	mod->m_userdata = ctx;
 
 	return 0;
@@ -68,16 +137,71 @@ static int if_fd_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 
 static void if_fd_fini(struct pppoat_module *mod)
 {
-	struct if_fd_ctx *ctx = mod->m_userdata;
+	struct if_fd_ctx     *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
 
 	PPPOAT_ASSERT(if_fd_ctx_invariant(ctx));
 
+	if (ctx->ifc_zerocopy)
+		pppoat_splice_fini(&ctx->ifc_splice);
+	if (ctx->ifc_cur != NULL)
+		pppoat_packet_put(mod->m_pkts, ctx->ifc_cur);
+	while ((pkt = pppoat_list_dequeue(&ctx->ifc_txq)) != NULL)
+		pppoat_packet_put(mod->m_pkts, pkt);
+	pppoat_mutex_fini(&ctx->ifc_wr_lock);
+	pppoat_mutex_fini(&ctx->ifc_txq_lock);
+	pppoat_list_fini(&ctx->ifc_txq);
 	pppoat_free(ctx);
 }
 
+static int if_fd_stream_conf(struct if_fd_ctx *ctx, struct pppoat_conf *conf)
+{
+	long val;
+	int  rc;
+
+	rc = pppoat_conf_find_long(conf, STDIO_CONF_MSG_SIZE, &val);
+	if (rc == 0) {
+		if (val < IF_FD_MSG_SIZE_MIN || val > IF_FD_MSG_SIZE_MAX) {
+			pppoat_error("stdio", "Message size must be in range "
+				     "%d..%d.", IF_FD_MSG_SIZE_MIN,
+				     IF_FD_MSG_SIZE_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->ifc_msg_size = (size_t)val;
+	}
+	rc = pppoat_conf_find_long(conf, STDIO_CONF_FLUSH_MS, &val);
+	if (rc == 0) {
+		if (val < 0) {
+			pppoat_error("stdio", "Invalid flush deadline %ld.",
+				     val);
+			return P_ERR(-EINVAL);
+		}
+		ctx->ifc_flush_ms = (uint64_t)val;
+	}
+	return 0;
+}
+
+/** Enables zero-copy writes if the output is a pipe. */
+static int if_fd_zerocopy_init(struct pppoat_module *mod,
+			       struct if_fd_ctx     *ctx)
+{
+	int rc;
+
+	rc = pppoat_splice_init(&ctx->ifc_splice, ctx->ifc_wr, mod->m_pkts);
+	if (rc == -ENOTSUP) {
+		pppoat_info("stdio", "Output is not a pipe, zero-copy is "
+			    "disabled");
+		return 0;
+	}
+	ctx->ifc_zerocopy = rc == 0;
+
+	return rc;
+}
+
 static int if_stdio_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 {
 	struct if_fd_ctx *ctx;
+	bool              zerocopy = false;
 	int               rc;
 
 	rc = if_fd_init(mod, conf);
@@ -86,6 +210,15 @@ static int if_stdio_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 		PPPOAT_ASSERT(if_fd_ctx_invariant(ctx));
 		ctx->ifc_rd = STDIN_FILENO;
 		ctx->ifc_wr = STDOUT_FILENO;
+		pppoat_conf_find_bool(conf, STDIO_CONF_ZEROCOPY, &zerocopy);
+		pppoat_conf_find_bool(conf, STDIO_CONF_STREAM,
+				      &ctx->ifc_stream);
+		if (ctx->ifc_stream)
+			rc = if_fd_stream_conf(ctx, conf);
+		if (rc == 0 && zerocopy)
+			rc = if_fd_zerocopy_init(mod, ctx);
+		if (rc != 0)
+			if_fd_fini(mod);
 	}
 	return rc;
 }
@@ -95,17 +228,154 @@ static void if_stdio_fini(struct pppoat_module *mod)
 	if_fd_fini(mod);
 }
 
+static uint64_t if_fd_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void if_fd_wake_drain(struct if_fd_ctx *ctx)
+{
+	char    buf[64];
+	ssize_t rlen;
+
+	do {
+		rlen = read(ctx->ifc_wake[0], buf, sizeof buf);
+	} while (rlen > 0 || (rlen < 0 && errno == EINTR));
+}
+
+static void if_fd_wake(struct if_fd_ctx *ctx)
+{
+	ssize_t wlen;
+
+	do {
+		wlen = write(ctx->ifc_wake[1], "w", 1);
+	} while (wlen < 0 && errno == EINTR);
+	/* Full pipe means that the thread is going to wake up anyway. */
+	if (wlen < 0 && !pppoat_io_error_is_recoverable(-errno))
+		pppoat_error("stdio", "Couldn't wake up the thread (errno=%d)",
+			     errno);
+}
+
+/** Writes all vectors, the last written vector may be partial. */
+static int if_fd_writev(int fd, struct iovec *iov, unsigned nr)
+{
+	ssize_t wlen;
+	int     rc = 0;
+
+	while (rc == 0 && nr > 0) {
+		wlen = writev(fd, iov, (int)nr);
+		if (wlen < 0) {
+			rc = -errno;
+			if (rc == -EINTR)
+				rc = 0;
+			else if (pppoat_io_error_is_recoverable(rc))
+				rc = pppoat_io_select_single_write(fd);
+			else
+				rc = P_ERR(rc);
+			continue;
+		}
+		while (nr > 0 && (size_t)wlen >= iov->iov_len) {
+			wlen -= (ssize_t)iov->iov_len;
+			++iov;
+			--nr;
+		}
+		if (nr > 0) {
+			iov->iov_base = (char *)iov->iov_base + wlen;
+			iov->iov_len -= (size_t)wlen;
+		}
+	}
+	return rc;
+}
+
+/** Writes all packets from the outbound queue. */
+static void if_fd_txq_flush(struct pppoat_module *mod)
+{
+	struct if_fd_ctx     *ctx = mod->m_userdata;
+	struct pppoat_packet *pkts[IF_FD_IOV_NR];
+	struct iovec          iov[IF_FD_IOV_NR];
+	unsigned              nr;
+	unsigned              i;
+	int                   rc;
+
+	pppoat_mutex_lock(&ctx->ifc_wr_lock);
+	do {
+		pppoat_mutex_lock(&ctx->ifc_txq_lock);
+		for (nr = 0; nr < IF_FD_IOV_NR; ++nr) {
+			pkts[nr] = pppoat_list_dequeue(&ctx->ifc_txq);
+			if (pkts[nr] == NULL)
+				break;
+			iov[nr].iov_base = pkts[nr]->pkt_data;
+			iov[nr].iov_len  = pkts[nr]->pkt_size;
+		}
+		ctx->ifc_txq_nr -= nr;
+		pppoat_mutex_unlock(&ctx->ifc_txq_lock);
+
+		rc = nr > 0 ? if_fd_writev(ctx->ifc_wr, iov, nr) : 0;
+		if (rc != 0)
+			pppoat_error("stdio", "Couldn't write %u packets "
+				     "(rc=%d)", nr, rc);
+		for (i = 0; i < nr; ++i)
+			pppoat_packet_put(mod->m_pkts, pkts[i]);
+	} while (nr == IF_FD_IOV_NR);
+	pppoat_mutex_unlock(&ctx->ifc_wr_lock);
+}
+
+static int if_fd_txq_add(struct pppoat_module *mod, struct pppoat_packet *pkt)
+{
+	struct if_fd_ctx *ctx = mod->m_userdata;
+	bool              was_empty;
+	bool              full;
+
+	pppoat_mutex_lock(&ctx->ifc_txq_lock);
+	was_empty = ctx->ifc_txq_nr == 0;
+	pppoat_list_enqueue(&ctx->ifc_txq, pkt);
+	++ctx->ifc_txq_nr;
+	full = ctx->ifc_txq_nr >= IF_FD_TXQ_MAX;
+	pppoat_mutex_unlock(&ctx->ifc_txq_lock);
+
+	/* Stream data can't be dropped, so the caller waits for the writer. */
+	if (full)
+		if_fd_txq_flush(mod);
+	else if (was_empty)
+		if_fd_wake(ctx);
+
+	return 0;
+}
+
 static int if_fd_run(struct pppoat_module *mod)
 {
 	struct if_fd_ctx *ctx = mod->m_userdata;
+	int               rc = 0;
 
 	PPPOAT_ASSERT(if_fd_ctx_invariant(ctx));
 
-	return 0;
+	if (ctx->ifc_stream) {
+		rc = pipe(ctx->ifc_wake);
+		rc = rc == 0 ? 0 : P_ERR(-errno);
+	}
+	if (rc == 0 && ctx->ifc_stream) {
+		(void)pppoat_io_fd_blocking_set(ctx->ifc_wake[0], false);
+		(void)pppoat_io_fd_blocking_set(ctx->ifc_wake[1], false);
+	}
+	return rc;
 }
 
 static int if_fd_stop(struct pppoat_module *mod)
 {
+	struct if_fd_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(if_fd_ctx_invariant(ctx));
+
+	if (ctx->ifc_stream) {
+		if_fd_txq_flush(mod);
+		(void)pppoat_io_close(ctx->ifc_wake[0]);
+		(void)pppoat_io_close(ctx->ifc_wake[1]);
+		ctx->ifc_wake[0] = -1;
+		ctx->ifc_wake[1] = -1;
+	}
 	return 0;
 }
 
@@ -148,6 +418,99 @@ static int if_fd_pkt_get(struct pppoat_module  *mod,
 	return rc;
 }
 
+/**
+ * Waits for input or a wake-up, negative timeout means infinity. After end
+ * of input only the wake-up pipe is watched.
+ */
+static int if_fd_stream_wait(struct if_fd_ctx *ctx,
+			     long              timeout_ms,
+			     bool             *readable)
+{
+	fd_set rfds;
+	int    maxfd = ctx->ifc_wake[0];
+	int    rc;
+
+	FD_ZERO(&rfds);
+	FD_SET(ctx->ifc_wake[0], &rfds);
+	if (!ctx->ifc_eof) {
+		FD_SET(ctx->ifc_rd, &rfds);
+		maxfd = pppoat_max(maxfd, ctx->ifc_rd);
+	}
+	rc = pppoat_io_select_timeout(maxfd, &rfds, NULL, timeout_ms);
+	if (rc == 0 && FD_ISSET(ctx->ifc_wake[0], &rfds))
+		if_fd_wake_drain(ctx);
+	*readable = rc == 0 && !ctx->ifc_eof && FD_ISSET(ctx->ifc_rd, &rfds);
+
+	return rc;
+}
+
+/** Appends available input to the current message. */
+static int if_fd_stream_read(struct pppoat_module *mod)
+{
+	struct if_fd_ctx *ctx = mod->m_userdata;
+	ssize_t           rlen;
+
+	if (ctx->ifc_cur == NULL) {
+		ctx->ifc_cur = pppoat_packet_get(mod->m_pkts,
+						 ctx->ifc_msg_size);
+		if (ctx->ifc_cur == NULL)
+			return P_ERR(-ENOMEM);
+		ctx->ifc_cur_len = 0;
+	}
+	rlen = read(ctx->ifc_rd, (char *)ctx->ifc_cur->pkt_data +
+		    ctx->ifc_cur_len, ctx->ifc_msg_size - ctx->ifc_cur_len);
+	if (rlen < 0)
+		return pppoat_io_error_is_recoverable(-errno) ? 0 :
+		       P_ERR(-errno);
+	if (rlen == 0) {
+		pppoat_info("stdio", "End of input");
+		ctx->ifc_eof = true;
+	}
+	if (rlen > 0 && ctx->ifc_cur_len == 0)
+		ctx->ifc_cur_time = if_fd_now();
+	ctx->ifc_cur_len += (size_t)rlen;
+
+	return 0;
+}
+
+static int if_fd_stream_get(struct pppoat_module  *mod,
+			    struct pppoat_packet **pkt)
+{
+	struct if_fd_ctx *ctx = mod->m_userdata;
+	uint64_t          deadline;
+	uint64_t          now;
+	long              timeout = -1;
+	bool              readable;
+	int               rc;
+
+	*pkt = NULL;
+	if_fd_txq_flush(mod);
+
+	deadline = ctx->ifc_cur_time + ctx->ifc_flush_ms;
+	if (ctx->ifc_cur_len > 0) {
+		now = if_fd_now();
+		timeout = deadline > now ? (long)(deadline - now) : 0;
+	}
+	rc = if_fd_stream_wait(ctx, timeout, &readable);
+	if (rc == 0 && readable)
+		rc = if_fd_stream_read(mod);
+	if (rc != 0 || ctx->ifc_cur_len == 0)
+		return rc;
+
+	deadline = ctx->ifc_cur_time + ctx->ifc_flush_ms;
+	if (ctx->ifc_cur_len < ctx->ifc_msg_size && !ctx->ifc_eof &&
+	    if_fd_now() < deadline)
+		return 0;
+
+	ctx->ifc_cur->pkt_size = ctx->ifc_cur_len;
+	ctx->ifc_cur->pkt_type = PPPOAT_PACKET_SEND;
+	*pkt = ctx->ifc_cur;
+	ctx->ifc_cur     = NULL;
+	ctx->ifc_cur_len = 0;
+
+	return 0;
+}
+
 static int if_fd_process(struct pppoat_module  *mod,
 			 struct pppoat_packet  *pkt,
 			 struct pppoat_packet **next)
@@ -158,12 +521,22 @@ static int if_fd_process(struct pppoat_module  *mod,
 	PPPOAT_ASSERT(if_fd_ctx_invariant(ctx));
 	PPPOAT_ASSERT(imply(pkt != NULL, pkt->pkt_type == PPPOAT_PACKET_RECV));
 
-	if (pkt == NULL)
-		return if_fd_pkt_get(mod, next);
+	if (pkt == NULL) {
+		return ctx->ifc_stream ? if_fd_stream_get(mod, next) :
+					 if_fd_pkt_get(mod, next);
+	}
 
-	rc = pppoat_io_write_sync(ctx->ifc_wr, pkt->pkt_data, pkt->pkt_size);
-	if (rc == 0)
-		pppoat_packet_put(mod->m_pkts, pkt);
+	if (ctx->ifc_zerocopy) {
+		/* The packet is released when the reader consumes it. */
+		rc = pppoat_splice_write(&ctx->ifc_splice, pkt);
+	} else if (ctx->ifc_stream) {
+		rc = if_fd_txq_add(mod, pkt);
+	} else {
+		rc = pppoat_io_write_sync(ctx->ifc_wr, pkt->pkt_data,
+					  pkt->pkt_size);
+		if (rc == 0)
+			pppoat_packet_put(mod->m_pkts, pkt);
+	}
 
 	*next = NULL;
 	return rc;
@@ -171,7 +544,9 @@ static int if_fd_process(struct pppoat_module  *mod,
 
 static size_t if_fd_mtu(struct pppoat_module *mod)
 {
-	return IF_FD_MTU;
+	struct if_fd_ctx *ctx = mod->m_userdata;
+
+	return ctx->ifc_stream ? ctx->ifc_msg_size : IF_FD_MTU;
 }
 
 static struct pppoat_module_ops if_stdio_ops = {
@@ -0,0 +1,850 @@
+/* modules/if_packet.c
+ * PPP over Any Transport -- AF_PACKET interface module
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "trace.h"
+
+#ifdef HAVE_MODULE_PACKET
+
+#include "conf.h"
+#include "io.h"
+#include "memory.h"
+#include "misc.h"
+#include "module.h"
+#include "mutex.h"
+#include "packet.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>		/* sysconf */
+#include <arpa/inet.h>		/* htons */
+#include <net/if.h>		/* if_nametoindex, ifreq */
+#include <net/if_arp.h>		/* ARPHRD_ETHER */
+#include <netinet/in.h>		/* IPPROTO_TCP */
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#define PACKET_CONF_DEV        "packet.dev"
+#define PACKET_CONF_BLOCKS     "packet.blocks"
+#define PACKET_CONF_BLOCK_SIZE "packet.block_size"
+#define PACKET_CONF_TIMEOUT    "packet.timeout"
+#define PACKET_CONF_TX_FRAMES  "packet.tx_frames"
+#define PACKET_CONF_PROMISC    "packet.promisc"
+
+/*
+ * AF_PACKET interface.
+ *
+ * The module attaches to an existing Ethernet device packet.dev, e.g. a
+ * physical port or an end of a veth pair, and bridges its segment into the
+ * tunnel. Frames cross the tunnel with the 4-byte packet information header
+ * of the tap module, so the peer may run either module.
+ *
+ * Received frames are collected by the kernel in a TPACKET_V3 RX ring of
+ * packet.blocks blocks of packet.block_size bytes. The kernel hands over
+ * a block when it's full or packet.timeout ms after the first frame, so a
+ * single wakeup of the blocking worker delivers a burst of frames. Frames
+ * are copied out of the block into pool packets and the block returns to
+ * the kernel as soon as the worker has walked it. VLAN tags which the
+ * device stripped are put back and checksums which the sender left to
+ * offloads, e.g. on a veth, are completed.
+ *
+ * Outbound frames are copied into a free slot of the TX ring of
+ * packet.tx_frames frames and the kernel is kicked by the module's blocking
+ * thread. One send(2) makes the kernel transmit all pending slots. Like
+ * the batched mode of the udp module, the caller wakes up the thread only
+ * when no kick is pending, so under load the thread keeps kicking and
+ * every syscall carries many frames. Frames are dropped when the ring is
+ * full.
+ *
+ * The device is switched to promiscuous mode unless packet.promisc is 0.
+ * Frames which the host sends itself on the device are not forwarded, so
+ * the transport may share it. The kernel hands GRO and TSO super-frames to
+ * the socket as is and they are dropped, disable the offloads on the
+ * device and on the veth peer with "ethtool -K". MTU is the MTU of the
+ * device, the module doesn't change it.
+ */
+
+enum {
+	IF_PACKET_BLOCKS         = 64,
+	IF_PACKET_BLOCKS_MAX     = 4096,
+	IF_PACKET_BLOCK_SIZE     = 1 << 18,
+	IF_PACKET_BLOCK_SIZE_MAX = 1 << 26,
+	IF_PACKET_TIMEOUT_MS     = 1,
+	IF_PACKET_TX_FRAMES      = 1024,
+	IF_PACKET_TX_FRAMES_MAX  = 1 << 16,
+	/** Minimal slot of the TX ring, also frame size of the RX ring. */
+	IF_PACKET_FRAME_MIN      = 2048,
+	IF_PACKET_POLL_MS        = 100,
+	/** Packet information header of the tap module. */
+	IF_PACKET_HDR_SIZE       = 4,
+	/** The compact header of tap frames. */
+	IF_PACKET_COMPACT_MARK   = 0xe0,
+	IF_PACKET_VLAN_HLEN      = 4,
+	IF_PACKET_ETH_VLAN       = 0x8100,
+	IF_PACKET_ETH_IP         = 0x0800,
+	IF_PACKET_ETH_IP6        = 0x86dd,
+};
+
+/** Offset of the data in a TX slot, see tpacket_parse_header(). */
+#define IF_PACKET_TX_DATA TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct if_packet_ctx {
+	char                *pc_dev;
+	int                  pc_ifindex;
+	size_t               pc_mtu;
+	/** Ethernet frame with a VLAN tag. */
+	size_t               pc_frame_max;
+	bool                 pc_promisc;
+	int                  pc_sock;
+	uint8_t             *pc_map;
+	size_t               pc_map_len;
+	/* RX ring, accessed by the blocking worker only. */
+	unsigned             pc_blocks_nr;
+	size_t               pc_block_size;
+	unsigned             pc_timeout;
+	unsigned             pc_block_cur;
+	/** Next frame of the current block, NULL if no block is open. */
+	struct tpacket3_hdr *pc_rx_next;
+	uint32_t             pc_rx_left;
+	/* TX ring, follows the RX ring in pc_map. */
+	uint8_t             *pc_tx;
+	unsigned             pc_tx_nr;
+	size_t               pc_tx_frame_size;
+	size_t               pc_tx_block_size;
+	unsigned             pc_tx_per_block;
+	unsigned             pc_tx_head;
+	/** Frames added since the last kick. */
+	unsigned             pc_tx_pending;
+	/** The blocking thread is kicking the kernel. */
+	bool                 pc_tx_kicking;
+	/** Pipe which wakes up the blocking thread to kick the kernel. */
+	int                  pc_wake[2];
+	/** Protects the TX ring and TX counters. */
+	struct pppoat_mutex  pc_tx_lock;
+	uint64_t             pc_rx_pkts;
+	uint64_t             pc_rx_drops;
+	uint64_t             pc_tx_pkts;
+	uint64_t             pc_tx_drops;
+	uint64_t             pc_tx_kicks;
+	uint64_t             pc_kernel_drops;
+};
+
+static bool if_packet_ctx_invariant(struct if_packet_ctx *ctx)
+{
+	return ctx != NULL && ctx->pc_sock >= 0 && ctx->pc_map != NULL;
+}
+
+static size_t if_packet_pow2_roundup(size_t val)
+{
+	size_t result = 1;
+
+	while (result < val)
+		result <<= 1;
+	return result;
+}
+
+static bool if_packet_is_pow2(long val)
+{
+	return val > 0 && (val & (val - 1)) == 0;
+}
+
+static uint32_t if_packet_csum_add(uint32_t       sum,
+				   const uint8_t *buf,
+				   size_t         len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (uint32_t)buf[i] << 8 | buf[i + 1];
+	if (len % 2 != 0)
+		sum += (uint32_t)buf[len - 1] << 8;
+	return sum;
+}
+
+/**
+ * Completes TCP or UDP checksum of a frame which the sender left to the
+ * device. The kernel reports only that the checksum isn't ready, so the
+ * transport header is found from the IP header. IPv6 extension headers
+ * and fragments are left as is.
+ */
+static void if_packet_csum_fix(uint8_t *frame, size_t len)
+{
+	uint8_t  *ip    = frame + ETH_HLEN;
+	uint8_t  *l4;
+	size_t    iplen = len - ETH_HLEN;
+	size_t    hlen;
+	size_t    l4len;
+	size_t    off;
+	unsigned  type;
+	uint8_t   proto;
+	uint32_t  sum;
+
+	type = (unsigned)frame[12] << 8 | frame[13];
+	if (type == IF_PACKET_ETH_VLAN &&
+	    len >= ETH_HLEN + IF_PACKET_VLAN_HLEN) {
+		type   = (unsigned)frame[16] << 8 | frame[17];
+		ip    += IF_PACKET_VLAN_HLEN;
+		iplen -= IF_PACKET_VLAN_HLEN;
+	}
+	if (type == IF_PACKET_ETH_IP && iplen >= 20 && ip[0] >> 4 == 4) {
+		hlen  = (ip[0] & 0x0f) * 4;
+		l4len = ((size_t)ip[2] << 8 | ip[3]);
+		if (hlen < 20 || l4len > iplen || l4len < hlen ||
+		    (ip[6] & 0x3f) != 0 || ip[7] != 0)
+			return;
+		l4len -= hlen;
+		proto  = ip[9];
+		sum    = if_packet_csum_add(0, ip + 12, 8);
+	} else if (type == IF_PACKET_ETH_IP6 && iplen >= 40 &&
+		   ip[0] >> 4 == 6) {
+		hlen  = 40;
+		l4len = ((size_t)ip[4] << 8 | ip[5]);
+		if (l4len > iplen - hlen)
+			return;
+		proto = ip[6];
+		sum   = if_packet_csum_add(0, ip + 8, 32);
+	} else
+		return;
+
+	off = proto == IPPROTO_TCP ? 16 : proto == IPPROTO_UDP ? 6 : 0;
+	if (off == 0 || l4len < off + 2)
+		return;
+	l4 = ip + hlen;
+	sum += proto + (uint32_t)l4len;
+	l4[off] = l4[off + 1] = 0;
+	sum = if_packet_csum_add(sum, l4, l4len);
+	while (sum >> 16 != 0)
+		sum = (sum & 0xffff) + (sum >> 16);
+	/* Zero means "no checksum" for UDP, the other form is equivalent. */
+	sum = (~sum & 0xffff) ?: 0xffff;
+	l4[off]     = sum >> 8;
+	l4[off + 1] = sum & 0xff;
+}
+
+static uint8_t *if_packet_tx_slot(struct if_packet_ctx *ctx, unsigned i)
+{
+	return ctx->pc_tx +
+	       (size_t)(i / ctx->pc_tx_per_block) * ctx->pc_tx_block_size +
+	       (size_t)(i % ctx->pc_tx_per_block) * ctx->pc_tx_frame_size;
+}
+
+static void if_packet_wake_drain(struct if_packet_ctx *ctx)
+{
+	char    buf[64];
+	ssize_t rlen;
+
+	do {
+		rlen = read(ctx->pc_wake[0], buf, sizeof buf);
+	} while (rlen > 0 || (rlen < 0 && errno == EINTR));
+}
+
+static void if_packet_wake(struct if_packet_ctx *ctx)
+{
+	ssize_t wlen;
+
+	do {
+		wlen = write(ctx->pc_wake[1], "w", 1);
+	} while (wlen < 0 && errno == EINTR);
+	/* Full pipe means that the thread is going to wake up anyway. */
+	if (wlen < 0 && !pppoat_io_error_is_recoverable(-errno))
+		pppoat_error("packet", "Couldn't wake up the thread "
+			     "(errno=%d)", errno);
+}
+
+/**
+ * Makes the kernel send pending slots. Called only from the module's
+ * blocking thread, repeats while other threads add frames.
+ */
+static void if_packet_tx_flush(struct if_packet_ctx *ctx)
+{
+	ssize_t rc = 0;
+
+	pppoat_mutex_lock(&ctx->pc_tx_lock);
+	ctx->pc_tx_kicking = true;
+	while (ctx->pc_tx_pending > 0) {
+		ctx->pc_tx_pending = 0;
+		++ctx->pc_tx_kicks;
+		pppoat_mutex_unlock(&ctx->pc_tx_lock);
+		rc = send(ctx->pc_sock, NULL, 0, MSG_DONTWAIT);
+		/* The device is busy or down, the slots wait for next kick. */
+		if (rc < 0 && !(errno == EAGAIN || errno == ENOBUFS ||
+				errno == ENETDOWN || errno == ENXIO)) {
+			pppoat_error("packet", "Couldn't send frames "
+				     "(errno=%d)", errno);
+		}
+		pppoat_mutex_lock(&ctx->pc_tx_lock);
+	}
+	ctx->pc_tx_kicking = false;
+	pppoat_mutex_unlock(&ctx->pc_tx_lock);
+}
+
+static bool if_packet_tx_is_pending(struct if_packet_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->pc_tx_pending, __ATOMIC_RELAXED) > 0;
+}
+
+static void if_packet_send(struct if_packet_ctx *ctx,
+			   const uint8_t        *frame,
+			   size_t                len)
+{
+	struct tpacket3_hdr *hdr;
+	uint8_t             *slot;
+	bool                 wake = false;
+
+	pppoat_mutex_lock(&ctx->pc_tx_lock);
+	slot = if_packet_tx_slot(ctx, ctx->pc_tx_head);
+	hdr  = (struct tpacket3_hdr *)slot;
+	if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+	    TP_STATUS_AVAILABLE) {
+		++ctx->pc_tx_drops;
+		goto unlock;
+	}
+	memcpy(slot + IF_PACKET_TX_DATA, frame, len);
+	hdr->tp_len         = len;
+	hdr->tp_snaplen     = len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+			 __ATOMIC_RELEASE);
+	ctx->pc_tx_head = (ctx->pc_tx_head + 1) % ctx->pc_tx_nr;
+	++ctx->pc_tx_pkts;
+	/* A kicking or already woken thread picks up the slot. */
+	wake = ctx->pc_tx_pending++ == 0 && !ctx->pc_tx_kicking;
+unlock:
+	pppoat_mutex_unlock(&ctx->pc_tx_lock);
+
+	if (wake)
+		if_packet_wake(ctx);
+}
+
+static struct tpacket_block_desc *if_packet_block(struct if_packet_ctx *ctx,
+						  unsigned              i)
+{
+	return (struct tpacket_block_desc *)(ctx->pc_map +
+					     (size_t)i * ctx->pc_block_size);
+}
+
+/** Returns the current block to the kernel. */
+static void if_packet_block_release(struct if_packet_ctx *ctx)
+{
+	struct tpacket_block_desc *bd = if_packet_block(ctx, ctx->pc_block_cur);
+
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+			 __ATOMIC_RELEASE);
+	ctx->pc_block_cur = (ctx->pc_block_cur + 1) % ctx->pc_blocks_nr;
+	ctx->pc_rx_next   = NULL;
+	ctx->pc_rx_left   = 0;
+}
+
+/** Opens the current block if the kernel has handed it over. */
+static bool if_packet_block_open(struct if_packet_ctx *ctx)
+{
+	struct tpacket_block_desc *bd = if_packet_block(ctx, ctx->pc_block_cur);
+
+	if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+	     TP_STATUS_USER) == 0)
+		return false;
+
+	ctx->pc_rx_next = (struct tpacket3_hdr *)((uint8_t *)bd +
+					bd->hdr.bh1.offset_to_first_pkt);
+	ctx->pc_rx_left = bd->hdr.bh1.num_pkts;
+	return true;
+}
+
+/**
+ * Copies a frame of the RX ring into a packet with the packet information
+ * header. Sets `pkt' to NULL if the frame is dropped.
+ */
+static int if_packet_frame_accept(struct pppoat_module      *mod,
+				  const struct tpacket3_hdr *hdr,
+				  struct pppoat_packet     **pkt)
+{
+	struct if_packet_ctx     *ctx = mod->m_userdata;
+	const struct sockaddr_ll *sll;
+	const uint8_t            *frame;
+	struct pppoat_packet     *pkt2;
+	uint8_t                  *data;
+	size_t                    vlan;
+	size_t                    len;
+	unsigned                  tpid;
+
+	*pkt = NULL;
+	sll = (const struct sockaddr_ll *)((const uint8_t *)hdr +
+					   TPACKET_ALIGN(sizeof *hdr));
+	if (sll->sll_pkttype == PACKET_OUTGOING)
+		return 0;
+
+	len  = hdr->tp_snaplen;
+	vlan = (hdr->tp_status & TP_STATUS_VLAN_VALID) != 0 ?
+	       IF_PACKET_VLAN_HLEN : 0;
+	if (len != hdr->tp_len || len < ETH_HLEN ||
+	    len + vlan > ctx->pc_frame_max) {
+		++ctx->pc_rx_drops;
+		return 0;
+	}
+	pkt2 = pppoat_packet_get(mod->m_pkts, IF_PACKET_HDR_SIZE + vlan + len);
+	if (pkt2 == NULL)
+		return P_ERR(-ENOMEM);
+
+	frame = (const uint8_t *)hdr + hdr->tp_mac;
+	data  = (uint8_t *)pkt2->pkt_data + IF_PACKET_HDR_SIZE;
+	memcpy(data, frame, 12);
+	if (vlan != 0) {
+		tpid = (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) != 0 ?
+		       hdr->hv1.tp_vlan_tpid : IF_PACKET_ETH_VLAN;
+		data[12] = tpid >> 8;
+		data[13] = tpid & 0xff;
+		data[14] = hdr->hv1.tp_vlan_tci >> 8;
+		data[15] = hdr->hv1.tp_vlan_tci & 0xff;
+	}
+	memcpy(data + 12 + vlan, frame + 12, len - 12);
+	len += vlan;
+	if ((hdr->tp_status & TP_STATUS_CSUMNOTREADY) != 0)
+		if_packet_csum_fix(data, len);
+
+	data -= IF_PACKET_HDR_SIZE;
+	data[0] = 0;
+	data[1] = 0;
+	data[2] = data[IF_PACKET_HDR_SIZE + 12];
+	data[3] = data[IF_PACKET_HDR_SIZE + 13];
+	pkt2->pkt_size = IF_PACKET_HDR_SIZE + len;
+	pkt2->pkt_type = PPPOAT_PACKET_SEND;
+	++ctx->pc_rx_pkts;
+	*pkt = pkt2;
+
+	return 0;
+}
+
+static int if_packet_pkt_get(struct pppoat_module  *mod,
+			     struct pppoat_packet **pkt)
+{
+	struct if_packet_ctx *ctx = mod->m_userdata;
+	struct tpacket3_hdr  *hdr;
+	fd_set                rfds;
+	int                   maxfd;
+	int                   rc;
+
+	maxfd = pppoat_max(ctx->pc_sock, ctx->pc_wake[0]);
+	*pkt = NULL;
+	while (true) {
+		if (if_packet_tx_is_pending(ctx))
+			if_packet_tx_flush(ctx);
+		if (ctx->pc_rx_left == 0 && ctx->pc_rx_next != NULL)
+			if_packet_block_release(ctx);
+		if (ctx->pc_rx_next == NULL && !if_packet_block_open(ctx)) {
+			/* The kernel marks the socket readable per block. */
+			FD_ZERO(&rfds);
+			FD_SET(ctx->pc_sock, &rfds);
+			FD_SET(ctx->pc_wake[0], &rfds);
+			rc = pppoat_io_select_timeout(maxfd, &rfds, NULL,
+						      IF_PACKET_POLL_MS);
+			if (rc != 0)
+				return rc;
+			if (FD_ISSET(ctx->pc_wake[0], &rfds)) {
+				if_packet_wake_drain(ctx);
+				if_packet_tx_flush(ctx);
+			}
+			if (!if_packet_block_open(ctx))
+				return 0;
+		}
+		if (ctx->pc_rx_left == 0)
+			continue;
+
+		hdr = ctx->pc_rx_next;
+		ctx->pc_rx_next = (struct tpacket3_hdr *)((uint8_t *)hdr +
+							  hdr->tp_next_offset);
+		--ctx->pc_rx_left;
+		rc = if_packet_frame_accept(mod, hdr, pkt);
+		if (rc != 0 || *pkt != NULL)
+			return rc;
+	}
+}
+
+static int if_packet_ifreq(struct if_packet_ctx *ctx,
+			   unsigned long         req,
+			   struct ifreq         *ifr)
+{
+	int sock;
+	int rc;
+
+	memset(ifr, 0, sizeof *ifr);
+	strncpy(ifr->ifr_name, ctx->pc_dev, sizeof(ifr->ifr_name) - 1);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return P_ERR(-errno);
+	rc = ioctl(sock, req, ifr);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	(void)pppoat_io_close(sock);
+
+	return rc;
+}
+
+static int if_packet_dev_init(struct if_packet_ctx *ctx)
+{
+	struct ifreq ifr;
+	int          rc;
+
+	ctx->pc_ifindex = if_nametoindex(ctx->pc_dev);
+	if (ctx->pc_ifindex == 0) {
+		pppoat_error("packet", "Unknown device %s.", ctx->pc_dev);
+		return P_ERR(-ENODEV);
+	}
+	rc = if_packet_ifreq(ctx, SIOCGIFHWADDR, &ifr);
+	if (rc == 0 && ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		pppoat_error("packet", "%s is not an Ethernet device.",
+			     ctx->pc_dev);
+		rc = P_ERR(-EINVAL);
+	}
+	rc = rc ?: if_packet_ifreq(ctx, SIOCGIFMTU, &ifr);
+	if (rc != 0)
+		return rc;
+	ctx->pc_mtu       = ifr.ifr_mtu;
+	ctx->pc_frame_max = ETH_HLEN + IF_PACKET_VLAN_HLEN + ctx->pc_mtu;
+
+	return 0;
+}
+
+static int if_packet_conf_long(struct pppoat_conf *conf,
+			       const char         *key,
+			       long                min,
+			       long                max,
+			       long               *val)
+{
+	int rc;
+
+	rc = pppoat_conf_find_long(conf, key, val);
+	if (rc == 0 && (*val < min || *val > max)) {
+		pppoat_error("packet", "%s must be in range %ld..%ld.", key,
+			     min, max);
+		rc = P_ERR(-EINVAL);
+	}
+	return rc == -ENOENT ? 0 : rc;
+}
+
+static int if_packet_conf_parse(struct if_packet_ctx *ctx,
+				struct pppoat_conf   *conf)
+{
+	long blocks     = IF_PACKET_BLOCKS;
+	long block_size = IF_PACKET_BLOCK_SIZE;
+	long timeout    = IF_PACKET_TIMEOUT_MS;
+	long tx_frames  = IF_PACKET_TX_FRAMES;
+	long page       = sysconf(_SC_PAGESIZE);
+	int  rc;
+
+	rc = pppoat_conf_find_string_alloc(conf, PACKET_CONF_DEV,
+					   &ctx->pc_dev);
+	if (rc == -ENOENT)
+		pppoat_error("packet", "Device is not set.");
+	rc = rc ?: if_packet_conf_long(conf, PACKET_CONF_BLOCKS, 2,
+				       IF_PACKET_BLOCKS_MAX, &blocks);
+	rc = rc ?: if_packet_conf_long(conf, PACKET_CONF_BLOCK_SIZE,
+				       IF_PACKET_FRAME_MIN,
+				       IF_PACKET_BLOCK_SIZE_MAX, &block_size);
+	rc = rc ?: if_packet_conf_long(conf, PACKET_CONF_TIMEOUT, 1, 1000,
+				       &timeout);
+	rc = rc ?: if_packet_conf_long(conf, PACKET_CONF_TX_FRAMES, 2,
+				       IF_PACKET_TX_FRAMES_MAX, &tx_frames);
+	if (rc != 0)
+		return rc;
+	if (!if_packet_is_pow2(block_size) || block_size < page) {
+		pppoat_error("packet", "Block size must be a power of 2 and "
+			     "at least the page size.");
+		return P_ERR(-EINVAL);
+	}
+	ctx->pc_blocks_nr  = (unsigned)blocks;
+	ctx->pc_block_size = (size_t)block_size;
+	ctx->pc_timeout    = (unsigned)timeout;
+	ctx->pc_tx_nr      = (unsigned)tx_frames;
+
+	pppoat_conf_find_bool(conf, PACKET_CONF_PROMISC, &ctx->pc_promisc);
+
+	return 0;
+}
+
+static int if_packet_sockopt(struct if_packet_ctx *ctx,
+			     int                   opt,
+			     const void           *val,
+			     socklen_t             len)
+{
+	int rc;
+
+	rc = setsockopt(ctx->pc_sock, SOL_PACKET, opt, val, len);
+	return rc < 0 ? P_ERR(-errno) : 0;
+}
+
+static int if_packet_rings_init(struct if_packet_ctx *ctx)
+{
+	struct tpacket_req3 rx;
+	struct tpacket_req3 tx;
+	size_t              page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t              rx_len;
+	int                 version = TPACKET_V3;
+	int                 one = 1;
+	int                 rc;
+
+	rc = if_packet_sockopt(ctx, PACKET_VERSION, &version, sizeof version);
+	/* Malformed frames of the TX ring are skipped instead of blocking. */
+	rc = rc ?: if_packet_sockopt(ctx, PACKET_LOSS, &one, sizeof one);
+	if (rc != 0)
+		return rc;
+#ifdef PACKET_IGNORE_OUTGOING
+	/* Saves the ring, outgoing frames are also dropped by the module. */
+	(void)if_packet_sockopt(ctx, PACKET_IGNORE_OUTGOING, &one, sizeof one);
+#endif
+
+	memset(&rx, 0, sizeof rx);
+	rx.tp_block_size     = ctx->pc_block_size;
+	rx.tp_block_nr       = ctx->pc_blocks_nr;
+	rx.tp_frame_size     = IF_PACKET_FRAME_MIN;
+	rx.tp_frame_nr       = ctx->pc_block_size / IF_PACKET_FRAME_MIN *
+			       ctx->pc_blocks_nr;
+	rx.tp_retire_blk_tov = ctx->pc_timeout;
+
+	ctx->pc_tx_frame_size = if_packet_pow2_roundup(pppoat_max(
+				IF_PACKET_TX_DATA + ctx->pc_frame_max,
+				(size_t)IF_PACKET_FRAME_MIN));
+	ctx->pc_tx_block_size = pppoat_max(ctx->pc_tx_frame_size, page);
+	ctx->pc_tx_per_block  = ctx->pc_tx_block_size / ctx->pc_tx_frame_size;
+	ctx->pc_tx_nr = (ctx->pc_tx_nr + ctx->pc_tx_per_block - 1) /
+			ctx->pc_tx_per_block * ctx->pc_tx_per_block;
+	memset(&tx, 0, sizeof tx);
+	tx.tp_block_size = ctx->pc_tx_block_size;
+	tx.tp_block_nr   = ctx->pc_tx_nr / ctx->pc_tx_per_block;
+	tx.tp_frame_size = ctx->pc_tx_frame_size;
+	tx.tp_frame_nr   = ctx->pc_tx_nr;
+
+	rc = if_packet_sockopt(ctx, PACKET_RX_RING, &rx, sizeof rx);
+	rc = rc ?: if_packet_sockopt(ctx, PACKET_TX_RING, &tx, sizeof tx);
+	if (rc != 0) {
+		pppoat_error("packet", "Can't set up TPACKET_V3 rings: %s",
+			     strerror(-rc));
+		return rc;
+	}
+
+	/* Both rings are mapped at once, TX follows RX. */
+	rx_len = ctx->pc_block_size * ctx->pc_blocks_nr;
+	ctx->pc_map_len = rx_len + ctx->pc_tx_block_size * tx.tp_block_nr;
+	ctx->pc_map = mmap(NULL, ctx->pc_map_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ctx->pc_sock, 0);
+	if (ctx->pc_map == MAP_FAILED) {
+		ctx->pc_map = NULL;
+		return P_ERR(-errno);
+	}
+	ctx->pc_tx = ctx->pc_map + rx_len;
+
+	return 0;
+}
+
+static int if_packet_sock_bind(struct if_packet_ctx *ctx)
+{
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+	int                rc;
+
+	memset(&sll, 0, sizeof sll);
+	sll.sll_family   = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex  = ctx->pc_ifindex;
+	rc = bind(ctx->pc_sock, (struct sockaddr *)&sll, sizeof sll);
+	if (rc < 0) {
+		rc = P_ERR(-errno);
+		pppoat_error("packet", "Can't bind to %s: %s", ctx->pc_dev,
+			     strerror(-rc));
+		return rc;
+	}
+	if (ctx->pc_promisc) {
+		/* The membership is dropped when the socket is closed. */
+		memset(&mreq, 0, sizeof mreq);
+		mreq.mr_ifindex = ctx->pc_ifindex;
+		mreq.mr_type    = PACKET_MR_PROMISC;
+		rc = if_packet_sockopt(ctx, PACKET_ADD_MEMBERSHIP, &mreq,
+				       sizeof mreq);
+	}
+	return rc;
+}
+
+static void if_packet_ctx_release(struct if_packet_ctx *ctx)
+{
+	if (ctx->pc_map != NULL)
+		(void)munmap(ctx->pc_map, ctx->pc_map_len);
+	if (ctx->pc_sock >= 0)
+		(void)pppoat_io_close(ctx->pc_sock);
+	if (ctx->pc_wake[0] >= 0) {
+		(void)pppoat_io_close(ctx->pc_wake[0]);
+		(void)pppoat_io_close(ctx->pc_wake[1]);
+	}
+	pppoat_free(ctx->pc_dev);
+	pppoat_mutex_fini(&ctx->pc_tx_lock);
+	pppoat_free(ctx);
+}
+
+static int if_packet_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+{
+	struct if_packet_ctx *ctx;
+	int                   rc;
+
+	ctx = pppoat_alloc(sizeof *ctx);
+	if (ctx == NULL)
+		return P_ERR(-ENOMEM);
+
+	memset(ctx, 0, sizeof *ctx);
+	ctx->pc_sock    = -1;
+	ctx->pc_wake[0] = -1;
+	ctx->pc_wake[1] = -1;
+	ctx->pc_promisc = true;
+	pppoat_mutex_init(&ctx->pc_tx_lock);
+
+	rc = if_packet_conf_parse(ctx, conf);
+	rc = rc ?: if_packet_dev_init(ctx);
+	if (rc == 0) {
+		rc = pipe(ctx->pc_wake) == 0 ? 0 : P_ERR(-errno);
+		if (rc == 0) {
+			(void)pppoat_io_fd_blocking_set(ctx->pc_wake[0], false);
+			(void)pppoat_io_fd_blocking_set(ctx->pc_wake[1], false);
+		}
+	}
+	if (rc == 0) {
+		/* No protocol until the rings are set up, see bind(). */
+		ctx->pc_sock = socket(AF_PACKET, SOCK_RAW, 0);
+		rc = ctx->pc_sock < 0 ? P_ERR(-errno) : 0;
+	}
+	rc = rc ?: if_packet_rings_init(ctx);
+	rc = rc ?: if_packet_sock_bind(ctx);
+	if (rc != 0) {
+		if_packet_ctx_release(ctx);
+		return rc;
+	}
+
+	pppoat_debug("packet", "Attached to %s, MTU %zu, %u blocks of %zu "
+		     "bytes, %u TX frames", ctx->pc_dev, ctx->pc_mtu,
+		     ctx->pc_blocks_nr, ctx->pc_block_size, ctx->pc_tx_nr);
+	mod->m_userdata = ctx;
+
+	return 0;
+}
+
+static void if_packet_fini(struct pppoat_module *mod)
+{
+	struct if_packet_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(if_packet_ctx_invariant(ctx));
+
+	if_packet_ctx_release(ctx);
+}
+
+static int if_packet_run(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static int if_packet_stop(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static int if_packet_process(struct pppoat_module  *mod,
+			     struct pppoat_packet  *pkt,
+			     struct pppoat_packet **next)
+{
+	struct if_packet_ctx *ctx = mod->m_userdata;
+	const uint8_t        *data;
+	size_t                hlen;
+	size_t                len;
+
+	PPPOAT_ASSERT(if_packet_ctx_invariant(ctx));
+	PPPOAT_ASSERT(imply(pkt != NULL, pkt->pkt_type == PPPOAT_PACKET_RECV));
+
+	if (pkt == NULL)
+		return if_packet_pkt_get(mod, next);
+
+	*next = NULL;
+	data = pkt->pkt_data;
+	/* Peers with tap.no_pi may send the compact header. */
+	hlen = pkt->pkt_size > 0 && data[0] == IF_PACKET_COMPACT_MARK ? 1 :
+	       IF_PACKET_HDR_SIZE;
+	len  = pkt->pkt_size - pppoat_min(hlen, pkt->pkt_size);
+	if ((hlen == IF_PACKET_HDR_SIZE && len > 0 && data[0] != 0) ||
+	    len < ETH_HLEN || len > ctx->pc_frame_max) {
+		pppoat_debug("packet", "Dropped packet of unknown format");
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	if_packet_send(ctx, data + hlen, len);
+	pppoat_packet_put(mod->m_pkts, pkt);
+
+	return 0;
+}
+
+static size_t if_packet_mtu(struct pppoat_module *mod)
+{
+	struct if_packet_ctx *ctx = mod->m_userdata;
+
+	return ctx->pc_mtu;
+}
+
+static void if_packet_stats(struct pppoat_module *mod)
+{
+	struct if_packet_ctx     *ctx = mod->m_userdata;
+	struct tpacket_stats_v3   st;
+	socklen_t                 len = sizeof st;
+	uint64_t                  tx_pkts;
+	uint64_t                  tx_drops;
+	uint64_t                  tx_kicks;
+
+	pppoat_mutex_lock(&ctx->pc_tx_lock);
+	tx_pkts  = ctx->pc_tx_pkts;
+	tx_drops = ctx->pc_tx_drops;
+	tx_kicks = ctx->pc_tx_kicks;
+	pppoat_mutex_unlock(&ctx->pc_tx_lock);
+	/* The kernel resets its counters on every read. */
+	if (getsockopt(ctx->pc_sock, SOL_PACKET, PACKET_STATISTICS, &st,
+		       &len) == 0)
+		ctx->pc_kernel_drops += st.tp_drops;
+
+	pppoat_info("packet", "Received: %" PRIu64 ", dropped: %" PRIu64
+		    ", kernel drops: %" PRIu64, ctx->pc_rx_pkts,
+		    ctx->pc_rx_drops, ctx->pc_kernel_drops);
+	pppoat_info("packet", "Sent: %" PRIu64 ", dropped: %" PRIu64
+		    ", kicks: %" PRIu64, tx_pkts, tx_drops, tx_kicks);
+}
+
+static struct pppoat_module_ops if_packet_ops = {
+	.mop_init    = &if_packet_init,
+	.mop_fini    = &if_packet_fini,
+	.mop_run     = &if_packet_run,
+	.mop_stop    = &if_packet_stop,
+	.mop_process = &if_packet_process,
+	.mop_mtu     = &if_packet_mtu,
+	.mop_stats   = &if_packet_stats,
+};
+
+struct pppoat_module_impl pppoat_module_if_packet = {
+	.mod_name  = "packet",
+	.mod_descr = "AF_PACKET interface",
+	.mod_type  = PPPOAT_MODULE_INTERFACE,
+	.mod_ops   = &if_packet_ops,
+	.mod_props = PPPOAT_MODULE_BLOCKING,
+};
+
+#endif /* HAVE_MODULE_PACKET */
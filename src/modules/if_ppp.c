@@ -0,0 +1,772 @@
+/* modules/if_ppp.c
+ * PPP over Any Transport -- Native PPP interface module
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "trace.h"
+
+#ifdef HAVE_MODULE_PPP
+
+#include "conf.h"
+#include "hdlc.h"
+#include "io.h"
+#include "list.h"
+#include "magic.h"
+#include "memory.h"
+#include "misc.h"
+#include "module.h"
+#include "mutex.h"
+#include "packet.h"
+#include "ppp.h"
+
+#include <errno.h>
+#include <fcntl.h>		/* O_RDWR */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>		/* inet_pton */
+#include <net/if.h>		/* ifreq */
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_tun.h>	/* TUNSETIFF */
+
+#define PPP_CONF_IP     "ppp.ip"
+#define PPP_CONF_IPV6   "ppp.ipv6"
+#define PPP_CONF_MRU    "ppp.mru"
+#define PPP_CONF_IFNAME "ppp.ifname"
+
+/*
+ * Native PPP interface.
+ *
+ * The module speaks PPP itself instead of running pppd: the engine in
+ * ppp.c negotiates LCP, IPCP and, with ppp.ipv6, IPV6CP, and IP packets
+ * go to a TUN device which the module configures when a network protocol
+ * comes up. The tunnel carries the asynchronous HDLC-like byte stream of
+ * the pppd module, so the peer may run either module, or pppd on a tty.
+ *
+ * ppp.ip has the format of pppd: "<local>:<remote>", either address may
+ * be omitted and then the peer suggests it. Without addresses the module
+ * waits for the peer to assign them, like `pppd passive'.
+ *
+ * Frames from the TUN device are encoded by the blocking thread. Control
+ * frames, which the engine sends from any thread, are queued and the
+ * thread is woken up to send them. Encoded frames larger than MTU of the
+ * transport are split, the receiver reassembles the stream anyway.
+ */
+
+enum {
+	IF_PPP_MTU  = 1500,
+	/** Largest MRU, also the TUN read buffer. */
+	IF_PPP_MRU_MAX = PPPOAT_PPP_MRU_DEFAULT,
+	IF_PPP_IFID_PREFIX = 64,
+};
+
+/** in6_ifreq of <linux/ipv6.h>, which conflicts with <netinet/in.h>. */
+struct if_ppp_in6_ifreq {
+	struct in6_addr ifr6_addr;
+	uint32_t        ifr6_prefixlen;
+	int             ifr6_ifindex;
+};
+
+struct if_ppp_ctx {
+	int                         ipc_fd;
+	char                        ipc_ifname[IFNAMSIZ];
+	int                         ipc_ifindex;
+	struct pppoat_module       *ipc_mod;
+	/** Protects the engine and ipc_ctlq. */
+	struct pppoat_mutex         ipc_lock;
+	struct pppoat_ppp           ipc_ppp;
+	/** Encoded control frames for the blocking thread. */
+	struct pppoat_list          ipc_ctlq;
+	/** Pipe which wakes up the blocking thread to send ipc_ctlq. */
+	int                         ipc_wake[2];
+	struct pppoat_mutex         ipc_rx_lock;
+	struct pppoat_hdlc_decoder  ipc_dec;
+	/* Owned by the blocking thread. */
+	uint8_t                    *ipc_buf;
+	/** Rest of the last frame which didn't fit MTU of the transport. */
+	struct pppoat_list          ipc_segs;
+	size_t                      ipc_mtu;
+	uint64_t                    ipc_tx_frames;
+	uint64_t                    ipc_tx_drops;
+	uint64_t                    ipc_rx_drops;
+};
+
+static struct pppoat_list_descr if_ppp_pktq_descr =
+	PPPOAT_LIST_DESCR("PPP frames", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_MODULE_IF_PPP_PKTQ_MAGIC);
+
+static bool if_ppp_ctx_invariant(const struct if_ppp_ctx *ctx)
+{
+	return ctx != NULL && ctx->ipc_fd >= 0;
+}
+
+static uint64_t if_ppp_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t if_ppp_seed(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec) ^
+	       (uint64_t)getpid() << 32;
+}
+
+static void if_ppp_wake_drain(struct if_ppp_ctx *ctx)
+{
+	char    buf[64];
+	ssize_t rlen;
+
+	do {
+		rlen = read(ctx->ipc_wake[0], buf, sizeof buf);
+	} while (rlen > 0 || (rlen < 0 && errno == EINTR));
+}
+
+static void if_ppp_wake(struct if_ppp_ctx *ctx)
+{
+	ssize_t wlen;
+
+	do {
+		wlen = write(ctx->ipc_wake[1], "w", 1);
+	} while (wlen < 0 && errno == EINTR);
+	/* Full pipe means that the thread is going to wake up anyway. */
+	if (wlen < 0 && !pppoat_io_error_is_recoverable(-errno))
+		pppoat_error("ppp", "Couldn't wake up the thread (errno=%d)",
+			     errno);
+}
+
+/* --------------------------------------------------------------------------
+ *  Configuration of the TUN device.
+ * -------------------------------------------------------------------------- */
+
+static int if_ppp_ioctl(int family, unsigned long req, void *arg)
+{
+	int sock;
+	int rc;
+
+	sock = socket(family, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return P_ERR(-errno);
+	rc = ioctl(sock, req, arg);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	(void)close(sock);
+
+	return rc;
+}
+
+static void if_ppp_ifreq_init(struct if_ppp_ctx *ctx, struct ifreq *ifr)
+{
+	memset(ifr, 0, sizeof *ifr);
+	strncpy(ifr->ifr_name, ctx->ipc_ifname, sizeof(ifr->ifr_name) - 1);
+}
+
+static int if_ppp_ip4_set(struct if_ppp_ctx *ctx,
+			  unsigned long      req,
+			  uint32_t           addr)
+{
+	struct sockaddr_in *sin;
+	struct ifreq        ifr;
+
+	if_ppp_ifreq_init(ctx, &ifr);
+	sin = (struct sockaddr_in *)&ifr.ifr_addr;
+	sin->sin_family      = AF_INET;
+	sin->sin_addr.s_addr = addr;
+
+	return if_ppp_ioctl(AF_INET, req, &ifr);
+}
+
+static int if_ppp_ip6_set(struct if_ppp_ctx *ctx,
+			  unsigned long      req,
+			  const uint8_t     *ifid)
+{
+	struct if_ppp_in6_ifreq ifr6 = {
+		.ifr6_prefixlen = IF_PPP_IFID_PREFIX,
+		.ifr6_ifindex   = ctx->ipc_ifindex,
+	};
+
+	/* Link-local address fe80::<interface identifier>. */
+	ifr6.ifr6_addr.s6_addr[0] = 0xfe;
+	ifr6.ifr6_addr.s6_addr[1] = 0x80;
+	memcpy(&ifr6.ifr6_addr.s6_addr[8], ifid, PPPOAT_PPP_IFID_LEN);
+
+	return if_ppp_ioctl(AF_INET6, req, &ifr6);
+}
+
+static int if_ppp_link_set(struct if_ppp_ctx *ctx, bool up)
+{
+	struct ifreq ifr;
+	int          rc;
+
+	if_ppp_ifreq_init(ctx, &ifr);
+	rc = if_ppp_ioctl(AF_INET, SIOCGIFFLAGS, &ifr);
+	if (rc != 0)
+		return rc;
+	if (up)
+		ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+	else
+		ifr.ifr_flags &= ~IFF_UP;
+
+	return if_ppp_ioctl(AF_INET, SIOCSIFFLAGS, &ifr);
+}
+
+static int if_ppp_mtu_apply(struct if_ppp_ctx *ctx, size_t mtu)
+{
+	struct ifreq ifr;
+
+	if_ppp_ifreq_init(ctx, &ifr);
+	ifr.ifr_mtu = (int)mtu;
+
+	return if_ppp_ioctl(AF_INET, SIOCSIFMTU, &ifr);
+}
+
+/** Network protocol is up, called with ipc_lock held. */
+static void if_ppp_up(struct pppoat_ppp *ppp, uint16_t proto)
+{
+	struct if_ppp_ctx *ctx = ppp->pp_userdata;
+	char               local[INET_ADDRSTRLEN];
+	char               remote[INET_ADDRSTRLEN];
+	size_t             mtu;
+	int                rc;
+
+	mtu = pppoat_min(pppoat_ppp_mtu(ppp), IF_PPP_MRU_MAX);
+	rc  = if_ppp_mtu_apply(ctx, mtu);
+
+	if (proto == PPPOAT_PPP_PROTO_IP) {
+		(void)inet_ntop(AF_INET, &ppp->pp_ip_local, local,
+				sizeof local);
+		(void)inet_ntop(AF_INET, &ppp->pp_ip_remote, remote,
+				sizeof remote);
+		pppoat_info("ppp", "IPCP is up on %s: local %s, remote %s",
+			    ctx->ipc_ifname, local, remote);
+		if (ppp->pp_ip_local == 0)
+			pppoat_error("ppp", "The peer hasn't assigned local "
+				     "IP address");
+		rc = rc ?: if_ppp_ip4_set(ctx, SIOCSIFADDR, ppp->pp_ip_local);
+		if (rc == 0 && ppp->pp_ip_remote != 0)
+			rc = if_ppp_ip4_set(ctx, SIOCSIFDSTADDR,
+					    ppp->pp_ip_remote);
+		rc = rc ?: if_ppp_ip4_set(ctx, SIOCSIFNETMASK, 0xffffffff);
+	} else {
+		pppoat_info("ppp", "IPV6CP is up on %s", ctx->ipc_ifname);
+		/* IPv6 addresses can't be added while the link is down. */
+		rc = rc ?: if_ppp_link_set(ctx, true);
+		rc = rc ?: if_ppp_ip6_set(ctx, SIOCSIFADDR,
+					  ppp->pp_ifid_local);
+	}
+	rc = rc ?: if_ppp_link_set(ctx, true);
+	if (rc != 0)
+		pppoat_error("ppp", "Couldn't configure %s (rc=%d)",
+			     ctx->ipc_ifname, rc);
+}
+
+static void if_ppp_down(struct pppoat_ppp *ppp, uint16_t proto)
+{
+	struct if_ppp_ctx *ctx = ppp->pp_userdata;
+
+	pppoat_info("ppp", "%s is down on %s",
+		    proto == PPPOAT_PPP_PROTO_IP ? "IPCP" : "IPV6CP",
+		    ctx->ipc_ifname);
+	/* Zero address removes IPv4 addresses from the interface. */
+	if (proto == PPPOAT_PPP_PROTO_IP)
+		(void)if_ppp_ip4_set(ctx, SIOCSIFADDR, 0);
+	else
+		(void)if_ppp_ip6_set(ctx, SIOCDIFADDR, ppp->pp_ifid_local);
+	if (!pppoat_ppp_is_up(ppp, PPPOAT_PPP_PROTO_IP) &&
+	    !pppoat_ppp_is_up(ppp, PPPOAT_PPP_PROTO_IPV6))
+		(void)if_ppp_link_set(ctx, false);
+}
+
+/** Encodes and queues a control packet, called with ipc_lock held. */
+static void if_ppp_ctl_send(struct pppoat_ppp *ppp,
+			    uint16_t           proto,
+			    const uint8_t     *buf,
+			    size_t             len)
+{
+	struct if_ppp_ctx    *ctx = ppp->pp_userdata;
+	struct pppoat_module *mod = ctx->ipc_mod;
+	struct pppoat_packet *pkt;
+	uint8_t               hdr[PPPOAT_PPP_HDR_MAX];
+	uint32_t              accm;
+	struct iovec          iov[2];
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len  = pppoat_ppp_hdr_build(ppp, proto, buf, len, hdr,
+					       &accm);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len  = len;
+
+	pkt = pppoat_packet_get(mod->m_pkts,
+				PPPOAT_HDLC_ENCODED_MAX(iov[0].iov_len + len));
+	if (pkt == NULL) {
+		++ctx->ipc_tx_drops;
+		return;
+	}
+	pkt->pkt_type = PPPOAT_PACKET_SEND;
+	pkt->pkt_size = pppoat_hdlc_encode(pkt->pkt_data, iov, 2, accm);
+	pppoat_list_enqueue(&ctx->ipc_ctlq, pkt);
+	if_ppp_wake(ctx);
+}
+
+static const struct pppoat_ppp_ops if_ppp_ppp_ops = {
+	.ppo_send = &if_ppp_ctl_send,
+	.ppo_up   = &if_ppp_up,
+	.ppo_down = &if_ppp_down,
+};
+
+/* -------------------------------------------------------------------------- */
+
+static int if_ppp_conf_ip(const char *str, uint32_t *local, uint32_t *remote)
+{
+	char  buf[2 * INET_ADDRSTRLEN];
+	char *sep;
+	int   rc = 0;
+
+	if (strlen(str) >= sizeof buf)
+		return -EINVAL;
+	strcpy(buf, str);
+	sep = strchr(buf, ':');
+	if (sep == NULL)
+		return -EINVAL;
+	*sep = '\0';
+
+	*local  = 0;
+	*remote = 0;
+	if (buf[0] != '\0' && inet_pton(AF_INET, buf, local) != 1)
+		rc = -EINVAL;
+	if (sep[1] != '\0' && inet_pton(AF_INET, sep + 1, remote) != 1)
+		rc = -EINVAL;
+
+	return rc;
+}
+
+static int if_ppp_conf_parse(struct if_ppp_ctx      *ctx,
+			     struct pppoat_conf     *conf,
+			     struct pppoat_ppp_conf *pconf)
+{
+	char ip[2 * INET_ADDRSTRLEN];
+	long mru;
+	int  rc;
+
+	rc = pppoat_conf_find_string(conf, PPP_CONF_IP, ip, sizeof ip);
+	if (rc == 0)
+		rc = if_ppp_conf_ip(ip, &pconf->ppc_ip_local,
+				    &pconf->ppc_ip_remote);
+	if (rc != 0 && rc != -ENOENT) {
+		pppoat_error("ppp", "%s must be <local>:<remote> IPv4 "
+			     "addresses.", PPP_CONF_IP);
+		return P_ERR(-EINVAL);
+	}
+
+	rc = pppoat_conf_find_long(conf, PPP_CONF_MRU, &mru);
+	if (rc == 0 && (mru < PPPOAT_PPP_MRU_MIN || mru > IF_PPP_MRU_MAX)) {
+		pppoat_error("ppp", "%s must be in range %d..%d.",
+			     PPP_CONF_MRU, PPPOAT_PPP_MRU_MIN, IF_PPP_MRU_MAX);
+		return P_ERR(-EINVAL);
+	}
+	if (rc != 0 && rc != -ENOENT)
+		return P_ERR(rc);
+	pconf->ppc_mru = rc == 0 ? (uint16_t)mru : 0;
+
+	pppoat_conf_find_bool(conf, PPP_CONF_IPV6, &pconf->ppc_ipv6);
+
+	rc = pppoat_conf_find_string(conf, PPP_CONF_IFNAME, ctx->ipc_ifname,
+				     sizeof ctx->ipc_ifname);
+	if (rc == -ENOENT)
+		strcpy(ctx->ipc_ifname, "ppp%d");
+	else if (rc != 0) {
+		pppoat_error("ppp", "%s is too long.", PPP_CONF_IFNAME);
+		return P_ERR(-EINVAL);
+	}
+
+	return 0;
+}
+
+static int if_ppp_tun_open(struct if_ppp_ctx *ctx)
+{
+	struct ifreq ifr;
+	int          rc;
+
+	memset(&ifr, 0, sizeof ifr);
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	strncpy(ifr.ifr_name, ctx->ipc_ifname, sizeof(ifr.ifr_name) - 1);
+
+	ctx->ipc_fd = open("/dev/net/tun", O_RDWR);
+	if (ctx->ipc_fd < 0)
+		return P_ERR(-errno);
+	rc = ioctl(ctx->ipc_fd, TUNSETIFF, (void *)&ifr);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	rc = rc ?: pppoat_io_fd_blocking_set(ctx->ipc_fd, false);
+	if (rc == 0) {
+		memcpy(ctx->ipc_ifname, ifr.ifr_name, sizeof ctx->ipc_ifname);
+		ctx->ipc_ifname[sizeof ctx->ipc_ifname - 1] = '\0';
+		ctx->ipc_ifindex = (int)if_nametoindex(ctx->ipc_ifname);
+	}
+	if (rc != 0) {
+		(void)close(ctx->ipc_fd);
+		ctx->ipc_fd = -1;
+	}
+	return rc;
+}
+
+static int if_ppp_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+{
+	struct pppoat_ppp_conf pconf = {};
+	struct if_ppp_ctx     *ctx;
+	int                    rc;
+
+	ctx = pppoat_alloc(sizeof *ctx);
+	if (ctx == NULL)
+		return P_ERR(-ENOMEM);
+	memset(ctx, 0, sizeof *ctx);
+	ctx->ipc_fd      = -1;
+	ctx->ipc_wake[0] = -1;
+	ctx->ipc_wake[1] = -1;
+	ctx->ipc_mod     = mod;
+	ctx->ipc_mtu     = IF_PPP_MTU;
+
+	rc = if_ppp_conf_parse(ctx, conf, &pconf);
+	if (rc != 0)
+		goto err_free;
+	pconf.ppc_seed = if_ppp_seed();
+
+	ctx->ipc_buf = pppoat_alloc(IF_PPP_MRU_MAX);
+	rc = ctx->ipc_buf == NULL ? P_ERR(-ENOMEM) : 0;
+	rc = rc ?: pppoat_hdlc_decoder_init(&ctx->ipc_dec, IF_PPP_MRU_MAX +
+					    PPPOAT_PPP_HDR_MAX);
+	if (rc != 0)
+		goto err_buf;
+	rc = pipe(ctx->ipc_wake) == 0 ? 0 : P_ERR(-errno);
+	if (rc != 0)
+		goto err_dec;
+	(void)pppoat_io_fd_blocking_set(ctx->ipc_wake[0], false);
+	(void)pppoat_io_fd_blocking_set(ctx->ipc_wake[1], false);
+	rc = if_ppp_tun_open(ctx);
+	if (rc != 0) {
+		pppoat_error("ppp", "Couldn't create TUN interface (rc=%d)",
+			     rc);
+		goto err_pipe;
+	}
+
+	pppoat_mutex_init(&ctx->ipc_lock);
+	pppoat_mutex_init(&ctx->ipc_rx_lock);
+	pppoat_list_init(&ctx->ipc_ctlq, &if_ppp_pktq_descr);
+	pppoat_list_init(&ctx->ipc_segs, &if_ppp_pktq_descr);
+	pppoat_ppp_init(&ctx->ipc_ppp, &pconf, &if_ppp_ppp_ops, ctx);
+	mod->m_userdata = ctx;
+
+	pppoat_debug("ppp", "Created interface %s", ctx->ipc_ifname);
+
+	return 0;
+
+err_pipe:
+	(void)close(ctx->ipc_wake[0]);
+	(void)close(ctx->ipc_wake[1]);
+err_dec:
+	pppoat_hdlc_decoder_fini(&ctx->ipc_dec);
+err_buf:
+	pppoat_free(ctx->ipc_buf);
+err_free:
+	pppoat_free(ctx);
+	return rc;
+}
+
+static void if_ppp_list_flush(struct pppoat_module *mod,
+			      struct pppoat_list   *list)
+{
+	struct pppoat_packet *pkt;
+
+	while ((pkt = pppoat_list_dequeue(list)) != NULL)
+		pppoat_packet_put(mod->m_pkts, pkt);
+	pppoat_list_fini(list);
+}
+
+static void if_ppp_fini(struct pppoat_module *mod)
+{
+	struct if_ppp_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(if_ppp_ctx_invariant(ctx));
+
+	if_ppp_list_flush(mod, &ctx->ipc_ctlq);
+	if_ppp_list_flush(mod, &ctx->ipc_segs);
+	pppoat_mutex_fini(&ctx->ipc_rx_lock);
+	pppoat_mutex_fini(&ctx->ipc_lock);
+	(void)close(ctx->ipc_fd);
+	(void)close(ctx->ipc_wake[0]);
+	(void)close(ctx->ipc_wake[1]);
+	pppoat_hdlc_decoder_fini(&ctx->ipc_dec);
+	pppoat_free(ctx->ipc_buf);
+	pppoat_free(ctx);
+	mod->m_userdata = NULL;
+}
+
+static int if_ppp_run(struct pppoat_module *mod)
+{
+	struct if_ppp_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(if_ppp_ctx_invariant(ctx));
+
+	pppoat_mutex_lock(&ctx->ipc_lock);
+	pppoat_ppp_open(&ctx->ipc_ppp, if_ppp_now());
+	pppoat_mutex_unlock(&ctx->ipc_lock);
+
+	return 0;
+}
+
+static int if_ppp_stop(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+/**
+ * Returns the first part of an encoded frame which fits MTU of the
+ * transport and keeps the rest in ipc_segs.
+ */
+static int if_ppp_segment(struct pppoat_module  *mod,
+			  struct if_ppp_ctx     *ctx,
+			  struct pppoat_packet  *pkt,
+			  struct pppoat_packet **out)
+{
+	struct pppoat_packet *seg;
+	size_t                mtu = __atomic_load_n(&ctx->ipc_mtu,
+						    __ATOMIC_RELAXED);
+	size_t                off;
+	size_t                len;
+
+	++ctx->ipc_tx_frames;
+	for (off = mtu; off < pkt->pkt_size; off += len) {
+		len = pppoat_min(mtu, pkt->pkt_size - off);
+		seg = pppoat_packet_get(mod->m_pkts, len);
+		if (seg == NULL) {
+			/* The receiver drops the broken frame. */
+			++ctx->ipc_tx_drops;
+			break;
+		}
+		memcpy(seg->pkt_data, (uint8_t *)pkt->pkt_data + off, len);
+		seg->pkt_size = len;
+		seg->pkt_type = PPPOAT_PACKET_SEND;
+		pppoat_list_enqueue(&ctx->ipc_segs, seg);
+	}
+	pkt->pkt_size = pppoat_min(pkt->pkt_size, mtu);
+	*out = pkt;
+
+	return 0;
+}
+
+static int if_ppp_pkt_get(struct pppoat_module  *mod,
+			  struct pppoat_packet **pkt)
+{
+	struct if_ppp_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt2;
+	uint8_t               hdr[PPPOAT_PPP_HDR_MAX];
+	struct iovec          iov[2];
+	uint16_t              proto;
+	uint32_t              accm;
+	int64_t               timeout;
+	ssize_t               rlen;
+	fd_set                rfds;
+	bool                  up;
+	int                   rc;
+
+	PPPOAT_ASSERT(if_ppp_ctx_invariant(ctx));
+
+	pkt2 = pppoat_list_dequeue(&ctx->ipc_segs);
+	if (pkt2 != NULL) {
+		*pkt = pkt2;
+		return 0;
+	}
+
+	pppoat_mutex_lock(&ctx->ipc_lock);
+	timeout = pppoat_ppp_timeout(&ctx->ipc_ppp, if_ppp_now());
+	pkt2 = pppoat_list_dequeue(&ctx->ipc_ctlq);
+	pppoat_mutex_unlock(&ctx->ipc_lock);
+	if (pkt2 != NULL)
+		return if_ppp_segment(mod, ctx, pkt2, pkt);
+
+	FD_ZERO(&rfds);
+	FD_SET(ctx->ipc_fd, &rfds);
+	FD_SET(ctx->ipc_wake[0], &rfds);
+	rc = pppoat_io_select_timeout(pppoat_max(ctx->ipc_fd,
+						 ctx->ipc_wake[0]),
+				      &rfds, NULL, timeout);
+	if (rc != 0)
+		return rc;
+	if (FD_ISSET(ctx->ipc_wake[0], &rfds))
+		if_ppp_wake_drain(ctx);
+
+	/* Nothing to return, the pipeline polls again. */
+	*pkt = NULL;
+	if (!FD_ISSET(ctx->ipc_fd, &rfds))
+		return 0;
+
+	rlen = read(ctx->ipc_fd, ctx->ipc_buf, IF_PPP_MRU_MAX);
+	if (rlen < 0)
+		return pppoat_io_error_is_recoverable(-errno) ? 0 :
+		       P_ERR(-errno);
+	if (rlen == 0)
+		return P_ERR(-EIO);
+
+	proto = (ctx->ipc_buf[0] >> 4) == 6 ? PPPOAT_PPP_PROTO_IPV6 :
+					      PPPOAT_PPP_PROTO_IP;
+	pppoat_mutex_lock(&ctx->ipc_lock);
+	up = pppoat_ppp_is_up(&ctx->ipc_ppp, proto);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len  = pppoat_ppp_hdr_build(&ctx->ipc_ppp, proto, NULL, 0,
+					       hdr, &accm);
+	pppoat_mutex_unlock(&ctx->ipc_lock);
+	if (!up) {
+		++ctx->ipc_tx_drops;
+		return 0;
+	}
+	iov[1].iov_base = ctx->ipc_buf;
+	iov[1].iov_len  = rlen;
+
+	pkt2 = pppoat_packet_get(mod->m_pkts, PPPOAT_HDLC_ENCODED_MAX(
+					 iov[0].iov_len + (size_t)rlen));
+	if (pkt2 == NULL)
+		return P_ERR(-ENOMEM);
+	pkt2->pkt_type = PPPOAT_PACKET_SEND;
+	pkt2->pkt_size = pppoat_hdlc_encode(pkt2->pkt_data, iov, 2, accm);
+
+	return if_ppp_segment(mod, ctx, pkt2, pkt);
+}
+
+/** Handles a received frame, called with ipc_rx_lock held. */
+static void if_ppp_frame(struct if_ppp_ctx *ctx,
+			 const uint8_t     *frame,
+			 size_t             len)
+{
+	uint16_t proto;
+	ssize_t  wlen;
+	bool     up;
+	int      hlen;
+
+	hlen = pppoat_ppp_hdr_parse(frame, len, &proto);
+	if (hlen < 0)
+		return;
+	frame += hlen;
+	len   -= hlen;
+
+	if (proto == PPPOAT_PPP_PROTO_IP || proto == PPPOAT_PPP_PROTO_IPV6) {
+		pppoat_mutex_lock(&ctx->ipc_lock);
+		up = pppoat_ppp_is_up(&ctx->ipc_ppp, proto);
+		pppoat_mutex_unlock(&ctx->ipc_lock);
+		wlen = up ? write(ctx->ipc_fd, frame, len) : -1;
+		if (wlen < 0)
+			++ctx->ipc_rx_drops;
+		return;
+	}
+
+	pppoat_mutex_lock(&ctx->ipc_lock);
+	pppoat_ppp_input(&ctx->ipc_ppp, proto, frame, len, if_ppp_now());
+	pppoat_mutex_unlock(&ctx->ipc_lock);
+}
+
+static int if_ppp_process(struct pppoat_module  *mod,
+			  struct pppoat_packet  *pkt,
+			  struct pppoat_packet **next)
+{
+	struct if_ppp_ctx *ctx = mod->m_userdata;
+	const uint8_t     *data;
+	const uint8_t     *frame;
+	size_t             frame_len;
+	size_t             off;
+
+	PPPOAT_ASSERT(if_ppp_ctx_invariant(ctx));
+	PPPOAT_ASSERT(imply(pkt != NULL, pkt->pkt_type == PPPOAT_PACKET_RECV));
+
+	if (pkt == NULL)
+		return if_ppp_pkt_get(mod, next);
+
+	data = pkt->pkt_data;
+	pppoat_mutex_lock(&ctx->ipc_rx_lock);
+	for (off = 0; off < pkt->pkt_size; ) {
+		off += pppoat_hdlc_decode(&ctx->ipc_dec, data + off,
+					  pkt->pkt_size - off, &frame,
+					  &frame_len);
+		if (frame != NULL)
+			if_ppp_frame(ctx, frame, frame_len);
+	}
+	pppoat_mutex_unlock(&ctx->ipc_rx_lock);
+
+	pppoat_packet_put(mod->m_pkts, pkt);
+	*next = NULL;
+
+	return 0;
+}
+
+static size_t if_ppp_mtu(struct pppoat_module *mod)
+{
+	struct if_ppp_ctx *ctx = mod->m_userdata;
+
+	return __atomic_load_n(&ctx->ipc_mtu, __ATOMIC_RELAXED);
+}
+
+/** Frames are split to MTU of the transport, the TUN MTU is negotiated. */
+static size_t if_ppp_mtu_set(struct pppoat_module *mod, size_t mtu)
+{
+	struct if_ppp_ctx *ctx = mod->m_userdata;
+
+	__atomic_store_n(&ctx->ipc_mtu, mtu, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void if_ppp_stats(struct pppoat_module *mod)
+{
+	struct if_ppp_ctx *ctx = mod->m_userdata;
+
+	pppoat_mutex_lock(&ctx->ipc_rx_lock);
+	pppoat_info("ppp", "Received frames: %" PRIu64 ", dropped: %" PRIu64
+		    ", bad: %" PRIu64 ", aborted: %" PRIu64,
+		    ctx->ipc_dec.hd_frames, ctx->ipc_rx_drops,
+		    ctx->ipc_dec.hd_errors, ctx->ipc_dec.hd_aborts);
+	pppoat_mutex_unlock(&ctx->ipc_rx_lock);
+	pppoat_info("ppp", "Sent frames: %" PRIu64 ", dropped: %" PRIu64,
+		    ctx->ipc_tx_frames, ctx->ipc_tx_drops);
+}
+
+static struct pppoat_module_ops if_ppp_ops = {
+	.mop_init    = &if_ppp_init,
+	.mop_fini    = &if_ppp_fini,
+	.mop_run     = &if_ppp_run,
+	.mop_stop    = &if_ppp_stop,
+	.mop_process = &if_ppp_process,
+	.mop_mtu     = &if_ppp_mtu,
+	.mop_mtu_set = &if_ppp_mtu_set,
+	.mop_stats   = &if_ppp_stats,
+};
+
+struct pppoat_module_impl pppoat_module_if_ppp = {
+	.mod_name  = "ppp",
+	.mod_descr = "Native PPP interface",
+	.mod_type  = PPPOAT_MODULE_INTERFACE,
+	.mod_ops   = &if_ppp_ops,
+	.mod_props = PPPOAT_MODULE_BLOCKING,
+};
+
+#endif /* HAVE_MODULE_PPP */
@@ -20,34 +20,81 @@
 #include "trace.h"
 
 #include "conf.h"
+#include "hdlc.h"
 #include "io.h"
 #include "magic.h"
 #include "memory.h"
 #include "misc.h"	/* ARRAY_SIZE */
 #include "module.h"
 #include "packet.h"
+#include "ppp.h"	/* PPPOAT_PPP_HDR_MAX */
+#include "splice.h"
 
 #include <errno.h>
+#include <inttypes.h>	/* PRIu64 */
 #include <sys/types.h>
+#include <sys/uio.h>	/* iovec */
 #include <sys/wait.h>
 #include <signal.h>	/* kill */
 #include <stdbool.h>
+#include <string.h>	/* memchr, memcpy */
 #include <unistd.h>	/* access, fork, pipe, dup2, exit, ... */
 
+/*
+ * pppd writes PPP frames in the asynchronous HDLC-like framing of RFC 1662
+ * to its stdout. pppd.framing chooses what a tunnel packet carries:
+ *
+ *  - "frame" (default): whole encoded frames, cut at flag bytes. A frame
+ *    which doesn't fit MTU is split, so the receiver just writes packets
+ *    to pppd and is compatible with the other modes except sync.
+ *  - "stream": whatever read() returns, one packet may hold a part of a
+ *    frame or several frames.
+ *  - "sync": decoded frames without flags, escaping and FCS, frames with
+ *    bad FCS are dropped. The receiver encodes them back, so both sides
+ *    must use sync framing. Escape-heavy payloads shrink up to 2 times.
+ */
+
+enum if_pppd_framing {
+	IF_PPPD_FRAMING_FRAME,
+	IF_PPPD_FRAMING_STREAM,
+	IF_PPPD_FRAMING_SYNC,
+};
+
 struct if_pppd_ctx {
-	const char *ipc_pppd_path;
-	pid_t       ipc_pppd_pid;
-	int         ipc_rd;
-	int         ipc_wr;
-	char       *ipc_ip;
-	uint32_t    ipc_magic;
+	const char                 *ipc_pppd_path;
+	pid_t                       ipc_pppd_pid;
+	int                         ipc_rd;
+	int                         ipc_wr;
+	char                       *ipc_ip;
+	enum if_pppd_framing        ipc_framing;
+	/** Bytes read from pppd, ipc_rbuf_off of them are handled. */
+	uint8_t                    *ipc_rbuf;
+	size_t                      ipc_rbuf_len;
+	size_t                      ipc_rbuf_off;
+	/** Frame being collected in frame mode. */
+	struct pppoat_packet       *ipc_cur;
+	size_t                      ipc_cur_len;
+	size_t                      ipc_cur_size;
+	/** Decoder of sync mode. */
+	struct pppoat_hdlc_decoder  ipc_dec;
+	/** Packets to pppd are vmspliced to the pipe. */
+	bool                        ipc_zerocopy;
+	struct pppoat_splice        ipc_splice;
+	uint64_t                    ipc_frames;
+	uint64_t                    ipc_splits;
+	uint32_t                    ipc_magic;
 };
 
-#define PPPD_CONF_IP   "pppd.ip"
-#define PPPD_CONF_PATH "pppd.path"
+#define PPPD_CONF_IP      "pppd.ip"
+#define PPPD_CONF_PATH    "pppd.path"
+#define PPPD_CONF_FRAMING "pppd.framing"
+#define PPPD_CONF_ZEROCOPY "pppd.zerocopy"
 
 enum {
 	IF_PPPD_MTU = 1500,
+	/** Decoded frame with MRU 1500 and uncompressed header. */
+	IF_PPPD_SYNC_MTU = IF_PPPD_MTU + PPPOAT_PPP_HDR_MAX,
+	IF_PPPD_RBUF_SIZE = 16384,
 };
 
 static const char *pppd_paths[] = {
@@ -84,6 +131,33 @@ static bool if_pppd_ctx_invariant(const struct if_pppd_ctx *ctx)
 	       ctx->ipc_magic == PPPOAT_MODULE_IF_PPPD_MAGIC;
 }
 
+static int if_pppd_framing_parse(struct if_pppd_ctx *ctx,
+				 struct pppoat_conf *conf)
+{
+	char *str;
+	int   rc;
+
+	ctx->ipc_framing = IF_PPPD_FRAMING_FRAME;
+	rc = pppoat_conf_find_string_alloc(conf, PPPD_CONF_FRAMING, &str);
+	if (rc == -ENOENT)
+		return 0;
+	if (rc != 0)
+		return rc;
+
+	if (pppoat_streq(str, "stream"))
+		ctx->ipc_framing = IF_PPPD_FRAMING_STREAM;
+	else if (pppoat_streq(str, "sync"))
+		ctx->ipc_framing = IF_PPPD_FRAMING_SYNC;
+	else if (!pppoat_streq(str, "frame")) {
+		pppoat_error("pppd", "Unknown framing '%s', use 'frame', "
+			     "'stream' or 'sync'.", str);
+		rc = P_ERR(-EINVAL);
+	}
+	pppoat_free(str);
+
+	return rc;
+}
+
 static int if_pppd_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 {
 	struct if_pppd_ctx *ctx;
@@ -92,6 +166,7 @@ static int if_pppd_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 	ctx = pppoat_alloc(sizeof *ctx);
 	if (ctx == NULL)
 		return P_ERR(-ENOMEM);
+	memset(ctx, 0, sizeof *ctx);
 
 	ctx->ipc_pppd_path = if_pppd_path();
 	if (ctx->ipc_pppd_path == NULL) {
@@ -104,11 +179,28 @@ static int if_pppd_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 	if (rc != 0 && rc != -ENOENT)
 		goto err;
 
+	rc = if_pppd_framing_parse(ctx, conf);
+	if (rc != 0)
+		goto err_ip;
+	pppoat_conf_find_bool(conf, PPPD_CONF_ZEROCOPY, &ctx->ipc_zerocopy);
+	if (ctx->ipc_framing != IF_PPPD_FRAMING_STREAM) {
+		ctx->ipc_rbuf = pppoat_alloc(IF_PPPD_RBUF_SIZE);
+		rc = ctx->ipc_rbuf == NULL ? P_ERR(-ENOMEM) : 0;
+	}
+	if (rc == 0 && ctx->ipc_framing == IF_PPPD_FRAMING_SYNC)
+		rc = pppoat_hdlc_decoder_init(&ctx->ipc_dec, IF_PPPD_SYNC_MTU);
+	if (rc != 0)
+		goto err_rbuf;
+
 	ctx->ipc_magic = PPPOAT_MODULE_IF_PPPD_MAGIC;
 	mod->m_userdata = ctx;
 
 	return 0;
 
+err_rbuf:
+	pppoat_free(ctx->ipc_rbuf);
+err_ip:
+	pppoat_free(ctx->ipc_ip);
 err:
 	pppoat_free(ctx);
 	return rc;
@@ -120,6 +212,11 @@ static void if_pppd_fini(struct pppoat_module *mod)
 
 	PPPOAT_ASSERT(if_pppd_ctx_invariant(ctx));
 
+	if (ctx->ipc_cur != NULL)
+		pppoat_packet_put(mod->m_pkts, ctx->ipc_cur);
+	if (ctx->ipc_framing == IF_PPPD_FRAMING_SYNC)
+		pppoat_hdlc_decoder_fini(&ctx->ipc_dec);
+	pppoat_free(ctx->ipc_rbuf);
 	pppoat_free(ctx->ipc_ip);
 	pppoat_free(ctx);
 	mod->m_userdata = NULL;
@@ -177,6 +274,16 @@ static int if_pppd_run(struct pppoat_module *mod)
 	(void)pppoat_io_fd_blocking_set(ctx->ipc_rd, false);
 	(void)pppoat_io_fd_blocking_set(ctx->ipc_wr, false);
 
+	if (ctx->ipc_zerocopy) {
+		rc = pppoat_splice_init(&ctx->ipc_splice, ctx->ipc_wr,
+					mod->m_pkts);
+		if (rc != 0) {
+			pppoat_info("pppd", "Zero-copy is not supported "
+				    "(rc=%d)", rc);
+			ctx->ipc_zerocopy = false;
+		}
+	}
+
 	return 0;
 }
 
@@ -197,14 +304,16 @@ static int if_pppd_stop(struct pppoat_module *mod)
 
 	PPPOAT_ASSERT(pid == ctx->ipc_pppd_pid); /* XXX */
 
+	if (ctx->ipc_zerocopy)
+		pppoat_splice_fini(&ctx->ipc_splice);
 	close(ctx->ipc_rd);
 	close(ctx->ipc_wr);
 
 	return 0;
 }
 
-static int if_pppd_pkt_get(struct pppoat_module  *mod,
-			   struct pppoat_packet **pkt)
+static int if_pppd_stream_get(struct pppoat_module  *mod,
+			      struct pppoat_packet **pkt)
 {
 	struct if_pppd_ctx   *ctx = mod->m_userdata;
 	struct pppoat_packet *pkt2;
@@ -242,6 +351,179 @@ static int if_pppd_pkt_get(struct pppoat_module  *mod,
 	return rc;
 }
 
+/** Reads from pppd to ipc_rbuf. */
+static int if_pppd_read(struct if_pppd_ctx *ctx)
+{
+	ssize_t rlen;
+	int     rc;
+
+	rc = pppoat_io_select_single_read(ctx->ipc_rd);
+	if (rc != 0)
+		return rc;
+	rlen = read(ctx->ipc_rd, ctx->ipc_rbuf, IF_PPPD_RBUF_SIZE);
+	if (rlen < 0)
+		return pppoat_io_error_is_recoverable(-errno) ? -errno :
+		       P_ERR(-errno);
+	/* Nothing is read, the caller finds no frame. */
+	ctx->ipc_rbuf_len = (size_t)rlen;
+	ctx->ipc_rbuf_off = 0;
+
+	return 0;
+}
+
+static void if_pppd_cur_emit(struct if_pppd_ctx    *ctx,
+			     struct pppoat_packet **pkt)
+{
+	ctx->ipc_cur->pkt_size = ctx->ipc_cur_len;
+	ctx->ipc_cur->pkt_type = PPPOAT_PACKET_SEND;
+	*pkt = ctx->ipc_cur;
+	ctx->ipc_cur = NULL;
+	++ctx->ipc_frames;
+}
+
+/**
+ * Collects bytes from ipc_rbuf up to and including the closing flag of a
+ * frame. Flags between frames are collapsed to one opening flag.
+ */
+static int if_pppd_frame_next(struct pppoat_module  *mod,
+			      struct if_pppd_ctx    *ctx,
+			      struct pppoat_packet **pkt)
+{
+	const uint8_t *p;
+	const uint8_t *flag;
+	uint8_t       *cur;
+	size_t         avail;
+	size_t         room;
+	size_t         n;
+
+	while (ctx->ipc_rbuf_off < ctx->ipc_rbuf_len) {
+		if (ctx->ipc_cur == NULL) {
+			ctx->ipc_cur_size = pppoat_module_mtu(mod);
+			ctx->ipc_cur = pppoat_packet_get(mod->m_pkts,
+							 ctx->ipc_cur_size);
+			if (ctx->ipc_cur == NULL)
+				return P_ERR(-ENOMEM);
+			ctx->ipc_cur_len = 0;
+		}
+		cur   = ctx->ipc_cur->pkt_data;
+		p     = ctx->ipc_rbuf + ctx->ipc_rbuf_off;
+		avail = ctx->ipc_rbuf_len - ctx->ipc_rbuf_off;
+		room  = ctx->ipc_cur_size - ctx->ipc_cur_len;
+		flag  = memchr(p, PPPOAT_HDLC_FLAG, avail);
+		n     = flag == NULL ? avail : (size_t)(flag - p);
+
+		if (n >= room) {
+			/* The receiver writes the parts to pppd in order. */
+			memcpy(cur + ctx->ipc_cur_len, p, room);
+			ctx->ipc_cur_len  += room;
+			ctx->ipc_rbuf_off += room;
+			++ctx->ipc_splits;
+			if_pppd_cur_emit(ctx, pkt);
+			return 0;
+		}
+		memcpy(cur + ctx->ipc_cur_len, p, n);
+		ctx->ipc_cur_len  += n;
+		ctx->ipc_rbuf_off += n;
+		if (flag == NULL)
+			break;
+
+		++ctx->ipc_rbuf_off;
+		if (ctx->ipc_cur_len == 0 ||
+		    (ctx->ipc_cur_len == 1 && cur[0] == PPPOAT_HDLC_FLAG)) {
+			cur[0] = PPPOAT_HDLC_FLAG;
+			ctx->ipc_cur_len = 1;
+			continue;
+		}
+		cur[ctx->ipc_cur_len++] = PPPOAT_HDLC_FLAG;
+		if_pppd_cur_emit(ctx, pkt);
+		return 0;
+	}
+	/* Partial frame, the pipeline polls again. */
+	*pkt = NULL;
+	return 0;
+}
+
+/** Decodes the next good frame from ipc_rbuf. */
+static int if_pppd_sync_next(struct pppoat_module  *mod,
+			     struct if_pppd_ctx    *ctx,
+			     struct pppoat_packet **pkt)
+{
+	struct pppoat_packet *pkt2;
+	const uint8_t        *frame;
+	size_t                frame_len;
+
+	while (ctx->ipc_rbuf_off < ctx->ipc_rbuf_len) {
+		ctx->ipc_rbuf_off += pppoat_hdlc_decode(&ctx->ipc_dec,
+				ctx->ipc_rbuf + ctx->ipc_rbuf_off,
+				ctx->ipc_rbuf_len - ctx->ipc_rbuf_off,
+				&frame, &frame_len);
+		if (frame == NULL)
+			continue;
+		pkt2 = pppoat_packet_get(mod->m_pkts, frame_len);
+		if (pkt2 == NULL)
+			return P_ERR(-ENOMEM);
+		memcpy(pkt2->pkt_data, frame, frame_len);
+		pkt2->pkt_type = PPPOAT_PACKET_SEND;
+		*pkt = pkt2;
+		++ctx->ipc_frames;
+		return 0;
+	}
+	*pkt = NULL;
+	return 0;
+}
+
+static int if_pppd_pkt_get(struct pppoat_module  *mod,
+			   struct pppoat_packet **pkt)
+{
+	struct if_pppd_ctx *ctx = mod->m_userdata;
+	int                 rc;
+
+	if (ctx->ipc_framing == IF_PPPD_FRAMING_STREAM)
+		return if_pppd_stream_get(mod, pkt);
+
+	if (ctx->ipc_rbuf_off == ctx->ipc_rbuf_len) {
+		rc = if_pppd_read(ctx);
+		if (rc != 0)
+			return rc;
+	}
+	return ctx->ipc_framing == IF_PPPD_FRAMING_SYNC ?
+	       if_pppd_sync_next(mod, ctx, pkt) :
+	       if_pppd_frame_next(mod, ctx, pkt);
+}
+
+/** Restores HDLC framing of a sync frame, escaping all control bytes. */
+static int if_pppd_sync_write(struct pppoat_module *mod,
+			      struct if_pppd_ctx   *ctx,
+			      struct pppoat_packet *pkt)
+{
+	struct pppoat_packet *enc;
+	struct iovec          iov = {
+		.iov_base = pkt->pkt_data,
+		.iov_len  = pkt->pkt_size,
+	};
+	int                   rc;
+
+	enc = pppoat_packet_get(mod->m_pkts,
+				PPPOAT_HDLC_ENCODED_MAX(pkt->pkt_size));
+	if (enc == NULL)
+		return P_ERR(-ENOMEM);
+	enc->pkt_size = pppoat_hdlc_encode(enc->pkt_data, &iov, 1,
+					   PPPOAT_HDLC_ACCM_ALL);
+	if (ctx->ipc_zerocopy) {
+		rc = pppoat_splice_write(&ctx->ipc_splice, enc);
+		if (rc != 0)
+			pppoat_packet_put(mod->m_pkts, enc);
+	} else {
+		rc = pppoat_io_write_sync(ctx->ipc_wr, enc->pkt_data,
+					  enc->pkt_size);
+		pppoat_packet_put(mod->m_pkts, enc);
+	}
+	if (rc == 0)
+		pppoat_packet_put(mod->m_pkts, pkt);
+
+	return rc;
+}
+
 static int if_pppd_process(struct pppoat_module  *mod,
 			   struct pppoat_packet  *pkt,
 			   struct pppoat_packet **next)
@@ -255,9 +537,17 @@ static int if_pppd_process(struct pppoat_module  *mod,
 	if (pkt == NULL)
 		return if_pppd_pkt_get(mod, next);
 
-	rc = pppoat_io_write_sync(ctx->ipc_wr, pkt->pkt_data, pkt->pkt_size);
-	if (rc == 0)
-		pppoat_packet_put(mod->m_pkts, pkt);
+	if (ctx->ipc_framing == IF_PPPD_FRAMING_SYNC) {
+		rc = if_pppd_sync_write(mod, ctx, pkt);
+	} else if (ctx->ipc_zerocopy) {
+		/* The packet is released when pppd reads it. */
+		rc = pppoat_splice_write(&ctx->ipc_splice, pkt);
+	} else {
+		rc = pppoat_io_write_sync(ctx->ipc_wr, pkt->pkt_data,
+					  pkt->pkt_size);
+		if (rc == 0)
+			pppoat_packet_put(mod->m_pkts, pkt);
+	}
 
 	*next = NULL;
 	return rc;
@@ -265,7 +555,23 @@ static int if_pppd_process(struct pppoat_module  *mod,
 
 static size_t if_pppd_mtu(struct pppoat_module *mod)
 {
-	return IF_PPPD_MTU;
+	struct if_pppd_ctx *ctx = mod->m_userdata;
+
+	return ctx->ipc_framing == IF_PPPD_FRAMING_SYNC ? IF_PPPD_SYNC_MTU :
+							  IF_PPPD_MTU;
+}
+
+static void if_pppd_stats(struct pppoat_module *mod)
+{
+	struct if_pppd_ctx *ctx = mod->m_userdata;
+
+	if (ctx->ipc_framing == IF_PPPD_FRAMING_FRAME)
+		pppoat_info("pppd", "Frames: %" PRIu64 ", split: %" PRIu64,
+			    ctx->ipc_frames, ctx->ipc_splits);
+	if (ctx->ipc_framing == IF_PPPD_FRAMING_SYNC)
+		pppoat_info("pppd", "Frames: %" PRIu64 ", bad: %" PRIu64
+			    ", aborted: %" PRIu64, ctx->ipc_frames,
+			    ctx->ipc_dec.hd_errors, ctx->ipc_dec.hd_aborts);
 }
 
 static struct pppoat_module_ops if_pppd_ops = {
@@ -275,6 +581,7 @@ static struct pppoat_module_ops if_pppd_ops = {
 	.mop_stop    = &if_pppd_stop,
 	.mop_process = &if_pppd_process,
 	.mop_mtu     = &if_pppd_mtu,
+	.mop_stats   = &if_pppd_stats,
 };
 
 struct pppoat_module_impl pppoat_module_if_pppd = {
@@ -19,20 +19,129 @@
 
 #include "trace.h"
 
+#include "bpf.h"
 #include "conf.h"
+#include "filter.h"
+#include "flow.h"
 #include "io.h"
 #include "magic.h"
 #include "memory.h"
 #include "misc.h"
 #include "module.h"
+#include "mutex.h"
 #include "packet.h"
 
+#include <pthread.h>
 #include <string.h>		/* strlen */
+#include <time.h>		/* clock_gettime */
 #include <unistd.h>		/* open, close, read */
 
+/**
+ * Multiple queues.
+ *
+ * With tun.queues=N (tap.queues for TAP), the interface is created with
+ * IFF_MULTI_QUEUE and N file descriptors are attached to it. The module
+ * asks the pipeline for N workers and every worker thread claims its own
+ * queue on the first poll, so reading and encapsulation of outbound
+ * packets scale past one core. Inbound packets are written to the queue
+ * chosen by hash of the inner flow.
+ *
+ * The kernel picks a queue for an outbound packet with tun.steering. The
+ * default "kernel" steering remembers the queue where a flow was last
+ * written, so both directions of a flow stay on one queue. With "ebpf",
+ * the module attaches a program with TUNSETSTEERINGEBPF which selects the
+ * queue by hash of the inner IP addresses and TCP/UDP ports. It keeps no
+ * state, so flows never move between queues. Multiple queues are
+ * supported on Linux only.
+ *
+ * Offloads.
+ *
+ * With tun.offload, the interface is created with IFF_VNET_HDR and
+ * announces checksum and TSO offloads with TUNSETOFFLOAD. Then the kernel
+ * doesn't segment TCP streams routed to the interface and a single read
+ * returns a super-packet up to 64KB with virtio_net_hdr after the packet
+ * information header. The module splits it into packets of gso_size
+ * payload, fixes lengths, IPv4 IDs, sequence numbers and checksums, and
+ * queues them for the reading worker. So the packets on the wire are the
+ * same as without offloads and the peer doesn't have to enable it.
+ * Equally sized segments of a burst map onto UDP GSO with udp.gso. Writes
+ * carry an empty virtio_net_hdr. Offloads are supported on Linux only.
+ *
+ * Packet information.
+ *
+ * By default, every packet crosses the tunnel with the 4-byte packet
+ * information header of the interface (flags and EtherType). With
+ * tun.no_pi, the interface is created with IFF_NO_PI and the module builds
+ * the header itself. It sets bit 0x80 of the second flags byte, which the
+ * kernel ignores, to tell the peer that it understands the compact format.
+ * Once such a packet arrives, the module sends IPv4 and IPv6 packets
+ * without any header, the receiver infers the protocol from the version
+ * nibble, and TAP frames with a single 0xe0 byte. Other TUN packets keep
+ * the full header. A receiver with tun.no_pi accepts both formats, the
+ * first byte tells them apart: packet information always starts with zero.
+ * So a peer without the option keeps working, but disabling it requires
+ * restart of both sides. The compact state is common for all peers, so
+ * all peers of a udp.server must support it. Offsets of the inner IP
+ * header in other modules (udp.ip_offset) are 0 for compact TUN packets.
+ *
+ * NAPI.
+ *
+ * With tun.napi, the interface is created with IFF_NAPI and packets written
+ * by the module are delivered through the NAPI context of the queue, i.e.
+ * through GRO, instead of the backlog of the writing CPU. TAP interfaces
+ * add IFF_NAPI_FRAGS and the module writes the Ethernet header and the
+ * payload as separate vectors, so the payload lands in page fragments and
+ * GRO merges it without copying the headers around. NAPI_FRAGS requires
+ * CAP_NET_ADMIN. If the kernel refuses or ignores the flags, the module
+ * continues with regular writes.
+ *
+ * Filters.
+ *
+ * tun.filter takes rules of filter.h, e.g. "multicast, ra", and drops
+ * matching packets routed to the interface before they reach the module.
+ * The rules are compiled to classic BPF, TAP interfaces attach it with
+ * TUNATTACHFILTER. TUN interfaces accept only eBPF with TUNSETFILTEREBPF,
+ * so the program is translated, which requires privileges to load BPF
+ * programs. If the kernel doesn't take the filter, the module runs it
+ * itself after reading a packet, which still saves the transport.
+ *
+ * Neighbours.
+ *
+ * With tap.neigh, the module learns IPv4 neighbours from ARP and IPv6
+ * neighbours from neighbour advertisements which arrive from the tunnel.
+ * Then it answers broadcast ARP requests and multicast neighbour
+ * solicitations for the learned addresses itself, so they don't cross the
+ * tunnel. Unicast requests, which the kernel sends to confirm
+ * reachability, and duplicate address detection always go to the peer and
+ * refresh the table. An entry lives IF_TAP_NEIGH_TTL after the last
+ * announcement.
+ *
+ * tap.bcast_rate limits other broadcast and multicast frames sent to the
+ * tunnel to the given number per second, 0 drops them. Bursts up to one
+ * second worth of frames pass.
+ */
+
 enum {
 	IF_TUN_MTU = 1500,
 	IF_TAP_MTU = 1500,
+	IF_TUNTAP_MTU_MIN = 68,
+	IF_TUNTAP_MTU_MAX = 65535,
+	IF_TUNTAP_QUEUES_MAX = 256,
+	/** Packet information header. */
+	IF_TUN_HDR_SIZE = 4,
+	/** Bit in the packet information flags, see "Packet information". */
+	IF_TUNTAP_PI_COMPACT = 0x80,
+	/** The compact header of TAP frames. */
+	IF_TAP_COMPACT_MARK = 0xe0,
+	/** Packet information, Ethernet header and VLAN tag. */
+	IF_TAP_HDR_SIZE = 4 + 14 + 4,
+	IF_TAP_NEIGH_MAX = 256,
+	/** Lifetime of a learned neighbour in ms. */
+	IF_TAP_NEIGH_TTL = 300 * 1000,
+	IF_TAP_ETH_ARP = 0x0806,
+	IF_TAP_ETH_IP6 = 0x86dd,
+	IF_TAP_ND_NS = 135,
+	IF_TAP_ND_NA = 136,
 };
 
 enum if_tuntap_type {
@@ -40,23 +149,699 @@ enum if_tuntap_type {
 	PPPOAT_IF_TAP,
 };
 
+enum if_tuntap_steering {
+	IF_TUNTAP_STEERING_KERNEL,
+	IF_TUNTAP_STEERING_EBPF,
+};
+
+/** Neighbour behind the tunnel, see "Neighbours". */
+struct if_tap_neigh {
+	unsigned char itn_ip[16];
+	unsigned char itn_mac[6];
+	/** 4 or 16, 0 for a free entry. */
+	uint8_t       itn_iplen;
+	/** Router flag of the last neighbour advertisement. */
+	bool          itn_router;
+	uint64_t      itn_seen;
+};
+
+/** Queue of the interface and the thread which reads it. */
+struct if_tuntap_queue {
+	int                   itq_fd;
+	bool                  itq_claimed;
+	/** Read buffer for super-packets, see "Offloads". */
+	unsigned char        *itq_buf;
+	/** Segments of the last super-packet, owned by the reading thread. */
+	struct pppoat_list    itq_segs;
+};
+
 struct if_tuntap_ctx {
-	enum if_tuntap_type   itc_type;
-	char                 *itc_ifname;
-	int                   itc_fd;
+	enum if_tuntap_type      itc_type;
+	char                    *itc_ifname;
+	struct if_tuntap_queue  *itc_queues;
+	unsigned                 itc_queues_nr;
+	enum if_tuntap_steering  itc_steering;
+	bool                     itc_offload;
+	bool                     itc_no_pi;
+	bool                     itc_napi;
+	bool                     itc_napi_frags;
+	/** Compiled tun.filter, empty without the option. */
+	struct pppoat_filter     itc_filter;
+	/** The kernel doesn't run itc_filter. */
+	bool                     itc_filter_user;
+	bool                     itc_neigh_on;
+	/** Broadcast frames per second to the tunnel, -1 means no limit. */
+	long                     itc_bcast_rate;
+	/** Token bucket of itc_bcast_rate in thousandths of a frame. */
+	uint64_t                 itc_bcast_tokens;
+	uint64_t                 itc_bcast_last;
+	/** Neighbour table, NULL without TAP features of "Neighbours". */
+	struct if_tap_neigh     *itc_neigh;
+	/** Protects itc_neigh and the token bucket. */
+	struct pppoat_mutex      itc_l2_lock;
+	/** The peer understands the compact format, accessed atomically. */
+	bool                     itc_peer_compact;
+	/** Protects claiming of itc_queues by threads. */
+	struct pppoat_mutex      itc_queues_lock;
+	/** Queue of the calling worker thread. */
+	pthread_key_t            itc_queue_key;
+	/** MTU of the interface, the read buffer includes headers too. */
+	size_t                   itc_mtu;
 };
 
 static int if_tuntap_fd_init(struct if_tuntap_ctx *ctx,
 			     struct pppoat_conf   *conf,
 			     enum if_tuntap_type   type);
 static void if_tuntap_fd_fini(struct if_tuntap_ctx *ctx);
+static int if_tuntap_mtu_set(struct if_tuntap_ctx *ctx, size_t mtu);
 static void if_tun_compat_layer(struct if_tuntap_ctx *ctx,
 				struct pppoat_packet *pkt,
 				bool                  send);
+static int if_tuntap_offload_read(struct pppoat_module    *mod,
+				  struct if_tuntap_queue  *q,
+				  struct pppoat_packet   **pkt);
+static int if_tuntap_write(struct if_tuntap_ctx *ctx,
+			   int                   fd,
+			   const unsigned char  *data,
+			   size_t                len);
+
+static struct pppoat_list_descr if_tuntap_segs_descr =
+	PPPOAT_LIST_DESCR("Segments queue", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_MODULE_IF_TUN_SEGS_MAGIC);
 
 static bool if_tuntap_ctx_invariant(const struct if_tuntap_ctx *ctx)
 {
-	return ctx != NULL;
+	return ctx != NULL && ctx->itc_queues_nr > 0;
+}
+
+static int if_tuntap_conf_parse(struct if_tuntap_ctx *ctx,
+				struct pppoat_conf   *conf)
+{
+	bool  tun = ctx->itc_type == PPPOAT_IF_TUN;
+	char *str;
+	long  nr;
+	int   rc;
+
+	rc = pppoat_conf_find_long(conf, tun ? "tun.queues" : "tap.queues",
+				   &nr);
+	if (rc == 0) {
+		if (nr < 1 || nr > IF_TUNTAP_QUEUES_MAX) {
+			pppoat_error("tun", "Number of queues must be in range "
+				     "1..%d.", IF_TUNTAP_QUEUES_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->itc_queues_nr = (unsigned)nr;
+	}
+	rc = pppoat_conf_find_string_alloc(conf, tun ? "tun.steering" :
+						       "tap.steering", &str);
+	if (rc == 0) {
+		if (pppoat_streq(str, "ebpf"))
+			ctx->itc_steering = IF_TUNTAP_STEERING_EBPF;
+		else if (!pppoat_streq(str, "kernel")) {
+			pppoat_error("tun", "Unknown steering '%s', use "
+				     "'kernel' or 'ebpf'.", str);
+			rc = P_ERR(-EINVAL);
+		}
+		pppoat_free(str);
+		if (rc != 0)
+			return rc;
+	}
+	pppoat_conf_find_bool(conf, tun ? "tun.offload" : "tap.offload",
+			      &ctx->itc_offload);
+	pppoat_conf_find_bool(conf, tun ? "tun.no_pi" : "tap.no_pi",
+			      &ctx->itc_no_pi);
+	pppoat_conf_find_bool(conf, tun ? "tun.napi" : "tap.napi",
+			      &ctx->itc_napi);
+	ctx->itc_napi_frags = ctx->itc_napi && !tun;
+
+	if (!tun) {
+		pppoat_conf_find_bool(conf, "tap.neigh", &ctx->itc_neigh_on);
+		rc = pppoat_conf_find_long(conf, "tap.bcast_rate", &nr);
+		if (rc == 0 && nr < 0) {
+			pppoat_error("tun", "Broadcast rate must not be "
+				     "negative.");
+			return P_ERR(-EINVAL);
+		}
+		ctx->itc_bcast_rate = rc == 0 ? nr : -1;
+	}
+
+	rc = pppoat_conf_find_string_alloc(conf, tun ? "tun.filter" :
+						       "tap.filter", &str);
+	if (rc == 0) {
+		rc = pppoat_filter_compile(&ctx->itc_filter, str, tun ?
+					   PPPOAT_FILTER_LINK_IP :
+					   PPPOAT_FILTER_LINK_ETHER);
+		if (rc != 0)
+			pppoat_error("tun", "Invalid filter '%s' (rc=%d)", str,
+				     rc);
+		pppoat_free(str);
+	}
+	return rc == -ENOENT ? 0 : rc;
+}
+
+static int if_tuntap_queues_init(struct if_tuntap_ctx *ctx)
+{
+	unsigned i;
+	int      rc;
+
+	ctx->itc_queues = pppoat_calloc(ctx->itc_queues_nr,
+					sizeof *ctx->itc_queues);
+	if (ctx->itc_queues == NULL)
+		return P_ERR(-ENOMEM);
+	rc = pthread_key_create(&ctx->itc_queue_key, NULL);
+	if (rc != 0) {
+		pppoat_free(ctx->itc_queues);
+		return P_ERR(-rc);
+	}
+	for (i = 0; i < ctx->itc_queues_nr; ++i) {
+		ctx->itc_queues[i].itq_fd = -1;
+		pppoat_list_init(&ctx->itc_queues[i].itq_segs,
+				 &if_tuntap_segs_descr);
+	}
+	pppoat_mutex_init(&ctx->itc_queues_lock);
+
+	return 0;
+}
+
+static void if_tuntap_queues_fini(struct if_tuntap_ctx *ctx)
+{
+	unsigned i;
+
+	for (i = 0; i < ctx->itc_queues_nr; ++i)
+		pppoat_list_fini(&ctx->itc_queues[i].itq_segs);
+	pppoat_mutex_fini(&ctx->itc_queues_lock);
+	(void)pthread_key_delete(ctx->itc_queue_key);
+	pppoat_free(ctx->itc_queues);
+}
+
+/**
+ * Returns queue of the calling worker thread. A thread claims a free queue
+ * on the first call. The pipeline starts exactly itc_queues_nr threads.
+ */
+static struct if_tuntap_queue *if_tuntap_queue_get(struct if_tuntap_ctx *ctx)
+{
+	struct if_tuntap_queue *q;
+	unsigned                i;
+
+	if (ctx->itc_queues_nr == 1)
+		return &ctx->itc_queues[0];
+
+	q = pthread_getspecific(ctx->itc_queue_key);
+	if (q != NULL)
+		return q;
+
+	pppoat_mutex_lock(&ctx->itc_queues_lock);
+	for (i = 0; i < ctx->itc_queues_nr; ++i) {
+		if (!ctx->itc_queues[i].itq_claimed) {
+			q = &ctx->itc_queues[i];
+			q->itq_claimed = true;
+			break;
+		}
+	}
+	pppoat_mutex_unlock(&ctx->itc_queues_lock);
+
+	PPPOAT_ASSERT(q != NULL);
+	(void)pthread_setspecific(ctx->itc_queue_key, q);
+
+	return q;
+}
+
+/**
+ * Returns queue for an inbound packet. Packets of a flow always go to the
+ * same queue, so they keep order. `data' is the packet without headers of
+ * the module.
+ */
+static struct if_tuntap_queue *if_tuntap_queue_pick(struct if_tuntap_ctx *ctx,
+						    const unsigned char  *data,
+						    size_t                len)
+{
+	size_t   off = 0;
+	uint32_t hash;
+
+	if (ctx->itc_queues_nr == 1)
+		return &ctx->itc_queues[0];
+
+	if (ctx->itc_type == PPPOAT_IF_TAP) {
+		/* Skip Ethernet header and a VLAN tag. */
+		off = 14;
+		if (len >= off + 4 && data[12] == 0x81 && data[13] == 0x00)
+			off += 4;
+	}
+	hash = len > off ? pppoat_flow_hash(data + off, len - off) : 0;
+
+	return &ctx->itc_queues[hash % ctx->itc_queues_nr];
+}
+
+static bool if_tuntap_compact(struct if_tuntap_ctx *ctx)
+{
+	return ctx->itc_no_pi &&
+	       __atomic_load_n(&ctx->itc_peer_compact, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns length of the header which the module prepends to a packet read
+ * from the interface. The kernel provides packet information itself
+ * without tun.no_pi.
+ */
+static size_t if_tuntap_hdr_len(struct if_tuntap_ctx *ctx, bool compact)
+{
+	if (!ctx->itc_no_pi)
+		return 0;
+	if (!compact)
+		return IF_TUN_HDR_SIZE;
+	return ctx->itc_type == PPPOAT_IF_TAP ? 1 : 0;
+}
+
+/**
+ * The peer infers protocol of a compact TUN packet from the version nibble,
+ * so other packets need the full header.
+ */
+static bool if_tuntap_compact_fits(struct if_tuntap_ctx *ctx,
+				   const unsigned char  *data,
+				   size_t                len)
+{
+	return ctx->itc_type == PPPOAT_IF_TAP ||
+	       (len > 0 && (data[0] >> 4 == 4 || data[0] >> 4 == 6));
+}
+
+static void if_tuntap_hdr_put(struct if_tuntap_ctx *ctx,
+			      unsigned char        *hdr,
+			      size_t                hlen,
+			      const unsigned char  *data,
+			      size_t                len)
+{
+	unsigned proto = 0;
+
+	if (hlen == 1)
+		hdr[0] = IF_TAP_COMPACT_MARK;
+	if (hlen != IF_TUN_HDR_SIZE)
+		return;
+
+	if (ctx->itc_type == PPPOAT_IF_TAP && len >= 14)
+		proto = (unsigned)data[12] << 8 | data[13];
+	if (ctx->itc_type == PPPOAT_IF_TUN && len > 0 && data[0] >> 4 == 4)
+		proto = 0x0800;
+	if (ctx->itc_type == PPPOAT_IF_TUN && len > 0 && data[0] >> 4 == 6)
+		proto = 0x86dd;
+	hdr[0] = 0;
+	hdr[1] = IF_TUNTAP_PI_COMPACT;
+	hdr[2] = proto >> 8;
+	hdr[3] = proto & 0xff;
+}
+
+/**
+ * Returns length of the header of a packet from the tunnel or -EINVAL if
+ * the format is unknown. Notes peers which understand the compact format.
+ */
+static int if_tuntap_hdr_parse(struct if_tuntap_ctx *ctx,
+			       struct pppoat_packet *pkt,
+			       size_t               *hlen)
+{
+	const unsigned char *buf = pkt->pkt_data;
+
+	*hlen = IF_TUN_HDR_SIZE;
+	if (pkt->pkt_size < (ctx->itc_no_pi ? 1 : IF_TUN_HDR_SIZE))
+		return -EINVAL;
+	if (!ctx->itc_no_pi)
+		return 0;
+
+	if (buf[0] == 0) {
+		if (pkt->pkt_size < IF_TUN_HDR_SIZE)
+			return -EINVAL;
+		if ((buf[1] & IF_TUNTAP_PI_COMPACT) != 0 &&
+		    !if_tuntap_compact(ctx)) {
+			pppoat_info("tun", "Peer supports compact headers");
+			__atomic_store_n(&ctx->itc_peer_compact, true,
+					 __ATOMIC_RELAXED);
+		}
+		return 0;
+	}
+	*hlen = ctx->itc_type == PPPOAT_IF_TAP ? 1 : 0;
+	if (ctx->itc_type == PPPOAT_IF_TAP && buf[0] == IF_TAP_COMPACT_MARK)
+		return 0;
+	if (ctx->itc_type == PPPOAT_IF_TUN &&
+	    (buf[0] >> 4 == 4 || buf[0] >> 4 == 6))
+		return 0;
+	return -EINVAL;
+}
+
+static uint32_t if_tuntap_csum_add(uint32_t             sum,
+				   const unsigned char *buf,
+				   size_t               len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (uint32_t)buf[i] << 8 | buf[i + 1];
+	if (len % 2 != 0)
+		sum += (uint32_t)buf[len - 1] << 8;
+	return sum;
+}
+
+static void if_tuntap_csum_put(unsigned char *field, uint32_t sum)
+{
+	while (sum >> 16 != 0)
+		sum = (sum & 0xffff) + (sum >> 16);
+	/* Zero means "no checksum" for UDP, the other form is equivalent. */
+	sum = (~sum & 0xffff) ?: 0xffff;
+	field[0] = sum >> 8;
+	field[1] = sum & 0xff;
+}
+
+static void if_tuntap_be16_put(unsigned char *buf, uint32_t val)
+{
+	buf[0] = (val >> 8) & 0xff;
+	buf[1] = val & 0xff;
+}
+
+/* --------------------------------------------------------------------------
+ *  Neighbours of TAP interfaces.
+ * -------------------------------------------------------------------------- */
+
+static uint64_t if_tuntap_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int if_tap_l2_init(struct if_tuntap_ctx *ctx)
+{
+	if (!ctx->itc_neigh_on && ctx->itc_bcast_rate < 0)
+		return 0;
+
+	ctx->itc_neigh = pppoat_calloc(IF_TAP_NEIGH_MAX,
+				       sizeof *ctx->itc_neigh);
+	if (ctx->itc_neigh == NULL)
+		return P_ERR(-ENOMEM);
+	ctx->itc_bcast_tokens = (uint64_t)ctx->itc_bcast_rate * 1000;
+	ctx->itc_bcast_last   = if_tuntap_now();
+	pppoat_mutex_init(&ctx->itc_l2_lock);
+
+	return 0;
+}
+
+static void if_tap_l2_fini(struct if_tuntap_ctx *ctx)
+{
+	if (ctx->itc_neigh == NULL)
+		return;
+	pppoat_mutex_fini(&ctx->itc_l2_lock);
+	pppoat_free(ctx->itc_neigh);
+}
+
+/** Returns entry of the address, possibly expired, or NULL. */
+static struct if_tap_neigh *if_tap_neigh_find(struct if_tuntap_ctx *ctx,
+					      const unsigned char  *ip,
+					      size_t                iplen)
+{
+	struct if_tap_neigh *n;
+	size_t               i;
+
+	for (i = 0; i < IF_TAP_NEIGH_MAX; ++i) {
+		n = &ctx->itc_neigh[i];
+		if (n->itn_iplen == iplen && memcmp(n->itn_ip, ip, iplen) == 0)
+			return n;
+	}
+	return NULL;
+}
+
+/** Adds or refreshes a neighbour, the oldest entry makes room. */
+static void if_tap_neigh_add(struct if_tuntap_ctx *ctx,
+			     const unsigned char  *ip,
+			     size_t                iplen,
+			     const unsigned char  *mac,
+			     bool                  router)
+{
+	struct if_tap_neigh *n;
+	size_t               i;
+
+	/* Group addresses never answer. */
+	if ((mac[0] & 0x01) != 0)
+		return;
+
+	pppoat_mutex_lock(&ctx->itc_l2_lock);
+	n = if_tap_neigh_find(ctx, ip, iplen);
+	if (n == NULL) {
+		n = &ctx->itc_neigh[0];
+		for (i = 1; i < IF_TAP_NEIGH_MAX; ++i) {
+			if (ctx->itc_neigh[i].itn_seen < n->itn_seen)
+				n = &ctx->itc_neigh[i];
+		}
+	}
+	memcpy(n->itn_ip, ip, iplen);
+	memcpy(n->itn_mac, mac, sizeof n->itn_mac);
+	n->itn_iplen  = (uint8_t)iplen;
+	n->itn_router = router;
+	n->itn_seen   = if_tuntap_now();
+	pppoat_mutex_unlock(&ctx->itc_l2_lock);
+}
+
+/** Copies MAC of a live neighbour. */
+static bool if_tap_neigh_lookup(struct if_tuntap_ctx *ctx,
+				const unsigned char  *ip,
+				size_t                iplen,
+				unsigned char        *mac,
+				bool                 *router)
+{
+	struct if_tap_neigh *n;
+	bool                 found;
+
+	pppoat_mutex_lock(&ctx->itc_l2_lock);
+	n = if_tap_neigh_find(ctx, ip, iplen);
+	found = n != NULL && if_tuntap_now() - n->itn_seen < IF_TAP_NEIGH_TTL;
+	if (found) {
+		memcpy(mac, n->itn_mac, sizeof n->itn_mac);
+		*router = n->itn_router;
+	}
+	pppoat_mutex_unlock(&ctx->itc_l2_lock);
+
+	return found;
+}
+
+/** Returns ARP payload of an Ethernet/IPv4 ARP frame or NULL. */
+static const unsigned char *if_tap_arp(const unsigned char *frame, size_t len)
+{
+	static const unsigned char hdr[] = { 0x00, 0x01, 0x08, 0x00, 6, 4 };
+
+	if (len < 14 + 28 ||
+	    (frame[12] << 8 | frame[13]) != IF_TAP_ETH_ARP ||
+	    memcmp(frame + 14, hdr, sizeof hdr) != 0)
+		return NULL;
+	return frame + 14;
+}
+
+/**
+ * Returns ICMPv6 message of a neighbour discovery frame or NULL. Valid
+ * messages have hop limit 255 and no extension headers.
+ */
+static const unsigned char *if_tap_nd(const unsigned char *frame,
+				      size_t               len,
+				      size_t              *icmp_len)
+{
+	const unsigned char *ip = frame + 14;
+
+	if (len < 14 + 40 + 24 ||
+	    (frame[12] << 8 | frame[13]) != IF_TAP_ETH_IP6 ||
+	    ip[0] >> 4 != 6 || ip[6] != 58 || ip[7] != 255 ||
+	    ip[40] < 133 || ip[40] > 137)
+		return NULL;
+	*icmp_len = pppoat_min(len - 14 - 40, (size_t)(ip[4] << 8 | ip[5]));
+	return ip + 40;
+}
+
+/** Returns link-layer address of the NS/NA option or NULL. */
+static const unsigned char *if_tap_nd_lladdr(const unsigned char *icmp,
+					     size_t               len,
+					     unsigned             type)
+{
+	size_t off;
+	size_t olen;
+
+	for (off = 24; off + 8 <= len; off += olen) {
+		olen = (size_t)icmp[off + 1] * 8;
+		if (olen == 0 || off + olen > len)
+			break;
+		if (icmp[off] == type && olen == 8)
+			return icmp + off + 2;
+	}
+	return NULL;
+}
+
+/** Learns from a frame which arrived from the tunnel. */
+static void if_tap_neigh_learn(struct if_tuntap_ctx *ctx,
+			       const unsigned char  *frame,
+			       size_t                len)
+{
+	const unsigned char *p;
+	const unsigned char *mac;
+	size_t               icmp_len;
+
+	p = if_tap_arp(frame, len);
+	if (p != NULL) {
+		/* Probes of duplicate address detection have no sender. */
+		if (memcmp(p + 14, "\0\0\0\0", 4) != 0)
+			if_tap_neigh_add(ctx, p + 14, 4, p + 8, false);
+		return;
+	}
+	p = if_tap_nd(frame, len, &icmp_len);
+	if (p != NULL && p[0] == IF_TAP_ND_NA) {
+		mac = if_tap_nd_lladdr(p, icmp_len, 2);
+		if (mac != NULL)
+			if_tap_neigh_add(ctx, p + 8, 16, mac,
+					 (p[4] & 0x80) != 0);
+	}
+}
+
+static int if_tap_reply(struct if_tuntap_ctx *ctx,
+			int                   fd,
+			unsigned char        *buf,
+			size_t                len,
+			unsigned              type)
+{
+	size_t pi = ctx->itc_no_pi ? 0 : IF_TUN_HDR_SIZE;
+
+	if (pi > 0) {
+		buf[0] = 0;
+		buf[1] = 0;
+		if_tuntap_be16_put(&buf[2], type);
+	}
+	if_tuntap_be16_put(&buf[pi + 12], type);
+	return if_tuntap_write(ctx, fd, buf, pi + len);
+}
+
+/** Answers a broadcast ARP request from the table. */
+static bool if_tap_neigh_arp(struct if_tuntap_ctx *ctx,
+			     int                   fd,
+			     const unsigned char  *frame,
+			     size_t                len)
+{
+	unsigned char        buf[IF_TUN_HDR_SIZE + 14 + 28];
+	unsigned char       *r = buf + (ctx->itc_no_pi ? 0 : IF_TUN_HDR_SIZE);
+	unsigned char        mac[6];
+	const unsigned char *p = if_tap_arp(frame, len);
+	bool                 router;
+
+	if (p == NULL || p[7] != 1 ||
+	    memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6) != 0 ||
+	    memcmp(p + 14, "\0\0\0\0", 4) == 0 ||
+	    !if_tap_neigh_lookup(ctx, p + 24, 4, mac, &router))
+		return false;
+
+	memcpy(r, frame + 6, 6);
+	memcpy(r + 6, mac, 6);
+	memcpy(r + 14, p, 6);
+	r[20] = 0;
+	r[21] = 2;
+	memcpy(r + 22, mac, 6);
+	memcpy(r + 28, p + 24, 4);
+	memcpy(r + 32, p + 8, 10);
+
+	return if_tap_reply(ctx, fd, buf, 14 + 28, IF_TAP_ETH_ARP) == 0;
+}
+
+/** Answers a multicast neighbour solicitation from the table. */
+static bool if_tap_neigh_ns(struct if_tuntap_ctx *ctx,
+			    int                   fd,
+			    const unsigned char  *frame,
+			    size_t                len)
+{
+	unsigned char        buf[IF_TUN_HDR_SIZE + 14 + 40 + 32];
+	unsigned char       *r = buf + (ctx->itc_no_pi ? 0 : IF_TUN_HDR_SIZE);
+	unsigned char       *ip = r + 14;
+	unsigned char       *icmp = ip + 40;
+	unsigned char        mac[6];
+	const unsigned char *p;
+	size_t               icmp_len;
+	uint32_t             sum;
+	bool                 router;
+
+	p = if_tap_nd(frame, len, &icmp_len);
+	if (p == NULL || p[0] != IF_TAP_ND_NS || (frame[0] & 0x01) == 0 ||
+	    /* Duplicate address detection comes from the unspecified. */
+	    memcmp(frame + 14 + 8, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",
+		   16) == 0 ||
+	    !if_tap_neigh_lookup(ctx, p + 8, 16, mac, &router))
+		return false;
+
+	memcpy(r, frame + 6, 6);
+	memcpy(r + 6, mac, 6);
+	memset(ip, 0, 40 + 32);
+	ip[0] = 0x60;
+	ip[5] = 32;
+	ip[6] = 58;
+	ip[7] = 255;
+	memcpy(ip + 8, p + 8, 16);
+	memcpy(ip + 24, frame + 14 + 8, 16);
+	icmp[0] = IF_TAP_ND_NA;
+	/* Solicited and override. */
+	icmp[4] = (router ? 0x80 : 0) | 0x60;
+	memcpy(icmp + 8, p + 8, 16);
+	icmp[24] = 2;
+	icmp[25] = 1;
+	memcpy(icmp + 26, mac, 6);
+	sum = if_tuntap_csum_add(32 + 58, ip + 8, 32);
+	if_tuntap_csum_put(icmp + 2, if_tuntap_csum_add(sum, icmp, 32));
+
+	return if_tap_reply(ctx, fd, buf, 14 + 40 + 32, IF_TAP_ETH_IP6) == 0;
+}
+
+/** Takes a token for a group frame other than ARP and NDP. */
+static bool if_tap_bcast_allow(struct if_tuntap_ctx *ctx,
+			       const unsigned char  *frame,
+			       size_t                len)
+{
+	uint64_t now;
+	uint64_t max;
+	size_t   icmp_len;
+	bool     allow;
+
+	if (ctx->itc_bcast_rate < 0 || len < 14 || (frame[0] & 0x01) == 0 ||
+	    if_tap_arp(frame, len) != NULL ||
+	    if_tap_nd(frame, len, &icmp_len) != NULL)
+		return true;
+
+	pppoat_mutex_lock(&ctx->itc_l2_lock);
+	now = if_tuntap_now();
+	max = (uint64_t)ctx->itc_bcast_rate * 1000;
+	ctx->itc_bcast_tokens += (now - ctx->itc_bcast_last) *
+				 (uint64_t)ctx->itc_bcast_rate;
+	ctx->itc_bcast_tokens = pppoat_min(ctx->itc_bcast_tokens, max);
+	ctx->itc_bcast_last   = now;
+	allow = ctx->itc_bcast_tokens >= 1000;
+	if (allow)
+		ctx->itc_bcast_tokens -= 1000;
+	pppoat_mutex_unlock(&ctx->itc_l2_lock);
+
+	return allow;
+}
+
+/**
+ * Handles a frame read from the interface. Returns true if the frame
+ * doesn't go to the tunnel.
+ */
+static bool if_tap_l2_consume(struct if_tuntap_ctx *ctx,
+			      int                   fd,
+			      const unsigned char  *frame,
+			      size_t                len)
+{
+	if (ctx->itc_neigh == NULL)
+		return false;
+	if (ctx->itc_neigh_on && (if_tap_neigh_arp(ctx, fd, frame, len) ||
+				  if_tap_neigh_ns(ctx, fd, frame, len)))
+		return true;
+	return !if_tap_bcast_allow(ctx, frame, len);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** Runs tun.filter if the kernel doesn't, see "Filters". */
+static bool if_tuntap_filtered(struct if_tuntap_ctx *ctx,
+			       const unsigned char  *data,
+			       size_t                len)
+{
+	return ctx->itc_filter_user &&
+	       pppoat_filter_run(&ctx->itc_filter, data, len) == 0;
 }
 
 static int if_tuntap_init(struct pppoat_module *mod,
@@ -64,19 +849,69 @@ static int if_tuntap_init(struct pppoat_module *mod,
 			  enum if_tuntap_type   type)
 {
 	struct if_tuntap_ctx *ctx;
+	const char           *key;
+	long                  mtu;
 	int                   rc;
 
 	ctx = pppoat_alloc(sizeof *ctx);
 	if (ctx == NULL)
 		return P_ERR(-ENOMEM);
 
-	ctx->itc_type   = type;
-	mod->m_userdata = ctx;
-
+	ctx->itc_type      = type;
+	ctx->itc_mtu       = type == PPPOAT_IF_TUN ? IF_TUN_MTU : IF_TAP_MTU;
+	ctx->itc_queues_nr = 1;
+	ctx->itc_steering  = IF_TUNTAP_STEERING_KERNEL;
+	ctx->itc_peer_compact = false;
+	ctx->itc_filter       = (struct pppoat_filter){};
+	ctx->itc_filter_user  = false;
+	ctx->itc_neigh_on     = false;
+	ctx->itc_bcast_rate   = -1;
+	ctx->itc_neigh        = NULL;
+	mod->m_userdata    = ctx;
+
+	rc = if_tuntap_conf_parse(ctx, conf) ?:
+	     if_tap_l2_init(ctx);
+	if (rc == 0) {
+		rc = if_tuntap_queues_init(ctx);
+		if (rc != 0)
+			if_tap_l2_fini(ctx);
+	}
+	if (rc != 0) {
+		pppoat_filter_fini(&ctx->itc_filter);
+		pppoat_free(ctx);
+		return rc;
+	}
 	rc = if_tuntap_fd_init(ctx, conf, type);
+	if (rc != 0) {
+		if_tuntap_queues_fini(ctx);
+		if_tap_l2_fini(ctx);
+		pppoat_filter_fini(&ctx->itc_filter);
+		pppoat_free(ctx);
+		return rc;
+	}
 
-	if (rc == 0)
-		pppoat_debug("tun", "Created interface %s", ctx->itc_ifname);
+	pppoat_debug("tun", "Created interface %s with %u queue(s)",
+		     ctx->itc_ifname, ctx->itc_queues_nr);
+
+	/* Large MTU requires the frag plugin or a transport with large MTU. */
+	key = type == PPPOAT_IF_TUN ? "tun.mtu" : "tap.mtu";
+	if (pppoat_conf_find_long(conf, key, &mtu) == 0) {
+		if (mtu < IF_TUNTAP_MTU_MIN || mtu > IF_TUNTAP_MTU_MAX) {
+			pppoat_error("tun", "MTU must be in range %d..%d.",
+				     IF_TUNTAP_MTU_MIN, IF_TUNTAP_MTU_MAX);
+			rc = P_ERR(-EINVAL);
+		}
+		rc = rc ?: if_tuntap_mtu_set(ctx, (size_t)mtu);
+		if (rc == 0)
+			ctx->itc_mtu = (size_t)mtu;
+		else {
+			if_tuntap_fd_fini(ctx);
+			if_tuntap_queues_fini(ctx);
+			if_tap_l2_fini(ctx);
+			pppoat_filter_fini(&ctx->itc_filter);
+			pppoat_free(ctx);
+		}
+	}
 
 	return rc;
 }
@@ -94,10 +929,20 @@ static int if_tap_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 static void if_tuntap_fini(struct pppoat_module *mod)
 {
 	struct if_tuntap_ctx *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
+	unsigned              i;
 
 	PPPOAT_ASSERT(if_tuntap_ctx_invariant(ctx));
 
+	for (i = 0; i < ctx->itc_queues_nr; ++i) {
+		while ((pkt = pppoat_list_dequeue(&ctx->itc_queues[i].itq_segs))
+		       != NULL)
+			pppoat_packet_put(mod->m_pkts, pkt);
+	}
 	if_tuntap_fd_fini(ctx);
+	if_tuntap_queues_fini(ctx);
+	if_tap_l2_fini(ctx);
+	pppoat_filter_fini(&ctx->itc_filter);
 	pppoat_free(ctx);
 }
 
@@ -118,31 +963,66 @@ static int if_tuntap_stop(struct pppoat_module *mod)
 static int if_tuntap_pkt_get(struct pppoat_module  *mod,
 			     struct pppoat_packet **pkt)
 {
-	struct if_tuntap_ctx *ctx = mod->m_userdata;
-	struct pppoat_packet *pkt2;
-	size_t                size;
-	ssize_t               rlen;
-	int                   fd;
-	int                   rc;
+	struct if_tuntap_ctx   *ctx = mod->m_userdata;
+	struct if_tuntap_queue *q;
+	struct pppoat_packet   *pkt2;
+	unsigned char          *buf;
+	size_t                  size;
+	size_t                  hlen;
+	ssize_t                 rlen;
+	ssize_t                 pi;
+	int                     fd;
+	int                     rc;
 
 	PPPOAT_ASSERT(if_tuntap_ctx_invariant(ctx));
 
-	size = pppoat_module_mtu(mod);
-	fd   = ctx->itc_fd;
+	q = if_tuntap_queue_get(ctx);
+	pkt2 = pppoat_list_dequeue(&q->itq_segs);
+	if (pkt2 != NULL) {
+		*pkt = pkt2;
+		return 0;
+	}
+	if (ctx->itc_offload)
+		return if_tuntap_offload_read(mod, q, pkt);
+
+	size = pppoat_module_mtu(mod) + (ctx->itc_type == PPPOAT_IF_TUN ?
+					 IF_TUN_HDR_SIZE : IF_TAP_HDR_SIZE);
+	hlen = if_tuntap_hdr_len(ctx, if_tuntap_compact(ctx));
+	fd   = q->itq_fd;
 	pkt2 = pppoat_packet_get(mod->m_pkts, size);
 	rc   = pkt2 == NULL ? P_ERR(-ENOMEM) : 0;
 
 	rc = rc ?: pppoat_io_select_single_read(fd);
 	if (rc == 0) {
-		rlen = read(fd, pkt2->pkt_data, pkt2->pkt_size);
+		buf  = pkt2->pkt_data;
+		rlen = read(fd, buf + hlen, pkt2->pkt_size - hlen);
 		if (rlen < 0) {
 			rc = pppoat_io_error_is_recoverable(-errno) ?
 			     -errno : P_ERR(-errno);
 		}
 		if (rlen == 0)
 			rc = P_ERR(-EIO);
-		if (rlen > 0) {
-			pkt2->pkt_size = rlen;
+		pi = ctx->itc_no_pi ? 0 : IF_TUN_HDR_SIZE;
+		if (rlen > pi && (if_tuntap_filtered(ctx, buf + hlen + pi,
+						     rlen - pi) ||
+				  if_tap_l2_consume(ctx, fd, buf + hlen + pi,
+						    rlen - pi))) {
+			/* Nothing to return, the pipeline polls again. */
+			pppoat_packet_put(mod->m_pkts, pkt2);
+			*pkt = NULL;
+			return 0;
+		}
+		if (rlen > 0 && hlen == 0 && if_tuntap_compact(ctx) &&
+		    !if_tuntap_compact_fits(ctx, buf, rlen)) {
+			hlen = IF_TUN_HDR_SIZE;
+			if ((size_t)rlen + hlen > pkt2->pkt_size)
+				rc = P_ERR(-EMSGSIZE);
+			else
+				memmove(buf + hlen, buf, rlen);
+		}
+		if (rc == 0 && rlen > 0) {
+			if_tuntap_hdr_put(ctx, buf, hlen, buf + hlen, rlen);
+			pkt2->pkt_size = hlen + rlen;
 			if_tun_compat_layer(ctx, pkt2, true);
 		}
 	}
@@ -161,6 +1041,10 @@ static int if_tuntap_process(struct pppoat_module  *mod,
 			     struct pppoat_packet **next)
 {
 	struct if_tuntap_ctx *ctx = mod->m_userdata;
+	unsigned char        *data;
+	size_t                hlen;
+	size_t                len;
+	int                   fd;
 	int                   rc;
 
 	PPPOAT_ASSERT(if_tuntap_ctx_invariant(ctx));
@@ -169,23 +1053,62 @@ static int if_tuntap_process(struct pppoat_module  *mod,
 	if (pkt == NULL)
 		return if_tuntap_pkt_get(mod, next);
 
+	*next = NULL;
+	if (if_tuntap_hdr_parse(ctx, pkt, &hlen) != 0) {
+		pppoat_debug("tun", "Dropped packet of unknown format");
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
 	if_tun_compat_layer(ctx, pkt, false);
-	rc = pppoat_io_write_sync(ctx->itc_fd, pkt->pkt_data, pkt->pkt_size);
+	data = (unsigned char *)pkt->pkt_data + hlen;
+	len  = pkt->pkt_size - hlen;
+	fd   = if_tuntap_queue_pick(ctx, data, len)->itq_fd;
+	if (ctx->itc_neigh_on)
+		if_tap_neigh_learn(ctx, data, len);
+	/* The interface expects packet information without tun.no_pi. */
+	if (!ctx->itc_no_pi) {
+		data = pkt->pkt_data;
+		len  = pkt->pkt_size;
+	}
+	rc = if_tuntap_write(ctx, fd, data, len);
 	if (rc == 0)
 		pppoat_packet_put(mod->m_pkts, pkt);
 
-	*next = NULL;
 	return rc;
 }
 
-static size_t if_tun_mtu(struct pppoat_module *mod)
+static unsigned if_tuntap_workers(struct pppoat_module *mod)
 {
-	return IF_TUN_MTU;
+	struct if_tuntap_ctx *ctx = mod->m_userdata;
+
+	return ctx->itc_queues_nr;
 }
 
-static size_t if_tap_mtu(struct pppoat_module *mod)
+static size_t if_tuntap_mtu(struct pppoat_module *mod)
 {
-	return IF_TAP_MTU;
+	struct if_tuntap_ctx *ctx = mod->m_userdata;
+
+	return ctx->itc_mtu;
+}
+
+/**
+ * Follows path MTU of the transport. Transport's MTU covers the packet
+ * information header and the Ethernet header in TAP mode.
+ */
+static size_t if_tuntap_mtu_update(struct pppoat_module *mod, size_t mtu)
+{
+	struct if_tuntap_ctx *ctx = mod->m_userdata;
+	size_t                hdr;
+
+	hdr = ctx->itc_type == PPPOAT_IF_TUN ? IF_TUN_HDR_SIZE :
+					       IF_TAP_HDR_SIZE;
+	mtu = mtu > hdr + IF_TUNTAP_MTU_MIN ? mtu - hdr : IF_TUNTAP_MTU_MIN;
+	mtu = pppoat_min(mtu, (size_t)IF_TUNTAP_MTU_MAX);
+	if (mtu != ctx->itc_mtu && if_tuntap_mtu_set(ctx, mtu) == 0) {
+		pppoat_info("tun", "MTU of %s is %zu", ctx->itc_ifname, mtu);
+		ctx->itc_mtu = mtu;
+	}
+	return 0;
 }
 
 static struct pppoat_module_ops if_tun_ops = {
@@ -194,7 +1117,9 @@ static struct pppoat_module_ops if_tun_ops = {
 	.mop_run     = &if_tuntap_run,
 	.mop_stop    = &if_tuntap_stop,
 	.mop_process = &if_tuntap_process,
-	.mop_mtu     = &if_tun_mtu,
+	.mop_mtu     = &if_tuntap_mtu,
+	.mop_mtu_set = &if_tuntap_mtu_update,
+	.mop_workers = &if_tuntap_workers,
 };
 
 struct pppoat_module_impl pppoat_module_if_tun = {
@@ -211,7 +1136,9 @@ static struct pppoat_module_ops if_tap_ops = {
 	.mop_run     = &if_tuntap_run,
 	.mop_stop    = &if_tuntap_stop,
 	.mop_process = &if_tuntap_process,
-	.mop_mtu     = &if_tap_mtu,
+	.mop_mtu     = &if_tuntap_mtu,
+	.mop_mtu_set = &if_tuntap_mtu_update,
+	.mop_workers = &if_tuntap_workers,
 };
 
 struct pppoat_module_impl pppoat_module_if_tap = {
@@ -227,8 +1154,10 @@ struct pppoat_module_impl pppoat_module_if_tap = {
  * -------------------------------------------------------------------------- */
 #ifdef __APPLE__
 
+#include <net/if.h>		/* ifreq */
 #include <net/if_utun.h>	/* UTUN_CONTROL_NAME, UTUN_OPT_IFNAME */
 #include <sys/ioctl.h>		/* ioctl */
+#include <sys/sockio.h>		/* SIOCSIFMTU */
 #include <sys/kern_control.h>	/* sockaddr_ctl, ctl_info */
 #include <sys/socket.h>		/* socket */
 #include <sys/sys_domain.h>	/* SYSPROTO_CONTROL, AF_SYS_CONTROL */
@@ -246,6 +1175,15 @@ static int if_tuntap_fd_init(struct if_tuntap_ctx *ctx,
 
 	PPPOAT_ASSERT(type == PPPOAT_IF_TUN);
 
+	if (ctx->itc_queues_nr > 1 || ctx->itc_offload || ctx->itc_no_pi ||
+	    ctx->itc_napi) {
+		pppoat_error("tun", "Multiple queues, offloads, no_pi and napi "
+			     "are not supported.");
+		return P_ERR(-ENOSYS);
+	}
+	/* uTun can't run filters. */
+	ctx->itc_filter_user = ctx->itc_filter.f_nr > 0;
+
 	fd = socket(PF_SYSTEM, SOCK_DGRAM, SYSPROTO_CONTROL);
 	PPPOAT_ASSERT(fd >= 0); /* XXX */
 
@@ -270,18 +1208,41 @@ static int if_tuntap_fd_init(struct if_tuntap_ctx *ctx,
 
 	(void)pppoat_io_fd_blocking_set(fd, false);
 
-	ctx->itc_fd     = fd;
-	ctx->itc_ifname = pppoat_strdup(ifname);
+	ctx->itc_queues[0].itq_fd = fd;
+	ctx->itc_ifname           = pppoat_strdup(ifname);
 
 	return 0;
 }
 
 static void if_tuntap_fd_fini(struct if_tuntap_ctx *ctx)
 {
-	(void)close(ctx->itc_fd);
+	(void)close(ctx->itc_queues[0].itq_fd);
 	pppoat_free(ctx->itc_ifname);
 }
 
+static int if_tuntap_mtu_set(struct if_tuntap_ctx *ctx, size_t mtu)
+{
+	struct ifreq ifr;
+	int          sock;
+	int          rc;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return P_ERR(-errno);
+
+	memset(&ifr, 0, sizeof ifr);
+	strncpy(ifr.ifr_name, ctx->itc_ifname, sizeof(ifr.ifr_name) - 1);
+	ifr.ifr_mtu = (int)mtu;
+	rc = ioctl(sock, SIOCSIFMTU, &ifr);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	if (rc != 0)
+		pppoat_error("tun", "Couldn't set MTU %zu on %s (rc=%d)",
+			     mtu, ctx->itc_ifname, rc);
+	(void)close(sock);
+
+	return rc;
+}
+
 enum {
 	TUN_TYPE_IP4 = 0x0800,
 	TUN_TYPE_IP6 = 0x86dd,
@@ -361,56 +1322,609 @@ static void if_tun_compat_layer(struct if_tuntap_ctx *ctx,
 	}
 }
 
+static int if_tuntap_offload_read(struct pppoat_module    *mod,
+				  struct if_tuntap_queue  *q,
+				  struct pppoat_packet   **pkt)
+{
+	return P_ERR(-ENOSYS);
+}
+
+static int if_tuntap_write(struct if_tuntap_ctx *ctx,
+			   int                   fd,
+			   const unsigned char  *data,
+			   size_t                len)
+{
+	return pppoat_io_write_sync(fd, data, len);
+}
+
 /* -------------------------------------------------------------------------- */
 #else /* __APPLE__ */
 
 #include <sys/socket.h>		/* sockaddr required for linux/if.h */
 #include <linux/if.h>		/* ifreq */
+#include <linux/filter.h>	/* sock_fprog */
 #include <linux/if_tun.h>	/* TUNSETIFF */
+#include <linux/virtio_net.h>	/* virtio_net_hdr */
+#include <netinet/in.h>		/* IPPROTO_TCP */
 #include <sys/ioctl.h>		/* ioctl */
+#include <sys/uio.h>		/* writev */
 #include <fcntl.h>		/* O_RDWR */
 
 static const char *if_tun_path = "/dev/net/tun";
 
+/**
+ * Attaches a new descriptor to the interface `ifr'. An empty name creates
+ * a new interface and the kernel fills the name in.
+ */
+static int if_tuntap_queue_open(struct ifreq *ifr, int *fd)
+{
+	int rc;
+
+	*fd = open(if_tun_path, O_RDWR);
+	if (*fd < 0)
+		return P_ERR(-errno);
+	rc = ioctl(*fd, TUNSETIFF, (void *)ifr);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	rc = rc ?: pppoat_io_fd_blocking_set(*fd, false);
+	if (rc != 0)
+		(void)close(*fd);
+	return rc;
+}
+
+#ifdef TUNSETSTEERINGEBPF
+/**
+ * Loads the steering program. It returns XOR of the IP addresses and, for
+ * TCP and UDP, the ports, folded to 16 bits. The kernel takes the result
+ * modulo number of queues. Packets start with Ethernet header in TAP mode.
+ */
+static int if_tuntap_steering_prog(struct if_tuntap_ctx *ctx, int *fd)
+{
+	int                   off = ctx->itc_type == PPPOAT_IF_TAP ? 14 : 0;
+	const struct bpf_insn insns[] = {
+		PPPOAT_BPF_MOV64_REG(BPF_REG_6, BPF_REG_1),
+		PPPOAT_BPF_LD_ABS(BPF_B, off),
+		PPPOAT_BPF_MOV64_REG(BPF_REG_7, BPF_REG_0),
+		PPPOAT_BPF_ALU64_IMM(BPF_RSH, BPF_REG_0, 4),
+		PPPOAT_BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 6, 17),	/* ip6 */
+		PPPOAT_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 4, 29),	/* zero */
+		/* IPv4, r7 is length of the header. */
+		PPPOAT_BPF_ALU64_IMM(BPF_AND, BPF_REG_7, 0x0f),
+		PPPOAT_BPF_ALU64_IMM(BPF_LSH, BPF_REG_7, 2),
+		PPPOAT_BPF_LD_ABS(BPF_W, off + 12),
+		PPPOAT_BPF_MOV64_REG(BPF_REG_8, BPF_REG_0),
+		PPPOAT_BPF_LD_ABS(BPF_W, off + 16),
+		PPPOAT_BPF_ALU64_REG(BPF_XOR, BPF_REG_8, BPF_REG_0),
+		PPPOAT_BPF_LD_ABS(BPF_B, off + 9),
+		PPPOAT_BPF_MOV64_REG(BPF_REG_9, BPF_REG_0),
+		/* Fragments don't carry ports. */
+		PPPOAT_BPF_LD_ABS(BPF_H, off + 6),
+		PPPOAT_BPF_ALU64_IMM(BPF_AND, BPF_REG_0, 0x3fff),
+		PPPOAT_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 14),	/* out */
+		PPPOAT_BPF_JMP_IMM(BPF_JEQ, BPF_REG_9, IPPROTO_TCP, 1),
+		PPPOAT_BPF_JMP_IMM(BPF_JNE, BPF_REG_9, IPPROTO_UDP, 12),
+		PPPOAT_BPF_LD_IND(BPF_W, BPF_REG_7, off),
+		PPPOAT_BPF_ALU64_REG(BPF_XOR, BPF_REG_8, BPF_REG_0),
+		PPPOAT_BPF_JA(9),				/* out */
+		/* ip6: the last words of the addresses. */
+		PPPOAT_BPF_LD_ABS(BPF_W, off + 20),
+		PPPOAT_BPF_MOV64_REG(BPF_REG_8, BPF_REG_0),
+		PPPOAT_BPF_LD_ABS(BPF_W, off + 36),
+		PPPOAT_BPF_ALU64_REG(BPF_XOR, BPF_REG_8, BPF_REG_0),
+		PPPOAT_BPF_LD_ABS(BPF_B, off + 6),
+		PPPOAT_BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, IPPROTO_TCP, 1),
+		PPPOAT_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, IPPROTO_UDP, 2),
+		PPPOAT_BPF_LD_ABS(BPF_W, off + 40),
+		PPPOAT_BPF_ALU64_REG(BPF_XOR, BPF_REG_8, BPF_REG_0),
+		/* out */
+		PPPOAT_BPF_MOV64_REG(BPF_REG_0, BPF_REG_8),
+		PPPOAT_BPF_ALU64_IMM(BPF_RSH, BPF_REG_0, 16),
+		PPPOAT_BPF_ALU64_REG(BPF_XOR, BPF_REG_0, BPF_REG_8),
+		PPPOAT_BPF_EXIT(),
+		/* zero */
+		PPPOAT_BPF_MOV64_IMM(BPF_REG_0, 0),
+		PPPOAT_BPF_EXIT(),
+	};
+
+	return pppoat_bpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER, insns,
+				    ARRAY_SIZE(insns), fd);
+}
+
+static int if_tuntap_steering_attach(struct if_tuntap_ctx *ctx)
+{
+	int prog_fd;
+	int rc;
+
+	rc = if_tuntap_steering_prog(ctx, &prog_fd);
+	if (rc != 0)
+		return rc;
+	/* The interface holds a reference to the program. */
+	rc = ioctl(ctx->itc_queues[0].itq_fd, TUNSETSTEERINGEBPF, &prog_fd);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	(void)close(prog_fd);
+
+	return rc;
+}
+#else /* TUNSETSTEERINGEBPF */
+static int if_tuntap_steering_attach(struct if_tuntap_ctx *ctx)
+{
+	return P_ERR(-ENOSYS);
+}
+#endif /* TUNSETSTEERINGEBPF */
+
+/** See "Filters". */
+static int if_tuntap_filter_attach(struct if_tuntap_ctx *ctx)
+{
+	struct sock_fprog fprog;
+	int               fd = ctx->itc_queues[0].itq_fd;
+	int               rc = -ENOSYS;
+#ifdef TUNSETFILTEREBPF
+	int               prog_fd;
+#endif
+
+	if (ctx->itc_type == PPPOAT_IF_TAP) {
+		/* struct pppoat_filter_insn has layout of sock_filter. */
+		fprog.len    = (unsigned short)ctx->itc_filter.f_nr;
+		fprog.filter = (struct sock_filter *)ctx->itc_filter.f_insns;
+		rc = ioctl(fd, TUNATTACHFILTER, &fprog);
+		if (rc == 0)
+			return 0;
+		rc = P_ERR(-errno);
+	}
+#ifdef TUNSETFILTEREBPF
+	rc = pppoat_bpf_prog_load_filter(&ctx->itc_filter, &prog_fd);
+	if (rc == 0) {
+		rc = ioctl(fd, TUNSETFILTEREBPF, &prog_fd);
+		rc = rc < 0 ? P_ERR(-errno) : 0;
+		(void)close(prog_fd);
+	}
+#endif /* TUNSETFILTEREBPF */
+	return rc;
+}
+
+enum {
+	/** Packet information, virtio_net_hdr, Ethernet header, VLAN tag. */
+	IF_TUNTAP_OFFLOAD_BUF = 4 + sizeof(struct virtio_net_hdr) + 14 + 4 +
+				IF_TUNTAP_MTU_MAX,
+	IF_TCP_FLAG_FIN = 0x01,
+	IF_TCP_FLAG_PSH = 0x08,
+	IF_TCP_FLAG_CWR = 0x80,
+};
+
+/** Completes a partial checksum, like the kernel does without offloads. */
+static void if_tuntap_csum_complete(unsigned char                *data,
+				    size_t                        len,
+				    const struct virtio_net_hdr  *vh)
+{
+	unsigned char *field;
+
+	if (vh->csum_start + vh->csum_offset + 2 > len)
+		return;
+	field = data + vh->csum_start + vh->csum_offset;
+	/* The field contains sum of the pseudo header already. */
+	if_tuntap_csum_put(field, if_tuntap_csum_add(0, data + vh->csum_start,
+						     len - vh->csum_start));
+}
+
+/**
+ * Builds segment `idx' of a TCP super-packet. `data' starts with IP header
+ * in TUN mode and Ethernet header in TAP mode, `hlen' covers all headers.
+ */
+static void if_tuntap_tso_segment(unsigned char       *seg,
+				  const unsigned char *data,
+				  size_t               l3,
+				  size_t               l4,
+				  size_t               hlen,
+				  size_t               off,
+				  size_t               len,
+				  unsigned             idx,
+				  bool                 last)
+{
+	unsigned char *ip  = seg + l3;
+	unsigned char *tcp = seg + l4;
+	uint32_t       sum;
+	uint32_t       seq;
+
+	memcpy(seg, data, hlen);
+	memcpy(seg + hlen, data + off, len);
+
+	if (ip[0] >> 4 == 4) {
+		if_tuntap_be16_put(&ip[2], hlen - l3 + len);
+		/* Consecutive IDs, like the kernel's segmentation. */
+		if_tuntap_be16_put(&ip[4],
+				   ((uint32_t)ip[4] << 8 | ip[5]) + idx);
+		ip[10] = ip[11] = 0;
+		if_tuntap_csum_put(&ip[10], if_tuntap_csum_add(0, ip, l4 - l3));
+		sum = if_tuntap_csum_add(0, &ip[12], 8);
+	} else {
+		if_tuntap_be16_put(&ip[4], hlen - l3 - 40 + len);
+		sum = if_tuntap_csum_add(0, &ip[8], 32);
+	}
+
+	seq = (uint32_t)tcp[4] << 24 | (uint32_t)tcp[5] << 16 |
+	      (uint32_t)tcp[6] << 8 | tcp[7];
+	seq += (uint32_t)(off - hlen);
+	tcp[4] = seq >> 24;
+	tcp[5] = (seq >> 16) & 0xff;
+	tcp[6] = (seq >> 8) & 0xff;
+	tcp[7] = seq & 0xff;
+	if (!last)
+		tcp[13] &= ~(IF_TCP_FLAG_FIN | IF_TCP_FLAG_PSH);
+	if (idx > 0)
+		tcp[13] &= ~IF_TCP_FLAG_CWR;
+
+	tcp[16] = tcp[17] = 0;
+	sum += IPPROTO_TCP + (uint32_t)(hlen - l4 + len);
+	if_tuntap_csum_put(&tcp[16], if_tuntap_csum_add(sum, tcp,
+							hlen - l4 + len));
+}
+
+/**
+ * Splits a TCP super-packet into pool packets with the header `hdr' of the
+ * module. The first one is returned, the rest are queued.
+ */
+static int if_tuntap_tso_split(struct pppoat_module         *mod,
+			       struct if_tuntap_queue       *q,
+			       const unsigned char          *hdr,
+			       size_t                        hdr_len,
+			       const unsigned char          *data,
+			       size_t                        len,
+			       const struct virtio_net_hdr  *vh,
+			       struct pppoat_packet        **first)
+{
+	struct if_tuntap_ctx *ctx = mod->m_userdata;
+	struct pppoat_packet *seg;
+	struct pppoat_list    segs;
+	unsigned              idx;
+	size_t                l3 = 0;
+	size_t                l4 = vh->csum_start;
+	size_t                hlen;
+	size_t                mss = vh->gso_size;
+	size_t                off;
+	size_t                slen;
+	int                   rc = 0;
+
+	if (ctx->itc_type == PPPOAT_IF_TAP)
+		l3 = len > 14 && data[12] == 0x81 && data[13] == 0x00 ? 18 : 14;
+	if (l4 + 20 > len || l4 < l3 + 20 || mss == 0)
+		return P_ERR(-EINVAL);
+	hlen = l4 + (data[l4 + 12] >> 4) * 4;
+	if (hlen >= len)
+		return P_ERR(-EINVAL);
+
+	pppoat_list_init(&segs, &if_tuntap_segs_descr);
+	for (off = hlen, idx = 0; rc == 0 && off < len; off += slen, ++idx) {
+		slen = pppoat_min(mss, len - off);
+		seg  = pppoat_packet_get(mod->m_pkts, hdr_len + hlen + slen);
+		if (seg == NULL) {
+			rc = P_ERR(-ENOMEM);
+			break;
+		}
+		memcpy(seg->pkt_data, hdr, hdr_len);
+		if_tuntap_tso_segment((unsigned char *)seg->pkt_data + hdr_len,
+				      data, l3, l4, hlen, off, slen, idx,
+				      off + slen == len);
+		seg->pkt_type = PPPOAT_PACKET_SEND;
+		pppoat_list_enqueue(&segs, seg);
+	}
+	if (rc != 0) {
+		while ((seg = pppoat_list_dequeue(&segs)) != NULL)
+			pppoat_packet_put(mod->m_pkts, seg);
+	} else {
+		*first = pppoat_list_dequeue(&segs);
+		while ((seg = pppoat_list_dequeue(&segs)) != NULL)
+			pppoat_list_enqueue(&q->itq_segs, seg);
+	}
+	pppoat_list_fini(&segs);
+
+	return rc;
+}
+
+static int if_tuntap_offload_read(struct pppoat_module    *mod,
+				  struct if_tuntap_queue  *q,
+				  struct pppoat_packet   **pkt)
+{
+	struct if_tuntap_ctx *ctx  = mod->m_userdata;
+	const size_t          vlen = sizeof(struct virtio_net_hdr);
+	struct virtio_net_hdr vh;
+	struct pppoat_packet *pkt2;
+	unsigned char         pi[IF_TUN_HDR_SIZE];
+	unsigned char        *hdr;
+	unsigned char        *data;
+	ssize_t               rlen;
+	size_t                hlen;
+	size_t                len;
+	int                   rc;
+
+	rc = pppoat_io_select_single_read(q->itq_fd);
+	if (rc != 0)
+		return rc;
+	rlen = read(q->itq_fd, q->itq_buf, IF_TUNTAP_OFFLOAD_BUF);
+	if (rlen < 0)
+		return pppoat_io_error_is_recoverable(-errno) ?
+		       -errno : P_ERR(-errno);
+
+	/* The kernel puts packet information before virtio_net_hdr. */
+	hdr  = q->itq_buf;
+	hlen = ctx->itc_no_pi ? 0 : IF_TUN_HDR_SIZE;
+	if ((size_t)rlen <= hlen + vlen)
+		return P_ERR(-EIO);
+	memcpy(&vh, q->itq_buf + hlen, vlen);
+	data = q->itq_buf + hlen + vlen;
+	len  = (size_t)rlen - hlen - vlen;
+	if (if_tuntap_filtered(ctx, data, len) ||
+	    if_tap_l2_consume(ctx, q->itq_fd, data, len)) {
+		*pkt = NULL;
+		return 0;
+	}
+	if (ctx->itc_no_pi) {
+		hdr  = pi;
+		hlen = if_tuntap_hdr_len(ctx, if_tuntap_compact(ctx) &&
+				if_tuntap_compact_fits(ctx, data, len));
+		if_tuntap_hdr_put(ctx, hdr, hlen, data, len);
+	}
+
+	switch (vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_NONE:
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		rc = if_tuntap_tso_split(mod, q, hdr, hlen, data, len, &vh,
+					 pkt);
+		if (rc != 0)
+			pppoat_debug("tun", "Dropped super-packet of %zu bytes "
+				     "(rc=%d)", len, rc);
+		/* Nothing to return, the pipeline polls again. */
+		if (rc == -EINVAL)
+			*pkt = NULL;
+		return rc == -EINVAL ? 0 : rc;
+	default:
+		pppoat_debug("tun", "Unsupported GSO type %u",
+			     (unsigned)vh.gso_type);
+		*pkt = NULL;
+		return 0;
+	}
+
+	if (vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+		if_tuntap_csum_complete(data, len, &vh);
+	pkt2 = pppoat_packet_get(mod->m_pkts, hlen + len);
+	if (pkt2 == NULL)
+		return P_ERR(-ENOMEM);
+	memcpy(pkt2->pkt_data, hdr, hlen);
+	memcpy((char *)pkt2->pkt_data + hlen, data, len);
+	pkt2->pkt_type = PPPOAT_PACKET_SEND;
+	*pkt = pkt2;
+
+	return 0;
+}
+
+/**
+ * Writes a packet to the interface. An empty virtio_net_hdr follows the
+ * packet information header with offloads. With NAPI_FRAGS, the kernel
+ * puts the first remaining vector into the linear part of the buffer and
+ * the rest into page fragments, so the Ethernet header goes separately.
+ */
+static int if_tuntap_write(struct if_tuntap_ctx *ctx,
+			   int                   fd,
+			   const unsigned char  *data,
+			   size_t                len)
+{
+	struct virtio_net_hdr vh;
+	struct iovec          iov[4];
+	size_t                hlen = ctx->itc_no_pi ? 0 : IF_TUN_HDR_SIZE;
+	size_t                l2;
+	unsigned              nr = 0;
+	ssize_t               wlen;
+	int                   rc;
+
+	if (len < hlen)
+		return P_ERR(-EINVAL);
+	l2 = ctx->itc_napi_frags ? pppoat_min(len - hlen, (size_t)14) : 0;
+
+	if (hlen > 0) {
+		iov[nr].iov_base = (void *)data;
+		iov[nr++].iov_len = hlen;
+	}
+	if (ctx->itc_offload) {
+		memset(&vh, 0, sizeof vh);
+		iov[nr].iov_base = &vh;
+		iov[nr++].iov_len = sizeof vh;
+	}
+	if (l2 > 0) {
+		iov[nr].iov_base = (void *)(data + hlen);
+		iov[nr++].iov_len = l2;
+	}
+	iov[nr].iov_base = (void *)(data + hlen + l2);
+	iov[nr++].iov_len = len - hlen - l2;
+
+	/* A write to the interface is never partial. */
+	do {
+		wlen = writev(fd, iov, nr);
+		rc   = wlen < 0 ? -errno : 0;
+		if (rc != 0 && pppoat_io_error_is_recoverable(rc))
+			rc = pppoat_io_select_single_write(fd) ?: -EAGAIN;
+	} while (rc == -EAGAIN || rc == -EINTR);
+
+	return rc;
+}
+
+static void if_tuntap_offload_fini(struct if_tuntap_ctx *ctx)
+{
+	unsigned i;
+
+	for (i = 0; i < ctx->itc_queues_nr; ++i) {
+		pppoat_free(ctx->itc_queues[i].itq_buf);
+		ctx->itc_queues[i].itq_buf = NULL;
+	}
+}
+
+static int if_tuntap_offload_init(struct if_tuntap_ctx *ctx)
+{
+	struct if_tuntap_queue *q;
+	unsigned                flags;
+	unsigned                i;
+	int                     rc;
+
+	for (i = 0; i < ctx->itc_queues_nr; ++i) {
+		q = &ctx->itc_queues[i];
+		q->itq_buf = pppoat_alloc(IF_TUNTAP_OFFLOAD_BUF);
+		if (q->itq_buf == NULL) {
+			if_tuntap_offload_fini(ctx);
+			return P_ERR(-ENOMEM);
+		}
+	}
+	/* Without offloads the kernel still prepends virtio_net_hdr. */
+	flags = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+	rc = ioctl(ctx->itc_queues[0].itq_fd, TUNSETOFFLOAD, flags);
+	if (rc < 0)
+		pppoat_info("tun", "Couldn't enable offloads (rc=%d)", -errno);
+
+	return 0;
+}
+
+static void if_tuntap_napi_flags(struct if_tuntap_ctx *ctx, struct ifreq *ifr)
+{
+#if defined(IFF_NAPI) && defined(IFF_NAPI_FRAGS)
+	ifr->ifr_flags &= ~(IFF_NAPI | IFF_NAPI_FRAGS);
+	if (ctx->itc_napi)
+		ifr->ifr_flags |= IFF_NAPI;
+	if (ctx->itc_napi_frags)
+		ifr->ifr_flags |= IFF_NAPI_FRAGS;
+#else
+	if (ctx->itc_napi)
+		pppoat_info("tun", "NAPI is not supported by the headers");
+	ctx->itc_napi = ctx->itc_napi_frags = false;
+#endif
+}
+
+/** Old kernels ignore unknown flags, so read back the ones in effect. */
+static void if_tuntap_napi_check(struct if_tuntap_ctx *ctx)
+{
+#if defined(IFF_NAPI) && defined(IFF_NAPI_FRAGS)
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof ifr);
+	if (ioctl(ctx->itc_queues[0].itq_fd, TUNGETIFF, &ifr) < 0 ||
+	    (ifr.ifr_flags & IFF_NAPI) == 0) {
+		pppoat_info("tun", "NAPI is not available");
+		ctx->itc_napi = false;
+	}
+	if (!ctx->itc_napi || (ifr.ifr_flags & IFF_NAPI_FRAGS) == 0)
+		ctx->itc_napi_frags = false;
+	pppoat_debug("tun", "NAPI %s, NAPI_FRAGS %s",
+		     ctx->itc_napi ? "on" : "off",
+		     ctx->itc_napi_frags ? "on" : "off");
+#endif
+}
+
 static int if_tuntap_fd_init(struct if_tuntap_ctx *ctx,
 			     struct pppoat_conf   *conf,
 			     enum if_tuntap_type   type)
 {
 	struct ifreq ifr;
-	int          fd;
-	int          rc;
-
-	/*
-	 * We can add IFF_NO_PI to the ifr_flags. It will save 4 bytes.
-	 * In this case we will have to determine protocol type
-	 * in if_tun_compat_layer() for uTun frame format.
-	 */
+	unsigned     i;
+	int          rc = 0;
 
 	PPPOAT_ASSERT(type == PPPOAT_IF_TUN || type == PPPOAT_IF_TAP);
 
-	fd = open(if_tun_path, O_RDWR);
-	PPPOAT_ASSERT(fd >= 0); /* XXX */
-
 	memset(&ifr, 0, sizeof ifr);
 	ifr.ifr_flags  = type == PPPOAT_IF_TUN ? IFF_TUN : IFF_TAP;
-	rc = ioctl(fd, TUNSETIFF, (void *)&ifr);
-	PPPOAT_ASSERT(rc >= 0); /* XXX */
+	if (ctx->itc_queues_nr > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (ctx->itc_offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+	if (ctx->itc_no_pi)
+		ifr.ifr_flags |= IFF_NO_PI;
+	if_tuntap_napi_flags(ctx, &ifr);
+
+	/* The first queue names the interface, the others attach to it. */
+	for (i = 0; i < ctx->itc_queues_nr; ++i) {
+		rc = if_tuntap_queue_open(&ifr, &ctx->itc_queues[i].itq_fd);
+		if (rc != 0 && i == 0 && ctx->itc_napi) {
+			pppoat_info("tun", "NAPI is not available (rc=%d)", rc);
+			ctx->itc_napi = ctx->itc_napi_frags = false;
+			if_tuntap_napi_flags(ctx, &ifr);
+			rc = if_tuntap_queue_open(&ifr,
+						  &ctx->itc_queues[i].itq_fd);
+		}
+		if (rc != 0) {
+			pppoat_error("tun", "Couldn't open queue %u of the "
+				     "interface (rc=%d)", i, rc);
+			goto err_close;
+		}
+	}
 	PPPOAT_ASSERT(strlen(ifr.ifr_name) > 0);
+	if (ctx->itc_napi)
+		if_tuntap_napi_check(ctx);
+
+	if (ctx->itc_queues_nr > 1 &&
+	    ctx->itc_steering == IF_TUNTAP_STEERING_EBPF) {
+		rc = if_tuntap_steering_attach(ctx);
+		if (rc != 0) {
+			pppoat_error("tun", "Couldn't attach steering program "
+				     "(rc=%d)", rc);
+			goto err_close;
+		}
+	}
 
-	(void)pppoat_io_fd_blocking_set(fd, false);
+	if (ctx->itc_filter.f_nr > 0) {
+		rc = if_tuntap_filter_attach(ctx);
+		if (rc != 0)
+			pppoat_info("tun", "Couldn't attach the filter, "
+				    "running it in userspace (rc=%d)", rc);
+		ctx->itc_filter_user = rc != 0;
+	}
+
+	if (ctx->itc_offload) {
+		rc = if_tuntap_offload_init(ctx);
+		if (rc != 0)
+			goto err_close;
+	}
 
-	ctx->itc_fd     = fd;
 	ctx->itc_ifname = pppoat_strdup(ifr.ifr_name);
+	rc = ctx->itc_ifname == NULL ? P_ERR(-ENOMEM) : 0;
+	if (rc == 0)
+		return 0;
 
-	return 0;
+	if_tuntap_offload_fini(ctx);
+err_close:
+	while (i-- > 0)
+		(void)close(ctx->itc_queues[i].itq_fd);
+	return rc;
 }
 
 static void if_tuntap_fd_fini(struct if_tuntap_ctx *ctx)
 {
-	(void)close(ctx->itc_fd);
+	unsigned i;
+
+	if_tuntap_offload_fini(ctx);
+	for (i = 0; i < ctx->itc_queues_nr; ++i)
+		(void)close(ctx->itc_queues[i].itq_fd);
 	pppoat_free(ctx->itc_ifname);
 }
 
+static int if_tuntap_mtu_set(struct if_tuntap_ctx *ctx, size_t mtu)
+{
+	struct ifreq ifr;
+	int          sock;
+	int          rc;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return P_ERR(-errno);
+
+	memset(&ifr, 0, sizeof ifr);
+	strncpy(ifr.ifr_name, ctx->itc_ifname, sizeof(ifr.ifr_name) - 1);
+	ifr.ifr_mtu = (int)mtu;
+	rc = ioctl(sock, SIOCSIFMTU, &ifr);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	if (rc != 0)
+		pppoat_error("tun", "Couldn't set MTU %zu on %s (rc=%d)",
+			     mtu, ctx->itc_ifname, rc);
+	(void)close(sock);
+
+	return rc;
+}
+
 static void if_tun_compat_layer(struct if_tuntap_ctx *ctx,
 				struct pppoat_packet *pkt,
 				bool                  send)
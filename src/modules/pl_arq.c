@@ -0,0 +1,872 @@
+/* modules/pl_arq.c
+ * PPP over Any Transport -- Selective repeat ARQ plugin
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "conf.h"
+#include "list.h"
+#include "magic.h"
+#include "memory.h"
+#include "misc.h"
+#include "module.h"
+#include "mutex.h"
+#include "packet.h"
+#include "pipeline.h"
+#include "rtt.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>	/* clock_gettime */
+
+#define ARQ_CONF_WINDOW          "arq.window"
+#define ARQ_CONF_RETRIES         "arq.retries"
+#define ARQ_CONF_RTO_MIN         "arq.rto_min"
+#define ARQ_CONF_RTO_MAX         "arq.rto_max"
+#define ARQ_CONF_REORDER         "arq.reorder"
+#define ARQ_CONF_REORDER_TIMEOUT "arq.reorder_timeout"
+
+/*
+ * The plugin repairs losses of the transport with retransmissions, so it
+ * suits transports which don't guarantee delivery, e.g. udp.
+ *
+ * Sender numbers packets and keeps a copy of every packet until it's
+ * acknowledged. Receiver acknowledges the next expected sequence number
+ * (cumulative ACK) together with a bitmap of the following 64 packets
+ * (SACK). A packet is retransmitted when 3 later packets are reported
+ * received (fast retransmit) or when its retransmission timer expires. The
+ * timer follows RFC 6298 and doubles with every retransmission of the
+ * packet. After arq.retries retransmissions the packet is given up. Until
+ * the first RTT sample, the timer starts from the transport's estimate if
+ * the transport measures RTT, e.g. udp with udp.probe.
+ *
+ * Send window limits the number of unacknowledged packets. When the window
+ * is full, the oldest packet is given up to make room for the new one, so
+ * the plugin never delays traffic. Every data packet carries the oldest
+ * sequence number the sender still retransmits, the receiver stops waiting
+ * for given up packets with it.
+ *
+ * Receiver delivers packets as they come, a lost packet doesn't hold back
+ * the following ones. With arq.reorder, packets are delivered in order and
+ * a gap waits for its retransmission at most arq.reorder_timeout.
+ *
+ * Timers and delayed ACKs are served by the pipeline poll, so their
+ * granularity is the poll interval.
+ *
+ * Wire format. Data packet: payload, sequence number (32 bits), oldest
+ * retransmitted sequence number (32 bits), type. ACK: cumulative ACK
+ * (32 bits), SACK bitmap (64 bits), type. Big endian.
+ */
+
+enum {
+	PL_ARQ_TRAILER         = 9,
+	PL_ARQ_ACK_SIZE        = 13,
+	PL_ARQ_WINDOW          = 256,
+	PL_ARQ_WINDOW_MIN      = 16,
+	PL_ARQ_WINDOW_MAX      = 4096,
+	PL_ARQ_RETRIES         = 3,
+	PL_ARQ_RETRIES_MAX     = 255,
+	/** Timeouts are in ms. */
+	PL_ARQ_RTO_INIT        = 200,
+	PL_ARQ_RTO_MIN         = 20,
+	PL_ARQ_RTO_MAX         = 1000,
+	PL_ARQ_REORDER_TIMEOUT = 50,
+	/** Clock granularity of RFC 6298, i.e. the poll interval. */
+	PL_ARQ_GRANULARITY     = 10,
+	/** Number of later packets which trigger fast retransmit. */
+	PL_ARQ_DUPTHRESH       = 3,
+	PL_ARQ_SACK_BITS       = 64,
+	/** Number of received packets which trigger an immediate ACK. */
+	PL_ARQ_ACK_EVERY       = 2,
+	PL_ARQ_SIZE_MAX        = 65535 - PL_ARQ_TRAILER,
+};
+
+enum pl_arq_type {
+	PL_ARQ_TYPE_DATA       = 0,
+	PL_ARQ_TYPE_ACK        = 1,
+};
+
+/** Unacknowledged packet. */
+struct pl_arq_tx_slot {
+	bool                  ts_used;
+	/** Copy of the payload, NULL if it couldn't be made. */
+	struct pppoat_packet *ts_pkt;
+	uint64_t              ts_sent;
+	uint64_t              ts_timer;
+	unsigned              ts_retries;
+};
+
+struct pl_arq_rx_slot {
+	bool                  rs_received;
+	/** Packet held for in-order delivery. */
+	struct pppoat_packet *rs_pkt;
+};
+
+struct pl_arq_ctx {
+	uint32_t               ac_window;
+	unsigned               ac_retries;
+	uint64_t               ac_rto_min;
+	uint64_t               ac_rto_max;
+	bool                   ac_reorder;
+	uint64_t               ac_reorder_timeout;
+	/* Sender, protected by ac_tx_lock. Times are in us. */
+	struct pppoat_mutex    ac_tx_lock;
+	struct pl_arq_tx_slot *ac_tx;
+	/** Oldest unacknowledged sequence number. */
+	uint32_t               ac_tx_una;
+	uint32_t               ac_tx_next;
+	uint64_t               ac_srtt;
+	uint64_t               ac_rttvar;
+	uint64_t               ac_rto;
+	uint64_t               ac_retransmits;
+	uint64_t               ac_given_up;
+	/* Receiver, protected by ac_rx_lock. */
+	struct pppoat_mutex    ac_rx_lock;
+	struct pl_arq_rx_slot *ac_rx;
+	/** Next expected sequence number. */
+	uint32_t               ac_rx_next;
+	unsigned               ac_rx_held_nr;
+	/** Time when the gap at ac_rx_next started holding packets. */
+	uint64_t               ac_rx_gap;
+	unsigned               ac_rx_unacked;
+	bool                   ac_rx_ack;
+	/** Retransmissions, ACKs and reordered packets for the pipeline. */
+	struct pppoat_list     ac_outq;
+	struct pppoat_mutex    ac_out_lock;
+};
+
+static struct pppoat_list_descr pl_arq_outq_descr =
+	PPPOAT_LIST_DESCR("ARQ output queue", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_MODULE_PL_ARQ_OUTQ_MAGIC);
+
+static bool pl_arq_ctx_invariant(struct pl_arq_ctx *ctx)
+{
+	return ctx != NULL && ctx->ac_window >= PL_ARQ_WINDOW_MIN &&
+	       ctx->ac_window <= PL_ARQ_WINDOW_MAX &&
+	       ctx->ac_tx_next - ctx->ac_tx_una <= ctx->ac_window;
+}
+
+static uint64_t pl_arq_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/** Returns true if sequence number a precedes b. */
+static bool pl_arq_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+static void pl_arq_be32_put(uint8_t *buf, uint32_t val)
+{
+	buf[0] = (uint8_t)(val >> 24);
+	buf[1] = (uint8_t)(val >> 16);
+	buf[2] = (uint8_t)(val >> 8);
+	buf[3] = (uint8_t)val;
+}
+
+static uint32_t pl_arq_be32_get(const uint8_t *buf)
+{
+	return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+	       (uint32_t)buf[2] << 8 | buf[3];
+}
+
+static int pl_arq_conf_long(struct pppoat_conf *conf,
+			    const char         *key,
+			    long                min,
+			    long                max,
+			    long               *out)
+{
+	long val;
+	int  rc;
+
+	rc = pppoat_conf_find_long(conf, key, &val);
+	if (rc == 0 && (val < min || val > max)) {
+		pppoat_error("arq", "%s must be in range %ld..%ld.",
+			     key, min, max);
+		return P_ERR(-EINVAL);
+	}
+	if (rc == 0)
+		*out = val;
+	return 0;
+}
+
+static int pl_arq_conf_parse(struct pl_arq_ctx *ctx, struct pppoat_conf *conf)
+{
+	long window  = PL_ARQ_WINDOW;
+	long retries = PL_ARQ_RETRIES;
+	long rto_min = PL_ARQ_RTO_MIN;
+	long rto_max = PL_ARQ_RTO_MAX;
+	long reorder = PL_ARQ_REORDER_TIMEOUT;
+	int  rc;
+
+	rc = pl_arq_conf_long(conf, ARQ_CONF_WINDOW, PL_ARQ_WINDOW_MIN,
+			      PL_ARQ_WINDOW_MAX, &window) ?:
+	     pl_arq_conf_long(conf, ARQ_CONF_RETRIES, 0, PL_ARQ_RETRIES_MAX,
+			      &retries) ?:
+	     pl_arq_conf_long(conf, ARQ_CONF_RTO_MIN, 1, 60000, &rto_min) ?:
+	     pl_arq_conf_long(conf, ARQ_CONF_RTO_MAX, rto_min, 60000,
+			      &rto_max) ?:
+	     pl_arq_conf_long(conf, ARQ_CONF_REORDER_TIMEOUT, 1, 60000,
+			      &reorder);
+	if (rc != 0)
+		return rc;
+
+	ctx->ac_window          = (uint32_t)window;
+	ctx->ac_retries         = (unsigned)retries;
+	ctx->ac_rto_min         = (uint64_t)rto_min * 1000;
+	ctx->ac_rto_max         = (uint64_t)rto_max * 1000;
+	ctx->ac_reorder_timeout = (uint64_t)reorder * 1000;
+	ctx->ac_reorder         = false;
+	pppoat_conf_find_bool(conf, ARQ_CONF_REORDER, &ctx->ac_reorder);
+
+	return 0;
+}
+
+static int pl_arq_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+{
+	struct pl_arq_ctx *ctx;
+	int                rc;
+
+	ctx = pppoat_alloc(sizeof *ctx);
+	if (ctx == NULL)
+		return P_ERR(-ENOMEM);
+	rc = pl_arq_conf_parse(ctx, conf);
+	if (rc != 0)
+		goto err_free;
+	ctx->ac_tx = pppoat_calloc(ctx->ac_window, sizeof *ctx->ac_tx);
+	ctx->ac_rx = pppoat_calloc(ctx->ac_window, sizeof *ctx->ac_rx);
+	if (ctx->ac_tx == NULL || ctx->ac_rx == NULL) {
+		rc = P_ERR(-ENOMEM);
+		goto err_free_slots;
+	}
+
+	ctx->ac_tx_una      = 0;
+	ctx->ac_tx_next     = 0;
+	ctx->ac_srtt        = 0;
+	ctx->ac_rttvar      = 0;
+	ctx->ac_rto         = pppoat_max((uint64_t)PL_ARQ_RTO_INIT * 1000,
+					 ctx->ac_rto_min);
+	ctx->ac_rto         = pppoat_min(ctx->ac_rto, ctx->ac_rto_max);
+	ctx->ac_retransmits = 0;
+	ctx->ac_given_up    = 0;
+	ctx->ac_rx_next     = 0;
+	ctx->ac_rx_held_nr  = 0;
+	ctx->ac_rx_gap      = 0;
+	ctx->ac_rx_unacked  = 0;
+	ctx->ac_rx_ack      = false;
+	pppoat_mutex_init(&ctx->ac_tx_lock);
+	pppoat_mutex_init(&ctx->ac_rx_lock);
+	pppoat_mutex_init(&ctx->ac_out_lock);
+	pppoat_list_init(&ctx->ac_outq, &pl_arq_outq_descr);
+
+	mod->m_userdata = ctx;
+
+	return 0;
+
+err_free_slots:
+	pppoat_free(ctx->ac_rx);
+	pppoat_free(ctx->ac_tx);
+err_free:
+	pppoat_free(ctx);
+	return rc;
+}
+
+static void pl_arq_fini(struct pppoat_module *mod)
+{
+	struct pl_arq_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
+	uint32_t              i;
+
+	PPPOAT_ASSERT(pl_arq_ctx_invariant(ctx));
+
+	while ((pkt = pppoat_list_dequeue(&ctx->ac_outq)) != NULL)
+		pppoat_packet_put(mod->m_pkts, pkt);
+	for (i = 0; i < ctx->ac_window; ++i) {
+		if (ctx->ac_tx[i].ts_pkt != NULL)
+			pppoat_packet_put(mod->m_pkts, ctx->ac_tx[i].ts_pkt);
+		if (ctx->ac_rx[i].rs_pkt != NULL)
+			pppoat_packet_put(mod->m_pkts, ctx->ac_rx[i].rs_pkt);
+	}
+	pppoat_list_fini(&ctx->ac_outq);
+	pppoat_mutex_fini(&ctx->ac_out_lock);
+	pppoat_mutex_fini(&ctx->ac_rx_lock);
+	pppoat_mutex_fini(&ctx->ac_tx_lock);
+	pppoat_free(ctx->ac_rx);
+	pppoat_free(ctx->ac_tx);
+	pppoat_free(ctx);
+}
+
+static int pl_arq_run(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static int pl_arq_stop(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static void pl_arq_out(struct pl_arq_ctx *ctx, struct pppoat_list *pkts)
+{
+	struct pppoat_packet *pkt;
+
+	pppoat_mutex_lock(&ctx->ac_out_lock);
+	while ((pkt = pppoat_list_dequeue(pkts)) != NULL)
+		pppoat_list_enqueue(&ctx->ac_outq, pkt);
+	pppoat_mutex_unlock(&ctx->ac_out_lock);
+}
+
+static struct pl_arq_tx_slot *pl_arq_tx_slot(struct pl_arq_ctx *ctx,
+					     uint32_t           seq)
+{
+	return &ctx->ac_tx[seq % ctx->ac_window];
+}
+
+static struct pl_arq_rx_slot *pl_arq_rx_slot(struct pl_arq_ctx *ctx,
+					     uint32_t           seq)
+{
+	return &ctx->ac_rx[seq % ctx->ac_window];
+}
+
+static void pl_arq_trailer_put(uint8_t *buf, uint32_t seq, uint32_t una)
+{
+	pl_arq_be32_put(buf, seq);
+	pl_arq_be32_put(buf + 4, una);
+	buf[8] = PL_ARQ_TYPE_DATA;
+}
+
+/* Sender. All functions below are called with ac_tx_lock held. */
+
+static void pl_arq_tx_release(struct pppoat_module  *mod,
+			      struct pl_arq_tx_slot *slot)
+{
+	if (slot->ts_pkt != NULL)
+		pppoat_packet_put(mod->m_pkts, slot->ts_pkt);
+	slot->ts_pkt  = NULL;
+	slot->ts_used = false;
+}
+
+static void pl_arq_tx_advance(struct pl_arq_ctx *ctx)
+{
+	while (ctx->ac_tx_una != ctx->ac_tx_next &&
+	       !pl_arq_tx_slot(ctx, ctx->ac_tx_una)->ts_used)
+		++ctx->ac_tx_una;
+}
+
+/** Updates RTO with a sample of RTT as described in RFC 6298. */
+static void pl_arq_rtt_sample(struct pl_arq_ctx *ctx, uint64_t rtt)
+{
+	uint64_t delta;
+
+	if (ctx->ac_srtt == 0) {
+		ctx->ac_srtt   = rtt;
+		ctx->ac_rttvar = rtt / 2;
+	} else {
+		delta = ctx->ac_srtt > rtt ? ctx->ac_srtt - rtt :
+					     rtt - ctx->ac_srtt;
+		ctx->ac_rttvar = (3 * ctx->ac_rttvar + delta) / 4;
+		ctx->ac_srtt   = (7 * ctx->ac_srtt + rtt) / 8;
+	}
+	ctx->ac_rto = ctx->ac_srtt +
+		      pppoat_max(4 * ctx->ac_rttvar,
+				 (uint64_t)PL_ARQ_GRANULARITY * 1000);
+	ctx->ac_rto = pppoat_max(ctx->ac_rto, ctx->ac_rto_min);
+	ctx->ac_rto = pppoat_min(ctx->ac_rto, ctx->ac_rto_max);
+}
+
+/**
+ * Until the first own sample, takes RTT measured by the transport, so
+ * the initial RTO isn't a blind guess.
+ */
+static void pl_arq_rtt_seed(struct pppoat_module *mod)
+{
+	struct pl_arq_ctx       *ctx = mod->m_userdata;
+	struct pppoat_rtt_stats  rs;
+	bool                     seed;
+
+	pppoat_mutex_lock(&ctx->ac_tx_lock);
+	seed = ctx->ac_srtt == 0;
+	pppoat_mutex_unlock(&ctx->ac_tx_lock);
+	if (!seed || mod->m_pipeline == NULL ||
+	    pppoat_pipeline_rtt(mod->m_pipeline, &rs) != 0)
+		return;
+
+	pppoat_mutex_lock(&ctx->ac_tx_lock);
+	if (ctx->ac_srtt == 0) {
+		pl_arq_rtt_sample(ctx, rs.rs_srtt);
+		pppoat_debug("arq", "RTO %" PRIu64 " us from transport RTT",
+			     ctx->ac_rto);
+	}
+	pppoat_mutex_unlock(&ctx->ac_tx_lock);
+}
+
+/** Acknowledges a packet. RTT is sampled from packets sent once (Karn). */
+static void pl_arq_tx_ack(struct pppoat_module *mod,
+			  uint32_t              seq,
+			  uint64_t              now)
+{
+	struct pl_arq_ctx     *ctx = mod->m_userdata;
+	struct pl_arq_tx_slot *slot = pl_arq_tx_slot(ctx, seq);
+
+	if (!slot->ts_used)
+		return;
+	if (slot->ts_retries == 0 && now >= slot->ts_sent)
+		pl_arq_rtt_sample(ctx, now - slot->ts_sent);
+	pl_arq_tx_release(mod, slot);
+}
+
+/** Queues a retransmission or gives the packet up. */
+static void pl_arq_retransmit(struct pppoat_module *mod,
+			      uint32_t              seq,
+			      uint64_t              now,
+			      struct pppoat_list   *out)
+{
+	struct pl_arq_ctx     *ctx = mod->m_userdata;
+	struct pl_arq_tx_slot *slot = pl_arq_tx_slot(ctx, seq);
+	struct pppoat_packet  *pkt = NULL;
+	size_t                 len;
+
+	if (slot->ts_pkt != NULL && slot->ts_retries < ctx->ac_retries) {
+		len = slot->ts_pkt->pkt_size;
+		pkt = pppoat_packet_get(mod->m_pkts, len + PL_ARQ_TRAILER);
+	}
+	if (pkt == NULL) {
+		++ctx->ac_given_up;
+		pl_arq_tx_release(mod, slot);
+		return;
+	}
+	memcpy(pkt->pkt_data, slot->ts_pkt->pkt_data, len);
+	pl_arq_trailer_put((uint8_t *)pkt->pkt_data + len, seq,
+			   ctx->ac_tx_una);
+	pkt->pkt_type = PPPOAT_PACKET_SEND;
+	pppoat_list_enqueue(out, pkt);
+
+	++slot->ts_retries;
+	++ctx->ac_retransmits;
+	slot->ts_sent  = now;
+	slot->ts_timer = now + pppoat_rtt_backoff(ctx->ac_rto, slot->ts_retries,
+						  ctx->ac_rto_max);
+}
+
+static int pl_arq_send(struct pppoat_module  *mod,
+		       struct pppoat_packet  *pkt,
+		       struct pppoat_packet **next)
+{
+	struct pl_arq_ctx     *ctx = mod->m_userdata;
+	struct pl_arq_tx_slot *slot;
+	struct pppoat_packet  *copy;
+	size_t                 len = pkt->pkt_size;
+	uint64_t               now = pl_arq_now();
+	uint32_t               seq;
+	uint32_t               una;
+	int                    rc;
+
+	if (len > PL_ARQ_SIZE_MAX) {
+		pppoat_debug("arq", "Dropping too big packet (%zu bytes)", len);
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	rc = pppoat_packet_reserve(mod->m_pkts, pkt, len + PL_ARQ_TRAILER);
+	if (rc != 0)
+		return rc;
+	/* Without a copy the packet is sent once. */
+	copy = pppoat_packet_get(mod->m_pkts, len);
+	if (copy != NULL)
+		memcpy(copy->pkt_data, pkt->pkt_data, len);
+
+	pppoat_mutex_lock(&ctx->ac_tx_lock);
+	if (ctx->ac_tx_next - ctx->ac_tx_una == ctx->ac_window) {
+		++ctx->ac_given_up;
+		pl_arq_tx_release(mod, pl_arq_tx_slot(ctx, ctx->ac_tx_una));
+		pl_arq_tx_advance(ctx);
+	}
+	seq  = ctx->ac_tx_next++;
+	slot = pl_arq_tx_slot(ctx, seq);
+	PPPOAT_ASSERT(!slot->ts_used);
+	slot->ts_used    = true;
+	slot->ts_pkt     = copy;
+	slot->ts_retries = 0;
+	slot->ts_sent    = now;
+	slot->ts_timer   = now + ctx->ac_rto;
+	una = ctx->ac_tx_una;
+	pppoat_mutex_unlock(&ctx->ac_tx_lock);
+
+	pl_arq_trailer_put((uint8_t *)pkt->pkt_data + len, seq, una);
+	pkt->pkt_size = len + PL_ARQ_TRAILER;
+	*next = pkt;
+
+	return 0;
+}
+
+static void pl_arq_ack_recv(struct pppoat_module *mod,
+			    struct pppoat_packet *pkt)
+{
+	struct pl_arq_ctx  *ctx = mod->m_userdata;
+	struct pppoat_list  out;
+	const uint8_t      *buf = pkt->pkt_data;
+	uint64_t            now = pl_arq_now();
+	uint64_t            sack;
+	uint32_t            ack;
+	uint32_t            top;
+	uint32_t            seq;
+	unsigned            i;
+
+	ack  = pl_arq_be32_get(buf);
+	sack = (uint64_t)pl_arq_be32_get(buf + 4) << 32 |
+	       pl_arq_be32_get(buf + 8);
+
+	pppoat_list_init(&out, &pl_arq_outq_descr);
+	pppoat_mutex_lock(&ctx->ac_tx_lock);
+	if (pl_arq_before(ctx->ac_tx_next, ack)) {
+		/* Acknowledges packets which were never sent. */
+		pppoat_mutex_unlock(&ctx->ac_tx_lock);
+		pppoat_list_fini(&out);
+		return;
+	}
+	for (seq = ctx->ac_tx_una; pl_arq_before(seq, ack); ++seq)
+		pl_arq_tx_ack(mod, seq, now);
+	top = ack;
+	for (i = 0; i < PL_ARQ_SACK_BITS; ++i) {
+		seq = ack + 1 + i;
+		if ((sack & (1ULL << i)) == 0 ||
+		    pl_arq_before(seq, ctx->ac_tx_una) ||
+		    !pl_arq_before(seq, ctx->ac_tx_next))
+			continue;
+		pl_arq_tx_ack(mod, seq, now);
+		top = seq;
+	}
+	pl_arq_tx_advance(ctx);
+
+	/*
+	 * Fast retransmit of holes which are followed by enough received
+	 * packets. A hole is retransmitted at most once per RTT.
+	 */
+	for (seq = ctx->ac_tx_una; pl_arq_before(seq, top) &&
+	     top - seq >= PL_ARQ_DUPTHRESH; ++seq) {
+		if (pl_arq_tx_slot(ctx, seq)->ts_used &&
+		    now >= pl_arq_tx_slot(ctx, seq)->ts_sent + ctx->ac_srtt)
+			pl_arq_retransmit(mod, seq, now, &out);
+	}
+	pl_arq_tx_advance(ctx);
+	pppoat_mutex_unlock(&ctx->ac_tx_lock);
+
+	pl_arq_out(ctx, &out);
+	pppoat_list_fini(&out);
+}
+
+static void pl_arq_tx_timers(struct pppoat_module *mod, uint64_t now)
+{
+	struct pl_arq_ctx     *ctx = mod->m_userdata;
+	struct pl_arq_tx_slot *slot;
+	struct pppoat_list     out;
+	uint32_t               seq;
+
+	pppoat_list_init(&out, &pl_arq_outq_descr);
+	pppoat_mutex_lock(&ctx->ac_tx_lock);
+	for (seq = ctx->ac_tx_una; seq != ctx->ac_tx_next; ++seq) {
+		slot = pl_arq_tx_slot(ctx, seq);
+		if (slot->ts_used && now >= slot->ts_timer)
+			pl_arq_retransmit(mod, seq, now, &out);
+	}
+	pl_arq_tx_advance(ctx);
+	pppoat_mutex_unlock(&ctx->ac_tx_lock);
+
+	pl_arq_out(ctx, &out);
+	pppoat_list_fini(&out);
+}
+
+/* Receiver. All functions below are called with ac_rx_lock held. */
+
+/** Moves ac_rx_next over received packets delivering held ones. */
+static void pl_arq_rx_advance(struct pppoat_module *mod,
+			      struct pppoat_list   *out,
+			      uint64_t              now)
+{
+	struct pl_arq_ctx     *ctx = mod->m_userdata;
+	struct pl_arq_rx_slot *slot = pl_arq_rx_slot(ctx, ctx->ac_rx_next);
+	bool                   moved = false;
+
+	while (slot->rs_received) {
+		if (slot->rs_pkt != NULL) {
+			pppoat_list_enqueue(out, slot->rs_pkt);
+			--ctx->ac_rx_held_nr;
+		}
+		slot->rs_pkt      = NULL;
+		slot->rs_received = false;
+		++ctx->ac_rx_next;
+		slot  = pl_arq_rx_slot(ctx, ctx->ac_rx_next);
+		moved = true;
+	}
+	if (moved)
+		ctx->ac_rx_gap = now;
+}
+
+/** Stops waiting for packets before `seq'. */
+static void pl_arq_rx_skip(struct pppoat_module *mod,
+			   uint32_t              seq,
+			   struct pppoat_list   *out,
+			   uint64_t              now)
+{
+	struct pl_arq_ctx *ctx = mod->m_userdata;
+
+	while (pl_arq_before(ctx->ac_rx_next, seq)) {
+		pl_arq_rx_slot(ctx, ctx->ac_rx_next)->rs_received = true;
+		pl_arq_rx_advance(mod, out, now);
+	}
+}
+
+/** Starts over from `seq', e.g. after the peer has restarted. */
+static void pl_arq_rx_reset(struct pppoat_module *mod,
+			    uint32_t              seq,
+			    struct pppoat_list   *out,
+			    uint64_t              now)
+{
+	struct pl_arq_ctx     *ctx = mod->m_userdata;
+	struct pl_arq_rx_slot *slot;
+	uint32_t               i;
+
+	for (i = 0; i < ctx->ac_window; ++i) {
+		slot = pl_arq_rx_slot(ctx, ctx->ac_rx_next + i);
+		if (slot->rs_pkt != NULL)
+			pppoat_list_enqueue(out, slot->rs_pkt);
+		slot->rs_pkt      = NULL;
+		slot->rs_received = false;
+	}
+	ctx->ac_rx_next    = seq;
+	ctx->ac_rx_held_nr = 0;
+	ctx->ac_rx_gap     = now;
+}
+
+static struct pppoat_packet *pl_arq_ack_make(struct pppoat_module *mod)
+{
+	struct pl_arq_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
+	uint8_t              *buf;
+	uint64_t              sack = 0;
+	uint32_t              seq;
+	unsigned              i;
+
+	for (i = 0; i < PL_ARQ_SACK_BITS && i + 1 < ctx->ac_window; ++i) {
+		seq = ctx->ac_rx_next + 1 + i;
+		if (pl_arq_rx_slot(ctx, seq)->rs_received)
+			sack |= 1ULL << i;
+	}
+	ctx->ac_rx_unacked = 0;
+	ctx->ac_rx_ack     = false;
+
+	pkt = pppoat_packet_get(mod->m_pkts, PL_ARQ_ACK_SIZE);
+	if (pkt != NULL) {
+		buf = pkt->pkt_data;
+		pl_arq_be32_put(buf, ctx->ac_rx_next);
+		pl_arq_be32_put(buf + 4, (uint32_t)(sack >> 32));
+		pl_arq_be32_put(buf + 8, (uint32_t)sack);
+		buf[12] = PL_ARQ_TYPE_ACK;
+		pkt->pkt_type = PPPOAT_PACKET_SEND;
+	}
+	return pkt;
+}
+
+static int pl_arq_recv(struct pppoat_module  *mod,
+		       struct pppoat_packet  *pkt,
+		       struct pppoat_packet **next)
+{
+	struct pl_arq_ctx     *ctx = mod->m_userdata;
+	struct pl_arq_rx_slot *slot;
+	struct pppoat_packet  *ack = NULL;
+	struct pppoat_list     out;
+	uint8_t               *trailer;
+	uint64_t               now;
+	uint32_t               seq;
+	uint32_t               una;
+	int32_t                dist;
+	int32_t                window;
+	bool                   gap;
+
+	if (pkt->pkt_size == PL_ARQ_ACK_SIZE &&
+	    ((uint8_t *)pkt->pkt_data)[PL_ARQ_ACK_SIZE - 1] == PL_ARQ_TYPE_ACK) {
+		pl_arq_ack_recv(mod, pkt);
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	trailer = (uint8_t *)pkt->pkt_data + pkt->pkt_size - PL_ARQ_TRAILER;
+	if (pkt->pkt_size < PL_ARQ_TRAILER ||
+	    trailer[8] != PL_ARQ_TYPE_DATA) {
+		pppoat_debug("arq", "Dropping malformed packet");
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	seq = pl_arq_be32_get(trailer);
+	una = pl_arq_be32_get(trailer + 4);
+	pkt->pkt_size -= PL_ARQ_TRAILER;
+	now = pl_arq_now();
+
+	pppoat_list_init(&out, &pl_arq_outq_descr);
+	pppoat_mutex_lock(&ctx->ac_rx_lock);
+	window = (int32_t)ctx->ac_window;
+	dist   = (int32_t)(seq - ctx->ac_rx_next);
+	if (dist < -window || dist >= 2 * window) {
+		pppoat_debug("arq", "Resynchronising at %" PRIu32, seq);
+		pl_arq_rx_reset(mod, seq, &out, now);
+	}
+	/* The sender doesn't retransmit packets before `una' anymore. */
+	if (seq - una < ctx->ac_window)
+		pl_arq_rx_skip(mod, una, &out, now);
+	if (!pl_arq_before(seq, ctx->ac_rx_next + ctx->ac_window))
+		pl_arq_rx_skip(mod, seq - ctx->ac_window + 1, &out, now);
+
+	slot = pl_arq_rx_slot(ctx, seq);
+	gap  = seq != ctx->ac_rx_next;
+	if (pl_arq_before(seq, ctx->ac_rx_next) || slot->rs_received) {
+		/* Duplicate, the ACK was probably lost. */
+		pppoat_packet_put(mod->m_pkts, pkt);
+		ctx->ac_rx_ack = true;
+	} else {
+		slot->rs_received = true;
+		if (ctx->ac_reorder && gap) {
+			slot->rs_pkt = pkt;
+			if (ctx->ac_rx_held_nr++ == 0)
+				ctx->ac_rx_gap = now;
+		} else
+			*next = pkt;
+		pl_arq_rx_advance(mod, &out, now);
+		++ctx->ac_rx_unacked;
+	}
+	/* Out of order arrival is reported at once for fast retransmit. */
+	if (gap || ctx->ac_rx_unacked >= PL_ARQ_ACK_EVERY)
+		ack = pl_arq_ack_make(mod);
+	pppoat_mutex_unlock(&ctx->ac_rx_lock);
+
+	if (ack != NULL)
+		pppoat_list_enqueue(&out, ack);
+	pl_arq_out(ctx, &out);
+	pppoat_list_fini(&out);
+
+	return 0;
+}
+
+static void pl_arq_rx_timers(struct pppoat_module *mod, uint64_t now)
+{
+	struct pl_arq_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *ack = NULL;
+	struct pppoat_list    out;
+	uint32_t              seq;
+
+	pppoat_list_init(&out, &pl_arq_outq_descr);
+	pppoat_mutex_lock(&ctx->ac_rx_lock);
+	if (ctx->ac_rx_held_nr > 0 &&
+	    now >= ctx->ac_rx_gap + ctx->ac_reorder_timeout) {
+		/* Give up the gap before the first held packet. */
+		for (seq = ctx->ac_rx_next + 1;
+		     !pl_arq_rx_slot(ctx, seq)->rs_received; ++seq)
+			;
+		pl_arq_rx_skip(mod, seq, &out, now);
+	}
+	if (ctx->ac_rx_ack || ctx->ac_rx_unacked > 0)
+		ack = pl_arq_ack_make(mod);
+	pppoat_mutex_unlock(&ctx->ac_rx_lock);
+
+	if (ack != NULL)
+		pppoat_list_enqueue(&out, ack);
+	pl_arq_out(ctx, &out);
+	pppoat_list_fini(&out);
+}
+
+/** Polled by the pipeline: serves timers and returns queued packets. */
+static int pl_arq_poll(struct pppoat_module  *mod,
+		       struct pppoat_packet **next)
+{
+	struct pl_arq_ctx *ctx = mod->m_userdata;
+	uint64_t           now;
+
+	pppoat_mutex_lock(&ctx->ac_out_lock);
+	*next = pppoat_list_dequeue(&ctx->ac_outq);
+	pppoat_mutex_unlock(&ctx->ac_out_lock);
+	if (*next != NULL)
+		return 0;
+
+	pl_arq_rtt_seed(mod);
+	now = pl_arq_now();
+	pl_arq_tx_timers(mod, now);
+	pl_arq_rx_timers(mod, now);
+
+	pppoat_mutex_lock(&ctx->ac_out_lock);
+	*next = pppoat_list_dequeue(&ctx->ac_outq);
+	pppoat_mutex_unlock(&ctx->ac_out_lock);
+
+	return 0;
+}
+
+static int pl_arq_process(struct pppoat_module  *mod,
+			  struct pppoat_packet  *pkt,
+			  struct pppoat_packet **next)
+{
+	struct pl_arq_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(pl_arq_ctx_invariant(ctx));
+
+	*next = NULL;
+	if (pkt == NULL)
+		return pl_arq_poll(mod, next);
+	return pkt->pkt_type == PPPOAT_PACKET_SEND ?
+	       pl_arq_send(mod, pkt, next) : pl_arq_recv(mod, pkt, next);
+}
+
+static void pl_arq_stats(struct pppoat_module *mod)
+{
+	struct pl_arq_ctx *ctx = mod->m_userdata;
+
+	pppoat_mutex_lock(&ctx->ac_tx_lock);
+	pppoat_info("arq", "Retransmitted %" PRIu64 ", given up %" PRIu64
+		    " packets, RTO %" PRIu64 " ms", ctx->ac_retransmits,
+		    ctx->ac_given_up, ctx->ac_rto / 1000);
+	pppoat_mutex_unlock(&ctx->ac_tx_lock);
+}
+
+static size_t pl_arq_mtu(struct pppoat_module *mod)
+{
+	return PL_ARQ_SIZE_MAX;
+}
+
+static size_t pl_arq_mtu_set(struct pppoat_module *mod, size_t mtu)
+{
+	return mtu > PL_ARQ_TRAILER ? mtu - PL_ARQ_TRAILER : 1;
+}
+
+static struct pppoat_module_ops pl_arq_ops = {
+	.mop_init    = &pl_arq_init,
+	.mop_fini    = &pl_arq_fini,
+	.mop_run     = &pl_arq_run,
+	.mop_stop    = &pl_arq_stop,
+	.mop_process = &pl_arq_process,
+	.mop_mtu     = &pl_arq_mtu,
+	.mop_mtu_set = &pl_arq_mtu_set,
+	.mop_stats   = &pl_arq_stats,
+};
+
+struct pppoat_module_impl pppoat_module_pl_arq = {
+	.mod_name  = "arq",
+	.mod_descr = "Selective repeat ARQ",
+	.mod_type  = PPPOAT_MODULE_PLUGIN,
+	.mod_ops   = &pl_arq_ops,
+	.mod_props = 0,
+};
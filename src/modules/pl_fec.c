@@ -0,0 +1,912 @@
+/* modules/pl_fec.c
+ * PPP over Any Transport -- Forward error correction plugin
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "conf.h"
+#include "gf256.h"
+#include "list.h"
+#include "magic.h"
+#include "memory.h"
+#include "misc.h"
+#include "module.h"
+#include "mutex.h"
+#include "packet.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>	/* clock_gettime */
+
+#define FEC_CONF_DATA     "fec.data"
+#define FEC_CONF_PARITY   "fec.parity"
+#define FEC_CONF_ADAPTIVE "fec.adaptive"
+#define FEC_CONF_TIMEOUT  "fec.timeout"
+#define FEC_CONF_SLOTS    "fec.slots"
+
+/*
+ * The plugin recovers lost packets without retransmission. Outbound packets
+ * are grouped by fec.data packets and every group is followed by up to
+ * fec.parity parity packets. The receiver recovers a group from any
+ * fec.data packets of it, so up to fec.parity losses per group cost
+ * nothing but bandwidth.
+ *
+ * Parity is a systematic Reed-Solomon code over GF(2^8) with a Cauchy
+ * matrix: parity j is sum of c(j, i) * D_i, where c(j, i) = 1 / (x_j + i)
+ * and x_j = 255 - j. Every square submatrix of a Cauchy matrix is
+ * invertible, so any combination of received packets works. The
+ * coefficients don't depend on the group size, hence a group which is
+ * closed by fec.timeout before it's full is encoded the same way. Packets
+ * of a group have different sizes, so a symbol D_i is the packet with
+ * 2-byte length prefix padded with zeros to the longest symbol.
+ *
+ * Every packet gets an 8-byte trailer: group id (32 bits), index within the
+ * group, number of data packets, number of parity packets and type. Data
+ * packets go on immediately and a copy is kept for decoding. Groups are
+ * stored in fec.slots entries indexed by group id, a newer group replaces
+ * an older one.
+ *
+ * Adaptation. The receiver counts expected and received packets of every
+ * replaced group and sends loss rate to the peer twice per second. With
+ * fec.adaptive, the sender sets parity to twice the expected number of
+ * losses per group plus one, at most fec.parity.
+ */
+
+enum {
+	PL_FEC_TRAILER    = 8,
+	/** Length prefix of a symbol. */
+	PL_FEC_LEN        = 2,
+	PL_FEC_DATA       = 8,
+	PL_FEC_DATA_MAX   = PPPOAT_GF256_MATRIX_MAX,
+	PL_FEC_PARITY     = 2,
+	PL_FEC_PARITY_MAX = 32,
+	/** Maximum delay of parity after the first packet of a group, ms. */
+	PL_FEC_TIMEOUT    = 10,
+	PL_FEC_SLOTS      = 32,
+	PL_FEC_SLOTS_MAX  = 4096,
+	/** Interval of loss reports in ms. */
+	PL_FEC_REPORT     = 500,
+	PL_FEC_SIZE_MAX   = 65535 - PL_FEC_TRAILER - PL_FEC_LEN,
+};
+
+enum pl_fec_type {
+	PL_FEC_TYPE_DATA   = 0,
+	PL_FEC_TYPE_PARITY = 1,
+	PL_FEC_TYPE_REPORT = 2,
+};
+
+struct pl_fec_trailer {
+	uint32_t         ft_id;
+	unsigned         ft_index;
+	unsigned         ft_k;
+	unsigned         ft_m;
+	enum pl_fec_type ft_type;
+};
+
+/** A group being received. */
+struct pl_fec_group {
+	bool                  fg_used;
+	uint32_t              fg_id;
+	/** Number of data packets, nominal until a parity packet comes. */
+	unsigned              fg_k;
+	unsigned              fg_m;
+	bool                  fg_k_known;
+	/** Received and recovered data packets. */
+	uint64_t              fg_data_map;
+	uint32_t              fg_parity_map;
+	unsigned              fg_data_nr;
+	unsigned              fg_parity_nr;
+	/** Size of the parity symbols, all of them are equally long. */
+	size_t                fg_parity_size;
+	/** Packets which came from the network, for loss accounting. */
+	unsigned              fg_recv_nr;
+	bool                  fg_done;
+	/** Symbols of data packets followed by parity packets. */
+	struct pppoat_packet *fg_syms[PL_FEC_DATA_MAX + PL_FEC_PARITY_MAX];
+};
+
+struct pl_fec_ctx {
+	unsigned             fc_k;
+	unsigned             fc_m_max;
+	/** Parity of new groups, changes with fec.adaptive. */
+	unsigned             fc_m;
+	bool                 fc_adaptive;
+	uint64_t             fc_timeout;
+	uint8_t              fc_coef[PL_FEC_PARITY_MAX][PL_FEC_DATA_MAX];
+	/* Sender, protected by fc_tx_lock. */
+	struct pppoat_mutex  fc_tx_lock;
+	uint32_t             fc_tx_id;
+	unsigned             fc_tx_nr;
+	unsigned             fc_tx_m;
+	uint64_t             fc_tx_start;
+	/** Parity symbols of the current group. */
+	struct pppoat_packet *fc_tx_parity[PL_FEC_PARITY_MAX];
+	/** Parity symbols which missed a data packet and aren't sent. */
+	uint32_t             fc_tx_invalid;
+	/* Receiver, protected by fc_rx_lock. */
+	struct pppoat_mutex  fc_rx_lock;
+	struct pl_fec_group *fc_groups;
+	unsigned             fc_groups_nr;
+	uint64_t             fc_rx_expected;
+	uint64_t             fc_rx_received;
+	uint64_t             fc_rx_recovered;
+	uint64_t             fc_report_next;
+	/** Parity, recovered packets and reports for the pipeline. */
+	struct pppoat_list   fc_outq;
+	struct pppoat_mutex  fc_out_lock;
+};
+
+static struct pppoat_list_descr pl_fec_outq_descr =
+	PPPOAT_LIST_DESCR("FEC output queue", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_MODULE_PL_FEC_OUTQ_MAGIC);
+
+static bool pl_fec_ctx_invariant(struct pl_fec_ctx *ctx)
+{
+	return ctx != NULL && ctx->fc_k > 0 && ctx->fc_k <= PL_FEC_DATA_MAX &&
+	       ctx->fc_m <= ctx->fc_m_max && ctx->fc_m_max <= PL_FEC_PARITY_MAX;
+}
+
+static uint64_t pl_fec_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int pl_fec_conf_parse(struct pl_fec_ctx *ctx, struct pppoat_conf *conf)
+{
+	long val;
+	int  rc;
+
+	ctx->fc_k            = PL_FEC_DATA;
+	ctx->fc_m_max        = PL_FEC_PARITY;
+	ctx->fc_timeout      = PL_FEC_TIMEOUT;
+	ctx->fc_groups_nr    = PL_FEC_SLOTS;
+
+	rc = pppoat_conf_find_long(conf, FEC_CONF_DATA, &val);
+	if (rc == 0) {
+		if (val < 1 || val > PL_FEC_DATA_MAX) {
+			pppoat_error("fec", "Number of data packets must be in "
+				     "range 1..%d.", PL_FEC_DATA_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_k = (unsigned)val;
+	}
+	rc = pppoat_conf_find_long(conf, FEC_CONF_PARITY, &val);
+	if (rc == 0) {
+		if (val < 0 || val > PL_FEC_PARITY_MAX) {
+			pppoat_error("fec", "Number of parity packets must be "
+				     "in range 0..%d.", PL_FEC_PARITY_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_m_max = (unsigned)val;
+	}
+	rc = pppoat_conf_find_long(conf, FEC_CONF_TIMEOUT, &val);
+	if (rc == 0) {
+		if (val < 1) {
+			pppoat_error("fec", "Invalid timeout %ld.", val);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_timeout = (uint64_t)val;
+	}
+	rc = pppoat_conf_find_long(conf, FEC_CONF_SLOTS, &val);
+	if (rc == 0) {
+		if (val < 1 || val > PL_FEC_SLOTS_MAX) {
+			pppoat_error("fec", "Number of slots must be in range "
+				     "1..%d.", PL_FEC_SLOTS_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_groups_nr = (unsigned)val;
+	}
+	pppoat_conf_find_bool(conf, FEC_CONF_ADAPTIVE, &ctx->fc_adaptive);
+	ctx->fc_m = ctx->fc_m_max;
+
+	return 0;
+}
+
+static int pl_fec_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+{
+	struct pl_fec_ctx *ctx;
+	unsigned           i;
+	unsigned           j;
+	int                rc;
+
+	ctx = pppoat_alloc(sizeof *ctx);
+	if (ctx == NULL)
+		return P_ERR(-ENOMEM);
+	rc = pl_fec_conf_parse(ctx, conf);
+	if (rc != 0)
+		goto err_free;
+	ctx->fc_groups = pppoat_calloc(ctx->fc_groups_nr,
+				       sizeof *ctx->fc_groups);
+	if (ctx->fc_groups == NULL) {
+		rc = P_ERR(-ENOMEM);
+		goto err_free;
+	}
+
+	pppoat_gf256_init();
+	for (j = 0; j < PL_FEC_PARITY_MAX; ++j)
+		for (i = 0; i < PL_FEC_DATA_MAX; ++i)
+			ctx->fc_coef[j][i] =
+				pppoat_gf256_inv((uint8_t)((255 - j) ^ i));
+	pppoat_debug("fec", "GF(2^8) implementation: %s",
+		     pppoat_gf256_impl());
+
+	ctx->fc_tx_id        = (uint32_t)pl_fec_now();
+	ctx->fc_tx_nr        = 0;
+	ctx->fc_rx_expected  = 0;
+	ctx->fc_rx_received  = 0;
+	ctx->fc_rx_recovered = 0;
+	ctx->fc_report_next  = 0;
+	memset(ctx->fc_tx_parity, 0, sizeof ctx->fc_tx_parity);
+	pppoat_mutex_init(&ctx->fc_tx_lock);
+	pppoat_mutex_init(&ctx->fc_rx_lock);
+	pppoat_mutex_init(&ctx->fc_out_lock);
+	pppoat_list_init(&ctx->fc_outq, &pl_fec_outq_descr);
+
+	mod->m_userdata = ctx;
+
+	return 0;
+
+err_free:
+	pppoat_free(ctx);
+	return rc;
+}
+
+static void pl_fec_group_clear(struct pppoat_module *mod,
+			       struct pl_fec_group  *g)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(g->fg_syms); ++i) {
+		if (g->fg_syms[i] != NULL)
+			pppoat_packet_put(mod->m_pkts, g->fg_syms[i]);
+		g->fg_syms[i] = NULL;
+	}
+}
+
+static void pl_fec_fini(struct pppoat_module *mod)
+{
+	struct pl_fec_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
+	unsigned              i;
+
+	PPPOAT_ASSERT(pl_fec_ctx_invariant(ctx));
+
+	while ((pkt = pppoat_list_dequeue(&ctx->fc_outq)) != NULL)
+		pppoat_packet_put(mod->m_pkts, pkt);
+	for (i = 0; i < ctx->fc_groups_nr; ++i)
+		pl_fec_group_clear(mod, &ctx->fc_groups[i]);
+	for (i = 0; i < PL_FEC_PARITY_MAX; ++i)
+		if (ctx->fc_tx_parity[i] != NULL)
+			pppoat_packet_put(mod->m_pkts, ctx->fc_tx_parity[i]);
+	pppoat_list_fini(&ctx->fc_outq);
+	pppoat_mutex_fini(&ctx->fc_out_lock);
+	pppoat_mutex_fini(&ctx->fc_rx_lock);
+	pppoat_mutex_fini(&ctx->fc_tx_lock);
+	pppoat_free(ctx->fc_groups);
+	pppoat_free(ctx);
+}
+
+static int pl_fec_run(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static int pl_fec_stop(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static void pl_fec_trailer_put(unsigned char               *buf,
+			       const struct pl_fec_trailer *t)
+{
+	buf[0] = (unsigned char)(t->ft_id >> 24);
+	buf[1] = (unsigned char)(t->ft_id >> 16);
+	buf[2] = (unsigned char)(t->ft_id >> 8);
+	buf[3] = (unsigned char)t->ft_id;
+	buf[4] = (unsigned char)t->ft_index;
+	buf[5] = (unsigned char)t->ft_k;
+	buf[6] = (unsigned char)t->ft_m;
+	buf[7] = (unsigned char)t->ft_type;
+}
+
+static void pl_fec_trailer_get(const unsigned char   *buf,
+			       struct pl_fec_trailer *t)
+{
+	t->ft_id    = (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+		      (uint32_t)buf[2] << 8 | buf[3];
+	t->ft_index = buf[4];
+	t->ft_k     = buf[5];
+	t->ft_m     = buf[6];
+	t->ft_type  = (enum pl_fec_type)buf[7];
+}
+
+/** Appends trailer to the packet. */
+static int pl_fec_trailer_add(struct pppoat_module        *mod,
+			      struct pppoat_packet        *pkt,
+			      const struct pl_fec_trailer *t)
+{
+	int rc;
+
+	rc = pppoat_packet_reserve(mod->m_pkts, pkt,
+				   pkt->pkt_size + PL_FEC_TRAILER);
+	if (rc == 0) {
+		pl_fec_trailer_put((unsigned char *)pkt->pkt_data +
+				   pkt->pkt_size, t);
+		pkt->pkt_size += PL_FEC_TRAILER;
+	}
+	return rc;
+}
+
+static void pl_fec_out(struct pl_fec_ctx *ctx, struct pppoat_list *pkts)
+{
+	struct pppoat_packet *pkt;
+
+	pppoat_mutex_lock(&ctx->fc_out_lock);
+	while ((pkt = pppoat_list_dequeue(pkts)) != NULL)
+		pppoat_list_enqueue(&ctx->fc_outq, pkt);
+	pppoat_mutex_unlock(&ctx->fc_out_lock);
+}
+
+/** Grows the symbol up to `size' bytes padding it with zeros. */
+static int pl_fec_sym_grow(struct pppoat_module *mod,
+			   struct pppoat_packet *sym,
+			   size_t                size)
+{
+	int rc = 0;
+
+	if (sym->pkt_size < size) {
+		rc = pppoat_packet_reserve(mod->m_pkts, sym, size);
+		if (rc == 0) {
+			memset((char *)sym->pkt_data + sym->pkt_size, 0,
+			       size - sym->pkt_size);
+			sym->pkt_size = size;
+		}
+	}
+	return rc;
+}
+
+/** sym ^= c * (length prefix and data of a packet). */
+static void pl_fec_sym_muladd(struct pppoat_packet *sym,
+			      const unsigned char  *data,
+			      size_t                len,
+			      uint8_t               c)
+{
+	uint8_t prefix[PL_FEC_LEN] = {
+		(uint8_t)(len >> 8),
+		(uint8_t)len,
+	};
+
+	PPPOAT_ASSERT(sym->pkt_size >= len + PL_FEC_LEN);
+
+	pppoat_gf256_muladd(sym->pkt_data, prefix, c, PL_FEC_LEN);
+	pppoat_gf256_muladd((uint8_t *)sym->pkt_data + PL_FEC_LEN, data, c,
+			    len);
+}
+
+/**
+ * Closes the current group and queues its parity packets. Called with
+ * fc_tx_lock held.
+ */
+static void pl_fec_tx_flush(struct pppoat_module *mod)
+{
+	struct pl_fec_ctx     *ctx = mod->m_userdata;
+	struct pppoat_list     pkts;
+	struct pppoat_packet  *pkt;
+	struct pl_fec_trailer  t;
+	unsigned               j;
+
+	pppoat_list_init(&pkts, &pl_fec_outq_descr);
+	for (j = 0; j < ctx->fc_tx_m; ++j) {
+		pkt = ctx->fc_tx_parity[j];
+		ctx->fc_tx_parity[j] = NULL;
+		if (pkt == NULL)
+			continue;
+		t = (struct pl_fec_trailer){
+			.ft_id    = ctx->fc_tx_id,
+			.ft_index = j,
+			.ft_k     = ctx->fc_tx_nr,
+			.ft_m     = ctx->fc_tx_m,
+			.ft_type  = PL_FEC_TYPE_PARITY,
+		};
+		if (pl_fec_trailer_add(mod, pkt, &t) != 0) {
+			pppoat_packet_put(mod->m_pkts, pkt);
+			continue;
+		}
+		pkt->pkt_type = PPPOAT_PACKET_SEND;
+		pppoat_list_enqueue(&pkts, pkt);
+	}
+	pl_fec_out(ctx, &pkts);
+	pppoat_list_fini(&pkts);
+
+	++ctx->fc_tx_id;
+	ctx->fc_tx_nr      = 0;
+	ctx->fc_tx_invalid = 0;
+}
+
+static int pl_fec_send(struct pppoat_module  *mod,
+		       struct pppoat_packet  *pkt,
+		       struct pppoat_packet **next)
+{
+	struct pl_fec_ctx     *ctx = mod->m_userdata;
+	struct pppoat_packet  *sym;
+	struct pl_fec_trailer  t;
+	size_t                 len = pkt->pkt_size;
+	unsigned               i;
+	unsigned               j;
+	int                    rc;
+
+	if (len > PL_FEC_SIZE_MAX) {
+		pppoat_debug("fec", "Dropping too big packet (%zu bytes)",
+			     len);
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	rc = pppoat_packet_reserve(mod->m_pkts, pkt, len + PL_FEC_TRAILER);
+	if (rc != 0)
+		return rc;
+
+	pppoat_mutex_lock(&ctx->fc_tx_lock);
+	if (ctx->fc_tx_nr == 0) {
+		ctx->fc_tx_m     = ctx->fc_m;
+		ctx->fc_tx_start = pl_fec_now();
+	}
+	i = ctx->fc_tx_nr++;
+	for (j = 0; j < ctx->fc_tx_m; ++j) {
+		if (ctx->fc_tx_invalid & (1U << j))
+			continue;
+		sym = ctx->fc_tx_parity[j];
+		if (sym == NULL) {
+			sym = pppoat_packet_get(mod->m_pkts, len + PL_FEC_LEN);
+			if (sym != NULL)
+				memset(sym->pkt_data, 0, len + PL_FEC_LEN);
+			ctx->fc_tx_parity[j] = sym;
+		}
+		/*
+		 * Parity which misses a data packet would corrupt recovery,
+		 * so it isn't sent for the rest of the group.
+		 */
+		if (sym == NULL ||
+		    pl_fec_sym_grow(mod, sym, len + PL_FEC_LEN) != 0) {
+			if (sym != NULL)
+				pppoat_packet_put(mod->m_pkts, sym);
+			ctx->fc_tx_parity[j] = NULL;
+			ctx->fc_tx_invalid |= 1U << j;
+			continue;
+		}
+		pl_fec_sym_muladd(sym, pkt->pkt_data, len, ctx->fc_coef[j][i]);
+	}
+	t = (struct pl_fec_trailer){
+		.ft_id    = ctx->fc_tx_id,
+		.ft_index = i,
+		.ft_k     = ctx->fc_k,
+		.ft_m     = ctx->fc_tx_m,
+		.ft_type  = PL_FEC_TYPE_DATA,
+	};
+	if (ctx->fc_tx_nr == ctx->fc_k)
+		pl_fec_tx_flush(mod);
+	pppoat_mutex_unlock(&ctx->fc_tx_lock);
+
+	pl_fec_trailer_put((unsigned char *)pkt->pkt_data + len, &t);
+	pkt->pkt_size = len + PL_FEC_TRAILER;
+	*next = pkt;
+
+	return 0;
+}
+
+/** Accounts packets of a group which is not going to change anymore. */
+static void pl_fec_group_account(struct pl_fec_ctx   *ctx,
+				 struct pl_fec_group *g)
+{
+	unsigned expected = g->fg_k + g->fg_m;
+
+	ctx->fc_rx_expected += expected;
+	ctx->fc_rx_received += pppoat_min(g->fg_recv_nr, expected);
+}
+
+/**
+ * Returns the group of a packet. A newer group replaces an older one in its
+ * slot, a packet of an already replaced group gets NULL.
+ */
+static struct pl_fec_group *pl_fec_group_get(struct pppoat_module        *mod,
+					     const struct pl_fec_trailer *t)
+{
+	struct pl_fec_ctx   *ctx = mod->m_userdata;
+	struct pl_fec_group *g;
+
+	g = &ctx->fc_groups[t->ft_id % ctx->fc_groups_nr];
+	if (g->fg_used && g->fg_id == t->ft_id)
+		return g;
+	if (g->fg_used && (int32_t)(t->ft_id - g->fg_id) < 0)
+		return NULL;
+
+	if (g->fg_used) {
+		pl_fec_group_account(ctx, g);
+		pl_fec_group_clear(mod, g);
+	}
+	memset(g, 0, sizeof *g);
+	g->fg_used = true;
+	g->fg_id   = t->ft_id;
+	g->fg_k    = t->ft_k;
+	g->fg_m    = t->ft_m;
+
+	return g;
+}
+
+/**
+ * Recovers missing data packets of the group if enough packets have come.
+ * The missing symbols M satisfy C * M = P - C' * D, where P are received
+ * parity symbols, D are received data symbols and C, C' are the respective
+ * columns of the coefficient rows of P.
+ */
+static void pl_fec_decode(struct pppoat_module *mod,
+			  struct pl_fec_group  *g,
+			  struct pppoat_list   *out)
+{
+	struct pl_fec_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *res[PL_FEC_DATA_MAX];
+	struct pppoat_packet *sym;
+	uint8_t               m[PL_FEC_DATA_MAX * PL_FEC_DATA_MAX];
+	unsigned              miss[PL_FEC_DATA_MAX];
+	unsigned              rows[PL_FEC_DATA_MAX];
+	unsigned              nr = 0;
+	unsigned              a;
+	unsigned              b;
+	unsigned              i;
+	size_t                size = 0;
+	size_t                len;
+	int                   rc;
+
+	if (g->fg_done || !g->fg_k_known || g->fg_data_nr >= g->fg_k ||
+	    g->fg_data_nr + g->fg_parity_nr < g->fg_k)
+		return;
+	g->fg_done = true;
+
+	for (i = 0; i < g->fg_k; ++i)
+		if ((g->fg_data_map & (1ULL << i)) == 0)
+			miss[nr++] = i;
+	for (i = 0, a = 0; a < nr; ++i) {
+		if ((g->fg_parity_map & (1U << i)) != 0) {
+			rows[a++] = i;
+			size = g->fg_syms[PL_FEC_DATA_MAX + i]->pkt_size;
+		}
+	}
+	for (a = 0; a < nr; ++a)
+		for (b = 0; b < nr; ++b)
+			m[a * nr + b] = ctx->fc_coef[rows[a]][miss[b]];
+	rc = pppoat_gf256_matrix_inv(m, nr);
+	PPPOAT_ASSERT(rc == 0);
+
+	/* Residuals of the parity symbols. */
+	memset(res, 0, sizeof res);
+	for (a = 0; a < nr; ++a) {
+		sym = g->fg_syms[PL_FEC_DATA_MAX + rows[a]];
+		res[a] = sym;
+		g->fg_syms[PL_FEC_DATA_MAX + rows[a]] = NULL;
+		for (i = 0; i < g->fg_k; ++i) {
+			if (g->fg_syms[i] != NULL &&
+			    g->fg_syms[i]->pkt_size <= sym->pkt_size)
+				pppoat_gf256_muladd(sym->pkt_data,
+						    g->fg_syms[i]->pkt_data,
+						    ctx->fc_coef[rows[a]][i],
+						    g->fg_syms[i]->pkt_size);
+		}
+	}
+	/* Missing symbols. */
+	for (b = 0; b < nr; ++b) {
+		sym = pppoat_packet_get(mod->m_pkts, size);
+		if (sym == NULL)
+			continue;
+		memset(sym->pkt_data, 0, size);
+		for (a = 0; a < nr; ++a)
+			pppoat_gf256_muladd(sym->pkt_data, res[a]->pkt_data,
+					    m[b * nr + a], size);
+		len = (size_t)((uint8_t *)sym->pkt_data)[0] << 8 |
+		      ((uint8_t *)sym->pkt_data)[1];
+		if (len + PL_FEC_LEN > size) {
+			pppoat_debug("fec", "Group %u decoded with invalid "
+				     "length", g->fg_id);
+			pppoat_packet_put(mod->m_pkts, sym);
+			continue;
+		}
+		memmove(sym->pkt_data, (char *)sym->pkt_data + PL_FEC_LEN,
+			len);
+		sym->pkt_size = len;
+		sym->pkt_type = PPPOAT_PACKET_RECV;
+		pppoat_list_enqueue(out, sym);
+		g->fg_data_map |= 1ULL << miss[b];
+		++ctx->fc_rx_recovered;
+	}
+	for (a = 0; a < nr; ++a)
+		pppoat_packet_put(mod->m_pkts, res[a]);
+	/* Symbols are not needed anymore, only counters. */
+	pl_fec_group_clear(mod, g);
+}
+
+/**
+ * Stores a copy of the received packet in its group.
+ *
+ * @return false if the packet is a duplicate of a received or recovered
+ *         data packet.
+ */
+static bool pl_fec_store(struct pppoat_module        *mod,
+			 struct pppoat_packet        *pkt,
+			 const struct pl_fec_trailer *t,
+			 struct pppoat_list          *out)
+{
+	struct pl_fec_ctx    *ctx = mod->m_userdata;
+	struct pl_fec_group  *g;
+	struct pppoat_packet *sym;
+	bool                  parity = t->ft_type == PL_FEC_TYPE_PARITY;
+	unsigned              slot;
+
+	pppoat_mutex_lock(&ctx->fc_rx_lock);
+	g = pl_fec_group_get(mod, t);
+	if (g != NULL && !parity && (g->fg_data_map & (1ULL << t->ft_index))) {
+		pppoat_mutex_unlock(&ctx->fc_rx_lock);
+		return false;
+	}
+	/* Late or duplicate parity and parity of a different size. */
+	if (parity && (g == NULL ||
+		       (g->fg_parity_map & (1U << t->ft_index)) != 0 ||
+		       (g->fg_parity_nr > 0 &&
+			pkt->pkt_size != g->fg_parity_size))) {
+		pppoat_mutex_unlock(&ctx->fc_rx_lock);
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return true;
+	}
+	if (g == NULL) {
+		pppoat_mutex_unlock(&ctx->fc_rx_lock);
+		return true;
+	}
+
+	++g->fg_recv_nr;
+	slot = parity ? PL_FEC_DATA_MAX + t->ft_index : t->ft_index;
+	/* Data symbol is the packet with length prefix. */
+	sym = parity || g->fg_done ? NULL :
+	      pppoat_packet_get(mod->m_pkts, pkt->pkt_size + PL_FEC_LEN);
+	if (sym != NULL) {
+		((uint8_t *)sym->pkt_data)[0] = (uint8_t)(pkt->pkt_size >> 8);
+		((uint8_t *)sym->pkt_data)[1] = (uint8_t)pkt->pkt_size;
+		memcpy((char *)sym->pkt_data + PL_FEC_LEN, pkt->pkt_data,
+		       pkt->pkt_size);
+	}
+	if (parity) {
+		g->fg_k             = t->ft_k;
+		g->fg_m             = t->ft_m;
+		g->fg_k_known       = true;
+		g->fg_parity_map   |= 1U << t->ft_index;
+		g->fg_parity_size   = pkt->pkt_size;
+		++g->fg_parity_nr;
+	} else if (sym != NULL || g->fg_done) {
+		/* Without the symbol the packet is missing for decoding. */
+		g->fg_data_map |= 1ULL << t->ft_index;
+		++g->fg_data_nr;
+	}
+	if (!g->fg_done) {
+		g->fg_syms[slot] = parity ? pkt : sym;
+		pl_fec_decode(mod, g, out);
+	} else if (parity)
+		pppoat_packet_put(mod->m_pkts, pkt);
+	pppoat_mutex_unlock(&ctx->fc_rx_lock);
+
+	return true;
+}
+
+/** Chooses parity for the loss rate reported by the peer. */
+static void pl_fec_report_recv(struct pl_fec_ctx    *ctx,
+			       struct pppoat_packet *pkt)
+{
+	const uint8_t *buf = pkt->pkt_data;
+	unsigned       loss;
+	unsigned       m;
+
+	if (!ctx->fc_adaptive || pkt->pkt_size < 2)
+		return;
+
+	/* Loss in 1/1000, twice the expected number of losses plus one. */
+	loss = pppoat_min((unsigned)buf[0] << 8 | buf[1], 1000U);
+	m    = (2 * ctx->fc_k * loss + 999) / 1000 + 1;
+	m    = pppoat_min(m, ctx->fc_m_max);
+	pppoat_mutex_lock(&ctx->fc_tx_lock);
+	if (m != ctx->fc_m) {
+		pppoat_debug("fec", "Loss %u.%u%%, parity %u -> %u",
+			     loss / 10, loss % 10, ctx->fc_m, m);
+		ctx->fc_m = m;
+	}
+	pppoat_mutex_unlock(&ctx->fc_tx_lock);
+}
+
+static int pl_fec_recv(struct pppoat_module  *mod,
+		       struct pppoat_packet  *pkt,
+		       struct pppoat_packet **next)
+{
+	struct pl_fec_ctx     *ctx = mod->m_userdata;
+	struct pl_fec_trailer  t;
+	struct pppoat_list     out;
+	bool                   valid;
+	bool                   fresh = true;
+
+	if (pkt->pkt_size < PL_FEC_TRAILER) {
+		pppoat_debug("fec", "Dropping packet without trailer");
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	pkt->pkt_size -= PL_FEC_TRAILER;
+	pl_fec_trailer_get((unsigned char *)pkt->pkt_data + pkt->pkt_size, &t);
+
+	if (t.ft_type == PL_FEC_TYPE_REPORT) {
+		pl_fec_report_recv(ctx, pkt);
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	valid = t.ft_k > 0 && t.ft_k <= PL_FEC_DATA_MAX &&
+		t.ft_m <= PL_FEC_PARITY_MAX &&
+		((t.ft_type == PL_FEC_TYPE_DATA && t.ft_index < t.ft_k) ||
+		 (t.ft_type == PL_FEC_TYPE_PARITY && t.ft_index < t.ft_m &&
+		  pkt->pkt_size >= PL_FEC_LEN));
+	if (!valid) {
+		pppoat_debug("fec", "Dropping malformed packet");
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+
+	pppoat_list_init(&out, &pl_fec_outq_descr);
+	fresh = pl_fec_store(mod, pkt, &t, &out);
+	pl_fec_out(ctx, &out);
+	pppoat_list_fini(&out);
+
+	/* Parity is consumed by pl_fec_store(). */
+	if (t.ft_type == PL_FEC_TYPE_DATA && fresh)
+		*next = pkt;
+	else if (t.ft_type == PL_FEC_TYPE_DATA)
+		pppoat_packet_put(mod->m_pkts, pkt);
+
+	return 0;
+}
+
+/** Returns a loss report if it's time to send one. */
+static struct pppoat_packet *pl_fec_report(struct pppoat_module *mod,
+					   uint64_t              now)
+{
+	struct pl_fec_ctx     *ctx = mod->m_userdata;
+	struct pppoat_packet  *pkt = NULL;
+	struct pl_fec_trailer  t = { .ft_type = PL_FEC_TYPE_REPORT };
+	uint64_t               expected = 0;
+	uint64_t               received = 0;
+	unsigned               loss;
+
+	pppoat_mutex_lock(&ctx->fc_rx_lock);
+	if (now >= ctx->fc_report_next) {
+		expected = ctx->fc_rx_expected;
+		received = ctx->fc_rx_received;
+		ctx->fc_rx_expected = 0;
+		ctx->fc_rx_received = 0;
+		ctx->fc_report_next = now + PL_FEC_REPORT;
+	}
+	pppoat_mutex_unlock(&ctx->fc_rx_lock);
+
+	if (expected > 0)
+		pkt = pppoat_packet_get(mod->m_pkts, 2 + PL_FEC_TRAILER);
+	if (pkt != NULL) {
+		loss = (unsigned)((expected - received) * 1000 / expected);
+		((uint8_t *)pkt->pkt_data)[0] = (uint8_t)(loss >> 8);
+		((uint8_t *)pkt->pkt_data)[1] = (uint8_t)loss;
+		pl_fec_trailer_put((unsigned char *)pkt->pkt_data + 2, &t);
+		pkt->pkt_size = 2 + PL_FEC_TRAILER;
+		pkt->pkt_type = PPPOAT_PACKET_SEND;
+	}
+	return pkt;
+}
+
+/**
+ * Polled by the pipeline: returns queued packets and serves timers, i.e.
+ * closes a group which waits too long and sends loss reports.
+ */
+static int pl_fec_poll(struct pppoat_module  *mod,
+		       struct pppoat_packet **next)
+{
+	struct pl_fec_ctx *ctx = mod->m_userdata;
+	uint64_t           now;
+
+	pppoat_mutex_lock(&ctx->fc_out_lock);
+	*next = pppoat_list_dequeue(&ctx->fc_outq);
+	pppoat_mutex_unlock(&ctx->fc_out_lock);
+	if (*next != NULL)
+		return 0;
+
+	now = pl_fec_now();
+	pppoat_mutex_lock(&ctx->fc_tx_lock);
+	if (ctx->fc_tx_nr > 0 && now >= ctx->fc_tx_start + ctx->fc_timeout)
+		pl_fec_tx_flush(mod);
+	pppoat_mutex_unlock(&ctx->fc_tx_lock);
+
+	pppoat_mutex_lock(&ctx->fc_out_lock);
+	*next = pppoat_list_dequeue(&ctx->fc_outq);
+	pppoat_mutex_unlock(&ctx->fc_out_lock);
+
+	if (*next == NULL)
+		*next = pl_fec_report(mod, now);
+	return 0;
+}
+
+static int pl_fec_process(struct pppoat_module  *mod,
+			  struct pppoat_packet  *pkt,
+			  struct pppoat_packet **next)
+{
+	struct pl_fec_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(pl_fec_ctx_invariant(ctx));
+
+	*next = NULL;
+	if (pkt == NULL)
+		return pl_fec_poll(mod, next);
+	return pkt->pkt_type == PPPOAT_PACKET_SEND ?
+	       pl_fec_send(mod, pkt, next) : pl_fec_recv(mod, pkt, next);
+}
+
+static void pl_fec_stats(struct pppoat_module *mod)
+{
+	struct pl_fec_ctx *ctx = mod->m_userdata;
+	uint64_t           recovered;
+	unsigned           m;
+
+	pppoat_mutex_lock(&ctx->fc_rx_lock);
+	recovered = ctx->fc_rx_recovered;
+	pppoat_mutex_unlock(&ctx->fc_rx_lock);
+	pppoat_mutex_lock(&ctx->fc_tx_lock);
+	m = ctx->fc_m;
+	pppoat_mutex_unlock(&ctx->fc_tx_lock);
+
+	pppoat_info("fec", "Recovered %" PRIu64 " packets, parity %u per %u packets",
+		    recovered, m, ctx->fc_k);
+}
+
+static size_t pl_fec_mtu(struct pppoat_module *mod)
+{
+	return PL_FEC_SIZE_MAX;
+}
+
+/** Parity packets carry length prefix and every packet has a trailer. */
+static size_t pl_fec_mtu_set(struct pppoat_module *mod, size_t mtu)
+{
+	return mtu > PL_FEC_TRAILER + PL_FEC_LEN ?
+	       mtu - PL_FEC_TRAILER - PL_FEC_LEN : 1;
+}
+
+static struct pppoat_module_ops pl_fec_ops = {
+	.mop_init    = &pl_fec_init,
+	.mop_fini    = &pl_fec_fini,
+	.mop_run     = &pl_fec_run,
+	.mop_stop    = &pl_fec_stop,
+	.mop_process = &pl_fec_process,
+	.mop_mtu     = &pl_fec_mtu,
+	.mop_mtu_set = &pl_fec_mtu_set,
+	.mop_stats   = &pl_fec_stats,
+};
+
+struct pppoat_module_impl pppoat_module_pl_fec = {
+	.mod_name  = "fec",
+	.mod_descr = "Forward error correction with Reed-Solomon code",
+	.mod_type  = PPPOAT_MODULE_PLUGIN,
+	.mod_ops   = &pl_fec_ops,
+	.mod_props = 0,
+};
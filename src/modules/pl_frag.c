@@ -0,0 +1,565 @@
+/* modules/pl_frag.c
+ * PPP over Any Transport -- Fragmentation plugin
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "conf.h"
+#include "list.h"
+#include "magic.h"
+#include "memory.h"
+#include "misc.h"
+#include "module.h"
+#include "mutex.h"
+#include "packet.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>	/* clock_gettime */
+
+#define FRAG_CONF_MTU     "frag.mtu"
+#define FRAG_CONF_SLOTS   "frag.slots"
+#define FRAG_CONF_TIMEOUT "frag.timeout"
+#define FRAG_CONF_MEM_MAX "frag.mem_max"
+
+/*
+ * The plugin lets the tunnel carry inner packets up to 64KB over transports
+ * with smaller MTU.
+ *
+ * Every outbound packet gets an 8-byte trailer: packet id (32 bits), offset
+ * of the fragment (16 bits) and total length of the packet (16 bits), all in
+ * network byte order. A packet which fits into frag.mtu with the trailer is
+ * sent as a single fragment with offset 0. Otherwise, it's split into
+ * fragments with payload of the same size, multiple of 8, except the last
+ * one. The first fragment continues through the pipeline and the rest are
+ * drained by the pipeline right after it. When the transport reports a new
+ * MTU at runtime (udp.pmtud), it replaces frag.mtu.
+ *
+ * Received fragments are collected in a reassembly table of frag.slots
+ * entries. Every entry keeps a bitmap of received 8-byte units, so
+ * duplicated and overlapping fragments are harmless. An entry is dropped
+ * after frag.timeout milliseconds, or earlier when a new packet needs its
+ * slot or the total size of incomplete packets exceeds frag.mem_max. Then
+ * the oldest entry is evicted.
+ */
+
+enum {
+	PL_FRAG_TRAILER   = 8,
+	/** Fragment offsets and lengths are multiple of this. */
+	PL_FRAG_UNIT      = 8,
+	PL_FRAG_MTU       = 1500,
+	PL_FRAG_MTU_MIN   = 64,
+	PL_FRAG_SIZE_MAX  = 65535,
+	PL_FRAG_UNITS     = (PL_FRAG_SIZE_MAX + PL_FRAG_UNIT - 1) / PL_FRAG_UNIT,
+	PL_FRAG_SLOTS     = 64,
+	PL_FRAG_SLOTS_MAX = 4096,
+	/** Reassembly timeout in ms. */
+	PL_FRAG_TIMEOUT   = 1000,
+	PL_FRAG_MEM_MAX   = 4 * 1024 * 1024,
+};
+
+struct pl_frag_slot {
+	/** Packet being reassembled, NULL if the slot is free. */
+	struct pppoat_packet *fs_pkt;
+	uint32_t              fs_id;
+	size_t                fs_total;
+	/** Number of received units. */
+	size_t                fs_units;
+	uint64_t              fs_deadline;
+	unsigned char         fs_map[(PL_FRAG_UNITS + 7) / 8];
+};
+
+struct pl_frag_ctx {
+	/** May change at runtime, see pl_frag_mtu_set(). */
+	size_t               fc_mtu;
+	struct pl_frag_slot *fc_slots;
+	unsigned             fc_slots_nr;
+	uint64_t             fc_timeout;
+	/** Total size of packets being reassembled. */
+	size_t               fc_mem;
+	size_t               fc_mem_max;
+	/** Protects the reassembly table. */
+	struct pppoat_mutex  fc_rx_lock;
+	uint32_t             fc_tx_id;
+	/** Fragments waiting for the pipeline, protected by fc_tx_lock. */
+	struct pppoat_list   fc_txq;
+	struct pppoat_mutex  fc_tx_lock;
+};
+
+static struct pppoat_list_descr pl_frag_txq_descr =
+	PPPOAT_LIST_DESCR("Fragments queue", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_MODULE_PL_FRAG_TXQ_MAGIC);
+
+static bool pl_frag_ctx_invariant(struct pl_frag_ctx *ctx)
+{
+	return ctx != NULL && ctx->fc_mtu >= PL_FRAG_MTU_MIN &&
+	       ctx->fc_mtu <= PL_FRAG_SIZE_MAX;
+}
+
+/** Payload size of every fragment except the last one. */
+static size_t pl_frag_chunk(size_t mtu)
+{
+	return (mtu - PL_FRAG_TRAILER) / PL_FRAG_UNIT * PL_FRAG_UNIT;
+}
+
+static uint64_t pl_frag_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int pl_frag_conf_parse(struct pl_frag_ctx *ctx, struct pppoat_conf *conf)
+{
+	long val;
+	int  rc;
+
+	ctx->fc_mtu      = PL_FRAG_MTU;
+	ctx->fc_slots_nr = PL_FRAG_SLOTS;
+	ctx->fc_timeout  = PL_FRAG_TIMEOUT;
+	ctx->fc_mem_max  = PL_FRAG_MEM_MAX;
+
+	rc = pppoat_conf_find_long(conf, FRAG_CONF_MTU, &val);
+	if (rc == 0) {
+		if (val < PL_FRAG_MTU_MIN || val > PL_FRAG_SIZE_MAX) {
+			pppoat_error("frag", "MTU must be in range %d..%d.",
+				     PL_FRAG_MTU_MIN, PL_FRAG_SIZE_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_mtu = (size_t)val;
+	}
+	rc = pppoat_conf_find_long(conf, FRAG_CONF_SLOTS, &val);
+	if (rc == 0) {
+		if (val < 1 || val > PL_FRAG_SLOTS_MAX) {
+			pppoat_error("frag", "Number of slots must be in range "
+				     "1..%d.", PL_FRAG_SLOTS_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_slots_nr = (unsigned)val;
+	}
+	rc = pppoat_conf_find_long(conf, FRAG_CONF_TIMEOUT, &val);
+	if (rc == 0) {
+		if (val < 1) {
+			pppoat_error("frag", "Invalid timeout %ld.", val);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_timeout = (uint64_t)val;
+	}
+	rc = pppoat_conf_find_long(conf, FRAG_CONF_MEM_MAX, &val);
+	if (rc == 0) {
+		if (val < PL_FRAG_SIZE_MAX) {
+			pppoat_error("frag", "Memory limit must be at least %d.",
+				     PL_FRAG_SIZE_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->fc_mem_max = (size_t)val;
+	}
+	return 0;
+}
+
+static int pl_frag_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+{
+	struct pl_frag_ctx *ctx;
+	int                 rc;
+
+	ctx = pppoat_alloc(sizeof *ctx);
+	if (ctx == NULL)
+		return P_ERR(-ENOMEM);
+	rc = pl_frag_conf_parse(ctx, conf);
+	if (rc != 0)
+		goto err_free;
+	ctx->fc_slots = pppoat_calloc(ctx->fc_slots_nr, sizeof *ctx->fc_slots);
+	if (ctx->fc_slots == NULL) {
+		rc = P_ERR(-ENOMEM);
+		goto err_free;
+	}
+	ctx->fc_mem   = 0;
+	ctx->fc_tx_id = (uint32_t)pl_frag_now();
+	pppoat_mutex_init(&ctx->fc_rx_lock);
+	pppoat_mutex_init(&ctx->fc_tx_lock);
+	pppoat_list_init(&ctx->fc_txq, &pl_frag_txq_descr);
+
+	mod->m_userdata = ctx;
+
+	return 0;
+
+err_free:
+	pppoat_free(ctx);
+	return rc;
+}
+
+static void pl_frag_fini(struct pppoat_module *mod)
+{
+	struct pl_frag_ctx   *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
+	unsigned              i;
+
+	PPPOAT_ASSERT(pl_frag_ctx_invariant(ctx));
+
+	while ((pkt = pppoat_list_dequeue(&ctx->fc_txq)) != NULL)
+		pppoat_packet_put(mod->m_pkts, pkt);
+	for (i = 0; i < ctx->fc_slots_nr; ++i)
+		if (ctx->fc_slots[i].fs_pkt != NULL)
+			pppoat_packet_put(mod->m_pkts, ctx->fc_slots[i].fs_pkt);
+	pppoat_list_fini(&ctx->fc_txq);
+	pppoat_mutex_fini(&ctx->fc_tx_lock);
+	pppoat_mutex_fini(&ctx->fc_rx_lock);
+	pppoat_free(ctx->fc_slots);
+	pppoat_free(ctx);
+}
+
+static int pl_frag_run(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static int pl_frag_stop(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static void pl_frag_trailer_put(unsigned char *buf,
+				uint32_t       id,
+				size_t         off,
+				size_t         total)
+{
+	buf[0] = (unsigned char)(id >> 24);
+	buf[1] = (unsigned char)(id >> 16);
+	buf[2] = (unsigned char)(id >> 8);
+	buf[3] = (unsigned char)id;
+	buf[4] = (unsigned char)(off >> 8);
+	buf[5] = (unsigned char)off;
+	buf[6] = (unsigned char)(total >> 8);
+	buf[7] = (unsigned char)total;
+}
+
+static void pl_frag_trailer_get(const unsigned char *buf,
+				uint32_t            *id,
+				size_t              *off,
+				size_t              *total)
+{
+	*id    = (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+		 (uint32_t)buf[2] << 8 | buf[3];
+	*off   = (size_t)buf[4] << 8 | buf[5];
+	*total = (size_t)buf[6] << 8 | buf[7];
+}
+
+static uint32_t pl_frag_id_next(struct pl_frag_ctx *ctx)
+{
+	uint32_t id;
+
+	pppoat_mutex_lock(&ctx->fc_tx_lock);
+	id = ctx->fc_tx_id++;
+	pppoat_mutex_unlock(&ctx->fc_tx_lock);
+
+	return id;
+}
+
+/**
+ * Splits the packet into fragments. The first fragment is returned in
+ * `next' and the rest are queued. The original packet is released.
+ */
+static int pl_frag_split(struct pppoat_module  *mod,
+			 struct pppoat_packet  *pkt,
+			 size_t                 chunk,
+			 struct pppoat_packet **next)
+{
+	struct pl_frag_ctx   *ctx = mod->m_userdata;
+	struct pppoat_list    frags;
+	struct pppoat_packet *frag;
+	unsigned char        *data = pkt->pkt_data;
+	uint32_t              id;
+	size_t                off;
+	size_t                len;
+	int                   rc = 0;
+
+	id = pl_frag_id_next(ctx);
+	pppoat_list_init(&frags, &pl_frag_txq_descr);
+	for (off = 0; rc == 0 && off < pkt->pkt_size; off += len) {
+		len  = pppoat_min(chunk, pkt->pkt_size - off);
+		frag = pppoat_packet_get(mod->m_pkts, len + PL_FRAG_TRAILER);
+		if (frag == NULL) {
+			rc = P_ERR(-ENOMEM);
+			break;
+		}
+		memcpy(frag->pkt_data, data + off, len);
+		pl_frag_trailer_put((unsigned char *)frag->pkt_data + len, id,
+				    off, pkt->pkt_size);
+		frag->pkt_size = len + PL_FRAG_TRAILER;
+		frag->pkt_type = PPPOAT_PACKET_SEND;
+		pppoat_list_enqueue(&frags, frag);
+	}
+	if (rc != 0) {
+		while ((frag = pppoat_list_dequeue(&frags)) != NULL)
+			pppoat_packet_put(mod->m_pkts, frag);
+		pppoat_list_fini(&frags);
+		return rc;
+	}
+
+	*next = pppoat_list_dequeue(&frags);
+	pppoat_mutex_lock(&ctx->fc_tx_lock);
+	while ((frag = pppoat_list_dequeue(&frags)) != NULL)
+		pppoat_list_enqueue(&ctx->fc_txq, frag);
+	pppoat_mutex_unlock(&ctx->fc_tx_lock);
+	pppoat_list_fini(&frags);
+	pppoat_packet_put(mod->m_pkts, pkt);
+
+	return 0;
+}
+
+static int pl_frag_send(struct pppoat_module  *mod,
+			struct pppoat_packet  *pkt,
+			struct pppoat_packet **next)
+{
+	struct pl_frag_ctx *ctx = mod->m_userdata;
+	size_t              size = pkt->pkt_size;
+	size_t              mtu  = ctx->fc_mtu;
+	int                 rc;
+
+	if (size > PL_FRAG_SIZE_MAX) {
+		pppoat_debug("frag", "Dropping too big packet (%zu bytes)",
+			     size);
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	if (size + PL_FRAG_TRAILER > mtu)
+		return pl_frag_split(mod, pkt, pl_frag_chunk(mtu), next);
+
+	rc = pppoat_packet_reserve(mod->m_pkts, pkt, size + PL_FRAG_TRAILER);
+	if (rc != 0)
+		return rc;
+	pl_frag_trailer_put((unsigned char *)pkt->pkt_data + size,
+			    pl_frag_id_next(ctx), 0, size);
+	pkt->pkt_size = size + PL_FRAG_TRAILER;
+	*next = pkt;
+
+	return 0;
+}
+
+static void pl_frag_slot_free(struct pppoat_module *mod,
+			      struct pl_frag_slot  *slot)
+{
+	struct pl_frag_ctx *ctx = mod->m_userdata;
+
+	if (slot->fs_pkt != NULL)
+		pppoat_packet_put(mod->m_pkts, slot->fs_pkt);
+	ctx->fc_mem -= slot->fs_total;
+	slot->fs_pkt   = NULL;
+	slot->fs_total = 0;
+}
+
+/**
+ * Finds the reassembly slot of a packet or allocates a new one. Expired
+ * slots are released on the way.
+ *
+ * @return Slot or NULL if memory limit doesn't allow the packet.
+ */
+static struct pl_frag_slot *pl_frag_slot_get(struct pppoat_module *mod,
+					     uint32_t              id,
+					     size_t                total)
+{
+	struct pl_frag_ctx  *ctx = mod->m_userdata;
+	struct pl_frag_slot *slot;
+	struct pl_frag_slot *free_slot = NULL;
+	struct pl_frag_slot *oldest;
+	uint64_t             now = pl_frag_now();
+	unsigned             i;
+
+	for (i = 0; i < ctx->fc_slots_nr; ++i) {
+		slot = &ctx->fc_slots[i];
+		if (slot->fs_pkt != NULL && slot->fs_deadline <= now) {
+			pppoat_debug("frag", "Reassembly of packet %u timed out",
+				     slot->fs_id);
+			pl_frag_slot_free(mod, slot);
+		}
+		if (slot->fs_pkt != NULL && slot->fs_id == id &&
+		    slot->fs_total == total)
+			return slot;
+		if (slot->fs_pkt == NULL && free_slot == NULL)
+			free_slot = slot;
+	}
+
+	while (free_slot == NULL || ctx->fc_mem + total > ctx->fc_mem_max) {
+		oldest = NULL;
+		for (i = 0; i < ctx->fc_slots_nr; ++i) {
+			slot = &ctx->fc_slots[i];
+			if (slot->fs_pkt != NULL && (oldest == NULL ||
+			    slot->fs_deadline < oldest->fs_deadline))
+				oldest = slot;
+		}
+		if (oldest == NULL)
+			return NULL;
+		pppoat_debug("frag", "Evicting incomplete packet %u",
+			     oldest->fs_id);
+		pl_frag_slot_free(mod, oldest);
+		free_slot = free_slot ?: oldest;
+	}
+
+	free_slot->fs_pkt = pppoat_packet_get(mod->m_pkts, total);
+	if (free_slot->fs_pkt == NULL)
+		return NULL;
+	free_slot->fs_id       = id;
+	free_slot->fs_total    = total;
+	free_slot->fs_units    = 0;
+	free_slot->fs_deadline = now + ctx->fc_timeout;
+	memset(free_slot->fs_map, 0, sizeof free_slot->fs_map);
+	ctx->fc_mem += total;
+
+	return free_slot;
+}
+
+/**
+ * Copies the fragment to its slot.
+ *
+ * @return Reassembled packet or NULL.
+ */
+static struct pppoat_packet *pl_frag_reassemble(struct pppoat_module *mod,
+						struct pppoat_packet *frag,
+						uint32_t              id,
+						size_t                off,
+						size_t                total)
+{
+	struct pl_frag_ctx   *ctx = mod->m_userdata;
+	struct pl_frag_slot  *slot;
+	struct pppoat_packet *pkt = NULL;
+	size_t                unit;
+	size_t                end;
+
+	pppoat_mutex_lock(&ctx->fc_rx_lock);
+	slot = pl_frag_slot_get(mod, id, total);
+	if (slot != NULL) {
+		memcpy((char *)slot->fs_pkt->pkt_data + off, frag->pkt_data,
+		       frag->pkt_size);
+		end = (off + frag->pkt_size + PL_FRAG_UNIT - 1) / PL_FRAG_UNIT;
+		for (unit = off / PL_FRAG_UNIT; unit < end; ++unit) {
+			if ((slot->fs_map[unit / 8] & (1U << unit % 8)) == 0) {
+				slot->fs_map[unit / 8] |= 1U << unit % 8;
+				++slot->fs_units;
+			}
+		}
+		if (slot->fs_units * PL_FRAG_UNIT >= total) {
+			pkt = slot->fs_pkt;
+			slot->fs_pkt = NULL;
+			pl_frag_slot_free(mod, slot);
+		}
+	}
+	pppoat_mutex_unlock(&ctx->fc_rx_lock);
+
+	if (slot == NULL)
+		pppoat_debug("frag", "No memory for reassembly of packet %u",
+			     id);
+	if (pkt != NULL) {
+		pkt->pkt_size = total;
+		pkt->pkt_type = PPPOAT_PACKET_RECV;
+	}
+	return pkt;
+}
+
+static int pl_frag_recv(struct pppoat_module  *mod,
+			struct pppoat_packet  *pkt,
+			struct pppoat_packet **next)
+{
+	uint32_t id;
+	size_t   off;
+	size_t   total;
+	size_t   len;
+
+	if (pkt->pkt_size < PL_FRAG_TRAILER) {
+		pppoat_debug("frag", "Dropping packet without trailer");
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	len = pkt->pkt_size - PL_FRAG_TRAILER;
+	pl_frag_trailer_get((unsigned char *)pkt->pkt_data + len, &id, &off,
+			    &total);
+	pkt->pkt_size = len;
+
+	if (off == 0 && len == total) {
+		*next = pkt;
+		return 0;
+	}
+	if (len == 0 || off + len > total || off % PL_FRAG_UNIT != 0 ||
+	    (off + len < total && len % PL_FRAG_UNIT != 0)) {
+		pppoat_debug("frag", "Dropping malformed fragment");
+		pppoat_packet_put(mod->m_pkts, pkt);
+		return 0;
+	}
+	*next = pl_frag_reassemble(mod, pkt, id, off, total);
+	pppoat_packet_put(mod->m_pkts, pkt);
+
+	return 0;
+}
+
+static int pl_frag_process(struct pppoat_module  *mod,
+			   struct pppoat_packet  *pkt,
+			   struct pppoat_packet **next)
+{
+	struct pl_frag_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(pl_frag_ctx_invariant(ctx));
+
+	*next = NULL;
+	if (pkt == NULL) {
+		pppoat_mutex_lock(&ctx->fc_tx_lock);
+		*next = pppoat_list_dequeue(&ctx->fc_txq);
+		pppoat_mutex_unlock(&ctx->fc_tx_lock);
+		return 0;
+	}
+	return pkt->pkt_type == PPPOAT_PACKET_SEND ?
+	       pl_frag_send(mod, pkt, next) : pl_frag_recv(mod, pkt, next);
+}
+
+static size_t pl_frag_mtu(struct pppoat_module *mod)
+{
+	return PL_FRAG_SIZE_MAX;
+}
+
+/**
+ * Transport's MTU has changed, e.g. due to path MTU discovery. Fragment
+ * size follows it and the interface keeps its MTU.
+ */
+static size_t pl_frag_mtu_set(struct pppoat_module *mod, size_t mtu)
+{
+	struct pl_frag_ctx *ctx = mod->m_userdata;
+
+	mtu = pppoat_max(mtu, (size_t)PL_FRAG_MTU_MIN);
+	mtu = pppoat_min(mtu, (size_t)PL_FRAG_SIZE_MAX);
+	pppoat_debug("frag", "Fragment size %zu -> %zu", ctx->fc_mtu, mtu);
+	ctx->fc_mtu = mtu;
+
+	return 0;
+}
+
+static struct pppoat_module_ops pl_frag_ops = {
+	.mop_init    = &pl_frag_init,
+	.mop_fini    = &pl_frag_fini,
+	.mop_run     = &pl_frag_run,
+	.mop_stop    = &pl_frag_stop,
+	.mop_process = &pl_frag_process,
+	.mop_mtu     = &pl_frag_mtu,
+	.mop_mtu_set = &pl_frag_mtu_set,
+};
+
+struct pppoat_module_impl pppoat_module_pl_frag = {
+	.mod_name  = "frag",
+	.mod_descr = "Fragmentation and reassembly of large packets",
+	.mod_type  = PPPOAT_MODULE_PLUGIN,
+	.mod_ops   = &pl_frag_ops,
+	.mod_props = 0,
+};
@@ -21,17 +21,21 @@
 
 #include "base64.h"
 #include "conf.h"
+#include "http.h"
 #include "io.h"
 #include "memory.h"
 #include "misc.h"
 #include "module.h"
 #include "packet.h"
 #include "queue.h"
+#include "rtt.h"
 #include "sem.h"
 #include "thread.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdlib.h>	/* strtoull */
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -41,12 +45,26 @@
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <time.h>	/* clock_gettime */
 #include <unistd.h>
 
 #define HTTP_CONF_PORT "http.port"
 #define HTTP_CONF_REMOTE "http.remote"
 #define HTTP_CONF_SERVER "server"
 #define HTTP_CONF_SIDE_CHANNEL "http.side_channel"
+#define HTTP_CONF_PROBE "http.probe"
+
+/*
+ * With http.probe in the normal mode, every message with data carries its
+ * send time in X-Ts header and the peer copies it to X-Ts-Echo header of
+ * the immediate answer. So RTT is measured on the traffic without extra
+ * messages. Both peers must enable the option, because the header makes
+ * a message with full-sized packet longer than the old message buffer.
+ */
+#define HTTP_TS_NAME "X-Ts"
+#define HTTP_TS_ECHO_NAME "X-Ts-Echo"
+#define HTTP_TS HTTP_TS_NAME ": "
+#define HTTP_TS_ECHO HTTP_TS_ECHO_NAME ": "
 
 #define HTTP_SERVER_MAX_DATA 16
 #define HTTP_CLIENT_MAX_DATA 16
@@ -63,10 +81,29 @@ enum {
 	TP_HTTP_MTU = 1500,
 	TP_HTTP_BACKLOG = 5,
 	TP_HTTP_CONN_MAX = 2,
+	/* Message with base64 encoded MTU and headers. */
+	TP_HTTP_MSG_MAX = 2048 + 64,
+	/* Receive ring of a connection. */
+	TP_HTTP_RING = 16384,
+	/* Largest packet announced by the side channel. */
+	TP_HTTP_SC_PKT_MAX = 65535,
 };
 
 #define HTTP_MIN(x, y) ((x) < (y) ? (x) : (y))
 
+struct tp_http_ctx;
+
+/* Incoming stream of a TCP connection and the message being parsed. */
+struct tp_http_conn {
+	struct tp_http_ctx       *hcn_ctx;
+	struct pppoat_http_parser hcn_parser;
+	/* X-Ts and X-Ts-Echo of the message, 0 if none. */
+	uint64_t                  hcn_ts;
+	uint64_t                  hcn_ts_echo;
+	/* The side channel message carries data. */
+	bool                      hcn_sc_data;
+};
+
 struct tp_http_ctx {
 	struct pppoat_module    *thc_module;
 	struct pppoat_thread     thc_thread;
@@ -75,9 +112,11 @@ struct tp_http_ctx {
 	char                    *thc_remote_ip;
 	int                      thc_sock;
 	int                      thc_conn[TP_HTTP_CONN_MAX];
+	struct tp_http_conn      thc_http[TP_HTTP_CONN_MAX];
 	int                      thc_pipe[2];
 	bool                     thc_is_server;
 	bool                     thc_is_side_channel;
+	bool                     thc_probe;
 	bool                     thc_send_ready;
 	/*
 	 * Side channel specific fields to split a packet into multiple
@@ -87,8 +126,35 @@ struct tp_http_ctx {
 	unsigned                 thc_recv_size;
 	unsigned                 thc_recv_offset;
 	unsigned                 thc_send_offset;
+	/* X-Ts of the last data message to echo, 0 if none. */
+	uint64_t                 thc_echo_ts;
+	struct pppoat_rtt        thc_rtt;
 };
 
+static uint64_t tp_http_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Returns value of the header or 0 if the line isn't the header. */
+static uint64_t tp_http_ts_find(const char *line, size_t len,
+				const char *name)
+{
+	const char *value;
+	size_t      vlen;
+	char        buf[24];
+
+	if (!pppoat_http_header_value(line, len, name, &value, &vlen) ||
+	    vlen >= sizeof(buf))
+		return 0;
+	memcpy(buf, value, vlen);
+	buf[vlen] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
 static int tp_http_listen(struct tp_http_ctx *ctx)
 {
 	int fd;
@@ -194,145 +260,170 @@ static int tp_http_connect(struct tp_http_ctx *ctx)
 	return rc;
 }
 
-static bool tp_http_recv_buf_normal(struct tp_http_ctx *ctx, uint8_t *buf, ssize_t len)
+static void tp_http_line_normal(void *arg, const char *line, size_t len)
 {
-	struct pppoat_packet *pkt;
-	char                 *msg;
-	char                 *body;
-	char                 *field;
-	size_t                body_len;
-	size_t                dec_len;
-	bool                  is_data_present;
-	int                   rc;
-
-	msg = pppoat_alloc(len + 1);
-	PPPOAT_ASSERT(msg != NULL);
-	memcpy(msg, buf, len);
-	msg[len] = '\0';
+	struct tp_http_conn *conn = arg;
 
-	body = strstr(msg, "\r\n\r\n");
-	if (body == NULL) {
-		pppoat_free(msg);
-		return false;
-	}
+	conn->hcn_ts = conn->hcn_ts ?: tp_http_ts_find(line, len, HTTP_TS_NAME);
+	conn->hcn_ts_echo = conn->hcn_ts_echo ?:
+			    tp_http_ts_find(line, len, HTTP_TS_ECHO_NAME);
+}
 
-	field = strstr(msg, "Content-Length:");
-	is_data_present = field != NULL && (uintptr_t)field < (uintptr_t)body;
-	if (is_data_present) {
-		body += 4; /* Skip \r\n\r\n */
-		body_len = strlen(body);
-		PPPOAT_ASSERT(pppoat_base64_is_valid(body, body_len));
-		pppoat_debug("RECV", "%s", body);
+/* Returns true if the message carries data. */
+static bool tp_http_recv_normal(struct tp_http_ctx   *ctx,
+				struct tp_http_conn  *conn,
+				struct pppoat_packet *pkt)
+{
+	uint64_t now;
 
-		dec_len = pppoat_base64_dec_len(body, body_len);
-		pkt = pppoat_packet_get(ctx->thc_module->m_pkts, dec_len);
-		pkt->pkt_size = dec_len;
-		rc = pppoat_base64_dec(body, body_len, pkt->pkt_data, dec_len);
-		PPPOAT_ASSERT(rc == 0); /* XXX */
+	now = tp_http_now();
+	if (conn->hcn_ts_echo != 0 && conn->hcn_ts_echo <= now)
+		pppoat_rtt_sample(&ctx->thc_rtt, now - conn->hcn_ts_echo);
 
+	if (pkt != NULL) {
 		pppoat_queue_enqueue(&ctx->thc_recv_q, pkt);
+		ctx->thc_echo_ts = conn->hcn_ts;
 	}
+	conn->hcn_ts      = 0;
+	conn->hcn_ts_echo = 0;
+
+	return pkt != NULL;
+}
+
+#define HTTP_CLIENT_SIZE "GET /index.php?s="
+#define HTTP_SET_COOKIE "Set-Cookie: "
+#define HTTP_AUTH "Authorization: "
 
-	pppoat_free(msg);
-	return is_data_present;
+/* Finds value of a "name=value;" field in the line. */
+static bool tp_http_sc_field(const char  *line,
+			     size_t       len,
+			     const char  *name,
+			     const char **value,
+			     size_t      *value_len)
+{
+	size_t nlen = strlen(name);
+	size_t i;
+	size_t j;
+
+	for (i = 0; i + nlen <= len; ++i) {
+		if (memcmp(line + i, name, nlen) != 0)
+			continue;
+		for (j = i + nlen; j < len && line[j] != ';'; ++j)
+			;
+		*value     = line + i + nlen;
+		*value_len = j - i - nlen;
+		return true;
+	}
+	return false;
 }
 
-static bool tp_http_recv_buf_sc(struct tp_http_ctx *ctx, uint8_t *buf, ssize_t len)
+/* Starts a new packet of the size from a base64 encoded header. */
+static void tp_http_sc_start(struct tp_http_ctx *ctx,
+			     const char         *b64,
+			     size_t              len)
 {
 	struct pppoat_packet *pkt;
-	char                 *msg;
-	char                 *body;
-	char                 *ptr;
-	unsigned              size = 0;
 	uint32_t              be;
+	size_t                size;
 	int                   rc;
 
-	/* Side channel version of the recv_buf. */
-
-	msg = pppoat_alloc(len + 1);
-	PPPOAT_ASSERT(msg != NULL);
-	memcpy(msg, buf, len);
-	msg[len] = '\0';
+	if (!pppoat_base64_is_valid(b64, len) ||
+	    pppoat_base64_dec_len(b64, len) != sizeof(be))
+		goto err;
+	rc = pppoat_base64_dec(b64, len, &be, sizeof(be));
+	size = ntohl(be);
+	if (rc != 0 || size == 0 || size > TP_HTTP_SC_PKT_MAX)
+		goto err;
 
-	body = strstr(msg, "\r\n\r\n");
-	if (body == NULL) {
-		pppoat_free(msg);
-		return false;
+	pkt = pppoat_packet_get(ctx->thc_module->m_pkts, size);
+	if (pkt == NULL) {
+		pppoat_error("http", "Couldn't allocate packet.");
+		return;
 	}
+	if (ctx->thc_recv_pkt != NULL) {
+		pppoat_debug("http", "Dropping incomplete packet.");
+		pppoat_packet_put(ctx->thc_module->m_pkts, ctx->thc_recv_pkt);
+	}
+	ctx->thc_recv_pkt    = pkt;
+	ctx->thc_recv_offset = 0;
+	return;
+err:
+	pppoat_debug("http", "Invalid packet size.");
+}
 
-#define HTTP_CLIENT_SIZE "GET /index.php?s="
-#define HTTP_SET_COOKIE "Set-Cookie: "
-#define HTTP_AUTH "Authorization: "
+/* Appends base64 encoded chunk to the current packet. */
+static void tp_http_sc_data(struct tp_http_conn *conn,
+			    const char          *b64,
+			    size_t               len)
+{
+	struct tp_http_ctx   *ctx = conn->hcn_ctx;
+	struct pppoat_packet *pkt = ctx->thc_recv_pkt;
+	size_t                size;
+	int                   rc;
 
-	pkt = ctx->thc_recv_pkt;
-
-	ptr = msg;
-	while (ptr != NULL && ptr < body) {
-		if (strncmp(ptr, HTTP_CLIENT_SIZE, strlen(HTTP_CLIENT_SIZE)) == 0) {
-			char *start = strstr(ptr, "?s=");
-			char *end = start ? strstr(start, " ") : NULL;
-			PPPOAT_ASSERT(ctx->thc_recv_pkt == NULL);
-			start += 3;
-			rc = pppoat_base64_dec(start, end - start, &be, sizeof(be));
-			PPPOAT_ASSERT(rc == 0);
-			size = ntohl(be);
-			pkt = pppoat_packet_get(ctx->thc_module->m_pkts, size);
-			pkt->pkt_size = size;
-			size = 0;
-			ctx->thc_recv_offset = 0;
-		} else if (strncmp(ptr, HTTP_SET_COOKIE, strlen(HTTP_SET_COOKIE)) == 0) {
-			char *start = strstr(ptr, " H=");
-			char *end = strstr(ptr, "\r\n");
-			if (start != NULL && end != NULL && start < end) {
-				start += 3;
-				rc = pppoat_base64_dec(start, strstr(start, ";") - start, &be, sizeof(be));
-				PPPOAT_ASSERT(rc == 0);
-				size = ntohl(be);
-				pkt = pppoat_packet_get(ctx->thc_module->m_pkts, size);
-				pkt->pkt_size = size;
-				size = 0;
-				ctx->thc_recv_offset = 0;
-			}
-			start = strstr(ptr, " ID=");
-			if (start != NULL && end != NULL && start < end) {
-				unsigned char *res;
-				size_t         res_len;
-				PPPOAT_ASSERT(pkt != NULL);
-				start += 4;
-				rc = pppoat_base64_dec_new(start, strstr(start, ";") - start, &res, &res_len);
-				PPPOAT_ASSERT(rc == 0);
-				size = res_len;
-				memcpy(pkt->pkt_data + ctx->thc_recv_offset, res, size);
-				pppoat_free(res);
-			}
-		} else if (strncmp(ptr, HTTP_AUTH, strlen(HTTP_AUTH)) == 0) {
-			char          *start = ptr + strlen(HTTP_AUTH);
-			unsigned char *res;
-			size_t         res_len;
-			PPPOAT_ASSERT(pkt != NULL);
-			rc = pppoat_base64_dec_new(start, strstr(start, "\r\n") - start, &res, &res_len);
-			PPPOAT_ASSERT(rc == 0);
-			size = res_len;
-			memcpy(pkt->pkt_data + ctx->thc_recv_offset, res, size);
-			pppoat_free(res);
-		}
-		ptr = strstr(ptr, "\r\n");
-		if (ptr)
-			ptr += 2;
+	if (pkt == NULL || !pppoat_base64_is_valid(b64, len))
+		goto err;
+	size = pppoat_base64_dec_len(b64, len);
+	if (size > pkt->pkt_size - ctx->thc_recv_offset)
+		goto err;
+	rc = pppoat_base64_dec(b64, len,
+			       (char *)pkt->pkt_data + ctx->thc_recv_offset,
+			       size);
+	if (rc != 0)
+		goto err;
+	ctx->thc_recv_offset += size;
+	conn->hcn_sc_data = conn->hcn_sc_data || size != 0;
+	return;
+err:
+	pppoat_debug("http", "Invalid data chunk.");
+}
+
+static void tp_http_line_sc(void *arg, const char *line, size_t len)
+{
+	struct tp_http_conn *conn = arg;
+	struct tp_http_ctx  *ctx = conn->hcn_ctx;
+	const char          *value;
+	size_t               vlen;
+	size_t               i;
+
+	/* Side channel version of the line handler. */
+
+	if (len > strlen(HTTP_CLIENT_SIZE) &&
+	    memcmp(line, HTTP_CLIENT_SIZE, strlen(HTTP_CLIENT_SIZE)) == 0) {
+		value = line + strlen(HTTP_CLIENT_SIZE);
+		vlen  = len - strlen(HTTP_CLIENT_SIZE);
+		for (i = 0; i < vlen && value[i] != ' '; ++i)
+			;
+		tp_http_sc_start(ctx, value, i);
+	} else if (len > strlen(HTTP_SET_COOKIE) &&
+		   memcmp(line, HTTP_SET_COOKIE,
+			  strlen(HTTP_SET_COOKIE)) == 0) {
+		if (tp_http_sc_field(line, len, " H=", &value, &vlen))
+			tp_http_sc_start(ctx, value, vlen);
+		if (tp_http_sc_field(line, len, " ID=", &value, &vlen))
+			tp_http_sc_data(conn, value, vlen);
+	} else if (len > strlen(HTTP_AUTH) &&
+		   memcmp(line, HTTP_AUTH, strlen(HTTP_AUTH)) == 0) {
+		tp_http_sc_data(conn, line + strlen(HTTP_AUTH),
+				len - strlen(HTTP_AUTH));
 	}
+}
 
-	// TODO skip if pkt NULL
+/* Returns true if the message carries data. */
+static bool tp_http_recv_sc(struct tp_http_ctx  *ctx,
+			    struct tp_http_conn *conn)
+{
+	struct pppoat_packet *pkt = ctx->thc_recv_pkt;
+	bool                  is_data = conn->hcn_sc_data;
 
-	ctx->thc_recv_offset += size;
 	if (pkt != NULL && ctx->thc_recv_offset >= pkt->pkt_size) {
 		pppoat_queue_enqueue(&ctx->thc_recv_q, pkt);
-		pkt = NULL;
+		ctx->thc_recv_pkt    = NULL;
 		ctx->thc_recv_offset = 0;
 	}
-	ctx->thc_recv_pkt = pkt;
+	conn->hcn_sc_data = false;
 
-	pppoat_free(msg);
-	return size != 0;
+	return is_data;
 }
 
 static void tp_http_send_next_normal(struct tp_http_ctx *ctx, int fd)
@@ -340,7 +431,8 @@ static void tp_http_send_next_normal(struct tp_http_ctx *ctx, int fd)
 	struct pppoat_packet *pkt;
 	char                 *base64;
 	char                  number[24];
-	char                  buf[2048];
+	char                  ts[24];
+	char                  buf[TP_HTTP_MSG_MAX];
 	int                   rc;
 
 	pkt = pppoat_queue_dequeue(&ctx->thc_send_q);
@@ -352,12 +444,18 @@ static void tp_http_send_next_normal(struct tp_http_ctx *ctx, int fd)
 		pppoat_debug("SEND", "%s", base64);
 
 		snprintf(number, sizeof(number), "%zu", strlen(base64));
+		snprintf(ts, sizeof(ts), "%" PRIu64, tp_http_now());
 
 		buf[0] = '\0';
 		if (ctx->thc_is_server)
 			strcat(buf, "HTTP/1.1 200 OK\r\n");
 		else
 			strcat(buf, "POST / HTTP/1.1\r\n");
+		if (ctx->thc_probe) {
+			strcat(buf, HTTP_TS);
+			strcat(buf, ts);
+			strcat(buf, "\r\n");
+		}
 		strcat(buf, "Content-Length: ");
 		strcat(buf, number);
 		strcat(buf, "\r\n\r\n");
@@ -498,12 +596,15 @@ static void tp_http_send_next_sc(struct tp_http_ctx *ctx, int fd)
 	}
 }
 
-static bool tp_http_recv_buf(struct tp_http_ctx *ctx, uint8_t *buf, ssize_t len)
+static bool tp_http_recv_msg(struct tp_http_ctx   *ctx,
+			     struct tp_http_conn  *conn,
+			     struct pppoat_packet *pkt)
 {
+	/* The side channel skips the body, data is in the headers. */
 	if (ctx->thc_is_side_channel) {
-		return tp_http_recv_buf_sc(ctx, buf, len);
+		return tp_http_recv_sc(ctx, conn);
 	} else {
-		return tp_http_recv_buf_normal(ctx, buf, len);
+		return tp_http_recv_normal(ctx, conn, pkt);
 	}
 }
 
@@ -516,24 +617,44 @@ static void tp_http_send_next(struct tp_http_ctx *ctx, int fd)
 	}
 }
 
-static void tp_http_send_get(struct tp_http_ctx *ctx, int fd)
+/* Sends a message without data, it echoes X-Ts of a received message. */
+static void tp_http_send_empty(struct tp_http_ctx *ctx, int fd,
+			       const char *start)
 {
-	char buf[32];
+	char buf[80];
 	int rc;
 
-	snprintf(buf, sizeof(buf), "GET / HTTP/1.1\r\n\r\n");
+	if (ctx->thc_echo_ts != 0) {
+		snprintf(buf, sizeof(buf), "%s\r\n" HTTP_TS_ECHO "%" PRIu64
+			 "\r\n\r\n", start, ctx->thc_echo_ts);
+		ctx->thc_echo_ts = 0;
+	} else
+		snprintf(buf, sizeof(buf), "%s\r\n\r\n", start);
 	rc = pppoat_io_write_sync(fd, buf, strlen(buf));
 	PPPOAT_ASSERT(rc == 0);
 }
 
+static void tp_http_send_get(struct tp_http_ctx *ctx, int fd)
+{
+	tp_http_send_empty(ctx, fd, "GET / HTTP/1.1");
+}
+
 static void tp_http_send_resp(struct tp_http_ctx *ctx, int fd)
 {
-	char buf[32];
-	int rc;
+	tp_http_send_empty(ctx, fd, "HTTP/1.1 200 OK");
+}
 
-	snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n\r\n");
-	rc = pppoat_io_write_sync(fd, buf, strlen(buf));
-	PPPOAT_ASSERT(rc == 0);
+/* Every message is answered, with data if the message had none. */
+static void tp_http_reply(struct tp_http_ctx *ctx, int fd, bool is_data)
+{
+	if (!is_data) {
+		tp_http_send_next(ctx, fd);
+	} else {
+		if (ctx->thc_is_server)
+			tp_http_send_resp(ctx, fd);
+		else
+			tp_http_send_get(ctx, fd);
+	}
 }
 
 static void tp_http_worker(struct pppoat_thread *thread)
@@ -541,14 +662,15 @@ static void tp_http_worker(struct pppoat_thread *thread)
 	struct tp_http_ctx *ctx =
 			container_of(thread, struct tp_http_ctx, thc_thread);
 
-	struct pollfd fds[3];
-	nfds_t        nfds;
-	nfds_t        i;
-	ssize_t       rlen;
-	uint8_t       buf[2048];
-	int           ready;
-	bool          is_data;
-	bool          running = true;
+	struct tp_http_conn  *conn;
+	struct pppoat_packet *pkt;
+	struct pollfd         fds[3];
+	nfds_t                nfds;
+	nfds_t                i;
+	int                   ready;
+	int                   rc;
+	bool                  is_data;
+	bool                  running = true;
 
 	memset(fds, 0, sizeof(fds));
 	fds[0].fd = ctx->thc_conn[0];
@@ -578,21 +700,28 @@ static void tp_http_worker(struct pppoat_thread *thread)
 				break;
 			}
 
-			if (fds[i].revents & POLLIN) {
-				rlen = read(fds[i].fd, buf, sizeof(buf));
-				PPPOAT_ASSERT(rlen >= 0);
-				if (rlen == 0)
-					continue;
-				is_data = tp_http_recv_buf(ctx, buf, rlen);
-				if (!is_data) {
-					tp_http_send_next(ctx, fds[i].fd);
-				} else {
-					if (ctx->thc_is_server)
-						tp_http_send_resp(ctx, fds[i].fd);
-					else
-						tp_http_send_get(ctx, fds[i].fd);
-				}
+			if (!(fds[i].revents & POLLIN))
+				continue;
+
+			/* A read may hold part of a message or several. */
+			conn = &ctx->thc_http[i];
+			rc = pppoat_http_parser_read(&conn->hcn_parser,
+						     fds[i].fd);
+			while (rc == 0) {
+				rc = pppoat_http_parse(&conn->hcn_parser, &pkt);
+				if (rc != 0)
+					break;
+				is_data = tp_http_recv_msg(ctx, conn, pkt);
+				tp_http_reply(ctx, fds[i].fd, is_data);
 			}
+			if (rc == -ECONNRESET)
+				pppoat_debug("http", "Connection closed.");
+			else if (rc != -EAGAIN)
+				pppoat_error("http", "Broken stream (rc=%d).",
+					     rc);
+			/* Negative fd is ignored by poll(). */
+			if (rc != -EAGAIN)
+				fds[i].fd = -1;
 		}
 	}
 }
@@ -627,6 +756,7 @@ static int tp_http_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 	pppoat_conf_find_bool(conf, HTTP_CONF_SERVER, &ctx->thc_is_server);
 	pppoat_conf_find_bool(conf, HTTP_CONF_SIDE_CHANNEL,
 			      &ctx->thc_is_side_channel);
+	pppoat_conf_find_bool(conf, HTTP_CONF_PROBE, &ctx->thc_probe);
 
 	rc = pppoat_conf_find_string_alloc(conf, HTTP_CONF_REMOTE,
 					   &ctx->thc_remote_ip);
@@ -635,23 +765,52 @@ static int tp_http_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 	PPPOAT_ASSERT(ctx->thc_is_server || rc == 0); /* XXX */
 
 	rc = pppoat_queue_init(&ctx->thc_send_q);
-	PPPOAT_ASSERT(rc == 0); /* XXX */
+	if (rc != 0)
+		goto err_free;
 	rc = pppoat_queue_init(&ctx->thc_recv_q);
-	PPPOAT_ASSERT(rc == 0); /* XXX */
+	if (rc != 0)
+		goto err_send_q;
 	rc = pppoat_thread_init(&ctx->thc_thread, &tp_http_worker);
-	PPPOAT_ASSERT(rc == 0); /* XXX */
+	if (rc != 0)
+		goto err_recv_q;
+	for (i = 0; i < TP_HTTP_CONN_MAX; ++i) {
+		ctx->thc_http[i].hcn_ctx = ctx;
+		rc = pppoat_http_parser_init(&ctx->thc_http[i].hcn_parser,
+				mod->m_pkts, TP_HTTP_RING,
+				!ctx->thc_is_side_channel,
+				ctx->thc_is_side_channel ? &tp_http_line_sc :
+							   &tp_http_line_normal,
+				&ctx->thc_http[i]);
+		if (rc != 0)
+			goto err_parsers;
+	}
 
 	ctx->thc_send_ready = !ctx->thc_is_server;
+	pppoat_rtt_init(&ctx->thc_rtt);
 
 	mod->m_userdata = ctx;
 
 	return 0;
+
+err_parsers:
+	while (--i >= 0)
+		pppoat_http_parser_fini(&ctx->thc_http[i].hcn_parser);
+	pppoat_thread_fini(&ctx->thc_thread);
+err_recv_q:
+	pppoat_queue_fini(&ctx->thc_recv_q);
+err_send_q:
+	pppoat_queue_fini(&ctx->thc_send_q);
+err_free:
+	pppoat_free(ctx->thc_remote_ip);
+	pppoat_free(ctx);
+	return P_ERR(rc);
 }
 
 static void tp_http_fini(struct pppoat_module *mod)
 {
 	struct tp_http_ctx   *ctx = mod->m_userdata;
 	struct pppoat_packet *pkt;
+	int                   i;
 
 	while ((pkt = pppoat_queue_dequeue(&ctx->thc_recv_q)))
 		pppoat_packet_put(mod->m_pkts, pkt);
@@ -661,10 +820,13 @@ static void tp_http_fini(struct pppoat_module *mod)
 		pppoat_packet_put(mod->m_pkts, ctx->thc_recv_pkt);
 
 	pppoat_thread_fini(&ctx->thc_thread);
+	for (i = 0; i < TP_HTTP_CONN_MAX; ++i)
+		pppoat_http_parser_fini(&ctx->thc_http[i].hcn_parser);
 	/* TODO Flush queues. */
 	pppoat_queue_fini(&ctx->thc_recv_q);
 	pppoat_queue_fini(&ctx->thc_send_q);
 	pppoat_free(ctx->thc_remote_ip);
+	pppoat_rtt_fini(&ctx->thc_rtt);
 
 	pppoat_free(ctx);
 }
@@ -751,6 +913,21 @@ static size_t tp_http_mtu(struct pppoat_module *mod)
 	return TP_HTTP_MTU;
 }
 
+static void tp_http_stats(struct pppoat_module *mod)
+{
+	struct tp_http_ctx *ctx = mod->m_userdata;
+
+	if (ctx->thc_probe && !ctx->thc_is_side_channel)
+		pppoat_rtt_log(&ctx->thc_rtt, "http");
+}
+
+static int tp_http_rtt(struct pppoat_module *mod, struct pppoat_rtt_stats *stats)
+{
+	struct tp_http_ctx *ctx = mod->m_userdata;
+
+	return pppoat_rtt_get(&ctx->thc_rtt, stats);
+}
+
 static struct pppoat_module_ops tp_http_ops = {
 	.mop_init    = &tp_http_init,
 	.mop_fini    = &tp_http_fini,
@@ -758,6 +935,8 @@ static struct pppoat_module_ops tp_http_ops = {
 	.mop_stop    = &tp_http_stop,
 	.mop_process = &tp_http_process,
 	.mop_mtu     = &tp_http_mtu,
+	.mop_stats   = &tp_http_stats,
+	.mop_rtt     = &tp_http_rtt,
 };
 
 struct pppoat_module_impl pppoat_module_tp_http = {
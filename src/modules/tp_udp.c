@@ -17,53 +17,363 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
 #include "trace.h"
 
 #include "conf.h"
+#include "flow.h"
 #include "io.h"
+#include "list.h"
 #include "magic.h"
 #include "memory.h"
 #include "misc.h"
 #include "module.h"
+#include "mutex.h"
 #include "packet.h"
+#include "peers.h"
+#include "rtt.h"
+#include "siphash.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>	/* INT_MAX */
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>	/* strtol */
 #include <string.h>
+#include <time.h>	/* clock_gettime */
+#include <arpa/inet.h>	/* inet_pton */
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>	/* UDP_SEGMENT, UDP_GRO */
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>	/* iovec */
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/filter.h>	/* sock_fprog */
+#include <linux/net_tstamp.h>	/* SOF_TIMESTAMPING_* */
+#endif
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define TP_UDP_HAVE_MMSG 1
+#endif
+#if defined(TP_UDP_HAVE_MMSG) && defined(UDP_SEGMENT)
+#define TP_UDP_HAVE_GSO 1
+#endif
+#if defined(TP_UDP_HAVE_MMSG) && defined(UDP_GRO)
+#define TP_UDP_HAVE_GRO 1
+#endif
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(BPF_MOD)
+#define TP_UDP_HAVE_STEERING 1
+#endif
+#ifdef SO_RXQ_OVFL
+#define TP_UDP_HAVE_RXQ_OVFL 1
+#endif
+#if defined(SO_TIMESTAMPING) && defined(SCM_TIMESTAMPING) && \
+    defined(SOF_TIMESTAMPING_RX_SOFTWARE)
+#define TP_UDP_HAVE_TSTAMP 1
+#endif
+
 #define UDP_CONF_PORT  "udp.port"
 #define UDP_CONF_SPORT "udp.sport"
 #define UDP_CONF_DPORT "udp.dport"
 #define UDP_CONF_HOST  "udp.host"
+#define UDP_CONF_BATCH "udp.batch"
+#define UDP_CONF_GSO   "udp.gso"
+#define UDP_CONF_GRO   "udp.gro"
+#define UDP_CONF_SOCKETS      "udp.sockets"
+#define UDP_CONF_STEERING     "udp.steering"
+#define UDP_CONF_STEERING_OFF "udp.steering_offset"
+#define UDP_CONF_CONNECT      "udp.connect"
+#define UDP_CONF_SECRET       "udp.secret"
+#define UDP_CONF_SERVER       "udp.server"
+#define UDP_CONF_ROUTES       "udp.routes"
+#define UDP_CONF_IP_OFF       "udp.ip_offset"
+#define UDP_CONF_PEERS_MAX    "udp.peers_max"
+#define UDP_CONF_PMTUD        "udp.pmtud"
+#define UDP_CONF_PMTUD_MAX    "udp.pmtud_max"
+#define UDP_CONF_RCVBUF       "udp.rcvbuf"
+#define UDP_CONF_SNDBUF       "udp.sndbuf"
+#define UDP_CONF_BUSY_POLL    "udp.busy_poll"
+#define UDP_CONF_TOS          "udp.tos"
+#define UDP_CONF_DSCP         "udp.dscp"
+#define UDP_CONF_PRIORITY     "udp.priority"
+#define UDP_CONF_PROBE        "udp.probe"
+#define UDP_CONF_SPRAY        "udp.spray"
+
+/*
+ * High level design.
+ *
+ * Every packet travels in a single UDP datagram. A client sends to the
+ * configured peer, while with udp.server the module serves multiple peers
+ * on one port and routes packets by the inner destination address. Other
+ * options are optimisations and additional features, they're described
+ * next to their code: batching and offloads, receive sharding, flow
+ * spraying, udp.secret and roaming, path MTU discovery, path measurement
+ * and socket options.
+ */
+
+union tp_udp_cmsg {
+	/* UDP_GRO, SO_RXQ_OVFL and SCM_TIMESTAMPING. */
+	char           uc_buf[CMSG_SPACE(sizeof(int)) +
+			      CMSG_SPACE(sizeof(uint32_t)) +
+			      CMSG_SPACE(3 * sizeof(struct timespec))];
+	struct cmsghdr uc_align;
+};
+
+/**
+ * With udp.batch greater than 1, the module moves up to udp.batch
+ * datagrams per syscall with recvmmsg(2)/sendmmsg(2). Received datagrams
+ * are buffered and returned to the pipeline one by one.
+ */
+struct tp_udp_batch {
+	struct pppoat_packet **ub_pkts;
+	struct iovec          *ub_iov;
+	/** Source addresses of received datagrams in the server mode. */
+	struct sockaddr_storage *ub_addrs;
+	socklen_t             *ub_addrlens;
+#ifdef TP_UDP_HAVE_MMSG
+	struct mmsghdr        *ub_msgs;
+	union tp_udp_cmsg     *ub_cmsg;
+#endif
+	/** GRO segment size of every received buffer, 0 if not coalesced. */
+	size_t                *ub_segs;
+	/** Kernel receive time in us, 0 if unknown. */
+	uint64_t              *ub_tstamps;
+	/** Sending socket of every packet, see tp_udp_pkt_sock(). */
+	int                   *ub_socks;
+	/** Number of valid datagrams in the batch. */
+	unsigned               ub_nr;
+	/** Next datagram to return to the pipeline. */
+	unsigned               ub_pos;
+	/** Offset of the next segment within a coalesced buffer. */
+	size_t                 ub_off;
+};
+
+/**
+ * Receive socket and the thread which serves it. With udp.sockets=N, the
+ * module binds N sockets to the source port with SO_REUSEPORT and asks the
+ * pipeline for N workers, so decapsulation of inbound traffic is spread
+ * over multiple cores. Sending is done via the first socket and the
+ * outbound queue is flushed by the first worker only to keep datagrams in
+ * order.
+ *
+ * Receive sockets request SO_RXQ_OVFL, so every datagram carries the number
+ * of datagrams the kernel has dropped on the socket because its buffer was
+ * full. The counters are reported with the module statistics (SIGUSR1).
+ */
+struct tp_udp_worker {
+	int                   uw_sock;
+	bool                  uw_claimed;
+	struct tp_udp_batch   uw_rx;
+	/** Datagrams dropped by the kernel on the socket, see SO_RXQ_OVFL. */
+	uint32_t              uw_drops;
+};
+
+/**
+ * State of path MTU discovery, sizes are UDP payload sizes.
+ *
+ * With udp.pmtud, the module searches for the largest datagram which
+ * reaches the peer, in the spirit of DPLPMTUD (RFC 8899). Datagrams are
+ * sent with Don't Fragment bit and ICMP messages are ignored. Instead, the
+ * first worker sends probes padded to the tested size and the peer answers
+ * every probe with a small acknowledgement. Probes and acknowledgements
+ * are sealed with udp.secret like data and never enter the pipeline, so
+ * both peers must enable the option.
+ */
+struct tp_udp_pmtud {
+	/** Largest confirmed size. */
+	size_t              pm_lo;
+	/** Upper bound of the search. */
+	size_t              pm_hi;
+	size_t              pm_max;
+	/** Size being probed, 0 if there is no probe in flight. */
+	size_t              pm_probe;
+	unsigned            pm_probes_nr;
+	bool                pm_done;
+	/** Time of the next action in ms, see tp_udp_now(). */
+	uint64_t            pm_next;
+	uint64_t            pm_raise;
+	/** MTU reported to the pipeline. */
+	size_t              pm_mtu;
+	struct pppoat_mutex pm_lock;
+};
+
+/**
+ * State of the echo probes.
+ *
+ * With udp.probe=N, the first worker sends an echo request every N ms and
+ * the peer answers it immediately. Requests and replies are datagrams with
+ * the PMTUD magic, so both peers must enable the option. A request carries
+ * the send time t1, the reply adds the receive time t2 of the request and
+ * its own send time t3, the requester notes the receive time t4 of the
+ * reply. Receive times are software timestamps of the kernel
+ * (SO_TIMESTAMPING), so scheduling delay of the worker isn't measured, and
+ * RTT is (t4 - t1) - (t3 - t2). The difference t2 - t1 gives one-way delay
+ * for jitter and queueing estimates. A request without reply before the
+ * next one is counted as lost.
+ */
+struct tp_udp_probe {
+	/** Interval in ms, 0 if probing is disabled. */
+	unsigned            pr_ival;
+	/** Sequence number of the last request. */
+	uint32_t            pr_seq;
+	bool                pr_pending;
+	/** Time of the next request in ms, see tp_udp_now(). */
+	uint64_t            pr_next;
+	struct pppoat_rtt   pr_rtt;
+	struct pppoat_mutex pr_lock;
+};
 
 struct tp_udp_ctx {
 	struct addrinfo      *uc_ainfo;
+	/** Socket for sending, it's the socket of the first worker. */
 	int                   uc_sock;
 	char                 *uc_dhost;
 	unsigned short        uc_sport;
 	unsigned short        uc_dport;
+	unsigned              uc_batch;
+	bool                  uc_gso;
+	bool                  uc_gro;
+	/**
+	 * Batched mode is chosen by the configuration and doesn't change when
+	 * the kernel rejects an offload.
+	 */
+	bool                  uc_batched;
+	/** Size of the receive buffers, large enough for GRO if enabled. */
+	size_t                uc_rx_size;
+	struct tp_udp_worker *uc_workers;
+	unsigned              uc_workers_nr;
+	/** Protects claiming of uc_workers by threads. */
+	struct pppoat_mutex   uc_workers_lock;
+	/** Worker claimed by the calling thread. */
+	pthread_key_t         uc_worker_key;
+	bool                  uc_steering;
+	unsigned              uc_steering_off;
+	bool                  uc_connect;
+	/** Unconnected socket in the connected mode, -1 otherwise. */
+	int                   uc_lsock;
+	/** Datagrams dropped by the kernel on uc_lsock, see SO_RXQ_OVFL. */
+	uint32_t              uc_lsock_drops;
+	/** Number of source ports for flow spraying, 1 disables it. */
+	unsigned              uc_spray;
+	/** Sockets bound to uc_sport + i, the first one is uc_sock. */
+	int                  *uc_spray_socks;
+	/** Destination for sendto(2), NULL in the connected mode. */
+	struct sockaddr      *uc_daddr;
+	socklen_t             uc_daddrlen;
+	bool                  uc_auth;
+	struct pppoat_siphash_key uc_key;
+	/** Sequence number of the next sealed datagram. */
+	uint64_t              uc_tx_seq;
+	struct pppoat_mutex   uc_tx_seq_lock;
+	/** Random session number, see struct pppoat_peers. */
+	uint64_t              uc_session;
+	/** Replay window of the peer in the client mode. */
+	struct pppoat_replay  uc_replay;
+	struct pppoat_mutex   uc_replay_lock;
+	bool                  uc_server;
+	char                 *uc_routes;
+	unsigned              uc_ip_off;
+	/** Address family of the sockets in the server mode. */
+	int                   uc_family;
+	unsigned              uc_peers_max;
+	struct pppoat_peers   uc_peers;
+	bool                  uc_pmtud;
+	struct tp_udp_pmtud   uc_pm;
+	struct tp_udp_probe   uc_probe;
+	struct tp_udp_batch   uc_tx;
+	/** Outbound queue for the batched mode, protected by uc_txq_lock. */
+	struct pppoat_list    uc_txq;
+	unsigned              uc_txq_nr;
+	struct pppoat_mutex   uc_txq_lock;
+	/** Packets dropped because uc_txq was full. */
+	uint64_t              uc_txq_drops;
+	/** Pipe which wakes up the blocking thread to flush uc_txq. */
+	int                   uc_wake[2];
+	/** Socket options, -1 keeps the system default. */
+	int                   uc_rcvbuf;
+	int                   uc_sndbuf;
+	int                   uc_busy_poll;
+	int                   uc_tos;
+	int                   uc_priority;
 	uint32_t              uc_magic;
 };
 
 enum {
-	TP_UDP_MTU = 1500,
+	TP_UDP_MTU       = 1500,
+	/**
+	 * Receive buffers are larger than MTU, so a full-sized inner packet
+	 * with interface or plugin headers isn't truncated.
+	 */
+	TP_UDP_HEADROOM  = 64,
+	TP_UDP_BATCH_MAX = 64,
+	/** Outbound packets above this limit are dropped in batched mode. */
+	TP_UDP_TXQ_MAX   = 1024,
+	/** Maximum datagrams per GSO buffer, see UDP_MAX_SEGMENTS in Linux. */
+	TP_UDP_GSO_SEGS  = 64,
+	/** Maximum size of a GSO or GRO buffer. */
+	TP_UDP_GSO_SIZE  = 65507,
+	TP_UDP_SOCKETS_MAX = 64,
+	/** Offset of IPv4 source address after 4-byte packet information. */
+	TP_UDP_STEERING_OFF = 16,
+	/** Session, sequence number and tag. */
+	TP_UDP_AUTH_SIZE = 24,
+	/** Offset of IPv4 header after 4-byte packet information. */
+	TP_UDP_IP_OFF    = 4,
+	TP_UDP_PEERS_MAX = 65536,
+	TP_UDP_PEERS_MAX_LIMIT = 1 << 20,
+	TP_UDP_SPRAY_MAX = 256,
+	/** Sizes of PMTUD probes, see RFC 8899 for the base size. */
+	TP_UDP_PMTUD_BASE    = 1200,
+	TP_UDP_PMTUD_MAX     = 1472,
+	/** Magic, type, padding and size. */
+	TP_UDP_PMTUD_HDR     = 16,
+	TP_UDP_PMTUD_PROBES  = 3,
+	/** Timers of PMTUD in ms. */
+	TP_UDP_PMTUD_TIMEOUT = 1000,
+	TP_UDP_PMTUD_CONFIRM = 30 * 1000,
+	TP_UDP_PMTUD_RAISE   = 600 * 1000,
+};
+
+enum tp_udp_pmtud_type {
+	TP_UDP_PMTUD_PROBE = 1,
+	TP_UDP_PMTUD_ACK   = 2,
+	TP_UDP_ECHO_REQ    = 3,
+	TP_UDP_ECHO_REP    = 4,
+};
+
+enum {
+	/** Magic, type, padding, sequence number and times t1, t2, t3. */
+	TP_UDP_ECHO_SIZE  = 40,
+	TP_UDP_ECHO_PROBE_MAX = 60 * 1000,
 };
 
+/** First bytes of PMTUD and echo datagrams, "PPOATPMT". */
+#define TP_UDP_PMTUD_MAGIC 0x50504f4154504d54ULL
+
+static struct pppoat_list_descr tp_udp_txq_descr =
+	PPPOAT_LIST_DESCR("UDP send queue", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_MODULE_TP_UDP_TXQ_MAGIC);
+
 static bool tp_udp_ctx_invariant(struct tp_udp_ctx *ctx)
 {
 	return ctx != NULL;
 }
 
+static bool tp_udp_is_batched(struct tp_udp_ctx *ctx)
+{
+	return ctx->uc_batched;
+}
+
 static int tp_udp_ainfo_get(struct addrinfo **ainfo,
 			    const char       *host,
-			    unsigned short    port)
+			    unsigned short    port,
+			    int               family)
 {
 	struct addrinfo hints;
 	char            service[6];
@@ -77,8 +387,12 @@ static int tp_udp_ainfo_get(struct addrinfo **ainfo,
 #ifdef __APPLE__
 	hints.ai_family   = AF_INET;
 #else /* __APPLE__ */
-	hints.ai_family   = AF_UNSPEC;
+	hints.ai_family   = family;
 #endif /* __APPLE__ */
+#ifdef AI_V4MAPPED
+	if (family == AF_INET6)
+		hints.ai_flags |= AI_V4MAPPED;
+#endif /* AI_V4MAPPED */
 	hints.ai_protocol = IPPROTO_UDP;
 	hints.ai_socktype = SOCK_DGRAM;
 
@@ -95,20 +409,36 @@ static int tp_udp_ainfo_get(struct addrinfo **ainfo,
 
 static void tp_udp_ainfo_put(struct addrinfo *ainfo)
 {
-	freeaddrinfo(ainfo);
+	if (ainfo != NULL)
+		freeaddrinfo(ainfo);
+}
+
+static int tp_udp_sockopt_set(int sock, int level, int name, int val)
+{
+	int rc;
+
+	rc = setsockopt(sock, level, name, &val, sizeof val);
+	return rc != 0 ? P_ERR(-errno) : 0;
 }
 
-static int tp_udp_sock_new(unsigned short port, int *sock)
+static int tp_udp_sock_new(unsigned short port, bool reuseport, int *sock)
 {
 	struct addrinfo *ainfo;
 	int              rc;
 
-	rc = tp_udp_ainfo_get(&ainfo, NULL, port);
+	rc = tp_udp_ainfo_get(&ainfo, NULL, port, AF_UNSPEC);
 	if (rc == 0) {
 		*sock = socket(ainfo->ai_family, ainfo->ai_socktype,
 			       ainfo->ai_protocol);
 		rc = *sock < 0 ? P_ERR(-errno) : 0;
 	}
+#ifdef SO_REUSEPORT
+	if (rc == 0 && reuseport) {
+		rc = tp_udp_sockopt_set(*sock, SOL_SOCKET, SO_REUSEPORT, 1);
+		if (rc != 0)
+			(void)close(*sock);
+	}
+#endif /* SO_REUSEPORT */
 	if (rc == 0) {
 		rc = bind(*sock, ainfo->ai_addr, ainfo->ai_addrlen);
 		rc = rc != 0 ? P_ERR(-errno) : 0;
@@ -121,13 +451,253 @@ static int tp_udp_sock_new(unsigned short port, int *sock)
 	return rc;
 }
 
-static int tp_udp_conf_parse(struct tp_udp_ctx *ctx, struct pppoat_conf *conf)
+static int tp_udp_conf_sockopt(struct pppoat_conf *conf,
+				const char         *key,
+				long                max,
+				int                *out)
 {
-	long port;
+	long val;
 	int  rc;
 
+	*out = -1;
+	rc = pppoat_conf_find_long(conf, key, &val);
+	if (rc == 0 && (val < 0 || val > max)) {
+		pppoat_error("udp", "%s must be in range 0..%ld.", key, max);
+		return P_ERR(-EINVAL);
+	}
+	if (rc == 0)
+		*out = (int)val;
+	return 0;
+}
+
+static int tp_udp_conf_sockopts_parse(struct tp_udp_ctx  *ctx,
+				      struct pppoat_conf *conf)
+{
+	int dscp;
+	int rc;
+
+	rc = tp_udp_conf_sockopt(conf, UDP_CONF_RCVBUF, INT_MAX / 2,
+				 &ctx->uc_rcvbuf) ?:
+	     tp_udp_conf_sockopt(conf, UDP_CONF_SNDBUF, INT_MAX / 2,
+				 &ctx->uc_sndbuf) ?:
+	     tp_udp_conf_sockopt(conf, UDP_CONF_BUSY_POLL, INT_MAX,
+				 &ctx->uc_busy_poll) ?:
+	     tp_udp_conf_sockopt(conf, UDP_CONF_TOS, 255, &ctx->uc_tos) ?:
+	     tp_udp_conf_sockopt(conf, UDP_CONF_DSCP, 63, &dscp) ?:
+	     tp_udp_conf_sockopt(conf, UDP_CONF_PRIORITY, INT_MAX,
+				 &ctx->uc_priority);
+	if (rc != 0)
+		return rc;
+
+	if (dscp >= 0 && ctx->uc_tos >= 0) {
+		pppoat_error("udp", UDP_CONF_DSCP " and " UDP_CONF_TOS
+			     " are mutually exclusive.");
+		return P_ERR(-EINVAL);
+	}
+	/* DSCP is the upper 6 bits of the TOS byte, ECN bits stay zero. */
+	if (dscp >= 0)
+		ctx->uc_tos = dscp << 2;
+#ifndef SO_BUSY_POLL
+	if (ctx->uc_busy_poll >= 0)
+		pppoat_info("udp", "Busy polling is not supported by the "
+			    "system.");
+	ctx->uc_busy_poll = -1;
+#endif
+#ifndef SO_PRIORITY
+	if (ctx->uc_priority >= 0)
+		pppoat_info("udp", "Socket priority is not supported by the "
+			    "system.");
+	ctx->uc_priority = -1;
+#endif
+	return 0;
+}
+
+static int tp_udp_conf_parse(struct tp_udp_ctx *ctx, struct pppoat_conf *conf)
+{
+	long  port;
+	long  batch;
+	long  nr;
+	char *str = NULL;
+	int   rc;
+
 	ctx->uc_sport = 0;
 	ctx->uc_dport = 0;
+	ctx->uc_batch = 1;
+	ctx->uc_workers_nr   = 1;
+	ctx->uc_steering     = false;
+	ctx->uc_steering_off = TP_UDP_STEERING_OFF;
+	ctx->uc_dhost        = NULL;
+	ctx->uc_routes       = NULL;
+	ctx->uc_ip_off       = TP_UDP_IP_OFF;
+	ctx->uc_peers_max    = TP_UDP_PEERS_MAX;
+
+	rc = tp_udp_conf_sockopts_parse(ctx, conf);
+	if (rc != 0)
+		return rc;
+	rc = pppoat_conf_find_long(conf, UDP_CONF_SOCKETS, &nr);
+	if (rc == 0) {
+		if (nr < 1 || nr > TP_UDP_SOCKETS_MAX) {
+			pppoat_error("udp", "Number of sockets must be in "
+				     "range 1..%d.", TP_UDP_SOCKETS_MAX);
+			return P_ERR(-EINVAL);
+		}
+#ifndef SO_REUSEPORT
+		if (nr > 1) {
+			pppoat_error("udp", "SO_REUSEPORT is not supported.");
+			return P_ERR(-ENOSYS);
+		}
+#endif
+		ctx->uc_workers_nr = (unsigned)nr;
+	}
+	rc = pppoat_conf_find_string_alloc(conf, UDP_CONF_STEERING, &str);
+	if (rc == 0) {
+		if (pppoat_streq(str, "inner"))
+			ctx->uc_steering = true;
+		else if (!pppoat_streq(str, "kernel")) {
+			pppoat_error("udp", "Unknown steering '%s', use "
+				     "'kernel' or 'inner'.", str);
+			rc = P_ERR(-EINVAL);
+		}
+		pppoat_free(str);
+		if (rc != 0)
+			return rc;
+	}
+#ifndef TP_UDP_HAVE_STEERING
+	if (ctx->uc_steering)
+		pppoat_info("udp", "Steering by inner addresses is not "
+			    "supported by the system.");
+	ctx->uc_steering = false;
+#endif
+	rc = pppoat_conf_find_long(conf, UDP_CONF_STEERING_OFF, &nr);
+	if (rc == 0) {
+		if (nr < 0 || nr > TP_UDP_MTU - 8) {
+			pppoat_error("udp", "Invalid steering offset %ld.", nr);
+			return P_ERR(-EINVAL);
+		}
+		ctx->uc_steering_off = (unsigned)nr;
+	}
+
+	pppoat_conf_find_bool(conf, UDP_CONF_CONNECT, &ctx->uc_connect);
+	if (ctx->uc_connect && ctx->uc_workers_nr > 1) {
+		pppoat_error("udp", UDP_CONF_CONNECT " is not compatible with "
+			     UDP_CONF_SOCKETS " > 1.");
+		return P_ERR(-EINVAL);
+	}
+	ctx->uc_auth = false;
+	rc = pppoat_conf_find_string_alloc(conf, UDP_CONF_SECRET, &str);
+	if (rc == 0) {
+		pppoat_siphash_key_derive(&ctx->uc_key, str);
+		pppoat_free(str);
+		ctx->uc_auth = true;
+	}
+	if (ctx->uc_connect && !ctx->uc_auth)
+		pppoat_info("udp", "Peer roaming requires " UDP_CONF_SECRET);
+
+	pppoat_conf_find_bool(conf, UDP_CONF_SERVER, &ctx->uc_server);
+	if (ctx->uc_server && ctx->uc_connect) {
+		pppoat_error("udp", UDP_CONF_SERVER " is not compatible with "
+			     UDP_CONF_CONNECT ".");
+		return P_ERR(-EINVAL);
+	}
+	rc = pppoat_conf_find_long(conf, UDP_CONF_IP_OFF, &nr);
+	if (rc == 0) {
+		if (nr < 0 || nr > TP_UDP_MTU - 20) {
+			pppoat_error("udp", "Invalid IP offset %ld.", nr);
+			return P_ERR(-EINVAL);
+		}
+		ctx->uc_ip_off = (unsigned)nr;
+	}
+	rc = pppoat_conf_find_long(conf, UDP_CONF_PEERS_MAX, &nr);
+	if (rc == 0) {
+		if (nr < 1 || nr > TP_UDP_PEERS_MAX_LIMIT) {
+			pppoat_error("udp", "Maximum number of peers must be in "
+				     "range 1..%d.", TP_UDP_PEERS_MAX_LIMIT);
+			return P_ERR(-EINVAL);
+		}
+		ctx->uc_peers_max = (unsigned)nr;
+	}
+
+	rc = pppoat_conf_find_long(conf, UDP_CONF_BATCH, &batch);
+	if (rc == 0) {
+		if (batch < 1 || batch > TP_UDP_BATCH_MAX) {
+			pppoat_error("udp", "Batch size must be in range "
+				     "1..%d.", TP_UDP_BATCH_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->uc_batch = (unsigned)batch;
+	}
+
+	pppoat_conf_find_bool(conf, UDP_CONF_GSO, &ctx->uc_gso);
+	pppoat_conf_find_bool(conf, UDP_CONF_GRO, &ctx->uc_gro);
+#ifndef TP_UDP_HAVE_GSO
+	if (ctx->uc_gso)
+		pppoat_info("udp", "GSO is not supported by the system.");
+	ctx->uc_gso = false;
+#endif
+#ifndef TP_UDP_HAVE_GRO
+	if (ctx->uc_gro)
+		pppoat_info("udp", "GRO is not supported by the system.");
+	ctx->uc_gro = false;
+#endif
+	if (ctx->uc_gso && ctx->uc_batch == 1) {
+		pppoat_error("udp", "GSO requires " UDP_CONF_BATCH " > 1.");
+		return P_ERR(-EINVAL);
+	}
+
+	pppoat_conf_find_bool(conf, UDP_CONF_PMTUD, &ctx->uc_pmtud);
+	ctx->uc_pm.pm_max = TP_UDP_PMTUD_MAX;
+	rc = pppoat_conf_find_long(conf, UDP_CONF_PMTUD_MAX, &nr);
+	if (rc == 0) {
+		if (nr < TP_UDP_PMTUD_BASE || nr > TP_UDP_GSO_SIZE) {
+			pppoat_error("udp", "Maximum PMTUD size must be in "
+				     "range %d..%d.", TP_UDP_PMTUD_BASE,
+				     TP_UDP_GSO_SIZE);
+			return P_ERR(-EINVAL);
+		}
+		ctx->uc_pm.pm_max = (size_t)nr;
+	}
+	if (ctx->uc_pmtud && ctx->uc_server) {
+		pppoat_error("udp", UDP_CONF_PMTUD " is not compatible with "
+			     UDP_CONF_SERVER ".");
+		return P_ERR(-EINVAL);
+	}
+	ctx->uc_probe.pr_ival = 0;
+	rc = pppoat_conf_find_long(conf, UDP_CONF_PROBE, &nr);
+	if (rc == 0) {
+		if (nr < 0 || nr > TP_UDP_ECHO_PROBE_MAX) {
+			pppoat_error("udp", "Probe interval must be in range "
+				     "0..%d ms.", TP_UDP_ECHO_PROBE_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->uc_probe.pr_ival = (unsigned)nr;
+	}
+	if (ctx->uc_probe.pr_ival != 0 && ctx->uc_server) {
+		pppoat_error("udp", UDP_CONF_PROBE " is not compatible with "
+			     UDP_CONF_SERVER ".");
+		return P_ERR(-EINVAL);
+	}
+	ctx->uc_spray = 1;
+	rc = pppoat_conf_find_long(conf, UDP_CONF_SPRAY, &nr);
+	if (rc == 0) {
+		if (nr < 1 || nr > TP_UDP_SPRAY_MAX) {
+			pppoat_error("udp", "Number of spraying ports must be in "
+				     "range 1..%d.", TP_UDP_SPRAY_MAX);
+			return P_ERR(-EINVAL);
+		}
+		ctx->uc_spray = (unsigned)nr;
+	}
+	if (ctx->uc_spray > 1 && ctx->uc_server) {
+		pppoat_error("udp", UDP_CONF_SPRAY " is not compatible with "
+			     UDP_CONF_SERVER ".");
+		return P_ERR(-EINVAL);
+	}
+	ctx->uc_batched = ctx->uc_batch > 1 || ctx->uc_gro;
+	ctx->uc_rx_size = ctx->uc_gro ? TP_UDP_GSO_SIZE :
+		TP_UDP_MTU + TP_UDP_HEADROOM +
+		(ctx->uc_auth ? TP_UDP_AUTH_SIZE : 0);
+	if (ctx->uc_pmtud)
+		ctx->uc_rx_size = pppoat_max(ctx->uc_rx_size,
+					     ctx->uc_pm.pm_max);
 
 	rc = pppoat_conf_find_long(conf, UDP_CONF_PORT, &port);
 	if (rc == 0) {
@@ -141,174 +711,2305 @@ static int tp_udp_conf_parse(struct tp_udp_ctx *ctx, struct pppoat_conf *conf)
 	if (rc == 0)
 		ctx->uc_dport = (unsigned short)port;
 
-	if (ctx->uc_sport == 0 || ctx->uc_dport == 0) {
+	if (ctx->uc_server && ctx->uc_sport == 0) {
+		pppoat_error("udp", "Source port is not set.");
+		rc = P_ERR(-ENOENT);
+	} else if (ctx->uc_server) {
+		/* Peers are learned or come from the routes file. */
+		rc = pppoat_conf_find_string_alloc(conf, UDP_CONF_ROUTES,
+						   &ctx->uc_routes);
+		rc = rc == -ENOENT ? 0 : rc;
+	} else if (ctx->uc_sport == 0 || ctx->uc_dport == 0) {
 		pppoat_error("udp", "Source or destination port is not set.");
-		return P_ERR(-ENOENT);
+		rc = P_ERR(-ENOENT);
+	} else if (ctx->uc_sport + ctx->uc_spray - 1 > 65535) {
+		pppoat_error("udp", "Spraying ports exceed 65535.");
+		rc = P_ERR(-EINVAL);
+	} else {
+		rc = pppoat_conf_find_string_alloc(conf, UDP_CONF_HOST,
+						   &ctx->uc_dhost);
+		if (rc == -ENOENT)
+			pppoat_error("udp", "Remote host address is not set.");
 	}
-
-	rc = pppoat_conf_find_string_alloc(conf, UDP_CONF_HOST, &ctx->uc_dhost);
-	if (rc == -ENOENT)
-		pppoat_error("udp", "Remote host address is not set.");
-
 	return rc;
 }
 
 static void tp_udp_conf_fini(struct tp_udp_ctx *ctx)
 {
+	pppoat_free(ctx->uc_routes);
 	pppoat_free(ctx->uc_dhost);
 }
 
-static int tp_udp_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+static void tp_udp_batch_free(struct tp_udp_batch *b)
 {
-	struct tp_udp_ctx *ctx;
-	int                rc;
+#ifdef TP_UDP_HAVE_MMSG
+	pppoat_free(b->ub_cmsg);
+	pppoat_free(b->ub_msgs);
+#endif
+	pppoat_free(b->ub_addrlens);
+	pppoat_free(b->ub_addrs);
+	pppoat_free(b->ub_socks);
+	pppoat_free(b->ub_tstamps);
+	pppoat_free(b->ub_segs);
+	pppoat_free(b->ub_iov);
+	pppoat_free(b->ub_pkts);
+}
 
-	ctx = pppoat_alloc(sizeof *ctx);
-	if (ctx == NULL)
+static int tp_udp_batch_init(struct tp_udp_batch *b, unsigned nr)
+{
+	bool failed;
+
+	b->ub_pkts = pppoat_calloc(nr, sizeof *b->ub_pkts);
+	b->ub_iov  = pppoat_calloc(nr, sizeof *b->ub_iov);
+	b->ub_segs = pppoat_calloc(nr, sizeof *b->ub_segs);
+	b->ub_tstamps  = pppoat_calloc(nr, sizeof *b->ub_tstamps);
+	b->ub_socks    = pppoat_calloc(nr, sizeof *b->ub_socks);
+	b->ub_addrs    = pppoat_calloc(nr, sizeof *b->ub_addrs);
+	b->ub_addrlens = pppoat_calloc(nr, sizeof *b->ub_addrlens);
+	failed = b->ub_pkts == NULL || b->ub_iov == NULL || b->ub_segs == NULL ||
+		 b->ub_tstamps == NULL || b->ub_socks == NULL ||
+		 b->ub_addrs == NULL || b->ub_addrlens == NULL;
+#ifdef TP_UDP_HAVE_MMSG
+	b->ub_msgs = pppoat_calloc(nr, sizeof *b->ub_msgs);
+	b->ub_cmsg = pppoat_calloc(nr, sizeof *b->ub_cmsg);
+	failed = failed || b->ub_msgs == NULL || b->ub_cmsg == NULL;
+#endif
+	if (failed) {
+		tp_udp_batch_free(b);
 		return P_ERR(-ENOMEM);
-	rc = tp_udp_conf_parse(ctx, conf);
-	if (rc != 0)
-		goto err_ctx_free;
+	}
+	b->ub_nr  = 0;
+	b->ub_pos = 0;
+	b->ub_off = 0;
 
-	rc = tp_udp_ainfo_get(&ctx->uc_ainfo, ctx->uc_dhost, ctx->uc_dport);
-	if (rc != 0)
-		goto err_conf_fini;
+	return 0;
+}
 
-	mod->m_userdata = ctx;
+static void tp_udp_batch_fini(struct tp_udp_batch  *b,
+			      struct pppoat_module *mod,
+			      unsigned              nr)
+{
+	unsigned i;
+
+	for (i = 0; i < nr; ++i)
+		if (b->ub_pkts[i] != NULL)
+			pppoat_packet_put(mod->m_pkts, b->ub_pkts[i]);
+	tp_udp_batch_free(b);
+}
+
+static int tp_udp_batched_init(struct tp_udp_ctx *ctx)
+{
+	unsigned i;
+	int      rc;
+
+	rc = tp_udp_batch_init(&ctx->uc_tx, ctx->uc_batch);
+	if (rc != 0)
+		return rc;
+	for (i = 0; i < ctx->uc_workers_nr; ++i) {
+		rc = tp_udp_batch_init(&ctx->uc_workers[i].uw_rx,
+				       ctx->uc_batch);
+		if (rc != 0) {
+			/* Slots are empty yet, so no packets to release. */
+			while (i > 0)
+				tp_udp_batch_free(&ctx->uc_workers[--i].uw_rx);
+			tp_udp_batch_free(&ctx->uc_tx);
+			return rc;
+		}
+	}
+	pppoat_list_init(&ctx->uc_txq, &tp_udp_txq_descr);
+	pppoat_mutex_init(&ctx->uc_txq_lock);
+	ctx->uc_txq_nr = 0;
 
 	return 0;
+}
 
-err_conf_fini:
-	tp_udp_conf_fini(ctx);
-err_ctx_free:
-	pppoat_free(ctx);
-	return rc;
+static void tp_udp_batched_fini(struct tp_udp_ctx    *ctx,
+				struct pppoat_module *mod)
+{
+	struct pppoat_packet *pkt;
+	unsigned              i;
+
+	while ((pkt = pppoat_list_dequeue(&ctx->uc_txq)) != NULL)
+		pppoat_packet_put(mod->m_pkts, pkt);
+	pppoat_mutex_fini(&ctx->uc_txq_lock);
+	pppoat_list_fini(&ctx->uc_txq);
+	tp_udp_batch_fini(&ctx->uc_tx, mod, ctx->uc_batch);
+	for (i = 0; i < ctx->uc_workers_nr; ++i)
+		tp_udp_batch_fini(&ctx->uc_workers[i].uw_rx, mod,
+				  ctx->uc_batch);
 }
 
-static void tp_udp_fini(struct pppoat_module *mod)
+static int tp_udp_workers_init(struct tp_udp_ctx *ctx)
 {
-	struct tp_udp_ctx *ctx = mod->m_userdata;
+	unsigned i;
+	int      rc;
 
-	PPPOAT_ASSERT(tp_udp_ctx_invariant(ctx));
+	ctx->uc_workers = pppoat_calloc(ctx->uc_workers_nr,
+					sizeof *ctx->uc_workers);
+	if (ctx->uc_workers == NULL)
+		return P_ERR(-ENOMEM);
+	rc = pthread_key_create(&ctx->uc_worker_key, NULL);
+	if (rc != 0) {
+		pppoat_free(ctx->uc_workers);
+		return P_ERR(-rc);
+	}
+	for (i = 0; i < ctx->uc_workers_nr; ++i)
+		ctx->uc_workers[i].uw_sock = -1;
+	pppoat_mutex_init(&ctx->uc_workers_lock);
 
-	tp_udp_ainfo_put(ctx->uc_ainfo);
-	tp_udp_conf_fini(ctx);
-	pppoat_free(ctx);
+	return 0;
 }
 
-static int tp_udp_run(struct pppoat_module *mod)
+static void tp_udp_workers_fini(struct tp_udp_ctx *ctx)
 {
-	struct tp_udp_ctx *ctx = mod->m_userdata;
-	int                rc;
+	pppoat_mutex_fini(&ctx->uc_workers_lock);
+	(void)pthread_key_delete(ctx->uc_worker_key);
+	pppoat_free(ctx->uc_workers);
+}
 
-	PPPOAT_ASSERT(tp_udp_ctx_invariant(ctx));
+/**
+ * Returns worker of the calling thread. A thread claims a free worker on
+ * the first call. The pipeline starts exactly uc_workers_nr threads.
+ */
+static struct tp_udp_worker *tp_udp_worker_get(struct tp_udp_ctx *ctx)
+{
+	struct tp_udp_worker *w;
+	unsigned              i;
 
-	rc = tp_udp_sock_new(ctx->uc_sport, &ctx->uc_sock);
-	if (rc == 0) {
-		(void)pppoat_io_fd_blocking_set(ctx->uc_sock, false);
+	if (ctx->uc_workers_nr == 1)
+		return &ctx->uc_workers[0];
+
+	w = pthread_getspecific(ctx->uc_worker_key);
+	if (w != NULL)
+		return w;
+
+	pppoat_mutex_lock(&ctx->uc_workers_lock);
+	for (i = 0; i < ctx->uc_workers_nr; ++i) {
+		if (!ctx->uc_workers[i].uw_claimed) {
+			w = &ctx->uc_workers[i];
+			w->uw_claimed = true;
+			break;
+		}
 	}
-	return rc;
+	pppoat_mutex_unlock(&ctx->uc_workers_lock);
+
+	PPPOAT_ASSERT(w != NULL);
+	(void)pthread_setspecific(ctx->uc_worker_key, w);
+
+	return w;
 }
 
-static int tp_udp_stop(struct pppoat_module *mod)
+static bool tp_udp_worker_is_first(struct tp_udp_ctx    *ctx,
+				   struct tp_udp_worker *w)
 {
-	struct tp_udp_ctx *ctx = mod->m_userdata;
-	int                rc;
+	return w == &ctx->uc_workers[0];
+}
 
-	pppoat_debug("udp", "stopping udp module");
+static uint64_t tp_udp_now(void)
+{
+	struct timespec ts;
 
-	rc = pppoat_io_close(ctx->uc_sock);
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-	return rc;
+static uint64_t tp_udp_seq_initial(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+		return 1;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
-static int tp_udp_pkt_get(struct pppoat_module  *mod,
-			  struct pppoat_packet **pkt)
+/** Returns a random non-zero session number for the trailer. */
+static uint64_t tp_udp_session_new(struct tp_udp_ctx *ctx)
 {
-	struct tp_udp_ctx    *ctx = mod->m_userdata;
-	struct pppoat_packet *pkt2;
-	size_t                size;
-	ssize_t               rlen;
-	int                   sock;
-	int                   rc;
+	uint64_t seed[2];
 
-	sock = ctx->uc_sock;
-	size = TP_UDP_MTU;
-	pkt2 = pppoat_packet_get(mod->m_pkts, size);
-	rc   = pkt2 == NULL ? P_ERR(-ENOMEM) : 0;
+	seed[0] = tp_udp_seq_initial();
+	seed[1] = (uint64_t)getpid() << 32 | (uint32_t)tp_udp_now();
+	return pppoat_siphash(&ctx->uc_key, seed, sizeof seed) ?: 1;
+}
 
-	rc = rc ?: pppoat_io_select_single_read(sock);
-	if (rc == 0) {
-		/* XXX use recvfrom() */
-		rlen = recv(sock, pkt2->pkt_data, pkt2->pkt_size, 0);
-		if (rlen < 0 && !pppoat_io_error_is_recoverable(-errno))
-			rc = P_ERR(-errno);
-		rc = rc ?: (rlen <= 0 ? -EAGAIN : 0); /* XXX */
-		if (rlen > 0)
-			pkt2->pkt_size = rlen;
+/** Reads IPv4 address at offset `off' of the inner IPv4 header. */
+static bool tp_udp_ip_addr(struct tp_udp_ctx    *ctx,
+			   struct pppoat_packet *pkt,
+			   unsigned              off,
+			   uint32_t             *addr)
+{
+	const unsigned char *ip = (unsigned char *)pkt->pkt_data +
+				  ctx->uc_ip_off;
+
+	if (pkt->pkt_size < ctx->uc_ip_off + 20 || ip[0] >> 4 != 4)
+		return false;
+	*addr = (uint32_t)ip[off] << 24 | (uint32_t)ip[off + 1] << 16 |
+		(uint32_t)ip[off + 2] << 8 | ip[off + 3];
+	return true;
+}
+
+/**
+ * Returns peer for the inner destination address or NULL. The address is
+ * found at udp.ip_offset bytes of the packet and looked up in a longest
+ * prefix match table. Static routes are loaded from udp.routes file with
+ * lines in format "prefix/len host port". Packets without route are
+ * dropped.
+ */
+static struct pppoat_peer *tp_udp_route(struct tp_udp_ctx    *ctx,
+					struct pppoat_packet *pkt)
+{
+	uint32_t dst;
+
+	if (!tp_udp_ip_addr(ctx, pkt, 16, &dst))
+		return NULL;
+	return pppoat_peers_route(&ctx->uc_peers, dst);
+}
+
+/**
+ * Routes inner source address of the datagram to its sender, so a client
+ * becomes reachable after its first packet. With `rebind', the route is
+ * taken from another peer. Otherwise, the address becomes free when its
+ * peer is replaced. Learning trusts any sender, therefore, udp.secret
+ * should be set on public networks.
+ */
+static void tp_udp_route_learn(struct tp_udp_ctx    *ctx,
+			       struct pppoat_packet *pkt,
+			       struct pppoat_peer   *peer,
+			       bool                  rebind)
+{
+	uint32_t src;
+	int      rc;
+
+	if (!tp_udp_ip_addr(ctx, pkt, 12, &src))
+		return;
+	rc = pppoat_peers_learn(&ctx->uc_peers, peer, src, rebind);
+	if (rc != 0 && rc != -EEXIST)
+		pppoat_debug("udp", "Couldn't add route (rc=%d)", rc);
+}
+
+static int tp_udp_route_parse(struct tp_udp_ctx *ctx,
+			      char              *line,
+			      unsigned           lineno)
+{
+	struct pppoat_peer *peer;
+	struct addrinfo    *ainfo;
+	struct in_addr      in;
+	char                net[32];
+	char                host[256];
+	char               *slash;
+	long                len = 32;
+	long                port;
+	int                 n;
+	int                 rc;
+
+	n = sscanf(line, "%31s %255s %ld", net, host, &port);
+	if (n <= 0 || net[0] == '#')
+		return 0;
+
+	slash = strchr(net, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		len = strtol(slash + 1, NULL, 10);
+	}
+	if (n != 3 || inet_pton(AF_INET, net, &in) != 1 || len < 0 ||
+	    len > 32 || port < 1 || port > 65535) {
+		pppoat_error("udp", "%s:%u: expected 'prefix/len host port'",
+			     ctx->uc_routes, lineno);
+		return P_ERR(-EINVAL);
 	}
-	if (rc != 0 && pkt2 != NULL)
-		pppoat_packet_put(mod->m_pkts, pkt2);
 
+	rc = tp_udp_ainfo_get(&ainfo, host, (unsigned short)port,
+			      ctx->uc_family);
 	if (rc == 0) {
-		pkt2->pkt_type = PPPOAT_PACKET_RECV;
-		*pkt = pkt2;
+		rc = pppoat_peers_get(&ctx->uc_peers, ainfo->ai_addr,
+				      ainfo->ai_addrlen, tp_udp_now(), &peer);
+		tp_udp_ainfo_put(ainfo);
 	}
+	if (rc == 0) {
+		peer->pe_static = true;
+		rc = pppoat_peers_route_add(&ctx->uc_peers, ntohl(in.s_addr),
+					    (uint8_t)len, peer);
+	}
+	if (rc != 0)
+		pppoat_error("udp", "%s:%u: couldn't add route (rc=%d)",
+			     ctx->uc_routes, lineno, rc);
 	return rc;
 }
 
-static int tp_udp_buf_send(int              sock,
-			   struct addrinfo *ainfo,
-			   unsigned char   *buf,
-			   size_t           len)
+static int tp_udp_routes_load(struct tp_udp_ctx *ctx)
 {
-	ssize_t slen = 0;
-	int     rc   = 0;
+	char      line[512];
+	unsigned  lineno = 0;
+	FILE     *f;
+	int       rc = 0;
 
-	do {
-		slen = sendto(sock, buf, len, 0, ainfo->ai_addr,
-			      ainfo->ai_addrlen);
-		if (slen < 0 && errno == EINTR)
-			continue;
-		if (slen < 0 && !pppoat_io_error_is_recoverable(-errno))
-			rc = P_ERR(-errno);
-		if (slen < 0 && pppoat_io_error_is_recoverable(-errno))
-			rc = pppoat_io_select_single_write(sock);
-		if (slen > 0) {
-			buf += slen;
-			len -= slen;
-		}
-	} while (rc == 0 && len > 0);
+	f = fopen(ctx->uc_routes, "r");
+	if (f == NULL) {
+		pppoat_error("udp", "Couldn't open routes file %s (errno=%d)",
+			     ctx->uc_routes, errno);
+		return P_ERR(-errno);
+	}
+	while (rc == 0 && fgets(line, sizeof line, f) != NULL)
+		rc = tp_udp_route_parse(ctx, line, ++lineno);
+	if (rc == 0 && ferror(f) != 0)
+		rc = P_ERR(-EIO);
+	fclose(f);
 
 	return rc;
 }
 
-static int tp_udp_process(struct pppoat_module  *mod,
-			  struct pppoat_packet  *pkt,
-			  struct pppoat_packet **next)
+static void tp_udp_server_fini(struct tp_udp_ctx *ctx)
 {
-	struct tp_udp_ctx *ctx = mod->m_userdata;
-	int                rc;
+	pppoat_peers_fini(&ctx->uc_peers);
+}
 
-	PPPOAT_ASSERT(tp_udp_ctx_invariant(ctx));
-	PPPOAT_ASSERT(imply(pkt != NULL, pkt->pkt_type == PPPOAT_PACKET_SEND));
+/**
+ * With udp.server, the module serves multiple peers on a single port. The
+ * peers are kept in a table of udp.peers_max entries, see peers.h. With
+ * udp.secret, a peer is found by its session, so a datagram replayed from
+ * a spoofed address is dropped and the peer may change its address.
+ * Otherwise, a peer is found by the outer source address.
+ */
+static int tp_udp_server_init(struct tp_udp_ctx *ctx)
+{
+	struct addrinfo *ainfo;
+	uint64_t         seed[2];
+	int              rc;
 
-	if (pkt == NULL) {
-		return tp_udp_pkt_get(mod, next);
+	/* Route peers must have the same family as the sockets. */
+	rc = tp_udp_ainfo_get(&ainfo, NULL, ctx->uc_sport, AF_UNSPEC);
+	if (rc != 0)
+		return rc;
+	ctx->uc_family = ainfo->ai_family;
+	tp_udp_ainfo_put(ainfo);
+
+	seed[0] = tp_udp_seq_initial();
+	seed[1] = (uint64_t)getpid();
+	rc = pppoat_peers_init(&ctx->uc_peers, ctx->uc_peers_max, seed);
+	if (rc == 0 && ctx->uc_routes != NULL) {
+		rc = tp_udp_routes_load(ctx);
+		if (rc != 0)
+			tp_udp_server_fini(ctx);
+		else
+			pppoat_info("udp", "Loaded routes to %u peers",
+				    ctx->uc_peers.ps_nr);
 	}
+	return rc;
+}
 
-	rc = tp_udp_buf_send(ctx->uc_sock, ctx->uc_ainfo, pkt->pkt_data,
-			     pkt->pkt_size);
-	if (rc == 0)
-		pppoat_packet_put(mod->m_pkts, pkt);
+/**
+ * Returns destination address of an outbound packet. In the server mode
+ * it's address of the routed peer.
+ */
+static const struct sockaddr *tp_udp_pkt_daddr(struct tp_udp_ctx    *ctx,
+					       struct pppoat_packet *pkt,
+					       socklen_t            *addrlen)
+{
+	struct pppoat_peer *peer = pkt->pkt_userdata;
 
-	*next = NULL;
-	return rc;
+	if (ctx->uc_server) {
+		*addrlen = peer->pe_addrlen;
+		return (const struct sockaddr *)&peer->pe_addr;
+	}
+	*addrlen = ctx->uc_daddrlen;
+	return ctx->uc_daddr;
 }
 
-static size_t tp_udp_mtu(struct pppoat_module *mod)
+/**
+ * Returns socket for an outbound packet.
+ *
+ * All datagrams of a tunnel share one outer 5-tuple, so ECMP routers keep
+ * them on one path and the peer's NIC hashes them to one receive queue.
+ * With udp.spray=N, the module binds N sending sockets to ports
+ * udp.sport..udp.sport+N-1 and picks the socket by hash of the inner flow:
+ * addresses, protocol and TCP/UDP/SCTP ports of the IPv4 or IPv6 packet
+ * at udp.ip_offset. Every inner flow keeps its outer port and stays in
+ * order, while different flows spread over paths and queues. Fragments and
+ * non-IP packets use the first port. Control datagrams always leave from
+ * udp.sport.
+ *
+ * A udp.server peer without udp.secret sees every port as a separate peer,
+ * so every sprayed port takes an entry of udp.peers_max on it. A peer with
+ * udp.connect and udp.secret follows the source port of the last datagram,
+ * so it must not be combined with spraying.
+ */
+static int tp_udp_pkt_sock(struct tp_udp_ctx *ctx, struct pppoat_packet *pkt)
 {
-	return TP_UDP_MTU;
+	uint32_t hash;
+
+	if (ctx->uc_spray <= 1 || pkt->pkt_size < ctx->uc_ip_off)
+		return ctx->uc_sock;
+	hash = pppoat_flow_hash((char *)pkt->pkt_data + ctx->uc_ip_off,
+				pkt->pkt_size - ctx->uc_ip_off);
+	return ctx->uc_spray_socks[hash % ctx->uc_spray];
+}
+
+static void tp_udp_be_put(unsigned char *buf, uint64_t val, unsigned len)
+{
+	while (len-- > 0) {
+		buf[len] = (unsigned char)val;
+		val >>= 8;
+	}
+}
+
+static uint64_t tp_udp_be_get(const unsigned char *buf, unsigned len)
+{
+	uint64_t val = 0;
+	unsigned i;
+
+	for (i = 0; i < len; ++i)
+		val = val << 8 | buf[i];
+	return val;
+}
+
+static void tp_udp_pmtud_init(struct tp_udp_ctx *ctx)
+{
+	struct tp_udp_pmtud *pm = &ctx->uc_pm;
+
+	pm->pm_lo        = TP_UDP_PMTUD_BASE;
+	pm->pm_hi        = pm->pm_max;
+	pm->pm_probe     = 0;
+	pm->pm_probes_nr = 0;
+	pm->pm_done      = false;
+	pm->pm_next      = 0;
+	pm->pm_raise     = 0;
+	pm->pm_mtu       = TP_UDP_MTU;
+	pppoat_mutex_init(&pm->pm_lock);
+}
+
+static void tp_udp_pmtud_fini(struct tp_udp_ctx *ctx)
+{
+	pppoat_mutex_fini(&ctx->uc_pm.pm_lock);
+}
+
+static void tp_udp_probe_init(struct tp_udp_ctx *ctx)
+{
+	struct tp_udp_probe *pr = &ctx->uc_probe;
+
+	pr->pr_seq     = 0;
+	pr->pr_pending = false;
+	pr->pr_next    = 0;
+	pppoat_rtt_init(&pr->pr_rtt);
+	pppoat_mutex_init(&pr->pr_lock);
+}
+
+static void tp_udp_probe_fini(struct tp_udp_ctx *ctx)
+{
+	pppoat_mutex_fini(&ctx->uc_probe.pr_lock);
+	pppoat_rtt_fini(&ctx->uc_probe.pr_rtt);
+}
+
+/** Wall clock in us, the clock of kernel software timestamps. */
+static uint64_t tp_udp_realtime(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Sets Don't Fragment bit on the sending socket. The kernel doesn't limit
+ * datagrams by path MTU learned from ICMP, probes find the limit instead.
+ */
+static int tp_udp_pmtud_sock_setup(int sock)
+{
+	struct sockaddr_storage addr;
+	socklen_t               addrlen = sizeof addr;
+	int                     rc;
+
+	rc = getsockname(sock, (struct sockaddr *)&addr, &addrlen);
+	rc = rc != 0 ? P_ERR(-errno) : 0;
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+	if (rc == 0 && addr.ss_family == AF_INET6) {
+		/* Dual-stack socket, IPv4 option applies to mapped peers. */
+		(void)tp_udp_sockopt_set(sock, IPPROTO_IP, IP_MTU_DISCOVER,
+					 IP_PMTUDISC_PROBE);
+		rc = tp_udp_sockopt_set(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER,
+					IPV6_PMTUDISC_PROBE);
+	} else if (rc == 0) {
+		rc = tp_udp_sockopt_set(sock, IPPROTO_IP, IP_MTU_DISCOVER,
+					IP_PMTUDISC_PROBE);
+	}
+#elif defined(IP_DONTFRAG)
+	if (rc == 0 && addr.ss_family == AF_INET6) {
+		rc = tp_udp_sockopt_set(sock, IPPROTO_IPV6, IPV6_DONTFRAG, 1);
+	} else if (rc == 0) {
+		rc = tp_udp_sockopt_set(sock, IPPROTO_IP, IP_DONTFRAG, 1);
+	}
+#else
+	rc = rc ?: P_ERR(-ENOSYS);
+#endif
+	if (rc != 0)
+		pppoat_error("udp", "Couldn't disable fragmentation for "
+			     "PMTUD (rc=%d)", rc);
+	return rc;
+}
+
+static int tp_udp_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+{
+	struct tp_udp_ctx *ctx;
+	int                rc;
+
+	ctx = pppoat_alloc(sizeof *ctx);
+	if (ctx == NULL)
+		return P_ERR(-ENOMEM);
+	rc = tp_udp_conf_parse(ctx, conf);
+	if (rc != 0)
+		goto err_ctx_free;
+
+	ctx->uc_ainfo = NULL;
+	if (!ctx->uc_server) {
+		rc = tp_udp_ainfo_get(&ctx->uc_ainfo, ctx->uc_dhost,
+				      ctx->uc_dport, AF_UNSPEC);
+	}
+	if (rc != 0)
+		goto err_conf_fini;
+
+	rc = tp_udp_workers_init(ctx);
+	if (rc != 0)
+		goto err_ainfo_put;
+
+	ctx->uc_sock    = -1;
+	ctx->uc_lsock   = -1;
+	ctx->uc_lsock_drops = 0;
+	ctx->uc_spray_socks = NULL;
+	ctx->uc_wake[0] = -1;
+	ctx->uc_wake[1] = -1;
+	ctx->uc_txq_drops = 0;
+	ctx->uc_daddr    = ctx->uc_ainfo == NULL || ctx->uc_connect ? NULL :
+			   ctx->uc_ainfo->ai_addr;
+	ctx->uc_daddrlen = ctx->uc_daddr == NULL ? 0 : ctx->uc_ainfo->ai_addrlen;
+	ctx->uc_tx_seq   = tp_udp_seq_initial();
+	ctx->uc_session  = tp_udp_session_new(ctx);
+	memset(&ctx->uc_replay, 0, sizeof ctx->uc_replay);
+	pppoat_mutex_init(&ctx->uc_tx_seq_lock);
+	pppoat_mutex_init(&ctx->uc_replay_lock);
+	tp_udp_pmtud_init(ctx);
+	tp_udp_probe_init(ctx);
+	if (ctx->uc_server) {
+		rc = tp_udp_server_init(ctx);
+		if (rc != 0)
+			goto err_workers_fini;
+	}
+	if (tp_udp_is_batched(ctx)) {
+		rc = tp_udp_batched_init(ctx);
+		if (rc != 0)
+			goto err_server_fini;
+	}
+
+	mod->m_userdata = ctx;
+
+	return 0;
+
+err_server_fini:
+	if (ctx->uc_server)
+		tp_udp_server_fini(ctx);
+err_workers_fini:
+	tp_udp_probe_fini(ctx);
+	tp_udp_pmtud_fini(ctx);
+	pppoat_mutex_fini(&ctx->uc_replay_lock);
+	pppoat_mutex_fini(&ctx->uc_tx_seq_lock);
+	tp_udp_workers_fini(ctx);
+err_ainfo_put:
+	tp_udp_ainfo_put(ctx->uc_ainfo);
+err_conf_fini:
+	tp_udp_conf_fini(ctx);
+err_ctx_free:
+	pppoat_free(ctx);
+	return rc;
+}
+
+static void tp_udp_fini(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(tp_udp_ctx_invariant(ctx));
+
+	if (tp_udp_is_batched(ctx))
+		tp_udp_batched_fini(ctx, mod);
+	if (ctx->uc_server)
+		tp_udp_server_fini(ctx);
+	tp_udp_probe_fini(ctx);
+	tp_udp_pmtud_fini(ctx);
+	pppoat_mutex_fini(&ctx->uc_replay_lock);
+	pppoat_mutex_fini(&ctx->uc_tx_seq_lock);
+	tp_udp_workers_fini(ctx);
+	tp_udp_ainfo_put(ctx->uc_ainfo);
+	tp_udp_conf_fini(ctx);
+	pppoat_free(ctx);
+}
+
+/**
+ * Checks that the kernel supports requested offloads and enables GRO.
+ * An offload which the kernel doesn't support is disabled.
+ *
+ * With udp.gso, consecutive queued packets of the same size are passed to
+ * the kernel as a single buffer with UDP_SEGMENT control message. With
+ * udp.gro, the kernel coalesces received datagrams of a flow and reports
+ * the segment size with UDP_GRO control message, such a buffer is split
+ * back into pool packets. Offloads are used only in the batched mode.
+ */
+static void tp_udp_offload_setup(struct tp_udp_ctx *ctx, int sock)
+{
+#ifdef TP_UDP_HAVE_GSO
+	/* Zero segment size doesn't change the socket behaviour. */
+	int gso = 0;
+#endif
+#ifdef TP_UDP_HAVE_GRO
+	int gro = 1;
+#endif
+
+#ifdef TP_UDP_HAVE_GSO
+	if (ctx->uc_gso && setsockopt(sock, IPPROTO_UDP, UDP_SEGMENT,
+				      &gso, sizeof gso) != 0) {
+		pppoat_info("udp", "GSO is not supported by the kernel "
+			    "(errno=%d), disabling.", errno);
+		ctx->uc_gso = false;
+	}
+#endif /* TP_UDP_HAVE_GSO */
+#ifdef TP_UDP_HAVE_GRO
+	if (ctx->uc_gro && setsockopt(sock, IPPROTO_UDP, UDP_GRO,
+				      &gro, sizeof gro) != 0) {
+		/* Keep large receive buffers, they're harmless. */
+		pppoat_info("udp", "GRO is not supported by the kernel "
+			    "(errno=%d), disabling.", errno);
+		ctx->uc_gro = false;
+	}
+#endif /* TP_UDP_HAVE_GRO */
+}
+
+/**
+ * Sets socket buffer size. The FORCE option is tried first and needs
+ * CAP_NET_ADMIN. Linux doubles the size for bookkeeping overhead and
+ * reports the doubled value, so a reported size below twice the request
+ * means it was capped by net.core.rmem_max or wmem_max.
+ */
+static void tp_udp_sock_buf_set(int sock, int name, int force, int size)
+{
+	const char *what = name == SO_RCVBUF ? "receive" : "send";
+	socklen_t   len = sizeof size;
+	int         actual;
+	int         rc = -1;
+
+	if (force >= 0)
+		rc = setsockopt(sock, SOL_SOCKET, force, &size, sizeof size);
+	if (rc != 0)
+		rc = setsockopt(sock, SOL_SOCKET, name, &size, sizeof size);
+	if (rc == 0)
+		rc = getsockopt(sock, SOL_SOCKET, name, &actual, &len);
+	if (rc != 0) {
+		pppoat_info("udp", "Couldn't set %s buffer size (errno=%d)",
+			    what, errno);
+	} else if (actual / 2 < size) {
+		pppoat_info("udp", "Socket %s buffer is limited to %d bytes",
+			    what, actual / 2);
+	}
+}
+
+static void tp_udp_sock_opt_set(int sock, int level, int name, int val,
+				const char *what)
+{
+	if (tp_udp_sockopt_set(sock, level, name, val) != 0)
+		pppoat_info("udp", "Couldn't set %s (errno=%d)", what, errno);
+}
+
+/**
+ * Applies socket options from the configuration, failures aren't fatal.
+ * udp.busy_poll makes receive calls spin on the device queue for the given
+ * time in us instead of sleeping. udp.tos (or udp.dscp) marks outgoing
+ * datagrams and udp.priority sets SO_PRIORITY for the local qdisc.
+ */
+static void tp_udp_sock_tune(struct tp_udp_ctx *ctx, int sock)
+{
+	struct sockaddr_storage addr;
+	socklen_t               addrlen = sizeof addr;
+	int                     force;
+
+	if (ctx->uc_rcvbuf >= 0) {
+#ifdef SO_RCVBUFFORCE
+		force = SO_RCVBUFFORCE;
+#else
+		force = -1;
+#endif
+		tp_udp_sock_buf_set(sock, SO_RCVBUF, force, ctx->uc_rcvbuf);
+	}
+	if (ctx->uc_sndbuf >= 0) {
+#ifdef SO_SNDBUFFORCE
+		force = SO_SNDBUFFORCE;
+#else
+		force = -1;
+#endif
+		tp_udp_sock_buf_set(sock, SO_SNDBUF, force, ctx->uc_sndbuf);
+	}
+#ifdef SO_BUSY_POLL
+	if (ctx->uc_busy_poll >= 0)
+		tp_udp_sock_opt_set(sock, SOL_SOCKET, SO_BUSY_POLL,
+				    ctx->uc_busy_poll, "busy polling");
+#endif
+#ifdef SO_PRIORITY
+	if (ctx->uc_priority >= 0)
+		tp_udp_sock_opt_set(sock, SOL_SOCKET, SO_PRIORITY,
+				    ctx->uc_priority, "socket priority");
+#endif
+	/* On a dual-stack socket, IPv4 option applies to mapped peers. */
+	if (ctx->uc_tos >= 0 &&
+	    getsockname(sock, (struct sockaddr *)&addr, &addrlen) == 0) {
+		if (addr.ss_family == AF_INET6) {
+			(void)tp_udp_sockopt_set(sock, IPPROTO_IP, IP_TOS,
+						 ctx->uc_tos);
+			tp_udp_sock_opt_set(sock, IPPROTO_IPV6, IPV6_TCLASS,
+					    ctx->uc_tos, "traffic class");
+		} else {
+			tp_udp_sock_opt_set(sock, IPPROTO_IP, IP_TOS,
+					    ctx->uc_tos, "TOS");
+		}
+	}
+}
+
+#ifdef TP_UDP_HAVE_STEERING
+/**
+ * Attaches reuseport program which selects a socket as
+ * (src ^ dst) % N, where src and dst are 32-bit words at the steering offset
+ * of the UDP payload.
+ *
+ * By default the kernel selects a socket by hash of the outer addresses and
+ * ports, which is constant for a single peer. With udp.steering=inner, the
+ * program selects it by the inner IPv4 addresses instead. The default
+ * offset matches IPv4 packets from tun interface with packet information
+ * header. Datagrams which are too short go to the first socket.
+ */
+static int tp_udp_steering_attach(struct tp_udp_ctx *ctx)
+{
+	unsigned           off = ctx->uc_steering_off;
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD   | BPF_W   | BPF_ABS, off),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD   | BPF_W   | BPF_ABS, off + 4),
+		BPF_STMT(BPF_ALU  | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU  | BPF_MOD | BPF_K, ctx->uc_workers_nr),
+		BPF_STMT(BPF_RET  | BPF_A, 0),
+	};
+	struct sock_fprog  prog = {
+		.len    = ARRAY_SIZE(code),
+		.filter = code,
+	};
+	int                rc;
+
+	rc = setsockopt(ctx->uc_workers[0].uw_sock, SOL_SOCKET,
+			SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+	return rc != 0 ? P_ERR(-errno) : 0;
+}
+#endif /* TP_UDP_HAVE_STEERING */
+
+static void tp_udp_socks_close(struct tp_udp_ctx *ctx)
+{
+	struct tp_udp_worker *w;
+	unsigned              i;
+
+	for (i = 0; i < ctx->uc_workers_nr; ++i) {
+		w = &ctx->uc_workers[i];
+		if (w->uw_sock >= 0)
+			(void)pppoat_io_close(w->uw_sock);
+		w->uw_sock = -1;
+	}
+	if (ctx->uc_lsock >= 0)
+		(void)pppoat_io_close(ctx->uc_lsock);
+	/* The first spraying socket is uc_sock. */
+	for (i = 1; ctx->uc_spray_socks != NULL && i < ctx->uc_spray; ++i) {
+		if (ctx->uc_spray_socks[i] >= 0)
+			(void)pppoat_io_close(ctx->uc_spray_socks[i]);
+	}
+	pppoat_free(ctx->uc_spray_socks);
+	ctx->uc_spray_socks = NULL;
+	ctx->uc_lsock = -1;
+	ctx->uc_sock  = -1;
+}
+
+/**
+ * Opens a socket for flow spraying. A peer which answers to the source port,
+ * e.g. in the server mode, sends to the socket, so the first worker receives
+ * from it too. GRO isn't enabled, a read returns a single datagram.
+ */
+static int tp_udp_spray_sock_new(struct tp_udp_ctx *ctx,
+				 unsigned short     port,
+				 int               *sock)
+{
+	int rc;
+
+	rc = tp_udp_sock_new(port, false, sock);
+	if (rc != 0)
+		return rc;
+	if (ctx->uc_connect) {
+		rc = connect(*sock, ctx->uc_ainfo->ai_addr,
+			     ctx->uc_ainfo->ai_addrlen);
+		rc = rc != 0 ? P_ERR(-errno) : 0;
+	}
+	if (rc == 0 && ctx->uc_pmtud)
+		rc = tp_udp_pmtud_sock_setup(*sock);
+	if (rc == 0) {
+		(void)pppoat_io_fd_blocking_set(*sock, false);
+		tp_udp_sock_tune(ctx, *sock);
+	} else
+		(void)pppoat_io_close(*sock);
+
+	return rc;
+}
+
+static int tp_udp_spray_open(struct tp_udp_ctx *ctx)
+{
+	unsigned i;
+	int      rc = 0;
+
+	ctx->uc_spray_socks = pppoat_calloc(ctx->uc_spray,
+					    sizeof *ctx->uc_spray_socks);
+	if (ctx->uc_spray_socks == NULL)
+		return P_ERR(-ENOMEM);
+	ctx->uc_spray_socks[0] = ctx->uc_sock;
+	for (i = 1; i < ctx->uc_spray; ++i)
+		ctx->uc_spray_socks[i] = -1;
+
+	for (i = 1; rc == 0 && i < ctx->uc_spray; ++i) {
+		rc = tp_udp_spray_sock_new(ctx, ctx->uc_sport + i,
+					   &ctx->uc_spray_socks[i]);
+		if (rc != 0) {
+			ctx->uc_spray_socks[i] = -1;
+			pppoat_error("udp", "Couldn't open spraying socket "
+				     "for port %u (rc=%d)",
+				     ctx->uc_sport + i, rc);
+		}
+	}
+	return rc;
+}
+
+static int tp_udp_socks_open(struct tp_udp_ctx *ctx)
+{
+	struct tp_udp_worker *w;
+	bool                  reuseport;
+	unsigned              i;
+	int                   rc = 0;
+
+	reuseport = ctx->uc_workers_nr > 1 || ctx->uc_connect;
+
+	for (i = 0; rc == 0 && i < ctx->uc_workers_nr; ++i) {
+		w  = &ctx->uc_workers[i];
+		rc = tp_udp_sock_new(ctx->uc_sport, reuseport, &w->uw_sock);
+		if (rc == 0) {
+			(void)pppoat_io_fd_blocking_set(w->uw_sock, false);
+			tp_udp_offload_setup(ctx, w->uw_sock);
+			tp_udp_sock_tune(ctx, w->uw_sock);
+#ifdef TP_UDP_HAVE_RXQ_OVFL
+			(void)tp_udp_sockopt_set(w->uw_sock, SOL_SOCKET,
+						 SO_RXQ_OVFL, 1);
+#endif
+#ifdef TP_UDP_HAVE_TSTAMP
+			if (ctx->uc_probe.pr_ival != 0)
+				tp_udp_sock_opt_set(w->uw_sock, SOL_SOCKET,
+					SO_TIMESTAMPING,
+					SOF_TIMESTAMPING_RX_SOFTWARE |
+					SOF_TIMESTAMPING_SOFTWARE,
+					"receive timestamps");
+#endif
+		} else
+			w->uw_sock = -1;
+		w->uw_claimed = false;
+		w->uw_drops   = 0;
+	}
+#ifdef TP_UDP_HAVE_STEERING
+	if (rc == 0 && reuseport && ctx->uc_steering &&
+	    tp_udp_steering_attach(ctx) != 0) {
+		pppoat_info("udp", "Couldn't attach steering program, "
+			    "falling back to kernel hashing.");
+	}
+#endif
+	if (rc == 0 && ctx->uc_connect) {
+		w  = &ctx->uc_workers[0];
+		rc = connect(w->uw_sock, ctx->uc_ainfo->ai_addr,
+			     ctx->uc_ainfo->ai_addrlen);
+		rc = rc != 0 ? P_ERR(-errno) : 0;
+		rc = rc ?: tp_udp_sock_new(ctx->uc_sport, true, &ctx->uc_lsock);
+		if (rc == 0) {
+			(void)pppoat_io_fd_blocking_set(ctx->uc_lsock, false);
+			tp_udp_sock_tune(ctx, ctx->uc_lsock);
+#ifdef TP_UDP_HAVE_RXQ_OVFL
+			(void)tp_udp_sockopt_set(ctx->uc_lsock, SOL_SOCKET,
+						 SO_RXQ_OVFL, 1);
+#endif
+		} else
+			ctx->uc_lsock = -1;
+	}
+	if (rc == 0)
+		ctx->uc_sock = ctx->uc_workers[0].uw_sock;
+	if (rc == 0 && ctx->uc_spray > 1)
+		rc = tp_udp_spray_open(ctx);
+	if (rc != 0)
+		tp_udp_socks_close(ctx);
+
+	return rc;
+}
+
+static int tp_udp_run(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+	int                rc;
+
+	PPPOAT_ASSERT(tp_udp_ctx_invariant(ctx));
+
+	rc = tp_udp_socks_open(ctx);
+	if (rc == 0 && ctx->uc_pmtud) {
+		rc = tp_udp_pmtud_sock_setup(ctx->uc_sock);
+		if (rc != 0)
+			tp_udp_socks_close(ctx);
+	}
+	if (rc == 0 && tp_udp_is_batched(ctx)) {
+		rc = pipe(ctx->uc_wake);
+		rc = rc == 0 ? 0 : P_ERR(-errno);
+		if (rc == 0) {
+			(void)pppoat_io_fd_blocking_set(ctx->uc_wake[0], false);
+			(void)pppoat_io_fd_blocking_set(ctx->uc_wake[1], false);
+		} else
+			tp_udp_socks_close(ctx);
+	}
+	return rc;
+}
+
+static int tp_udp_stop(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+
+	pppoat_debug("udp", "stopping udp module");
+
+	if (tp_udp_is_batched(ctx)) {
+		(void)pppoat_io_close(ctx->uc_wake[0]);
+		(void)pppoat_io_close(ctx->uc_wake[1]);
+		ctx->uc_wake[0] = -1;
+		ctx->uc_wake[1] = -1;
+	}
+	tp_udp_socks_close(ctx);
+
+	return 0;
+}
+
+static void tp_udp_le64_put(unsigned char *buf, uint64_t val)
+{
+	unsigned i;
+
+	for (i = 0; i < 8; ++i)
+		buf[i] = (unsigned char)(val >> (8 * i));
+}
+
+static uint64_t tp_udp_le64_get(const unsigned char *buf)
+{
+	uint64_t val = 0;
+	unsigned i;
+
+	for (i = 0; i < 8; ++i)
+		val |= (uint64_t)buf[i] << (8 * i);
+	return val;
+}
+
+/**
+ * Appends session, sequence number and tag to the packet.
+ *
+ * With udp.secret, every datagram carries a trailer with a random session
+ * number of the sender, a sequence number and SipHash-2-4 tag of the
+ * payload and the both numbers. Datagrams with invalid tag are dropped.
+ * A sliding window of the last 1024 sequence numbers (per session in the
+ * server mode) drops replayed datagrams and ones which are older than the
+ * window. Sequence numbers start from the current time in nanoseconds, so
+ * a restarted peer isn't taken for a replay.
+ */
+static int tp_udp_auth_seal(struct pppoat_module *mod,
+			    struct pppoat_packet *pkt)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+	unsigned char     *trailer;
+	uint64_t           seq;
+	int                rc;
+
+	rc = pppoat_packet_reserve(mod->m_pkts, pkt,
+				   pkt->pkt_size + TP_UDP_AUTH_SIZE);
+	if (rc != 0)
+		return rc;
+
+	pppoat_mutex_lock(&ctx->uc_tx_seq_lock);
+	seq = ctx->uc_tx_seq++;
+	pppoat_mutex_unlock(&ctx->uc_tx_seq_lock);
+
+	trailer = (unsigned char *)pkt->pkt_data + pkt->pkt_size;
+	tp_udp_le64_put(trailer, ctx->uc_session);
+	tp_udp_le64_put(trailer + 8, seq);
+	tp_udp_le64_put(trailer + 16, pppoat_siphash(&ctx->uc_key,
+						     pkt->pkt_data,
+						     pkt->pkt_size + 16));
+	pkt->pkt_size += TP_UDP_AUTH_SIZE;
+
+	return 0;
+}
+
+/**
+ * Verifies and strips the trailer.
+ *
+ * @return true if the tag is valid.
+ */
+static bool tp_udp_auth_open(struct tp_udp_ctx    *ctx,
+			     struct pppoat_packet *pkt,
+			     uint64_t             *session,
+			     uint64_t             *seq)
+{
+	unsigned char *trailer;
+	size_t         len;
+
+	if (pkt->pkt_size < TP_UDP_AUTH_SIZE)
+		return false;
+	len     = pkt->pkt_size - TP_UDP_AUTH_SIZE;
+	trailer = (unsigned char *)pkt->pkt_data + len;
+	if (pppoat_siphash(&ctx->uc_key, pkt->pkt_data, len + 16) !=
+	    tp_udp_le64_get(trailer + 16))
+		return false;
+
+	*session = tp_udp_le64_get(trailer);
+	*seq     = tp_udp_le64_get(trailer + 8);
+	pkt->pkt_size = len;
+
+	return true;
+}
+
+/** Checks a datagram against the replay window in the client mode. */
+static bool tp_udp_replay_accept(struct tp_udp_ctx *ctx,
+				 uint64_t           seq,
+				 bool              *newest)
+{
+	bool fresh;
+
+	/* Several workers receive from the same peer. */
+	pppoat_mutex_lock(&ctx->uc_replay_lock);
+	fresh = pppoat_replay_check(&ctx->uc_replay, seq, newest);
+	pppoat_mutex_unlock(&ctx->uc_replay_lock);
+
+	return fresh;
+}
+
+/** Seals and sends a control datagram bypassing the send queue. */
+static int tp_udp_ctl_send(struct pppoat_module *mod,
+			   struct pppoat_packet *pkt)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+	ssize_t            slen;
+	int                rc = 0;
+
+	if (ctx->uc_auth)
+		rc = tp_udp_auth_seal(mod, pkt);
+	if (rc == 0) {
+		do {
+			slen = sendto(ctx->uc_sock, pkt->pkt_data,
+				      pkt->pkt_size, 0, ctx->uc_daddr,
+				      ctx->uc_daddrlen);
+		} while (slen < 0 && errno == EINTR);
+		rc = slen < 0 ? -errno : 0;
+	}
+	pppoat_packet_put(mod->m_pkts, pkt);
+
+	return rc;
+}
+
+/**
+ * Sends a probe of `size' bytes including the udp.secret trailer or an
+ * acknowledgement of such a probe.
+ */
+static int tp_udp_pmtud_send(struct pppoat_module   *mod,
+			     enum tp_udp_pmtud_type  type,
+			     size_t                  size)
+{
+	struct tp_udp_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
+	unsigned char        *buf;
+	size_t                auth = ctx->uc_auth ? TP_UDP_AUTH_SIZE : 0;
+	size_t                len;
+
+	len = type == TP_UDP_PMTUD_PROBE ? size - auth : TP_UDP_PMTUD_HDR;
+	pkt = pppoat_packet_get(mod->m_pkts, len);
+	if (pkt == NULL)
+		return P_ERR(-ENOMEM);
+
+	buf = pkt->pkt_data;
+	memset(buf, 0, len);
+	tp_udp_be_put(buf, TP_UDP_PMTUD_MAGIC, 8);
+	buf[8] = (unsigned char)type;
+	tp_udp_be_put(buf + 12, size, 4);
+	pkt->pkt_size = len;
+
+	return tp_udp_ctl_send(mod, pkt);
+}
+
+/** Chooses the next probe. Returns 0 if nothing is to be probed now. */
+static size_t tp_udp_pmtud_next(struct tp_udp_ctx *ctx, uint64_t now)
+{
+	struct tp_udp_pmtud *pm   = &ctx->uc_pm;
+	size_t               auth = ctx->uc_auth ? TP_UDP_AUTH_SIZE : 0;
+
+	if (pm->pm_done && now >= pm->pm_raise && pm->pm_lo < pm->pm_max) {
+		pm->pm_hi   = pm->pm_max;
+		pm->pm_done = false;
+	}
+	if (pm->pm_done && now >= pm->pm_raise)
+		pm->pm_raise = now + TP_UDP_PMTUD_RAISE;
+	if (pm->pm_done)
+		return pm->pm_lo;
+
+	if (pm->pm_lo >= pm->pm_hi) {
+		pm->pm_done  = true;
+		pm->pm_mtu   = pm->pm_lo - auth;
+		pm->pm_raise = now + TP_UDP_PMTUD_RAISE;
+		pm->pm_next  = now + TP_UDP_PMTUD_CONFIRM;
+		pppoat_info("udp", "Path MTU is %zu bytes", pm->pm_lo);
+		return 0;
+	}
+	/* The maximum is the common case, try it before bisecting. */
+	return pm->pm_hi == pm->pm_max ? pm->pm_hi :
+	       pm->pm_lo + (pm->pm_hi - pm->pm_lo + 1) / 2;
+}
+
+/** The probe in flight got no answer. */
+static void tp_udp_pmtud_lost(struct tp_udp_ctx *ctx, bool final)
+{
+	struct tp_udp_pmtud *pm   = &ctx->uc_pm;
+	size_t               auth = ctx->uc_auth ? TP_UDP_AUTH_SIZE : 0;
+
+	if (!final && pm->pm_probes_nr < TP_UDP_PMTUD_PROBES)
+		return;
+
+	if (pm->pm_done) {
+		pppoat_info("udp", "Path MTU %zu is not confirmed, falling "
+			    "back to %d bytes", pm->pm_lo, TP_UDP_PMTUD_BASE);
+		pm->pm_lo   = TP_UDP_PMTUD_BASE;
+		pm->pm_hi   = pm->pm_max;
+		pm->pm_mtu  = pm->pm_lo - auth;
+		pm->pm_done = false;
+	} else
+		pm->pm_hi = pm->pm_probe - 1;
+	pm->pm_probe     = 0;
+	pm->pm_probes_nr = 0;
+}
+
+static void tp_udp_pmtud_ack(struct tp_udp_ctx *ctx, size_t size)
+{
+	struct tp_udp_pmtud *pm  = &ctx->uc_pm;
+	uint64_t             now = tp_udp_now();
+
+	pppoat_mutex_lock(&pm->pm_lock);
+	if (pm->pm_probe != 0 && size == pm->pm_probe) {
+		pm->pm_lo        = pppoat_max(pm->pm_lo, size);
+		pm->pm_probe     = 0;
+		pm->pm_probes_nr = 0;
+		pm->pm_next      = pm->pm_done ? now + TP_UDP_PMTUD_CONFIRM :
+						 now;
+	}
+	pppoat_mutex_unlock(&pm->pm_lock);
+}
+
+/**
+ * Drives the search. Called by the first worker before waiting for data.
+ *
+ * The search starts from udp.pmtud_max and continues as binary search
+ * between the largest confirmed size and the smallest failed one. A size
+ * fails after 3 probes without answer or when the kernel rejects it. Once
+ * the search is finished, the module confirms the size every 30 seconds
+ * and falls back to 1200 bytes if the confirmation fails, e.g. when the
+ * route has changed. An attempt to raise the size is made every 10
+ * minutes.
+ *
+ * @return Time in ms until the next call.
+ */
+static long tp_udp_pmtud_tick(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx   *ctx = mod->m_userdata;
+	struct tp_udp_pmtud *pm  = &ctx->uc_pm;
+	uint64_t             now = tp_udp_now();
+	size_t               size = 0;
+	long                 timeout;
+	int                  rc;
+
+	pppoat_mutex_lock(&pm->pm_lock);
+	if (now >= pm->pm_next && pm->pm_probe != 0)
+		tp_udp_pmtud_lost(ctx, false);
+	if (now >= pm->pm_next) {
+		size = pm->pm_probe ?: tp_udp_pmtud_next(ctx, now);
+		pm->pm_probe = size;
+	}
+	if (size != 0) {
+		++pm->pm_probes_nr;
+		pm->pm_next = now + TP_UDP_PMTUD_TIMEOUT;
+	}
+	pppoat_mutex_unlock(&pm->pm_lock);
+
+	if (size != 0) {
+		rc = tp_udp_pmtud_send(mod, TP_UDP_PMTUD_PROBE, size);
+		if (rc == -EMSGSIZE) {
+			/* Larger than MTU of the local interface. */
+			pppoat_mutex_lock(&pm->pm_lock);
+			if (pm->pm_probe == size) {
+				tp_udp_pmtud_lost(ctx, true);
+				pm->pm_next = now;
+			}
+			pppoat_mutex_unlock(&pm->pm_lock);
+		} else if (rc != 0)
+			pppoat_debug("udp", "Couldn't send probe (rc=%d)", rc);
+	}
+
+	pppoat_mutex_lock(&pm->pm_lock);
+	timeout = pm->pm_next > now ? (long)(pm->pm_next - now) : 0;
+	pppoat_mutex_unlock(&pm->pm_lock);
+
+	return timeout;
+}
+
+/**
+ * Sends an echo request or a reply. The reply repeats sequence number and
+ * t1 of the request and carries its receive time t2.
+ */
+static int tp_udp_echo_send(struct pppoat_module   *mod,
+			    enum tp_udp_pmtud_type  type,
+			    uint32_t                seq,
+			    uint64_t                t1,
+			    uint64_t                t2)
+{
+	struct pppoat_packet *pkt;
+	unsigned char        *buf;
+
+	pkt = pppoat_packet_get(mod->m_pkts, TP_UDP_ECHO_SIZE);
+	if (pkt == NULL)
+		return P_ERR(-ENOMEM);
+
+	buf = pkt->pkt_data;
+	memset(buf, 0, TP_UDP_ECHO_SIZE);
+	tp_udp_be_put(buf, TP_UDP_PMTUD_MAGIC, 8);
+	buf[8] = (unsigned char)type;
+	tp_udp_be_put(buf + 12, seq, 4);
+	tp_udp_be_put(buf + 16, t1, 8);
+	tp_udp_be_put(buf + 24, t2, 8);
+	tp_udp_be_put(buf + 32, tp_udp_realtime(), 8);
+	pkt->pkt_size = TP_UDP_ECHO_SIZE;
+
+	return tp_udp_ctl_send(mod, pkt);
+}
+
+/**
+ * Sends the next echo request. Called by the first worker before waiting
+ * for data.
+ *
+ * @return Time in ms until the next call.
+ */
+static long tp_udp_probe_tick(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx   *ctx = mod->m_userdata;
+	struct tp_udp_probe *pr  = &ctx->uc_probe;
+	uint64_t             now = tp_udp_now();
+	uint32_t             seq = 0;
+	bool                 lost = false;
+	bool                 send = false;
+	long                 timeout;
+	int                  rc;
+
+	pppoat_mutex_lock(&pr->pr_lock);
+	if (now >= pr->pr_next) {
+		lost = pr->pr_pending;
+		seq  = ++pr->pr_seq;
+		send = true;
+		pr->pr_pending = true;
+		pr->pr_next    = now + pr->pr_ival;
+	}
+	timeout = (long)(pr->pr_next - now);
+	pppoat_mutex_unlock(&pr->pr_lock);
+
+	if (lost)
+		pppoat_rtt_loss_sample(&pr->pr_rtt, true);
+	if (send) {
+		rc = tp_udp_echo_send(mod, TP_UDP_ECHO_REQ, seq,
+				      tp_udp_realtime(), 0);
+		if (rc != 0)
+			pppoat_debug("udp", "Couldn't send echo (rc=%d)", rc);
+	}
+	return timeout;
+}
+
+/** Handles an echo datagram received at `t4' us. */
+static void tp_udp_echo_recv(struct pppoat_module *mod,
+			     const unsigned char  *buf,
+			     uint64_t              t4)
+{
+	struct tp_udp_ctx   *ctx = mod->m_userdata;
+	struct tp_udp_probe *pr  = &ctx->uc_probe;
+	uint32_t             seq = (uint32_t)tp_udp_be_get(buf + 12, 4);
+	uint64_t             t1  = tp_udp_be_get(buf + 16, 8);
+	uint64_t             t2  = tp_udp_be_get(buf + 24, 8);
+	uint64_t             t3  = tp_udp_be_get(buf + 32, 8);
+	bool                 match;
+
+	if (buf[8] == TP_UDP_ECHO_REQ) {
+		(void)tp_udp_echo_send(mod, TP_UDP_ECHO_REP, seq, t1, t4);
+		return;
+	}
+
+	pppoat_mutex_lock(&pr->pr_lock);
+	match = pr->pr_pending && seq == pr->pr_seq;
+	if (match)
+		pr->pr_pending = false;
+	pppoat_mutex_unlock(&pr->pr_lock);
+
+	/* Late replies are already counted as lost. */
+	if (!match || t4 < t1 || t3 < t2 || t4 - t1 < t3 - t2)
+		return;
+	pppoat_rtt_sample(&pr->pr_rtt, (t4 - t1) - (t3 - t2));
+	pppoat_rtt_owd_sample(&pr->pr_rtt, t1, t2);
+	pppoat_rtt_loss_sample(&pr->pr_rtt, false);
+}
+
+/**
+ * Handles a PMTUD or echo datagram after udp.secret trailer is stripped.
+ * `tstamp' is the receive time in us or 0 if unknown.
+ *
+ * @return true if the packet is a control datagram and must be dropped.
+ */
+static bool tp_udp_ctl_recv(struct pppoat_module *mod,
+			    struct pppoat_packet *pkt,
+			    uint64_t              tstamp)
+{
+	struct tp_udp_ctx   *ctx = mod->m_userdata;
+	const unsigned char *buf = pkt->pkt_data;
+	size_t               size;
+	size_t               wire;
+
+	if ((!ctx->uc_pmtud && ctx->uc_probe.pr_ival == 0) ||
+	    pkt->pkt_size < TP_UDP_PMTUD_HDR ||
+	    tp_udp_be_get(buf, 8) != TP_UDP_PMTUD_MAGIC)
+		return false;
+
+	wire = pkt->pkt_size + (ctx->uc_auth ? TP_UDP_AUTH_SIZE : 0);
+	size = (size_t)tp_udp_be_get(buf + 12, 4);
+	if (buf[8] == TP_UDP_PMTUD_PROBE && size == wire && ctx->uc_pmtud)
+		(void)tp_udp_pmtud_send(mod, TP_UDP_PMTUD_ACK, size);
+	else if (buf[8] == TP_UDP_PMTUD_ACK && ctx->uc_pmtud)
+		tp_udp_pmtud_ack(ctx, size);
+	else if ((buf[8] == TP_UDP_ECHO_REQ || buf[8] == TP_UDP_ECHO_REP) &&
+		 pkt->pkt_size >= TP_UDP_ECHO_SIZE &&
+		 ctx->uc_probe.pr_ival != 0)
+		tp_udp_echo_recv(mod, buf, tstamp ?: tp_udp_realtime());
+
+	return true;
+}
+
+/**
+ * Authenticates a datagram received from the peer. Invalid or replayed
+ * datagram is released and *pkt is set to NULL. In the server mode, a valid
+ * datagram updates the peers and routes.
+ */
+static void tp_udp_pkt_accept(struct pppoat_module  *mod,
+			      struct pppoat_packet **pkt,
+			      const struct sockaddr *from,
+			      socklen_t              fromlen,
+			      uint64_t               tstamp)
+{
+	struct tp_udp_ctx  *ctx = mod->m_userdata;
+	struct pppoat_peer *peer = NULL;
+	uint64_t            session = 0;
+	uint64_t            seq = 0;
+	bool                newest = false;
+	int                 rc = 0;
+
+	if (*pkt == NULL)
+		return;
+
+	if (ctx->uc_auth && !tp_udp_auth_open(ctx, *pkt, &session, &seq)) {
+		pppoat_debug("udp", "Dropping datagram with invalid tag");
+		goto drop;
+	}
+	if (ctx->uc_server && ctx->uc_auth) {
+		rc = pppoat_peers_accept(&ctx->uc_peers, from, fromlen,
+					 session, seq, tp_udp_now(), &peer,
+					 &newest);
+	} else if (ctx->uc_server) {
+		rc = pppoat_peers_get(&ctx->uc_peers, from, fromlen,
+				      tp_udp_now(), &peer);
+	} else if (ctx->uc_auth && !tp_udp_replay_accept(ctx, seq, &newest))
+		rc = -EALREADY;
+	if (rc == -EALREADY) {
+		pppoat_debug("udp", "Dropping replayed datagram");
+		goto drop;
+	}
+	if (rc != 0)
+		pppoat_debug("udp", "Couldn't add peer (rc=%d)", rc);
+	/* Without peer, an authenticated datagram can't be checked. */
+	if (rc != 0 && ctx->uc_auth)
+		goto drop;
+	if (tp_udp_ctl_recv(mod, *pkt, tstamp))
+		goto drop;
+	/*
+	 * Only the newest authenticated datagram takes the route from another
+	 * peer, so a client which has restarted at a new address gets its
+	 * traffic back while replays and stale datagrams don't move it.
+	 */
+	if (peer != NULL)
+		tp_udp_route_learn(ctx, *pkt, peer, ctx->uc_auth && newest);
+	return;
+
+drop:
+	pppoat_packet_put(mod->m_pkts, *pkt);
+	*pkt = NULL;
+}
+
+/**
+ * Parses control messages of a received datagram. Updates drop counter of
+ * the socket, stores receive time in us or 0 to `tstamp' and returns GRO
+ * segment size or 0.
+ */
+static size_t tp_udp_cmsg_parse(uint32_t      *drops,
+				struct msghdr *msg,
+				uint64_t      *tstamp)
+{
+	struct cmsghdr *cmsg;
+	size_t          seg = 0;
+#ifdef TP_UDP_HAVE_GRO
+	int             val;
+#endif
+#ifdef TP_UDP_HAVE_TSTAMP
+	struct timespec ts[3];
+#endif
+
+	*tstamp = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef TP_UDP_HAVE_GRO
+		if (cmsg->cmsg_level == IPPROTO_UDP &&
+		    cmsg->cmsg_type == UDP_GRO) {
+			memcpy(&val, CMSG_DATA(cmsg), sizeof val);
+			seg = val > 0 ? (size_t)val : 0;
+		}
+#endif /* TP_UDP_HAVE_GRO */
+#ifdef TP_UDP_HAVE_RXQ_OVFL
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(drops, CMSG_DATA(cmsg), sizeof *drops);
+#endif /* TP_UDP_HAVE_RXQ_OVFL */
+#ifdef TP_UDP_HAVE_TSTAMP
+		/* Software timestamp is the first of three. */
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			memcpy(ts, CMSG_DATA(cmsg), sizeof ts);
+			*tstamp = (uint64_t)ts[0].tv_sec * 1000000 +
+				  (uint64_t)ts[0].tv_nsec / 1000;
+		}
+#endif /* TP_UDP_HAVE_TSTAMP */
+	}
+	return seg;
+}
+
+static void tp_udp_roam(struct tp_udp_ctx     *ctx,
+			struct sockaddr       *addr,
+			socklen_t              addrlen)
+{
+	char host[NI_MAXHOST];
+	char serv[NI_MAXSERV];
+	int  rc;
+
+	rc = connect(ctx->uc_sock, addr, addrlen);
+	if (rc != 0) {
+		pppoat_error("udp", "Couldn't re-connect to the new peer "
+			     "address (errno=%d)", errno);
+		return;
+	}
+	rc = getnameinfo(addr, addrlen, host, sizeof host, serv, sizeof serv,
+			 NI_NUMERICHOST | NI_NUMERICSERV);
+	if (rc == 0)
+		pppoat_info("udp", "Peer moved to %s port %s", host, serv);
+}
+
+/**
+ * Receives a datagram from the unconnected socket in the connected mode.
+ *
+ * With udp.connect, the socket is connected to the peer, so the kernel
+ * doesn't look up route for every datagram and delivers to the socket only
+ * datagrams from the peer. The unconnected socket is bound to the same
+ * port and receives datagrams from other addresses. A valid datagram from
+ * a new address with sequence number greater than any seen before makes
+ * the module re-connect to that address, so the peer may change its
+ * address and the tunnel survives. Without udp.secret such a datagram is
+ * accepted as before, but the module doesn't follow the new address.
+ */
+static int tp_udp_roam_recv(struct pppoat_module  *mod,
+			    struct pppoat_packet **pkt)
+{
+	struct tp_udp_ctx       *ctx = mod->m_userdata;
+	struct pppoat_packet    *pkt2;
+	struct sockaddr_storage  from;
+	union tp_udp_cmsg        cbuf;
+	struct iovec             iov;
+	struct msghdr            msg;
+	ssize_t                  rlen;
+	uint64_t                 tstamp;
+	uint64_t                 session;
+	uint64_t                 seq;
+	bool                     newest;
+
+	*pkt = NULL;
+	pkt2 = pppoat_packet_get(mod->m_pkts, ctx->uc_rx_size);
+	if (pkt2 == NULL)
+		return P_ERR(-ENOMEM);
+
+	iov = (struct iovec){
+		.iov_base = pkt2->pkt_data,
+		.iov_len  = pkt2->pkt_size,
+	};
+	msg = (struct msghdr){
+		.msg_name       = &from,
+		.msg_namelen    = sizeof from,
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = cbuf.uc_buf,
+		.msg_controllen = sizeof cbuf.uc_buf,
+	};
+	do {
+		rlen = recvmsg(ctx->uc_lsock, &msg, 0);
+	} while (rlen < 0 && errno == EINTR);
+	if (rlen <= 0) {
+		pppoat_packet_put(mod->m_pkts, pkt2);
+		return rlen < 0 && !pppoat_io_error_is_recoverable(-errno) ?
+		       P_ERR(-errno) : 0;
+	}
+	pkt2->pkt_size = (size_t)rlen;
+	(void)tp_udp_cmsg_parse(&ctx->uc_lsock_drops, &msg, &tstamp);
+
+	if (ctx->uc_auth) {
+		if (!tp_udp_auth_open(ctx, pkt2, &session, &seq)) {
+			pppoat_debug("udp", "Dropping datagram with invalid "
+				     "tag from unknown address");
+			pppoat_packet_put(mod->m_pkts, pkt2);
+			return 0;
+		}
+		if (!tp_udp_replay_accept(ctx, seq, &newest)) {
+			pppoat_debug("udp", "Dropping replayed datagram from "
+				     "unknown address");
+			pppoat_packet_put(mod->m_pkts, pkt2);
+			return 0;
+		}
+		if (newest)
+			tp_udp_roam(ctx, (struct sockaddr *)&from,
+				    msg.msg_namelen);
+	}
+	if (tp_udp_ctl_recv(mod, pkt2, tstamp)) {
+		pppoat_packet_put(mod->m_pkts, pkt2);
+		return 0;
+	}
+	pkt2->pkt_type = PPPOAT_PACKET_RECV;
+	*pkt = pkt2;
+
+	return 0;
+}
+
+/**
+ * Waits until a descriptor of the worker becomes readable. The first worker
+ * also waits for the wake pipe, the unconnected socket and spraying sockets
+ * if they exist and wakes up for PMTUD and probe timers.
+ */
+static int tp_udp_wait(struct pppoat_module *mod,
+		       struct tp_udp_worker *w,
+		       fd_set               *rfds)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+	long               timeout = -1;
+	long               ptimeout;
+	unsigned           i;
+	int                maxfd = w->uw_sock;
+
+	FD_ZERO(rfds);
+	FD_SET(w->uw_sock, rfds);
+	if (tp_udp_worker_is_first(ctx, w) && ctx->uc_wake[0] >= 0) {
+		FD_SET(ctx->uc_wake[0], rfds);
+		maxfd = pppoat_max(maxfd, ctx->uc_wake[0]);
+	}
+	if (tp_udp_worker_is_first(ctx, w) && ctx->uc_lsock >= 0) {
+		FD_SET(ctx->uc_lsock, rfds);
+		maxfd = pppoat_max(maxfd, ctx->uc_lsock);
+	}
+	for (i = 1; tp_udp_worker_is_first(ctx, w) &&
+		    ctx->uc_spray_socks != NULL && i < ctx->uc_spray; ++i) {
+		FD_SET(ctx->uc_spray_socks[i], rfds);
+		maxfd = pppoat_max(maxfd, ctx->uc_spray_socks[i]);
+	}
+	if (tp_udp_worker_is_first(ctx, w) && ctx->uc_pmtud)
+		timeout = tp_udp_pmtud_tick(mod);
+	if (tp_udp_worker_is_first(ctx, w) && ctx->uc_probe.pr_ival != 0) {
+		ptimeout = tp_udp_probe_tick(mod);
+		timeout  = timeout < 0 ? ptimeout :
+			   pppoat_min(timeout, ptimeout);
+	}
+	return pppoat_io_select_timeout(maxfd, rfds, NULL, timeout);
+}
+
+static bool tp_udp_lsock_is_ready(struct tp_udp_ctx    *ctx,
+				  struct tp_udp_worker *w,
+				  fd_set               *rfds)
+{
+	return tp_udp_worker_is_first(ctx, w) && ctx->uc_lsock >= 0 &&
+	       FD_ISSET(ctx->uc_lsock, rfds);
+}
+
+/** Returns a readable spraying socket if the worker serves them or -1. */
+static int tp_udp_spray_ready(struct tp_udp_ctx    *ctx,
+			      struct tp_udp_worker *w,
+			      fd_set               *rfds)
+{
+	unsigned i;
+
+	for (i = 1; tp_udp_worker_is_first(ctx, w) &&
+		    ctx->uc_spray_socks != NULL && i < ctx->uc_spray; ++i)
+		if (FD_ISSET(ctx->uc_spray_socks[i], rfds))
+			return ctx->uc_spray_socks[i];
+	return -1;
+}
+
+/** Receives a single datagram from a readable socket of the worker. */
+static int tp_udp_recv_one(struct pppoat_module  *mod,
+			   struct tp_udp_worker  *w,
+			   int                    sock,
+			   struct pppoat_packet **pkt)
+{
+	struct tp_udp_ctx       *ctx = mod->m_userdata;
+	struct pppoat_packet    *pkt2;
+	struct sockaddr_storage  from;
+	union tp_udp_cmsg        cbuf;
+	struct iovec             iov;
+	struct msghdr            msg;
+	ssize_t                  rlen;
+	uint64_t                 tstamp = 0;
+	int                      rc;
+
+	pkt2 = pppoat_packet_get(mod->m_pkts, ctx->uc_rx_size);
+	rc   = pkt2 == NULL ? P_ERR(-ENOMEM) : 0;
+	if (rc == 0) {
+		iov = (struct iovec){
+			.iov_base = pkt2->pkt_data,
+			.iov_len  = pkt2->pkt_size,
+		};
+		msg = (struct msghdr){
+			.msg_name       = &from,
+			.msg_namelen    = sizeof from,
+			.msg_iov        = &iov,
+			.msg_iovlen     = 1,
+			.msg_control    = cbuf.uc_buf,
+			.msg_controllen = sizeof cbuf.uc_buf,
+		};
+		rlen = recvmsg(sock, &msg, 0);
+		if (rlen < 0 && !pppoat_io_error_is_recoverable(-errno))
+			rc = P_ERR(-errno);
+		rc = rc ?: (rlen <= 0 ? -EAGAIN : 0); /* XXX */
+		if (rlen > 0) {
+			pkt2->pkt_size = rlen;
+			(void)tp_udp_cmsg_parse(&w->uw_drops, &msg, &tstamp);
+		}
+	}
+	if (rc != 0 && pkt2 != NULL)
+		pppoat_packet_put(mod->m_pkts, pkt2);
+
+	if (rc == 0) {
+		pkt2->pkt_type = PPPOAT_PACKET_RECV;
+		*pkt = pkt2;
+		tp_udp_pkt_accept(mod, pkt, (struct sockaddr *)&from,
+				  msg.msg_namelen, tstamp);
+	}
+	return rc;
+}
+
+static int tp_udp_pkt_get(struct pppoat_module  *mod,
+			  struct tp_udp_worker  *w,
+			  struct pppoat_packet **pkt)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+	fd_set             rfds;
+	int                sock;
+	int                rc;
+
+	*pkt = NULL;
+	rc = tp_udp_wait(mod, w, &rfds);
+	if (rc == 0 && tp_udp_lsock_is_ready(ctx, w, &rfds))
+		return tp_udp_roam_recv(mod, pkt);
+	sock = rc == 0 ? tp_udp_spray_ready(ctx, w, &rfds) : -1;
+	if (sock >= 0)
+		return tp_udp_recv_one(mod, w, sock, pkt);
+	if (rc != 0 || !FD_ISSET(w->uw_sock, &rfds))
+		return rc;
+
+	return tp_udp_recv_one(mod, w, w->uw_sock, pkt);
+}
+
+static int tp_udp_pkt_send(struct tp_udp_ctx    *ctx,
+			   struct pppoat_packet *pkt)
+{
+	const struct sockaddr *daddr;
+	socklen_t              daddrlen;
+	unsigned char         *buf  = pkt->pkt_data;
+	size_t                 len  = pkt->pkt_size;
+	int                    sock = tp_udp_pkt_sock(ctx, pkt);
+	ssize_t                slen = 0;
+	int                    rc   = 0;
+
+	daddr = tp_udp_pkt_daddr(ctx, pkt, &daddrlen);
+	do {
+		slen = sendto(sock, buf, len, 0, daddr, daddrlen);
+		if (slen < 0 && errno == EINTR)
+			continue;
+		if (slen < 0 && !pppoat_io_error_is_recoverable(-errno))
+			rc = P_ERR(-errno);
+		if (slen < 0 && pppoat_io_error_is_recoverable(-errno))
+			rc = pppoat_io_select_single_write(sock);
+		if (slen > 0) {
+			buf += slen;
+			len -= slen;
+		}
+	} while (rc == 0 && len > 0);
+
+	return rc;
+}
+
+static void tp_udp_wake_drain(struct tp_udp_ctx *ctx)
+{
+	char    buf[64];
+	ssize_t rlen;
+
+	do {
+		rlen = read(ctx->uc_wake[0], buf, sizeof buf);
+	} while (rlen > 0 || (rlen < 0 && errno == EINTR));
+}
+
+static void tp_udp_wake(struct tp_udp_ctx *ctx)
+{
+	ssize_t wlen;
+
+	do {
+		wlen = write(ctx->uc_wake[1], "w", 1);
+	} while (wlen < 0 && errno == EINTR);
+	/* Full pipe means that the thread is going to wake up anyway. */
+	if (wlen < 0 && !pppoat_io_error_is_recoverable(-errno))
+		pppoat_error("udp", "Couldn't wake up the thread (errno=%d)",
+			     errno);
+}
+
+/**
+ * Receives up to ctx->uc_batch datagrams without blocking.
+ *
+ * Packets are taken from the pool only for the empty slots, so the slots
+ * which didn't receive data are reused by the next call.
+ */
+static int tp_udp_recv_batch(struct pppoat_module *mod,
+			     struct tp_udp_worker *w)
+{
+	struct tp_udp_ctx   *ctx = mod->m_userdata;
+	struct tp_udp_batch *rx  = &w->uw_rx;
+	unsigned             nr;
+	unsigned             i;
+	ssize_t              rlen;
+	int                  rc = 0;
+
+	for (nr = 0; nr < ctx->uc_batch; ++nr) {
+		if (rx->ub_pkts[nr] == NULL)
+			rx->ub_pkts[nr] = pppoat_packet_get(mod->m_pkts,
+							    ctx->uc_rx_size);
+		if (rx->ub_pkts[nr] == NULL)
+			break;
+		rx->ub_iov[nr].iov_base = rx->ub_pkts[nr]->pkt_data;
+		rx->ub_iov[nr].iov_len  = rx->ub_pkts[nr]->pkt_size;
+		rx->ub_segs[nr] = 0;
+		rx->ub_tstamps[nr] = 0;
+	}
+	if (nr == 0)
+		return P_ERR(-ENOMEM);
+
+#ifdef TP_UDP_HAVE_MMSG
+	for (i = 0; i < nr; ++i) {
+		memset(&rx->ub_msgs[i], 0, sizeof rx->ub_msgs[i]);
+		rx->ub_msgs[i].msg_hdr.msg_iov    = &rx->ub_iov[i];
+		rx->ub_msgs[i].msg_hdr.msg_iovlen = 1;
+		if (ctx->uc_server) {
+			rx->ub_msgs[i].msg_hdr.msg_name    = &rx->ub_addrs[i];
+			rx->ub_msgs[i].msg_hdr.msg_namelen =
+						sizeof rx->ub_addrs[i];
+		}
+		rx->ub_msgs[i].msg_hdr.msg_control = rx->ub_cmsg[i].uc_buf;
+		rx->ub_msgs[i].msg_hdr.msg_controllen =
+					sizeof rx->ub_cmsg[i].uc_buf;
+	}
+	do {
+		rlen = recvmmsg(w->uw_sock, rx->ub_msgs, nr, MSG_DONTWAIT,
+				NULL);
+	} while (rlen < 0 && errno == EINTR);
+	if (rlen < 0 && !pppoat_io_error_is_recoverable(-errno))
+		rc = P_ERR(-errno);
+	nr = rlen > 0 ? (unsigned)rlen : 0;
+	for (i = 0; i < nr; ++i) {
+		rx->ub_pkts[i]->pkt_size = rx->ub_msgs[i].msg_len;
+		rx->ub_segs[i] = tp_udp_cmsg_parse(&w->uw_drops,
+						   &rx->ub_msgs[i].msg_hdr,
+						   &rx->ub_tstamps[i]);
+		rx->ub_addrlens[i] = rx->ub_msgs[i].msg_hdr.msg_namelen;
+	}
+#else /* TP_UDP_HAVE_MMSG */
+	i = 0;
+	while (i < nr) {
+		rx->ub_addrlens[i] = sizeof rx->ub_addrs[i];
+		rlen = recvfrom(w->uw_sock, rx->ub_iov[i].iov_base,
+				rx->ub_iov[i].iov_len, MSG_DONTWAIT,
+				(struct sockaddr *)&rx->ub_addrs[i],
+				&rx->ub_addrlens[i]);
+		if (rlen < 0 && errno == EINTR)
+			continue;
+		if (rlen < 0 && !pppoat_io_error_is_recoverable(-errno))
+			rc = P_ERR(-errno);
+		if (rlen < 0)
+			break;
+		rx->ub_pkts[i++]->pkt_size = (size_t)rlen;
+	}
+	nr = i;
+#endif /* TP_UDP_HAVE_MMSG */
+
+	rx->ub_nr  = nr;
+	rx->ub_pos = 0;
+	rx->ub_off = 0;
+
+	return rc;
+}
+
+#ifdef TP_UDP_HAVE_GSO
+/**
+ * Returns number of packets starting from the first one which can be sent
+ * as a single GSO buffer. All datagrams must have the same size except the
+ * last one, which may be shorter, and the same peer in the server mode.
+ */
+static unsigned tp_udp_gso_group(struct pppoat_packet **pkts,
+				 const int             *socks,
+				 unsigned               nr)
+{
+	size_t   seg = pkts[0]->pkt_size;
+	size_t   total = seg;
+	unsigned i;
+
+	for (i = 1; i < nr && i < TP_UDP_GSO_SEGS; ++i) {
+		if (pkts[i]->pkt_size > seg || pkts[i]->pkt_size == 0 ||
+		    total + pkts[i]->pkt_size > TP_UDP_GSO_SIZE ||
+		    pkts[i]->pkt_userdata != pkts[0]->pkt_userdata ||
+		    socks[i] != socks[0])
+			break;
+		total += pkts[i]->pkt_size;
+		if (pkts[i]->pkt_size < seg) {
+			++i;
+			break;
+		}
+	}
+	return i;
+}
+
+static void tp_udp_gso_cmsg_set(struct msghdr     *msg,
+				union tp_udp_cmsg *cbuf,
+				uint16_t           seg)
+{
+	struct cmsghdr *cmsg;
+
+	msg->msg_control    = cbuf->uc_buf;
+	msg->msg_controllen = CMSG_SPACE(sizeof seg);
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = IPPROTO_UDP;
+	cmsg->cmsg_type  = UDP_SEGMENT;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof seg);
+	memcpy(CMSG_DATA(cmsg), &seg, sizeof seg);
+}
+#endif /* TP_UDP_HAVE_GSO */
+
+#ifdef TP_UDP_HAVE_MMSG
+/**
+ * Fills tx->ub_msgs for nr packets from tx->ub_pkts.
+ *
+ * @return Number of messages. It's less than nr when GSO groups packets.
+ */
+static unsigned tp_udp_tx_msgs_build(struct tp_udp_ctx *ctx, unsigned nr)
+{
+	struct tp_udp_batch *tx = &ctx->uc_tx;
+	struct msghdr       *msg;
+	unsigned             msgs_nr = 0;
+	unsigned             grp;
+	unsigned             i;
+
+	for (i = 0; i < nr; i += grp) {
+		grp = 1;
+#ifdef TP_UDP_HAVE_GSO
+		if (ctx->uc_gso)
+			grp = tp_udp_gso_group(&tx->ub_pkts[i],
+					       &tx->ub_socks[i], nr - i);
+#endif
+		memset(&tx->ub_msgs[msgs_nr], 0, sizeof tx->ub_msgs[msgs_nr]);
+		msg = &tx->ub_msgs[msgs_nr].msg_hdr;
+		msg->msg_name    = (void *)tp_udp_pkt_daddr(ctx, tx->ub_pkts[i],
+							    &msg->msg_namelen);
+		msg->msg_iov     = &tx->ub_iov[i];
+		msg->msg_iovlen  = grp;
+#ifdef TP_UDP_HAVE_GSO
+		if (grp > 1)
+			tp_udp_gso_cmsg_set(msg, &tx->ub_cmsg[msgs_nr],
+					    tx->ub_pkts[i]->pkt_size);
+#endif
+		++msgs_nr;
+	}
+	return msgs_nr;
+}
+
+static int tp_udp_msg_sock(struct tp_udp_ctx *ctx, unsigned pos)
+{
+	struct tp_udp_batch *tx = &ctx->uc_tx;
+
+	return tx->ub_socks[tx->ub_msgs[pos].msg_hdr.msg_iov - tx->ub_iov];
+}
+
+/**
+ * Splits a GSO message which the kernel refused (e.g. segment doesn't fit
+ * into the path MTU) into separate messages. The message array is rebuilt
+ * from the message's first packet without GSO.
+ */
+static unsigned tp_udp_tx_msgs_split(struct tp_udp_ctx *ctx,
+				     unsigned           pos,
+				     unsigned           nr)
+{
+	struct tp_udp_batch *tx = &ctx->uc_tx;
+	struct msghdr       *msg;
+	unsigned             first;
+	unsigned             i;
+
+	first = tx->ub_msgs[pos].msg_hdr.msg_iov - tx->ub_iov;
+	for (i = 0; first + i < nr; ++i) {
+		memset(&tx->ub_msgs[pos + i], 0, sizeof tx->ub_msgs[pos + i]);
+		msg = &tx->ub_msgs[pos + i].msg_hdr;
+		msg->msg_name    = (void *)tp_udp_pkt_daddr(ctx,
+						tx->ub_pkts[first + i],
+						&msg->msg_namelen);
+		msg->msg_iov     = &tx->ub_iov[first + i];
+		msg->msg_iovlen  = 1;
+	}
+	return pos + i;
+}
+#endif /* TP_UDP_HAVE_MMSG */
+
+static int tp_udp_send_batch(struct tp_udp_ctx *ctx, unsigned nr)
+{
+	struct tp_udp_batch *tx = &ctx->uc_tx;
+	unsigned             pkts_nr = nr;
+	unsigned             pos = 0;
+	unsigned             i;
+	ssize_t              slen;
+	int                  sock;
+	int                  rc = 0;
+#ifdef TP_UDP_HAVE_MMSG
+	unsigned             run;
+#else
+	const struct sockaddr *daddr;
+	socklen_t              daddrlen;
+#endif
+
+	for (i = 0; i < nr; ++i) {
+		tx->ub_iov[i].iov_base = tx->ub_pkts[i]->pkt_data;
+		tx->ub_iov[i].iov_len  = tx->ub_pkts[i]->pkt_size;
+		tx->ub_socks[i] = tp_udp_pkt_sock(ctx, tx->ub_pkts[i]);
+	}
+#ifdef TP_UDP_HAVE_MMSG
+	nr = tp_udp_tx_msgs_build(ctx, nr);
+#endif
+
+	while (rc == 0 && pos < nr) {
+#ifdef TP_UDP_HAVE_MMSG
+		/* A single call carries consecutive messages of one socket. */
+		sock = tp_udp_msg_sock(ctx, pos);
+		for (run = 1; pos + run < nr &&
+			      tp_udp_msg_sock(ctx, pos + run) == sock; ++run);
+		slen = sendmmsg(sock, &tx->ub_msgs[pos], run, 0);
+		if (slen < 0 && (errno == EINVAL || errno == EMSGSIZE ||
+				 errno == EIO) &&
+		    tx->ub_msgs[pos].msg_hdr.msg_control != NULL) {
+			/* Only the flushing thread reads uc_gso. */
+			pppoat_info("udp", "GSO send failed (errno=%d), "
+				    "disabling.", errno);
+			ctx->uc_gso = false;
+			nr = tp_udp_tx_msgs_split(ctx, pos, pkts_nr);
+			continue;
+		}
+#else
+		sock  = tx->ub_socks[pos];
+		daddr = tp_udp_pkt_daddr(ctx, tx->ub_pkts[pos], &daddrlen);
+		slen  = sendto(sock, tx->ub_iov[pos].iov_base,
+			       tx->ub_iov[pos].iov_len, 0, daddr, daddrlen);
+		slen = slen < 0 ? slen : 1;
+#endif
+		if (slen < 0 && errno == EINTR)
+			continue;
+		if (slen < 0 && !pppoat_io_error_is_recoverable(-errno))
+			rc = P_ERR(-errno);
+		if (slen < 0 && pppoat_io_error_is_recoverable(-errno))
+			rc = pppoat_io_select_single_write(sock);
+		if (slen > 0)
+			pos += (unsigned)slen;
+	}
+	return rc;
+}
+
+/**
+ * Sends all packets from the outbound queue. Called only from the module's
+ * blocking thread, so the datagrams leave in the order they were queued.
+ * The caller of tp_udp_txq_add() wakes up the thread only when the queue is
+ * empty, so under load the thread keeps draining the queue and every
+ * sendmmsg(2) carries multiple datagrams without adding artificial delay.
+ */
+static void tp_udp_txq_flush(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx    *ctx = mod->m_userdata;
+	struct pppoat_packet *pkt;
+	unsigned              nr;
+	unsigned              i;
+	int                   rc;
+
+	do {
+		pppoat_mutex_lock(&ctx->uc_txq_lock);
+		for (nr = 0; nr < ctx->uc_batch; ++nr) {
+			pkt = pppoat_list_dequeue(&ctx->uc_txq);
+			if (pkt == NULL)
+				break;
+			ctx->uc_tx.ub_pkts[nr] = pkt;
+		}
+		ctx->uc_txq_nr -= nr;
+		pppoat_mutex_unlock(&ctx->uc_txq_lock);
+
+		if (nr > 0) {
+			rc = tp_udp_send_batch(ctx, nr);
+			if (rc != 0)
+				pppoat_error("udp", "Couldn't send %u packets "
+					     "(rc=%d)", nr, rc);
+		}
+		for (i = 0; i < nr; ++i) {
+			pppoat_packet_put(mod->m_pkts, ctx->uc_tx.ub_pkts[i]);
+			ctx->uc_tx.ub_pkts[i] = NULL;
+		}
+	} while (nr == ctx->uc_batch);
+}
+
+static int tp_udp_txq_add(struct pppoat_module *mod, struct pppoat_packet *pkt)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+	bool               was_empty = false;
+	bool               drop = false;
+
+	pppoat_mutex_lock(&ctx->uc_txq_lock);
+	if (ctx->uc_txq_nr >= TP_UDP_TXQ_MAX) {
+		drop = true;
+		++ctx->uc_txq_drops;
+	} else {
+		was_empty = ctx->uc_txq_nr == 0;
+		pppoat_list_enqueue(&ctx->uc_txq, pkt);
+		++ctx->uc_txq_nr;
+	}
+	pppoat_mutex_unlock(&ctx->uc_txq_lock);
+
+	if (drop) {
+		pppoat_debug("udp", "Send queue is full, dropping packet");
+		pppoat_packet_put(mod->m_pkts, pkt);
+	}
+	if (was_empty)
+		tp_udp_wake(ctx);
+
+	return 0;
+}
+
+/**
+ * Copies the next segment of the current receive buffer to a new packet.
+ * The receive buffer stays in its slot and is reused by the next recv.
+ */
+static int tp_udp_gro_next(struct pppoat_module  *mod,
+			   struct tp_udp_worker  *w,
+			   struct pppoat_packet **pkt)
+{
+	struct tp_udp_ctx    *ctx = mod->m_userdata;
+	struct tp_udp_batch  *rx  = &w->uw_rx;
+	struct pppoat_packet *buf = rx->ub_pkts[rx->ub_pos];
+	size_t                seg = rx->ub_segs[rx->ub_pos];
+	size_t                len;
+
+	PPPOAT_ASSERT(rx->ub_off < buf->pkt_size);
+
+	len = buf->pkt_size - rx->ub_off;
+	len = seg == 0 ? len : pppoat_min(seg, len);
+	*pkt = pppoat_packet_get(mod->m_pkts, len);
+	if (*pkt == NULL)
+		return P_ERR(-ENOMEM);
+	memcpy((*pkt)->pkt_data, (char *)buf->pkt_data + rx->ub_off, len);
+
+	rx->ub_off += len;
+	if (rx->ub_off == buf->pkt_size) {
+		buf->pkt_size = ctx->uc_rx_size;
+		rx->ub_off    = 0;
+		++rx->ub_pos;
+	}
+	return 0;
+}
+
+static int tp_udp_pkt_get_batched(struct pppoat_module  *mod,
+				  struct tp_udp_worker  *w,
+				  struct pppoat_packet **pkt)
+{
+	struct tp_udp_ctx    *ctx = mod->m_userdata;
+	struct tp_udp_batch  *rx  = &w->uw_rx;
+	struct pppoat_packet *pkt2;
+	bool                  first = tp_udp_worker_is_first(ctx, w);
+	unsigned              pos;
+	fd_set                rfds;
+	int                   sock;
+	int                   rc = 0;
+
+	*pkt = NULL;
+	if (first)
+		tp_udp_txq_flush(mod);
+
+	if (rx->ub_pos == rx->ub_nr) {
+		rc = tp_udp_wait(mod, w, &rfds);
+		if (rc == 0 && first && FD_ISSET(ctx->uc_wake[0], &rfds))
+			tp_udp_wake_drain(ctx);
+		if (rc == 0 && tp_udp_lsock_is_ready(ctx, w, &rfds))
+			return tp_udp_roam_recv(mod, pkt);
+		sock = rc == 0 ? tp_udp_spray_ready(ctx, w, &rfds) : -1;
+		if (sock >= 0)
+			return tp_udp_recv_one(mod, w, sock, pkt);
+		if (rc == 0 && FD_ISSET(w->uw_sock, &rfds))
+			rc = tp_udp_recv_batch(mod, w);
+	}
+
+	/* Skip empty datagrams, their slots are reused by the next recv. */
+	while (rx->ub_pos < rx->ub_nr &&
+	       rx->ub_pkts[rx->ub_pos]->pkt_size == 0) {
+		rx->ub_pkts[rx->ub_pos]->pkt_size = ctx->uc_rx_size;
+		++rx->ub_pos;
+	}
+	/* Slot of the returned datagram, GRO may advance ub_pos. */
+	pos = rx->ub_pos;
+	if (rx->ub_pos < rx->ub_nr && ctx->uc_gro)
+		rc = tp_udp_gro_next(mod, w, pkt);
+	else if (rx->ub_pos < rx->ub_nr) {
+		pkt2 = rx->ub_pkts[rx->ub_pos];
+		rx->ub_pkts[rx->ub_pos] = NULL;
+		++rx->ub_pos;
+		*pkt = pkt2;
+	}
+	if (*pkt != NULL) {
+		(*pkt)->pkt_type = PPPOAT_PACKET_RECV;
+		tp_udp_pkt_accept(mod, pkt,
+				  (struct sockaddr *)&rx->ub_addrs[pos],
+				  rx->ub_addrlens[pos], rx->ub_tstamps[pos]);
+	}
+
+	return rc;
+}
+
+static int tp_udp_process(struct pppoat_module  *mod,
+			  struct pppoat_packet  *pkt,
+			  struct pppoat_packet **next)
+{
+	struct tp_udp_ctx    *ctx = mod->m_userdata;
+	struct tp_udp_worker *w;
+	int                   rc;
+
+	PPPOAT_ASSERT(tp_udp_ctx_invariant(ctx));
+	PPPOAT_ASSERT(imply(pkt != NULL, pkt->pkt_type == PPPOAT_PACKET_SEND));
+
+	if (pkt == NULL) {
+		w = tp_udp_worker_get(ctx);
+		return tp_udp_is_batched(ctx) ?
+		       tp_udp_pkt_get_batched(mod, w, next) :
+		       tp_udp_pkt_get(mod, w, next);
+	}
+
+	*next = NULL;
+	if (ctx->uc_server) {
+		pkt->pkt_userdata = tp_udp_route(ctx, pkt);
+		if (pkt->pkt_userdata == NULL) {
+			pppoat_debug("udp", "No route, dropping packet");
+			pppoat_packet_put(mod->m_pkts, pkt);
+			return 0;
+		}
+	}
+	if (ctx->uc_auth) {
+		rc = tp_udp_auth_seal(mod, pkt);
+		if (rc != 0)
+			return rc;
+	}
+	if (tp_udp_is_batched(ctx))
+		return tp_udp_txq_add(mod, pkt);
+
+	rc = tp_udp_pkt_send(ctx, pkt);
+	if (rc == 0)
+		pppoat_packet_put(mod->m_pkts, pkt);
+
+	*next = NULL;
+	return rc;
+}
+
+/**
+ * Until the first search completes, the module reports the default MTU.
+ * Afterwards, the MTU is the discovered size without the udp.secret
+ * trailer, and the pipeline passes changes to a plugin or the interface.
+ */
+static size_t tp_udp_mtu(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+
+	return ctx->uc_pmtud ? ctx->uc_pm.pm_mtu : TP_UDP_MTU;
+}
+
+static unsigned tp_udp_workers(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+
+	return ctx->uc_workers_nr;
+}
+
+static void tp_udp_stats(struct pppoat_module *mod)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+	uint64_t           drops = 0;
+#ifdef TP_UDP_HAVE_RXQ_OVFL
+	unsigned           i;
+
+	for (i = 0; i < ctx->uc_workers_nr; ++i) {
+		drops += ctx->uc_workers[i].uw_drops;
+		if (ctx->uc_workers_nr > 1)
+			pppoat_info("udp", "Socket %u: %" PRIu32 " datagrams "
+				    "dropped by the kernel", i,
+				    ctx->uc_workers[i].uw_drops);
+	}
+	if (ctx->uc_lsock >= 0) {
+		drops += ctx->uc_lsock_drops;
+		pppoat_info("udp", "Unconnected socket: %" PRIu32 " datagrams "
+			    "dropped by the kernel", ctx->uc_lsock_drops);
+	}
+	pppoat_info("udp", "Kernel receive drops: %" PRIu64, drops);
+#endif /* TP_UDP_HAVE_RXQ_OVFL */
+	if (tp_udp_is_batched(ctx)) {
+		pppoat_mutex_lock(&ctx->uc_txq_lock);
+		drops = ctx->uc_txq_drops;
+		pppoat_mutex_unlock(&ctx->uc_txq_lock);
+		pppoat_info("udp", "Send queue drops: %" PRIu64, drops);
+	}
+	if (ctx->uc_probe.pr_ival != 0)
+		pppoat_rtt_log(&ctx->uc_probe.pr_rtt, "udp");
+}
+
+static int tp_udp_rtt(struct pppoat_module *mod, struct pppoat_rtt_stats *stats)
+{
+	struct tp_udp_ctx *ctx = mod->m_userdata;
+
+	return ctx->uc_probe.pr_ival == 0 ? -ENOENT :
+	       pppoat_rtt_get(&ctx->uc_probe.pr_rtt, stats);
 }
 
 static struct pppoat_module_ops tp_udp_ops = {
@@ -318,6 +3019,9 @@ static struct pppoat_module_ops tp_udp_ops = {
 	.mop_stop    = &tp_udp_stop,
 	.mop_process = &tp_udp_process,
 	.mop_mtu     = &tp_udp_mtu,
+	.mop_workers = &tp_udp_workers,
+	.mop_stats   = &tp_udp_stats,
+	.mop_rtt     = &tp_udp_rtt,
 };
 
 struct pppoat_module_impl pppoat_module_tp_udp = {
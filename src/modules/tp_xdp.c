@@ -0,0 +1,1184 @@
+/* modules/tp_xdp.c
+ * PPP over Any Transport -- AF_XDP transport module
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "trace.h"
+
+#ifdef HAVE_MODULE_XDP
+
+#include "bpf.h"
+#include "conf.h"
+#include "io.h"
+#include "memory.h"
+#include "misc.h"
+#include "module.h"
+#include "mutex.h"
+#include "packet.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>	/* offsetof */
+#include <stdio.h>	/* fopen, sscanf */
+#include <string.h>
+#include <time.h>	/* nanosleep */
+#include <unistd.h>
+#include <arpa/inet.h>	/* htons */
+#include <net/if.h>	/* if_nametoindex, ifreq */
+#include <net/if_arp.h>	/* arpreq */
+#include <net/route.h>	/* RTF_UP, RTF_GATEWAY */
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>	/* XDP_FLAGS_* */
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_CONF_DEV      "xdp.dev"
+#define XDP_CONF_QUEUE    "xdp.queue"
+#define XDP_CONF_MODE     "xdp.mode"
+#define XDP_CONF_ZEROCOPY "xdp.zerocopy"
+#define XDP_CONF_PORT     "xdp.port"
+#define XDP_CONF_SPORT    "xdp.sport"
+#define XDP_CONF_DPORT    "xdp.dport"
+#define XDP_CONF_HOST     "xdp.host"
+#define XDP_CONF_SADDR    "xdp.saddr"
+#define XDP_CONF_DMAC     "xdp.dmac"
+#define XDP_CONF_FRAMES   "xdp.frames"
+#define XDP_CONF_RING     "xdp.ring"
+
+/*
+ * AF_XDP transport.
+ *
+ * The module sends and receives plain UDP/IPv4 datagrams, so the peer may
+ * run the udp module without udp.secret, but it bypasses the kernel network
+ * stack. A small XDP program is attached to xdp.dev. It redirects frames
+ * with IPv4/UDP to the local address and xdp.sport to an AF_XDP socket
+ * through an XSKMAP and passes everything else, including ARP and
+ * fragments, to the kernel. The socket is bound to a single device queue
+ * xdp.queue, so on a multiqueue NIC the flow must be steered to the queue,
+ * e.g. with "ethtool -N". Frames which arrive at other queues go to the
+ * kernel and are lost.
+ *
+ * Frames live in UMEM, an area shared with the kernel and split into
+ * xdp.frames chunks of 4 KiB. Free chunks are kept on a stack. The blocking
+ * worker posts free chunks to the fill ring in batches, the kernel writes
+ * received frames into them and reports them in the RX ring. A received
+ * payload enters the pipeline without copying: it's wrapped into an empty
+ * pool packet with own packet ops, and the chunk returns to the free stack
+ * when the packet is put. A module which needs a larger buffer reserves it
+ * and the pool copies the data.
+ *
+ * Outbound packets are copied into a free chunk after Ethernet, IPv4 and
+ * UDP headers built by the module and posted to the TX ring. The kernel is
+ * kicked only when it asks for that (XDP_USE_NEED_WAKEUP). Sent chunks are
+ * reaped from the completion ring in batches before every send. UDP
+ * checksum is not computed, which is allowed for IPv4.
+ *
+ * Destination MAC address is xdp.dmac or the kernel's neighbour entry of
+ * the next hop towards xdp.host. The module sends an empty datagram to the
+ * discard port of the peer to make the kernel resolve it. Afterwards the
+ * address is learned from datagrams of the peer, so a change of the
+ * gateway doesn't break the tunnel.
+ *
+ * xdp.mode selects the XDP attach mode: "drv" (native), "skb" (generic,
+ * works with any device including veth) or "auto" (native when the driver
+ * supports it). With xdp.zerocopy, binding fails unless the driver maps
+ * UMEM for DMA. The program is attached with a BPF link, so it's detached
+ * when the process exits, even after a crash. Linux 5.9 or newer is
+ * required.
+ *
+ * Only IPv4 without options is supported. MTU is the MTU of the device
+ * without IPv4 and UDP headers, limited by the chunk size.
+ */
+
+enum {
+	TP_XDP_FRAME_SIZE = 4096,
+	TP_XDP_FRAMES     = 4096,
+	TP_XDP_FRAMES_MAX = 1 << 20,
+	TP_XDP_RING       = 2048,
+	TP_XDP_RING_MIN   = 64,
+	/** Number of fill and completion entries handled at once. */
+	TP_XDP_BATCH      = 64,
+	/** UMEM headroom which aligns IPv4 header to 4 bytes. */
+	TP_XDP_NET_ALIGN  = 2,
+	TP_XDP_IP_HDR     = 20,
+	TP_XDP_HDR_SIZE   = ETH_HLEN + TP_XDP_IP_HDR + 8,
+	TP_XDP_FRAME_MAX  = TP_XDP_FRAME_SIZE - XDP_PACKET_HEADROOM -
+			    TP_XDP_NET_ALIGN,
+	TP_XDP_POLL_MS    = 100,
+	TP_XDP_TTL        = 64,
+	/** Port of the datagram which makes the kernel resolve the peer. */
+	TP_XDP_DISCARD_PORT = 9,
+	TP_XDP_NEIGH_TRIES  = 10,
+	TP_XDP_NEIGH_WAIT_MS = 100,
+	/** Jump offset which is patched to the "pass" exit of the program. */
+	TP_XDP_PROG_PASS  = 0x7fff,
+};
+
+struct tp_xdp_ring {
+	uint32_t *xr_producer;
+	uint32_t *xr_consumer;
+	uint32_t *xr_flags;
+	void     *xr_descs;
+	uint32_t  xr_size;
+	uint32_t  xr_mask;
+	/** Local copies, consumer of a producer ring is offset by size. */
+	uint32_t  xr_cached_prod;
+	uint32_t  xr_cached_cons;
+	void     *xr_map;
+	size_t    xr_map_len;
+};
+
+struct tp_xdp_ctx {
+	char                     *xc_dev;
+	int                       xc_ifindex;
+	unsigned                  xc_queue;
+	uint32_t                  xc_xdp_flags;
+	uint16_t                  xc_bind_flags;
+	/** Ports and addresses are in network byte order. */
+	uint16_t                  xc_sport;
+	uint16_t                  xc_dport;
+	struct in_addr            xc_saddr;
+	struct in_addr            xc_daddr;
+	uint8_t                   xc_smac[ETH_ALEN];
+	uint8_t                   xc_dmac[ETH_ALEN];
+	bool                      xc_dmac_valid;
+	size_t                    xc_mtu;
+	unsigned                  xc_frames_nr;
+	unsigned                  xc_ring_size;
+	uint8_t                  *xc_umem;
+	size_t                    xc_umem_len;
+	int                       xc_sock;
+	int                       xc_map_fd;
+	int                       xc_prog_fd;
+	int                       xc_link_fd;
+	struct tp_xdp_ring        xc_rx;
+	struct tp_xdp_ring        xc_tx;
+	struct tp_xdp_ring        xc_fill;
+	struct tp_xdp_ring        xc_comp;
+	/** Stack of free chunks. */
+	uint64_t                 *xc_free;
+	unsigned                  xc_free_nr;
+	struct pppoat_mutex       xc_free_lock;
+	/** Protects TX and completion rings, headers and xc_dmac. */
+	struct pppoat_mutex       xc_tx_lock;
+	uint16_t                  xc_ip_id;
+	/** Ops of received packets, they lead back to the context. */
+	struct pppoat_packet_ops  xc_pkt_ops;
+	uint64_t                  xc_rx_pkts;
+	uint64_t                  xc_rx_drops;
+	uint64_t                  xc_tx_pkts;
+	uint64_t                  xc_tx_drops;
+};
+
+static bool tp_xdp_ctx_invariant(struct tp_xdp_ctx *ctx)
+{
+	return ctx != NULL && ctx->xc_sock >= 0;
+}
+
+static uint32_t tp_xdp_ring_load(uint32_t *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static void tp_xdp_ring_store(uint32_t *ptr, uint32_t val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+/** Returns number of free entries of a producer ring, at most `nr'. */
+static uint32_t tp_xdp_prod_reserve(struct tp_xdp_ring *r, uint32_t nr)
+{
+	uint32_t free = r->xr_cached_cons - r->xr_cached_prod;
+
+	if (free < nr) {
+		r->xr_cached_cons = tp_xdp_ring_load(r->xr_consumer) +
+				    r->xr_size;
+		free = r->xr_cached_cons - r->xr_cached_prod;
+	}
+	return pppoat_min(free, nr);
+}
+
+static void tp_xdp_prod_submit(struct tp_xdp_ring *r, uint32_t nr)
+{
+	r->xr_cached_prod += nr;
+	tp_xdp_ring_store(r->xr_producer, r->xr_cached_prod);
+}
+
+/** Returns number of filled entries of a consumer ring, at most `nr'. */
+static uint32_t tp_xdp_cons_peek(struct tp_xdp_ring *r, uint32_t nr)
+{
+	uint32_t avail = r->xr_cached_prod - r->xr_cached_cons;
+
+	if (avail == 0) {
+		r->xr_cached_prod = tp_xdp_ring_load(r->xr_producer);
+		avail = r->xr_cached_prod - r->xr_cached_cons;
+	}
+	return pppoat_min(avail, nr);
+}
+
+static void tp_xdp_cons_release(struct tp_xdp_ring *r, uint32_t nr)
+{
+	r->xr_cached_cons += nr;
+	tp_xdp_ring_store(r->xr_consumer, r->xr_cached_cons);
+}
+
+static bool tp_xdp_ring_needs_wakeup(struct tp_xdp_ring *r)
+{
+	return (tp_xdp_ring_load(r->xr_flags) & XDP_RING_NEED_WAKEUP) != 0;
+}
+
+static int tp_xdp_ring_map(struct tp_xdp_ctx        *ctx,
+			   struct tp_xdp_ring       *r,
+			   const struct xdp_ring_offset *off,
+			   size_t                    desc_size,
+			   off_t                     pgoff,
+			   bool                      producer)
+{
+	r->xr_map_len = off->desc + ctx->xc_ring_size * desc_size;
+	r->xr_map = mmap(NULL, r->xr_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ctx->xc_sock, pgoff);
+	if (r->xr_map == MAP_FAILED) {
+		r->xr_map = NULL;
+		return P_ERR(-errno);
+	}
+	r->xr_producer = (uint32_t *)((char *)r->xr_map + off->producer);
+	r->xr_consumer = (uint32_t *)((char *)r->xr_map + off->consumer);
+	r->xr_flags    = (uint32_t *)((char *)r->xr_map + off->flags);
+	r->xr_descs    = (char *)r->xr_map + off->desc;
+	r->xr_size     = ctx->xc_ring_size;
+	r->xr_mask     = ctx->xc_ring_size - 1;
+	r->xr_cached_prod = tp_xdp_ring_load(r->xr_producer);
+	r->xr_cached_cons = tp_xdp_ring_load(r->xr_consumer) +
+			    (producer ? r->xr_size : 0);
+	return 0;
+}
+
+static void tp_xdp_ring_unmap(struct tp_xdp_ring *r)
+{
+	if (r->xr_map != NULL)
+		(void)munmap(r->xr_map, r->xr_map_len);
+	r->xr_map = NULL;
+}
+
+static bool tp_xdp_frame_get(struct tp_xdp_ctx *ctx, uint64_t *addr)
+{
+	bool result;
+
+	pppoat_mutex_lock(&ctx->xc_free_lock);
+	result = ctx->xc_free_nr > 0;
+	if (result)
+		*addr = ctx->xc_free[--ctx->xc_free_nr];
+	pppoat_mutex_unlock(&ctx->xc_free_lock);
+
+	return result;
+}
+
+static void tp_xdp_frame_put(struct tp_xdp_ctx *ctx, uint64_t addr)
+{
+	/* Descriptors may point inside a chunk. */
+	addr &= ~(uint64_t)(TP_XDP_FRAME_SIZE - 1);
+
+	pppoat_mutex_lock(&ctx->xc_free_lock);
+	PPPOAT_ASSERT(ctx->xc_free_nr < ctx->xc_frames_nr);
+	ctx->xc_free[ctx->xc_free_nr++] = addr;
+	pppoat_mutex_unlock(&ctx->xc_free_lock);
+}
+
+static void tp_xdp_pkt_free(struct pppoat_packet *pkt)
+{
+	struct tp_xdp_ctx *ctx;
+
+	ctx = container_of((struct pppoat_packet_ops *)pkt->pkt_ops,
+			   struct tp_xdp_ctx, xc_pkt_ops);
+	tp_xdp_frame_put(ctx, (uint8_t *)pkt->pkt_data - ctx->xc_umem);
+	pkt->pkt_data = NULL;
+	pkt->pkt_size = 0;
+}
+
+/** Posts free chunks to the fill ring. Called by the worker only. */
+static void tp_xdp_fill(struct tp_xdp_ctx *ctx)
+{
+	struct tp_xdp_ring *r     = &ctx->xc_fill;
+	uint64_t           *addrs = r->xr_descs;
+	uint32_t            nr;
+	uint32_t            i;
+
+	nr = tp_xdp_prod_reserve(r, TP_XDP_BATCH);
+	if (nr == 0)
+		return;
+
+	pppoat_mutex_lock(&ctx->xc_free_lock);
+	nr = pppoat_min(nr, ctx->xc_free_nr);
+	for (i = 0; i < nr; ++i) {
+		addrs[(r->xr_cached_prod + i) & r->xr_mask] =
+			ctx->xc_free[--ctx->xc_free_nr];
+	}
+	pppoat_mutex_unlock(&ctx->xc_free_lock);
+
+	if (nr > 0)
+		tp_xdp_prod_submit(r, nr);
+}
+
+/** Returns sent chunks to the free stack. Called with xc_tx_lock held. */
+static void tp_xdp_complete(struct tp_xdp_ctx *ctx)
+{
+	struct tp_xdp_ring *r     = &ctx->xc_comp;
+	uint64_t           *addrs = r->xr_descs;
+	uint32_t            nr;
+	uint32_t            i;
+
+	nr = tp_xdp_cons_peek(r, TP_XDP_BATCH);
+	if (nr == 0)
+		return;
+
+	pppoat_mutex_lock(&ctx->xc_free_lock);
+	for (i = 0; i < nr; ++i) {
+		ctx->xc_free[ctx->xc_free_nr++] =
+			addrs[(r->xr_cached_cons + i) & r->xr_mask] &
+			~(uint64_t)(TP_XDP_FRAME_SIZE - 1);
+	}
+	pppoat_mutex_unlock(&ctx->xc_free_lock);
+	tp_xdp_cons_release(r, nr);
+}
+
+static uint16_t tp_xdp_ip_csum(const void *hdr, size_t len)
+{
+	const uint16_t *p   = hdr;
+	uint32_t        sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	while (sum >> 16 != 0)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint16_t)~sum;
+}
+
+static void tp_xdp_hdr_build(struct tp_xdp_ctx *ctx,
+			     uint8_t           *frame,
+			     size_t             size)
+{
+	struct ethhdr *eth = (struct ethhdr *)frame;
+	struct iphdr  *ip  = (struct iphdr *)(frame + ETH_HLEN);
+	struct udphdr *udp = (struct udphdr *)(frame + ETH_HLEN +
+					       TP_XDP_IP_HDR);
+
+	memcpy(eth->h_dest, ctx->xc_dmac, ETH_ALEN);
+	memcpy(eth->h_source, ctx->xc_smac, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	ip->version  = 4;
+	ip->ihl      = TP_XDP_IP_HDR / 4;
+	ip->tos      = 0;
+	ip->tot_len  = htons(TP_XDP_IP_HDR + sizeof *udp + size);
+	ip->id       = htons(ctx->xc_ip_id++);
+	ip->frag_off = htons(IP_DF);
+	ip->ttl      = TP_XDP_TTL;
+	ip->protocol = IPPROTO_UDP;
+	ip->check    = 0;
+	ip->saddr    = ctx->xc_saddr.s_addr;
+	ip->daddr    = ctx->xc_daddr.s_addr;
+	ip->check    = tp_xdp_ip_csum(ip, TP_XDP_IP_HDR);
+
+	udp->source = ctx->xc_sport;
+	udp->dest   = ctx->xc_dport;
+	udp->len    = htons(sizeof *udp + size);
+	udp->check  = 0;
+}
+
+static int tp_xdp_kick(struct tp_xdp_ctx *ctx)
+{
+	ssize_t rc;
+
+	rc = sendto(ctx->xc_sock, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	/* The kernel is busy or the device is down, the frame waits. */
+	if (rc < 0 && (errno == EAGAIN || errno == EBUSY ||
+		       errno == ENOBUFS || errno == ENETDOWN))
+		rc = 0;
+
+	return rc < 0 ? P_ERR(-errno) : 0;
+}
+
+static int tp_xdp_pkt_send(struct tp_xdp_ctx    *ctx,
+			   struct pppoat_packet *pkt)
+{
+	struct tp_xdp_ring *r = &ctx->xc_tx;
+	struct xdp_desc    *desc;
+	uint64_t            addr;
+	int                 rc = 0;
+
+	pppoat_mutex_lock(&ctx->xc_tx_lock);
+	tp_xdp_complete(ctx);
+	if (!ctx->xc_dmac_valid || pkt->pkt_size > ctx->xc_mtu ||
+	    tp_xdp_prod_reserve(r, 1) == 0 || !tp_xdp_frame_get(ctx, &addr)) {
+		++ctx->xc_tx_drops;
+		goto unlock;
+	}
+	addr += TP_XDP_NET_ALIGN;
+	tp_xdp_hdr_build(ctx, ctx->xc_umem + addr, pkt->pkt_size);
+	memcpy(ctx->xc_umem + addr + TP_XDP_HDR_SIZE, pkt->pkt_data,
+	       pkt->pkt_size);
+
+	desc = (struct xdp_desc *)r->xr_descs + (r->xr_cached_prod & r->xr_mask);
+	desc->addr    = addr;
+	desc->len     = TP_XDP_HDR_SIZE + pkt->pkt_size;
+	desc->options = 0;
+	tp_xdp_prod_submit(r, 1);
+	++ctx->xc_tx_pkts;
+
+	if (tp_xdp_ring_needs_wakeup(r))
+		rc = tp_xdp_kick(ctx);
+unlock:
+	pppoat_mutex_unlock(&ctx->xc_tx_lock);
+
+	return rc;
+}
+
+static void tp_xdp_dmac_learn(struct tp_xdp_ctx *ctx, const uint8_t *mac)
+{
+	if (ctx->xc_dmac_valid && memcmp(ctx->xc_dmac, mac, ETH_ALEN) == 0)
+		return;
+
+	pppoat_mutex_lock(&ctx->xc_tx_lock);
+	memcpy(ctx->xc_dmac, mac, ETH_ALEN);
+	ctx->xc_dmac_valid = true;
+	pppoat_mutex_unlock(&ctx->xc_tx_lock);
+	pppoat_debug("xdp", "Learned destination MAC "
+		     "%02x:%02x:%02x:%02x:%02x:%02x",
+		     mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+/**
+ * Checks a received frame and wraps its payload into a packet. The frame
+ * already matched the XDP program, so only the peer and lengths are left.
+ */
+static int tp_xdp_frame_accept(struct pppoat_module  *mod,
+			       uint64_t               addr,
+			       uint32_t               len,
+			       struct pppoat_packet **pkt)
+{
+	struct tp_xdp_ctx    *ctx   = mod->m_userdata;
+	uint8_t              *frame = ctx->xc_umem + addr;
+	struct ethhdr        *eth   = (struct ethhdr *)frame;
+	struct iphdr         *ip    = (struct iphdr *)(frame + ETH_HLEN);
+	struct udphdr        *udp   = (struct udphdr *)(frame + ETH_HLEN +
+							TP_XDP_IP_HDR);
+	struct pppoat_packet *pkt2;
+	size_t                size;
+
+	size = len < TP_XDP_HDR_SIZE ? 0 : ntohs(udp->len);
+	if (size <= sizeof *udp || size > len - ETH_HLEN - TP_XDP_IP_HDR ||
+	    ip->saddr != ctx->xc_daddr.s_addr ||
+	    udp->source != ctx->xc_dport) {
+		++ctx->xc_rx_drops;
+		tp_xdp_frame_put(ctx, addr);
+		return 0;
+	}
+	size -= sizeof *udp;
+
+	pkt2 = pppoat_packet_get_empty(mod->m_pkts);
+	if (pkt2 == NULL) {
+		tp_xdp_frame_put(ctx, addr);
+		return P_ERR(-ENOMEM);
+	}
+	tp_xdp_dmac_learn(ctx, eth->h_source);
+
+	pkt2->pkt_type        = PPPOAT_PACKET_RECV;
+	pkt2->pkt_data        = frame + TP_XDP_HDR_SIZE;
+	pkt2->pkt_size        = size;
+	/* The buffer doesn't belong to the pool, see tp_xdp_pkt_free(). */
+	pkt2->pkt_size_actual = 0;
+	pkt2->pkt_ops         = &ctx->xc_pkt_ops;
+	++ctx->xc_rx_pkts;
+	*pkt = pkt2;
+
+	return 0;
+}
+
+static int tp_xdp_pkt_get(struct pppoat_module  *mod,
+			  struct pppoat_packet **pkt)
+{
+	struct tp_xdp_ctx  *ctx = mod->m_userdata;
+	struct tp_xdp_ring *r   = &ctx->xc_rx;
+	struct xdp_desc    *desc;
+	fd_set              rfds;
+	uint64_t            addr;
+	uint32_t            len;
+	int                 rc;
+
+	*pkt = NULL;
+	tp_xdp_fill(ctx);
+	if (tp_xdp_cons_peek(r, 1) == 0) {
+		/*
+		 * Wake up periodically, chunks may return to the free stack
+		 * while the fill ring is empty.
+		 */
+		FD_ZERO(&rfds);
+		FD_SET(ctx->xc_sock, &rfds);
+		rc = pppoat_io_select_timeout(ctx->xc_sock, &rfds, NULL,
+					      TP_XDP_POLL_MS);
+		if (rc != 0 || tp_xdp_cons_peek(r, 1) == 0)
+			return rc;
+	}
+	desc = (struct xdp_desc *)r->xr_descs + (r->xr_cached_cons & r->xr_mask);
+	addr = desc->addr;
+	len  = desc->len;
+	tp_xdp_cons_release(r, 1);
+
+	return tp_xdp_frame_accept(mod, addr, len, pkt);
+}
+
+static int tp_xdp_prog_load(struct tp_xdp_ctx *ctx)
+{
+	struct bpf_insn prog[] = {
+		PPPOAT_BPF_MOV64_REG(BPF_REG_6, BPF_REG_1),
+		PPPOAT_BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1,
+				   offsetof(struct xdp_md, data)),
+		PPPOAT_BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_1,
+				   offsetof(struct xdp_md, data_end)),
+		PPPOAT_BPF_MOV64_REG(BPF_REG_4, BPF_REG_2),
+		PPPOAT_BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, TP_XDP_HDR_SIZE),
+		PPPOAT_BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3,
+				   TP_XDP_PROG_PASS),
+		/* Ethernet type. */
+		PPPOAT_BPF_LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 12),
+		PPPOAT_BPF_JMP32_IMM(BPF_JNE, BPF_REG_5, htons(ETH_P_IP),
+				     TP_XDP_PROG_PASS),
+		/* IPv4 without options. */
+		PPPOAT_BPF_LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN),
+		PPPOAT_BPF_JMP32_IMM(BPF_JNE, BPF_REG_5, 0x45,
+				     TP_XDP_PROG_PASS),
+		PPPOAT_BPF_LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 9),
+		PPPOAT_BPF_JMP32_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP,
+				     TP_XDP_PROG_PASS),
+		/* Fragments are reassembled by the kernel. */
+		PPPOAT_BPF_LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6),
+		PPPOAT_BPF_ALU64_IMM(BPF_AND, BPF_REG_5,
+				     htons(IP_MF | IP_OFFMASK)),
+		PPPOAT_BPF_JMP32_IMM(BPF_JNE, BPF_REG_5, 0, TP_XDP_PROG_PASS),
+		PPPOAT_BPF_LDX_MEM(BPF_W, BPF_REG_5, BPF_REG_2, ETH_HLEN + 16),
+		PPPOAT_BPF_JMP32_IMM(BPF_JNE, BPF_REG_5,
+				     (int32_t)ctx->xc_saddr.s_addr,
+				     TP_XDP_PROG_PASS),
+		/* UDP destination port. */
+		PPPOAT_BPF_LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2,
+				   ETH_HLEN + TP_XDP_IP_HDR + 2),
+		PPPOAT_BPF_JMP32_IMM(BPF_JNE, BPF_REG_5, ctx->xc_sport,
+				     TP_XDP_PROG_PASS),
+		/* Redirect to the socket of the queue, otherwise pass. */
+		PPPOAT_BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6,
+				   offsetof(struct xdp_md, rx_queue_index)),
+		PPPOAT_BPF_LD_MAP_FD(BPF_REG_1, ctx->xc_map_fd),
+		PPPOAT_BPF_MOV64_IMM(BPF_REG_3, XDP_PASS),
+		PPPOAT_BPF_CALL(BPF_FUNC_redirect_map),
+		PPPOAT_BPF_EXIT(),
+		/* Pass. */
+		PPPOAT_BPF_MOV64_IMM(BPF_REG_0, XDP_PASS),
+		PPPOAT_BPF_EXIT(),
+	};
+	size_t nr = ARRAY_SIZE(prog);
+	size_t i;
+
+	for (i = 0; i < nr; ++i) {
+		if ((BPF_CLASS(prog[i].code) == BPF_JMP ||
+		     BPF_CLASS(prog[i].code) == BPF_JMP32) &&
+		    prog[i].off == TP_XDP_PROG_PASS)
+			prog[i].off = (int16_t)(nr - 2 - i - 1);
+	}
+	return pppoat_bpf_prog_load(BPF_PROG_TYPE_XDP, prog, nr,
+				    &ctx->xc_prog_fd);
+}
+
+static int tp_xdp_ifreq(struct tp_xdp_ctx *ctx, unsigned long req,
+			struct ifreq *ifr)
+{
+	int sock;
+	int rc;
+
+	memset(ifr, 0, sizeof *ifr);
+	strncpy(ifr->ifr_name, ctx->xc_dev, sizeof(ifr->ifr_name) - 1);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return P_ERR(-errno);
+	rc = ioctl(sock, req, ifr);
+	rc = rc < 0 ? P_ERR(-errno) : 0;
+	(void)pppoat_io_close(sock);
+
+	return rc;
+}
+
+static int tp_xdp_dev_init(struct tp_xdp_ctx *ctx)
+{
+	struct ifreq ifr;
+	int          rc;
+
+	ctx->xc_ifindex = if_nametoindex(ctx->xc_dev);
+	if (ctx->xc_ifindex == 0) {
+		pppoat_error("xdp", "Unknown device %s.", ctx->xc_dev);
+		return P_ERR(-ENODEV);
+	}
+	rc = tp_xdp_ifreq(ctx, SIOCGIFHWADDR, &ifr);
+	if (rc == 0 && ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		pppoat_error("xdp", "%s is not an Ethernet device.",
+			     ctx->xc_dev);
+		rc = P_ERR(-EINVAL);
+	}
+	if (rc != 0)
+		return rc;
+	memcpy(ctx->xc_smac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	rc = tp_xdp_ifreq(ctx, SIOCGIFMTU, &ifr);
+	if (rc != 0)
+		return rc;
+	ctx->xc_mtu = pppoat_min((size_t)ifr.ifr_mtu,
+				 (size_t)TP_XDP_FRAME_MAX - ETH_HLEN) -
+		      TP_XDP_IP_HDR - sizeof(struct udphdr);
+
+	if (ctx->xc_saddr.s_addr == INADDR_ANY) {
+		rc = tp_xdp_ifreq(ctx, SIOCGIFADDR, &ifr);
+		if (rc != 0) {
+			pppoat_error("xdp", "%s has no IPv4 address, set "
+				     XDP_CONF_SADDR ".", ctx->xc_dev);
+			return rc;
+		}
+		ctx->xc_saddr =
+			((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+	}
+	return 0;
+}
+
+/** Finds the next hop towards the peer in the main routing table. */
+static struct in_addr tp_xdp_nexthop(struct tp_xdp_ctx *ctx)
+{
+	struct in_addr  nh = ctx->xc_daddr;
+	char            line[256];
+	char            ifname[IFNAMSIZ];
+	unsigned        dst;
+	unsigned        gw;
+	unsigned        flags;
+	unsigned        mask;
+	long            best = -1;
+	FILE           *f;
+
+	f = fopen("/proc/net/route", "r");
+	if (f == NULL)
+		return nh;
+	while (fgets(line, sizeof line, f) != NULL) {
+		/* Addresses are printed as raw 32-bit values. */
+		if (sscanf(line, "%15s %x %x %x %*d %*d %*d %x", ifname, &dst,
+			   &gw, &flags, &mask) != 5 ||
+		    !pppoat_streq(ifname, ctx->xc_dev) ||
+		    (flags & RTF_UP) == 0 ||
+		    (ctx->xc_daddr.s_addr & mask) != dst ||
+		    (long)ntohl(mask) <= best)
+			continue;
+		best = (long)ntohl(mask);
+		nh.s_addr = (flags & RTF_GATEWAY) != 0 ? gw :
+			    ctx->xc_daddr.s_addr;
+	}
+	fclose(f);
+
+	return nh;
+}
+
+static bool tp_xdp_neigh_lookup(struct tp_xdp_ctx *ctx, struct in_addr nh)
+{
+	struct sockaddr_in *sin;
+	struct arpreq       req;
+	int                 sock;
+	int                 rc;
+
+	memset(&req, 0, sizeof req);
+	sin = (struct sockaddr_in *)&req.arp_pa;
+	sin->sin_family = AF_INET;
+	sin->sin_addr   = nh;
+	strncpy(req.arp_dev, ctx->xc_dev, sizeof(req.arp_dev) - 1);
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return false;
+	rc = ioctl(sock, SIOCGARP, &req);
+	(void)pppoat_io_close(sock);
+	if (rc < 0 || (req.arp_flags & ATF_COM) == 0)
+		return false;
+
+	memcpy(ctx->xc_dmac, req.arp_ha.sa_data, ETH_ALEN);
+	return true;
+}
+
+/** Makes the kernel resolve the next hop with an empty datagram. */
+static void tp_xdp_neigh_solicit(struct tp_xdp_ctx *ctx)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port   = htons(TP_XDP_DISCARD_PORT),
+		.sin_addr   = ctx->xc_daddr,
+	};
+	int                sock;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return;
+	(void)sendto(sock, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&sin,
+		     sizeof sin);
+	(void)pppoat_io_close(sock);
+}
+
+static void tp_xdp_dmac_resolve(struct tp_xdp_ctx *ctx)
+{
+	struct timespec ts = {
+		.tv_sec  = 0,
+		.tv_nsec = TP_XDP_NEIGH_WAIT_MS * 1000000L,
+	};
+	struct in_addr  nh = tp_xdp_nexthop(ctx);
+	unsigned        i;
+
+	ctx->xc_dmac_valid = tp_xdp_neigh_lookup(ctx, nh);
+	for (i = 0; !ctx->xc_dmac_valid && i < TP_XDP_NEIGH_TRIES; ++i) {
+		if (i == 0)
+			tp_xdp_neigh_solicit(ctx);
+		(void)nanosleep(&ts, NULL);
+		ctx->xc_dmac_valid = tp_xdp_neigh_lookup(ctx, nh);
+	}
+	if (!ctx->xc_dmac_valid) {
+		pppoat_info("xdp", "Can't resolve MAC address of %s, waiting "
+			    "for a datagram from the peer.", inet_ntoa(nh));
+	}
+}
+
+static int tp_xdp_mac_parse(const char *str, uint8_t *mac)
+{
+	unsigned char c;
+
+	return sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%c", &mac[0],
+		      &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &c) == 6 ?
+	       0 : P_ERR(-EINVAL);
+}
+
+static int tp_xdp_addr_parse(const char *host, struct in_addr *addr)
+{
+	struct addrinfo  hints;
+	struct addrinfo *ainfo;
+	int              rc;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family   = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	rc = getaddrinfo(host, NULL, &hints, &ainfo);
+	if (rc != 0) {
+		pppoat_error("xdp", "Can't resolve %s: %s", host,
+			     gai_strerror(rc));
+		return P_ERR(-EINVAL);
+	}
+	*addr = ((struct sockaddr_in *)ainfo->ai_addr)->sin_addr;
+	freeaddrinfo(ainfo);
+
+	return 0;
+}
+
+static int tp_xdp_conf_long(struct pppoat_conf *conf,
+			    const char         *key,
+			    long                min,
+			    long                max,
+			    long               *val)
+{
+	int rc;
+
+	rc = pppoat_conf_find_long(conf, key, val);
+	if (rc == 0 && (*val < min || *val > max)) {
+		pppoat_error("xdp", "%s must be in range %ld..%ld.", key, min,
+			     max);
+		rc = P_ERR(-EINVAL);
+	}
+	return rc == -ENOENT ? 0 : rc;
+}
+
+static int tp_xdp_conf_parse(struct tp_xdp_ctx  *ctx,
+			     struct pppoat_conf *conf)
+{
+	bool  zerocopy = false;
+	char *str      = NULL;
+	long  queue    = 0;
+	long  port     = 0;
+	long  sport    = 0;
+	long  dport    = 0;
+	long  frames   = TP_XDP_FRAMES;
+	long  ring     = TP_XDP_RING;
+	int   rc;
+
+	rc = pppoat_conf_find_string_alloc(conf, XDP_CONF_DEV, &ctx->xc_dev);
+	if (rc == -ENOENT)
+		pppoat_error("xdp", "Device is not set.");
+	rc = rc ?: tp_xdp_conf_long(conf, XDP_CONF_QUEUE, 0, 65535, &queue);
+	rc = rc ?: tp_xdp_conf_long(conf, XDP_CONF_PORT, 1, 65535, &port);
+	sport = dport = port;
+	rc = rc ?: tp_xdp_conf_long(conf, XDP_CONF_SPORT, 1, 65535, &sport);
+	rc = rc ?: tp_xdp_conf_long(conf, XDP_CONF_DPORT, 1, 65535, &dport);
+	rc = rc ?: tp_xdp_conf_long(conf, XDP_CONF_FRAMES, 2 * TP_XDP_RING_MIN,
+				    TP_XDP_FRAMES_MAX, &frames);
+	rc = rc ?: tp_xdp_conf_long(conf, XDP_CONF_RING, TP_XDP_RING_MIN,
+				    TP_XDP_FRAMES_MAX / 2, &ring);
+	if (rc != 0)
+		return rc;
+	if (sport == 0 || dport == 0) {
+		pppoat_error("xdp", "Source or destination port is not set.");
+		return P_ERR(-ENOENT);
+	}
+	if ((ring & (ring - 1)) != 0 || frames < 2 * ring) {
+		pppoat_error("xdp", "Ring size must be a power of 2 and at "
+			     "most half of the number of frames.");
+		return P_ERR(-EINVAL);
+	}
+	ctx->xc_queue     = (unsigned)queue;
+	ctx->xc_sport     = htons((uint16_t)sport);
+	ctx->xc_dport     = htons((uint16_t)dport);
+	ctx->xc_frames_nr = (unsigned)frames;
+	ctx->xc_ring_size = (unsigned)ring;
+
+	rc = pppoat_conf_find_string_alloc(conf, XDP_CONF_HOST, &str);
+	if (rc == -ENOENT)
+		pppoat_error("xdp", "Remote host address is not set.");
+	rc = rc ?: tp_xdp_addr_parse(str, &ctx->xc_daddr);
+	pppoat_free(str);
+	str = NULL;
+	if (rc != 0)
+		return rc;
+
+	ctx->xc_saddr.s_addr = INADDR_ANY;
+	rc = pppoat_conf_find_string_alloc(conf, XDP_CONF_SADDR, &str);
+	if (rc == 0) {
+		rc = inet_pton(AF_INET, str, &ctx->xc_saddr) == 1 ? 0 :
+		     P_ERR(-EINVAL);
+		pppoat_free(str);
+		str = NULL;
+	}
+	rc = rc == -ENOENT ? 0 : rc;
+	rc = rc ?: pppoat_conf_find_string_alloc(conf, XDP_CONF_DMAC, &str);
+	if (rc == 0) {
+		rc = tp_xdp_mac_parse(str, ctx->xc_dmac);
+		ctx->xc_dmac_valid = rc == 0;
+		pppoat_free(str);
+		str = NULL;
+	}
+	rc = rc == -ENOENT ? 0 : rc;
+	if (rc != 0)
+		return rc;
+
+	pppoat_conf_find_bool(conf, XDP_CONF_ZEROCOPY, &zerocopy);
+	ctx->xc_bind_flags = XDP_USE_NEED_WAKEUP |
+			     (zerocopy ? XDP_ZEROCOPY : 0);
+	ctx->xc_xdp_flags  = 0;
+	rc = pppoat_conf_find_string_alloc(conf, XDP_CONF_MODE, &str);
+	if (rc == 0) {
+		if (pppoat_streq(str, "skb")) {
+			ctx->xc_xdp_flags  = XDP_FLAGS_SKB_MODE;
+			ctx->xc_bind_flags |= XDP_COPY;
+		} else if (pppoat_streq(str, "drv")) {
+			ctx->xc_xdp_flags  = XDP_FLAGS_DRV_MODE;
+		} else if (!pppoat_streq(str, "auto")) {
+			pppoat_error("xdp", "Unknown mode '%s', use 'skb', "
+				     "'drv' or 'auto'.", str);
+			rc = P_ERR(-EINVAL);
+		}
+		pppoat_free(str);
+	}
+	rc = rc == -ENOENT ? 0 : rc;
+	if (rc == 0 && zerocopy && ctx->xc_xdp_flags == XDP_FLAGS_SKB_MODE) {
+		pppoat_error("xdp", XDP_CONF_ZEROCOPY " requires native mode.");
+		rc = P_ERR(-EINVAL);
+	}
+	return rc;
+}
+
+static int tp_xdp_umem_init(struct tp_xdp_ctx *ctx)
+{
+	struct xdp_umem_reg reg;
+	unsigned            i;
+	int                 rc;
+
+	ctx->xc_umem_len = (size_t)ctx->xc_frames_nr * TP_XDP_FRAME_SIZE;
+	ctx->xc_umem = mmap(NULL, ctx->xc_umem_len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ctx->xc_umem == MAP_FAILED) {
+		ctx->xc_umem = NULL;
+		return P_ERR(-errno);
+	}
+	ctx->xc_free = pppoat_calloc(ctx->xc_frames_nr, sizeof *ctx->xc_free);
+	if (ctx->xc_free == NULL)
+		return P_ERR(-ENOMEM);
+	for (i = 0; i < ctx->xc_frames_nr; ++i)
+		ctx->xc_free[i] = (uint64_t)i * TP_XDP_FRAME_SIZE;
+	ctx->xc_free_nr = ctx->xc_frames_nr;
+
+	memset(&reg, 0, sizeof reg);
+	reg.addr       = (uint64_t)(uintptr_t)ctx->xc_umem;
+	reg.len        = ctx->xc_umem_len;
+	reg.chunk_size = TP_XDP_FRAME_SIZE;
+	reg.headroom   = TP_XDP_NET_ALIGN;
+	rc = setsockopt(ctx->xc_sock, SOL_XDP, XDP_UMEM_REG, &reg, sizeof reg);
+	return rc < 0 ? P_ERR(-errno) : 0;
+}
+
+static int tp_xdp_rings_init(struct tp_xdp_ctx *ctx)
+{
+	struct xdp_mmap_offsets off;
+	socklen_t               len = sizeof off;
+	int                     size = ctx->xc_ring_size;
+	int                     sock = ctx->xc_sock;
+	int                     rc;
+
+	rc = setsockopt(sock, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof size);
+	rc = rc ?: setsockopt(sock, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+			      sizeof size);
+	rc = rc ?: setsockopt(sock, SOL_XDP, XDP_RX_RING, &size, sizeof size);
+	rc = rc ?: setsockopt(sock, SOL_XDP, XDP_TX_RING, &size, sizeof size);
+	rc = rc ?: getsockopt(sock, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len);
+	if (rc < 0)
+		return P_ERR(-errno);
+
+	rc = tp_xdp_ring_map(ctx, &ctx->xc_rx, &off.rx, sizeof(struct xdp_desc),
+			     XDP_PGOFF_RX_RING, false);
+	rc = rc ?: tp_xdp_ring_map(ctx, &ctx->xc_tx, &off.tx,
+				   sizeof(struct xdp_desc), XDP_PGOFF_TX_RING,
+				   true);
+	rc = rc ?: tp_xdp_ring_map(ctx, &ctx->xc_fill, &off.fr,
+				   sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING,
+				   true);
+	rc = rc ?: tp_xdp_ring_map(ctx, &ctx->xc_comp, &off.cr,
+				   sizeof(uint64_t),
+				   XDP_UMEM_PGOFF_COMPLETION_RING, false);
+	return rc;
+}
+
+static int tp_xdp_sock_bind(struct tp_xdp_ctx *ctx)
+{
+	struct sockaddr_xdp sxdp;
+	struct xdp_options  opts;
+	socklen_t           len = sizeof opts;
+	int                 rc;
+
+	memset(&sxdp, 0, sizeof sxdp);
+	sxdp.sxdp_family   = AF_XDP;
+	sxdp.sxdp_flags    = ctx->xc_bind_flags;
+	sxdp.sxdp_ifindex  = ctx->xc_ifindex;
+	sxdp.sxdp_queue_id = ctx->xc_queue;
+	rc = bind(ctx->xc_sock, (struct sockaddr *)&sxdp, sizeof sxdp);
+	if (rc < 0) {
+		rc = P_ERR(-errno);
+		pppoat_error("xdp", "Can't bind to %s queue %u: %s",
+			     ctx->xc_dev, ctx->xc_queue, strerror(-rc));
+		return rc;
+	}
+	rc = getsockopt(ctx->xc_sock, SOL_XDP, XDP_OPTIONS, &opts, &len);
+	if (rc == 0) {
+		pppoat_debug("xdp", "Socket is in %s mode",
+			     (opts.flags & XDP_OPTIONS_ZEROCOPY) != 0 ?
+			     "zero-copy" : "copy");
+	}
+	return 0;
+}
+
+static int tp_xdp_attach(struct tp_xdp_ctx *ctx)
+{
+	uint32_t key = ctx->xc_queue;
+	int      rc;
+
+	rc = pppoat_bpf_map_create(BPF_MAP_TYPE_XSKMAP, sizeof key,
+				   sizeof(int), ctx->xc_queue + 1,
+				   &ctx->xc_map_fd);
+	rc = rc ?: pppoat_bpf_map_update(ctx->xc_map_fd, &key, &ctx->xc_sock);
+	rc = rc ?: tp_xdp_prog_load(ctx);
+	rc = rc ?: pppoat_bpf_xdp_attach(ctx->xc_prog_fd, ctx->xc_ifindex,
+					 ctx->xc_xdp_flags, &ctx->xc_link_fd);
+	if (rc != 0) {
+		pppoat_error("xdp", "Can't attach XDP program to %s: %s",
+			     ctx->xc_dev, strerror(-rc));
+	}
+	return rc;
+}
+
+static void tp_xdp_ctx_release(struct tp_xdp_ctx *ctx)
+{
+	/* Detach the program first, so the kernel stops using UMEM. */
+	if (ctx->xc_link_fd >= 0)
+		(void)pppoat_io_close(ctx->xc_link_fd);
+	if (ctx->xc_prog_fd >= 0)
+		(void)pppoat_io_close(ctx->xc_prog_fd);
+	if (ctx->xc_map_fd >= 0)
+		(void)pppoat_io_close(ctx->xc_map_fd);
+	tp_xdp_ring_unmap(&ctx->xc_comp);
+	tp_xdp_ring_unmap(&ctx->xc_fill);
+	tp_xdp_ring_unmap(&ctx->xc_tx);
+	tp_xdp_ring_unmap(&ctx->xc_rx);
+	if (ctx->xc_sock >= 0)
+		(void)pppoat_io_close(ctx->xc_sock);
+	if (ctx->xc_umem != NULL)
+		(void)munmap(ctx->xc_umem, ctx->xc_umem_len);
+	pppoat_free(ctx->xc_free);
+	pppoat_free(ctx->xc_dev);
+	pppoat_mutex_fini(&ctx->xc_tx_lock);
+	pppoat_mutex_fini(&ctx->xc_free_lock);
+	pppoat_free(ctx);
+}
+
+static int tp_xdp_init(struct pppoat_module *mod, struct pppoat_conf *conf)
+{
+	struct tp_xdp_ctx *ctx;
+	int                rc;
+
+	ctx = pppoat_alloc(sizeof *ctx);
+	if (ctx == NULL)
+		return P_ERR(-ENOMEM);
+
+	memset(ctx, 0, sizeof *ctx);
+	ctx->xc_sock    = -1;
+	ctx->xc_map_fd  = -1;
+	ctx->xc_prog_fd = -1;
+	ctx->xc_link_fd = -1;
+	ctx->xc_pkt_ops.pko_free = &tp_xdp_pkt_free;
+	pppoat_mutex_init(&ctx->xc_free_lock);
+	pppoat_mutex_init(&ctx->xc_tx_lock);
+
+	rc = tp_xdp_conf_parse(ctx, conf);
+	rc = rc ?: tp_xdp_dev_init(ctx);
+	if (rc == 0) {
+		ctx->xc_sock = socket(AF_XDP, SOCK_RAW, 0);
+		rc = ctx->xc_sock < 0 ? P_ERR(-errno) : 0;
+	}
+	rc = rc ?: tp_xdp_umem_init(ctx);
+	rc = rc ?: tp_xdp_rings_init(ctx);
+	rc = rc ?: tp_xdp_sock_bind(ctx);
+	rc = rc ?: tp_xdp_attach(ctx);
+	if (rc != 0) {
+		tp_xdp_ctx_release(ctx);
+		return rc;
+	}
+	if (!ctx->xc_dmac_valid)
+		tp_xdp_dmac_resolve(ctx);
+
+	pppoat_debug("xdp", "Attached to %s queue %u, MTU %zu", ctx->xc_dev,
+		     ctx->xc_queue, ctx->xc_mtu);
+	mod->m_userdata = ctx;
+
+	return 0;
+}
+
+static void tp_xdp_fini(struct pppoat_module *mod)
+{
+	struct tp_xdp_ctx *ctx = mod->m_userdata;
+
+	PPPOAT_ASSERT(tp_xdp_ctx_invariant(ctx));
+
+	tp_xdp_ctx_release(ctx);
+}
+
+static int tp_xdp_run(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static int tp_xdp_stop(struct pppoat_module *mod)
+{
+	return 0;
+}
+
+static int tp_xdp_process(struct pppoat_module  *mod,
+			  struct pppoat_packet  *pkt,
+			  struct pppoat_packet **next)
+{
+	struct tp_xdp_ctx *ctx = mod->m_userdata;
+	int                rc;
+
+	PPPOAT_ASSERT(tp_xdp_ctx_invariant(ctx));
+	PPPOAT_ASSERT(imply(pkt != NULL, pkt->pkt_type == PPPOAT_PACKET_SEND));
+
+	if (pkt == NULL)
+		return tp_xdp_pkt_get(mod, next);
+
+	rc = tp_xdp_pkt_send(ctx, pkt);
+	if (rc == 0)
+		pppoat_packet_put(mod->m_pkts, pkt);
+
+	*next = NULL;
+	return rc;
+}
+
+static size_t tp_xdp_mtu(struct pppoat_module *mod)
+{
+	struct tp_xdp_ctx *ctx = mod->m_userdata;
+
+	return ctx->xc_mtu;
+}
+
+static void tp_xdp_stats(struct pppoat_module *mod)
+{
+	struct tp_xdp_ctx      *ctx = mod->m_userdata;
+	struct xdp_statistics   st;
+	socklen_t               len = sizeof st;
+	uint64_t                tx_drops;
+
+	pppoat_mutex_lock(&ctx->xc_tx_lock);
+	tx_drops = ctx->xc_tx_drops;
+	pppoat_mutex_unlock(&ctx->xc_tx_lock);
+	pppoat_info("xdp", "Received: %" PRIu64 ", dropped: %" PRIu64,
+		    ctx->xc_rx_pkts, ctx->xc_rx_drops);
+	pppoat_info("xdp", "Sent: %" PRIu64 ", dropped: %" PRIu64,
+		    ctx->xc_tx_pkts, tx_drops);
+	if (getsockopt(ctx->xc_sock, SOL_XDP, XDP_STATISTICS, &st, &len) == 0) {
+		pppoat_info("xdp", "Kernel drops: %llu, RX ring full: %llu, "
+			    "fill ring empty: %llu",
+			    (unsigned long long)st.rx_dropped,
+			    (unsigned long long)st.rx_ring_full,
+			    (unsigned long long)st.rx_fill_ring_empty_descs);
+	}
+}
+
+static struct pppoat_module_ops tp_xdp_ops = {
+	.mop_init    = &tp_xdp_init,
+	.mop_fini    = &tp_xdp_fini,
+	.mop_run     = &tp_xdp_run,
+	.mop_stop    = &tp_xdp_stop,
+	.mop_process = &tp_xdp_process,
+	.mop_mtu     = &tp_xdp_mtu,
+	.mop_stats   = &tp_xdp_stats,
+};
+
+struct pppoat_module_impl pppoat_module_tp_xdp = {
+	.mod_name  = "xdp",
+	.mod_descr = "AF_XDP transport",
+	.mod_type  = PPPOAT_MODULE_TRANSPORT,
+	.mod_ops   = &tp_xdp_ops,
+	.mod_props = PPPOAT_MODULE_BLOCKING,
+};
+
+#endif /* HAVE_MODULE_XDP */
@@ -30,12 +30,14 @@
 #include "module.h"
 #include "packet.h"
 #include "queue.h"
+#include "rtt.h"
 #include "sem.h"
 #include "thread.h"
 
 #include <stdbool.h>
 #include <stdio.h>	/* snprintf */
 #include <string.h>
+#include <time.h>	/* clock_gettime */
 #include <strophe.h>
 
 /*
@@ -65,6 +67,12 @@
  * Ignore delayed messages.
  *
  * Send stanza only to online contact.
+ *
+ * Path measurement.
+ * With xmpp.probe=N, the module sends XMPP Ping (XEP-0199) to the remote jid
+ * every N ms and measures RTT by the answer. A ping without answer before
+ * the next one is counted as lost. Note that the path includes the servers
+ * of both peers. Pings from other entities are always answered.
  */
 
 struct tp_xmpp_ctx {
@@ -83,6 +91,12 @@ struct tp_xmpp_ctx {
 	char                    *txc_remote;
 	bool                     txc_is_server;
 	uint32_t                 txc_id_cnt;
+	/* Ping interval in ms, 0 if disabled. */
+	unsigned long            txc_ping_ival;
+	char                     txc_ping_id[16];
+	bool                     txc_ping_pending;
+	uint64_t                 txc_ping_sent;
+	struct pppoat_rtt        txc_rtt;
 	uint32_t                 txc_magic;
 };
 
@@ -98,11 +112,13 @@ enum {
 #define XMPP_CONF_JID "xmpp.jid"
 #define XMPP_CONF_PASSWD "xmpp.passwd"
 #define XMPP_CONF_REMOTE "xmpp.remote"
+#define XMPP_CONF_PROBE "xmpp.probe"
 
 #define XMPP_NS_XEP_0091 "jabber:x:delay"
 #define XMPP_NS_XEP_0203 "urn:xmpp:delay"
 #define XMPP_NS_XEP_0092 "jabber:iq:version"
 #define XMPP_NS_XEP_0030_INFO "http://jabber.org/protocol/disco#info"
+#define XMPP_NS_XEP_0199 "urn:xmpp:ping"
 
 #ifndef PACKAGE_NAME
 #define PACKAGE_NAME "pppoat"
@@ -130,6 +146,11 @@ static int tp_xmpp_version_handler(xmpp_conn_t   *conn,
 static int tp_xmpp_disco_handler(xmpp_conn_t   *conn,
 				 xmpp_stanza_t *stanza,
 				 void          *userdata);
+static int tp_xmpp_ping_handler(xmpp_conn_t   *conn,
+				xmpp_stanza_t *stanza,
+				void          *userdata);
+static int tp_xmpp_ping_timer_cb(xmpp_conn_t *conn, void *userdata);
+static void tp_xmpp_ping_cancel(struct tp_xmpp_ctx *ctx);
 static int tp_xmpp_send_pkt(struct tp_xmpp_ctx *ctx, struct pppoat_packet *pkt);
 
 static const char *tp_xmpp_sw_name = PACKAGE_NAME;
@@ -143,11 +164,17 @@ static bool tp_xmpp_ctx_invariant(struct tp_xmpp_ctx *ctx)
 
 static int tp_xmpp_conf_parse(struct tp_xmpp_ctx *ctx, struct pppoat_conf *conf)
 {
-	int rc;
+	long probe;
+	int  rc;
 
 	ctx->txc_jid = NULL;
 	ctx->txc_passwd = NULL;
 	ctx->txc_remote = NULL;
+	ctx->txc_ping_ival = 0;
+
+	rc = pppoat_conf_find_long(conf, XMPP_CONF_PROBE, &probe);
+	if (rc == 0 && probe > 0)
+		ctx->txc_ping_ival = (unsigned long)probe;
 
 	pppoat_conf_find_bool(conf, XMPP_CONF_SERVER, &ctx->txc_is_server);
 
@@ -203,6 +230,8 @@ static int tp_xmpp_init(struct pppoat_module *mod, struct pppoat_conf *conf)
 	PPPOAT_ASSERT(ctx->txc_xmpp_ctx != NULL); /* XXX */
 
 	ctx->txc_id_cnt = 0;
+	ctx->txc_ping_pending = false;
+	pppoat_rtt_init(&ctx->txc_rtt);
 	ctx->txc_magic  = PPPOAT_MODULE_TP_XMPP_MAGIC;
 	ctx->txc_module = mod;
 	mod->m_userdata = ctx;
@@ -234,6 +263,7 @@ static void tp_xmpp_fini(struct pppoat_module *mod)
 	tp_xmpp_queue_flush(&ctx->txc_send_q, mod);
 	pppoat_queue_fini(&ctx->txc_recv_q);
 	pppoat_queue_fini(&ctx->txc_send_q);
+	pppoat_rtt_fini(&ctx->txc_rtt);
 	tp_xmpp_conf_fini(ctx);
 	pppoat_free(ctx);
 }
@@ -289,6 +319,9 @@ static void tp_xmpp_handlers_register(struct tp_xmpp_ctx *ctx)
 	/* Service Discovery handler */
 	xmpp_handler_add(ctx->txc_xmpp_conn, tp_xmpp_disco_handler,
 			 XMPP_NS_XEP_0030_INFO, "iq", "get", ctx);
+	/* XMPP Ping handler */
+	xmpp_handler_add(ctx->txc_xmpp_conn, tp_xmpp_ping_handler,
+			 XMPP_NS_XEP_0199, "iq", "get", ctx);
 }
 
 static int tp_xmpp_run(struct pppoat_module *mod)
@@ -369,6 +402,21 @@ static size_t tp_xmpp_mtu(struct pppoat_module *mod)
 	return TP_XMPP_MTU;
 }
 
+static void tp_xmpp_stats(struct pppoat_module *mod)
+{
+	struct tp_xmpp_ctx *ctx = mod->m_userdata;
+
+	if (ctx->txc_ping_ival != 0)
+		pppoat_rtt_log(&ctx->txc_rtt, "xmpp");
+}
+
+static int tp_xmpp_rtt(struct pppoat_module *mod, struct pppoat_rtt_stats *stats)
+{
+	struct tp_xmpp_ctx *ctx = mod->m_userdata;
+
+	return pppoat_rtt_get(&ctx->txc_rtt, stats);
+}
+
 static struct pppoat_module_ops tp_xmpp_ops = {
 	.mop_init    = &tp_xmpp_init,
 	.mop_fini    = &tp_xmpp_fini,
@@ -376,6 +424,8 @@ static struct pppoat_module_ops tp_xmpp_ops = {
 	.mop_stop    = &tp_xmpp_stop,
 	.mop_process = &tp_xmpp_process,
 	.mop_mtu     = &tp_xmpp_mtu,
+	.mop_stats   = &tp_xmpp_stats,
+	.mop_rtt     = &tp_xmpp_rtt,
 };
 
 struct pppoat_module_impl pppoat_module_tp_xmpp = {
@@ -515,9 +565,15 @@ static void tp_xmpp_conn_handler(xmpp_conn_t         *conn,
 		PPPOAT_ASSERT(presence != NULL);
 		xmpp_send(conn, presence);
 		xmpp_stanza_release(presence);
+		if (ctx->txc_ping_ival != 0 && ctx->txc_remote != NULL) {
+			tp_xmpp_ping_cancel(ctx);
+			xmpp_timed_handler_add(conn, &tp_xmpp_ping_timer_cb,
+					       ctx->txc_ping_ival, ctx);
+		}
 		break;
 
 	case XMPP_CONN_DISCONNECT:
+		tp_xmpp_ping_cancel(ctx);
 		tp_xmpp_conn_reconnect(ctx);
 		break;
 
@@ -693,6 +749,14 @@ static int tp_xmpp_disco_handler(xmpp_conn_t   *conn,
 	xmpp_stanza_add_child(query, item);
 	xmpp_stanza_release(item);
 
+	item = xmpp_stanza_new(xmpp_ctx);
+	if (item == NULL)
+		goto quit;
+	xmpp_stanza_set_name(item, "feature");
+	xmpp_stanza_set_attribute(item, "var", XMPP_NS_XEP_0199);
+	xmpp_stanza_add_child(query, item);
+	xmpp_stanza_release(item);
+
 	xmpp_send(conn, iq);
 
 quit:
@@ -734,6 +798,104 @@ static char *tp_xmpp_id_alloc(struct tp_xmpp_ctx *ctx, enum tp_xmpp_id_t type)
 	return id;
 }
 
+static int tp_xmpp_ping_handler(xmpp_conn_t   *conn,
+				xmpp_stanza_t *stanza,
+				void          *userdata)
+{
+	struct tp_xmpp_ctx *ctx = userdata;
+	xmpp_stanza_t      *iq;
+
+	PPPOAT_ASSERT(tp_xmpp_ctx_invariant(ctx));
+
+	iq = xmpp_stanza_reply(stanza);
+	if (iq != NULL) {
+		xmpp_stanza_del_attribute(iq, "xmlns");
+		xmpp_stanza_set_type(iq, "result");
+		xmpp_send(conn, iq);
+		xmpp_stanza_release(iq);
+	}
+	return 1;
+}
+
+static uint64_t tp_xmpp_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Result and error both mean that the ping reached the remote side. */
+static int tp_xmpp_pong_handler(xmpp_conn_t   *conn,
+				xmpp_stanza_t *stanza,
+				void          *userdata)
+{
+	struct tp_xmpp_ctx *ctx = userdata;
+
+	PPPOAT_ASSERT(tp_xmpp_ctx_invariant(ctx));
+
+	if (ctx->txc_ping_pending) {
+		ctx->txc_ping_pending = false;
+		pppoat_rtt_sample(&ctx->txc_rtt,
+				  tp_xmpp_now() - ctx->txc_ping_sent);
+		pppoat_rtt_loss_sample(&ctx->txc_rtt, false);
+	}
+	/* Remove the handler. */
+	return 0;
+}
+
+static void tp_xmpp_ping_pending_drop(struct tp_xmpp_ctx *ctx)
+{
+	if (ctx->txc_ping_pending) {
+		xmpp_id_handler_delete(ctx->txc_xmpp_conn,
+				       &tp_xmpp_pong_handler,
+				       ctx->txc_ping_id);
+		ctx->txc_ping_pending = false;
+	}
+}
+
+static void tp_xmpp_ping_cancel(struct tp_xmpp_ctx *ctx)
+{
+	xmpp_timed_handler_delete(ctx->txc_xmpp_conn, &tp_xmpp_ping_timer_cb);
+	tp_xmpp_ping_pending_drop(ctx);
+}
+
+static int tp_xmpp_ping_timer_cb(xmpp_conn_t *conn, void *userdata)
+{
+	struct tp_xmpp_ctx *ctx = userdata;
+	xmpp_stanza_t      *iq;
+	xmpp_stanza_t      *ping;
+
+	PPPOAT_ASSERT(tp_xmpp_ctx_invariant(ctx));
+
+	if (ctx->txc_ping_pending)
+		pppoat_rtt_loss_sample(&ctx->txc_rtt, true);
+	tp_xmpp_ping_pending_drop(ctx);
+
+	tp_xmpp_id(ctx, XMPP_ID_IQ, ctx->txc_ping_id, sizeof ctx->txc_ping_id);
+	iq = xmpp_iq_new(ctx->txc_xmpp_ctx, "get", ctx->txc_ping_id);
+	ping = xmpp_stanza_new(ctx->txc_xmpp_ctx);
+	if (iq == NULL || ping == NULL)
+		goto quit;
+	xmpp_stanza_set_attribute(iq, "to", ctx->txc_remote);
+	xmpp_stanza_set_name(ping, "ping");
+	xmpp_stanza_set_ns(ping, XMPP_NS_XEP_0199);
+	xmpp_stanza_add_child(iq, ping);
+
+	xmpp_id_handler_add(conn, &tp_xmpp_pong_handler, ctx->txc_ping_id, ctx);
+	ctx->txc_ping_pending = true;
+	ctx->txc_ping_sent = tp_xmpp_now();
+	xmpp_send(conn, iq);
+
+quit:
+	if (ping != NULL)
+		xmpp_stanza_release(ping);
+	if (iq != NULL)
+		xmpp_stanza_release(iq);
+	/* Keep the timed handler. */
+	return 1;
+}
+
 static int tp_xmpp_send_pkt(struct tp_xmpp_ctx *ctx, struct pppoat_packet *pkt)
 {
 	xmpp_stanza_t *msg;
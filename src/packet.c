@@ -24,6 +24,8 @@
 #include "memory.h"
 #include "packet.h"
 
+#include <string.h>	/* memcpy */
+
 static struct pppoat_list_descr packets_cache_descr =
 	PPPOAT_LIST_DESCR("Packets cache", struct pppoat_packet, pkt_cache_link,
 			  pkt_cache_magic, PPPOAT_PACKETS_CACHE_MAGIC);
@@ -147,6 +149,38 @@ struct pppoat_packet *pppoat_packet_get_empty(struct pppoat_packets *pkts)
 	return pkt;
 }
 
+int pppoat_packet_reserve(struct pppoat_packets *pkts,
+			  struct pppoat_packet  *pkt,
+			  size_t                 size)
+{
+	const struct pppoat_packet_ops *ops;
+	struct pppoat_packet           *tmp;
+	void                           *data;
+	size_t                          size_actual;
+
+	if (pkt->pkt_size_actual >= size)
+		return 0;
+
+	tmp = pppoat_packet_get(pkts, size);
+	if (tmp == NULL)
+		return P_ERR(-ENOMEM);
+	memcpy(tmp->pkt_data, pkt->pkt_data, pkt->pkt_size);
+
+	/* Swap buffers, so the old one is released with the temporary packet. */
+	data        = pkt->pkt_data;
+	size_actual = pkt->pkt_size_actual;
+	ops         = pkt->pkt_ops;
+	pkt->pkt_data        = tmp->pkt_data;
+	pkt->pkt_size_actual = tmp->pkt_size_actual;
+	pkt->pkt_ops         = tmp->pkt_ops;
+	tmp->pkt_data        = data;
+	tmp->pkt_size_actual = size_actual;
+	tmp->pkt_ops         = ops;
+	pppoat_packet_put(pkts, tmp);
+
+	return 0;
+}
+
 void pppoat_packet_put(struct pppoat_packets *pkts, struct pppoat_packet *pkt)
 {
 	if (pkt->pkt_size_actual == 0) {
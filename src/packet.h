@@ -82,6 +82,18 @@ struct pppoat_packet *pppoat_packet_get(struct pppoat_packets *pkts,
  */
 struct pppoat_packet *pppoat_packet_get_empty(struct pppoat_packets *pkts);
 
+/**
+ * Makes sure that the packet's data buffer is at least `size' bytes.
+ *
+ * If the buffer is smaller, it's replaced with a bigger one and the first
+ * pkt_size bytes are copied. pkt_size is not changed.
+ *
+ * @return 0 on success or -ENOMEM.
+ */
+int pppoat_packet_reserve(struct pppoat_packets *pkts,
+			  struct pppoat_packet  *pkt,
+			  size_t                 size);
+
 /**
  * Marks the packet object as unused.
  *
@@ -0,0 +1,544 @@
+/* peers.c
+ * PPP over Any Transport -- Peer table of a datagram server
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "memory.h"
+#include "misc.h"
+#include "peers.h"
+
+#include <errno.h>
+#include <string.h>	/* memcmp, memcpy, memset */
+#include <netinet/in.h>	/* sockaddr_in, sockaddr_in6 */
+
+enum {
+	/** Peers examined by a search for replacement. */
+	PEERS_SCAN = 64,
+};
+
+enum peers_index {
+	PEERS_BY_ADDR,
+	PEERS_BY_SESSION,
+};
+
+/** Fills port and address of a socket address. Returns 0 for other families. */
+static size_t peers_addr_key(const struct sockaddr *addr, unsigned char *key)
+{
+	const struct sockaddr_in  *sin;
+	const struct sockaddr_in6 *sin6;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in *)addr;
+		memcpy(key, &sin->sin_port, 2);
+		memcpy(key + 2, &sin->sin_addr, 4);
+		return 6;
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *)addr;
+		memcpy(key, &sin6->sin6_port, 2);
+		/* Mapped IPv4 address matches the same IPv4 peer. */
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			memcpy(key + 2, &sin6->sin6_addr.s6_addr[12], 4);
+			return 6;
+		}
+		memcpy(key + 2, &sin6->sin6_addr, 16);
+		return 18;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t peers_nh(struct pppoat_peers *ps, struct pppoat_peer *peer)
+{
+	return (uint32_t)(peer - ps->ps_peers);
+}
+
+static uint32_t *peers_idx(struct pppoat_peers *ps, enum peers_index which)
+{
+	return which == PEERS_BY_ADDR ? ps->ps_addr_idx : ps->ps_session_idx;
+}
+
+static const unsigned char *peers_key(const struct pppoat_peer *peer,
+				      enum peers_index          which,
+				      size_t                   *keylen)
+{
+	if (which == PEERS_BY_SESSION) {
+		*keylen = sizeof peer->pe_session;
+		return (const unsigned char *)&peer->pe_session;
+	}
+	*keylen = peer->pe_keylen;
+	return peer->pe_key;
+}
+
+static uint32_t peers_hash(struct pppoat_peers *ps,
+			   const unsigned char *key,
+			   size_t               keylen)
+{
+	return pppoat_siphash(&ps->ps_key, key, keylen) & ps->ps_mask;
+}
+
+/**
+ * Looks a key up in the index. On a miss, `slot' receives the free slot
+ * where the key belongs.
+ */
+static struct pppoat_peer *peers_find(struct pppoat_peers *ps,
+				      enum peers_index     which,
+				      const unsigned char *key,
+				      size_t               keylen,
+				      uint32_t            *slot)
+{
+	struct pppoat_peer  *peer;
+	const unsigned char *pkey;
+	uint32_t            *idx = peers_idx(ps, which);
+	size_t               plen;
+	uint32_t             i;
+
+	i = peers_hash(ps, key, keylen);
+	/* The index is at least twice bigger than ps_max. */
+	for (; idx[i] != 0; i = (i + 1) & ps->ps_mask) {
+		peer = &ps->ps_peers[idx[i] - 1];
+		pkey = peers_key(peer, which, &plen);
+		if (plen == keylen && memcmp(pkey, key, keylen) == 0)
+			return peer;
+	}
+	if (slot != NULL)
+		*slot = i;
+	return NULL;
+}
+
+/**
+ * Publishes a fully initialised peer in the index. Must be called under
+ * ps_lock.
+ */
+static void peers_index(struct pppoat_peers *ps,
+			enum peers_index     which,
+			struct pppoat_peer  *peer)
+{
+	const unsigned char *key;
+	size_t               keylen;
+	uint32_t             slot = 0;
+
+	key = peers_key(peer, which, &keylen);
+	(void)peers_find(ps, which, key, keylen, &slot);
+	__sync_synchronize();
+	peers_idx(ps, which)[slot] = peers_nh(ps, peer) + 1;
+}
+
+/**
+ * Removes a peer from the index with backward shift. A concurrent lookup
+ * may miss a moved peer, then it repeats the search under the lock.
+ */
+static void peers_unindex(struct pppoat_peers *ps,
+			  enum peers_index     which,
+			  struct pppoat_peer  *peer)
+{
+	struct pppoat_peer  *p2;
+	const unsigned char *key;
+	uint32_t            *idx = peers_idx(ps, which);
+	uint32_t             mask = ps->ps_mask;
+	size_t               keylen;
+	uint32_t             home;
+	uint32_t             i;
+	uint32_t             j;
+
+	key = peers_key(peer, which, &keylen);
+	i = peers_hash(ps, key, keylen);
+	while (&ps->ps_peers[idx[i] - 1] != peer)
+		i = (i + 1) & mask;
+	for (j = (i + 1) & mask; idx[j] != 0; j = (j + 1) & mask) {
+		p2   = &ps->ps_peers[idx[j] - 1];
+		key  = peers_key(p2, which, &keylen);
+		home = peers_hash(ps, key, keylen);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			idx[i] = idx[j];
+			i = j;
+		}
+	}
+	idx[i] = 0;
+}
+
+/**
+ * Deletes routes of the peer and removes it from the indices. Must be
+ * called under ps_lock.
+ */
+static void peers_detach(struct pppoat_peers *ps, struct pppoat_peer *peer)
+{
+	while (peer->pe_routes_nr > 0)
+		(void)pppoat_lpm_del(&ps->ps_lpm,
+				     peer->pe_routes[--peer->pe_routes_nr], 32);
+	if (peer->pe_keylen != 0)
+		peers_unindex(ps, PEERS_BY_ADDR, peer);
+	if (peer->pe_session != 0)
+		peers_unindex(ps, PEERS_BY_SESSION, peer);
+	peer->pe_keylen  = 0;
+	peer->pe_session = 0;
+}
+
+/**
+ * Finds a learned peer which has been idle for PPPOAT_PEERS_IDLE or has
+ * lost its address and detaches it. Must be called under ps_lock.
+ */
+static struct pppoat_peer *peers_evict(struct pppoat_peers *ps, uint64_t now)
+{
+	struct pppoat_peer *peer = NULL;
+	unsigned            i;
+
+	for (i = 0; i < pppoat_min(ps->ps_nr, PEERS_SCAN); ++i) {
+		peer = &ps->ps_peers[ps->ps_hand];
+		ps->ps_hand = (ps->ps_hand + 1) % ps->ps_nr;
+		if (!peer->pe_static &&
+		    (peer->pe_keylen == 0 ||
+		     now - peer->pe_last >= PPPOAT_PEERS_IDLE))
+			break;
+		peer = NULL;
+	}
+	if (peer != NULL)
+		peers_detach(ps, peer);
+	return peer;
+}
+
+/**
+ * Adds a new peer or replaces an idle one. Lookup doesn't take the lock,
+ * so the peer is fully initialised before it's published in the indices.
+ * Must be called under ps_lock.
+ */
+static int peers_add(struct pppoat_peers    *ps,
+		     const struct sockaddr  *addr,
+		     socklen_t               addrlen,
+		     const unsigned char    *key,
+		     size_t                  keylen,
+		     uint64_t                session,
+		     uint64_t                now,
+		     struct pppoat_peer    **peer)
+{
+	struct pppoat_peer *p;
+
+	p = ps->ps_nr < ps->ps_max ? &ps->ps_peers[ps->ps_nr++] :
+				     peers_evict(ps, now);
+	if (p == NULL)
+		return P_ERR(-ENOSPC);
+
+	memcpy(&p->pe_addr, addr, addrlen);
+	memcpy(p->pe_key, key, keylen);
+	memset(&p->pe_replay, 0, sizeof p->pe_replay);
+	p->pe_addrlen   = addrlen;
+	p->pe_keylen    = keylen;
+	p->pe_session   = session;
+	p->pe_last      = now;
+	p->pe_addr_last = now;
+	p->pe_static    = false;
+	p->pe_routes_nr = 0;
+	peers_index(ps, PEERS_BY_ADDR, p);
+	if (session != 0)
+		peers_index(ps, PEERS_BY_SESSION, p);
+	*peer = p;
+
+	return 0;
+}
+
+int pppoat_peers_init(struct pppoat_peers *ps, unsigned max, const void *seed)
+{
+	size_t slots;
+	int    rc;
+
+	for (slots = 1; slots < 2 * (size_t)max; slots <<= 1);
+	ps->ps_peers       = pppoat_calloc(max, sizeof *ps->ps_peers);
+	ps->ps_addr_idx    = pppoat_calloc(slots, sizeof *ps->ps_addr_idx);
+	ps->ps_session_idx = pppoat_calloc(slots, sizeof *ps->ps_session_idx);
+	rc = ps->ps_peers == NULL || ps->ps_addr_idx == NULL ||
+	     ps->ps_session_idx == NULL ? P_ERR(-ENOMEM) : 0;
+	/* Every peer typically brings at most one /24 with host routes. */
+	rc = rc ?: pppoat_lpm_init(&ps->ps_lpm, max);
+	if (rc != 0) {
+		pppoat_free(ps->ps_session_idx);
+		pppoat_free(ps->ps_addr_idx);
+		pppoat_free(ps->ps_peers);
+		return rc;
+	}
+	ps->ps_nr   = 0;
+	ps->ps_max  = max;
+	ps->ps_mask = (uint32_t)slots - 1;
+	ps->ps_hand = 0;
+	pppoat_siphash_key_set(&ps->ps_key, seed);
+	pppoat_mutex_init(&ps->ps_lock);
+	pppoat_mutex_init(&ps->ps_replay_lock);
+
+	return 0;
+}
+
+void pppoat_peers_fini(struct pppoat_peers *ps)
+{
+	pppoat_lpm_fini(&ps->ps_lpm);
+	pppoat_mutex_fini(&ps->ps_replay_lock);
+	pppoat_mutex_fini(&ps->ps_lock);
+	pppoat_free(ps->ps_session_idx);
+	pppoat_free(ps->ps_addr_idx);
+	pppoat_free(ps->ps_peers);
+}
+
+int pppoat_peers_get(struct pppoat_peers    *ps,
+		     const struct sockaddr  *addr,
+		     socklen_t               addrlen,
+		     uint64_t                now,
+		     struct pppoat_peer    **peer)
+{
+	unsigned char key[PPPOAT_PEERS_KEY_MAX];
+	size_t        keylen;
+	int           rc = 0;
+
+	keylen = peers_addr_key(addr, key);
+	if (keylen == 0 || addrlen > sizeof (*peer)->pe_addr)
+		return P_ERR(-EAFNOSUPPORT);
+
+	*peer = peers_find(ps, PEERS_BY_ADDR, key, keylen, NULL);
+	if (*peer == NULL) {
+		pppoat_mutex_lock(&ps->ps_lock);
+		*peer = peers_find(ps, PEERS_BY_ADDR, key, keylen, NULL);
+		if (*peer == NULL)
+			rc = peers_add(ps, addr, addrlen, key, keylen, 0, now,
+				       peer);
+		pppoat_mutex_unlock(&ps->ps_lock);
+	}
+	if (rc == 0) {
+		(*peer)->pe_last      = now;
+		(*peer)->pe_addr_last = now;
+	}
+	return rc;
+}
+
+/**
+ * Finds peer of a session which isn't in the index yet. A peer at the same
+ * address takes the session if it continues the sequence numbers. Must be
+ * called under ps_lock.
+ */
+static int peers_session_add(struct pppoat_peers    *ps,
+			     const struct sockaddr  *addr,
+			     socklen_t               addrlen,
+			     const unsigned char    *key,
+			     size_t                  keylen,
+			     uint64_t                session,
+			     uint64_t                seq,
+			     uint64_t                now,
+			     struct pppoat_peer    **peer)
+{
+	struct pppoat_peer *p;
+
+	*peer = peers_find(ps, PEERS_BY_SESSION,
+			   (const unsigned char *)&session, sizeof session,
+			   NULL);
+	if (*peer != NULL)
+		return 0;
+	p = peers_find(ps, PEERS_BY_ADDR, key, keylen, NULL);
+	if (p == NULL)
+		return peers_add(ps, addr, addrlen, key, keylen, session, now,
+				 peer);
+
+	/* A replayed datagram of an old session mustn't reset the window. */
+	if (p->pe_session != 0 && seq <= p->pe_replay.rp_top)
+		return -EALREADY;
+	if (p->pe_session != 0)
+		peers_unindex(ps, PEERS_BY_SESSION, p);
+	pppoat_mutex_lock(&ps->ps_replay_lock);
+	memset(&p->pe_replay, 0, sizeof p->pe_replay);
+	pppoat_mutex_unlock(&ps->ps_replay_lock);
+	p->pe_session = session;
+	peers_index(ps, PEERS_BY_SESSION, p);
+	*peer = p;
+
+	return 0;
+}
+
+/**
+ * Moves the peer to a new address. A learned peer which has the address
+ * is detached, it's a stale peer of the same remote. Must be called under
+ * ps_lock.
+ */
+static void peers_move(struct pppoat_peers   *ps,
+		       struct pppoat_peer    *peer,
+		       const struct sockaddr *addr,
+		       socklen_t              addrlen,
+		       const unsigned char   *key,
+		       size_t                 keylen,
+		       uint64_t               now)
+{
+	struct pppoat_peer *other;
+
+	other = peers_find(ps, PEERS_BY_ADDR, key, keylen, NULL);
+	if (other == peer || (other != NULL && other->pe_static))
+		return;
+	if (other != NULL)
+		peers_detach(ps, other);
+
+	if (peer->pe_keylen != 0)
+		peers_unindex(ps, PEERS_BY_ADDR, peer);
+	memcpy(&peer->pe_addr, addr, addrlen);
+	memcpy(peer->pe_key, key, keylen);
+	peer->pe_addrlen   = addrlen;
+	peer->pe_keylen    = keylen;
+	peer->pe_addr_last = now;
+	peers_index(ps, PEERS_BY_ADDR, peer);
+}
+
+int pppoat_peers_accept(struct pppoat_peers    *ps,
+			const struct sockaddr  *addr,
+			socklen_t               addrlen,
+			uint64_t                session,
+			uint64_t                seq,
+			uint64_t                now,
+			struct pppoat_peer    **peer,
+			bool                   *newest)
+{
+	unsigned char       key[PPPOAT_PEERS_KEY_MAX];
+	struct pppoat_peer *p;
+	size_t              keylen;
+	bool                fresh;
+	int                 rc = 0;
+
+	keylen = peers_addr_key(addr, key);
+	if (keylen == 0 || addrlen > sizeof p->pe_addr)
+		return P_ERR(-EAFNOSUPPORT);
+	if (session == 0)
+		return -EINVAL;
+
+	p = peers_find(ps, PEERS_BY_SESSION, (const unsigned char *)&session,
+		       sizeof session, NULL);
+	if (p == NULL) {
+		pppoat_mutex_lock(&ps->ps_lock);
+		rc = peers_session_add(ps, addr, addrlen, key, keylen, session,
+				       seq, now, &p);
+		pppoat_mutex_unlock(&ps->ps_lock);
+	}
+	if (rc != 0)
+		return rc;
+
+	/* Several workers receive from the same peer. */
+	pppoat_mutex_lock(&ps->ps_replay_lock);
+	fresh = pppoat_replay_check(&p->pe_replay, seq, newest);
+	pppoat_mutex_unlock(&ps->ps_replay_lock);
+	if (!fresh)
+		return -EALREADY;
+
+	p->pe_last = now;
+	if (p->pe_keylen == keylen && memcmp(p->pe_key, key, keylen) == 0) {
+		p->pe_addr_last = now;
+	} else if (*newest &&
+		   now - p->pe_addr_last >= PPPOAT_PEERS_ROAM_HOLD) {
+		pppoat_mutex_lock(&ps->ps_lock);
+		peers_move(ps, p, addr, addrlen, key, keylen, now);
+		pppoat_mutex_unlock(&ps->ps_lock);
+	}
+	*peer = p;
+
+	return 0;
+}
+
+int pppoat_peers_route_add(struct pppoat_peers *ps,
+			   uint32_t             prefix,
+			   uint8_t              len,
+			   struct pppoat_peer  *peer)
+{
+	int rc;
+
+	pppoat_mutex_lock(&ps->ps_lock);
+	rc = pppoat_lpm_add(&ps->ps_lpm, prefix, len, peers_nh(ps, peer));
+	pppoat_mutex_unlock(&ps->ps_lock);
+
+	return rc;
+}
+
+struct pppoat_peer *pppoat_peers_route(struct pppoat_peers *ps,
+				       uint32_t             addr)
+{
+	uint32_t nh;
+
+	if (pppoat_lpm_lookup(&ps->ps_lpm, addr, &nh) != 0)
+		return NULL;
+	return &ps->ps_peers[nh];
+}
+
+/** Returns position of a learned route in the peer or -1. */
+static int peers_route_pos(struct pppoat_peer *peer, uint32_t addr)
+{
+	unsigned i;
+
+	for (i = 0; i < peer->pe_routes_nr; ++i)
+		if (peer->pe_routes[i] == addr)
+			return (int)i;
+	return -1;
+}
+
+int pppoat_peers_learn(struct pppoat_peers *ps,
+		       struct pppoat_peer  *peer,
+		       uint32_t             addr,
+		       bool                 rebind)
+{
+	struct pppoat_peer *owner = NULL;
+	uint32_t            nh;
+	int                 pos = -1;
+	int                 rc;
+
+	if (pppoat_lpm_lookup(&ps->ps_lpm, addr, &nh) == 0 &&
+	    nh == peers_nh(ps, peer))
+		return 0;
+
+	pppoat_mutex_lock(&ps->ps_lock);
+	if (pppoat_lpm_find(&ps->ps_lpm, addr, 32, &nh) == 0) {
+		owner = &ps->ps_peers[nh];
+		pos = owner == peer ? -1 : peers_route_pos(owner, addr);
+	}
+	if (owner != NULL && (!rebind || pos < 0))
+		rc = owner == peer ? 0 : -EEXIST;
+	else if (peer->pe_routes_nr == PPPOAT_PEERS_ROUTES)
+		rc = -ENOSPC;
+	else
+		rc = pppoat_lpm_add(&ps->ps_lpm, addr, 32, peers_nh(ps, peer));
+	if (rc == 0 && pos >= 0)
+		owner->pe_routes[pos] = owner->pe_routes[--owner->pe_routes_nr];
+	if (rc == 0 && owner != peer)
+		peer->pe_routes[peer->pe_routes_nr++] = addr;
+	pppoat_mutex_unlock(&ps->ps_lock);
+
+	return rc;
+}
+
+bool pppoat_replay_check(struct pppoat_replay *rp, uint64_t seq, bool *newest)
+{
+	uint64_t *word;
+	uint64_t  bit = 1ULL << (seq % 64);
+	uint64_t  top = rp->rp_top / 64;
+	uint64_t  skip;
+	uint64_t  i;
+
+	*newest = seq > rp->rp_top;
+	if (seq > rp->rp_top) {
+		skip = pppoat_min(seq / 64 - top,
+				  (uint64_t)PPPOAT_REPLAY_WORDS);
+		for (i = 1; i <= skip; ++i)
+			rp->rp_map[(top + i) % PPPOAT_REPLAY_WORDS] = 0;
+		rp->rp_top = seq;
+	} else if (rp->rp_top - seq >= PPPOAT_REPLAY_WIN)
+		return false;
+
+	word = &rp->rp_map[(seq / 64) % PPPOAT_REPLAY_WORDS];
+	if ((*word & bit) != 0)
+		return false;
+	*word |= bit;
+
+	return true;
+}
@@ -0,0 +1,193 @@
+/* peers.h
+ * PPP over Any Transport -- Peer table of a datagram server
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_PEERS_H__
+#define __PPPOAT_PEERS_H__
+
+#include "lpm.h"
+#include "mutex.h"
+#include "siphash.h"
+
+#include <stdbool.h>
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+#include <sys/socket.h>	/* sockaddr_storage, socklen_t */
+
+/**
+ * High level design.
+ *
+ * The table keeps peers of a server which serves multiple peers on
+ * a single port. The peer array is preallocated and open addressing hash
+ * tables map outer address and session of a peer to its index without
+ * locks on the receive path. Adding of peers and routes is serialised by
+ * a lock. The table reads no clock, user passes the current time in ms.
+ *
+ * An authenticated peer puts a random session number and a sequence number
+ * into every datagram. The replay window belongs to the session, not to
+ * the outer address, so a datagram replayed from another address is
+ * dropped and doesn't take a peer. A datagram which advances the window
+ * moves the peer to its source address once the old address has been
+ * silent for PPPOAT_PEERS_ROAM_HOLD, so the peer may change its address
+ * while datagrams from several source ports of a peer don't make it flap.
+ * A new session from a known address replaces the old one if it continues
+ * the sequence numbers, i.e. the peer has restarted. Peers start sequence
+ * numbers from the current time for this reason.
+ *
+ * When the array is full, a new peer replaces a learned peer which has been
+ * silent for PPPOAT_PEERS_IDLE, so random or spoofed source addresses don't
+ * exhaust it. The search continues from where the previous one stopped and
+ * examines a limited number of peers. Peers of static routes are never
+ * replaced.
+ *
+ * Routes are kept in a longest prefix match table with peer index as the
+ * next hop. A peer learns at most PPPOAT_PEERS_ROUTES host routes, they're
+ * deleted with the peer. A learned route moves to another peer only on
+ * user's request, e.g. when a restarted client has appeared at a new
+ * address with a new session.
+ */
+
+enum {
+	/** Port and IPv6 address. */
+	PPPOAT_PEERS_KEY_MAX   = 18,
+	/** Learned routes per peer. */
+	PPPOAT_PEERS_ROUTES    = 4,
+	/** Idle time in ms after which a learned peer may be replaced. */
+	PPPOAT_PEERS_IDLE      = 120 * 1000,
+	/** Silence of the old address in ms before a peer moves. */
+	PPPOAT_PEERS_ROAM_HOLD = 1000,
+	/** Words of the replay window, the last word is partially valid. */
+	PPPOAT_REPLAY_WORDS    = 17,
+	PPPOAT_REPLAY_WIN      = (PPPOAT_REPLAY_WORDS - 1) * 64,
+};
+
+/**
+ * Replay window in the spirit of RFC 6479. Bit of sequence number n is kept
+ * in a ring of words, so advancing the window only clears skipped words.
+ */
+struct pppoat_replay {
+	/** Greatest accepted sequence number. */
+	uint64_t rp_top;
+	uint64_t rp_map[PPPOAT_REPLAY_WORDS];
+};
+
+struct pppoat_peer {
+	struct sockaddr_storage pe_addr;
+	socklen_t               pe_addrlen;
+	/** Session of an authenticated peer, 0 if unknown. */
+	uint64_t                pe_session;
+	/** Replay window of the session, protected by ps_replay_lock. */
+	struct pppoat_replay    pe_replay;
+	/** Time of the last datagram. */
+	uint64_t                pe_last;
+	/** Time of the last datagram from pe_addr. */
+	uint64_t                pe_addr_last;
+	/** Peer of a static route, it's never replaced. */
+	bool                    pe_static;
+	/** Learned /32 routes, protected by ps_lock. */
+	uint32_t                pe_routes[PPPOAT_PEERS_ROUTES];
+	unsigned                pe_routes_nr;
+	/** Port and address used as a key, zero length if not indexed. */
+	unsigned char           pe_key[PPPOAT_PEERS_KEY_MAX];
+	size_t                  pe_keylen;
+};
+
+struct pppoat_peers {
+	struct pppoat_peer        *ps_peers;
+	unsigned                   ps_nr;
+	unsigned                   ps_max;
+	/** Indices by address and by session, a slot keeps index + 1. */
+	uint32_t                  *ps_addr_idx;
+	uint32_t                  *ps_session_idx;
+	uint32_t                   ps_mask;
+	/** Next peer to examine for replacement. */
+	unsigned                   ps_hand;
+	struct pppoat_siphash_key  ps_key;
+	/** Serialises adding of peers and routes. */
+	struct pppoat_mutex        ps_lock;
+	/** Protects replay windows of the peers. */
+	struct pppoat_mutex        ps_replay_lock;
+	struct pppoat_lpm          ps_lpm;
+};
+
+/**
+ * Initialises empty table for `max' peers. `seed' is PPPOAT_SIPHASH_KEY_LEN
+ * random bytes for the hash tables.
+ */
+int pppoat_peers_init(struct pppoat_peers *ps, unsigned max, const void *seed);
+void pppoat_peers_fini(struct pppoat_peers *ps);
+
+/**
+ * Finds a peer by address or adds a new one. It's used for peers of static
+ * routes and without authentication.
+ *
+ * @return 0, -EAFNOSUPPORT or -ENOSPC if there is no idle peer to replace.
+ */
+int pppoat_peers_get(struct pppoat_peers    *ps,
+		     const struct sockaddr  *addr,
+		     socklen_t               addrlen,
+		     uint64_t                now,
+		     struct pppoat_peer    **peer);
+
+/**
+ * Accepts an authenticated datagram. Finds the peer by session or adds
+ * a new one and checks the sequence number against the replay window.
+ * `newest' is set if the datagram has advanced the window.
+ *
+ * @return 0, -EALREADY if the datagram is replayed, older than the window
+ *         or older than the session of the peer at the same address,
+ *         -EINVAL for session 0 or an error of pppoat_peers_get().
+ */
+int pppoat_peers_accept(struct pppoat_peers    *ps,
+			const struct sockaddr  *addr,
+			socklen_t               addrlen,
+			uint64_t                session,
+			uint64_t                seq,
+			uint64_t                now,
+			struct pppoat_peer    **peer,
+			bool                   *newest);
+
+/** Adds a static route to the peer. */
+int pppoat_peers_route_add(struct pppoat_peers *ps,
+			   uint32_t             prefix,
+			   uint8_t              len,
+			   struct pppoat_peer  *peer);
+
+/** Returns peer for the address in host byte order or NULL. */
+struct pppoat_peer *pppoat_peers_route(struct pppoat_peers *ps,
+				       uint32_t             addr);
+
+/**
+ * Routes the address to the peer unless it has a host route already.
+ * With `rebind', a host route learned by another peer is moved to this one.
+ *
+ * @return 0, -EEXIST or -ENOSPC if the peer has too many routes.
+ */
+int pppoat_peers_learn(struct pppoat_peers *ps,
+		       struct pppoat_peer  *peer,
+		       uint32_t             addr,
+		       bool                 rebind);
+
+/**
+ * Marks sequence number as received.
+ *
+ * @return false if it has been received before or is older than the window.
+ */
+bool pppoat_replay_check(struct pppoat_replay *rp, uint64_t seq, bool *newest);
+
+#endif /* __PPPOAT_PEERS_H__ */
@@ -20,16 +20,24 @@
 #include "trace.h"
 
 #include "magic.h"
+#include "memory.h"
 #include "misc.h"
 #include "module.h"
 #include "packet.h"
 #include "pipeline.h"
 
+#include <errno.h>
 #include <string.h>
+#include <time.h>	/* nanosleep */
 
 static void pipeline_blocking_thread(struct pppoat_thread *thread);
 static void pipeline_loop_thread(struct pppoat_thread *thread);
 
+enum {
+	/** Pause of the loop thread when no module has data, in ms. */
+	PIPELINE_LOOP_IDLE_MS = 10,
+};
+
 static struct pppoat_list_descr pipeline_descr =
 	PPPOAT_LIST_DESCR("Pipeline", struct pppoat_module, m_link, m_magic,
 			  PPPOAT_PIPELINE_MAGIC);
@@ -60,21 +68,67 @@ void pppoat_pipeline_fini(struct pppoat_pipeline *p)
 	pppoat_list_fini(&p->pl_modules);
 }
 
-static int pipeline_start_if_blocking(struct pppoat_pipeline *p,
-				      struct pppoat_module   *mod,
-				      struct pppoat_thread   *thread)
+static unsigned pipeline_workers_nr(struct pppoat_module *mod)
 {
-	int rc = 0;
+	return pppoat_module_is_blocking(mod) ? pppoat_module_workers(mod) : 0;
+}
 
-	if (pppoat_module_is_blocking(mod)) {
-		rc = pppoat_thread_init(thread, &pipeline_blocking_thread);
-		if (rc == 0) {
-			thread->t_userdata = p;
-			rc = pppoat_thread_start(thread);
-			if (rc != 0)
-				pppoat_thread_fini(thread);
+static void pipeline_workers_stop(struct pppoat_pipeline *p)
+{
+	struct pppoat_pipeline_worker *w;
+	int                            rc;
+
+	while (p->pl_workers_nr > 0) {
+		w = &p->pl_workers[--p->pl_workers_nr];
+		(void)pppoat_thread_cancel(&w->pw_thread);
+		rc = pppoat_thread_join(&w->pw_thread);
+		PPPOAT_ASSERT(rc == 0);
+		pppoat_thread_fini(&w->pw_thread);
+	}
+	pppoat_free(p->pl_workers);
+	p->pl_workers = NULL;
+}
+
+static int pipeline_workers_start(struct pppoat_pipeline *p)
+{
+	struct pppoat_pipeline_worker *w;
+	struct pppoat_module          *mod;
+	struct pppoat_module          *edges[2];
+	unsigned                       nr;
+	unsigned                       i;
+	unsigned                       j;
+	int                            rc = 0;
+
+	edges[0] = pppoat_list_head(&p->pl_modules);
+	edges[1] = pppoat_list_tail(&p->pl_modules);
+	nr = pipeline_workers_nr(edges[0]) + pipeline_workers_nr(edges[1]);
+	if (nr == 0)
+		return 0;
+
+	p->pl_workers = pppoat_calloc(nr, sizeof *p->pl_workers);
+	if (p->pl_workers == NULL)
+		return P_ERR(-ENOMEM);
+
+	for (i = 0; rc == 0 && i < ARRAY_SIZE(edges); ++i) {
+		mod = edges[i];
+		for (j = 0; rc == 0 && j < pipeline_workers_nr(mod); ++j) {
+			w = &p->pl_workers[p->pl_workers_nr];
+			w->pw_pipeline  = p;
+			w->pw_module    = mod;
+			w->pw_edge      = i;
+			w->pw_mtu_watch = j == 0;
+			rc = pppoat_thread_init(&w->pw_thread,
+						&pipeline_blocking_thread);
+			rc = rc ?: pppoat_thread_start(&w->pw_thread);
+			if (rc == 0)
+				++p->pl_workers_nr;
+			else
+				pppoat_thread_fini(&w->pw_thread);
 		}
 	}
+	if (rc != 0)
+		pipeline_workers_stop(p);
+
 	return rc;
 }
 
@@ -85,19 +139,16 @@ int pppoat_pipeline_start(struct pppoat_pipeline *p)
 	PPPOAT_ASSERT(p->pl_modules_nr > 1);
 
 	p->pl_running = true;
+	p->pl_mtu[0]  = pppoat_module_mtu(pppoat_list_head(&p->pl_modules));
+	p->pl_mtu[1]  = pppoat_module_mtu(pppoat_list_tail(&p->pl_modules));
 
 	/*
-	 * Start a thread per blocking module. Blocking modules are simplified
+	 * Start threads for blocking modules. Blocking modules are simplified
 	 * modules without event handling. Such a module reads/writes data in
 	 * blocking manner and doesn't support non-blocking polling.
-	 *
-	 * XXX If an error happens, already started threads won't be cleaned up.
 	 */
 
-	rc = pipeline_start_if_blocking(p, pppoat_list_head(&p->pl_modules),
-					&p->pl_thread_blk1)
-	  ?: pipeline_start_if_blocking(p, pppoat_list_tail(&p->pl_modules),
-					&p->pl_thread_blk2);
+	rc = pipeline_workers_start(p);
 	if (rc != 0)
 		goto quit;
 
@@ -115,6 +166,10 @@ int pppoat_pipeline_start(struct pppoat_pipeline *p)
 			if (rc != 0)
 				pppoat_thread_fini(&p->pl_thread);
 		}
+		if (rc != 0) {
+			p->pl_running = false;
+			pipeline_workers_stop(p);
+		}
 	}
 
 quit:
@@ -136,18 +191,7 @@ void pppoat_pipeline_stop(struct pppoat_pipeline *p)
 		PPPOAT_ASSERT(rc == 0);
 		pppoat_thread_fini(&p->pl_thread);
 	}
-	if (pppoat_module_is_blocking(pppoat_list_tail(&p->pl_modules))) {
-		(void)pppoat_thread_cancel(&p->pl_thread_blk2);
-		rc = pppoat_thread_join(&p->pl_thread_blk2);
-		PPPOAT_ASSERT(rc == 0);
-		pppoat_thread_fini(&p->pl_thread_blk2);
-	}
-	if (pppoat_module_is_blocking(pppoat_list_head(&p->pl_modules))) {
-		(void)pppoat_thread_cancel(&p->pl_thread_blk1);
-		rc = pppoat_thread_join(&p->pl_thread_blk1);
-		PPPOAT_ASSERT(rc == 0);
-		pppoat_thread_fini(&p->pl_thread_blk1);
-	}
+	pipeline_workers_stop(p);
 }
 
 static bool pipeline_modules_list_invariant(struct pppoat_pipeline *p)
@@ -200,67 +244,188 @@ void pppoat_pipeline_add_module(struct pppoat_pipeline *p,
 
 	pppoat_list_insert_tail(&p->pl_modules, mod);
 	++p->pl_modules_nr;
+	mod->m_pipeline = p;
 }
 
-static int pipeline_module_process(struct pppoat_pipeline *p,
-				   struct pppoat_module   *mod)
+void pppoat_pipeline_stats(struct pppoat_pipeline *p)
+{
+	struct pppoat_module *mod;
+
+	for (mod = pppoat_list_head(&p->pl_modules); mod != NULL;
+	     mod = pppoat_list_next(&p->pl_modules, mod))
+		pppoat_module_stats(mod);
+}
+
+int pppoat_pipeline_rtt(struct pppoat_pipeline  *p,
+			struct pppoat_rtt_stats *stats)
+{
+	struct pppoat_module *mod;
+	int                   rc = -ENOENT;
+
+	for (mod = pppoat_list_head(&p->pl_modules); mod != NULL && rc != 0;
+	     mod = pppoat_list_next(&p->pl_modules, mod)) {
+		if (pppoat_module_type(mod) == PPPOAT_MODULE_TRANSPORT)
+			rc = pppoat_module_rtt(mod, stats);
+	}
+	return rc;
+}
+
+static int pipeline_module_drain(struct pppoat_pipeline *p,
+				 struct pppoat_module   *mod);
+
+/**
+ * Moves a packet produced by `mod' through the pipeline until a module
+ * consumes it.
+ */
+static int pipeline_packet_forward(struct pppoat_pipeline *p,
+				   struct pppoat_module   *mod,
+				   struct pppoat_packet   *pkt)
 {
-	struct pppoat_packet *pkt;
 	struct pppoat_packet *pkt_next;
 	int                   rc;
 
-	rc = pppoat_module_process(mod, NULL, &pkt);
-	while (rc == 0 && pkt != NULL) {
-		if (pkt->pkt_type == PPPOAT_PACKET_SEND)
-			mod = pppoat_list_next(&p->pl_modules, mod);
-		else
-			mod = pppoat_list_prev(&p->pl_modules, mod);
+	PPPOAT_ASSERT(pkt->pkt_type == PPPOAT_PACKET_SEND ||
+		      pkt->pkt_type == PPPOAT_PACKET_RECV);
 
-		PPPOAT_ASSERT(pkt->pkt_type == PPPOAT_PACKET_SEND ||
-			      pkt->pkt_type == PPPOAT_PACKET_RECV);
-		PPPOAT_ASSERT(mod != NULL);
+	if (pkt->pkt_type == PPPOAT_PACKET_SEND)
+		mod = pppoat_list_next(&p->pl_modules, mod);
+	else
+		mod = pppoat_list_prev(&p->pl_modules, mod);
+	PPPOAT_ASSERT(mod != NULL);
 
-		rc = pppoat_module_process(mod, pkt, &pkt_next);
-		if (rc != 0)
-			pppoat_packet_put(mod->m_pkts, pkt);
-		pkt = pkt_next;
+	rc = pppoat_module_process(mod, pkt, &pkt_next);
+	if (rc != 0) {
+		pppoat_packet_put(mod->m_pkts, pkt);
+		pppoat_error("pipeline", "Error during processing module '%s' "
+			     "(rc=%d)", pppoat_module_name(mod), rc);
+		return rc;
 	}
+	if (pkt_next != NULL)
+		rc = pipeline_packet_forward(p, mod, pkt_next);
+	/*
+	 * A plugin may produce several packets from a single one, e.g.
+	 * fragments. Pass them on in the context of the current thread.
+	 */
+	if (rc == 0 && pppoat_module_type(mod) == PPPOAT_MODULE_PLUGIN)
+		rc = pipeline_module_drain(p, mod);
+
+	return rc;
+}
+
+/**
+ * Polls the module once.
+ *
+ * @return true if the module produced a packet.
+ */
+static bool pipeline_module_process(struct pppoat_pipeline *p,
+				    struct pppoat_module   *mod)
+{
+	struct pppoat_packet *pkt;
+	int                   rc;
+
+	rc = pppoat_module_process(mod, NULL, &pkt);
 	if (rc != 0) {
 		pppoat_error("pipeline", "Error during processing module '%s' "
 			     "(rc=%d)", pppoat_module_name(mod), rc);
+		return false;
 	}
+	if (pkt != NULL)
+		(void)pipeline_packet_forward(p, mod, pkt);
+
+	return pkt != NULL;
+}
+
+static int pipeline_module_drain(struct pppoat_pipeline *p,
+				 struct pppoat_module   *mod)
+{
+	struct pppoat_packet *pkt;
+	int                   rc;
+
+	do {
+		rc = pppoat_module_process(mod, NULL, &pkt);
+		if (rc == 0 && pkt != NULL)
+			rc = pipeline_packet_forward(p, mod, pkt);
+	} while (rc == 0 && pkt != NULL);
+
 	return rc;
 }
 
-static void pipeline_blocking_thread(struct pppoat_thread *thread)
+/**
+ * Propagates MTU change of an edge module towards the opposite edge. Every
+ * module may adjust the MTU for the next one or stop the propagation. Only
+ * one thread watches every edge, so changes are not reported twice.
+ */
+static void pipeline_mtu_check(struct pppoat_pipeline *p, unsigned edge)
 {
-	struct pppoat_pipeline *p = thread->t_userdata;
-	struct pppoat_module   *mod = NULL;
+	struct pppoat_module *mod;
+	size_t                mtu;
+
+	mod = edge == 0 ? pppoat_list_head(&p->pl_modules) :
+			  pppoat_list_tail(&p->pl_modules);
+	mtu = pppoat_module_mtu(mod);
+	if (mtu == p->pl_mtu[edge])
+		return;
+
+	pppoat_debug("pipeline", "MTU of '%s' changed %zu -> %zu",
+		     pppoat_module_name(mod), p->pl_mtu[edge], mtu);
+	p->pl_mtu[edge] = mtu;
+	do {
+		mod = edge == 0 ? pppoat_list_next(&p->pl_modules, mod) :
+				  pppoat_list_prev(&p->pl_modules, mod);
+		mtu = mod == NULL ? 0 : pppoat_module_mtu_set(mod, mtu);
+	} while (mtu != 0);
+}
 
-	PPPOAT_ASSERT(thread == &p->pl_thread_blk1 ||
-		      thread == &p->pl_thread_blk2);
-	if (thread == &p->pl_thread_blk1)
-		mod = pppoat_list_head(&p->pl_modules);
-	if (thread == &p->pl_thread_blk2)
-		mod = pppoat_list_tail(&p->pl_modules);
+static void pipeline_blocking_thread(struct pppoat_thread *thread)
+{
+	struct pppoat_pipeline_worker *w =
+		container_of(thread, struct pppoat_pipeline_worker, pw_thread);
+	struct pppoat_pipeline        *p = w->pw_pipeline;
 
 	while (p->pl_running) {
-		pipeline_module_process(p, mod);
+		(void)pipeline_module_process(p, w->pw_module);
+		if (w->pw_mtu_watch)
+			pipeline_mtu_check(p, w->pw_edge);
 	}
 }
 
+static void pipeline_idle(void)
+{
+	struct timespec ts = {
+		.tv_sec  = 0,
+		.tv_nsec = PIPELINE_LOOP_IDLE_MS * 1000000L,
+	};
+
+	(void)nanosleep(&ts, NULL);
+}
+
 static void pipeline_loop_thread(struct pppoat_thread *thread)
 {
 	struct pppoat_pipeline *p =
 			container_of(thread, struct pppoat_pipeline, pl_thread);
 	struct pppoat_module   *mod;
+	bool                    busy;
 
+	/*
+	 * Plugins are drained by the thread which passes a packet through
+	 * them, so this thread only serves plugins' timers (e.g. retransmits)
+	 * and non-blocking edge modules. Sleep when nobody has data.
+	 */
 	while (p->pl_running) {
-		mod = pppoat_list_head(&p->pl_modules);
+		busy = false;
+		mod  = pppoat_list_head(&p->pl_modules);
 		while (mod != NULL) {
 			if (!pppoat_module_is_blocking(mod))
-				pipeline_module_process(p, mod);
+				busy = pipeline_module_process(p, mod) || busy;
 			mod = pppoat_list_next(&p->pl_modules, mod);
 		}
+		mod = pppoat_list_head(&p->pl_modules);
+		if (!pppoat_module_is_blocking(mod))
+			pipeline_mtu_check(p, 0);
+		mod = pppoat_list_tail(&p->pl_modules);
+		if (!pppoat_module_is_blocking(mod))
+			pipeline_mtu_check(p, 1);
+		if (!busy)
+			pipeline_idle();
 	}
 }
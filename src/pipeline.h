@@ -93,14 +93,32 @@
 
 struct pppoat_module;
 struct pppoat_packet;
+struct pppoat_rtt_stats;
+
+/**
+ * Blocking modules are polled by worker threads. A module may request
+ * several workers (see pppoat_module_ops::mop_workers), then the opposite
+ * edge module processes packets from multiple threads concurrently.
+ */
+struct pppoat_pipeline_worker {
+	struct pppoat_thread    pw_thread;
+	struct pppoat_pipeline *pw_pipeline;
+	struct pppoat_module   *pw_module;
+	/** Index of the edge module: 0 for head and 1 for tail. */
+	unsigned                pw_edge;
+	/** Whether this worker watches MTU of the module. */
+	bool                    pw_mtu_watch;
+};
 
 struct pppoat_pipeline {
-	struct pppoat_list   pl_modules;
-	struct pppoat_thread pl_thread;
-	struct pppoat_thread pl_thread_blk1;
-	struct pppoat_thread pl_thread_blk2;
-	size_t               pl_modules_nr;
-	bool                 pl_running;
+	struct pppoat_list             pl_modules;
+	struct pppoat_thread           pl_thread;
+	struct pppoat_pipeline_worker *pl_workers;
+	size_t                         pl_workers_nr;
+	size_t                         pl_modules_nr;
+	/** Last known MTU of the head and tail modules. */
+	size_t                         pl_mtu[2];
+	bool                           pl_running;
 };
 
 int pppoat_pipeline_init(struct pppoat_pipeline *p);
@@ -112,4 +130,15 @@ void pppoat_pipeline_stop(struct pppoat_pipeline *p);
 void pppoat_pipeline_add_module(struct pppoat_pipeline *p,
 				struct pppoat_module   *mod);
 
+/** Logs statistics of the modules from head to tail. */
+void pppoat_pipeline_stats(struct pppoat_pipeline *p);
+/**
+ * Fills `stats' with the path estimate of the first transport which
+ * provides it.
+ *
+ * @return 0 or -ENOENT.
+ */
+int pppoat_pipeline_rtt(struct pppoat_pipeline  *p,
+			struct pppoat_rtt_stats *stats);
+
 #endif /* __PPPOAT_PIPELINE_H__ */
@@ -0,0 +1,1359 @@
+/* ppp.c
+ * PPP over Any Transport -- PPP link negotiation
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "hdlc.h"
+#include "misc.h"
+#include "ppp.h"
+
+#include <errno.h>
+#include <string.h>	/* memcmp, memcpy */
+
+enum {
+	PPP_CONF_REQ   = 1,
+	PPP_CONF_ACK   = 2,
+	PPP_CONF_NAK   = 3,
+	PPP_CONF_REJ   = 4,
+	PPP_TERM_REQ   = 5,
+	PPP_TERM_ACK   = 6,
+	PPP_CODE_REJ   = 7,
+	/* LCP only. */
+	PPP_PROTO_REJ  = 8,
+	PPP_ECHO_REQ   = 9,
+	PPP_ECHO_REP   = 10,
+	PPP_DISCARD    = 11,
+	PPP_IDENT      = 12,
+	PPP_TIME_LEFT  = 13,
+};
+
+enum {
+	PPP_LCP_MRU    = 1,
+	PPP_LCP_ACCM   = 2,
+	PPP_LCP_AUTH   = 3,
+	PPP_LCP_MAGIC  = 5,
+	PPP_LCP_PFC    = 7,
+	PPP_LCP_ACFC   = 8,
+	PPP_IPCP_ADDR  = 3,
+	PPP_IPV6CP_ID  = 1,
+};
+
+enum {
+	/** Code, identifier and length of a control packet. */
+	PPP_CP_HDR_LEN      = 4,
+	/* Defaults of RFC 1661. */
+	PPP_RESTART_MS      = 3000,
+	PPP_MAX_TERMINATE   = 2,
+	PPP_MAX_CONFIGURE   = 10,
+	PPP_MAX_FAILURE     = 5,
+	/** Interval before the link is reopened, like pppd holdoff. */
+	PPP_HOLDOFF_MS      = 3000,
+};
+
+struct pppoat_ppp_layer_ops {
+	uint16_t    plo_proto;
+	const char *plo_name;
+	/** Resets options which we request to the configured values. */
+	void      (*plo_reset)(struct pppoat_ppp *ppp);
+	size_t    (*plo_req_build)(struct pppoat_ppp *ppp, uint8_t *buf);
+	/** Applies an option from Configure-Nak or Configure-Reject. */
+	void      (*plo_nak)(struct pppoat_ppp *ppp,
+			     uint8_t            type,
+			     const uint8_t     *data,
+			     size_t             len,
+			     bool               reject);
+	/** Resets the peer's options to defaults before they're acked. */
+	void      (*plo_peer_reset)(struct pppoat_ppp *ppp);
+	/**
+	 * Checks an option of the peer's Configure-Request. Returns
+	 * PPP_CONF_ACK, PPP_CONF_REJ or PPP_CONF_NAK with a suggested value
+	 * of the same length in `nak'. Accepted option is applied if
+	 * `commit' is true.
+	 */
+	uint8_t   (*plo_opt_check)(struct pppoat_ppp *ppp,
+				   uint8_t            type,
+				   const uint8_t     *data,
+				   size_t             len,
+				   uint8_t           *nak,
+				   bool               commit);
+	void      (*plo_up)(struct pppoat_ppp *ppp);
+	void      (*plo_down)(struct pppoat_ppp *ppp);
+	void      (*plo_finished)(struct pppoat_ppp *ppp);
+};
+
+static const char *ppp_state_names[] = {
+	[PPPOAT_PPP_INITIAL]  = "Initial",
+	[PPPOAT_PPP_STARTING] = "Starting",
+	[PPPOAT_PPP_CLOSED]   = "Closed",
+	[PPPOAT_PPP_STOPPED]  = "Stopped",
+	[PPPOAT_PPP_CLOSING]  = "Closing",
+	[PPPOAT_PPP_STOPPING] = "Stopping",
+	[PPPOAT_PPP_REQ_SENT] = "Req-Sent",
+	[PPPOAT_PPP_ACK_RCVD] = "Ack-Rcvd",
+	[PPPOAT_PPP_ACK_SENT] = "Ack-Sent",
+	[PPPOAT_PPP_OPENED]   = "Opened",
+};
+
+static uint16_t ppp_get16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t ppp_get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint8_t *ppp_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+	return p + 2;
+}
+
+static uint8_t *ppp_put32(uint8_t *p, uint32_t v)
+{
+	p = ppp_put16(p, v >> 16);
+	return ppp_put16(p, v & 0xffff);
+}
+
+/** Appends option header, the value of `len' bytes follows. */
+static uint8_t *ppp_opt_put(uint8_t *p, uint8_t type, size_t len)
+{
+	p[0] = type;
+	p[1] = (uint8_t)(len + 2);
+	return p + 2;
+}
+
+/** xorshift64*, the values don't need to be unpredictable. */
+static uint32_t ppp_random(struct pppoat_ppp *ppp)
+{
+	uint64_t x = ppp->pp_rand;
+	uint32_t v;
+
+	do {
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		v  = (x * 0x2545f4914f6cdd1dULL) >> 32;
+	} while (v == 0);
+	ppp->pp_rand = x;
+
+	return v;
+}
+
+static void ppp_ifid_random(struct pppoat_ppp *ppp, uint8_t *ifid)
+{
+	ppp_put32(ifid, ppp_random(ppp));
+	ppp_put32(ifid + 4, ppp_random(ppp));
+}
+
+static bool ppp_ifid_is_zero(const uint8_t *ifid)
+{
+	static const uint8_t zero[PPPOAT_PPP_IFID_LEN] = {};
+
+	return memcmp(ifid, zero, PPPOAT_PPP_IFID_LEN) == 0;
+}
+
+static struct pppoat_ppp_fsm *ppp_lcp(struct pppoat_ppp *ppp)
+{
+	return &ppp->pp_fsm[PPPOAT_PPP_LCP];
+}
+
+static bool ppp_lcp_is_opened(const struct pppoat_ppp *ppp)
+{
+	return ppp->pp_fsm[PPPOAT_PPP_LCP].pf_state == PPPOAT_PPP_OPENED;
+}
+
+/* --------------------------------------------------------------------------
+ *  Option negotiation automaton of RFC 1661.
+ * -------------------------------------------------------------------------- */
+
+static void fsm_state_set(struct pppoat_ppp_fsm     *f,
+			  enum pppoat_ppp_fsm_state  state)
+{
+	if (f->pf_state != state) {
+		pppoat_debug("ppp", "%s: %s -> %s", f->pf_ops->plo_name,
+			     ppp_state_names[f->pf_state],
+			     ppp_state_names[state]);
+	}
+	f->pf_state = state;
+	/* The restart timer runs only in the transient states. */
+	if (state <= PPPOAT_PPP_STOPPED || state == PPPOAT_PPP_OPENED)
+		f->pf_deadline = 0;
+}
+
+static void fsm_send(struct pppoat_ppp     *ppp,
+		     struct pppoat_ppp_fsm *f,
+		     uint8_t                code,
+		     uint8_t                id,
+		     const uint8_t         *data,
+		     size_t                 len)
+{
+	uint8_t *p = ppp->pp_out;
+
+	len = pppoat_min(len, sizeof ppp->pp_out - PPP_CP_HDR_LEN);
+	p[0] = code;
+	p[1] = id;
+	ppp_put16(p + 2, (uint16_t)(len + PPP_CP_HDR_LEN));
+	if (len > 0)
+		memmove(p + PPP_CP_HDR_LEN, data, len);
+	ppp->pp_ops->ppo_send(ppp, f->pf_ops->plo_proto, p,
+			      len + PPP_CP_HDR_LEN);
+}
+
+static void fsm_timer_start(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	f->pf_deadline = ppp->pp_now + PPP_RESTART_MS;
+}
+
+static void fsm_irc(struct pppoat_ppp_fsm *f, bool configure)
+{
+	f->pf_restart = configure ? PPP_MAX_CONFIGURE : PPP_MAX_TERMINATE;
+}
+
+static void fsm_zrc(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	f->pf_restart = 0;
+	fsm_timer_start(ppp, f);
+}
+
+/**
+ * Sends Configure-Request. A new negotiation starts from the configured
+ * options, retransmission and response to Nak keep the current ones.
+ */
+static void fsm_scr(struct pppoat_ppp     *ppp,
+		    struct pppoat_ppp_fsm *f,
+		    bool                   fresh)
+{
+	if (fresh) {
+		f->pf_ops->plo_reset(ppp);
+		f->pf_failures = 0;
+	}
+	f->pf_req_len = f->pf_ops->plo_req_build(ppp, f->pf_req);
+	fsm_send(ppp, f, PPP_CONF_REQ, ++f->pf_id, f->pf_req, f->pf_req_len);
+	f->pf_restart -= f->pf_restart > 0 ? 1 : 0;
+	fsm_timer_start(ppp, f);
+}
+
+static void fsm_str(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	fsm_send(ppp, f, PPP_TERM_REQ, ++f->pf_id, NULL, 0);
+	f->pf_restart -= f->pf_restart > 0 ? 1 : 0;
+	fsm_timer_start(ppp, f);
+}
+
+static void fsm_sta(struct pppoat_ppp     *ppp,
+		    struct pppoat_ppp_fsm *f,
+		    uint8_t                id)
+{
+	fsm_send(ppp, f, PPP_TERM_ACK, id, NULL, 0);
+}
+
+static void fsm_tlu(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	pppoat_debug("ppp", "%s: up", f->pf_ops->plo_name);
+	f->pf_ops->plo_up(ppp);
+}
+
+static void fsm_tld(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	pppoat_debug("ppp", "%s: down", f->pf_ops->plo_name);
+	f->pf_ops->plo_down(ppp);
+}
+
+static void fsm_tlf(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	f->pf_ops->plo_finished(ppp);
+}
+
+static void fsm_up(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	switch (f->pf_state) {
+	case PPPOAT_PPP_INITIAL:
+		fsm_state_set(f, PPPOAT_PPP_CLOSED);
+		break;
+	case PPPOAT_PPP_STARTING:
+		fsm_irc(f, true);
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, true);
+		break;
+	default:
+		break;
+	}
+}
+
+static void fsm_down(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	switch (f->pf_state) {
+	case PPPOAT_PPP_CLOSED:
+	case PPPOAT_PPP_CLOSING:
+		fsm_state_set(f, PPPOAT_PPP_INITIAL);
+		break;
+	case PPPOAT_PPP_STOPPED:
+	case PPPOAT_PPP_STOPPING:
+	case PPPOAT_PPP_REQ_SENT:
+	case PPPOAT_PPP_ACK_RCVD:
+	case PPPOAT_PPP_ACK_SENT:
+		fsm_state_set(f, PPPOAT_PPP_STARTING);
+		break;
+	case PPPOAT_PPP_OPENED:
+		fsm_state_set(f, PPPOAT_PPP_STARTING);
+		fsm_tld(ppp, f);
+		break;
+	default:
+		break;
+	}
+}
+
+static void fsm_open(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	switch (f->pf_state) {
+	case PPPOAT_PPP_INITIAL:
+		fsm_state_set(f, PPPOAT_PPP_STARTING);
+		break;
+	case PPPOAT_PPP_CLOSED:
+		fsm_irc(f, true);
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, true);
+		break;
+	case PPPOAT_PPP_CLOSING:
+		fsm_state_set(f, PPPOAT_PPP_STOPPING);
+		break;
+	default:
+		break;
+	}
+}
+
+static void fsm_close(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	switch (f->pf_state) {
+	case PPPOAT_PPP_STARTING:
+		fsm_state_set(f, PPPOAT_PPP_INITIAL);
+		fsm_tlf(ppp, f);
+		break;
+	case PPPOAT_PPP_STOPPED:
+		fsm_state_set(f, PPPOAT_PPP_CLOSED);
+		break;
+	case PPPOAT_PPP_STOPPING:
+		fsm_state_set(f, PPPOAT_PPP_CLOSING);
+		break;
+	case PPPOAT_PPP_OPENED:
+	case PPPOAT_PPP_REQ_SENT:
+	case PPPOAT_PPP_ACK_RCVD:
+	case PPPOAT_PPP_ACK_SENT:
+		if (f->pf_state == PPPOAT_PPP_OPENED)
+			fsm_tld(ppp, f);
+		fsm_irc(f, false);
+		fsm_state_set(f, PPPOAT_PPP_CLOSING);
+		fsm_str(ppp, f);
+		break;
+	default:
+		break;
+	}
+}
+
+static void fsm_timeout(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	bool more = f->pf_restart > 0;
+
+	switch (f->pf_state) {
+	case PPPOAT_PPP_CLOSING:
+	case PPPOAT_PPP_STOPPING:
+		if (more) {
+			fsm_str(ppp, f);
+		} else {
+			fsm_state_set(f, f->pf_state == PPPOAT_PPP_CLOSING ?
+				      PPPOAT_PPP_CLOSED : PPPOAT_PPP_STOPPED);
+			fsm_tlf(ppp, f);
+		}
+		break;
+	case PPPOAT_PPP_REQ_SENT:
+	case PPPOAT_PPP_ACK_RCVD:
+	case PPPOAT_PPP_ACK_SENT:
+		if (more) {
+			if (f->pf_state == PPPOAT_PPP_ACK_RCVD)
+				fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+			fsm_scr(ppp, f, false);
+		} else {
+			pppoat_info("ppp", "%s: peer doesn't respond",
+				    f->pf_ops->plo_name);
+			fsm_state_set(f, PPPOAT_PPP_STOPPED);
+			fsm_tlf(ppp, f);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Checks options of the peer's Configure-Request and builds the response.
+ * Returns response code or 0 if the request is malformed.
+ */
+static uint8_t fsm_req_check(struct pppoat_ppp     *ppp,
+			     struct pppoat_ppp_fsm *f,
+			     const uint8_t         *opts,
+			     size_t                 len,
+			     uint8_t               *resp,
+			     size_t                *resp_len)
+{
+	const struct pppoat_ppp_layer_ops *ops = f->pf_ops;
+	uint8_t                            rej[sizeof ppp->pp_out];
+	size_t                             rej_len = 0;
+	size_t                             nak_len = 0;
+	size_t                             olen;
+	size_t                             off;
+	uint8_t                            code;
+
+	for (off = 0; off < len; off += olen) {
+		if (len - off < 2 || opts[off + 1] < 2 ||
+		    opts[off + 1] > len - off)
+			return 0;
+		olen = opts[off + 1];
+		code = ops->plo_opt_check(ppp, opts[off], opts + off + 2,
+					  olen - 2, resp + nak_len + 2, false);
+		/* Endless Nak loop turns into Reject. */
+		if (code == PPP_CONF_NAK &&
+		    f->pf_failures >= PPP_MAX_FAILURE)
+			code = PPP_CONF_REJ;
+		if (code == PPP_CONF_REJ) {
+			memcpy(rej + rej_len, opts + off, olen);
+			rej_len += olen;
+		} else if (code == PPP_CONF_NAK) {
+			ppp_opt_put(resp + nak_len, opts[off], olen - 2);
+			nak_len += olen;
+		}
+	}
+
+	if (rej_len > 0) {
+		memcpy(resp, rej, rej_len);
+		*resp_len = rej_len;
+		return PPP_CONF_REJ;
+	}
+	if (nak_len > 0) {
+		++f->pf_failures;
+		*resp_len = nak_len;
+		return PPP_CONF_NAK;
+	}
+
+	ops->plo_peer_reset(ppp);
+	for (off = 0; off < len; off += opts[off + 1])
+		(void)ops->plo_opt_check(ppp, opts[off], opts + off + 2,
+					 opts[off + 1] - 2, resp, true);
+	memcpy(resp, opts, len);
+	*resp_len = len;
+	f->pf_failures = 0;
+
+	return PPP_CONF_ACK;
+}
+
+static void fsm_rcr(struct pppoat_ppp     *ppp,
+		    struct pppoat_ppp_fsm *f,
+		    uint8_t                id,
+		    const uint8_t         *opts,
+		    size_t                 len)
+{
+	uint8_t resp[sizeof ppp->pp_out];
+	size_t  resp_len;
+	uint8_t code;
+	bool    good;
+
+	switch (f->pf_state) {
+	case PPPOAT_PPP_CLOSED:
+		fsm_sta(ppp, f, id);
+		return;
+	case PPPOAT_PPP_CLOSING:
+	case PPPOAT_PPP_STOPPING:
+		return;
+	default:
+		break;
+	}
+
+	code = fsm_req_check(ppp, f, opts, len, resp, &resp_len);
+	if (code == 0)
+		return;
+	good = code == PPP_CONF_ACK;
+
+	switch (f->pf_state) {
+	case PPPOAT_PPP_OPENED:
+		fsm_tld(ppp, f);
+		fsm_irc(f, true);
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, true);
+		break;
+	case PPPOAT_PPP_STOPPED:
+		fsm_irc(f, true);
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, true);
+		break;
+	default:
+		break;
+	}
+	fsm_send(ppp, f, code, id, resp, resp_len);
+
+	switch (f->pf_state) {
+	case PPPOAT_PPP_REQ_SENT:
+	case PPPOAT_PPP_ACK_SENT:
+		fsm_state_set(f, good ? PPPOAT_PPP_ACK_SENT :
+					PPPOAT_PPP_REQ_SENT);
+		break;
+	case PPPOAT_PPP_ACK_RCVD:
+		if (good) {
+			fsm_state_set(f, PPPOAT_PPP_OPENED);
+			fsm_tlu(ppp, f);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void fsm_rca(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	switch (f->pf_state) {
+	case PPPOAT_PPP_REQ_SENT:
+		fsm_irc(f, true);
+		fsm_state_set(f, PPPOAT_PPP_ACK_RCVD);
+		break;
+	case PPPOAT_PPP_ACK_SENT:
+		fsm_irc(f, true);
+		fsm_state_set(f, PPPOAT_PPP_OPENED);
+		fsm_tlu(ppp, f);
+		break;
+	case PPPOAT_PPP_ACK_RCVD:
+		/* Crossed connection. */
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, false);
+		break;
+	case PPPOAT_PPP_OPENED:
+		fsm_tld(ppp, f);
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, true);
+		break;
+	default:
+		break;
+	}
+}
+
+static void fsm_rcn(struct pppoat_ppp     *ppp,
+		    struct pppoat_ppp_fsm *f,
+		    const uint8_t         *opts,
+		    size_t                 len,
+		    bool                   reject)
+{
+	size_t off;
+
+	switch (f->pf_state) {
+	case PPPOAT_PPP_REQ_SENT:
+	case PPPOAT_PPP_ACK_RCVD:
+	case PPPOAT_PPP_ACK_SENT:
+	case PPPOAT_PPP_OPENED:
+		break;
+	default:
+		return;
+	}
+
+	for (off = 0; off < len; off += opts[off + 1]) {
+		if (len - off < 2 || opts[off + 1] < 2 ||
+		    opts[off + 1] > len - off)
+			return;
+	}
+	for (off = 0; off < len; off += opts[off + 1]) {
+		f->pf_ops->plo_nak(ppp, opts[off], opts + off + 2,
+				   opts[off + 1] - 2, reject);
+	}
+
+	switch (f->pf_state) {
+	case PPPOAT_PPP_REQ_SENT:
+	case PPPOAT_PPP_ACK_SENT:
+		fsm_irc(f, true);
+		fsm_scr(ppp, f, false);
+		break;
+	case PPPOAT_PPP_ACK_RCVD:
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, false);
+		break;
+	case PPPOAT_PPP_OPENED:
+		fsm_tld(ppp, f);
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, false);
+		break;
+	default:
+		break;
+	}
+}
+
+static void fsm_rtr(struct pppoat_ppp     *ppp,
+		    struct pppoat_ppp_fsm *f,
+		    uint8_t                id)
+{
+	switch (f->pf_state) {
+	case PPPOAT_PPP_ACK_RCVD:
+	case PPPOAT_PPP_ACK_SENT:
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		break;
+	case PPPOAT_PPP_OPENED:
+		pppoat_info("ppp", "%s: terminated by peer",
+			    f->pf_ops->plo_name);
+		fsm_tld(ppp, f);
+		fsm_state_set(f, PPPOAT_PPP_STOPPING);
+		fsm_zrc(ppp, f);
+		break;
+	default:
+		break;
+	}
+	fsm_sta(ppp, f, id);
+}
+
+static void fsm_rta(struct pppoat_ppp *ppp, struct pppoat_ppp_fsm *f)
+{
+	switch (f->pf_state) {
+	case PPPOAT_PPP_CLOSING:
+		fsm_state_set(f, PPPOAT_PPP_CLOSED);
+		fsm_tlf(ppp, f);
+		break;
+	case PPPOAT_PPP_STOPPING:
+		fsm_state_set(f, PPPOAT_PPP_STOPPED);
+		fsm_tlf(ppp, f);
+		break;
+	case PPPOAT_PPP_ACK_RCVD:
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		break;
+	case PPPOAT_PPP_OPENED:
+		fsm_tld(ppp, f);
+		fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		fsm_scr(ppp, f, true);
+		break;
+	default:
+		break;
+	}
+}
+
+/** Handles Code-Reject or Protocol-Reject. */
+static void fsm_rxj(struct pppoat_ppp     *ppp,
+		    struct pppoat_ppp_fsm *f,
+		    bool                   fatal)
+{
+	if (!fatal) {
+		if (f->pf_state == PPPOAT_PPP_ACK_RCVD)
+			fsm_state_set(f, PPPOAT_PPP_REQ_SENT);
+		return;
+	}
+
+	pppoat_info("ppp", "%s: rejected by peer", f->pf_ops->plo_name);
+	switch (f->pf_state) {
+	case PPPOAT_PPP_CLOSED:
+	case PPPOAT_PPP_CLOSING:
+		fsm_state_set(f, PPPOAT_PPP_CLOSED);
+		fsm_tlf(ppp, f);
+		break;
+	case PPPOAT_PPP_STOPPED:
+	case PPPOAT_PPP_STOPPING:
+	case PPPOAT_PPP_REQ_SENT:
+	case PPPOAT_PPP_ACK_RCVD:
+	case PPPOAT_PPP_ACK_SENT:
+		fsm_state_set(f, PPPOAT_PPP_STOPPED);
+		fsm_tlf(ppp, f);
+		break;
+	case PPPOAT_PPP_OPENED:
+		fsm_tld(ppp, f);
+		fsm_irc(f, false);
+		fsm_state_set(f, PPPOAT_PPP_STOPPING);
+		fsm_str(ppp, f);
+		break;
+	default:
+		break;
+	}
+}
+
+/* --------------------------------------------------------------------------
+ *  LCP.
+ * -------------------------------------------------------------------------- */
+
+static void lcp_reset(struct pppoat_ppp *ppp)
+{
+	ppp->pp_mru        = ppp->pp_conf.ppc_mru ?: PPPOAT_PPP_MRU_DEFAULT;
+	ppp->pp_want_mru   = ppp->pp_mru != PPPOAT_PPP_MRU_DEFAULT;
+	ppp->pp_want_accm  = true;
+	ppp->pp_rx_accm    = 0;
+	ppp->pp_want_magic = true;
+	ppp->pp_magic      = ppp_random(ppp);
+	ppp->pp_want_pfc   = true;
+	ppp->pp_want_acfc  = true;
+}
+
+static size_t lcp_req_build(struct pppoat_ppp *ppp, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	if (ppp->pp_want_mru) {
+		p = ppp_opt_put(p, PPP_LCP_MRU, 2);
+		p = ppp_put16(p, ppp->pp_mru);
+	}
+	if (ppp->pp_want_accm) {
+		p = ppp_opt_put(p, PPP_LCP_ACCM, 4);
+		p = ppp_put32(p, ppp->pp_rx_accm);
+	}
+	if (ppp->pp_want_magic) {
+		p = ppp_opt_put(p, PPP_LCP_MAGIC, 4);
+		p = ppp_put32(p, ppp->pp_magic);
+	}
+	if (ppp->pp_want_pfc)
+		p = ppp_opt_put(p, PPP_LCP_PFC, 0);
+	if (ppp->pp_want_acfc)
+		p = ppp_opt_put(p, PPP_LCP_ACFC, 0);
+
+	return p - buf;
+}
+
+static void lcp_nak(struct pppoat_ppp *ppp,
+		    uint8_t            type,
+		    const uint8_t     *data,
+		    size_t             len,
+		    bool               reject)
+{
+	uint16_t mru_max = ppp->pp_conf.ppc_mru ?: PPPOAT_PPP_MRU_DEFAULT;
+
+	switch (type) {
+	case PPP_LCP_MRU:
+		if (reject || len != 2) {
+			ppp->pp_want_mru = false;
+			ppp->pp_mru      = PPPOAT_PPP_MRU_DEFAULT;
+		} else {
+			/* We can't receive more than the configured MRU. */
+			ppp->pp_mru = pppoat_max(ppp_get16(data),
+						 PPPOAT_PPP_MRU_MIN);
+			ppp->pp_mru = pppoat_min(ppp->pp_mru, mru_max);
+			ppp->pp_want_mru = true;
+		}
+		break;
+	case PPP_LCP_ACCM:
+		if (reject || len != 4)
+			ppp->pp_want_accm = false;
+		else
+			ppp->pp_rx_accm |= ppp_get32(data);
+		break;
+	case PPP_LCP_MAGIC:
+		if (reject || len != 4)
+			ppp->pp_want_magic = false;
+		else
+			ppp->pp_magic = ppp_random(ppp);
+		break;
+	case PPP_LCP_PFC:
+		ppp->pp_want_pfc = false;
+		break;
+	case PPP_LCP_ACFC:
+		ppp->pp_want_acfc = false;
+		break;
+	default:
+		break;
+	}
+}
+
+static void lcp_peer_reset(struct pppoat_ppp *ppp)
+{
+	ppp->pp_peer_mru   = PPPOAT_PPP_MRU_DEFAULT;
+	ppp->pp_peer_magic = 0;
+	ppp->pp_tx_accm    = PPPOAT_HDLC_ACCM_ALL;
+	ppp->pp_tx_pfc     = false;
+	ppp->pp_tx_acfc    = false;
+}
+
+static uint8_t lcp_opt_check(struct pppoat_ppp *ppp,
+			     uint8_t            type,
+			     const uint8_t     *data,
+			     size_t             len,
+			     uint8_t           *nak,
+			     bool               commit)
+{
+	uint32_t v;
+
+	switch (type) {
+	case PPP_LCP_MRU:
+		if (len != 2)
+			return PPP_CONF_REJ;
+		if (ppp_get16(data) < PPPOAT_PPP_MRU_MIN) {
+			ppp_put16(nak, PPPOAT_PPP_MRU_MIN);
+			return PPP_CONF_NAK;
+		}
+		if (commit)
+			ppp->pp_peer_mru = ppp_get16(data);
+		return PPP_CONF_ACK;
+	case PPP_LCP_ACCM:
+		if (len != 4)
+			return PPP_CONF_REJ;
+		if (commit)
+			ppp->pp_tx_accm = ppp_get32(data);
+		return PPP_CONF_ACK;
+	case PPP_LCP_MAGIC:
+		if (len != 4)
+			return PPP_CONF_REJ;
+		v = ppp_get32(data);
+		if (ppp->pp_want_magic && v == ppp->pp_magic) {
+			/* Either a looped-back link or a collision. */
+			ppp_put32(nak, ppp_random(ppp));
+			ppp->pp_magic = ppp_random(ppp);
+			return PPP_CONF_NAK;
+		}
+		if (commit)
+			ppp->pp_peer_magic = v;
+		return PPP_CONF_ACK;
+	case PPP_LCP_PFC:
+	case PPP_LCP_ACFC:
+		if (len != 0)
+			return PPP_CONF_REJ;
+		if (commit && type == PPP_LCP_PFC)
+			ppp->pp_tx_pfc = true;
+		if (commit && type == PPP_LCP_ACFC)
+			ppp->pp_tx_acfc = true;
+		return PPP_CONF_ACK;
+	default:
+		/* Including authentication. */
+		return PPP_CONF_REJ;
+	}
+}
+
+static void lcp_up(struct pppoat_ppp *ppp)
+{
+	int i;
+
+	pppoat_debug("ppp", "LCP: MRU %u, peer MRU %u, magic %08x/%08x",
+		     ppp->pp_mru, ppp->pp_peer_mru, ppp->pp_magic,
+		     ppp->pp_peer_magic);
+	for (i = PPPOAT_PPP_LCP + 1; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		if (ppp->pp_fsm[i].pf_enabled)
+			fsm_up(ppp, &ppp->pp_fsm[i]);
+	}
+}
+
+static void lcp_down(struct pppoat_ppp *ppp)
+{
+	int i;
+
+	for (i = PPPOAT_PPP_LCP + 1; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		if (ppp->pp_fsm[i].pf_enabled)
+			fsm_down(ppp, &ppp->pp_fsm[i]);
+	}
+}
+
+static void lcp_finished(struct pppoat_ppp *ppp)
+{
+	if (!ppp->pp_closed)
+		ppp->pp_holdoff = ppp->pp_now + PPP_HOLDOFF_MS;
+}
+
+/* --------------------------------------------------------------------------
+ *  IPCP and IPV6CP.
+ * -------------------------------------------------------------------------- */
+
+/** Closes the link when the last network protocol fails, like pppd. */
+static void ncp_finished(struct pppoat_ppp *ppp)
+{
+	int i;
+
+	if (!ppp_lcp_is_opened(ppp))
+		return;
+	for (i = PPPOAT_PPP_LCP + 1; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		if (ppp->pp_fsm[i].pf_enabled &&
+		    ppp->pp_fsm[i].pf_state > PPPOAT_PPP_STOPPED)
+			return;
+	}
+	pppoat_info("ppp", "No network protocols running");
+	fsm_close(ppp, ppp_lcp(ppp));
+}
+
+static void ipcp_reset(struct pppoat_ppp *ppp)
+{
+	ppp->pp_want_ip  = true;
+	ppp->pp_ip_local = ppp->pp_conf.ppc_ip_local;
+}
+
+static size_t ipcp_req_build(struct pppoat_ppp *ppp, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	if (ppp->pp_want_ip) {
+		p = ppp_opt_put(p, PPP_IPCP_ADDR, 4);
+		memcpy(p, &ppp->pp_ip_local, 4);
+		p += 4;
+	}
+	return p - buf;
+}
+
+static void ipcp_nak(struct pppoat_ppp *ppp,
+		     uint8_t            type,
+		     const uint8_t     *data,
+		     size_t             len,
+		     bool               reject)
+{
+	if (type != PPP_IPCP_ADDR)
+		return;
+	if (reject || len != 4)
+		ppp->pp_want_ip = false;
+	else if (ppp->pp_conf.ppc_ip_local == 0)
+		memcpy(&ppp->pp_ip_local, data, 4);
+}
+
+static void ipcp_peer_reset(struct pppoat_ppp *ppp)
+{
+	ppp->pp_ip_remote = ppp->pp_conf.ppc_ip_remote;
+}
+
+static uint8_t ipcp_opt_check(struct pppoat_ppp *ppp,
+			      uint8_t            type,
+			      const uint8_t     *data,
+			      size_t             len,
+			      uint8_t           *nak,
+			      bool               commit)
+{
+	uint32_t remote = ppp->pp_conf.ppc_ip_remote;
+	uint32_t addr;
+
+	/* VJ compression, DNS and NBNS addresses are not supported. */
+	if (type != PPP_IPCP_ADDR || len != 4)
+		return PPP_CONF_REJ;
+
+	memcpy(&addr, data, 4);
+	if (addr == 0 && remote == 0)
+		return PPP_CONF_REJ;
+	if (remote != 0 && addr != remote) {
+		memcpy(nak, &remote, 4);
+		return PPP_CONF_NAK;
+	}
+	if (commit)
+		ppp->pp_ip_remote = addr;
+	return PPP_CONF_ACK;
+}
+
+static void ipcp_up(struct pppoat_ppp *ppp)
+{
+	ppp->pp_ops->ppo_up(ppp, PPPOAT_PPP_PROTO_IP);
+}
+
+static void ipcp_down(struct pppoat_ppp *ppp)
+{
+	ppp->pp_ops->ppo_down(ppp, PPPOAT_PPP_PROTO_IP);
+}
+
+static void ipv6cp_reset(struct pppoat_ppp *ppp)
+{
+	ppp->pp_want_ifid = true;
+}
+
+static size_t ipv6cp_req_build(struct pppoat_ppp *ppp, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	if (ppp->pp_want_ifid) {
+		p = ppp_opt_put(p, PPP_IPV6CP_ID, PPPOAT_PPP_IFID_LEN);
+		memcpy(p, ppp->pp_ifid_local, PPPOAT_PPP_IFID_LEN);
+		p += PPPOAT_PPP_IFID_LEN;
+	}
+	return p - buf;
+}
+
+static void ipv6cp_nak(struct pppoat_ppp *ppp,
+		       uint8_t            type,
+		       const uint8_t     *data,
+		       size_t             len,
+		       bool               reject)
+{
+	if (type != PPP_IPV6CP_ID)
+		return;
+	if (reject || len != PPPOAT_PPP_IFID_LEN)
+		ppp->pp_want_ifid = false;
+	else if (!ppp_ifid_is_zero(data) &&
+		 memcmp(data, ppp->pp_ifid_remote, len) != 0)
+		memcpy(ppp->pp_ifid_local, data, len);
+}
+
+static void ipv6cp_peer_reset(struct pppoat_ppp *ppp)
+{
+	memset(ppp->pp_ifid_remote, 0, PPPOAT_PPP_IFID_LEN);
+}
+
+static uint8_t ipv6cp_opt_check(struct pppoat_ppp *ppp,
+				uint8_t            type,
+				const uint8_t     *data,
+				size_t             len,
+				uint8_t           *nak,
+				bool               commit)
+{
+	if (type != PPP_IPV6CP_ID || len != PPPOAT_PPP_IFID_LEN)
+		return PPP_CONF_REJ;
+
+	if (ppp_ifid_is_zero(data) ||
+	    memcmp(data, ppp->pp_ifid_local, len) == 0) {
+		do {
+			ppp_ifid_random(ppp, nak);
+		} while (memcmp(nak, ppp->pp_ifid_local, len) == 0);
+		return PPP_CONF_NAK;
+	}
+	if (commit)
+		memcpy(ppp->pp_ifid_remote, data, len);
+	return PPP_CONF_ACK;
+}
+
+static void ipv6cp_up(struct pppoat_ppp *ppp)
+{
+	ppp->pp_ops->ppo_up(ppp, PPPOAT_PPP_PROTO_IPV6);
+}
+
+static void ipv6cp_down(struct pppoat_ppp *ppp)
+{
+	ppp->pp_ops->ppo_down(ppp, PPPOAT_PPP_PROTO_IPV6);
+}
+
+static const struct pppoat_ppp_layer_ops ppp_layer_ops[] = {
+	[PPPOAT_PPP_LCP] = {
+		.plo_proto      = PPPOAT_PPP_PROTO_LCP,
+		.plo_name       = "LCP",
+		.plo_reset      = &lcp_reset,
+		.plo_req_build  = &lcp_req_build,
+		.plo_nak        = &lcp_nak,
+		.plo_peer_reset = &lcp_peer_reset,
+		.plo_opt_check  = &lcp_opt_check,
+		.plo_up         = &lcp_up,
+		.plo_down       = &lcp_down,
+		.plo_finished   = &lcp_finished,
+	},
+	[PPPOAT_PPP_IPCP] = {
+		.plo_proto      = PPPOAT_PPP_PROTO_IPCP,
+		.plo_name       = "IPCP",
+		.plo_reset      = &ipcp_reset,
+		.plo_req_build  = &ipcp_req_build,
+		.plo_nak        = &ipcp_nak,
+		.plo_peer_reset = &ipcp_peer_reset,
+		.plo_opt_check  = &ipcp_opt_check,
+		.plo_up         = &ipcp_up,
+		.plo_down       = &ipcp_down,
+		.plo_finished   = &ncp_finished,
+	},
+	[PPPOAT_PPP_IPV6CP] = {
+		.plo_proto      = PPPOAT_PPP_PROTO_IPV6CP,
+		.plo_name       = "IPV6CP",
+		.plo_reset      = &ipv6cp_reset,
+		.plo_req_build  = &ipv6cp_req_build,
+		.plo_nak        = &ipv6cp_nak,
+		.plo_peer_reset = &ipv6cp_peer_reset,
+		.plo_opt_check  = &ipv6cp_opt_check,
+		.plo_up         = &ipv6cp_up,
+		.plo_down       = &ipv6cp_down,
+		.plo_finished   = &ncp_finished,
+	},
+};
+
+/* --------------------------------------------------------------------------
+ *  Interface.
+ * -------------------------------------------------------------------------- */
+
+static struct pppoat_ppp_fsm *ppp_fsm_find(struct pppoat_ppp *ppp,
+					   uint16_t           proto)
+{
+	int i;
+
+	for (i = 0; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		if (ppp->pp_fsm[i].pf_ops->plo_proto == proto)
+			return &ppp->pp_fsm[i];
+	}
+	return NULL;
+}
+
+static void ppp_proto_reject(struct pppoat_ppp *ppp,
+			     uint16_t           proto,
+			     const uint8_t     *buf,
+			     size_t             len)
+{
+	struct pppoat_ppp_fsm *lcp = ppp_lcp(ppp);
+	uint8_t                data[sizeof ppp->pp_out];
+
+	pppoat_debug("ppp", "Rejecting protocol 0x%04x", proto);
+	len = pppoat_min(len, ppp->pp_peer_mru - PPP_CP_HDR_LEN - 2);
+	len = pppoat_min(len, sizeof data - 2);
+	ppp_put16(data, proto);
+	memcpy(data + 2, buf, len);
+	fsm_send(ppp, lcp, PPP_PROTO_REJ, ++lcp->pf_id, data, len + 2);
+}
+
+/** Handles LCP codes beyond Code-Reject. Returns false for unknown code. */
+static bool ppp_lcp_extra(struct pppoat_ppp *ppp,
+			  uint8_t            code,
+			  uint8_t            id,
+			  const uint8_t     *data,
+			  size_t             len)
+{
+	struct pppoat_ppp_fsm *f;
+	uint8_t                reply[sizeof ppp->pp_out];
+
+	switch (code) {
+	case PPP_PROTO_REJ:
+		f = len >= 2 ? ppp_fsm_find(ppp, ppp_get16(data)) : NULL;
+		if (f != NULL && f != ppp_lcp(ppp) &&
+		    ppp_lcp_is_opened(ppp))
+			fsm_rxj(ppp, f, true);
+		return true;
+	case PPP_ECHO_REQ:
+		if (!ppp_lcp_is_opened(ppp) || len < 4)
+			return true;
+		len = pppoat_min(len, sizeof reply);
+		ppp_put32(reply, ppp->pp_want_magic ? ppp->pp_magic : 0);
+		memcpy(reply + 4, data + 4, len - 4);
+		fsm_send(ppp, ppp_lcp(ppp), PPP_ECHO_REP, id, reply, len);
+		return true;
+	case PPP_ECHO_REP:
+	case PPP_DISCARD:
+	case PPP_IDENT:
+	case PPP_TIME_LEFT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void pppoat_ppp_input(struct pppoat_ppp *ppp,
+		      uint16_t           proto,
+		      const uint8_t     *buf,
+		      size_t             len,
+		      uint64_t           now)
+{
+	struct pppoat_ppp_fsm *f = ppp_fsm_find(ppp, proto);
+	const uint8_t         *data;
+	uint16_t               plen;
+	uint8_t                code;
+	uint8_t                id;
+
+	ppp->pp_now = now;
+	if (f == NULL || !f->pf_enabled) {
+		if (ppp_lcp_is_opened(ppp))
+			ppp_proto_reject(ppp, proto, buf, len);
+		return;
+	}
+	if (f != ppp_lcp(ppp) && !ppp_lcp_is_opened(ppp))
+		return;
+	if (len < PPP_CP_HDR_LEN || f->pf_state <= PPPOAT_PPP_STARTING)
+		return;
+
+	code = buf[0];
+	id   = buf[1];
+	plen = ppp_get16(buf + 2);
+	if (plen < PPP_CP_HDR_LEN || plen > len)
+		return;
+	/* Octets after the length field are padding. */
+	data = buf + PPP_CP_HDR_LEN;
+	len  = plen - PPP_CP_HDR_LEN;
+
+	switch (code) {
+	case PPP_CONF_REQ:
+		fsm_rcr(ppp, f, id, data, len);
+		break;
+	case PPP_CONF_ACK:
+	case PPP_CONF_NAK:
+	case PPP_CONF_REJ:
+		if (id != f->pf_id)
+			break;
+		if (code == PPP_CONF_ACK && (len != f->pf_req_len ||
+		    memcmp(data, f->pf_req, len) != 0))
+			break;
+		if (f->pf_state == PPPOAT_PPP_CLOSED ||
+		    f->pf_state == PPPOAT_PPP_STOPPED)
+			fsm_sta(ppp, f, id);
+		else if (code == PPP_CONF_ACK)
+			fsm_rca(ppp, f);
+		else
+			fsm_rcn(ppp, f, data, len, code == PPP_CONF_REJ);
+		break;
+	case PPP_TERM_REQ:
+		fsm_rtr(ppp, f, id);
+		break;
+	case PPP_TERM_ACK:
+		fsm_rta(ppp, f);
+		break;
+	case PPP_CODE_REJ:
+		fsm_rxj(ppp, f, len > 0 && data[0] >= PPP_CONF_REQ &&
+				data[0] <= PPP_CODE_REJ);
+		break;
+	default:
+		if (f == ppp_lcp(ppp) &&
+		    ppp_lcp_extra(ppp, code, id, data, len))
+			break;
+		fsm_send(ppp, f, PPP_CODE_REJ, ++f->pf_id, buf,
+			 pppoat_min(plen, ppp->pp_peer_mru - PPP_CP_HDR_LEN));
+		break;
+	}
+}
+
+void pppoat_ppp_init(struct pppoat_ppp            *ppp,
+		     const struct pppoat_ppp_conf *conf,
+		     const struct pppoat_ppp_ops  *ops,
+		     void                         *userdata)
+{
+	int i;
+
+	memset(ppp, 0, sizeof *ppp);
+	ppp->pp_ops      = ops;
+	ppp->pp_userdata = userdata;
+	ppp->pp_conf     = *conf;
+	ppp->pp_rand     = (conf->ppc_seed ^ 0x9e3779b97f4a7c15ULL) ?: 1;
+
+	for (i = 0; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		ppp->pp_fsm[i].pf_ops     = &ppp_layer_ops[i];
+		ppp->pp_fsm[i].pf_state   = PPPOAT_PPP_INITIAL;
+		ppp->pp_fsm[i].pf_enabled = i != PPPOAT_PPP_IPV6CP ||
+					    conf->ppc_ipv6;
+		ppp_layer_ops[i].plo_reset(ppp);
+		ppp_layer_ops[i].plo_peer_reset(ppp);
+	}
+	ppp_ifid_random(ppp, ppp->pp_ifid_local);
+}
+
+void pppoat_ppp_open(struct pppoat_ppp *ppp, uint64_t now)
+{
+	int i;
+
+	ppp->pp_now    = now;
+	ppp->pp_closed = false;
+	for (i = 0; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		if (ppp->pp_fsm[i].pf_enabled)
+			fsm_open(ppp, &ppp->pp_fsm[i]);
+	}
+	/* The transport is the lower layer and it's always up. */
+	fsm_up(ppp, ppp_lcp(ppp));
+}
+
+void pppoat_ppp_close(struct pppoat_ppp *ppp, uint64_t now)
+{
+	ppp->pp_now     = now;
+	ppp->pp_closed  = true;
+	ppp->pp_holdoff = 0;
+	fsm_close(ppp, ppp_lcp(ppp));
+}
+
+static void ppp_reopen(struct pppoat_ppp *ppp)
+{
+	struct pppoat_ppp_fsm *lcp = ppp_lcp(ppp);
+
+	pppoat_debug("ppp", "Reopening the link");
+	if (lcp->pf_state == PPPOAT_PPP_STOPPED)
+		fsm_down(ppp, lcp);
+	pppoat_ppp_open(ppp, ppp->pp_now);
+}
+
+int64_t pppoat_ppp_timeout(struct pppoat_ppp *ppp, uint64_t now)
+{
+	struct pppoat_ppp_fsm *f;
+	uint64_t               next = 0;
+	int                    i;
+
+	ppp->pp_now = now;
+	for (i = 0; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		f = &ppp->pp_fsm[i];
+		if (f->pf_deadline != 0 && now >= f->pf_deadline) {
+			f->pf_deadline = 0;
+			fsm_timeout(ppp, f);
+		}
+	}
+	if (ppp->pp_holdoff != 0 && now >= ppp->pp_holdoff) {
+		ppp->pp_holdoff = 0;
+		ppp_reopen(ppp);
+	}
+
+	for (i = 0; i < PPPOAT_PPP_LAYER_NR; ++i) {
+		f = &ppp->pp_fsm[i];
+		if (f->pf_deadline != 0 && (next == 0 || f->pf_deadline < next))
+			next = f->pf_deadline;
+	}
+	if (ppp->pp_holdoff != 0 && (next == 0 || ppp->pp_holdoff < next))
+		next = ppp->pp_holdoff;
+
+	return next == 0 ? -1 : (int64_t)(next - now);
+}
+
+bool pppoat_ppp_is_up(const struct pppoat_ppp *ppp, uint16_t proto)
+{
+	enum pppoat_ppp_layer layer;
+
+	switch (proto) {
+	case PPPOAT_PPP_PROTO_IP:
+		layer = PPPOAT_PPP_IPCP;
+		break;
+	case PPPOAT_PPP_PROTO_IPV6:
+		layer = PPPOAT_PPP_IPV6CP;
+		break;
+	default:
+		return false;
+	}
+	return ppp->pp_fsm[layer].pf_state == PPPOAT_PPP_OPENED;
+}
+
+size_t pppoat_ppp_mtu(const struct pppoat_ppp *ppp)
+{
+	return ppp->pp_peer_mru;
+}
+
+size_t pppoat_ppp_hdr_build(const struct pppoat_ppp *ppp,
+			    uint16_t                 proto,
+			    const uint8_t           *info,
+			    size_t                   len,
+			    uint8_t                 *hdr,
+			    uint32_t                *accm)
+{
+	bool     lcp = proto == PPPOAT_PPP_PROTO_LCP;
+	uint8_t *p   = hdr;
+
+	/*
+	 * LCP is never compressed. Configuration packets escape all control
+	 * characters, so they survive a link with the default ACCM.
+	 */
+	if (lcp || !ppp->pp_tx_acfc) {
+		*p++ = 0xff;
+		*p++ = 0x03;
+	}
+	if (!lcp && ppp->pp_tx_pfc && proto < 0x100)
+		*p++ = (uint8_t)proto;
+	else
+		p = ppp_put16(p, proto);
+
+	*accm = ppp->pp_tx_accm;
+	if (!ppp_lcp_is_opened(ppp) ||
+	    (lcp && len > 0 && info[0] >= PPP_CONF_REQ &&
+	     info[0] <= PPP_CODE_REJ))
+		*accm = PPPOAT_HDLC_ACCM_ALL;
+
+	return p - hdr;
+}
+
+int pppoat_ppp_hdr_parse(const uint8_t *frame, size_t len, uint16_t *proto)
+{
+	size_t off = 0;
+
+	if (len >= 2 && frame[0] == 0xff && frame[1] == 0x03)
+		off = 2;
+	if (off < len && (frame[off] & 1) != 0) {
+		*proto = frame[off];
+		return off + 1;
+	}
+	/* Protocol field ends with an odd octet. */
+	if (off + 2 <= len && (frame[off + 1] & 1) != 0) {
+		*proto = ppp_get16(frame + off);
+		return off + 2;
+	}
+	return -EINVAL;
+}
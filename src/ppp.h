@@ -0,0 +1,211 @@
+/* ppp.h
+ * PPP over Any Transport -- PPP link negotiation
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_PPP_H__
+#define __PPPOAT_PPP_H__
+
+#include <stdbool.h>
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/**
+ * High level design.
+ *
+ * The engine negotiates a PPP link with a peer such as pppd: LCP from
+ * RFC 1661, IPCP from RFC 1332 and IPV6CP from RFC 5072. Every protocol
+ * runs the option negotiation automaton of RFC 1661. The engine does no
+ * I/O and reads no clock. User passes received control packets and the
+ * current time, and the engine sends packets and reports NCP state via
+ * callbacks. Calls must be serialised by user.
+ *
+ * Supported LCP options are MRU, ACCM, Magic-Number, PFC and ACFC. The
+ * link doesn't authenticate, like `pppd noauth'. IPCP negotiates
+ * IP-Address and IPV6CP negotiates Interface-Identifier, other options
+ * are rejected. The link is reopened after a hold-off interval when it
+ * goes down, like `pppd persist'.
+ */
+
+enum {
+	PPPOAT_PPP_PROTO_IP     = 0x0021,
+	PPPOAT_PPP_PROTO_IPV6   = 0x0057,
+	PPPOAT_PPP_PROTO_IPCP   = 0x8021,
+	PPPOAT_PPP_PROTO_IPV6CP = 0x8057,
+	PPPOAT_PPP_PROTO_LCP    = 0xc021,
+};
+
+enum {
+	PPPOAT_PPP_MRU_DEFAULT = 1500,
+	PPPOAT_PPP_MRU_MIN     = 128,
+	/** Address, control and protocol fields. */
+	PPPOAT_PPP_HDR_MAX     = 4,
+	PPPOAT_PPP_IFID_LEN    = 8,
+};
+
+enum pppoat_ppp_fsm_state {
+	PPPOAT_PPP_INITIAL,
+	PPPOAT_PPP_STARTING,
+	PPPOAT_PPP_CLOSED,
+	PPPOAT_PPP_STOPPED,
+	PPPOAT_PPP_CLOSING,
+	PPPOAT_PPP_STOPPING,
+	PPPOAT_PPP_REQ_SENT,
+	PPPOAT_PPP_ACK_RCVD,
+	PPPOAT_PPP_ACK_SENT,
+	PPPOAT_PPP_OPENED,
+};
+
+enum pppoat_ppp_layer {
+	PPPOAT_PPP_LCP,
+	PPPOAT_PPP_IPCP,
+	PPPOAT_PPP_IPV6CP,
+	PPPOAT_PPP_LAYER_NR,
+};
+
+struct pppoat_ppp;
+struct pppoat_ppp_layer_ops;
+
+struct pppoat_ppp_ops {
+	/** Sends control packet of the protocol, without PPP header. */
+	void (*ppo_send)(struct pppoat_ppp *ppp,
+			 uint16_t           proto,
+			 const uint8_t     *buf,
+			 size_t             len);
+	/** Network protocol PPPOAT_PPP_PROTO_IP or _IPV6 is up or down. */
+	void (*ppo_up)(struct pppoat_ppp *ppp, uint16_t proto);
+	void (*ppo_down)(struct pppoat_ppp *ppp, uint16_t proto);
+};
+
+struct pppoat_ppp_conf {
+	/** MRU to request, 0 for the default. */
+	uint16_t ppc_mru;
+	/** Local and remote IPv4 addresses in network byte order, 0 lets
+	    the peer choose. */
+	uint32_t ppc_ip_local;
+	uint32_t ppc_ip_remote;
+	bool     ppc_ipv6;
+	/** Seeds magic numbers and interface identifiers. */
+	uint64_t ppc_seed;
+};
+
+struct pppoat_ppp_fsm {
+	const struct pppoat_ppp_layer_ops *pf_ops;
+	enum pppoat_ppp_fsm_state          pf_state;
+	bool                               pf_enabled;
+	uint8_t                            pf_id;
+	unsigned                           pf_restart;
+	unsigned                           pf_failures;
+	/** Restart timer in ms, 0 if stopped. */
+	uint64_t                           pf_deadline;
+	/** Options of the last Configure-Request. */
+	uint8_t                            pf_req[64];
+	size_t                             pf_req_len;
+};
+
+struct pppoat_ppp {
+	const struct pppoat_ppp_ops *pp_ops;
+	void                        *pp_userdata;
+	struct pppoat_ppp_conf       pp_conf;
+	struct pppoat_ppp_fsm        pp_fsm[PPPOAT_PPP_LAYER_NR];
+	uint64_t                     pp_now;
+	uint64_t                     pp_rand;
+	/** Time to reopen the link after it's gone down, 0 if not set. */
+	uint64_t                     pp_holdoff;
+	bool                         pp_closed;
+
+	/* LCP options which we request and which the peer acked. */
+	bool                         pp_want_mru;
+	bool                         pp_want_magic;
+	bool                         pp_want_accm;
+	bool                         pp_want_pfc;
+	bool                         pp_want_acfc;
+	uint16_t                     pp_mru;
+	uint32_t                     pp_magic;
+	uint32_t                     pp_rx_accm;
+	/* LCP options which the peer requested. */
+	uint16_t                     pp_peer_mru;
+	uint32_t                     pp_peer_magic;
+	uint32_t                     pp_tx_accm;
+	bool                         pp_tx_pfc;
+	bool                         pp_tx_acfc;
+
+	bool                         pp_want_ip;
+	uint32_t                     pp_ip_local;
+	uint32_t                     pp_ip_remote;
+
+	bool                         pp_want_ifid;
+	uint8_t                      pp_ifid_local[PPPOAT_PPP_IFID_LEN];
+	uint8_t                      pp_ifid_remote[PPPOAT_PPP_IFID_LEN];
+
+	/** Buffer for outgoing packets. */
+	uint8_t                      pp_out[PPPOAT_PPP_MRU_DEFAULT];
+};
+
+void pppoat_ppp_init(struct pppoat_ppp            *ppp,
+		     const struct pppoat_ppp_conf *conf,
+		     const struct pppoat_ppp_ops  *ops,
+		     void                         *userdata);
+
+/** Starts negotiation. */
+void pppoat_ppp_open(struct pppoat_ppp *ppp, uint64_t now);
+/** Terminates the link gracefully. */
+void pppoat_ppp_close(struct pppoat_ppp *ppp, uint64_t now);
+
+/**
+ * Handles a received packet of a control protocol or an unknown protocol.
+ * `buf' points to the information field after the protocol field.
+ */
+void pppoat_ppp_input(struct pppoat_ppp *ppp,
+		      uint16_t           proto,
+		      const uint8_t     *buf,
+		      size_t             len,
+		      uint64_t           now);
+
+/**
+ * Runs expired timers.
+ *
+ * @return Time in ms until the next timer or -1 if there is no timer.
+ */
+int64_t pppoat_ppp_timeout(struct pppoat_ppp *ppp, uint64_t now);
+
+/** Checks whether data packets of the protocol may be sent and received. */
+bool pppoat_ppp_is_up(const struct pppoat_ppp *ppp, uint16_t proto);
+
+/** MTU of the link: the peer's MRU. */
+size_t pppoat_ppp_mtu(const struct pppoat_ppp *ppp);
+
+/**
+ * Builds address, control and protocol fields of a frame to the peer,
+ * compressed if the peer agreed. Returns length of the header and ACCM to
+ * encode the frame with.
+ */
+size_t pppoat_ppp_hdr_build(const struct pppoat_ppp *ppp,
+			    uint16_t                 proto,
+			    const uint8_t           *info,
+			    size_t                   len,
+			    uint8_t                 *hdr,
+			    uint32_t                *accm);
+
+/**
+ * Parses header of a received frame, with or without compression.
+ *
+ * @return Length of the header or -EINVAL.
+ */
+int pppoat_ppp_hdr_parse(const uint8_t *frame, size_t len, uint16_t *proto);
+
+#endif /* __PPPOAT_PPP_H__ */
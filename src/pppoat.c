@@ -35,29 +35,50 @@
 #include <string.h>
 
 static struct pppoat_semaphore exit_sem;
+/** Set by SIGUSR1, which posts exit_sem to ask for statistics. */
+static volatile sig_atomic_t   stats_requested;
 
 static const pppoat_log_level_t default_log_level = PPPOAT_INFO;
 static struct pppoat_log_driver * const default_log_drv =
 						&pppoat_log_driver_stderr;
 
 /* Interface modules. */
+extern struct pppoat_module_impl pppoat_module_if_packet;
+extern struct pppoat_module_impl pppoat_module_if_ppp;
 extern struct pppoat_module_impl pppoat_module_if_pppd;
 extern struct pppoat_module_impl pppoat_module_if_stdio;
 extern struct pppoat_module_impl pppoat_module_if_tun;
 extern struct pppoat_module_impl pppoat_module_if_tap;
+/* Plugin modules. */
+extern struct pppoat_module_impl pppoat_module_pl_arq;
+extern struct pppoat_module_impl pppoat_module_pl_fec;
+extern struct pppoat_module_impl pppoat_module_pl_frag;
 /* Transport modules. */
 extern struct pppoat_module_impl pppoat_module_tp_http;
 extern struct pppoat_module_impl pppoat_module_tp_udp;
+extern struct pppoat_module_impl pppoat_module_tp_xdp;
 extern struct pppoat_module_impl pppoat_module_tp_xmpp;
 
 /* Array of all supported modules. */
 struct pppoat_module_impl *pppoat_modules[] = {
+#ifdef HAVE_MODULE_PACKET
+	&pppoat_module_if_packet,
+#endif
+#ifdef HAVE_MODULE_PPP
+	&pppoat_module_if_ppp,
+#endif
 	&pppoat_module_if_pppd,
 	&pppoat_module_if_stdio,
 	&pppoat_module_if_tun,
 	&pppoat_module_if_tap,
+	&pppoat_module_pl_arq,
+	&pppoat_module_pl_fec,
+	&pppoat_module_pl_frag,
 	&pppoat_module_tp_http,
 	&pppoat_module_tp_udp,
+#ifdef HAVE_MODULE_XDP
+	&pppoat_module_tp_xdp,
+#endif
 #ifdef HAVE_MODULE_XMPP
 	&pppoat_module_tp_xmpp,
 #endif
@@ -162,9 +183,65 @@ static void modules_print_type(enum pppoat_module_type type)
 			modules_print_pretty(pppoat_modules[i]);
 }
 
+static void plugins_fini(struct pppoat_module **plugins, size_t nr)
+{
+	while (nr > 0) {
+		pppoat_module_fini(plugins[--nr]);
+		pppoat_free(plugins[nr]);
+	}
+	pppoat_free(plugins);
+}
+
+/**
+ * Initialises plugins from a comma separated list of names. Plugins are
+ * placed in the pipeline in the given order from interface to transport.
+ */
+static int plugins_init(struct pppoat          *ctx,
+			char                   *names,
+			struct pppoat_module ***plugins,
+			size_t                 *nr)
+{
+	struct pppoat_module_impl *impl;
+	struct pppoat_module      *mod;
+	char                      *name;
+	char                      *saveptr;
+	size_t                     max = 1;
+	int                        rc = 0;
+
+	for (name = names; *name != '\0'; ++name)
+		max += *name == ',';
+	*nr      = 0;
+	*plugins = pppoat_calloc(max, sizeof **plugins);
+	if (*plugins == NULL)
+		return P_ERR(-ENOMEM);
+
+	for (name = strtok_r(names, ", ", &saveptr); rc == 0 && name != NULL;
+	     name = strtok_r(NULL, ", ", &saveptr)) {
+		impl = modules_find(name);
+		if (impl == NULL || impl->mod_type != PPPOAT_MODULE_PLUGIN) {
+			pppoat_error("pppoat", "Unknown plugin '%s'", name);
+			rc = P_ERR(-EINVAL);
+			break;
+		}
+		mod = pppoat_alloc(sizeof *mod);
+		rc  = mod == NULL ? P_ERR(-ENOMEM) : 0;
+		rc  = rc ?: pppoat_module_init(mod, impl, ctx);
+		if (rc == 0)
+			(*plugins)[(*nr)++] = mod;
+		else
+			pppoat_free(mod);
+	}
+	if (rc != 0)
+		plugins_fini(*plugins, *nr);
+
+	return rc;
+}
+
 static void pppoat_sighandler(int signo)
 {
 	pppoat_debug("pppoat", "signal %d caught", signo);
+	if (signo == SIGUSR1)
+		stats_requested = 1;
 	pppoat_semaphore_post(&exit_sem);
 }
 
@@ -185,6 +262,7 @@ static void pppoat_cleanup(struct pppoat *ctx)
 	/* Restore default handlers before finalising the semaphore. */
 	(void)sigaction(SIGTERM, &default_sigaction, NULL);
 	(void)sigaction(SIGINT, &default_sigaction, NULL);
+	(void)sigaction(SIGUSR1, &default_sigaction, NULL);
 	pppoat_semaphore_fini(&exit_sem);
 }
 
@@ -195,6 +273,9 @@ int main(int argc, char **argv)
 	struct pppoat_module_impl *tp;
 	struct pppoat_module      *if_mod;
 	struct pppoat_module      *tp_mod;
+	struct pppoat_module     **plugins = NULL;
+	size_t                     plugins_nr = 0;
+	size_t                     i;
 	char                      *file;
 	char                      *name;
 	bool                       verbose;
@@ -209,7 +290,8 @@ int main(int argc, char **argv)
 	pppoat_semaphore_init(&exit_sem, 0);
 
 	rc = sigaction(SIGTERM, &pppoat_sigaction, NULL)
-	  ?: sigaction(SIGINT, &pppoat_sigaction, NULL);
+	  ?: sigaction(SIGINT, &pppoat_sigaction, NULL)
+	  ?: sigaction(SIGUSR1, &pppoat_sigaction, NULL);
 	rc = rc == 0 ? 0 : P_ERR(-errno);
 	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
 		rc = rc ?: P_ERR(-errno);
@@ -267,6 +349,8 @@ int main(int argc, char **argv)
 	if (flag) {
 		printf("Interface modules:\n\n");
 		modules_print_type(PPPOAT_MODULE_INTERFACE);
+		printf("\nPlugin modules:\n\n");
+		modules_print_type(PPPOAT_MODULE_PLUGIN);
 		printf("\nTransport modules:\n\n");
 		modules_print_type(PPPOAT_MODULE_TRANSPORT);
 		goto exit;
@@ -299,6 +383,14 @@ int main(int argc, char **argv)
 	PPPOAT_ASSERT(iface->mod_type == PPPOAT_MODULE_INTERFACE);
 	PPPOAT_ASSERT(tp->mod_type == PPPOAT_MODULE_TRANSPORT);
 
+	rc = pppoat_conf_find_string_alloc(ctx->p_conf, "plugins", &name);
+	if (rc == 0) {
+		rc = plugins_init(ctx, name, &plugins, &plugins_nr);
+		pppoat_free(name);
+		if (rc != 0)
+			goto exit;
+	}
+
 	if_mod = pppoat_alloc(sizeof *if_mod);
 	PPPOAT_ASSERT(if_mod != NULL);
 	tp_mod = pppoat_alloc(sizeof *tp_mod);
@@ -308,7 +400,13 @@ int main(int argc, char **argv)
 	rc = pppoat_module_init(tp_mod, tp, ctx);
 	PPPOAT_ASSERT(rc == 0);
 	pppoat_pipeline_add_module(ctx->p_pipeline, if_mod);
+	for (i = 0; i < plugins_nr; ++i)
+		pppoat_pipeline_add_module(ctx->p_pipeline, plugins[i]);
 	pppoat_pipeline_add_module(ctx->p_pipeline, tp_mod);
+	for (i = 0; i < plugins_nr; ++i) {
+		rc = pppoat_module_run(plugins[i]);
+		PPPOAT_ASSERT(rc == 0);
+	}
 	rc = pppoat_module_run(if_mod);
 	PPPOAT_ASSERT(rc == 0);
 	rc = pppoat_module_run(tp_mod);
@@ -316,10 +414,16 @@ int main(int argc, char **argv)
 	pppoat_pipeline_start(ctx->p_pipeline);
 
 	/*
-	 * Wait for signal.
+	 * Wait for signal. SIGUSR1 dumps statistics and keeps running.
 	 */
 
-	pppoat_semaphore_wait(&exit_sem);
+	while (true) {
+		pppoat_semaphore_wait(&exit_sem);
+		if (!stats_requested)
+			break;
+		stats_requested = 0;
+		pppoat_pipeline_stats(ctx->p_pipeline);
+	}
 
 	/*
 	 * Finalisation.
@@ -328,6 +432,9 @@ int main(int argc, char **argv)
 	pppoat_pipeline_stop(ctx->p_pipeline);
 	pppoat_module_stop(if_mod);
 	pppoat_module_stop(tp_mod);
+	for (i = 0; i < plugins_nr; ++i)
+		pppoat_module_stop(plugins[i]);
+	plugins_fini(plugins, plugins_nr);
 	pppoat_module_fini(if_mod);
 	pppoat_module_fini(tp_mod);
 	pppoat_free(if_mod);
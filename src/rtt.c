@@ -0,0 +1,162 @@
+/* rtt.c
+ * PPP over Any Transport -- Path delay and loss estimator
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "misc.h"
+#include "rtt.h"
+
+#include <errno.h>
+#include <inttypes.h>	/* PRIu64 */
+#include <string.h>	/* memset */
+
+enum {
+	/* Gains are 1/2^shift, RFC 6298 and RFC 3550. */
+	RTT_SRTT_SHIFT   = 3,
+	RTT_RTTVAR_SHIFT = 2,
+	RTT_JITTER_SHIFT = 4,
+	RTT_LOSS_SHIFT   = 4,
+	RTT_LOSS_ONE     = 1000000,
+};
+
+static uint64_t rtt_abs_diff(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static void rtt_jitter_update(struct pppoat_rtt_stats *s, uint64_t d)
+{
+	if (d > s->rs_jitter)
+		s->rs_jitter += (d - s->rs_jitter) >> RTT_JITTER_SHIFT;
+	else
+		s->rs_jitter -= (s->rs_jitter - d) >> RTT_JITTER_SHIFT;
+}
+
+void pppoat_rtt_init(struct pppoat_rtt *rtt)
+{
+	memset(&rtt->rt_stats, 0, sizeof rtt->rt_stats);
+	rtt->rt_owd_min = 0;
+	rtt->rt_owd_last = 0;
+	rtt->rt_owd_valid = false;
+	pppoat_mutex_init(&rtt->rt_lock);
+}
+
+void pppoat_rtt_fini(struct pppoat_rtt *rtt)
+{
+	pppoat_mutex_fini(&rtt->rt_lock);
+}
+
+void pppoat_rtt_sample(struct pppoat_rtt *rtt, uint64_t rtt_us)
+{
+	struct pppoat_rtt_stats *s = &rtt->rt_stats;
+	uint64_t                 d;
+
+	pppoat_mutex_lock(&rtt->rt_lock);
+	if (s->rs_samples == 0) {
+		s->rs_srtt = rtt_us;
+		s->rs_rttvar = rtt_us / 2;
+		s->rs_min = rtt_us;
+	} else {
+		d = rtt_abs_diff(s->rs_srtt, rtt_us);
+		s->rs_rttvar = s->rs_rttvar - (s->rs_rttvar >> RTT_RTTVAR_SHIFT)
+			     + (d >> RTT_RTTVAR_SHIFT);
+		s->rs_srtt = s->rs_srtt - (s->rs_srtt >> RTT_SRTT_SHIFT)
+			   + (rtt_us >> RTT_SRTT_SHIFT);
+		if (rtt_us < s->rs_min)
+			s->rs_min = rtt_us;
+		if (!rtt->rt_owd_valid)
+			rtt_jitter_update(s, rtt_abs_diff(s->rs_last, rtt_us));
+	}
+	s->rs_last = rtt_us;
+	++s->rs_samples;
+	pppoat_mutex_unlock(&rtt->rt_lock);
+}
+
+void pppoat_rtt_owd_sample(struct pppoat_rtt *rtt, uint64_t tx, uint64_t rx)
+{
+	struct pppoat_rtt_stats *s = &rtt->rt_stats;
+	int64_t                  owd = (int64_t)(rx - tx);
+
+	pppoat_mutex_lock(&rtt->rt_lock);
+	if (!rtt->rt_owd_valid) {
+		rtt->rt_owd_min = owd;
+	} else {
+		rtt_jitter_update(s, owd > rtt->rt_owd_last ?
+				     (uint64_t)(owd - rtt->rt_owd_last) :
+				     (uint64_t)(rtt->rt_owd_last - owd));
+		if (owd < rtt->rt_owd_min)
+			rtt->rt_owd_min = owd;
+	}
+	rtt->rt_owd_last = owd;
+	rtt->rt_owd_valid = true;
+	s->rs_owd = (uint64_t)(owd - rtt->rt_owd_min);
+	pppoat_mutex_unlock(&rtt->rt_lock);
+}
+
+void pppoat_rtt_loss_sample(struct pppoat_rtt *rtt, bool lost)
+{
+	struct pppoat_rtt_stats *s = &rtt->rt_stats;
+
+	pppoat_mutex_lock(&rtt->rt_lock);
+	if (lost) {
+		s->rs_loss += (RTT_LOSS_ONE - s->rs_loss) >> RTT_LOSS_SHIFT;
+		++s->rs_lost;
+	} else
+		s->rs_loss -= s->rs_loss >> RTT_LOSS_SHIFT;
+	pppoat_mutex_unlock(&rtt->rt_lock);
+}
+
+int pppoat_rtt_get(struct pppoat_rtt *rtt, struct pppoat_rtt_stats *stats)
+{
+	int rc;
+
+	pppoat_mutex_lock(&rtt->rt_lock);
+	*stats = rtt->rt_stats;
+	rc = stats->rs_samples == 0 ? -ENOENT : 0;
+	pppoat_mutex_unlock(&rtt->rt_lock);
+
+	return rc;
+}
+
+uint64_t pppoat_rtt_backoff(uint64_t rto, unsigned retries, uint64_t max)
+{
+	unsigned i;
+
+	for (i = 0; i < retries && rto < max; ++i)
+		rto = rto > max / 2 ? max : rto * 2;
+	return pppoat_min(rto, max);
+}
+
+void pppoat_rtt_log(struct pppoat_rtt *rtt, const char *name)
+{
+	struct pppoat_rtt_stats s;
+	int                     rc;
+
+	rc = pppoat_rtt_get(rtt, &s);
+	if (rc != 0) {
+		pppoat_info(name, "RTT: no samples");
+		return;
+	}
+	pppoat_info(name, "RTT: srtt=%" PRIu64 "us rttvar=%" PRIu64 "us "
+		    "min=%" PRIu64 "us jitter=%" PRIu64 "us owd=+%" PRIu64 "us",
+		    s.rs_srtt, s.rs_rttvar, s.rs_min, s.rs_jitter, s.rs_owd);
+	pppoat_info(name, "RTT: samples=%" PRIu64 " lost=%" PRIu64
+		    " loss=%u.%02u%%", s.rs_samples, s.rs_lost,
+		    s.rs_loss / 10000, s.rs_loss / 100 % 100);
+}
@@ -0,0 +1,85 @@
+/* rtt.h
+ * PPP over Any Transport -- Path delay and loss estimator
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_RTT_H__
+#define __PPPOAT_RTT_H__
+
+#include "mutex.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Estimator of round-trip time, jitter and loss of a path. Transports feed
+ * it with results of their probes, other modules read a snapshot through
+ * pppoat_pipeline_rtt(). All times are in microseconds.
+ *
+ * Smoothed RTT and its variation follow RFC 6298. Jitter is the RFC 3550
+ * interarrival jitter: it is computed from one-way delays when the probe
+ * carries a remote timestamp and from successive RTT samples otherwise.
+ * Clocks of the peers are not synchronised, therefore one-way delay is
+ * reported relative to the minimum observed one, i.e. as queueing delay.
+ */
+
+struct pppoat_rtt_stats {
+	uint64_t rs_srtt;
+	uint64_t rs_rttvar;
+	uint64_t rs_min;
+	uint64_t rs_last;
+	uint64_t rs_jitter;
+	/** One-way delay above the minimum, 0 without remote timestamps. */
+	uint64_t rs_owd;
+	/** Smoothed loss rate in parts per million. */
+	uint32_t rs_loss;
+	uint64_t rs_samples;
+	uint64_t rs_lost;
+};
+
+struct pppoat_rtt {
+	struct pppoat_mutex     rt_lock;
+	struct pppoat_rtt_stats rt_stats;
+	int64_t                 rt_owd_min;
+	int64_t                 rt_owd_last;
+	bool                    rt_owd_valid;
+};
+
+void pppoat_rtt_init(struct pppoat_rtt *rtt);
+void pppoat_rtt_fini(struct pppoat_rtt *rtt);
+
+void pppoat_rtt_sample(struct pppoat_rtt *rtt, uint64_t rtt_us);
+/**
+ * Adds one-way delay sample. `tx' is the sender's timestamp and `rx' is
+ * the receiver's one, the clocks may have arbitrary offset.
+ */
+void pppoat_rtt_owd_sample(struct pppoat_rtt *rtt, uint64_t tx, uint64_t rx);
+/** Accounts a probe which was answered or lost. */
+void pppoat_rtt_loss_sample(struct pppoat_rtt *rtt, bool lost);
+
+/** @return 0 or -ENOENT if there is no RTT sample yet. */
+int pppoat_rtt_get(struct pppoat_rtt *rtt, struct pppoat_rtt_stats *stats);
+/**
+ * Returns retransmission timeout `rto' doubled `retries' times (RFC 6298,
+ * 5.5) and limited by `max'. It saturates for any number of retries.
+ */
+uint64_t pppoat_rtt_backoff(uint64_t rto, unsigned retries, uint64_t max);
+
+/** Logs a snapshot at info level, `name' is a prefix for the lines. */
+void pppoat_rtt_log(struct pppoat_rtt *rtt, const char *name);
+
+#endif /* __PPPOAT_RTT_H__ */
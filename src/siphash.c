@@ -0,0 +1,103 @@
+/* siphash.c
+ * PPP over Any Transport -- SipHash-2-4 keyed hash
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "siphash.h"
+
+#include <string.h>	/* strlen */
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3)			\
+	do {						\
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0;	\
+		v0 = ROTL(v0, 32);			\
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;	\
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;	\
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2;	\
+		v2 = ROTL(v2, 32);			\
+	} while (0)
+
+static uint64_t siphash_le64(const unsigned char *p)
+{
+	return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+void pppoat_siphash_key_set(struct pppoat_siphash_key *key, const void *buf)
+{
+	key->sk_k0 = siphash_le64(buf);
+	key->sk_k1 = siphash_le64((const unsigned char *)buf + 8);
+}
+
+void pppoat_siphash_key_derive(struct pppoat_siphash_key *key,
+			       const char                *secret)
+{
+	/* Arbitrary constants, both sides must use the same ones. */
+	const struct pppoat_siphash_key k0 = {
+		.sk_k0 = 0x7070706f61743200ULL,
+		.sk_k1 = 0x6b65792d64657276ULL,
+	};
+	const struct pppoat_siphash_key k1 = {
+		.sk_k0 = k0.sk_k1,
+		.sk_k1 = k0.sk_k0,
+	};
+	size_t len = strlen(secret);
+
+	key->sk_k0 = pppoat_siphash(&k0, secret, len);
+	key->sk_k1 = pppoat_siphash(&k1, secret, len);
+}
+
+uint64_t pppoat_siphash(const struct pppoat_siphash_key *key,
+			const void                      *buf,
+			size_t                           len)
+{
+	const unsigned char *p   = buf;
+	const unsigned char *end = p + (len & ~(size_t)7);
+	uint64_t             v0  = key->sk_k0 ^ 0x736f6d6570736575ULL;
+	uint64_t             v1  = key->sk_k1 ^ 0x646f72616e646f6dULL;
+	uint64_t             v2  = key->sk_k0 ^ 0x6c7967656e657261ULL;
+	uint64_t             v3  = key->sk_k1 ^ 0x7465646279746573ULL;
+	uint64_t             b   = (uint64_t)len << 56;
+	uint64_t             m;
+	unsigned             i;
+
+	for (; p != end; p += 8) {
+		m = siphash_le64(p);
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	for (i = 0; i < (len & 7); ++i)
+		b |= (uint64_t)p[i] << (8 * i);
+
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	for (i = 0; i < 4; ++i)
+		SIPROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
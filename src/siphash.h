@@ -0,0 +1,51 @@
+/* siphash.h
+ * PPP over Any Transport -- SipHash-2-4 keyed hash
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_SIPHASH_H__
+#define __PPPOAT_SIPHASH_H__
+
+#include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/**
+ * SipHash-2-4 is a short-input PRF by J.-P. Aumasson and D. J. Bernstein.
+ * It's used as a MAC for short messages such as tunnel packets.
+ */
+
+enum {
+	PPPOAT_SIPHASH_KEY_LEN = 16,
+};
+
+struct pppoat_siphash_key {
+	uint64_t sk_k0;
+	uint64_t sk_k1;
+};
+
+/** Sets key from 16 bytes in little-endian order. */
+void pppoat_siphash_key_set(struct pppoat_siphash_key *key, const void *buf);
+
+/** Derives key from a string of arbitrary length, e.g. a passphrase. */
+void pppoat_siphash_key_derive(struct pppoat_siphash_key *key,
+			       const char                *secret);
+
+uint64_t pppoat_siphash(const struct pppoat_siphash_key *key,
+			const void                      *buf,
+			size_t                           len);
+
+#endif /* __PPPOAT_SIPHASH_H__ */
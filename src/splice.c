@@ -0,0 +1,178 @@
+/* splice.c
+ * PPP over Any Transport -- Zero-copy writes to pipes
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "trace.h"
+
+#include "io.h"
+#include "magic.h"
+#include "splice.h"
+
+#include <errno.h>
+#include <fcntl.h>	/* vmsplice, F_SETPIPE_SZ */
+#include <sys/ioctl.h>	/* FIONREAD */
+#include <sys/stat.h>
+#include <sys/uio.h>	/* iovec */
+
+enum {
+	/**
+	 * Every packet takes at least one of the pipe's page slots, the
+	 * default 64KB pipe holds only 16 packets.
+	 */
+	SPLICE_PIPE_SIZE = 1024 * 1024,
+};
+
+static struct pppoat_list_descr splice_pinned_descr =
+	PPPOAT_LIST_DESCR("Pinned packets", struct pppoat_packet, pkt_q_link,
+			  pkt_q_magic, PPPOAT_SPLICE_PINNED_MAGIC);
+
+#ifdef HAVE_VMSPLICE
+
+int pppoat_splice_init(struct pppoat_splice  *sp,
+		       int                    fd,
+		       struct pppoat_packets *pkts)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return P_ERR(-errno);
+	if (!S_ISFIFO(st.st_mode))
+		return -ENOTSUP;
+#ifdef F_SETPIPE_SZ
+	/* Best effort, limited by /proc/sys/fs/pipe-max-size. */
+	(void)fcntl(fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+
+	*sp = (struct pppoat_splice){
+		.sp_fd   = fd,
+		.sp_pkts = pkts,
+	};
+	pppoat_mutex_init(&sp->sp_lock);
+	pppoat_list_init(&sp->sp_pinned, &splice_pinned_descr);
+
+	return 0;
+}
+
+/** Releases packets which the reader has consumed, called with the lock. */
+static void splice_reclaim(struct pppoat_splice *sp)
+{
+	struct pppoat_packet *pkt;
+	uint64_t              consumed;
+	int                   unread;
+
+	if (pppoat_list_is_empty(&sp->sp_pinned) ||
+	    ioctl(sp->sp_fd, FIONREAD, &unread) != 0)
+		return;
+
+	consumed = sp->sp_spliced - (uint64_t)unread;
+	while ((pkt = pppoat_list_head(&sp->sp_pinned)) != NULL &&
+	       sp->sp_released + pkt->pkt_size <= consumed) {
+		pppoat_list_del(&sp->sp_pinned, pkt);
+		sp->sp_released += pkt->pkt_size;
+		pppoat_packet_put(sp->sp_pkts, pkt);
+	}
+}
+
+/**
+ * Moves the buffer of a partially written packet to an empty packet which
+ * stays pinned, the caller releases the emptied packet.
+ */
+static void splice_partial_pin(struct pppoat_splice *sp,
+			       struct pppoat_packet *pkt,
+			       size_t                written)
+{
+	struct pppoat_packet *shell;
+
+	shell = pppoat_packet_get_empty(sp->sp_pkts);
+	if (shell == NULL) {
+		/* The reader may see modified data, the stream is broken. */
+		sp->sp_spliced -= written;
+		return;
+	}
+	shell->pkt_data        = pkt->pkt_data;
+	shell->pkt_size        = written;
+	shell->pkt_size_actual = pkt->pkt_size_actual;
+	shell->pkt_ops         = pkt->pkt_ops;
+	pkt->pkt_data        = NULL;
+	pkt->pkt_size        = 0;
+	pkt->pkt_size_actual = 0;
+	pkt->pkt_ops         = NULL;
+	pppoat_list_enqueue(&sp->sp_pinned, shell);
+}
+
+int pppoat_splice_write(struct pppoat_splice *sp, struct pppoat_packet *pkt)
+{
+	struct iovec iov = {
+		.iov_base = pkt->pkt_data,
+		.iov_len  = pkt->pkt_size,
+	};
+	ssize_t      wlen;
+	int          rc = 0;
+
+	pppoat_mutex_lock(&sp->sp_lock);
+	splice_reclaim(sp);
+	while (rc == 0 && iov.iov_len > 0) {
+		wlen = vmsplice(sp->sp_fd, &iov, 1, SPLICE_F_NONBLOCK);
+		if (wlen < 0) {
+			rc = -errno;
+			if (pppoat_io_error_is_recoverable(rc)) {
+				splice_reclaim(sp);
+				rc = rc == -EINTR ? 0 :
+				     pppoat_io_select_single_write(sp->sp_fd);
+			}
+			continue;
+		}
+		sp->sp_spliced += (uint64_t)wlen;
+		iov.iov_base = (char *)iov.iov_base + wlen;
+		iov.iov_len -= (size_t)wlen;
+	}
+	if (rc == 0)
+		pppoat_list_enqueue(&sp->sp_pinned, pkt);
+	else if (iov.iov_len < pkt->pkt_size)
+		splice_partial_pin(sp, pkt, pkt->pkt_size - iov.iov_len);
+	pppoat_mutex_unlock(&sp->sp_lock);
+
+	return rc;
+}
+
+#else /* HAVE_VMSPLICE */
+
+int pppoat_splice_init(struct pppoat_splice  *sp,
+		       int                    fd,
+		       struct pppoat_packets *pkts)
+{
+	return -ENOTSUP;
+}
+
+int pppoat_splice_write(struct pppoat_splice *sp, struct pppoat_packet *pkt)
+{
+	return P_ERR(-ENOTSUP);
+}
+
+#endif /* HAVE_VMSPLICE */
+
+void pppoat_splice_fini(struct pppoat_splice *sp)
+{
+	struct pppoat_packet *pkt;
+
+	while ((pkt = pppoat_list_dequeue(&sp->sp_pinned)) != NULL)
+		pppoat_packet_put(sp->sp_pkts, pkt);
+	pppoat_list_fini(&sp->sp_pinned);
+	pppoat_mutex_fini(&sp->sp_lock);
+}
@@ -0,0 +1,76 @@
+/* splice.h
+ * PPP over Any Transport -- Zero-copy writes to pipes
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PPPOAT_SPLICE_H__
+#define __PPPOAT_SPLICE_H__
+
+#include "list.h"
+#include "mutex.h"
+#include "packet.h"
+
+#include <stdint.h>
+
+/**
+ * High level design.
+ *
+ * vmsplice(2) puts references to pages of a packet to the pipe instead of
+ * copying the data, the reader copies it directly from the packet. So the
+ * packet must not be reused until the reader consumes the bytes. Written
+ * packets are pinned in FIFO order and the amount of unread bytes in the
+ * pipe, FIONREAD, tells how many of them are consumed. This requires that
+ * nobody else writes to the pipe.
+ *
+ * Pages aren't gifted: buffers of the packet pool are reused and share
+ * pages with other allocations.
+ */
+
+struct pppoat_splice {
+	int                    sp_fd;
+	struct pppoat_packets *sp_pkts;
+	struct pppoat_mutex    sp_lock;
+	/** Packets referenced by the pipe, oldest first. */
+	struct pppoat_list     sp_pinned;
+	/** Bytes moved to the pipe. */
+	uint64_t               sp_spliced;
+	/** Bytes of released packets. */
+	uint64_t               sp_released;
+};
+
+/**
+ * Prepares zero-copy writes to the pipe `fd'.
+ *
+ * @return 0, -ENOTSUP if `fd' is not a pipe or vmsplice() is not
+ *         supported, or other error.
+ */
+int pppoat_splice_init(struct pppoat_splice  *sp,
+		       int                    fd,
+		       struct pppoat_packets *pkts);
+/** Releases pinned packets, the pipe must not be read after this call. */
+void pppoat_splice_fini(struct pppoat_splice *sp);
+
+/**
+ * Writes the whole packet to the pipe, blocks while the pipe is full.
+ * On success the packet is owned by `sp' and released to the pool when
+ * the reader consumes it. On error the packet remains owned by the caller
+ * and the stream is broken, the buffer of a partially written packet is
+ * taken and the packet is left empty.
+ */
+int pppoat_splice_write(struct pppoat_splice *sp, struct pppoat_packet *pkt);
+
+#endif /* __PPPOAT_SPLICE_H__ */
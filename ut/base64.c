@@ -24,6 +24,7 @@
 #include "misc.h"	/* ARRAY_SIZE, pppoat_streq */
 #include "ut/ut.h"
 
+#include <errno.h>
 #include <string.h>	/* strlen */
 
 /*
@@ -157,12 +158,77 @@ static void ut_base64_binary(void)
 			     ARRAY_SIZE(ut_base64_binary_vector));
 }
 
+/* Decodes every vector split in two parts at every position. */
+static void ut_base64_decoder_run(const struct ut_base64_test *vec, size_t nr)
+{
+	struct pppoat_base64_decoder dec;
+	unsigned char                raw[64];
+	size_t                       len;
+	size_t                       len2;
+	size_t                       b64_len;
+	size_t                       i;
+	size_t                       k;
+	int                          rc;
+
+	for (i = 0; i < nr; ++i) {
+		b64_len = strlen(vec[i].ubt_base64);
+		PPPOAT_ASSERT(b64_len / 4 * 3 <= sizeof raw);
+		for (k = 0; k <= b64_len; ++k) {
+			pppoat_base64_decoder_init(&dec);
+			rc = pppoat_base64_decoder_update(&dec,
+					vec[i].ubt_base64, k, raw, &len);
+			PPPOAT_ASSERT(rc == 0);
+			rc = pppoat_base64_decoder_update(&dec,
+					vec[i].ubt_base64 + k, b64_len - k,
+					raw + len, &len2);
+			PPPOAT_ASSERT(rc == 0);
+			rc = pppoat_base64_decoder_final(&dec);
+			PPPOAT_ASSERT(rc == 0);
+			PPPOAT_ASSERT(len + len2 == vec[i].ubt_raw_len);
+			PPPOAT_ASSERT(memcmp(raw, vec[i].ubt_raw,
+					     len + len2) == 0);
+		}
+	}
+}
+
+static void ut_base64_decoder(void)
+{
+	static const char *invalid[] = { "Zg=A", "Z===", "Zg==Zg==", "Zm9*" };
+	struct pppoat_base64_decoder dec;
+	unsigned char                raw[16];
+	size_t                       len;
+	size_t                       i;
+	int                          rc;
+
+	ut_base64_decoder_run(ut_base64_rfc4648_vector,
+			      ARRAY_SIZE(ut_base64_rfc4648_vector));
+	ut_base64_decoder_run(ut_base64_strings_vector,
+			      ARRAY_SIZE(ut_base64_strings_vector));
+	ut_base64_decoder_run(ut_base64_binary_vector,
+			      ARRAY_SIZE(ut_base64_binary_vector));
+
+	for (i = 0; i < ARRAY_SIZE(invalid); ++i) {
+		pppoat_base64_decoder_init(&dec);
+		rc = pppoat_base64_decoder_update(&dec, invalid[i],
+						  strlen(invalid[i]), raw,
+						  &len);
+		PPPOAT_ASSERT(rc == -EINVAL);
+	}
+	/* Truncated quantum. */
+	pppoat_base64_decoder_init(&dec);
+	rc = pppoat_base64_decoder_update(&dec, "Zm9vYg", 6, raw, &len);
+	PPPOAT_ASSERT(rc == 0 && len == 3);
+	rc = pppoat_base64_decoder_final(&dec);
+	PPPOAT_ASSERT(rc == -EINVAL);
+}
+
 struct pppoat_ut_group pppoat_tests_base64 = {
 	.ug_name = "base64",
 	.ug_tests = {
 		PPPOAT_UT_TEST("RFC4648", ut_base64_rfc4648),
 		PPPOAT_UT_TEST("strings", ut_base64_strings),
 		PPPOAT_UT_TEST("binary", ut_base64_binary),
+		PPPOAT_UT_TEST("decoder", ut_base64_decoder),
 		PPPOAT_UT_TEST_END,
 	},
 };
@@ -0,0 +1,184 @@
+/* ut/filter.c
+ * PPP over Any Transport -- Unit tests (Packet filters)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "filter.h"
+#include "misc.h"
+#include "ut/ut.h"
+
+#include <errno.h>
+#include <string.h>	/* memcpy */
+
+static const unsigned char ut_filter_ip4_udp[] = {
+	0x45, 0x00, 0x00, 0x1c, 0x12, 0x34, 0x00, 0x00,
+	0x40, 0x11, 0x00, 0x00, 10, 0, 0, 1,
+	10, 0, 0, 2,
+	0x9c, 0x40, 0x00, 0x35, 0x00, 0x08, 0x00, 0x00,
+};
+
+static const unsigned char ut_filter_ip6_icmp[] = {
+	0x60, 0x00, 0x00, 0x00, 0x00, 0x08, 0x3a, 0xff,
+	0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+	0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+	0x86, 0x00, 0x00, 0x00, 0x40, 0x00, 0x07, 0x08,
+};
+
+static const unsigned char ut_filter_ether_arp[] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0, 0, 0, 0, 1,
+	0x08, 0x06, 0x00, 0x01, 0x08, 0x00, 0x06, 0x04,
+};
+
+static bool ut_filter_pass(const struct pppoat_filter *filter,
+			   const void                 *pkt,
+			   size_t                      len)
+{
+	return pppoat_filter_run(filter, pkt, len) != 0;
+}
+
+static void ut_filter_compile(void)
+{
+	struct pppoat_filter filter;
+	const char          *bad[] = {
+		"foo", "port", "port 65536", "proto x", "multicast 1",
+		"ra,,ipv4", "ipv4 ipv6", "port -1",
+	};
+	size_t               i;
+	int                  rc;
+
+	for (i = 0; i < ARRAY_SIZE(bad); ++i) {
+		rc = pppoat_filter_compile(&filter, bad[i],
+					   PPPOAT_FILTER_LINK_IP);
+		PPPOAT_ASSERT_INFO(rc == -EINVAL, "rules=%s", bad[i]);
+	}
+
+	/* An empty filter accepts everything. */
+	rc = pppoat_filter_compile(&filter, " ", PPPOAT_FILTER_LINK_IP);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ut_filter_ip4_udp,
+				     sizeof ut_filter_ip4_udp));
+	PPPOAT_ASSERT(ut_filter_pass(&filter, "x", 1));
+	pppoat_filter_fini(&filter);
+
+	rc = pppoat_filter_compile(&filter, "ipv6, ", PPPOAT_FILTER_LINK_IP);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ut_filter_ip4_udp,
+				     sizeof ut_filter_ip4_udp));
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ut_filter_ip6_icmp,
+				      sizeof ut_filter_ip6_icmp));
+	pppoat_filter_fini(&filter);
+}
+
+static void ut_filter_ip(void)
+{
+	struct pppoat_filter filter;
+	unsigned char        ip4[sizeof ut_filter_ip4_udp];
+	unsigned char        ip6[sizeof ut_filter_ip6_icmp];
+	int                  rc;
+
+	rc = pppoat_filter_compile(&filter, "multicast, ra, port 53, proto 47",
+				   PPPOAT_FILTER_LINK_IP);
+	PPPOAT_ASSERT(rc == 0);
+
+	memcpy(ip4, ut_filter_ip4_udp, sizeof ip4);
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip4, sizeof ip4));
+	ip4[23] = 0x50;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ip4, sizeof ip4));
+	/* Ports of TCP, which are at the same offset. */
+	ip4[9] = 6;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ip4, sizeof ip4));
+	ip4[23] = 0x35;
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip4, sizeof ip4));
+	/* Options move the ports. */
+	ip4[0] = 0x46;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ip4, sizeof ip4));
+	ip4[0] = 0x45;
+	/* Non-first fragments have no ports. */
+	ip4[7] = 0x10;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ip4, sizeof ip4));
+	ip4[9] = 47;
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip4, sizeof ip4));
+	ip4[9] = 17;
+	ip4[16] = 224;
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip4, sizeof ip4));
+
+	/* Router advertisement to all nodes. */
+	memcpy(ip6, ut_filter_ip6_icmp, sizeof ip6);
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip6, sizeof ip6));
+	/* Neighbour solicitation passes, even to a multicast address. */
+	ip6[40] = 135;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ip6, sizeof ip6));
+	ip6[6] = 17;
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip6, sizeof ip6));
+	ip6[24] = 0xfd;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, ip6, sizeof ip6));
+	ip6[42] = 0;
+	ip6[43] = 53;
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip6, sizeof ip6));
+
+	/* Truncated packets are dropped like in the kernel. */
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, ip6, 40));
+
+	pppoat_filter_fini(&filter);
+}
+
+static void ut_filter_ether(void)
+{
+	struct pppoat_filter filter;
+	unsigned char        frame[14 + sizeof ut_filter_ip4_udp];
+	unsigned char        arp[sizeof ut_filter_ether_arp];
+	int                  rc;
+
+	rc = pppoat_filter_compile(&filter, "broadcast, multicast",
+				   PPPOAT_FILTER_LINK_ETHER);
+	PPPOAT_ASSERT(rc == 0);
+
+	memcpy(arp, ut_filter_ether_arp, sizeof arp);
+	PPPOAT_ASSERT(ut_filter_pass(&filter, arp, sizeof arp));
+	/* Other protocols to the broadcast address. */
+	arp[13] = 0x42;
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, arp, sizeof arp));
+	/* Link local multicast, e.g. LLDP. */
+	memcpy(arp, "\x01\x80\xc2\x00\x00\x0e", 6);
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, arp, sizeof arp));
+	arp[0] = 0x02;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, arp, sizeof arp));
+
+	memcpy(frame, ut_filter_ether_arp, 12);
+	frame[12] = 0x08;
+	frame[13] = 0x00;
+	memcpy(frame + 14, ut_filter_ip4_udp, sizeof ut_filter_ip4_udp);
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, frame, sizeof frame));
+	frame[0] = 0x02;
+	PPPOAT_ASSERT(ut_filter_pass(&filter, frame, sizeof frame));
+	frame[14 + 16] = 239;
+	PPPOAT_ASSERT(!ut_filter_pass(&filter, frame, sizeof frame));
+
+	pppoat_filter_fini(&filter);
+}
+
+struct pppoat_ut_group pppoat_tests_filter = {
+	.ug_name = "filter",
+	.ug_tests = {
+		PPPOAT_UT_TEST("compile", ut_filter_compile),
+		PPPOAT_UT_TEST("ip", ut_filter_ip),
+		PPPOAT_UT_TEST("ether", ut_filter_ether),
+		PPPOAT_UT_TEST_END,
+	},
+};
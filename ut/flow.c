@@ -0,0 +1,109 @@
+/* flow.c
+ * PPP over Any Transport -- Unit tests
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "flow.h"
+#include "ut/ut.h"
+
+#include <string.h>	/* memcpy */
+
+static const unsigned char ut_flow_ip4_tcp[] = {
+	0x45, 0x00, 0x00, 0x28, 0x12, 0x34, 0x40, 0x00,
+	0x40, 0x06, 0x00, 0x00, 10, 0, 0, 1,
+	10, 0, 0, 2,
+	0x9c, 0x40, 0x00, 0x50, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const unsigned char ut_flow_ip6_udp[] = {
+	0x60, 0x00, 0x00, 0x00, 0x00, 0x08, 0x11, 0x40,
+	0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+	0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
+	0x9c, 0x40, 0x00, 0x35, 0x00, 0x08, 0x00, 0x00,
+};
+
+static void ut_flow_ip4(void)
+{
+	unsigned char pkt[sizeof ut_flow_ip4_tcp];
+	uint32_t      h;
+	uint32_t      h2;
+
+	memcpy(pkt, ut_flow_ip4_tcp, sizeof pkt);
+	h = pppoat_flow_hash(pkt, sizeof pkt);
+	PPPOAT_ASSERT(h != 0);
+
+	/* Fields outside of the flow don't matter. */
+	pkt[5] = 0x99;
+	pkt[8] = 0x01;
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, sizeof pkt) == h);
+
+	pkt[21] = 0x41;
+	h2 = pppoat_flow_hash(pkt, sizeof pkt);
+	PPPOAT_ASSERT(h2 != h);
+
+	/* Fragments are hashed without ports. */
+	pkt[6] = 0x20;
+	h  = pppoat_flow_hash(pkt, sizeof pkt);
+	pkt[21] = 0x40;
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, sizeof pkt) == h);
+	PPPOAT_ASSERT(h != h2);
+
+	/* Ports beyond the buffer are ignored too. */
+	pkt[6] = 0x40;
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, 20) == h);
+}
+
+static void ut_flow_ip6(void)
+{
+	unsigned char pkt[sizeof ut_flow_ip6_udp];
+	uint32_t      h;
+
+	memcpy(pkt, ut_flow_ip6_udp, sizeof pkt);
+	h = pppoat_flow_hash(pkt, sizeof pkt);
+	PPPOAT_ASSERT(h != 0);
+
+	pkt[1] = 0x55;
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, sizeof pkt) == h);
+	pkt[23] = 3;
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, sizeof pkt) != h);
+}
+
+static void ut_flow_invalid(void)
+{
+	unsigned char pkt[sizeof ut_flow_ip6_udp];
+
+	memcpy(pkt, ut_flow_ip4_tcp, sizeof ut_flow_ip4_tcp);
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, 19) == 0);
+
+	memcpy(pkt, ut_flow_ip6_udp, sizeof pkt);
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, 39) == 0);
+
+	pkt[0] = 0x20;
+	PPPOAT_ASSERT(pppoat_flow_hash(pkt, sizeof pkt) == 0);
+}
+
+struct pppoat_ut_group pppoat_tests_flow = {
+	.ug_name = "flow",
+	.ug_tests = {
+		PPPOAT_UT_TEST("ip4", ut_flow_ip4),
+		PPPOAT_UT_TEST("ip6", ut_flow_ip6),
+		PPPOAT_UT_TEST("invalid", ut_flow_invalid),
+		PPPOAT_UT_TEST_END,
+	},
+};
@@ -0,0 +1,146 @@
+/* lpm.c
+ * PPP over Any Transport -- Unit tests
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "gf256.h"
+#include "ut/ut.h"
+
+#include <errno.h>
+#include <stdlib.h>	/* rand */
+#include <string.h>
+
+enum {
+	UT_GF256_BUF = 300,
+	UT_GF256_ITERS = 200,
+};
+
+static void ut_gf256_field(void)
+{
+	unsigned a;
+	unsigned b;
+	uint8_t  c;
+
+	pppoat_gf256_init();
+
+	for (a = 1; a < 256; ++a) {
+		PPPOAT_ASSERT(pppoat_gf256_mul(a, pppoat_gf256_inv(a)) == 1);
+		PPPOAT_ASSERT(pppoat_gf256_mul(a, 1) == a);
+		PPPOAT_ASSERT(pppoat_gf256_mul(a, 0) == 0);
+	}
+	/* x * x = x^2 and 0x80 * 2 wraps through the polynomial. */
+	PPPOAT_ASSERT(pppoat_gf256_mul(2, 2) == 4);
+	PPPOAT_ASSERT(pppoat_gf256_mul(0x80, 2) == 0x1d);
+
+	for (a = 0; a < 256; a += 7) {
+		for (b = 0; b < 256; b += 5) {
+			PPPOAT_ASSERT(pppoat_gf256_mul(a, b) ==
+				      pppoat_gf256_mul(b, a));
+			c = (uint8_t)rand();
+			PPPOAT_ASSERT(pppoat_gf256_mul(a ^ b, c) ==
+				      (pppoat_gf256_mul(a, c) ^
+				       pppoat_gf256_mul(b, c)));
+		}
+	}
+}
+
+static void ut_gf256_muladd(void)
+{
+	uint8_t  src[UT_GF256_BUF];
+	uint8_t  dst[UT_GF256_BUF];
+	uint8_t  exp[UT_GF256_BUF];
+	size_t   off;
+	size_t   len;
+	size_t   i;
+	unsigned iter;
+	uint8_t  c;
+
+	pppoat_gf256_init();
+
+	for (iter = 0; iter < UT_GF256_ITERS; ++iter) {
+		/* Unaligned buffers and lengths around SIMD width. */
+		off = (size_t)rand() % 16;
+		len = (size_t)rand() % (UT_GF256_BUF - 16);
+		c   = (uint8_t)rand();
+		for (i = 0; i < UT_GF256_BUF; ++i) {
+			src[i] = (uint8_t)rand();
+			dst[i] = (uint8_t)rand();
+		}
+		memcpy(exp, dst, sizeof exp);
+		for (i = 0; i < len; ++i)
+			exp[off + i] ^= pppoat_gf256_mul(c, src[off + i]);
+
+		pppoat_gf256_muladd(dst + off, src + off, c, len);
+		PPPOAT_ASSERT(memcmp(dst, exp, sizeof exp) == 0);
+	}
+}
+
+static void ut_gf256_matrix(void)
+{
+	uint8_t  m[PPPOAT_GF256_MATRIX_MAX * PPPOAT_GF256_MATRIX_MAX];
+	uint8_t  orig[PPPOAT_GF256_MATRIX_MAX * PPPOAT_GF256_MATRIX_MAX];
+	uint8_t  v;
+	unsigned n;
+	unsigned i;
+	unsigned j;
+	unsigned l;
+	int      rc;
+
+	pppoat_gf256_init();
+
+	/* Cauchy matrices 1 / (x_i + y_j) are always invertible. */
+	for (n = 1; n <= PPPOAT_GF256_MATRIX_MAX; n = n * 2 + 1) {
+		for (i = 0; i < n; ++i)
+			for (j = 0; j < n; ++j)
+				m[i * n + j] = pppoat_gf256_inv(
+					(uint8_t)((255 - i) ^ j));
+		memcpy(orig, m, n * n);
+		rc = pppoat_gf256_matrix_inv(m, n);
+		PPPOAT_ASSERT(rc == 0);
+
+		for (i = 0; i < n; ++i) {
+			for (j = 0; j < n; ++j) {
+				v = 0;
+				for (l = 0; l < n; ++l)
+					v ^= pppoat_gf256_mul(orig[i * n + l],
+							      m[l * n + j]);
+				PPPOAT_ASSERT(v == (i == j ? 1 : 0));
+			}
+		}
+	}
+
+	/* Equal rows. */
+	n = 3;
+	memset(m, 0, n * n);
+	m[0] = m[3] = 5;
+	m[1] = m[4] = 7;
+	m[8] = 1;
+	rc = pppoat_gf256_matrix_inv(m, n);
+	PPPOAT_ASSERT(rc == -EINVAL);
+}
+
+struct pppoat_ut_group pppoat_tests_gf256 = {
+	.ug_name = "gf256",
+	.ug_tests = {
+		PPPOAT_UT_TEST("field", ut_gf256_field),
+		PPPOAT_UT_TEST("muladd", ut_gf256_muladd),
+		PPPOAT_UT_TEST("matrix", ut_gf256_matrix),
+		PPPOAT_UT_TEST_END,
+	},
+};
@@ -0,0 +1,248 @@
+/* ut/hdlc.c
+ * PPP over Any Transport -- Unit tests (HDLC-like framing)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "hdlc.h"
+#include "misc.h"	/* ARRAY_SIZE, pppoat_min */
+#include "ut/ut.h"
+
+#include <string.h>	/* memcmp, memmove */
+
+/* LCP Configure-Request with ACCM 0 and magic number 0x01020304. */
+static const uint8_t ut_hdlc_lcp[] = {
+	0xff, 0x03, 0xc0, 0x21, 0x01, 0x01, 0x00, 0x0e,
+	0x02, 0x06, 0x00, 0x00, 0x00, 0x00,
+	0x05, 0x06, 0x01, 0x02, 0x03, 0x04,
+};
+
+static void ut_hdlc_fcs(void)
+{
+	uint8_t  buf[11] = "123456789";
+	uint16_t fcs;
+
+	/* Check value of CRC-16/X-25. */
+	fcs = pppoat_hdlc_fcs(PPPOAT_HDLC_FCS_INIT, buf, 9) ^ 0xffff;
+	PPPOAT_ASSERT(fcs == 0x906e);
+
+	buf[9]  = fcs & 0xff;
+	buf[10] = fcs >> 8;
+	fcs = pppoat_hdlc_fcs(PPPOAT_HDLC_FCS_INIT, buf, sizeof buf);
+	PPPOAT_ASSERT(fcs == PPPOAT_HDLC_FCS_GOOD);
+}
+
+static size_t ut_hdlc_encode_lcp(uint8_t *out, uint32_t accm)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)ut_hdlc_lcp, .iov_len = 4 },
+		{ .iov_base = (void *)(ut_hdlc_lcp + 4),
+		  .iov_len = sizeof ut_hdlc_lcp - 4 },
+	};
+
+	return pppoat_hdlc_encode(out, iov, 2, accm);
+}
+
+static void ut_hdlc_encode(void)
+{
+	uint8_t out[PPPOAT_HDLC_ENCODED_MAX(sizeof ut_hdlc_lcp)];
+	size_t  len;
+	size_t  i;
+
+	len = ut_hdlc_encode_lcp(out, PPPOAT_HDLC_ACCM_ALL);
+	PPPOAT_ASSERT(len <= sizeof out);
+	PPPOAT_ASSERT(out[0] == PPPOAT_HDLC_FLAG);
+	PPPOAT_ASSERT(out[len - 1] == PPPOAT_HDLC_FLAG);
+	for (i = 1; i < len - 1; ++i) {
+		PPPOAT_ASSERT(out[i] != PPPOAT_HDLC_FLAG);
+		PPPOAT_ASSERT(out[i] >= 0x20);
+	}
+	/* The first escaped byte is the control field. */
+	PPPOAT_ASSERT(out[2] == PPPOAT_HDLC_ESCAPE && out[3] == 0x23);
+
+	/* Without ACCM the data doesn't need escaping. */
+	len = ut_hdlc_encode_lcp(out, 0);
+	PPPOAT_ASSERT(memcmp(out + 1, ut_hdlc_lcp, sizeof ut_hdlc_lcp) == 0);
+	PPPOAT_ASSERT(len >= sizeof ut_hdlc_lcp + 4);
+}
+
+static void ut_hdlc_decode(void)
+{
+	struct pppoat_hdlc_decoder dec;
+	const uint8_t             *frame;
+	uint8_t                    stream[3 * PPPOAT_HDLC_ENCODED_MAX(
+						sizeof ut_hdlc_lcp)];
+	size_t                     frame_len;
+	size_t                     len;
+	size_t                     off;
+	size_t                     n;
+	int                        frames;
+	int                        rc;
+
+	rc = pppoat_hdlc_decoder_init(&dec, 64);
+	PPPOAT_ASSERT(rc == 0);
+
+	/* Two frames, the second one after garbage and without the flag. */
+	len  = ut_hdlc_encode_lcp(stream, PPPOAT_HDLC_ACCM_ALL);
+	stream[len++] = 0x55;
+	n = ut_hdlc_encode_lcp(stream + len, 0);
+	memmove(stream + len, stream + len + 1, n - 1);
+	len += n - 1;
+
+	off = 0;
+	frames = 0;
+	while (off < len) {
+		off += pppoat_hdlc_decode(&dec, stream + off, len - off,
+					  &frame, &frame_len);
+		if (frame != NULL) {
+			PPPOAT_ASSERT(frame_len == sizeof ut_hdlc_lcp);
+			PPPOAT_ASSERT(memcmp(frame, ut_hdlc_lcp,
+					     frame_len) == 0);
+			++frames;
+		}
+	}
+	PPPOAT_ASSERT(frames == 1);
+	PPPOAT_ASSERT(dec.hd_errors == 1);
+
+	/* Byte by byte. */
+	len = ut_hdlc_encode_lcp(stream, PPPOAT_HDLC_ACCM_ALL);
+	for (off = 0, frames = 0; off < len; ++off) {
+		n = pppoat_hdlc_decode(&dec, stream + off, 1, &frame,
+				       &frame_len);
+		PPPOAT_ASSERT(n == 1);
+		frames += frame != NULL ? 1 : 0;
+	}
+	PPPOAT_ASSERT(frames == 1);
+	PPPOAT_ASSERT(frame_len == sizeof ut_hdlc_lcp);
+	PPPOAT_ASSERT(dec.hd_frames == 2);
+
+	pppoat_hdlc_decoder_fini(&dec);
+}
+
+static void ut_hdlc_scan(void)
+{
+	/* Bytes which differ from flag or escape in one bit. */
+	static const uint8_t near[] = { 0x7c, 0x7f, 0x5e, 0xfe, 0x5d, 0xfd };
+	uint8_t              buf[67];
+	size_t               i;
+
+	for (i = 0; i < sizeof buf; ++i)
+		buf[i] = near[i % ARRAY_SIZE(near)];
+	PPPOAT_ASSERT(pppoat_hdlc_scan(buf, sizeof buf) == sizeof buf);
+	PPPOAT_ASSERT(pppoat_hdlc_scan(buf, 0) == 0);
+
+	for (i = 0; i < sizeof buf; ++i) {
+		buf[i] = PPPOAT_HDLC_FLAG;
+		PPPOAT_ASSERT(pppoat_hdlc_scan(buf, sizeof buf) == i);
+		PPPOAT_ASSERT(pppoat_hdlc_scan(buf, i) == i);
+		buf[i] = PPPOAT_HDLC_ESCAPE;
+		PPPOAT_ASSERT(pppoat_hdlc_scan(buf, sizeof buf) == i);
+		buf[i] = near[i % ARRAY_SIZE(near)];
+	}
+}
+
+static void ut_hdlc_long(void)
+{
+	struct pppoat_hdlc_decoder dec;
+	const uint8_t             *frame;
+	struct iovec               iov;
+	uint8_t                    data[1500];
+	uint8_t                    stream[PPPOAT_HDLC_ENCODED_MAX(1500)];
+	size_t                     frame_len;
+	size_t                     len;
+	size_t                     off;
+	size_t                     n;
+	size_t                     i;
+	int                        rc;
+
+	/* Long runs of plain bytes with flags and escapes in between. */
+	for (i = 0; i < sizeof data; ++i)
+		data[i] = (uint8_t)(i * 7 + i / 100);
+	iov.iov_base = data;
+	iov.iov_len  = sizeof data;
+	len = pppoat_hdlc_encode(stream, &iov, 1, 0);
+
+	rc = pppoat_hdlc_decoder_init(&dec, sizeof data);
+	PPPOAT_ASSERT(rc == 0);
+	for (n = 1; n < 40; n += 3) {
+		for (off = 0; off < len; ) {
+			off += pppoat_hdlc_decode(&dec, stream + off,
+						  pppoat_min(n, len - off),
+						  &frame, &frame_len);
+		}
+		PPPOAT_ASSERT(frame != NULL && frame_len == sizeof data);
+		PPPOAT_ASSERT(memcmp(frame, data, sizeof data) == 0);
+	}
+	PPPOAT_ASSERT(dec.hd_errors == 0);
+	pppoat_hdlc_decoder_fini(&dec);
+}
+
+static void ut_hdlc_errors(void)
+{
+	struct pppoat_hdlc_decoder dec;
+	const uint8_t             *frame;
+	uint8_t                    stream[PPPOAT_HDLC_ENCODED_MAX(
+						sizeof ut_hdlc_lcp)];
+	size_t                     frame_len;
+	size_t                     len;
+	size_t                     n;
+	int                        rc;
+
+	rc = pppoat_hdlc_decoder_init(&dec, sizeof ut_hdlc_lcp);
+	PPPOAT_ASSERT(rc == 0);
+
+	/* Corrupted byte. */
+	len = ut_hdlc_encode_lcp(stream, 0);
+	stream[5] ^= 0x01;
+	n = pppoat_hdlc_decode(&dec, stream, len, &frame, &frame_len);
+	PPPOAT_ASSERT(n == len && frame == NULL);
+	PPPOAT_ASSERT(dec.hd_errors == 1);
+
+	/* Abort sequence. */
+	len = ut_hdlc_encode_lcp(stream, 0);
+	stream[len - 2] = PPPOAT_HDLC_ESCAPE;
+	n = pppoat_hdlc_decode(&dec, stream, len, &frame, &frame_len);
+	PPPOAT_ASSERT(n == len && frame == NULL);
+	PPPOAT_ASSERT(dec.hd_aborts == 1);
+
+	/* Exactly the maximum size is accepted. */
+	len = ut_hdlc_encode_lcp(stream, 0);
+	n = pppoat_hdlc_decode(&dec, stream, len, &frame, &frame_len);
+	PPPOAT_ASSERT(frame != NULL && frame_len == sizeof ut_hdlc_lcp);
+	pppoat_hdlc_decoder_fini(&dec);
+
+	rc = pppoat_hdlc_decoder_init(&dec, sizeof ut_hdlc_lcp - 1);
+	PPPOAT_ASSERT(rc == 0);
+	n = pppoat_hdlc_decode(&dec, stream, len, &frame, &frame_len);
+	PPPOAT_ASSERT(n == len && frame == NULL);
+	PPPOAT_ASSERT(dec.hd_errors == 1);
+	pppoat_hdlc_decoder_fini(&dec);
+}
+
+struct pppoat_ut_group pppoat_tests_hdlc = {
+	.ug_name = "hdlc",
+	.ug_tests = {
+		PPPOAT_UT_TEST("fcs", ut_hdlc_fcs),
+		PPPOAT_UT_TEST("encode", ut_hdlc_encode),
+		PPPOAT_UT_TEST("decode", ut_hdlc_decode),
+		PPPOAT_UT_TEST("errors", ut_hdlc_errors),
+		PPPOAT_UT_TEST("scan", ut_hdlc_scan),
+		PPPOAT_UT_TEST("long", ut_hdlc_long),
+		PPPOAT_UT_TEST_END,
+	},
+};
@@ -0,0 +1,262 @@
+/* ut/http.c
+ * PPP over Any Transport -- Unit tests (Incremental HTTP/1.1 message parser)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "http.h"
+#include "misc.h"	/* ARRAY_SIZE, pppoat_min */
+#include "packet.h"
+#include "ut/ut.h"
+
+#include <errno.h>
+#include <stdio.h>	/* snprintf */
+#include <stdlib.h>	/* strtoull */
+#include <string.h>	/* memcmp, memset, strlen */
+#include <unistd.h>	/* pipe, write, close */
+
+enum {
+	UT_HTTP_RING = 2 * PPPOAT_HTTP_LINE_MAX,
+};
+
+/* "Hello, world!" with X-Ts header. */
+static const char ut_http_msg[] =
+	"POST / HTTP/1.1\r\n"
+	"X-Ts: 12345\r\n"
+	"content-length:  20 \r\n"
+	"\r\n"
+	"SGVsbG8sIHdvcmxkIQ==";
+
+static const char ut_http_empty[] = "GET / HTTP/1.1\r\n\r\n";
+
+struct ut_http {
+	struct pppoat_packets     uh_pkts;
+	struct pppoat_http_parser uh_parser;
+	int                       uh_fds[2];
+	unsigned                  uh_lines;
+	uint64_t                  uh_ts;
+};
+
+static void ut_http_line(void *arg, const char *line, size_t len)
+{
+	struct ut_http *uh = arg;
+	const char     *value;
+	size_t          vlen;
+	char            buf[24];
+
+	PPPOAT_ASSERT(len > 0 && line[len - 1] != '\r');
+	++uh->uh_lines;
+	if (pppoat_http_header_value(line, len, "X-Ts", &value, &vlen)) {
+		PPPOAT_ASSERT(vlen < sizeof buf);
+		memcpy(buf, value, vlen);
+		buf[vlen] = '\0';
+		uh->uh_ts = strtoull(buf, NULL, 10);
+	}
+}
+
+static void ut_http_init(struct ut_http *uh, bool base64)
+{
+	int rc;
+
+	uh->uh_lines = 0;
+	uh->uh_ts    = 0;
+	rc = pppoat_packets_init(&uh->uh_pkts);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_http_parser_init(&uh->uh_parser, &uh->uh_pkts,
+				     UT_HTTP_RING, base64, &ut_http_line, uh);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pipe(uh->uh_fds);
+	PPPOAT_ASSERT(rc == 0);
+}
+
+static void ut_http_fini(struct ut_http *uh)
+{
+	(void)close(uh->uh_fds[0]);
+	(void)close(uh->uh_fds[1]);
+	pppoat_http_parser_fini(&uh->uh_parser);
+	pppoat_packets_fini(&uh->uh_pkts);
+}
+
+/* Passes data to the parser via the pipe. */
+static void ut_http_feed(struct ut_http *uh, const char *buf, size_t len)
+{
+	ssize_t wlen;
+	int     rc;
+
+	wlen = write(uh->uh_fds[1], buf, len);
+	PPPOAT_ASSERT(wlen == (ssize_t)len);
+	rc = pppoat_http_parser_read(&uh->uh_parser, uh->uh_fds[0]);
+	PPPOAT_ASSERT(rc == 0);
+}
+
+static void ut_http_check_msg(struct ut_http *uh, struct pppoat_packet *pkt)
+{
+	PPPOAT_ASSERT(pkt != NULL);
+	PPPOAT_ASSERT(pkt->pkt_size == 13);
+	PPPOAT_ASSERT(memcmp(pkt->pkt_data, "Hello, world!", 13) == 0);
+	PPPOAT_ASSERT(uh->uh_ts == 12345);
+	pppoat_packet_put(&uh->uh_pkts, pkt);
+	uh->uh_ts = 0;
+}
+
+static void ut_http_pipelined(void)
+{
+	struct pppoat_packet *pkt;
+	struct ut_http        uh;
+	char                  buf[256];
+	int                   len;
+	int                   rc;
+
+	ut_http_init(&uh, true);
+	len = snprintf(buf, sizeof buf, "%s%s%s", ut_http_msg, ut_http_empty,
+		       ut_http_msg);
+	ut_http_feed(&uh, buf, (size_t)len);
+
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == 0);
+	ut_http_check_msg(&uh, pkt);
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == 0 && pkt == NULL);
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == 0);
+	ut_http_check_msg(&uh, pkt);
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == -EAGAIN && pkt == NULL);
+	PPPOAT_ASSERT(uh.uh_lines == 7);
+
+	ut_http_fini(&uh);
+}
+
+static void ut_http_split(void)
+{
+	struct pppoat_packet *pkt;
+	struct ut_http        uh;
+	size_t                len = strlen(ut_http_msg);
+	size_t                i;
+	int                   rc;
+
+	ut_http_init(&uh, true);
+	for (i = 0; i < len; ++i) {
+		ut_http_feed(&uh, ut_http_msg + i, 1);
+		rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+		PPPOAT_ASSERT(i + 1 < len ? rc == -EAGAIN : rc == 0);
+	}
+	ut_http_check_msg(&uh, pkt);
+
+	ut_http_fini(&uh);
+}
+
+/* Every position of the message crosses the end of the ring once. */
+static void ut_http_wrap(void)
+{
+	struct pppoat_packet *pkt;
+	struct ut_http        uh;
+	char                  nl[PPPOAT_HTTP_LINE_MAX];
+	size_t                len = strlen(ut_http_msg);
+	size_t                pad;
+	size_t                skip;
+	int                   rc;
+
+	ut_http_init(&uh, true);
+	memset(nl, '\n', sizeof nl);
+	for (pad = 1; pad <= len; ++pad) {
+		/* Empty lines before a message move it in the ring. */
+		skip = (UT_HTTP_RING - pad - uh.uh_parser.hp_wr) %
+		       UT_HTTP_RING;
+		while (skip > 0) {
+			ut_http_feed(&uh, nl, pppoat_min(skip, sizeof nl));
+			skip -= pppoat_min(skip, sizeof nl);
+			rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+			PPPOAT_ASSERT(rc == -EAGAIN);
+		}
+		ut_http_feed(&uh, ut_http_msg, len);
+		rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+		PPPOAT_ASSERT(rc == 0);
+		ut_http_check_msg(&uh, pkt);
+	}
+
+	ut_http_fini(&uh);
+}
+
+static void ut_http_skip(void)
+{
+	static const char html[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Length: 10\r\n"
+		"\r\n"
+		"<html>\r\n\r\n";
+	struct pppoat_packet *pkt;
+	struct ut_http        uh;
+	int                   rc;
+
+	ut_http_init(&uh, false);
+	ut_http_feed(&uh, html, strlen(html));
+	ut_http_feed(&uh, ut_http_empty, strlen(ut_http_empty));
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == 0 && pkt == NULL);
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == 0 && pkt == NULL);
+	PPPOAT_ASSERT(uh.uh_lines == 3);
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == -EAGAIN);
+
+	ut_http_fini(&uh);
+}
+
+static void ut_http_malformed(void)
+{
+	static const char *msgs[] = {
+		"GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+		"GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+		"GET / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc",
+		"GET / HTTP/1.1\r\nContent-Length: 4\r\n\r\nab*d",
+		"GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+	};
+	struct pppoat_packet *pkt;
+	struct ut_http        uh;
+	char                  buf[PPPOAT_HTTP_LINE_MAX + 2];
+	size_t                i;
+	int                   rc;
+
+	for (i = 0; i < ARRAY_SIZE(msgs); ++i) {
+		ut_http_init(&uh, true);
+		ut_http_feed(&uh, msgs[i], strlen(msgs[i]));
+		rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+		PPPOAT_ASSERT(rc == -EPROTO && pkt == NULL);
+		ut_http_fini(&uh);
+	}
+
+	ut_http_init(&uh, true);
+	memset(buf, 'a', sizeof buf);
+	ut_http_feed(&uh, buf, sizeof buf);
+	rc = pppoat_http_parse(&uh.uh_parser, &pkt);
+	PPPOAT_ASSERT(rc == -EMSGSIZE);
+	ut_http_fini(&uh);
+}
+
+struct pppoat_ut_group pppoat_tests_http = {
+	.ug_name = "http",
+	.ug_tests = {
+		PPPOAT_UT_TEST("pipelined", ut_http_pipelined),
+		PPPOAT_UT_TEST("split", ut_http_split),
+		PPPOAT_UT_TEST("wrap", ut_http_wrap),
+		PPPOAT_UT_TEST("skip", ut_http_skip),
+		PPPOAT_UT_TEST("malformed", ut_http_malformed),
+		PPPOAT_UT_TEST_END,
+	},
+};
@@ -0,0 +1,246 @@
+/* lpm.c
+ * PPP over Any Transport -- Unit tests
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "lpm.h"
+#include "misc.h"	/* ARRAY_SIZE */
+#include "ut/ut.h"
+
+#include <errno.h>
+#include <stdlib.h>	/* rand */
+
+#define UT_IP(a, b, c, d) \
+	((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (d))
+
+enum {
+	UT_LPM_TBL8_MAX = 64,
+	UT_LPM_RULES_NR = 200,
+	UT_LPM_LOOKUPS  = 20000,
+	UT_LPM_MANY     = 65536,
+};
+
+static void ut_lpm_simple(void)
+{
+	struct pppoat_lpm lpm;
+	uint32_t          nh;
+	int               rc;
+
+	rc = pppoat_lpm_init(&lpm, UT_LPM_TBL8_MAX);
+	PPPOAT_ASSERT(rc == 0);
+
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 0, 0, 1), &nh);
+	PPPOAT_ASSERT(rc == -ENOENT);
+
+	rc = pppoat_lpm_add(&lpm, UT_IP(10, 0, 0, 0), 8, 1)
+	  ?: pppoat_lpm_add(&lpm, UT_IP(10, 1, 0, 0), 16, 2)
+	  ?: pppoat_lpm_add(&lpm, UT_IP(10, 1, 2, 0), 28, 3)
+	  ?: pppoat_lpm_add(&lpm, UT_IP(10, 1, 2, 5), 32, 4);
+	PPPOAT_ASSERT(rc == 0);
+
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 9, 9, 9), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 1);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 9, 9), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 2);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 2, 4), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 3);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 2, 5), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 4);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 2, 16), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 2);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(11, 0, 0, 1), &nh);
+	PPPOAT_ASSERT(rc == -ENOENT);
+
+	/* Default prefix. */
+	rc = pppoat_lpm_add(&lpm, 0, 0, 5);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(11, 0, 0, 1), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 5);
+
+	/* Deletion uncovers the shorter prefixes. */
+	rc = pppoat_lpm_del(&lpm, UT_IP(10, 1, 2, 0), 28);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 2, 4), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 2);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 2, 5), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 4);
+	rc = pppoat_lpm_del(&lpm, UT_IP(10, 1, 0, 0), 16);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 2, 4), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 1);
+	rc = pppoat_lpm_del(&lpm, UT_IP(10, 1, 0, 0), 16);
+	PPPOAT_ASSERT(rc == -ENOENT);
+
+	/* Replacement of next hop. */
+	rc = pppoat_lpm_add(&lpm, UT_IP(10, 1, 2, 5), 32, 6);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_lpm_lookup(&lpm, UT_IP(10, 1, 2, 5), &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == 6);
+
+	pppoat_lpm_fini(&lpm);
+}
+
+struct ut_lpm_rule {
+	uint32_t ulr_prefix;
+	uint8_t  ulr_len;
+	uint32_t ulr_nh;
+	bool     ulr_deleted;
+};
+
+static uint32_t ut_lpm_mask(uint8_t len)
+{
+	return len == 0 ? 0 : ~0U << (32 - len);
+}
+
+/* Linear search over all rules. */
+static int ut_lpm_ref_lookup(struct ut_lpm_rule *rules,
+			     size_t              nr,
+			     uint32_t            addr,
+			     uint32_t           *nh)
+{
+	struct ut_lpm_rule *best = NULL;
+	size_t              i;
+
+	for (i = 0; i < nr; ++i) {
+		if (!rules[i].ulr_deleted &&
+		    (addr & ut_lpm_mask(rules[i].ulr_len)) ==
+		    rules[i].ulr_prefix &&
+		    (best == NULL || rules[i].ulr_len > best->ulr_len))
+			best = &rules[i];
+	}
+	if (best != NULL)
+		*nh = best->ulr_nh;
+	return best == NULL ? -ENOENT : 0;
+}
+
+static void ut_lpm_compare(struct pppoat_lpm  *lpm,
+			   struct ut_lpm_rule *rules,
+			   size_t              nr)
+{
+	uint32_t addr;
+	uint32_t nh1;
+	uint32_t nh2;
+	int      rc1;
+	int      rc2;
+	int      i;
+
+	for (i = 0; i < UT_LPM_LOOKUPS; ++i) {
+		/* Bias addresses to the rules, so longer prefixes are hit. */
+		addr = rules[rand() % nr].ulr_prefix | (rand() & 0x3ff);
+		rc1 = pppoat_lpm_lookup(lpm, addr, &nh1);
+		rc2 = ut_lpm_ref_lookup(rules, nr, addr, &nh2);
+		PPPOAT_ASSERT(rc1 == rc2);
+		PPPOAT_ASSERT(imply(rc1 == 0, nh1 == nh2));
+	}
+}
+
+static void ut_lpm_random(void)
+{
+	struct pppoat_lpm   lpm;
+	struct ut_lpm_rule  rules[UT_LPM_RULES_NR];
+	struct ut_lpm_rule *r;
+	size_t              i;
+	size_t              j;
+	int                 rc;
+
+	srand(42);
+	rc = pppoat_lpm_init(&lpm, UT_LPM_RULES_NR);
+	PPPOAT_ASSERT(rc == 0);
+
+	for (i = 0; i < ARRAY_SIZE(rules); ++i) {
+		r = &rules[i];
+		/* Keep prefixes within 10.0.0.0/12 to get overlaps. */
+		r->ulr_len     = 12 + rand() % 21;
+		r->ulr_prefix  = (UT_IP(10, 0, 0, 0) | (rand() & 0xfffff)) &
+				 ut_lpm_mask(r->ulr_len);
+		r->ulr_nh      = (uint32_t)i;
+		r->ulr_deleted = false;
+		for (j = 0; j < i; ++j) {
+			/* The table replaces next hop of a duplicate. */
+			if (!rules[j].ulr_deleted &&
+			    rules[j].ulr_prefix == r->ulr_prefix &&
+			    rules[j].ulr_len == r->ulr_len)
+				rules[j].ulr_deleted = true;
+		}
+		rc = pppoat_lpm_add(&lpm, r->ulr_prefix, r->ulr_len,
+				    r->ulr_nh);
+		PPPOAT_ASSERT(rc == 0);
+	}
+	ut_lpm_compare(&lpm, rules, ARRAY_SIZE(rules));
+
+	for (i = 0; i < ARRAY_SIZE(rules); i += 2) {
+		r = &rules[i];
+		if (r->ulr_deleted)
+			continue;
+		rc = pppoat_lpm_del(&lpm, r->ulr_prefix, r->ulr_len);
+		PPPOAT_ASSERT(rc == 0);
+		r->ulr_deleted = true;
+	}
+	ut_lpm_compare(&lpm, rules, ARRAY_SIZE(rules));
+
+	pppoat_lpm_fini(&lpm);
+}
+
+/* Host routes of a /16, a linear rule store would make this quadratic. */
+static void ut_lpm_many(void)
+{
+	struct pppoat_lpm lpm;
+	uint32_t          addr;
+	uint32_t          nh;
+	uint32_t          i;
+	int               rc;
+
+	rc = pppoat_lpm_init(&lpm, 256);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_lpm_add(&lpm, UT_IP(10, 0, 0, 0), 8, UT_LPM_MANY);
+	PPPOAT_ASSERT(rc == 0);
+
+	for (i = 0; i < UT_LPM_MANY; ++i) {
+		rc = pppoat_lpm_add(&lpm, UT_IP(10, 1, 0, 0) | i, 32, i);
+		PPPOAT_ASSERT(rc == 0);
+	}
+	for (i = 0; i < UT_LPM_MANY; i += 2) {
+		rc = pppoat_lpm_del(&lpm, UT_IP(10, 1, 0, 0) | i, 32);
+		PPPOAT_ASSERT(rc == 0);
+	}
+	for (i = 0; i < UT_LPM_MANY; ++i) {
+		addr = UT_IP(10, 1, 0, 0) | i;
+		rc = pppoat_lpm_lookup(&lpm, addr, &nh);
+		PPPOAT_ASSERT(rc == 0);
+		PPPOAT_ASSERT(nh == (i % 2 == 0 ? UT_LPM_MANY : i));
+		rc = pppoat_lpm_find(&lpm, addr, 32, &nh);
+		PPPOAT_ASSERT(i % 2 == 0 ? rc == -ENOENT : rc == 0 && nh == i);
+	}
+	rc = pppoat_lpm_find(&lpm, UT_IP(10, 1, 0, 0), 16, &nh);
+	PPPOAT_ASSERT(rc == -ENOENT);
+	rc = pppoat_lpm_find(&lpm, UT_IP(10, 1, 0, 0), 8, &nh);
+	PPPOAT_ASSERT(rc == 0 && nh == UT_LPM_MANY);
+
+	pppoat_lpm_fini(&lpm);
+}
+
+struct pppoat_ut_group pppoat_tests_lpm = {
+	.ug_name = "lpm",
+	.ug_tests = {
+		PPPOAT_UT_TEST("simple", ut_lpm_simple),
+		PPPOAT_UT_TEST("random", ut_lpm_random),
+		PPPOAT_UT_TEST("many", ut_lpm_many),
+		PPPOAT_UT_TEST_END,
+	},
+};
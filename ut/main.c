@@ -29,19 +29,41 @@ static struct pppoat_ut ut_inst;
 void add_all_tests(struct pppoat_ut *ut)
 {
 	extern struct pppoat_ut_group pppoat_tests_base64;
+	extern struct pppoat_ut_group pppoat_tests_filter;
+	extern struct pppoat_ut_group pppoat_tests_flow;
+	extern struct pppoat_ut_group pppoat_tests_gf256;
+	extern struct pppoat_ut_group pppoat_tests_hdlc;
+	extern struct pppoat_ut_group pppoat_tests_http;
 	extern struct pppoat_ut_group pppoat_tests_list;
+	extern struct pppoat_ut_group pppoat_tests_lpm;
+	extern struct pppoat_ut_group pppoat_tests_rtt;
 	extern struct pppoat_ut_group pppoat_tests_sem;
+	extern struct pppoat_ut_group pppoat_tests_siphash;
+	extern struct pppoat_ut_group pppoat_tests_splice;
 	extern struct pppoat_ut_group pppoat_tests_conf;
 	extern struct pppoat_ut_group pppoat_tests_packet;
+	extern struct pppoat_ut_group pppoat_tests_peers;
+	extern struct pppoat_ut_group pppoat_tests_ppp;
 	extern struct pppoat_ut_group pppoat_tests_queue;
 	extern struct pppoat_ut_group pppoat_tests_thread;
 	extern struct pppoat_ut_group pppoat_tests_trace;
 
 	pppoat_ut_group_add(ut, &pppoat_tests_base64);
+	pppoat_ut_group_add(ut, &pppoat_tests_filter);
+	pppoat_ut_group_add(ut, &pppoat_tests_flow);
+	pppoat_ut_group_add(ut, &pppoat_tests_gf256);
+	pppoat_ut_group_add(ut, &pppoat_tests_hdlc);
+	pppoat_ut_group_add(ut, &pppoat_tests_http);
 	pppoat_ut_group_add(ut, &pppoat_tests_list);
+	pppoat_ut_group_add(ut, &pppoat_tests_lpm);
+	pppoat_ut_group_add(ut, &pppoat_tests_rtt);
 	pppoat_ut_group_add(ut, &pppoat_tests_sem);
+	pppoat_ut_group_add(ut, &pppoat_tests_siphash);
+	pppoat_ut_group_add(ut, &pppoat_tests_splice);
 	pppoat_ut_group_add(ut, &pppoat_tests_conf);
 	pppoat_ut_group_add(ut, &pppoat_tests_packet);
+	pppoat_ut_group_add(ut, &pppoat_tests_peers);
+	pppoat_ut_group_add(ut, &pppoat_tests_ppp);
 	pppoat_ut_group_add(ut, &pppoat_tests_queue);
 	pppoat_ut_group_add(ut, &pppoat_tests_thread);
 	pppoat_ut_group_add(ut, &pppoat_tests_trace);
@@ -22,7 +22,7 @@
 #include "packet.h"
 #include "ut/ut.h"
 
-#include <string.h>	/* memset */
+#include <string.h>	/* memset, memcmp */
 
 enum {
 	UT_PACKET_SIZE = 1500,
@@ -135,12 +135,45 @@ static void ut_packet_ops_free(void)
 	PPPOAT_ASSERT(counter == 1);
 }
 
+static void ut_packet_reserve(void)
+{
+	struct pppoat_packet *pkt;
+	unsigned char         pattern[UT_PACKET_SIZE];
+	size_t                i;
+	int                   rc;
+
+	for (i = 0; i < sizeof pattern; ++i)
+		pattern[i] = (unsigned char)i;
+
+	rc = pppoat_packets_init(&pkts);
+	PPPOAT_ASSERT(rc == 0);
+	pkt = pppoat_packet_get(&pkts, UT_PACKET_SIZE);
+	PPPOAT_ASSERT(pkt != NULL);
+	memcpy(pkt->pkt_data, pattern, sizeof pattern);
+
+	rc = pppoat_packet_reserve(&pkts, pkt, UT_PACKET_SIZE / 2);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(pkt->pkt_size == UT_PACKET_SIZE);
+
+	rc = pppoat_packet_reserve(&pkts, pkt, UT_PACKET_SIZE * 2);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(pkt->pkt_size == UT_PACKET_SIZE);
+	PPPOAT_ASSERT(pkt->pkt_size_actual >= UT_PACKET_SIZE * 2);
+	PPPOAT_ASSERT(memcmp(pkt->pkt_data, pattern, sizeof pattern) == 0);
+	/* The whole reserved buffer must be accessible. */
+	memset(pkt->pkt_data, 0, UT_PACKET_SIZE * 2);
+
+	pppoat_packet_put(&pkts, pkt);
+	pppoat_packets_fini(&pkts);
+}
+
 struct pppoat_ut_group pppoat_tests_packet = {
 	.ug_name = "packet",
 	.ug_tests = {
 		PPPOAT_UT_TEST("get-empty", ut_packet_get_empty),
 		PPPOAT_UT_TEST("get-put", ut_packet_get_put),
 		PPPOAT_UT_TEST("ops-free", ut_packet_ops_free),
+		PPPOAT_UT_TEST("reserve", ut_packet_reserve),
 		PPPOAT_UT_TEST_END,
 	},
 };
@@ -0,0 +1,264 @@
+/* ut/peers.c
+ * PPP over Any Transport -- Unit tests (Peer table of a datagram server)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "peers.h"
+#include "ut/ut.h"
+
+#include <errno.h>
+#include <string.h>	/* memset */
+#include <arpa/inet.h>	/* htonl, htons */
+#include <netinet/in.h>
+
+#define UT_IP(a, b, c, d) \
+	((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (d))
+
+enum {
+	UT_PEERS_MAX = 4,
+	/** Start time in ms, later than PPPOAT_PEERS_IDLE. */
+	UT_PEERS_NOW = 1000000,
+};
+
+static const unsigned char ut_peers_seed[PPPOAT_SIPHASH_KEY_LEN] =
+	"0123456789abcde";
+
+static void ut_peers_init(struct pppoat_peers *ps, unsigned max)
+{
+	int rc;
+
+	rc = pppoat_peers_init(ps, max, ut_peers_seed);
+	PPPOAT_ASSERT(rc == 0);
+}
+
+static struct sockaddr *ut_peers_addr(struct sockaddr_in *sin,
+				      uint32_t            ip,
+				      unsigned short      port)
+{
+	memset(sin, 0, sizeof *sin);
+	sin->sin_family      = AF_INET;
+	sin->sin_addr.s_addr = htonl(ip);
+	sin->sin_port        = htons(port);
+	return (struct sockaddr *)sin;
+}
+
+static bool ut_peers_is_at(struct pppoat_peer *peer, struct sockaddr_in *sin)
+{
+	struct sockaddr_in *at = (struct sockaddr_in *)&peer->pe_addr;
+
+	return at->sin_addr.s_addr == sin->sin_addr.s_addr &&
+	       at->sin_port == sin->sin_port;
+}
+
+static void ut_peers_replay(void)
+{
+	struct pppoat_peers  ps;
+	struct pppoat_peer  *peer;
+	struct pppoat_peer  *peer2;
+	struct sockaddr_in   a;
+	struct sockaddr_in   b;
+	uint64_t             now = UT_PEERS_NOW;
+	bool                 newest;
+	int                  rc;
+
+	ut_peers_init(&ps, UT_PEERS_MAX);
+	(void)ut_peers_addr(&a, UT_IP(192, 0, 2, 1), 1000);
+	(void)ut_peers_addr(&b, UT_IP(198, 51, 100, 7), 2000);
+
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 100,
+				 now, &peer, &newest);
+	PPPOAT_ASSERT(rc == 0 && newest);
+	PPPOAT_ASSERT(ps.ps_nr == 1 && peer->pe_session == 7);
+
+	/* The same datagram from another address takes no peer. */
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&b, sizeof b, 7, 100,
+				 now + 1, &peer2, &newest);
+	PPPOAT_ASSERT(rc == -EALREADY);
+	PPPOAT_ASSERT(ps.ps_nr == 1 && ut_peers_is_at(peer, &a));
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 100,
+				 now + 1, &peer2, &newest);
+	PPPOAT_ASSERT(rc == -EALREADY);
+
+	/* Reordered datagrams within the window are accepted once. */
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 99,
+				 now + 1, &peer2, &newest);
+	PPPOAT_ASSERT(rc == 0 && !newest && peer2 == peer);
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7,
+				 100 + PPPOAT_REPLAY_WIN, now + 1, &peer2,
+				 &newest);
+	PPPOAT_ASSERT(rc == 0 && newest);
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 98,
+				 now + 1, &peer2, &newest);
+	PPPOAT_ASSERT(rc == -EALREADY);
+
+	/* A restarted peer continues the sequence numbers. */
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 8, 50,
+				 now + 2, &peer2, &newest);
+	PPPOAT_ASSERT(rc == -EALREADY && peer->pe_session == 7);
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 8,
+				 1000000, now + 2, &peer2, &newest);
+	PPPOAT_ASSERT(rc == 0 && peer2 == peer && peer->pe_session == 8);
+	PPPOAT_ASSERT(ps.ps_nr == 1);
+
+	/* The old session is forgotten at this address. */
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 101,
+				 now + 3, &peer2, &newest);
+	PPPOAT_ASSERT(rc == -EALREADY && peer->pe_session == 8);
+
+	pppoat_peers_fini(&ps);
+}
+
+static void ut_peers_roam(void)
+{
+	struct pppoat_peers  ps;
+	struct pppoat_peer  *peer;
+	struct pppoat_peer  *peer2;
+	struct sockaddr_in   a;
+	struct sockaddr_in   b;
+	uint64_t             now = UT_PEERS_NOW;
+	bool                 newest;
+	int                  rc;
+
+	ut_peers_init(&ps, UT_PEERS_MAX);
+	(void)ut_peers_addr(&a, UT_IP(192, 0, 2, 1), 1000);
+	(void)ut_peers_addr(&b, UT_IP(198, 51, 100, 7), 2000);
+
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 1,
+				 now, &peer, &newest);
+	PPPOAT_ASSERT(rc == 0);
+
+	/* The peer doesn't move while the old address is alive. */
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&b, sizeof b, 7, 2,
+				 now + 1, &peer2, &newest);
+	PPPOAT_ASSERT(rc == 0 && peer2 == peer && ut_peers_is_at(peer, &a));
+
+	now += PPPOAT_PEERS_ROAM_HOLD;
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&b, sizeof b, 7, 10,
+				 now, &peer2, &newest);
+	PPPOAT_ASSERT(rc == 0 && peer2 == peer && ut_peers_is_at(peer, &b));
+	PPPOAT_ASSERT(ps.ps_nr == 1);
+
+	/* A late datagram from the old address doesn't move it back. */
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 5,
+				 now + PPPOAT_PEERS_ROAM_HOLD, &peer2, &newest);
+	PPPOAT_ASSERT(rc == 0 && !newest && ut_peers_is_at(peer, &b));
+	rc = pppoat_peers_get(&ps, (struct sockaddr *)&b, sizeof b, now,
+			      &peer2);
+	PPPOAT_ASSERT(rc == 0 && peer2 == peer);
+
+	pppoat_peers_fini(&ps);
+}
+
+static void ut_peers_rebind(void)
+{
+	struct pppoat_peers  ps;
+	struct pppoat_peer  *peer;
+	struct pppoat_peer  *peer2;
+	struct sockaddr_in   a;
+	struct sockaddr_in   b;
+	uint64_t             now = UT_PEERS_NOW;
+	bool                 newest;
+	int                  rc;
+
+	ut_peers_init(&ps, UT_PEERS_MAX);
+	(void)ut_peers_addr(&a, UT_IP(192, 0, 2, 1), 1000);
+	(void)ut_peers_addr(&b, UT_IP(198, 51, 100, 7), 2000);
+
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&a, sizeof a, 7, 1,
+				 now, &peer, &newest);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_peers_learn(&ps, peer, UT_IP(10, 2, 0, 1), true);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_peers_route_add(&ps, UT_IP(10, 3, 0, 1), 32, peer);
+	PPPOAT_ASSERT(rc == 0);
+
+	/* The client has restarted at another address. */
+	rc = pppoat_peers_accept(&ps, (struct sockaddr *)&b, sizeof b, 8, 2,
+				 now + 1, &peer2, &newest);
+	PPPOAT_ASSERT(rc == 0 && peer2 != peer);
+	rc = pppoat_peers_learn(&ps, peer2, UT_IP(10, 2, 0, 1), false);
+	PPPOAT_ASSERT(rc == -EEXIST);
+	PPPOAT_ASSERT(pppoat_peers_route(&ps, UT_IP(10, 2, 0, 1)) == peer);
+	rc = pppoat_peers_learn(&ps, peer2, UT_IP(10, 2, 0, 1), true);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(pppoat_peers_route(&ps, UT_IP(10, 2, 0, 1)) == peer2);
+	PPPOAT_ASSERT(peer->pe_routes_nr == 0 && peer2->pe_routes_nr == 1);
+	rc = pppoat_peers_learn(&ps, peer2, UT_IP(10, 2, 0, 1), true);
+	PPPOAT_ASSERT(rc == 0 && peer2->pe_routes_nr == 1);
+
+	/* Static routes aren't moved. */
+	rc = pppoat_peers_learn(&ps, peer2, UT_IP(10, 3, 0, 1), true);
+	PPPOAT_ASSERT(rc == -EEXIST);
+	PPPOAT_ASSERT(pppoat_peers_route(&ps, UT_IP(10, 3, 0, 1)) == peer);
+
+	pppoat_peers_fini(&ps);
+}
+
+static void ut_peers_evict(void)
+{
+	struct pppoat_peers  ps;
+	struct pppoat_peer  *peer;
+	struct pppoat_peer  *peer2;
+	struct sockaddr_in   sin;
+	uint64_t             now = UT_PEERS_NOW;
+	int                  rc;
+
+	ut_peers_init(&ps, 2);
+	rc = pppoat_peers_get(&ps, ut_peers_addr(&sin, UT_IP(10, 0, 0, 1), 1),
+			      sizeof sin, now, &peer);
+	PPPOAT_ASSERT(rc == 0);
+	peer->pe_static = true;
+	rc = pppoat_peers_route_add(&ps, UT_IP(10, 1, 0, 0), 16, peer);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_peers_get(&ps, ut_peers_addr(&sin, UT_IP(10, 0, 0, 2), 2),
+			      sizeof sin, now, &peer2);
+	PPPOAT_ASSERT(rc == 0 && peer2 != peer);
+	rc = pppoat_peers_learn(&ps, peer2, UT_IP(10, 2, 0, 1), false);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(pppoat_peers_route(&ps, UT_IP(10, 2, 0, 1)) == peer2);
+	PPPOAT_ASSERT(pppoat_peers_route(&ps, UT_IP(10, 1, 2, 3)) == peer);
+
+	rc = pppoat_peers_get(&ps, ut_peers_addr(&sin, UT_IP(10, 0, 0, 3), 3),
+			      sizeof sin, now + 1, &peer2);
+	PPPOAT_ASSERT(rc == -ENOSPC);
+
+	/* The idle learned peer is replaced with its routes. */
+	now += PPPOAT_PEERS_IDLE;
+	rc = pppoat_peers_get(&ps, ut_peers_addr(&sin, UT_IP(10, 0, 0, 3), 3),
+			      sizeof sin, now, &peer2);
+	PPPOAT_ASSERT(rc == 0 && peer2 != peer && ut_peers_is_at(peer2, &sin));
+	PPPOAT_ASSERT(pppoat_peers_route(&ps, UT_IP(10, 2, 0, 1)) == NULL);
+	PPPOAT_ASSERT(pppoat_peers_route(&ps, UT_IP(10, 1, 2, 3)) == peer);
+	rc = pppoat_peers_get(&ps, ut_peers_addr(&sin, UT_IP(10, 0, 0, 1), 1),
+			      sizeof sin, now, &peer2);
+	PPPOAT_ASSERT(rc == 0 && peer2 == peer);
+
+	pppoat_peers_fini(&ps);
+}
+
+struct pppoat_ut_group pppoat_tests_peers = {
+	.ug_name = "peers",
+	.ug_tests = {
+		PPPOAT_UT_TEST("replay", ut_peers_replay),
+		PPPOAT_UT_TEST("roam", ut_peers_roam),
+		PPPOAT_UT_TEST("rebind", ut_peers_rebind),
+		PPPOAT_UT_TEST("evict", ut_peers_evict),
+		PPPOAT_UT_TEST_END,
+	},
+};
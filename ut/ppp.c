@@ -0,0 +1,538 @@
+/* ut/ppp.c
+ * PPP over Any Transport -- Unit tests (PPP link negotiation)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "hdlc.h"
+#include "misc.h"
+#include "ppp.h"
+#include "ut/ut.h"
+
+#include <errno.h>
+#include <arpa/inet.h>	/* htonl */
+#include <string.h>	/* memcmp, memcpy */
+
+enum {
+	UT_PPP_QUEUE_LEN = 64,
+	UT_PPP_PKT_SIZE  = 256,
+};
+
+struct ut_ppp_pkt {
+	uint16_t upk_proto;
+	size_t   upk_len;
+	uint8_t  upk_data[UT_PPP_PKT_SIZE];
+};
+
+/** One end of a link, packets which it sends are queued for the remote. */
+struct ut_ppp_end {
+	struct pppoat_ppp  ue_ppp;
+	struct ut_ppp_end *ue_remote;
+	struct ut_ppp_pkt  ue_queue[UT_PPP_QUEUE_LEN];
+	int                ue_queue_nr;
+	/** Drops everything it sends. */
+	bool               ue_mute;
+	int                ue_sent;
+	bool               ue_ip;
+	bool               ue_ipv6;
+	int                ue_downs;
+};
+
+static void ut_ppp_send(struct pppoat_ppp *ppp,
+			uint16_t           proto,
+			const uint8_t     *buf,
+			size_t             len)
+{
+	struct ut_ppp_end *end = ppp->pp_userdata;
+	struct ut_ppp_end *remote = end->ue_remote;
+	struct ut_ppp_pkt *pkt;
+
+	++end->ue_sent;
+	if (end->ue_mute)
+		return;
+
+	PPPOAT_ASSERT(remote->ue_queue_nr < UT_PPP_QUEUE_LEN);
+	PPPOAT_ASSERT(len <= UT_PPP_PKT_SIZE);
+	pkt = &remote->ue_queue[remote->ue_queue_nr++];
+	pkt->upk_proto = proto;
+	pkt->upk_len   = len;
+	memcpy(pkt->upk_data, buf, len);
+}
+
+static void ut_ppp_up(struct pppoat_ppp *ppp, uint16_t proto)
+{
+	struct ut_ppp_end *end = ppp->pp_userdata;
+
+	if (proto == PPPOAT_PPP_PROTO_IP)
+		end->ue_ip = true;
+	if (proto == PPPOAT_PPP_PROTO_IPV6)
+		end->ue_ipv6 = true;
+}
+
+static void ut_ppp_down(struct pppoat_ppp *ppp, uint16_t proto)
+{
+	struct ut_ppp_end *end = ppp->pp_userdata;
+
+	if (proto == PPPOAT_PPP_PROTO_IP)
+		end->ue_ip = false;
+	if (proto == PPPOAT_PPP_PROTO_IPV6)
+		end->ue_ipv6 = false;
+	++end->ue_downs;
+}
+
+static const struct pppoat_ppp_ops ut_ppp_ops = {
+	.ppo_send = &ut_ppp_send,
+	.ppo_up   = &ut_ppp_up,
+	.ppo_down = &ut_ppp_down,
+};
+
+static void ut_ppp_link(struct ut_ppp_end            *a,
+			const struct pppoat_ppp_conf *conf_a,
+			struct ut_ppp_end            *b,
+			const struct pppoat_ppp_conf *conf_b)
+{
+	memset(a, 0, sizeof *a);
+	memset(b, 0, sizeof *b);
+	a->ue_remote = b;
+	b->ue_remote = a;
+	pppoat_ppp_init(&a->ue_ppp, conf_a, &ut_ppp_ops, a);
+	pppoat_ppp_init(&b->ue_ppp, conf_b, &ut_ppp_ops, b);
+}
+
+/** Delivers queued packets until both ends are quiet. */
+static void ut_ppp_pump(struct ut_ppp_end *a,
+			struct ut_ppp_end *b,
+			uint64_t           now)
+{
+	struct ut_ppp_pkt  pkt;
+	struct ut_ppp_end *end;
+	int                i;
+
+	while (a->ue_queue_nr > 0 || b->ue_queue_nr > 0) {
+		end = a->ue_queue_nr > 0 ? a : b;
+		pkt = end->ue_queue[0];
+		--end->ue_queue_nr;
+		for (i = 0; i < end->ue_queue_nr; ++i)
+			end->ue_queue[i] = end->ue_queue[i + 1];
+		pppoat_ppp_input(&end->ue_ppp, pkt.upk_proto, pkt.upk_data,
+				 pkt.upk_len, now);
+	}
+}
+
+static void ut_ppp_negotiate(void)
+{
+	struct pppoat_ppp_conf conf_a = {
+		.ppc_ip_local  = htonl(0x0a000001),
+		.ppc_ip_remote = htonl(0x0a000002),
+		.ppc_ipv6      = true,
+		.ppc_seed      = 1,
+	};
+	struct pppoat_ppp_conf conf_b = {
+		.ppc_ipv6      = true,
+		.ppc_seed      = 2,
+	};
+	struct ut_ppp_end      a;
+	struct ut_ppp_end      b;
+	uint8_t                hdr[PPPOAT_PPP_HDR_MAX];
+	uint8_t                info[] = { 1, 1, 0, 4 };
+	uint32_t               accm;
+	size_t                 len;
+
+	ut_ppp_link(&a, &conf_a, &b, &conf_b);
+	pppoat_ppp_open(&a.ue_ppp, 0);
+	pppoat_ppp_open(&b.ue_ppp, 0);
+	ut_ppp_pump(&a, &b, 0);
+
+	PPPOAT_ASSERT(a.ue_ip && b.ue_ip);
+	PPPOAT_ASSERT(a.ue_ipv6 && b.ue_ipv6);
+	PPPOAT_ASSERT(pppoat_ppp_is_up(&a.ue_ppp, PPPOAT_PPP_PROTO_IP));
+	PPPOAT_ASSERT(pppoat_ppp_is_up(&b.ue_ppp, PPPOAT_PPP_PROTO_IPV6));
+	/* B got its address from A. */
+	PPPOAT_ASSERT(b.ue_ppp.pp_ip_local == htonl(0x0a000002));
+	PPPOAT_ASSERT(b.ue_ppp.pp_ip_remote == htonl(0x0a000001));
+	PPPOAT_ASSERT(a.ue_ppp.pp_ip_remote == htonl(0x0a000002));
+	PPPOAT_ASSERT(memcmp(a.ue_ppp.pp_ifid_local, b.ue_ppp.pp_ifid_remote,
+			     PPPOAT_PPP_IFID_LEN) == 0);
+	PPPOAT_ASSERT(memcmp(b.ue_ppp.pp_ifid_local, a.ue_ppp.pp_ifid_remote,
+			     PPPOAT_PPP_IFID_LEN) == 0);
+	PPPOAT_ASSERT(a.ue_ppp.pp_peer_magic == b.ue_ppp.pp_magic);
+	PPPOAT_ASSERT(pppoat_ppp_mtu(&a.ue_ppp) == PPPOAT_PPP_MRU_DEFAULT);
+
+	/* Data frames are compressed and not escaped. */
+	len = pppoat_ppp_hdr_build(&a.ue_ppp, PPPOAT_PPP_PROTO_IP, NULL, 0,
+				   hdr, &accm);
+	PPPOAT_ASSERT(len == 1 && hdr[0] == 0x21 && accm == 0);
+	len = pppoat_ppp_hdr_build(&a.ue_ppp, PPPOAT_PPP_PROTO_LCP, info,
+				   sizeof info, hdr, &accm);
+	PPPOAT_ASSERT(len == 4 && hdr[0] == 0xff && hdr[3] == 0x21);
+	PPPOAT_ASSERT(accm == PPPOAT_HDLC_ACCM_ALL);
+
+	PPPOAT_ASSERT(pppoat_ppp_timeout(&a.ue_ppp, 0) == -1);
+}
+
+static void ut_ppp_magic(void)
+{
+	struct pppoat_ppp_conf conf_a = {
+		.ppc_ip_local  = htonl(0x0a000001),
+		.ppc_ip_remote = htonl(0x0a000002),
+		.ppc_mru       = 1400,
+		.ppc_seed      = 1,
+	};
+	struct pppoat_ppp_conf conf_b = {
+		.ppc_ip_local  = htonl(0x0a000002),
+		.ppc_ip_remote = htonl(0x0a000001),
+		.ppc_seed      = 2,
+	};
+	struct ut_ppp_end      a;
+	struct ut_ppp_end      b;
+	struct ut_ppp_pkt      pkt;
+	uint32_t               magic;
+	uint32_t               nak;
+
+	ut_ppp_link(&a, &conf_a, &b, &conf_b);
+	pppoat_ppp_open(&a.ue_ppp, 0);
+	magic = a.ue_ppp.pp_magic;
+
+	/* Looped-back Configure-Request carries our own magic number. */
+	PPPOAT_ASSERT(b.ue_queue_nr == 1);
+	pkt = b.ue_queue[0];
+	b.ue_queue_nr = 0;
+	pppoat_ppp_input(&a.ue_ppp, pkt.upk_proto, pkt.upk_data, pkt.upk_len,
+			 0);
+	PPPOAT_ASSERT(b.ue_queue_nr == 1);
+	pkt = b.ue_queue[0];
+	PPPOAT_ASSERT(pkt.upk_len == 10);
+	PPPOAT_ASSERT(pkt.upk_data[0] == 3 && pkt.upk_data[4] == 5);
+	nak = (uint32_t)pkt.upk_data[6] << 24 | pkt.upk_data[7] << 16 |
+	      pkt.upk_data[8] << 8 | pkt.upk_data[9];
+	PPPOAT_ASSERT(nak != magic);
+	PPPOAT_ASSERT(a.ue_ppp.pp_magic != magic);
+	b.ue_queue_nr = 0;
+
+	/* The lost request is retransmitted with the new magic number. */
+	pppoat_ppp_open(&b.ue_ppp, 0);
+	(void)pppoat_ppp_timeout(&a.ue_ppp, 3000);
+	ut_ppp_pump(&a, &b, 3000);
+	PPPOAT_ASSERT(a.ue_ip && b.ue_ip);
+	PPPOAT_ASSERT(!a.ue_ipv6 && !b.ue_ipv6);
+	PPPOAT_ASSERT(a.ue_ppp.pp_peer_magic == b.ue_ppp.pp_magic);
+	PPPOAT_ASSERT(b.ue_ppp.pp_peer_magic == a.ue_ppp.pp_magic);
+	/* A receives up to 1400 bytes, B sends up to 1400. */
+	PPPOAT_ASSERT(pppoat_ppp_mtu(&b.ue_ppp) == 1400);
+	PPPOAT_ASSERT(pppoat_ppp_mtu(&a.ue_ppp) == PPPOAT_PPP_MRU_DEFAULT);
+}
+
+static void ut_ppp_timeout(void)
+{
+	struct pppoat_ppp_conf conf_a = { .ppc_seed = 1 };
+	struct pppoat_ppp_conf conf_b = {
+		.ppc_ip_local  = htonl(0x0a000001),
+		.ppc_ip_remote = htonl(0x0a000002),
+		.ppc_seed      = 2,
+	};
+	struct ut_ppp_end      a;
+	struct ut_ppp_end      b;
+	uint64_t               now = 0;
+	int64_t                ms;
+	int                    sent;
+
+	ut_ppp_link(&a, &conf_a, &b, &conf_b);
+	a.ue_mute = true;
+	pppoat_ppp_open(&a.ue_ppp, now);
+	PPPOAT_ASSERT(a.ue_sent == 1);
+
+	/* Configure-Requests are retransmitted until max-configure. */
+	while (a.ue_ppp.pp_fsm[PPPOAT_PPP_LCP].pf_state !=
+	       PPPOAT_PPP_STOPPED) {
+		ms = pppoat_ppp_timeout(&a.ue_ppp, now);
+		PPPOAT_ASSERT(ms > 0);
+		now += ms;
+		PPPOAT_ASSERT(now < 60000);
+	}
+	PPPOAT_ASSERT(a.ue_sent == 10);
+
+	/* The link is reopened after hold-off. */
+	ms = pppoat_ppp_timeout(&a.ue_ppp, now);
+	PPPOAT_ASSERT(ms > 0);
+	sent = a.ue_sent;
+	now += ms;
+	(void)pppoat_ppp_timeout(&a.ue_ppp, now);
+	PPPOAT_ASSERT(a.ue_sent == sent + 1);
+
+	/* The peer appears, the muted request is retransmitted. */
+	a.ue_mute = false;
+	pppoat_ppp_open(&b.ue_ppp, now);
+	ut_ppp_pump(&a, &b, now);
+	PPPOAT_ASSERT(!a.ue_ip && !b.ue_ip);
+	now += pppoat_ppp_timeout(&a.ue_ppp, now);
+	(void)pppoat_ppp_timeout(&a.ue_ppp, now);
+	ut_ppp_pump(&a, &b, now);
+	PPPOAT_ASSERT(a.ue_ip && b.ue_ip);
+	PPPOAT_ASSERT(a.ue_ppp.pp_ip_local == htonl(0x0a000002));
+}
+
+static void ut_ppp_reject(void)
+{
+	struct pppoat_ppp_conf conf_a = {
+		.ppc_ip_local  = htonl(0x0a000001),
+		.ppc_ip_remote = htonl(0x0a000002),
+		.ppc_ipv6      = true,
+		.ppc_seed      = 1,
+	};
+	struct pppoat_ppp_conf conf_b = { .ppc_seed = 2 };
+	struct ut_ppp_end      a;
+	struct ut_ppp_end      b;
+	struct ut_ppp_pkt     *pkt;
+	static const uint8_t   echo[] = { 9, 7, 0, 10, 0, 0, 0, 0, 'h', 'i' };
+	static const uint8_t   unknown[] = { 0x45, 0x00 };
+
+	/* B doesn't run IPV6CP and rejects the protocol. */
+	ut_ppp_link(&a, &conf_a, &b, &conf_b);
+	pppoat_ppp_open(&a.ue_ppp, 0);
+	pppoat_ppp_open(&b.ue_ppp, 0);
+	ut_ppp_pump(&a, &b, 0);
+	PPPOAT_ASSERT(a.ue_ip && b.ue_ip);
+	PPPOAT_ASSERT(!a.ue_ipv6);
+	PPPOAT_ASSERT(a.ue_ppp.pp_fsm[PPPOAT_PPP_IPV6CP].pf_state ==
+		      PPPOAT_PPP_STOPPED);
+
+	pppoat_ppp_input(&b.ue_ppp, PPPOAT_PPP_PROTO_LCP, echo, sizeof echo, 0);
+	PPPOAT_ASSERT(a.ue_queue_nr == 1);
+	pkt = &a.ue_queue[0];
+	PPPOAT_ASSERT(pkt->upk_proto == PPPOAT_PPP_PROTO_LCP);
+	PPPOAT_ASSERT(pkt->upk_len == sizeof echo);
+	PPPOAT_ASSERT(pkt->upk_data[0] == 10 && pkt->upk_data[1] == 7);
+	PPPOAT_ASSERT(memcmp(pkt->upk_data + 8, "hi", 2) == 0);
+	a.ue_queue_nr = 0;
+
+	pppoat_ppp_input(&b.ue_ppp, 0x0041, unknown, sizeof unknown, 0);
+	PPPOAT_ASSERT(a.ue_queue_nr == 1);
+	pkt = &a.ue_queue[0];
+	PPPOAT_ASSERT(pkt->upk_data[0] == 8);
+	PPPOAT_ASSERT(pkt->upk_data[4] == 0x00 && pkt->upk_data[5] == 0x41);
+	PPPOAT_ASSERT(pkt->upk_len == 6 + sizeof unknown);
+	ut_ppp_pump(&a, &b, 0);
+	PPPOAT_ASSERT(a.ue_ip && b.ue_ip);
+}
+
+static void ut_ppp_close(void)
+{
+	struct pppoat_ppp_conf conf_a = {
+		.ppc_ip_local  = htonl(0x0a000001),
+		.ppc_ip_remote = htonl(0x0a000002),
+		.ppc_seed      = 1,
+	};
+	struct pppoat_ppp_conf conf_b = { .ppc_seed = 2 };
+	struct ut_ppp_end      a;
+	struct ut_ppp_end      b;
+
+	ut_ppp_link(&a, &conf_a, &b, &conf_b);
+	pppoat_ppp_open(&a.ue_ppp, 0);
+	pppoat_ppp_open(&b.ue_ppp, 0);
+	ut_ppp_pump(&a, &b, 0);
+	PPPOAT_ASSERT(a.ue_ip && b.ue_ip);
+
+	pppoat_ppp_close(&a.ue_ppp, 100);
+	ut_ppp_pump(&a, &b, 100);
+	PPPOAT_ASSERT(!a.ue_ip && !b.ue_ip);
+	PPPOAT_ASSERT(a.ue_downs == 1 && b.ue_downs == 1);
+	PPPOAT_ASSERT(a.ue_ppp.pp_fsm[PPPOAT_PPP_LCP].pf_state ==
+		      PPPOAT_PPP_CLOSED);
+	/* Closed link isn't reopened. */
+	PPPOAT_ASSERT(pppoat_ppp_timeout(&a.ue_ppp, 100) == -1);
+}
+
+static void ut_ppp_hdr(void)
+{
+	static const struct {
+		uint8_t  frame[4];
+		size_t   len;
+		int      rc;
+		uint16_t proto;
+	} cases[] = {
+		{ { 0xff, 0x03, 0xc0, 0x21 }, 4, 4, PPPOAT_PPP_PROTO_LCP },
+		{ { 0xff, 0x03, 0x00, 0x21 }, 4, 4, PPPOAT_PPP_PROTO_IP },
+		{ { 0xff, 0x03, 0x57 }, 3, 3, PPPOAT_PPP_PROTO_IPV6 },
+		{ { 0x00, 0x21 }, 2, 2, PPPOAT_PPP_PROTO_IP },
+		{ { 0x21 }, 1, 1, PPPOAT_PPP_PROTO_IP },
+		{ { 0xff, 0x03, 0x00, 0x20 }, 4, -EINVAL, 0 },
+		{ { 0xff, 0x03 }, 2, -EINVAL, 0 },
+		{ { 0x00 }, 0, -EINVAL, 0 },
+	};
+	uint16_t proto;
+	size_t   i;
+	int      rc;
+
+	for (i = 0; i < ARRAY_SIZE(cases); ++i) {
+		proto = 0;
+		rc = pppoat_ppp_hdr_parse(cases[i].frame, cases[i].len, &proto);
+		PPPOAT_ASSERT_INFO(rc == cases[i].rc, "case=%zu rc=%d", i, rc);
+		PPPOAT_ASSERT(proto == cases[i].proto);
+	}
+}
+
+/*
+ * Frames of pppd 2.4 started with `noauth noipdefault' on an async line,
+ * after HDLC decoding and without FCS. pppd requests ACCM, Magic-Number,
+ * PFC and ACFC, then asks for VJ compression and an address from us.
+ */
+static const uint8_t ut_pppd_lcp_req[] = {
+	0xff, 0x03, 0xc0, 0x21, 0x01, 0x01, 0x00, 0x14,
+	0x02, 0x06, 0x00, 0x00, 0x00, 0x00, 0x05, 0x06,
+	0x5e, 0x63, 0x0a, 0xb8, 0x07, 0x02, 0x08, 0x02,
+};
+static const uint8_t ut_pppd_ipcp_req_vj[] = {
+	0x80, 0x21, 0x01, 0x01, 0x00, 0x10, 0x02, 0x06,
+	0x00, 0x2d, 0x0f, 0x01, 0x03, 0x06, 0x00, 0x00,
+	0x00, 0x00,
+};
+static const uint8_t ut_pppd_ipcp_req_zero[] = {
+	0x80, 0x21, 0x01, 0x02, 0x00, 0x0a, 0x03, 0x06,
+	0x00, 0x00, 0x00, 0x00,
+};
+static const uint8_t ut_pppd_ipcp_req_addr[] = {
+	0x80, 0x21, 0x01, 0x03, 0x00, 0x0a, 0x03, 0x06,
+	0x0a, 0x00, 0x00, 0x02,
+};
+
+/* Responses which pppd expects. */
+static const uint8_t ut_pppd_lcp_ack[] = {
+	0x02, 0x01, 0x00, 0x14, 0x02, 0x06, 0x00, 0x00,
+	0x00, 0x00, 0x05, 0x06, 0x5e, 0x63, 0x0a, 0xb8,
+	0x07, 0x02, 0x08, 0x02,
+};
+static const uint8_t ut_pppd_ipcp_rej[] = {
+	0x04, 0x01, 0x00, 0x0a, 0x02, 0x06, 0x00, 0x2d,
+	0x0f, 0x01,
+};
+static const uint8_t ut_pppd_ipcp_nak[] = {
+	0x03, 0x02, 0x00, 0x0a, 0x03, 0x06, 0x0a, 0x00,
+	0x00, 0x02,
+};
+static const uint8_t ut_pppd_ipcp_ack[] = {
+	0x02, 0x03, 0x00, 0x0a, 0x03, 0x06, 0x0a, 0x00,
+	0x00, 0x02,
+};
+
+/** Passes a frame of pppd to the end. */
+static void ut_ppp_pppd_input(struct ut_ppp_end *end,
+			      const uint8_t     *frame,
+			      size_t             len)
+{
+	uint16_t proto;
+	int      rc;
+
+	rc = pppoat_ppp_hdr_parse(frame, len, &proto);
+	PPPOAT_ASSERT(rc > 0);
+	pppoat_ppp_input(&end->ue_ppp, proto, frame + rc, len - rc, 0);
+}
+
+/** Takes the only packet which the end has sent to pppd. */
+static struct ut_ppp_pkt ut_ppp_pppd_output(struct ut_ppp_end *pppd)
+{
+	PPPOAT_ASSERT_INFO(pppd->ue_queue_nr == 1, "nr=%d",
+			   pppd->ue_queue_nr);
+	pppd->ue_queue_nr = 0;
+	return pppd->ue_queue[0];
+}
+
+static void ut_ppp_pppd_expect(struct ut_ppp_end *pppd,
+			       uint16_t           proto,
+			       const uint8_t     *buf,
+			       size_t             len)
+{
+	struct ut_ppp_pkt pkt = ut_ppp_pppd_output(pppd);
+
+	PPPOAT_ASSERT(pkt.upk_proto == proto);
+	PPPOAT_ASSERT(pkt.upk_len == len);
+	PPPOAT_ASSERT(memcmp(pkt.upk_data, buf, len) == 0);
+}
+
+/** Acks our Configure-Request the way pppd does: with the same options. */
+static void ut_ppp_pppd_ack(struct ut_ppp_end *end, struct ut_ppp_pkt *req)
+{
+	PPPOAT_ASSERT(req->upk_len >= 4 && req->upk_data[0] == 1);
+	PPPOAT_ASSERT(((size_t)req->upk_data[2] << 8 | req->upk_data[3]) ==
+		      req->upk_len);
+	req->upk_data[0] = 2;
+	pppoat_ppp_input(&end->ue_ppp, req->upk_proto, req->upk_data,
+			 req->upk_len, 0);
+}
+
+static void ut_ppp_pppd(void)
+{
+	struct pppoat_ppp_conf conf = {
+		.ppc_ip_local  = htonl(0x0a000001),
+		.ppc_ip_remote = htonl(0x0a000002),
+		.ppc_seed      = 1,
+	};
+	struct pppoat_ppp_conf conf_pppd = { .ppc_seed = 2 };
+	struct ut_ppp_end      a;
+	struct ut_ppp_end      pppd;
+	struct ut_ppp_pkt      req;
+
+	/* The second end is never opened, it collects what pppd receives. */
+	ut_ppp_link(&a, &conf, &pppd, &conf_pppd);
+	pppoat_ppp_open(&a.ue_ppp, 0);
+	req = ut_ppp_pppd_output(&pppd);
+	PPPOAT_ASSERT(req.upk_proto == PPPOAT_PPP_PROTO_LCP);
+
+	ut_ppp_pppd_input(&a, ut_pppd_lcp_req, sizeof ut_pppd_lcp_req);
+	ut_ppp_pppd_expect(&pppd, PPPOAT_PPP_PROTO_LCP, ut_pppd_lcp_ack,
+			   sizeof ut_pppd_lcp_ack);
+	ut_ppp_pppd_ack(&a, &req);
+	PPPOAT_ASSERT(a.ue_ppp.pp_peer_magic == 0x5e630ab8);
+	PPPOAT_ASSERT(a.ue_ppp.pp_tx_accm == 0);
+	PPPOAT_ASSERT(a.ue_ppp.pp_tx_pfc && a.ue_ppp.pp_tx_acfc);
+
+	/* LCP is opened and IPCP starts. */
+	req = ut_ppp_pppd_output(&pppd);
+	PPPOAT_ASSERT(req.upk_proto == PPPOAT_PPP_PROTO_IPCP);
+
+	ut_ppp_pppd_input(&a, ut_pppd_ipcp_req_vj, sizeof ut_pppd_ipcp_req_vj);
+	ut_ppp_pppd_expect(&pppd, PPPOAT_PPP_PROTO_IPCP, ut_pppd_ipcp_rej,
+			   sizeof ut_pppd_ipcp_rej);
+	ut_ppp_pppd_input(&a, ut_pppd_ipcp_req_zero,
+			  sizeof ut_pppd_ipcp_req_zero);
+	ut_ppp_pppd_expect(&pppd, PPPOAT_PPP_PROTO_IPCP, ut_pppd_ipcp_nak,
+			   sizeof ut_pppd_ipcp_nak);
+	ut_ppp_pppd_input(&a, ut_pppd_ipcp_req_addr,
+			  sizeof ut_pppd_ipcp_req_addr);
+	ut_ppp_pppd_expect(&pppd, PPPOAT_PPP_PROTO_IPCP, ut_pppd_ipcp_ack,
+			   sizeof ut_pppd_ipcp_ack);
+	PPPOAT_ASSERT(!a.ue_ip);
+
+	ut_ppp_pppd_ack(&a, &req);
+	PPPOAT_ASSERT(a.ue_ip);
+	PPPOAT_ASSERT(a.ue_ppp.pp_ip_remote == htonl(0x0a000002));
+	PPPOAT_ASSERT(pppoat_ppp_timeout(&a.ue_ppp, 0) == -1);
+}
+
+struct pppoat_ut_group pppoat_tests_ppp = {
+	.ug_name = "ppp",
+	.ug_tests = {
+		PPPOAT_UT_TEST("negotiate", ut_ppp_negotiate),
+		PPPOAT_UT_TEST("magic", ut_ppp_magic),
+		PPPOAT_UT_TEST("timeout", ut_ppp_timeout),
+		PPPOAT_UT_TEST("reject", ut_ppp_reject),
+		PPPOAT_UT_TEST("close", ut_ppp_close),
+		PPPOAT_UT_TEST("hdr", ut_ppp_hdr),
+		PPPOAT_UT_TEST("pppd", ut_ppp_pppd),
+		PPPOAT_UT_TEST_END,
+	},
+};
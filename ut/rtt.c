@@ -0,0 +1,147 @@
+/* rtt.c
+ * PPP over Any Transport -- Unit tests
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "rtt.h"
+#include "ut/ut.h"
+
+#include <errno.h>
+
+static void ut_rtt_srtt(void)
+{
+	struct pppoat_rtt       rtt;
+	struct pppoat_rtt_stats s;
+	int                     rc;
+	int                     i;
+
+	pppoat_rtt_init(&rtt);
+	rc = pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(rc == -ENOENT);
+
+	for (i = 0; i < 100; ++i)
+		pppoat_rtt_sample(&rtt, 1000);
+	rc = pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(s.rs_samples == 100);
+	PPPOAT_ASSERT(s.rs_srtt == 1000);
+	PPPOAT_ASSERT(s.rs_min == 1000);
+	PPPOAT_ASSERT(s.rs_rttvar < 10);
+	PPPOAT_ASSERT(s.rs_jitter == 0);
+
+	for (i = 0; i < 50; ++i)
+		pppoat_rtt_sample(&rtt, 2000);
+	rc = pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(s.rs_srtt > 1900 && s.rs_srtt <= 2000);
+	PPPOAT_ASSERT(s.rs_min == 1000);
+	PPPOAT_ASSERT(s.rs_last == 2000);
+	PPPOAT_ASSERT(s.rs_jitter > 0);
+
+	pppoat_rtt_fini(&rtt);
+}
+
+static void ut_rtt_owd(void)
+{
+	struct pppoat_rtt       rtt;
+	struct pppoat_rtt_stats s;
+	uint64_t                offset = 5000000000ULL;
+	uint64_t                tx;
+	int                     rc;
+	int                     i;
+
+	pppoat_rtt_init(&rtt);
+	/* Remote clock is behind, so raw one-way delay is negative. */
+	for (i = 0, tx = offset; i < 20; ++i, tx += 10000) {
+		pppoat_rtt_owd_sample(&rtt, tx, tx - offset + 100);
+		pppoat_rtt_sample(&rtt, 200);
+	}
+	rc = pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(s.rs_owd == 0);
+	PPPOAT_ASSERT(s.rs_jitter == 0);
+
+	/* Alternating queueing delay. */
+	for (i = 0; i < 100; ++i, tx += 10000)
+		pppoat_rtt_owd_sample(&rtt, tx, tx - offset + 100 +
+					       (i % 2 == 0 ? 400 : 0));
+	rc = pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(s.rs_owd == 0);
+	PPPOAT_ASSERT(s.rs_jitter > 300 && s.rs_jitter <= 400);
+	pppoat_rtt_owd_sample(&rtt, tx, tx - offset + 350);
+	rc = pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(s.rs_owd == 250);
+
+	pppoat_rtt_fini(&rtt);
+}
+
+static void ut_rtt_loss(void)
+{
+	struct pppoat_rtt       rtt;
+	struct pppoat_rtt_stats s;
+	int                     i;
+
+	pppoat_rtt_init(&rtt);
+	pppoat_rtt_sample(&rtt, 1000);
+	for (i = 0; i < 1000; ++i)
+		pppoat_rtt_loss_sample(&rtt, i % 10 == 0);
+	(void)pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(s.rs_lost == 100);
+	/* 10% with EWMA noise. */
+	PPPOAT_ASSERT(s.rs_loss > 50000 && s.rs_loss < 200000);
+
+	for (i = 0; i < 200; ++i)
+		pppoat_rtt_loss_sample(&rtt, false);
+	(void)pppoat_rtt_get(&rtt, &s);
+	PPPOAT_ASSERT(s.rs_loss < 100);
+	PPPOAT_ASSERT(s.rs_lost == 100);
+
+	pppoat_rtt_fini(&rtt);
+}
+
+static void ut_rtt_backoff(void)
+{
+	const uint64_t max = 60 * 1000 * 1000;
+
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 0, max) == 200000);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 1, max) == 400000);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 8, max) == 51200000);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 9, max) == max);
+	/* A shift by that much would overflow. */
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 63, max) == max);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 64, max) == max);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 255, max) == max);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(200000, 255, UINT64_MAX) ==
+		      UINT64_MAX);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(2 * max, 1, max) == max);
+	PPPOAT_ASSERT(pppoat_rtt_backoff(0, 255, max) == 0);
+}
+
+struct pppoat_ut_group pppoat_tests_rtt = {
+	.ug_name = "rtt",
+	.ug_tests = {
+		PPPOAT_UT_TEST("srtt", ut_rtt_srtt),
+		PPPOAT_UT_TEST("owd", ut_rtt_owd),
+		PPPOAT_UT_TEST("loss", ut_rtt_loss),
+		PPPOAT_UT_TEST("backoff", ut_rtt_backoff),
+		PPPOAT_UT_TEST_END,
+	},
+};
@@ -0,0 +1,87 @@
+/* siphash.c
+ * PPP over Any Transport -- Unit tests
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "misc.h"	/* ARRAY_SIZE */
+#include "siphash.h"
+#include "ut/ut.h"
+
+struct ut_siphash_test {
+	size_t   ust_len;
+	uint64_t ust_hash;
+};
+
+/*
+ * Vectors from the reference implementation: key is 00 01 .. 0f and message
+ * of length N is 00 01 .. (N-1).
+ */
+static const struct ut_siphash_test ut_siphash_ref_vector[] = {
+	{ .ust_len = 0,  .ust_hash = 0x726fdb47dd0e0e31ULL },
+	{ .ust_len = 1,  .ust_hash = 0x74f839c593dc67fdULL },
+	{ .ust_len = 7,  .ust_hash = 0xab0200f58b01d137ULL },
+	{ .ust_len = 8,  .ust_hash = 0x93f5f5799a932462ULL },
+	{ .ust_len = 15, .ust_hash = 0xa129ca6149be45e5ULL },
+	{ .ust_len = 63, .ust_hash = 0x958a324ceb064572ULL },
+};
+
+static void ut_siphash_reference(void)
+{
+	struct pppoat_siphash_key key;
+	unsigned char             kbuf[PPPOAT_SIPHASH_KEY_LEN];
+	unsigned char             msg[64];
+	size_t                    i;
+
+	for (i = 0; i < sizeof kbuf; ++i)
+		kbuf[i] = (unsigned char)i;
+	for (i = 0; i < sizeof msg; ++i)
+		msg[i] = (unsigned char)i;
+	pppoat_siphash_key_set(&key, kbuf);
+
+	for (i = 0; i < ARRAY_SIZE(ut_siphash_ref_vector); ++i) {
+		PPPOAT_ASSERT(pppoat_siphash(&key, msg,
+					     ut_siphash_ref_vector[i].ust_len) ==
+			      ut_siphash_ref_vector[i].ust_hash);
+	}
+}
+
+static void ut_siphash_derive(void)
+{
+	struct pppoat_siphash_key key1;
+	struct pppoat_siphash_key key2;
+	struct pppoat_siphash_key key3;
+
+	pppoat_siphash_key_derive(&key1, "secret");
+	pppoat_siphash_key_derive(&key2, "secret");
+	pppoat_siphash_key_derive(&key3, "secret2");
+
+	PPPOAT_ASSERT(key1.sk_k0 == key2.sk_k0 && key1.sk_k1 == key2.sk_k1);
+	PPPOAT_ASSERT(key1.sk_k0 != key3.sk_k0 || key1.sk_k1 != key3.sk_k1);
+	PPPOAT_ASSERT(pppoat_siphash(&key1, "data", 4) !=
+		      pppoat_siphash(&key3, "data", 4));
+}
+
+struct pppoat_ut_group pppoat_tests_siphash = {
+	.ug_name = "siphash",
+	.ug_tests = {
+		PPPOAT_UT_TEST("reference", ut_siphash_reference),
+		PPPOAT_UT_TEST("derive", ut_siphash_derive),
+		PPPOAT_UT_TEST_END,
+	},
+};
@@ -0,0 +1,135 @@
+/* ut/splice.c
+ * PPP over Any Transport -- Unit tests (Zero-copy writes to pipes)
+ *
+ * Copyright (C) 2012-2019 Dmitry Podgorny <pasis.ua@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "packet.h"
+#include "splice.h"
+#include "ut/ut.h"
+
+#include <errno.h>
+#include <string.h>	/* memset, memcmp */
+#include <sys/socket.h>	/* socketpair */
+#include <unistd.h>	/* pipe, read, close */
+
+enum {
+	UT_SPLICE_SIZE = 1000,
+	UT_SPLICE_NR   = 3,
+};
+
+static struct pppoat_packet *ut_splice_pkt(struct pppoat_packets *pkts,
+					   int                    i)
+{
+	struct pppoat_packet *pkt;
+
+	pkt = pppoat_packet_get(pkts, UT_SPLICE_SIZE);
+	PPPOAT_ASSERT(pkt != NULL);
+	memset(pkt->pkt_data, 'a' + i, UT_SPLICE_SIZE);
+
+	return pkt;
+}
+
+static void ut_splice_read_check(int fd, int i)
+{
+	char    buf[UT_SPLICE_SIZE];
+	char    exp[UT_SPLICE_SIZE];
+	ssize_t rlen;
+	size_t  len;
+
+	for (len = 0; len < sizeof buf; len += (size_t)rlen) {
+		rlen = read(fd, buf + len, sizeof buf - len);
+		PPPOAT_ASSERT(rlen > 0);
+	}
+	memset(exp, 'a' + i, sizeof exp);
+	PPPOAT_ASSERT(memcmp(buf, exp, sizeof buf) == 0);
+}
+
+static void ut_splice_write(void)
+{
+	struct pppoat_packets pkts;
+	struct pppoat_splice  sp;
+	struct pppoat_packet *pkt;
+	int                   fds[2];
+	int                   i;
+	int                   rc;
+
+	rc = pppoat_packets_init(&pkts);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pipe(fds);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_splice_init(&sp, fds[1], &pkts);
+	if (rc == -ENOTSUP)
+		goto out;
+	PPPOAT_ASSERT(rc == 0);
+
+	for (i = 0; i < UT_SPLICE_NR; ++i) {
+		rc = pppoat_splice_write(&sp, ut_splice_pkt(&pkts, i));
+		PPPOAT_ASSERT(rc == 0);
+	}
+	PPPOAT_ASSERT(pppoat_list_count(&sp.sp_pinned) == UT_SPLICE_NR);
+
+	/* Packets are pinned until the reader consumes them completely. */
+	ut_splice_read_check(fds[0], 0);
+	pkt = ut_splice_pkt(&pkts, UT_SPLICE_NR);
+	rc = pppoat_splice_write(&sp, pkt);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(pppoat_list_count(&sp.sp_pinned) == UT_SPLICE_NR);
+	PPPOAT_ASSERT(pppoat_list_head(&sp.sp_pinned) != pkt);
+
+	for (i = 1; i <= UT_SPLICE_NR; ++i)
+		ut_splice_read_check(fds[0], i);
+	pkt = ut_splice_pkt(&pkts, 0);
+	rc = pppoat_splice_write(&sp, pkt);
+	PPPOAT_ASSERT(rc == 0);
+	PPPOAT_ASSERT(pppoat_list_count(&sp.sp_pinned) == 1);
+	ut_splice_read_check(fds[0], 0);
+
+	pppoat_splice_fini(&sp);
+out:
+	(void)close(fds[0]);
+	(void)close(fds[1]);
+	pppoat_packets_fini(&pkts);
+}
+
+static void ut_splice_not_pipe(void)
+{
+	struct pppoat_packets pkts;
+	struct pppoat_splice  sp;
+	int                   fds[2];
+	int                   rc;
+
+	rc = pppoat_packets_init(&pkts);
+	PPPOAT_ASSERT(rc == 0);
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	PPPOAT_ASSERT(rc == 0);
+	rc = pppoat_splice_init(&sp, fds[1], &pkts);
+	PPPOAT_ASSERT(rc == -ENOTSUP);
+	(void)close(fds[0]);
+	(void)close(fds[1]);
+	pppoat_packets_fini(&pkts);
+}
+
+struct pppoat_ut_group pppoat_tests_splice = {
+	.ug_name = "splice",
+	.ug_tests = {
+		PPPOAT_UT_TEST("write", ut_splice_write),
+		PPPOAT_UT_TEST("not-pipe", ut_splice_not_pipe),
+		PPPOAT_UT_TEST_END,
+	},
+};